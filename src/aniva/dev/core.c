@@ -1,16 +1,20 @@
 #include "core.h"
 #include "dev/driver.h"
+#include "entry/bootprof.h"
 #include "driver.h"
 #include "libk/data/linkedlist.h"
+#include "libk/data/queue.h"
 #include "libk/flow/error.h"
 #include "logging/log.h"
 #include "mem/zalloc/zalloc.h"
 #include "oss/core.h"
 #include "oss/obj.h"
 #include "proc/core.h"
+#include "proc/proc.h"
 #include "proc/thread.h"
 #include "sched/scheduler.h"
 #include "sync/mutex.h"
+#include "sync/sem.h"
 #include "system/processor/processor.h"
 #include <entry/entry.h>
 #include <mem/heap.h>
@@ -109,7 +113,13 @@ static dev_constraint_t __dev_constraints[DRIVER_TYPE_COUNT] = {
 
 static list_t* __deferred_driver_drivers;
 
-static bool __load_precompiled_driver(driver_t* driver)
+/*!
+ * @brief: Add a precompiled driver to the batch of drivers we're about to load
+ *
+ * Nothing gets loaded here. The batch is loaded in one go by __load_precompiled_drivers, so
+ * drivers that don't depend on each other can be initialized at the same time
+ */
+static bool __gather_precompiled_driver(driver_t* driver, list_t* batch)
 {
     if (!driver)
         return false;
@@ -124,11 +134,7 @@ static bool __load_precompiled_driver(driver_t* driver)
 
     driver_gather_dependencies(driver);
 
-    /*
-     * NOTE: this fails if the driver is already loaded, but we ignore this
-     * since we also load drivers preemptively if they are needed as a dependency
-     */
-    load_driver(driver);
+    list_append(batch, driver);
 
     return true;
 }
@@ -143,7 +149,34 @@ static bool walk_precompiled_drivers_to_load(oss_node_t* node, oss_obj_t* data,
 
     driver = oss_obj_unwrap(data, driver_t);
 
-    return __load_precompiled_driver(driver);
+    return __gather_precompiled_driver(driver, arg);
+}
+
+static void __load_precompiled_drivers(list_t* batch)
+{
+    u32 idx;
+    driver_t** drivers;
+
+    if (!batch->m_length)
+        return;
+
+    drivers = kmalloc(batch->m_length * sizeof(*drivers));
+
+    if (!drivers)
+        return;
+
+    idx = 0;
+
+    FOREACH(i, batch)
+    drivers[idx++] = i->data;
+
+    /*
+     * NOTE: this fails if any driver fails to load, but we ignore this
+     * since a single broken driver should not take the others down with it
+     */
+    (void)load_drivers(drivers, idx);
+
+    kfree(drivers);
 }
 
 driver_t* allocate_ddriver()
@@ -287,6 +320,51 @@ static void __driver_unregister_presence(enum DRIVER_TYPE type)
     mutex_unlock(__driver_constraint_lock);
 }
 
+/*
+ * Driver init executor
+ *
+ * Loading drivers used to happen one at a time, where every driver first loaded its own dependencies
+ * recursively. Now we gather every driver that needs loading (including any dependency that isn't loaded
+ * yet) into a graph, where every driver waits on the dependencies it has in that same graph. Once all
+ * of its dependencies are done, the f_init of a driver gets run on one of the driver init workers. This
+ * way drivers that don't depend on each other get initialized concurrently.
+ *
+ * The thread that asked for the load runs nodes of its own graph as well. Drivers may load other drivers
+ * from their f_init, so we can't depend on there being an idle worker.
+ */
+#define DRIVER_INIT_NR_WORKERS 3
+
+typedef struct drv_init_node {
+    driver_t* driver;
+    /* Number of dependencies of this driver in the graph that did not finish yet */
+    u32 nr_pending;
+    /* Set while we're still adding the dependencies of this node */
+    bool visiting;
+    /* Either this driver or one of its dependencies failed. Don't bother initializing it */
+    bool failed;
+    kerror_t error;
+    /* Drivers we optionally depend on, that we don't wait for since they close a cycle through us */
+    list_t* cut_deps;
+    struct drv_init_graph* graph;
+} drv_init_node_t;
+
+typedef struct drv_init_graph {
+    list_t* nodes;
+    /* Nodes that have all their dependencies loaded */
+    queue_t* ready;
+    u32 nr_left;
+    /* Posted when a node in this graph becomes ready, or when the last node is done */
+    struct semaphore* wake;
+} drv_init_graph_t;
+
+/* Protects the init graphs and every node in them */
+static mutex_t* __driver_init_lock;
+/* Graphs that are currently being executed */
+static list_t* __driver_init_graphs;
+/* Posted for every node that becomes ready */
+static struct semaphore* __driver_init_sem;
+static bool __driver_init_has_workers;
+
 /*
  * Steps to load a driver into our registry
  * 1: Resolve the url in the driver
@@ -294,21 +372,136 @@ static void __driver_unregister_presence(enum DRIVER_TYPE type)
  * 3: emplace the driver into the drivertree
  * 4: run driver bootstraps
  *
+ * Step 1 through 3 are done by __driver_init_graph_add, step 4 by __driver_do_load
  * We also might want to create a kernel-process for each driver
  * TODO: better security
  */
-kerror_t load_driver(driver_t* driver)
+static kerror_t __driver_do_load(driver_t* driver)
 {
+    u64 start;
     kerror_t error;
     aniva_driver_t* handle;
 
+    /*
+     * A driver can be part of multiple graphs that run at the same time. Whoever comes in second
+     * waits here until the first is done, and then finds it loaded
+     */
+    mutex_lock(driver->m_load_lock);
+
+    /* Someone might have pulled this driver in from their own f_init already */
+    if (is_driver_loaded(driver)) {
+        mutex_unlock(driver->m_load_lock);
+        return 0;
+    }
+
+    handle = driver->m_handle;
+
+    start = read_tsc();
+
+    error = bootstrap_driver(driver);
+
+    bootprof_record(handle->m_name, start);
+
+    /* If the driver says something went wrong, trust that */
+    if (error || (driver->m_flags & DRV_FAILED)) {
+        unload_driver(driver->m_url);
+        mutex_unlock(driver->m_load_lock);
+        return -1;
+    }
+
+    __driver_register_presence(handle->m_type);
+
+    /*
+     * TODO: we need to detect when we want to apply the 'activity' and 'precedence' mechanisms
+     * since we always load a bunch of graphics drivers at startup. We need to select one once all the devices should be set up
+     * and then remove all the unused drivers once they are gracefully exited
+     *
+     * Maybe we simply do what linux drm does and have drivers mark themselves as the 'active' driver by removing any lingering
+     * apperature...
+     *
+     */
+    //__driver_register_active(handle->m_type, driver);
+
+    driver->m_flags |= DRV_LOADED;
+
+    mutex_unlock(driver->m_load_lock);
+    return (0);
+}
+
+static drv_init_node_t* __driver_init_graph_get_node(drv_init_graph_t* graph, driver_t* driver)
+{
+    drv_init_node_t* node;
+
+    FOREACH(i, graph->nodes)
+    {
+        node = i->data;
+
+        if (node->driver == driver)
+            return node;
+    }
+
+    return nullptr;
+}
+
+static bool __driver_init_node_is_cut(drv_init_node_t* node, driver_t* driver)
+{
+    u32 idx;
+
+    if (!node->cut_deps)
+        return false;
+
+    return (list_indexof(node->cut_deps, &idx, driver) == 0);
+}
+
+/*!
+ * @brief: Stop @node from waiting on @driver
+ *
+ * @returns: 0 on success, -1 if we ran out of memory
+ */
+static int __driver_init_node_cut_dep(drv_init_node_t* node, driver_t* driver)
+{
+    if (__driver_init_node_is_cut(node, driver))
+        return 0;
+
+    if (!node->cut_deps)
+        node->cut_deps = init_list();
+
+    if (!node->cut_deps)
+        return -1;
+
+    list_append(node->cut_deps, driver);
+    return 0;
+}
+
+/*!
+ * @brief: Add @driver and all of its dependencies that aren't loaded to @graph
+ *
+ * Drivers that can't be loaded still get a node, which is marked as failed. This way the failure
+ * propagates to anyone that depends on them
+ */
+static kerror_t __driver_init_graph_add(drv_init_graph_t* graph, driver_t* driver)
+{
+    drv_init_node_t* node;
+    drv_init_node_t* dep_node;
+    driver_dependency_t* dep;
+
     if (!driver)
         return -1;
 
-    if (!verify_driver(driver))
-        goto fail_and_exit;
+    node = __driver_init_graph_get_node(graph, driver);
 
-    handle = driver->m_handle;
+    if (node) {
+        /* We came back to a driver we're still resolving the dependencies for */
+        if (node->visiting) {
+            KLOG_ERR("Found a dependency cycle through driver: %s\n", driver->m_url);
+            return -1;
+        }
+
+        return node->failed ? -1 : 0;
+    }
+
+    if (!verify_driver(driver))
+        return -1;
 
     /* Can't load if it's already loaded lmao */
     if (is_driver_loaded(driver))
@@ -319,62 +512,393 @@ kerror_t load_driver(driver_t* driver)
     // these cases will return false if we start using ANIVA_FAIL_WITH_WARNING here, so they will
     // need to be replaced with result != ANIVA_SUCCESS
     if (!is_driver_installed(driver) && (install_driver(driver)))
-        goto fail_and_exit;
+        return -1;
 
-    KLOG_INFO("Loading driver: %s\n", handle->m_name);
+    node = kmalloc(sizeof(*node));
+
+    if (!node)
+        return -1;
+
+    memset(node, 0, sizeof(*node));
+
+    node->driver = driver;
+    node->graph = graph;
+    node->visiting = true;
+
+    list_append(graph->nodes, node);
+
+    KLOG_INFO("Loading driver: %s\n", driver->m_handle->m_name);
 
     if (!driver->m_dep_list)
-        goto skip_dependencies;
+        goto done;
 
     FOREACH_VEC(driver->m_dep_list, data, idx)
     {
-        driver_dependency_t* dep = (driver_dependency_t*)data;
+        dep = (driver_dependency_t*)data;
 
         /* Skip non-driver dependencies for now */
         ASSERT_MSG(drv_dep_is_driver(&dep->dep), "TODO: implement non-driver dependencies for drivers");
 
-        // TODO: check for errors
-        if (dep && !is_driver_loaded(dep->obj.drv)) {
-            KLOG_INFO("Loading driver dependency: %s\n", dep->obj.drv->m_url);
+        if (dep->obj.drv && driver_is_deferred(dep->obj.drv))
+            kernel_panic("TODO: handle deferred dependencies!");
 
-            if (driver_is_deferred(dep->obj.drv))
-                kernel_panic("TODO: handle deferred dependencies!");
+        if (!__driver_init_graph_add(graph, dep->obj.drv))
+            continue;
+
+        /* We can do without optional dependencies */
+        if (drv_dep_is_optional(&dep->dep)) {
+            /*
+             * When it points back into a cycle, we'd wait on a node that waits on us. Drop the edge,
+             * so we only load after that driver if it happens to be done already
+             */
+            dep_node = __driver_init_graph_get_node(graph, dep->obj.drv);
 
-            if (load_driver(dep->obj.drv))
-                goto fail_and_exit;
+            if (dep_node && dep_node->visiting && __driver_init_node_cut_dep(node, dep->obj.drv))
+                node->failed = true;
+
+            continue;
         }
+
+        node->failed = true;
+        break;
     }
 
-skip_dependencies:
-    error = bootstrap_driver(driver);
+done:
+    node->visiting = false;
 
-    /* If the driver says something went wrong, trust that */
-    if (error || (driver->m_flags & DRV_FAILED)) {
-        unload_driver(driver->m_url);
+    return node->failed ? -1 : 0;
+}
+
+/*!
+ * @brief: Count how many times @node depends on @dep_node
+ *
+ * Also tells us if all of those dependencies are optional
+ */
+static u32 __driver_init_node_deps_on(drv_init_node_t* node, drv_init_node_t* dep_node, bool* p_optional)
+{
+    u32 count;
+    driver_dependency_t* dep;
+
+    count = 0;
+
+    if (p_optional)
+        *p_optional = true;
+
+    if (!node->driver->m_dep_list)
+        return 0;
+
+    /* Cut edges are never waited on, so they don't count */
+    if (__driver_init_node_is_cut(node, dep_node->driver))
+        return 0;
+
+    FOREACH_VEC(node->driver->m_dep_list, data, idx)
+    {
+        dep = (driver_dependency_t*)data;
+
+        if (dep->obj.drv != dep_node->driver)
+            continue;
+
+        if (p_optional && !drv_dep_is_optional(&dep->dep))
+            *p_optional = false;
+
+        count++;
+    }
+
+    return count;
+}
+
+/*!
+ * @brief: Queue a node for execution
+ *
+ * Caller must hold __driver_init_lock
+ */
+static void __driver_init_node_ready(drv_init_node_t* node)
+{
+    queue_enqueue(node->graph->ready, node);
+
+    if (__driver_init_has_workers)
+        sem_post(__driver_init_sem);
+
+    sem_post(node->graph->wake);
+}
+
+/*!
+ * @brief: Run a single node and let its dependants know
+ */
+static void __driver_init_node_run(drv_init_node_t* node)
+{
+    bool optional;
+    u32 count;
+    kerror_t error;
+    drv_init_node_t* dependant;
+    drv_init_graph_t* graph;
+
+    error = node->failed ? -1 : __driver_do_load(node->driver);
+
+    graph = node->graph;
+
+    mutex_lock(__driver_init_lock);
+
+    node->error = error;
+
+    FOREACH(i, graph->nodes)
+    {
+        dependant = i->data;
+
+        /* Already on its way */
+        if (!dependant->nr_pending)
+            continue;
+
+        count = __driver_init_node_deps_on(dependant, node, &optional);
+
+        if (!count)
+            continue;
+
+        if (error && !optional)
+            dependant->failed = true;
+
+        dependant->nr_pending -= count;
+
+        if (!dependant->nr_pending)
+            __driver_init_node_ready(dependant);
+    }
+
+    graph->nr_left--;
+
+    /* Let the owner of the graph know we're done */
+    if (!graph->nr_left)
+        sem_post(graph->wake);
+
+    mutex_unlock(__driver_init_lock);
+}
+
+/*!
+ * @brief: Take a node off of any graph that has nodes ready to go
+ */
+static drv_init_node_t* __driver_init_take_node()
+{
+    drv_init_node_t* node;
+
+    node = nullptr;
+
+    mutex_lock(__driver_init_lock);
+
+    FOREACH(i, __driver_init_graphs)
+    {
+        node = queue_dequeue(((drv_init_graph_t*)i->data)->ready);
+
+        if (node)
+            break;
+    }
+
+    mutex_unlock(__driver_init_lock);
+
+    return node;
+}
+
+static void __driver_init_worker()
+{
+    drv_init_node_t* node;
+
+    while (true) {
+        sem_wait(__driver_init_sem, NULL);
+
+        node = __driver_init_take_node();
+
+        /* Someone beat us to it */
+        if (!node)
+            continue;
+
+        __driver_init_node_run(node);
+    }
+}
+
+/*!
+ * @brief: Spawn the driver init workers in the kernel process
+ *
+ * Until we have a scheduler and a kernel process, whoever loads the drivers does all the work
+ */
+static void __driver_init_spawn_workers()
+{
+    proc_t* c_proc;
+
+    if (__driver_init_has_workers)
+        return;
+
+    c_proc = get_current_proc();
+
+    if (!c_proc || c_proc != sched_get_kernel_proc())
+        return;
+
+    for (u32 i = 0; i < DRIVER_INIT_NR_WORKERS; i++) {
+        if (!spawn_thread("drv_init", SCHED_PRIO_HIGH, (FuncPtr)__driver_init_worker, NULL))
+            break;
+
+        __driver_init_has_workers = true;
+    }
+}
+
+static int __driver_init_graph_create(drv_init_graph_t* graph)
+{
+    memset(graph, 0, sizeof(*graph));
+
+    graph->nodes = init_list();
+    graph->ready = create_limitless_queue();
+    graph->wake = create_semaphore(-1, 0, 1);
+
+    if (!graph->nodes || !graph->ready || !graph->wake)
         return -1;
+
+    return 0;
+}
+
+static void __driver_init_graph_destroy(drv_init_graph_t* graph)
+{
+    drv_init_node_t* node;
+
+    if (graph->nodes) {
+        FOREACH(i, graph->nodes)
+        {
+            node = i->data;
+
+            if (node->cut_deps)
+                destroy_list(node->cut_deps);
+
+            kfree(node);
+        }
+
+        destroy_list(graph->nodes);
     }
 
-    __driver_register_presence(handle->m_type);
+    if (graph->ready)
+        destroy_queue(graph->ready, false);
 
-    /*
-     * TODO: we need to detect when we want to apply the 'activity' and 'precedence' mechanisms
-     * since we always load a bunch of graphics drivers at startup. We need to select one once all the devices should be set up
-     * and then remove all the unused drivers once they are gracefully exited
-     *
-     * Maybe we simply do what linux drm does and have drivers mark themselves as the 'active' driver by removing any lingering
-     * apperature...
-     *
-     */
-    //__driver_register_active(handle->m_type, driver);
+    if (graph->wake)
+        destroy_semaphore(graph->wake);
+}
 
-    driver->m_flags |= DRV_LOADED;
+/*!
+ * @brief: Initialize every driver in @graph
+ *
+ * Returns once every node in the graph is done
+ */
+static void __driver_init_graph_exec(drv_init_graph_t* graph)
+{
+    drv_init_node_t* node;
+    drv_init_node_t* dep_node;
 
-    return (0);
+    if (!graph->nodes->m_length)
+        return;
+
+    /* Only bother with the workers if there is a chance to do stuff in parallel */
+    if (graph->nodes->m_length > 1)
+        __driver_init_spawn_workers();
+
+    mutex_lock(__driver_init_lock);
+
+    graph->nr_left = graph->nodes->m_length;
+
+    FOREACH(i, graph->nodes)
+    {
+        node = i->data;
+
+        /* Failed nodes don't need to wait for anything. This also breaks up any dependency cycles */
+        if (node->failed)
+            continue;
+
+        FOREACH(j, graph->nodes)
+        {
+            dep_node = j->data;
+            node->nr_pending += __driver_init_node_deps_on(node, dep_node, NULL);
+        }
+    }
+
+    list_append(__driver_init_graphs, graph);
+
+    FOREACH(i, graph->nodes)
+    {
+        node = i->data;
+
+        if (!node->nr_pending)
+            __driver_init_node_ready(node);
+    }
+
+    mutex_unlock(__driver_init_lock);
+
+    while (true) {
+        mutex_lock(__driver_init_lock);
+
+        if (!graph->nr_left) {
+            list_remove_ex(__driver_init_graphs, graph);
+            mutex_unlock(__driver_init_lock);
+            break;
+        }
+
+        node = queue_dequeue(graph->ready);
+
+        mutex_unlock(__driver_init_lock);
+
+        if (node) {
+            __driver_init_node_run(node);
+            continue;
+        }
+
+        /* Wait for the workers to make progress */
+        sem_wait(graph->wake, NULL);
+    }
+}
+
+/*!
+ * @brief: Load @count drivers at once
+ *
+ * Drivers that don't depend on each other are initialized concurrently
+ *
+ * @returns: 0 if every driver got loaded, -1 otherwise
+ */
+kerror_t load_drivers(driver_t** drivers, uint32_t count)
+{
+    kerror_t error;
+    drv_init_node_t* node;
+    drv_init_graph_t graph;
+
+    if (!drivers || !count)
+        return -1;
+
+    error = 0;
+
+    if (__driver_init_graph_create(&graph))
+        goto fail_and_exit;
+
+    for (u32 i = 0; i < count; i++)
+        if (__driver_init_graph_add(&graph, drivers[i]) && !__driver_init_graph_get_node(&graph, drivers[i]))
+            error = -1;
+
+    __driver_init_graph_exec(&graph);
+
+    /* Drivers without a node were already loaded */
+    for (u32 i = 0; i < count; i++) {
+        node = __driver_init_graph_get_node(&graph, drivers[i]);
+
+        if (node && node->error)
+            error = -1;
+    }
+
+    __driver_init_graph_destroy(&graph);
+    return error;
 
 fail_and_exit:
+    __driver_init_graph_destroy(&graph);
     return -1;
 }
 
+kerror_t load_driver(driver_t* driver)
+{
+    if (!driver)
+        return -1;
+
+    return load_drivers(&driver, 1);
+}
+
 kerror_t unload_driver(dev_url_t url)
 {
     int error;
@@ -568,7 +1092,7 @@ kerror_t driver_set_ready(const char* path)
     if (!driver || (driver->m_flags & DRV_LOADED) != DRV_LOADED)
         return -1;
 
-    driver->m_flags |= DRV_ACTIVE;
+    driver_mark_ready(driver);
 
     return (0);
 }
@@ -683,17 +1207,24 @@ kerror_t driver_send_msg_sync_with_timeout(const char* path, driver_control_code
 
     size_t timeout = mto;
 
-    /* NOTE: this is the same logic as that which is used in driver_is_ready(...) */
+    /* Sleep until the driver tells us it's ready, instead of spinning on it */
+    if (timeout == DRIVER_WAIT_UNTIL_READY) {
+        while (!driver_is_ready(driver))
+            if (driver_wait_ready(driver))
+                goto exit_fail;
+    }
+
+    /*
+     * NOTE: this is the same logic as that which is used in driver_is_ready(...)
+     * Semaphores can't time out, so waits with a timeout still poll
+     */
     while (!driver_is_ready(driver)) {
 
         scheduler_yield();
 
-        if (timeout != DRIVER_WAIT_UNTIL_READY) {
-
-            timeout--;
-            if (timeout == 0) {
-                goto exit_fail;
-            }
+        timeout--;
+        if (timeout == 0) {
+            goto exit_fail;
         }
     }
 
@@ -717,6 +1248,8 @@ exit_fail:
  */
 void init_aniva_driver_registry()
 {
+    list_t* batch;
+
     __driver_node = create_oss_node("Drv", OSS_OBJ_STORE_NODE, NULL, NULL);
     __driver_allocator = create_zone_allocator_ex(nullptr, NULL, driver_SOFTMAX * sizeof(driver_t), sizeof(driver_t), NULL);
     __deferred_driver_drivers = init_list();
@@ -745,8 +1278,11 @@ void init_aniva_driver_registry()
         ASSERT(install_driver(driver) == 0);
     }
 
+    batch = init_list();
+
     /* First load pass */
-    oss_node_itterate(__driver_node, walk_precompiled_drivers_to_load, NULL);
+    oss_node_itterate(__driver_node, walk_precompiled_drivers_to_load, batch);
+    __load_precompiled_drivers(batch);
 
     // Install exported drivers
     FOREACH_PCDRV(ptr)
@@ -769,8 +1305,15 @@ void init_aniva_driver_registry()
         ASSERT(install_driver(driver) == 0);
     }
 
+    destroy_list(batch);
+    batch = init_list();
+
     /* Second load pass, with the core drivers already loaded */
-    oss_node_itterate(__driver_node, walk_precompiled_drivers_to_load, NULL);
+    oss_node_itterate(__driver_node, walk_precompiled_drivers_to_load, batch);
+    __load_precompiled_drivers(batch);
+
+    destroy_list(batch);
+    batch = init_list();
 
     FOREACH(i, __deferred_driver_drivers)
     {
@@ -783,9 +1326,12 @@ void init_aniva_driver_registry()
         /* Clear the deferred flag */
         driver->m_flags &= ~DRV_DEFERRED;
 
-        ASSERT_MSG(__load_precompiled_driver(driver), "Failed to load deferred precompiled driver!");
+        ASSERT_MSG(__gather_precompiled_driver(driver, batch), "Failed to load deferred precompiled driver!");
     }
 
+    __load_precompiled_drivers(batch);
+
+    destroy_list(batch);
     destroy_list(__deferred_driver_drivers);
     __deferred_driver_drivers = nullptr;
 }
@@ -795,5 +1341,9 @@ void init_aniva_driver_registry()
  */
 void init_driver_subsys()
 {
-    /* ... */
+    __driver_init_lock = create_mutex(NULL);
+    __driver_init_graphs = init_list();
+    __driver_init_sem = create_semaphore(-1, 0, DRIVER_INIT_NR_WORKERS);
+
+    ASSERT_MSG(__driver_init_lock && __driver_init_graphs && __driver_init_sem, "Failed to initialize the driver init executor");
 }
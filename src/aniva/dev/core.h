@@ -120,6 +120,12 @@ kerror_t uninstall_driver(struct driver* handle);
  */
 kerror_t load_driver(struct driver* driver);
 
+/*
+ * Load a batch of drivers, together with any dependencies that aren't loaded yet.
+ * Drivers that don't depend on each other are initialized concurrently
+ */
+kerror_t load_drivers(struct driver** drivers, uint32_t count);
+
 /*
  * unload a driver from its structure in RAM
  */
@@ -177,7 +183,7 @@ kerror_t driver_send_msg_sync(const char* path, driver_control_code_t code, void
  * Sends a packet to the target driver and waits a number of scheduler yields for the socket to be ready
  * if the timer runs out before the socket is ready, we return nullptr
  *
- * When mto is set to DRIVER_WAIT_UNTIL_READY, we simply wait untill the driver marks itself ready
+ * When mto is set to DRIVER_WAIT_UNTIL_READY, we simply block untill the driver marks itself ready
  */
 kerror_t driver_send_msg_sync_with_timeout(const char* path, driver_control_code_t code, void* buffer, size_t buffer_size, size_t mto);
 
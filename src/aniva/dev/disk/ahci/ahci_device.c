@@ -6,6 +6,7 @@
 #include "dev/driver.h"
 #include "dev/pci/io.h"
 #include "dev/pci/pci.h"
+#include "irq/interrupts.h"
 #include "lightos/dev/pci.h"
 #include "libk/data/linkedlist.h"
 #include "libk/flow/error.h"
@@ -34,7 +35,7 @@ static ALWAYS_INLINE void* get_hba_region(ahci_device_t* device);
 static ALWAYS_INLINE ANIVA_STATUS reset_hba(ahci_device_t* device);
 static ALWAYS_INLINE ANIVA_STATUS initialize_hba(ahci_device_t* device);
 
-static ALWAYS_INLINE registers_t* ahci_irq_handler(registers_t* regs);
+static int ahci_irq_handler(void* ctx);
 
 static void __register_ahci_device(ahci_device_t* device)
 {
@@ -228,13 +229,17 @@ static ANIVA_STATUS initialize_hba(ahci_device_t* device)
 
     // HBA has been reset, enable its interrupts and claim this line
     /* TODO: notify PCI of any interrupt line changes */
-    error = pci_device_allocate_irq(device->m_identifier, NULL, NULL, ahci_irq_handler, NULL, "AHCI controller");
+    error = pci_device_allocate_irq(device->m_identifier, NULL, IRQHANDLER_FLAG_DIRECT_CALL, ahci_irq_handler, device, "AHCI controller");
 
-    /* TODO: handle this propperly =)))) */
-    ASSERT_MSG(error == NULL, "Failed to allocate an IRQ for this AHCI device!");
+    /* Every command also gets polled for, so we can do without. Just keep the HBA from raising anything */
+    if (error)
+        KLOG_DBG("AHCI: Failed to allocate an IRQ (%d), leaving interrupts masked\n", error);
+    else {
+        device->m_has_irq = true;
 
-    ghc = ahci_mmio_read32((uintptr_t)device->m_hba_region, AHCI_REG_AHCI_GHC) | AHCI_GHC_IE;
-    ahci_mmio_write32((uintptr_t)device->m_hba_region, AHCI_REG_AHCI_GHC, ghc);
+        ghc = ahci_mmio_read32((uintptr_t)device->m_hba_region, AHCI_REG_AHCI_GHC) | AHCI_GHC_IE;
+        ahci_mmio_write32((uintptr_t)device->m_hba_region, AHCI_REG_AHCI_GHC, ghc);
+    }
 
     KLOG_DBG("AHCI: Gathering info about ports...\n");
 
@@ -245,40 +250,41 @@ static ANIVA_STATUS initialize_hba(ahci_device_t* device)
     return status;
 }
 
-static registers_t* ahci_irq_handler(registers_t* regs)
+/*!
+ * @brief: IRQ handler of an AHCI controller
+ *
+ * The line may be shared, so we always let the other handlers have a look too
+ */
+static int ahci_irq_handler(void* ctx)
 {
+    uint32_t status;
+    ahci_port_t* port;
+    ahci_device_t* device = ctx;
 
-    ahci_device_t* device = __ahci_devices;
-
-    // TODO: handle
-    // kernel_panic("Recieved AHCI interrupt!");
-
-    while (device) {
-
-        uint32_t ahci_interrupt_status = 0;
+    if (!device || !device->m_hba_region)
+        return 0;
 
-        ahci_mmio_read32((uintptr_t)device->m_hba_region, AHCI_REG_IS);
+    status = ahci_mmio_read32((uintptr_t)device->m_hba_region, AHCI_REG_IS);
 
-        if (ahci_interrupt_status == 0)
-            goto next;
+    /* Not for us */
+    if (!status)
+        return 0;
 
-        FOREACH(i, device->m_ports)
-        {
-            ahci_port_t* port = i->data;
-
-            /* Sanity check */
-            ASSERT(port->m_port_index < 32);
+    FOREACH(i, device->m_ports)
+    {
+        port = i->data;
 
-            if (ahci_interrupt_status & (1 << port->m_port_index)) {
-                ahci_port_handle_int(port);
-            }
-        }
+        /* Sanity check */
+        ASSERT(port->m_port_index < 32);
 
-    next:
-        device = device->m_next;
+        if (status & (1 << port->m_port_index))
+            ahci_port_handle_int(port);
     }
 
-    return regs;
+    /* Acknowledge after the ports, since a pending PxIS keeps the bit in IS set */
+    ahci_mmio_write32((uintptr_t)device->m_hba_region, AHCI_REG_IS, status);
+
+    return 0;
 }
 
 /*
@@ -325,6 +331,10 @@ ahci_device_t* create_ahci_device(pci_device_t* identifier)
 
 void destroy_ahci_device(ahci_device_t* device)
 {
+    /* The handler gets @device as context */
+    if (device->m_has_irq)
+        (void)pci_device_deallocate_irq(device->m_identifier, ahci_irq_handler, device);
+
     __unregister_ahci_device(device);
 
     FOREACH(i, device->m_ports)
@@ -19,6 +19,9 @@ typedef struct ahci_device {
     uint32_t m_used_ports;
     uint32_t m_available_ports;
 
+    /* Set when our handler is on the INTx line. Without it, interrupts stay masked and we poll */
+    bool m_has_irq;
+
     struct driver* m_parent;
     struct ahci_device* m_next;
 } ahci_device_t;
@@ -660,10 +660,17 @@ fail_and_dealloc:
  */
 ANIVA_STATUS ahci_port_handle_int(ahci_port_t* port)
 {
+    uint32_t status;
 
-    port->m_awaiting_dma_transfer_complete = false;
+    status = ahci_port_mmio_read32(port, AHCI_REG_PxIS);
+
+    /* The bits are write-one-to-clear, so only clear what we saw and don't lose anything that came in since */
+    ahci_port_mmio_write32(port, AHCI_REG_PxIS, status);
 
-    ahci_port_mmio_write32(port, AHCI_REG_PxIS, 0);
+    if (status & AHCI_PxIS_TFES)
+        port->m_transfer_failed = true;
+
+    port->m_awaiting_dma_transfer_complete = false;
 
     return ANIVA_SUCCESS;
 }
@@ -35,6 +35,8 @@
 #define AHCI_GHC_MRSM (1 << 2) // MSI Revert to Single Message (RO)
 #define AHCI_GHC_AE (1U << 31) // AHCI Enable (RW/RO)
 
+#define AHCI_PxIS_TFES (1 << 30) // Task File Error Status
+
 #define AHCI_CAP_S64A (1U << 31) // Supports 64-bit addressing
 
 #define AHCI_CAP2_BOH (1 << 0) // BIOS/OS Handoff
@@ -0,0 +1,453 @@
+#include "blkqueue.h"
+#include "dev/disk/device.h"
+#include "libk/flow/error.h"
+#include "logging/log.h"
+#include "mem/heap.h"
+#include "mem/kmem.h"
+#include "proc/core.h"
+#include "sched/scheduler.h"
+#include "sync/sem.h"
+#include <libk/string.h>
+
+/* Request is owned by the queue now, free it once it completes */
+#define BLK_REQ_FLAG_DETACHED 0x00000004
+/* Someone already consumed the completion */
+#define BLK_REQ_FLAG_WAITED 0x00000008
+
+static blk_elevator_t* __blk_elevators[] = {
+    &blk_elevator_none,
+    &blk_elevator_deadline,
+};
+
+static blk_elevator_t* __blk_get_elevator(const char* name)
+{
+    if (!name)
+        name = BLK_ELEVATOR_DEFAULT;
+
+    for (u32 i = 0; i < (sizeof(__blk_elevators) / sizeof(*__blk_elevators)); i++)
+        if (strcmp(__blk_elevators[i]->name, name) == 0)
+            return __blk_elevators[i];
+
+    return nullptr;
+}
+
+static void __destroy_blk_request(blk_request_t* req)
+{
+    destroy_semaphore(req->completion);
+    kfree(req);
+}
+
+/*!
+ * @brief: Signal the completion of a single request
+ */
+static void __blk_complete_request(blk_queue_t* queue, blk_request_t* req, int status)
+{
+    bool detached;
+
+    spinlock_lock(&queue->lock);
+
+    req->status = status;
+    req->flags |= BLK_REQ_FLAG_DONE;
+    detached = (req->flags & BLK_REQ_FLAG_DETACHED) == BLK_REQ_FLAG_DETACHED;
+
+    spinlock_unlock(&queue->lock);
+
+    /* Nobody is interested */
+    if (detached) {
+        __destroy_blk_request(req);
+        return;
+    }
+
+    sem_post(req->completion);
+}
+
+static inline bool __blk_chain_is_contiguous(blk_request_t* req, size_t blk_size)
+{
+    for (blk_request_t* c = req; c->merge_next; c = c->merge_next)
+        if ((u8*)c->buffer + c->count * blk_size != c->merge_next->buffer)
+            return false;
+
+    return true;
+}
+
+static inline int __blk_do_io(volume_device_t* vdev, u32 op, u64 blk, void* buffer, size_t count)
+{
+    f_device_ctl_t f_io = (op == BLK_REQ_WRITE) ? vdev->ops->f_bwrite : vdev->ops->f_bread;
+
+    if (!f_io)
+        return -KERR_INVAL;
+
+    return f_io(vdev->dev, NULL, blk, buffer, count);
+}
+
+/*!
+ * @brief: Send a (merged) request to the device
+ *
+ * A merged chain goes down as a single device call. When the buffers of the chain are not
+ * contiguous in memory we go through a bounce buffer, since a memcpy is way cheaper than a
+ * device round trip
+ */
+static int __blk_dispatch(blk_queue_t* queue, blk_request_t* req)
+{
+    int error;
+    u8* bounce;
+    size_t blk_size;
+    size_t bounce_size;
+    blk_request_t* c;
+
+    if (!req->merge_next)
+        return __blk_do_io(queue->vdev, req->op, req->blk, req->buffer, req->count);
+
+    blk_size = queue->vdev->info.logical_sector_size;
+
+    if (__blk_chain_is_contiguous(req, blk_size))
+        return __blk_do_io(queue->vdev, req->op, req->blk, req->buffer, req->merged_count);
+
+    bounce_size = ALIGN_UP(req->merged_count * blk_size, SMALL_PAGE_SIZE);
+
+    /* No memory for a bounce buffer, do them one by one */
+    if (kmem_kernel_alloc_range((void**)&bounce, bounce_size, 0, KMEM_FLAG_WRITABLE)) {
+        error = 0;
+
+        for (c = req; c && !error; c = c->merge_next)
+            error = __blk_do_io(queue->vdev, c->op, c->blk, c->buffer, c->count);
+
+        return error;
+    }
+
+    if (req->op == BLK_REQ_WRITE)
+        for (c = req; c; c = c->merge_next)
+            memcpy(bounce + (c->blk - req->blk) * blk_size, c->buffer, c->count * blk_size);
+
+    error = __blk_do_io(queue->vdev, req->op, req->blk, bounce, req->merged_count);
+
+    if (!error && req->op == BLK_REQ_READ)
+        for (c = req; c; c = c->merge_next)
+            memcpy(c->buffer, bounce + (c->blk - req->blk) * blk_size, c->count * blk_size);
+
+    kmem_kernel_dealloc((vaddr_t)bounce, bounce_size);
+    return error;
+}
+
+/*!
+ * @brief: Dispatcher thread for a single queue
+ *
+ * Asks the elevator for the next request, feeds it to the device and completes it
+ */
+static void __blk_dispatcher(blk_queue_t* queue)
+{
+    int error;
+    blk_request_t* req;
+    blk_request_t* next;
+
+    while (true) {
+        sem_wait(queue->work_sem, NULL);
+
+        spinlock_lock(&queue->lock);
+
+        req = queue->elevator->f_next(queue);
+
+        if (req) {
+            queue->nr_queued--;
+            queue->nr_dispatched++;
+        }
+
+        spinlock_unlock(&queue->lock);
+
+        if (!req) {
+            if (queue->stopping)
+                break;
+
+            continue;
+        }
+
+        error = __blk_dispatch(queue, req);
+
+        /* Complete the entire chain */
+        while (req) {
+            next = req->merge_next;
+            __blk_complete_request(queue, req, error);
+            req = next;
+        }
+    }
+
+    queue->stopped = true;
+}
+
+blk_queue_t* create_blk_queue(struct volume_device* vdev, const char* elevator)
+{
+    blk_queue_t* ret;
+    char name_buffer[32] = { 0 };
+
+    if (!vdev)
+        return nullptr;
+
+    ret = kmalloc(sizeof(*ret));
+
+    if (!ret)
+        return nullptr;
+
+    memset(ret, 0, sizeof(*ret));
+
+    ret->vdev = vdev;
+    ret->elevator = __blk_get_elevator(elevator);
+
+    if (!ret->elevator)
+        ret->elevator = &blk_elevator_none;
+
+    init_spinlock(&ret->lock, NULL);
+
+    if (ret->elevator->f_init && ret->elevator->f_init(ret))
+        goto free_and_exit;
+
+    ret->work_sem = create_semaphore(-1, 0, 1);
+
+    if (!ret->work_sem)
+        goto exit_elevator_and_exit;
+
+    sfmt(name_buffer, "blkq/VD%d", vdev->id);
+
+    ret->dispatcher = spawn_thread(name_buffer, SCHED_PRIO_HIGH, (FuncPtr)__blk_dispatcher, (u64)ret);
+
+    if (!ret->dispatcher)
+        goto destroy_sem_and_exit;
+
+    return ret;
+
+destroy_sem_and_exit:
+    destroy_semaphore(ret->work_sem);
+exit_elevator_and_exit:
+    if (ret->elevator->f_exit)
+        ret->elevator->f_exit(ret);
+free_and_exit:
+    kfree(ret);
+    return nullptr;
+}
+
+/*!
+ * @brief: Drain and destroy a request queue
+ *
+ * Anything that is still queued gets dispatched before the dispatcher exits
+ */
+void destroy_blk_queue(blk_queue_t* queue)
+{
+    queue->stopping = true;
+
+    /* Kick the dispatcher so it sees the stop request even when idle */
+    sem_post(queue->work_sem);
+
+    while (!queue->stopped)
+        scheduler_yield();
+
+    if (queue->elevator->f_exit)
+        queue->elevator->f_exit(queue);
+
+    destroy_semaphore(queue->work_sem);
+    kfree(queue);
+}
+
+/*!
+ * @brief: Switch the elevator of a queue
+ *
+ * Queued requests are moved over to the new elevator in the order the old one would have
+ * dispatched them
+ */
+int blk_queue_set_elevator(blk_queue_t* queue, const char* name)
+{
+    blk_request_t* req;
+    blk_request_t* list;
+    blk_request_t** tail;
+    blk_elevator_t* old;
+    blk_elevator_t* new;
+    void* old_private;
+
+    new = __blk_get_elevator(name);
+
+    if (!queue || !new)
+        return -KERR_INVAL;
+
+    spinlock_lock(&queue->lock);
+
+    old = queue->elevator;
+
+    if (old == new) {
+        spinlock_unlock(&queue->lock);
+        return 0;
+    }
+
+    /* Drain the old elevator */
+    list = nullptr;
+    tail = &list;
+
+    while ((req = old->f_next(queue))) {
+        req->next = nullptr;
+        *tail = req;
+        tail = &req->next;
+    }
+
+    old_private = queue->elv_private;
+
+    queue->elevator = new;
+    queue->elv_private = nullptr;
+
+    if (new->f_init && new->f_init(queue)) {
+        /* Put the old one back */
+        queue->elevator = old;
+        queue->elv_private = old_private;
+        new = old;
+    } else if (old->f_exit) {
+        void* new_private = queue->elv_private;
+
+        queue->elv_private = old_private;
+        old->f_exit(queue);
+        queue->elv_private = new_private;
+    }
+
+    while (list) {
+        req = list;
+        list = req->next;
+
+        new->f_add(queue, req);
+    }
+
+    spinlock_unlock(&queue->lock);
+    return 0;
+}
+
+/*!
+ * @brief: Queue up a block request
+ *
+ * Returns a request object that acts as completion object. The caller needs to release it
+ * with release_blk_request, after or instead of waiting for it.
+ */
+blk_request_t* blk_submit(blk_queue_t* queue, u32 op, u64 blk, void* buffer, size_t count)
+{
+    size_t max_count;
+    blk_request_t* ret;
+    blk_request_t* target;
+    blk_request_t* tail;
+
+    if (!queue || !buffer || !count || queue->stopping)
+        return nullptr;
+
+    ret = kmalloc(sizeof(*ret));
+
+    if (!ret)
+        return nullptr;
+
+    memset(ret, 0, sizeof(*ret));
+
+    ret->queue = queue;
+    ret->op = op;
+    ret->blk = blk;
+    ret->count = count;
+    ret->merged_count = count;
+    ret->buffer = buffer;
+    ret->completion = create_semaphore(1, 0, 1);
+
+    if (!ret->completion) {
+        kfree(ret);
+        return nullptr;
+    }
+
+    max_count = queue->vdev->info.max_transfer_sector_nr;
+
+    spinlock_lock(&queue->lock);
+
+    ret->seq = queue->nr_submitted++;
+
+    target = queue->elevator->f_find_merge ? queue->elevator->f_find_merge(queue, ret) : nullptr;
+
+    /* Back-merge into a queued request if the device can take the combined transfer */
+    if (target && (!max_count || target->merged_count + count <= max_count)) {
+        for (tail = target; tail->merge_next; tail = tail->merge_next)
+            ;
+
+        tail->merge_next = ret;
+        target->merged_count += count;
+        ret->flags |= BLK_REQ_FLAG_MERGED;
+
+        queue->nr_merged++;
+
+        spinlock_unlock(&queue->lock);
+        return ret;
+    }
+
+    queue->elevator->f_add(queue, ret);
+    queue->nr_queued++;
+
+    spinlock_unlock(&queue->lock);
+
+    sem_post(queue->work_sem);
+    return ret;
+}
+
+bool blk_request_is_done(blk_request_t* req)
+{
+    return (req->flags & BLK_REQ_FLAG_DONE) == BLK_REQ_FLAG_DONE;
+}
+
+/*!
+ * @brief: Wait for a request to complete
+ *
+ * Returns the status of the request. Can be called multiple times
+ */
+int blk_request_wait(blk_request_t* req)
+{
+    if (!req)
+        return -KERR_INVAL;
+
+    if ((req->flags & BLK_REQ_FLAG_WAITED) != BLK_REQ_FLAG_WAITED) {
+        sem_wait(req->completion, NULL);
+        req->flags |= BLK_REQ_FLAG_WAITED;
+    }
+
+    return req->status;
+}
+
+/*!
+ * @brief: Drop the callers reference to a request
+ *
+ * When the request is still in flight, the queue frees it once it completes
+ */
+void release_blk_request(blk_request_t* req)
+{
+    blk_queue_t* queue;
+
+    if (!req)
+        return;
+
+    queue = req->queue;
+
+    spinlock_lock(&queue->lock);
+
+    if (!blk_request_is_done(req)) {
+        req->flags |= BLK_REQ_FLAG_DETACHED;
+        spinlock_unlock(&queue->lock);
+        return;
+    }
+
+    spinlock_unlock(&queue->lock);
+
+    __destroy_blk_request(req);
+}
+
+int blk_submit_sync(blk_queue_t* queue, u32 op, u64 blk, void* buffer, size_t count)
+{
+    int error;
+    blk_request_t* req;
+
+    if (!queue)
+        return -KERR_INVAL;
+
+    req = blk_submit(queue, op, blk, buffer, count);
+
+    /* Could not queue, go straight to the device */
+    if (!req)
+        return __blk_do_io(queue->vdev, op, blk, buffer, count);
+
+    error = blk_request_wait(req);
+
+    release_blk_request(req);
+    return error;
+}
@@ -0,0 +1,119 @@
+#ifndef __ANIVA_DISK_BLKQUEUE_H__
+#define __ANIVA_DISK_BLKQUEUE_H__
+
+#include "sync/spinlock.h"
+#include <libk/stddef.h>
+
+struct thread;
+struct semaphore;
+struct volume_device;
+struct blk_queue;
+
+#define BLK_REQ_READ 0
+#define BLK_REQ_WRITE 1
+
+/* The device is done with this request (and any requests that were merged into it) */
+#define BLK_REQ_FLAG_DONE 0x00000001
+/* This request got merged into another request and won't be dispatched by itself */
+#define BLK_REQ_FLAG_MERGED 0x00000002
+
+/*
+ * A single block I/O request
+ *
+ * blk_submit hands one of these back as a completion object. The submitter can go do other
+ * things and call blk_request_wait once it actually needs the data.
+ */
+typedef struct blk_request {
+    struct blk_queue* queue;
+
+    u32 op;
+    u32 flags;
+
+    u64 blk;
+    size_t count;
+    void* buffer;
+
+    int status;
+
+    /* Submission order within the queue, used to keep overlapping requests in order */
+    u64 seq;
+
+    /* Tick at which the deadline elevator stops being polite about this request */
+    size_t deadline;
+
+    struct semaphore* completion;
+
+    /* Elevator links */
+    struct blk_request* next;
+    struct blk_request* fifo_next;
+
+    /* Requests that were back-merged into this one, in LBA order */
+    struct blk_request* merge_next;
+    /* Block count of this request and all its merged requests together */
+    size_t merged_count;
+} blk_request_t;
+
+/*
+ * An I/O scheduler
+ *
+ * Elevators decide in which order queued requests get dispatched to the device. They
+ * are called with the queue lock held, so they should not block
+ */
+typedef struct blk_elevator {
+    const char* name;
+
+    int (*f_init)(struct blk_queue* queue);
+    void (*f_exit)(struct blk_queue* queue);
+    void (*f_add)(struct blk_queue* queue, blk_request_t* req);
+    /* Pick the next request to dispatch and remove it from the elevator */
+    blk_request_t* (*f_next)(struct blk_queue* queue);
+    /* Find a queued request that ends right where @req starts */
+    blk_request_t* (*f_find_merge)(struct blk_queue* queue, blk_request_t* req);
+} blk_elevator_t;
+
+extern blk_elevator_t blk_elevator_none;
+extern blk_elevator_t blk_elevator_deadline;
+
+#define BLK_ELEVATOR_DEFAULT "deadline"
+
+/*
+ * Per volume device request queue
+ *
+ * Requests get merged and sorted by the elevator, after which a dispatcher thread feeds
+ * them to the device ops one by one
+ */
+typedef struct blk_queue {
+    struct volume_device* vdev;
+
+    blk_elevator_t* elevator;
+    void* elv_private;
+
+    spinlock_t lock;
+
+    /* Posted for every submitted request */
+    struct semaphore* work_sem;
+    struct thread* dispatcher;
+
+    u32 nr_queued;
+    bool stopping;
+    volatile bool stopped;
+
+    /* Statistics */
+    u64 nr_submitted;
+    u64 nr_merged;
+    u64 nr_dispatched;
+} blk_queue_t;
+
+blk_queue_t* create_blk_queue(struct volume_device* vdev, const char* elevator);
+void destroy_blk_queue(blk_queue_t* queue);
+
+int blk_queue_set_elevator(blk_queue_t* queue, const char* name);
+
+blk_request_t* blk_submit(blk_queue_t* queue, u32 op, u64 blk, void* buffer, size_t count);
+int blk_request_wait(blk_request_t* req);
+bool blk_request_is_done(blk_request_t* req);
+void release_blk_request(blk_request_t* req);
+
+int blk_submit_sync(blk_queue_t* queue, u32 op, u64 blk, void* buffer, size_t count);
+
+#endif // !__ANIVA_DISK_BLKQUEUE_H__
@@ -1,4 +1,5 @@
 #include "device.h"
+#include "dev/disk/blkqueue.h"
 #include "dev/disk/partition/gpt.h"
 #include "dev/disk/volume.h"
 #include "mem/heap.h"
@@ -219,6 +220,9 @@ int volume_dev_bread(volume_device_t* volume_dev, u64 block, void* buffer, size_
     if (!volume_dev->ops->f_bread)
         return -KERR_INVAL;
 
+    if (volume_dev->queue)
+        return blk_submit_sync(volume_dev->queue, BLK_REQ_READ, block, buffer, nr_blocks);
+
     return volume_dev->ops->f_bread(volume_dev->dev, NULL, block, buffer, nr_blocks);
 }
 
@@ -241,6 +245,9 @@ int volume_dev_bwrite(volume_device_t* volume_dev, u64 block, void* buffer, size
     if (!volume_dev->ops->f_bwrite)
         return -KERR_INVAL;
 
+    if (volume_dev->queue)
+        return blk_submit_sync(volume_dev->queue, BLK_REQ_WRITE, block, buffer, nr_blocks);
+
     return volume_dev->ops->f_bwrite(volume_dev->dev, NULL, block, buffer, nr_blocks);
 }
 
@@ -254,3 +261,25 @@ int volume_dev_flush(volume_device_t* volume_dev)
 
     return volume_dev->ops->f_flush(volume_dev->dev, NULL, NULL, nullptr, NULL);
 }
+
+/*!
+ * @brief: Queue a block read without waiting for it
+ *
+ * Returns nullptr when the device has no request queue, in which case the caller should
+ * fall back to volume_dev_bread
+ */
+struct blk_request* volume_dev_bread_async(volume_device_t* volume_dev, u64 block, void* buffer, size_t nr_blocks)
+{
+    if (!volume_dev || !volume_dev->queue)
+        return nullptr;
+
+    return blk_submit(volume_dev->queue, BLK_REQ_READ, block, buffer, nr_blocks);
+}
+
+struct blk_request* volume_dev_bwrite_async(volume_device_t* volume_dev, u64 block, void* buffer, size_t nr_blocks)
+{
+    if (!volume_dev || !volume_dev->queue)
+        return nullptr;
+
+    return blk_submit(volume_dev->queue, BLK_REQ_WRITE, block, buffer, nr_blocks);
+}
@@ -6,6 +6,8 @@
 #include <lightos/volume/shared.h>
 
 struct volume;
+struct blk_queue;
+struct blk_request;
 struct mbr_table;
 struct gpt_table;
 
@@ -45,6 +47,9 @@ typedef struct volume_device {
     volume_info_t info;
     volume_dev_ops_t* ops;
 
+    /* Request queue that sits in front of ->f_bread and ->f_bwrite (Memory backed devices don't get one) */
+    struct blk_queue* queue;
+
     /* A volume device (usually) contains volumes */
     size_t nr_volumes;
     struct volume* vec_volumes;
@@ -79,4 +84,7 @@ int volume_dev_write(volume_device_t* volume_dev, u64 offset, void* buffer, size
 int volume_dev_bwrite(volume_device_t* volume_dev, u64 block, void* buffer, size_t nr_blocks);
 int volume_dev_flush(volume_device_t* volume_dev);
 
+struct blk_request* volume_dev_bread_async(volume_device_t* volume_dev, u64 block, void* buffer, size_t nr_blocks);
+struct blk_request* volume_dev_bwrite_async(volume_device_t* volume_dev, u64 block, void* buffer, size_t nr_blocks);
+
 #endif // !__ANIVA_DISK_VOLUME_DEVICE_H__
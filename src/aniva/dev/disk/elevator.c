@@ -0,0 +1,327 @@
+#include "blkqueue.h"
+#include "libk/flow/error.h"
+#include "mem/heap.h"
+#include "time/core.h"
+#include <libk/string.h>
+
+/*
+ * The 'none' elevator
+ *
+ * Plain FIFO. Only merges with the request that was queued last, which catches
+ * sequential streams without having to scan anything
+ */
+typedef struct none_data {
+    blk_request_t* head;
+    blk_request_t* tail;
+} none_data_t;
+
+static int none_init(blk_queue_t* queue)
+{
+    none_data_t* data = kmalloc(sizeof(*data));
+
+    if (!data)
+        return -KERR_NOMEM;
+
+    memset(data, 0, sizeof(*data));
+
+    queue->elv_private = data;
+    return 0;
+}
+
+static void none_exit(blk_queue_t* queue)
+{
+    kfree(queue->elv_private);
+    queue->elv_private = nullptr;
+}
+
+static void none_add(blk_queue_t* queue, blk_request_t* req)
+{
+    none_data_t* data = queue->elv_private;
+
+    req->next = nullptr;
+
+    if (data->tail)
+        data->tail->next = req;
+    else
+        data->head = req;
+
+    data->tail = req;
+}
+
+static blk_request_t* none_next(blk_queue_t* queue)
+{
+    none_data_t* data = queue->elv_private;
+    blk_request_t* ret = data->head;
+
+    if (!ret)
+        return nullptr;
+
+    data->head = ret->next;
+
+    if (!data->head)
+        data->tail = nullptr;
+
+    ret->next = nullptr;
+    return ret;
+}
+
+static blk_request_t* none_find_merge(blk_queue_t* queue, blk_request_t* req)
+{
+    none_data_t* data = queue->elv_private;
+    blk_request_t* tail = data->tail;
+
+    if (tail && tail->op == req->op && tail->blk + tail->merged_count == req->blk)
+        return tail;
+
+    return nullptr;
+}
+
+blk_elevator_t blk_elevator_none = {
+    .name = "none",
+    .f_init = none_init,
+    .f_exit = none_exit,
+    .f_add = none_add,
+    .f_next = none_next,
+    .f_find_merge = none_find_merge,
+};
+
+/*
+ * The 'deadline' elevator
+ *
+ * Keeps reads and writes in separate LBA-sorted lists and sweeps through them in batches,
+ * so the device sees mostly ascending block numbers. Every request also gets an expiry time.
+ * When the oldest request of a direction expires, it gets served next, so a busy region of
+ * the disk can't starve requests elsewhere. Reads are preferred over writes, since someone is
+ * usually waiting on them, but writes get a turn after a couple of read batches.
+ *
+ * Sorting may never reorder requests that touch the same blocks when one of them is a write,
+ * since a read would see the wrong data (or a write would get overwritten by an older one).
+ * Before a request goes out we check for older conflicting requests and send those first.
+ */
+#define DEADLINE_READ_EXPIRE (TARGET_TPS / 2)
+#define DEADLINE_WRITE_EXPIRE (TARGET_TPS * 5)
+#define DEADLINE_FIFO_BATCH 16
+#define DEADLINE_WRITES_STARVED 2
+
+typedef struct deadline_data {
+    /* Sorted on blk, linked through ->next */
+    blk_request_t* sorted[2];
+    /* In submission order, linked through ->fifo_next */
+    blk_request_t* fifo_head[2];
+    blk_request_t* fifo_tail[2];
+
+    /* Where the last dispatched request ended */
+    u64 head_pos;
+    u32 batch_dir;
+    u32 batch_left;
+    u32 starved;
+} deadline_data_t;
+
+static int deadline_init(blk_queue_t* queue)
+{
+    deadline_data_t* data = kmalloc(sizeof(*data));
+
+    if (!data)
+        return -KERR_NOMEM;
+
+    memset(data, 0, sizeof(*data));
+
+    queue->elv_private = data;
+    return 0;
+}
+
+static void deadline_exit(blk_queue_t* queue)
+{
+    kfree(queue->elv_private);
+    queue->elv_private = nullptr;
+}
+
+static void deadline_add(blk_queue_t* queue, blk_request_t* req)
+{
+    blk_request_t** walker;
+    deadline_data_t* data = queue->elv_private;
+    u32 dir = req->op;
+
+    req->deadline = time_get_system_ticks() + (dir == BLK_REQ_READ ? DEADLINE_READ_EXPIRE : DEADLINE_WRITE_EXPIRE);
+
+    /* Sorted insert */
+    for (walker = &data->sorted[dir]; *walker && (*walker)->blk <= req->blk; walker = &(*walker)->next)
+        ;
+
+    req->next = *walker;
+    *walker = req;
+
+    /* FIFO append */
+    req->fifo_next = nullptr;
+
+    if (data->fifo_tail[dir])
+        data->fifo_tail[dir]->fifo_next = req;
+    else
+        data->fifo_head[dir] = req;
+
+    data->fifo_tail[dir] = req;
+}
+
+static void deadline_remove(deadline_data_t* data, blk_request_t* req)
+{
+    blk_request_t** walker;
+    blk_request_t* prev;
+    u32 dir = req->op;
+
+    for (walker = &data->sorted[dir]; *walker; walker = &(*walker)->next) {
+        if (*walker != req)
+            continue;
+
+        *walker = req->next;
+        break;
+    }
+
+    prev = nullptr;
+
+    for (blk_request_t* c = data->fifo_head[dir]; c; prev = c, c = c->fifo_next) {
+        if (c != req)
+            continue;
+
+        if (prev)
+            prev->fifo_next = c->fifo_next;
+        else
+            data->fifo_head[dir] = c->fifo_next;
+
+        if (data->fifo_tail[dir] == c)
+            data->fifo_tail[dir] = prev;
+
+        break;
+    }
+
+    req->next = nullptr;
+    req->fifo_next = nullptr;
+}
+
+/*!
+ * @brief: Find the first request in @dir at or after the current head position
+ */
+static blk_request_t* deadline_next_in_sweep(deadline_data_t* data, u32 dir)
+{
+    for (blk_request_t* c = data->sorted[dir]; c; c = c->next)
+        if (c->blk >= data->head_pos)
+            return c;
+
+    return nullptr;
+}
+
+static inline bool deadline_conflicts(blk_request_t* a, blk_request_t* b)
+{
+    if (a->op == BLK_REQ_READ && b->op == BLK_REQ_READ)
+        return false;
+
+    return a->blk < b->blk + b->merged_count && b->blk < a->blk + a->merged_count;
+}
+
+/*!
+ * @brief: Find the oldest queued request that has to go out before @req
+ *
+ * Returns @req itself if nothing that was submitted earlier touches the same blocks
+ */
+static blk_request_t* deadline_resolve_hazards(deadline_data_t* data, blk_request_t* req)
+{
+    blk_request_t* oldest;
+
+    while (true) {
+        oldest = req;
+
+        for (u32 dir = 0; dir < 2; dir++) {
+            /* Lists are sorted on blk, so nothing past the end of @req can overlap it */
+            for (blk_request_t* c = data->sorted[dir]; c && c->blk < req->blk + req->merged_count; c = c->next)
+                if (c->seq < oldest->seq && deadline_conflicts(c, req))
+                    oldest = c;
+        }
+
+        if (oldest == req)
+            return req;
+
+        req = oldest;
+    }
+}
+
+static blk_request_t* deadline_next(blk_queue_t* queue)
+{
+    u32 dir;
+    blk_request_t* ret;
+    deadline_data_t* data = queue->elv_private;
+
+    /* Continue the current batch if we can keep sweeping upwards */
+    if (data->batch_left) {
+        ret = deadline_next_in_sweep(data, data->batch_dir);
+
+        if (ret) {
+            data->batch_left--;
+            goto remove_and_exit;
+        }
+    }
+
+    if (!data->sorted[BLK_REQ_READ] && !data->sorted[BLK_REQ_WRITE])
+        return nullptr;
+
+    /* Pick a direction for the new batch */
+    if (data->sorted[BLK_REQ_READ] && (!data->sorted[BLK_REQ_WRITE] || data->starved < DEADLINE_WRITES_STARVED)) {
+        dir = BLK_REQ_READ;
+
+        if (data->sorted[BLK_REQ_WRITE])
+            data->starved++;
+    } else {
+        dir = BLK_REQ_WRITE;
+        data->starved = 0;
+    }
+
+    data->batch_dir = dir;
+    data->batch_left = DEADLINE_FIFO_BATCH - 1;
+
+    /* Expired requests go first */
+    ret = data->fifo_head[dir];
+
+    if (ret && ret->deadline <= time_get_system_ticks())
+        goto remove_and_exit;
+
+    ret = deadline_next_in_sweep(data, dir);
+
+    /* Wrap around to the start of the disk */
+    if (!ret)
+        ret = data->sorted[dir];
+
+remove_and_exit:
+    ret = deadline_resolve_hazards(data, ret);
+
+    deadline_remove(data, ret);
+
+    data->head_pos = ret->blk + ret->merged_count;
+    return ret;
+}
+
+static blk_request_t* deadline_find_merge(blk_queue_t* queue, blk_request_t* req)
+{
+    deadline_data_t* data = queue->elv_private;
+
+    /*
+     * Merging would move @req ahead of everything queued after its target, so don't
+     * merge at all if any queued request conflicts with it
+     */
+    for (u32 dir = 0; dir < 2; dir++)
+        for (blk_request_t* c = data->sorted[dir]; c && c->blk < req->blk + req->merged_count; c = c->next)
+            if (deadline_conflicts(c, req))
+                return nullptr;
+
+    for (blk_request_t* c = data->sorted[req->op]; c && c->blk < req->blk; c = c->next)
+        if (c->blk + c->merged_count == req->blk)
+            return c;
+
+    return nullptr;
+}
+
+blk_elevator_t blk_elevator_deadline = {
+    .name = "deadline",
+    .f_init = deadline_init,
+    .f_exit = deadline_exit,
+    .f_add = deadline_add,
+    .f_next = deadline_next,
+    .f_find_merge = deadline_find_merge,
+};
@@ -0,0 +1,175 @@
+#ifndef __ANIVA_NVME_DEFINITIONS__
+#define __ANIVA_NVME_DEFINITIONS__
+#include <libk/stddef.h>
+
+/*
+ * NVMe controller register offsets (NVM Express base specification, section 3.1)
+ */
+#define NVME_REG_CAP 0x00 // Controller Capabilities (64-bit)
+#define NVME_REG_VS 0x08 // Version
+#define NVME_REG_INTMS 0x0C // Interrupt Mask Set
+#define NVME_REG_INTMC 0x10 // Interrupt Mask Clear
+#define NVME_REG_CC 0x14 // Controller Configuration
+#define NVME_REG_CSTS 0x1C // Controller Status
+#define NVME_REG_AQA 0x24 // Admin Queue Attributes
+#define NVME_REG_ASQ 0x28 // Admin Submission Queue Base Address (64-bit)
+#define NVME_REG_ACQ 0x30 // Admin Completion Queue Base Address (64-bit)
+#define NVME_REG_DBS 0x1000 // Start of the doorbell registers
+
+#define NVME_CAP_MQES(cap) ((u32)((cap) & 0xffff)) // Maximum Queue Entries Supported (0's based)
+#define NVME_CAP_TO(cap) ((u32)(((cap) >> 24) & 0xff)) // Timeout (in 500 ms units)
+#define NVME_CAP_DSTRD(cap) ((u32)(((cap) >> 32) & 0xf)) // Doorbell Stride
+#define NVME_CAP_CSS_NVM(cap) (((cap) >> 37) & 1) // NVM command set supported
+#define NVME_CAP_MPSMIN(cap) ((u32)(((cap) >> 48) & 0xf)) // Memory Page Size Minimum
+
+#define NVME_CC_EN (1 << 0) // Enable
+#define NVME_CC_CSS_NVM (0 << 4) // I/O Command Set Selected: NVM
+#define NVME_CC_MPS(shift) ((((shift) - 12) & 0xf) << 7) // Memory Page Size
+#define NVME_CC_AMS_RR (0 << 11) // Arbitration Mechanism: Round Robin
+#define NVME_CC_SHN_NONE (0 << 14) // No shutdown notification
+#define NVME_CC_SHN_NORMAL (1 << 14) // Normal shutdown notification
+#define NVME_CC_SHN_MASK (3 << 14)
+#define NVME_CC_IOSQES(shift) ((shift) << 16) // I/O Submission Queue Entry Size
+#define NVME_CC_IOCQES(shift) ((shift) << 20) // I/O Completion Queue Entry Size
+
+#define NVME_CSTS_RDY (1 << 0) // Ready
+#define NVME_CSTS_CFS (1 << 1) // Controller Fatal Status
+#define NVME_CSTS_SHST_MASK (3 << 2) // Shutdown Status
+#define NVME_CSTS_SHST_CMPLT (2 << 2) // Shutdown processing complete
+
+/*
+ * Admin command set opcodes
+ */
+#define NVME_ADMIN_DELETE_SQ 0x00
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_DELETE_CQ 0x04
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+#define NVME_ADMIN_GET_FEATURES 0x0A
+
+/*
+ * NVM command set opcodes
+ */
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ 0x02
+
+/* CNS values for the identify command */
+#define NVME_IDENTIFY_CNS_NS 0x00
+#define NVME_IDENTIFY_CNS_CTRL 0x01
+#define NVME_IDENTIFY_CNS_ACTIVE_NS_LIST 0x02
+
+/* Feature identifiers for set/get features */
+#define NVME_FEAT_NR_QUEUES 0x07
+#define NVME_FEAT_IRQ_COALESCE 0x08
+
+/* Queue creation flags (CDW11) */
+#define NVME_QUEUE_PHYS_CONTIG (1 << 0)
+#define NVME_CQ_IRQ_ENABLED (1 << 1)
+#define NVME_SQ_PRIO_MEDIUM (2 << 1)
+
+/* Completion queue entry status field */
+#define NVME_CQE_PHASE(status) ((status) & 1)
+#define NVME_CQE_STATUS(status) (((status) >> 1) & 0x7ff)
+
+#define NVME_SQE_SHIFT 6
+#define NVME_CQE_SHIFT 4
+
+/* We always use 4 KiB host pages */
+#define NVME_PAGE_SHIFT 12
+#define NVME_PAGE_SIZE (1 << NVME_PAGE_SHIFT)
+
+/* How many PRP entries fit in a single page-sized PRP list */
+#define NVME_PRPS_PER_PAGE (NVME_PAGE_SIZE / sizeof(u64))
+
+/*
+ * Submission queue entry
+ *
+ * Every command is 64 bytes. Admin- and I/O commands share this layout, only the
+ * meaning of the command dwords changes
+ */
+typedef struct nvme_sqe {
+    u8 opcode;
+    u8 flags;
+    u16 cid;
+    u32 nsid;
+    u64 rsvd;
+    u64 mptr;
+    u64 prp1;
+    u64 prp2;
+    u32 cdw10;
+    u32 cdw11;
+    u32 cdw12;
+    u32 cdw13;
+    u32 cdw14;
+    u32 cdw15;
+} __attribute__((packed)) nvme_sqe_t;
+
+/*
+ * Completion queue entry
+ */
+typedef struct nvme_cqe {
+    u32 result;
+    u32 rsvd;
+    u16 sq_head;
+    u16 sq_id;
+    u16 cid;
+    u16 status;
+} __attribute__((packed)) nvme_cqe_t;
+
+/*
+ * Identify controller data structure
+ *
+ * We only care about a handful of fields, the rest is padding up to 4 KiB
+ */
+typedef struct nvme_id_ctrl {
+    u16 vid;
+    u16 ssvid;
+    char sn[20];
+    char mn[40];
+    char fr[8];
+    u8 rab;
+    u8 ieee[3];
+    u8 cmic;
+    /* Maximum data transfer size in units of the minimum page size (2^mdts) */
+    u8 mdts;
+    u16 cntlid;
+    u32 ver;
+    u8 rsvd84[172];
+    u8 admin_rsvd[256];
+    u8 sqes;
+    u8 cqes;
+    u16 maxcmd;
+    /* Number of namespaces */
+    u32 nn;
+    u8 rsvd520[3576];
+} __attribute__((packed)) nvme_id_ctrl_t;
+
+typedef struct nvme_lbaf {
+    u16 ms;
+    u8 lbads;
+    u8 rp;
+} __attribute__((packed)) nvme_lbaf_t;
+
+/*
+ * Identify namespace data structure
+ */
+typedef struct nvme_id_ns {
+    /* Namespace size in logical blocks */
+    u64 nsze;
+    u64 ncap;
+    u64 nuse;
+    u8 nsfeat;
+    u8 nlbaf;
+    /* Formatted LBA size (Low nibble indexes into lbaf) */
+    u8 flbas;
+    u8 mc;
+    u8 dpc;
+    u8 dps;
+    u8 rsvd30[98];
+    nvme_lbaf_t lbaf[16];
+    u8 rsvd192[3904];
+} __attribute__((packed)) nvme_id_ns_t;
+
+#endif // !__ANIVA_NVME_DEFINITIONS__
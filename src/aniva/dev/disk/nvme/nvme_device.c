@@ -0,0 +1,777 @@
+#include "nvme_device.h"
+#include "dev/core.h"
+#include "dev/device.h"
+#include "dev/disk/device.h"
+#include "dev/disk/volume.h"
+#include "dev/driver.h"
+#include "dev/pci/pci.h"
+#include "irq/interrupts.h"
+#include "libk/flow/error.h"
+#include "libk/io.h"
+#include "libk/math/math.h"
+#include "lightos/dev/pci.h"
+#include "lightos/dev/shared.h"
+#include "logging/log.h"
+#include "mem/heap.h"
+#include "mem/kmem.h"
+#include "system/processor/processor.h"
+#include <libk/string.h>
+
+static u32 _nvme_ctrl_count;
+static nvme_ctrl_t* __nvme_controllers;
+static driver_t* _nvme_driver;
+
+static pci_dev_id_t nvme_id_table[] = {
+    PCI_DEVID_CLASSES(MASS_STORAGE, PCI_SUBCLASS_NVM, PCI_PROGIF_NVME),
+    PCI_DEVID_END
+};
+
+static inline u32 nvme_read32(nvme_ctrl_t* ctrl, u32 reg)
+{
+    return mmio_read_dword((u8*)ctrl->regs + reg);
+}
+
+static inline void nvme_write32(nvme_ctrl_t* ctrl, u32 reg, u32 value)
+{
+    mmio_write_dword((u8*)ctrl->regs + reg, value);
+}
+
+static inline void nvme_write64(nvme_ctrl_t* ctrl, u32 reg, u64 value)
+{
+    /* Some controllers don't like qword accesses, so split them up */
+    mmio_write_dword((u8*)ctrl->regs + reg, value & 0xffffffffUL);
+    mmio_write_dword((u8*)ctrl->regs + reg + 4, value >> 32);
+}
+
+/*!
+ * @brief: Pick the I/O queue pair for the current CPU
+ *
+ * Every CPU gets its own queue pair when the controller gives us enough of them. When it doesn't,
+ * CPUs share queue pairs round-robin
+ */
+nvme_queue_t* nvme_ctrl_get_io_queue(nvme_ctrl_t* ctrl)
+{
+    processor_t* cpu;
+
+    if (!ctrl->nr_io_queues)
+        return nullptr;
+
+    cpu = get_current_processor();
+
+    return ctrl->io_queues[cpu->m_cpu_num % ctrl->nr_io_queues];
+}
+
+/*!
+ * @brief: Wait until CSTS.RDY matches @ready
+ *
+ * CAP.TO tells us the worst case time (in 500 ms units) the controller needs to
+ * transition
+ */
+static int nvme_wait_ready(nvme_ctrl_t* ctrl, bool ready)
+{
+    u32 csts;
+    u32 timeout_ms;
+
+    timeout_ms = (NVME_CAP_TO(ctrl->cap) + 1) * 500;
+
+    for (u32 i = 0; i < timeout_ms; i++) {
+        csts = nvme_read32(ctrl, NVME_REG_CSTS);
+
+        if (csts & NVME_CSTS_CFS)
+            return -KERR_DEV;
+
+        if (!!(csts & NVME_CSTS_RDY) == ready)
+            return 0;
+
+        mdelay(1);
+    }
+
+    return -KERR_TIMEOUT;
+}
+
+static int nvme_disable(nvme_ctrl_t* ctrl)
+{
+    u32 cc;
+
+    cc = nvme_read32(ctrl, NVME_REG_CC);
+
+    if ((cc & NVME_CC_EN) == 0 && (nvme_read32(ctrl, NVME_REG_CSTS) & NVME_CSTS_RDY) == 0)
+        return 0;
+
+    nvme_write32(ctrl, NVME_REG_CC, cc & ~NVME_CC_EN);
+
+    return nvme_wait_ready(ctrl, false);
+}
+
+static int nvme_enable(nvme_ctrl_t* ctrl)
+{
+    u32 cc;
+
+    cc = NVME_CC_EN | NVME_CC_CSS_NVM | NVME_CC_MPS(NVME_PAGE_SHIFT) | NVME_CC_AMS_RR | NVME_CC_SHN_NONE | NVME_CC_IOSQES(NVME_SQE_SHIFT) | NVME_CC_IOCQES(NVME_CQE_SHIFT);
+
+    nvme_write32(ctrl, NVME_REG_CC, cc);
+
+    return nvme_wait_ready(ctrl, true);
+}
+
+/*!
+ * @brief: Interrupt handler for a NVMe controller
+ *
+ * We only use a single vector, so any completion queue may have new entries for us. Since
+ * queue reaping only marks command slots as done, this is cheap enough to do for every queue
+ */
+static int nvme_irq_handler(void* ctx)
+{
+    nvme_ctrl_t* ctrl = ctx;
+
+    if (!ctrl)
+        return 0;
+
+    if (ctrl->admin_q)
+        nvme_queue_reap(ctrl->admin_q);
+
+    for (u32 i = 0; i < ctrl->nr_io_queues; i++)
+        nvme_queue_reap(ctrl->io_queues[i]);
+
+    return 0;
+}
+
+static int nvme_map_registers(nvme_ctrl_t* ctrl)
+{
+    u32 bar0, bar1;
+    paddr_t bar_addr;
+
+    ctrl->pdev->ops.read_dword(ctrl->pdev, BAR0, &bar0);
+
+    if (!is_bar_mem(bar0))
+        return -KERR_DEV;
+
+    bar_addr = get_bar_address(bar0);
+
+    /* NVMe register space is (pretty much always) 64-bit */
+    if (is_bar_64bit(bar0)) {
+        ctrl->pdev->ops.read_dword(ctrl->pdev, BAR1, &bar1);
+        bar_addr |= ((paddr_t)bar1 << 32);
+    }
+
+    ctrl->regs_size = pci_get_bar_size(ctrl->pdev, 0);
+
+    /* We need at least the admin doorbells */
+    if (ctrl->regs_size < NVME_REG_DBS + SMALL_PAGE_SIZE)
+        ctrl->regs_size = NVME_REG_DBS + SMALL_PAGE_SIZE;
+
+    return kmem_kernel_alloc(&ctrl->regs, bar_addr, ctrl->regs_size, 0, KMEM_FLAG_DMA | KMEM_FLAG_KERNEL);
+}
+
+static int nvme_identify(nvme_ctrl_t* ctrl, u32 nsid, u32 cns, void* buffer)
+{
+    nvme_sqe_t cmd = { 0 };
+
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.cdw10 = cns;
+
+    return nvme_queue_submit_sync(ctrl->admin_q, &cmd, buffer, NVME_PAGE_SIZE, NULL);
+}
+
+static int nvme_set_features(nvme_ctrl_t* ctrl, u32 fid, u32 value, u32* p_result)
+{
+    nvme_sqe_t cmd = { 0 };
+
+    cmd.opcode = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = fid;
+    cmd.cdw11 = value;
+
+    return nvme_queue_submit_sync(ctrl->admin_q, &cmd, NULL, NULL, p_result);
+}
+
+/*!
+ * @brief: Ask the controller for @wanted I/O queue pairs
+ *
+ * The controller may give us fewer, in which case we just use what we get
+ */
+static u32 nvme_request_io_queues(nvme_ctrl_t* ctrl, u32 wanted)
+{
+    u32 result;
+    u32 nr_sq, nr_cq;
+
+    if (nvme_set_features(ctrl, NVME_FEAT_NR_QUEUES, ((wanted - 1) << 16) | (wanted - 1), &result))
+        return 0;
+
+    /* Values are 0's based */
+    nr_sq = (result & 0xffff) + 1;
+    nr_cq = (result >> 16) + 1;
+
+    return MIN(wanted, MIN(nr_sq, nr_cq));
+}
+
+static int nvme_create_io_queue(nvme_ctrl_t* ctrl, u16 qid)
+{
+    int error;
+    nvme_queue_t* queue;
+    nvme_sqe_t cmd = { 0 };
+
+    queue = create_nvme_queue(ctrl, qid, MIN(NVME_IO_QUEUE_DEPTH, NVME_CAP_MQES(ctrl->cap) + 1));
+
+    if (!queue)
+        return -KERR_NOMEM;
+
+    /* Completion queue first, since the submission queue needs to point to it */
+    cmd.opcode = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1 = queue->cq_dma;
+    cmd.cdw10 = ((u32)(queue->depth - 1) << 16) | qid;
+    /* Interrupt vector 0, since we don't do MSI-X (yet) */
+    cmd.cdw11 = NVME_CQ_IRQ_ENABLED | NVME_QUEUE_PHYS_CONTIG;
+
+    error = nvme_queue_submit_sync(ctrl->admin_q, &cmd, NULL, NULL, NULL);
+
+    if (error)
+        goto destroy_and_exit;
+
+    memset(&cmd, 0, sizeof(cmd));
+
+    cmd.opcode = NVME_ADMIN_CREATE_SQ;
+    cmd.prp1 = queue->sq_dma;
+    cmd.cdw10 = ((u32)(queue->depth - 1) << 16) | qid;
+    cmd.cdw11 = ((u32)qid << 16) | NVME_SQ_PRIO_MEDIUM | NVME_QUEUE_PHYS_CONTIG;
+
+    error = nvme_queue_submit_sync(ctrl->admin_q, &cmd, NULL, NULL, NULL);
+
+    if (error)
+        goto destroy_and_exit;
+
+    ctrl->io_queues[qid - 1] = queue;
+    return 0;
+
+destroy_and_exit:
+    destroy_nvme_queue(queue);
+    return error;
+}
+
+/*!
+ * @brief: Split a block transfer into commands the controller can swallow
+ *
+ * All commands of a single request are submitted before we wait for any of them, so
+ * the controller can work on them in parallel
+ */
+static int nvme_ns_rw(nvme_ns_t* ns, u8 opcode, u64 blk, void* buffer, size_t count)
+{
+    int error;
+    u16 cids[NVME_IO_BATCH];
+    u32 nr_cids;
+    u64 max_blks;
+    u64 c_count;
+    nvme_queue_t* queue;
+    nvme_sqe_t cmd;
+
+    if (!count || !buffer)
+        return -KERR_INVAL;
+
+    if (blk + count > ns->nr_blocks)
+        return -KERR_RANGE;
+
+    queue = nvme_ctrl_get_io_queue(ns->ctrl);
+
+    if (!queue)
+        return -KERR_NODEV;
+
+    error = 0;
+    /* One page less than the max, since an unaligned buffer eats an extra PRP entry */
+    max_blks = ((u64)(ns->ctrl->max_xfer_pages - 1) << NVME_PAGE_SHIFT) >> ns->lba_shift;
+
+    if (!max_blks)
+        max_blks = 1;
+
+    while (count && !error) {
+        nr_cids = 0;
+
+        /* Fill the queue with as much of the request as we can track */
+        while (count && nr_cids < NVME_IO_BATCH) {
+            c_count = MIN(count, max_blks);
+
+            memset(&cmd, 0, sizeof(cmd));
+
+            cmd.opcode = opcode;
+            cmd.nsid = ns->nsid;
+            cmd.cdw10 = blk & 0xffffffffUL;
+            cmd.cdw11 = blk >> 32;
+            /* Number of logical blocks, 0's based */
+            cmd.cdw12 = (c_count - 1) & 0xffff;
+
+            error = nvme_queue_submit(queue, &cmd, buffer, c_count << ns->lba_shift, &cids[nr_cids]);
+
+            if (error)
+                break;
+
+            nr_cids++;
+            blk += c_count;
+            count -= c_count;
+            buffer = (u8*)buffer + (c_count << ns->lba_shift);
+        }
+
+        /* Collect all the completions, even if something went wrong on the way */
+        for (u32 i = 0; i < nr_cids; i++)
+            if (nvme_queue_wait(queue, cids[i], NULL) && !error)
+                error = -KERR_IO;
+    }
+
+    return error;
+}
+
+static inline nvme_ns_t* nvme_get_ns(device_t* device)
+{
+    volume_device_t* vdev;
+
+    if (!device)
+        return nullptr;
+
+    vdev = device->private;
+
+    if (!vdev)
+        return nullptr;
+
+    return vdev->private;
+}
+
+static int nvme_ns_bread(device_t* device, driver_t* driver, u64 blk, void* buffer, size_t count)
+{
+    nvme_ns_t* ns = nvme_get_ns(device);
+
+    if (!ns)
+        return -KERR_INVAL;
+
+    return nvme_ns_rw(ns, NVME_CMD_READ, blk, buffer, count);
+}
+
+static int nvme_ns_bwrite(device_t* device, driver_t* driver, u64 blk, void* buffer, size_t count)
+{
+    nvme_ns_t* ns = nvme_get_ns(device);
+
+    if (!ns)
+        return -KERR_INVAL;
+
+    return nvme_ns_rw(ns, NVME_CMD_WRITE, blk, buffer, count);
+}
+
+/*!
+ * @brief: Byte-granular read/write
+ *
+ * Goes through a bounce buffer which covers all the blocks that the range touches
+ */
+static int nvme_ns_rw_bytes(nvme_ns_t* ns, u64 offset, void* buffer, size_t size, bool write)
+{
+    int error;
+    void* bounce;
+    u64 start_blk;
+    u64 nr_blks;
+    u64 blk_size;
+    size_t bounce_size;
+
+    if (!size || !buffer)
+        return -KERR_INVAL;
+
+    blk_size = (1ULL << ns->lba_shift);
+    start_blk = offset >> ns->lba_shift;
+    nr_blks = (ALIGN_UP(offset + size, blk_size) >> ns->lba_shift) - start_blk;
+    bounce_size = ALIGN_UP(nr_blks << ns->lba_shift, SMALL_PAGE_SIZE);
+
+    if (kmem_kernel_alloc_range(&bounce, bounce_size, 0, KMEM_FLAG_WRITABLE))
+        return -KERR_NOMEM;
+
+    error = nvme_ns_rw(ns, NVME_CMD_READ, start_blk, bounce, nr_blks);
+
+    if (error)
+        goto dealloc_and_exit;
+
+    if (!write) {
+        memcpy(buffer, (u8*)bounce + (offset - (start_blk << ns->lba_shift)), size);
+        goto dealloc_and_exit;
+    }
+
+    /* Read-modify-write */
+    memcpy((u8*)bounce + (offset - (start_blk << ns->lba_shift)), buffer, size);
+
+    error = nvme_ns_rw(ns, NVME_CMD_WRITE, start_blk, bounce, nr_blks);
+
+dealloc_and_exit:
+    kmem_kernel_dealloc((vaddr_t)bounce, bounce_size);
+    return error;
+}
+
+static int nvme_ns_read(device_t* device, driver_t* driver, u64 offset, void* buffer, size_t size)
+{
+    nvme_ns_t* ns = nvme_get_ns(device);
+
+    if (!ns)
+        return -KERR_INVAL;
+
+    return nvme_ns_rw_bytes(ns, offset, buffer, size, false);
+}
+
+static int nvme_ns_write(device_t* device, driver_t* driver, u64 offset, void* buffer, size_t size)
+{
+    nvme_ns_t* ns = nvme_get_ns(device);
+
+    if (!ns)
+        return -KERR_INVAL;
+
+    return nvme_ns_rw_bytes(ns, offset, buffer, size, true);
+}
+
+static int nvme_ns_flush(device_t* device, driver_t* driver, u64 offset, void* buffer, size_t size)
+{
+    nvme_ns_t* ns;
+    nvme_queue_t* queue;
+    nvme_sqe_t cmd = { 0 };
+
+    ns = nvme_get_ns(device);
+
+    if (!ns)
+        return -KERR_INVAL;
+
+    queue = nvme_ctrl_get_io_queue(ns->ctrl);
+
+    if (!queue)
+        return -KERR_NODEV;
+
+    cmd.opcode = NVME_CMD_FLUSH;
+    cmd.nsid = ns->nsid;
+
+    return nvme_queue_submit_sync(queue, &cmd, NULL, NULL, NULL);
+}
+
+static int nvme_ns_getinfo(device_t* device, driver_t* driver, u64 offset, void* buffer, size_t size)
+{
+    DEVINFO* binfo;
+    volume_device_t* vdev;
+
+    if (!buffer || size != sizeof(*binfo))
+        return -KERR_INVAL;
+
+    binfo = buffer;
+    vdev = device->private;
+
+    if (!vdev)
+        return -KERR_INVAL;
+
+    memset(binfo, 0, sizeof(*binfo));
+
+    sfmt((char*)binfo->devicename, "%s", vdev->info.label);
+
+    binfo->ctype = DEVICE_CTYPE_PCI;
+    binfo->class = MASS_STORAGE;
+    binfo->subclass = PCI_SUBCLASS_NVM;
+
+    return 0;
+}
+
+static volume_dev_ops_t _nvme_ns_ops = {
+    .f_read = nvme_ns_read,
+    .f_write = nvme_ns_write,
+    .f_bread = nvme_ns_bread,
+    .f_bwrite = nvme_ns_bwrite,
+    .f_flush = nvme_ns_flush,
+    .f_getinfo = nvme_ns_getinfo,
+};
+
+static void nvme_decode_string(char* dst, const char* src, size_t len)
+{
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+
+    /* Strings in identify data are space padded */
+    while (len && (dst[len - 1] == ' ' || dst[len - 1] == '\0'))
+        dst[--len] = '\0';
+}
+
+/*!
+ * @brief: Identify a namespace and register it as a volume device
+ */
+static int nvme_add_namespace(nvme_ctrl_t* ctrl, u32 nsid, nvme_id_ns_t* id)
+{
+    nvme_ns_t* ns;
+    nvme_lbaf_t* lbaf;
+    volume_info_t vinfo = { 0 };
+
+    if (nvme_identify(ctrl, nsid, NVME_IDENTIFY_CNS_NS, id))
+        return -KERR_IO;
+
+    /* Inactive namespace */
+    if (!id->nsze)
+        return -KERR_NODEV;
+
+    lbaf = &id->lbaf[id->flbas & 0xf];
+
+    /* We don't do metadata or weird block sizes */
+    if (lbaf->ms || lbaf->lbads < 9 || lbaf->lbads > NVME_PAGE_SHIFT)
+        return -KERR_INVAL;
+
+    ns = kmalloc(sizeof(*ns));
+
+    if (!ns)
+        return -KERR_NOMEM;
+
+    memset(ns, 0, sizeof(*ns));
+
+    ns->ctrl = ctrl;
+    ns->nsid = nsid;
+    ns->lba_shift = lbaf->lbads;
+    ns->nr_blocks = id->nsze;
+
+    ns->vdev = create_volume_device(NULL, &_nvme_ns_ops, NULL, ns);
+
+    if (!ns->vdev) {
+        kfree(ns);
+        return -KERR_NOMEM;
+    }
+
+    register_volume_device(ns->vdev);
+
+    vinfo.type = VOLUME_TYPE_UNKNOWN;
+    vinfo.logical_sector_size = (1 << ns->lba_shift);
+    vinfo.physical_sector_size = vinfo.logical_sector_size;
+    vinfo.max_transfer_sector_nr = ((ctrl->max_xfer_pages - 1) << NVME_PAGE_SHIFT) >> ns->lba_shift;
+    vinfo.max_offset = (ns->nr_blocks << ns->lba_shift) - 1;
+
+    sfmt(vinfo.label, "%s n%d", ctrl->model, nsid);
+
+    /* Link before populating, since the partition scan already reads from the namespace */
+    ns->next = ctrl->namespaces;
+    ctrl->namespaces = ns;
+
+    /* This also scans the partition table */
+    volume_dev_set_info(ns->vdev, &vinfo);
+
+    KLOG_DBG("NVMe: Namespace %d on %s. Block count: 0x%llx, Blocksize: 0x%x\n", nsid, ctrl->model, ns->nr_blocks, vinfo.logical_sector_size);
+    return 0;
+}
+
+/*!
+ * @brief: Bring up a NVMe controller
+ *
+ * 1) Disable the controller and program the admin queue
+ * 2) Enable it again and identify it
+ * 3) Negotiate I/O queue pairs and setup interrupt coalescing
+ * 4) Create the I/O queue pairs and scan the namespaces
+ */
+static int nvme_init_ctrl(nvme_ctrl_t* ctrl)
+{
+    int error;
+    u32 nr_queues, nr_ns;
+    nvme_id_ctrl_t* id_ctrl;
+    nvme_id_ns_t* id_ns;
+
+    error = nvme_map_registers(ctrl);
+
+    if (error)
+        return error;
+
+    ctrl->cap = mmio_read_qword(ctrl->regs + NVME_REG_CAP);
+    ctrl->version = nvme_read32(ctrl, NVME_REG_VS);
+    ctrl->db_stride = NVME_CAP_DSTRD(ctrl->cap);
+
+    KLOG_DBG("NVMe: Controller version %d.%d (cap=0x%llx)\n", ctrl->version >> 16, (ctrl->version >> 8) & 0xff, ctrl->cap);
+
+    if (!NVME_CAP_CSS_NVM(ctrl->cap) || NVME_CAP_MPSMIN(ctrl->cap) > 0)
+        return -KERR_DEV;
+
+    error = nvme_disable(ctrl);
+
+    if (error)
+        return error;
+
+    ctrl->admin_q = create_nvme_queue(ctrl, 0, MIN(NVME_ADMIN_QUEUE_DEPTH, NVME_CAP_MQES(ctrl->cap) + 1));
+
+    if (!ctrl->admin_q)
+        return -KERR_NOMEM;
+
+    nvme_write32(ctrl, NVME_REG_AQA, ((u32)(ctrl->admin_q->depth - 1) << 16) | (ctrl->admin_q->depth - 1));
+    nvme_write64(ctrl, NVME_REG_ASQ, ctrl->admin_q->sq_dma);
+    nvme_write64(ctrl, NVME_REG_ACQ, ctrl->admin_q->cq_dma);
+
+    error = nvme_enable(ctrl);
+
+    if (error)
+        return error;
+
+    /* Completions get polled as well, so a missing IRQ line is not fatal */
+    if (pci_device_allocate_irq(ctrl->pdev, NULL, IRQHANDLER_FLAG_DIRECT_CALL, nvme_irq_handler, ctrl, "NVMe controller"))
+        KLOG_DBG("NVMe: Failed to allocate an IRQ, falling back to polling\n");
+    else
+        ctrl->has_irq = true;
+
+    if (kmem_kernel_alloc_range((void**)&id_ctrl, NVME_PAGE_SIZE, 0, KMEM_FLAG_DMA))
+        return -KERR_NOMEM;
+
+    if (kmem_kernel_alloc_range((void**)&id_ns, NVME_PAGE_SIZE, 0, KMEM_FLAG_DMA)) {
+        kmem_kernel_dealloc((vaddr_t)id_ctrl, NVME_PAGE_SIZE);
+        return -KERR_NOMEM;
+    }
+
+    error = nvme_identify(ctrl, 0, NVME_IDENTIFY_CNS_CTRL, id_ctrl);
+
+    if (error)
+        goto dealloc_and_exit;
+
+    nvme_decode_string(ctrl->model, id_ctrl->mn, sizeof(id_ctrl->mn));
+
+    /* MDTS is in units of the minimum page size, which we checked is 4 KiB. Zero means no limit */
+    ctrl->max_xfer_pages = NVME_PRPS_PER_PAGE;
+
+    if (id_ctrl->mdts)
+        ctrl->max_xfer_pages = MIN(ctrl->max_xfer_pages, 1U << id_ctrl->mdts);
+
+    /* Ask for a queue pair per CPU */
+    nr_queues = nvme_request_io_queues(ctrl, NVME_MAX_IO_QUEUES);
+
+    error = -KERR_DEV;
+
+    if (!nr_queues)
+        goto dealloc_and_exit;
+
+    /* Coalescing is optional, so ignore the result */
+    (void)nvme_set_features(ctrl, NVME_FEAT_IRQ_COALESCE, (NVME_IRQ_COALESCE_TIME << 8) | (NVME_IRQ_COALESCE_THRESHOLD - 1), NULL);
+
+    for (u32 i = 0; i < nr_queues; i++) {
+        if (nvme_create_io_queue(ctrl, i + 1))
+            break;
+
+        ctrl->nr_io_queues++;
+    }
+
+    if (!ctrl->nr_io_queues)
+        goto dealloc_and_exit;
+
+    nr_ns = id_ctrl->nn;
+
+    KLOG_DBG("NVMe: %s: %d I/O queue pairs, %d namespaces\n", ctrl->model, ctrl->nr_io_queues, nr_ns);
+
+    for (u32 nsid = 1; nsid <= nr_ns; nsid++)
+        nvme_add_namespace(ctrl, nsid, id_ns);
+
+    error = 0;
+dealloc_and_exit:
+    kmem_kernel_dealloc((vaddr_t)id_ns, NVME_PAGE_SIZE);
+    kmem_kernel_dealloc((vaddr_t)id_ctrl, NVME_PAGE_SIZE);
+    return error;
+}
+
+static void destroy_nvme_ctrl(nvme_ctrl_t* ctrl)
+{
+    nvme_ns_t* ns;
+    nvme_ctrl_t** walker;
+
+    for (walker = &__nvme_controllers; *walker; walker = &(*walker)->next) {
+        if (*walker != ctrl)
+            continue;
+
+        *walker = ctrl->next;
+        break;
+    }
+
+    while (ctrl->namespaces) {
+        ns = ctrl->namespaces;
+        ctrl->namespaces = ns->next;
+
+        unregister_volume_device(ns->vdev);
+        destroy_volume_device(ns->vdev);
+        kfree(ns);
+    }
+
+    if (ctrl->regs)
+        (void)nvme_disable(ctrl);
+
+    /* The handler gets @ctrl as context, so it has to be gone before we free it */
+    if (ctrl->has_irq)
+        (void)pci_device_deallocate_irq(ctrl->pdev, nvme_irq_handler, ctrl);
+
+    for (u32 i = 0; i < ctrl->nr_io_queues; i++)
+        destroy_nvme_queue(ctrl->io_queues[i]);
+
+    if (ctrl->admin_q)
+        destroy_nvme_queue(ctrl->admin_q);
+
+    kfree(ctrl);
+}
+
+static int nvme_probe(pci_device_t* device, pci_driver_t* driver)
+{
+    int error;
+    device_t* dev;
+    nvme_ctrl_t* ctrl;
+    char name_buffer[16] = { 0 };
+
+    pci_device_enable(device);
+
+    ctrl = kmalloc(sizeof(*ctrl));
+
+    if (!ctrl)
+        return -KERR_NOMEM;
+
+    memset(ctrl, 0, sizeof(*ctrl));
+
+    ctrl->pdev = device;
+    ctrl->idx = _nvme_ctrl_count++;
+    ctrl->next = __nvme_controllers;
+    __nvme_controllers = ctrl;
+
+    sfmt(name_buffer, "nvme%d", ctrl->idx);
+
+    dev = device->dev;
+
+    mutex_lock(dev->lock);
+
+    /* Take the device from PCI */
+    (void)driver_takeover_device(_nvme_driver, dev, name_buffer, NULL, ctrl);
+
+    mutex_unlock(dev->lock);
+
+    error = nvme_init_ctrl(ctrl);
+
+    if (error) {
+        KLOG_DBG("NVMe: Failed to initialize controller (error=%d)\n", error);
+        destroy_nvme_ctrl(ctrl);
+    }
+
+    return error;
+}
+
+pci_driver_t nvme_pci_driver = {
+    .id_table = nvme_id_table,
+    .f_probe = nvme_probe,
+    .device_flags = NULL,
+};
+
+int nvme_driver_init(driver_t* driver)
+{
+    __nvme_controllers = nullptr;
+    _nvme_ctrl_count = 0;
+    _nvme_driver = driver;
+
+    register_pci_driver(driver, &nvme_pci_driver);
+
+    return 0;
+}
+
+int nvme_driver_exit()
+{
+    unregister_pci_driver(&nvme_pci_driver);
+
+    while (__nvme_controllers)
+        destroy_nvme_ctrl(__nvme_controllers);
+
+    return 0;
+}
+
+/*
+ * Drv/disk/nvme
+ */
+aniva_driver_t base_nvme_driver = {
+    .m_name = "nvme",
+    .m_descriptor = "NVM Express controller driver",
+    .m_type = DT_DISK,
+    .m_version = DRIVER_VERSION(0, 0, 1),
+    .f_init = nvme_driver_init,
+    .f_exit = nvme_driver_exit,
+};
+EXPORT_DRIVER_PTR(base_nvme_driver);
@@ -0,0 +1,83 @@
+#ifndef __ANIVA_NVME_CONTROLLER__
+#define __ANIVA_NVME_CONTROLLER__
+
+#include "dev/disk/device.h"
+#include "dev/disk/nvme/definitions.h"
+#include "dev/disk/nvme/nvme_queue.h"
+#include <dev/pci/pci.h>
+
+struct driver;
+
+/* The maximum amount of I/O queue pairs we ask the controller for */
+#define NVME_MAX_IO_QUEUES 16
+/* Queue depths we use for the admin and I/O queues */
+#define NVME_ADMIN_QUEUE_DEPTH 32
+#define NVME_IO_QUEUE_DEPTH 64
+/* How many commands a single block request may have in flight before it waits on them */
+#define NVME_IO_BATCH 8
+
+/*
+ * Interrupt coalescing defaults: Fire an interrupt once 8 completions have gathered,
+ * or 100 microseconds after the first completion was posted
+ */
+#define NVME_IRQ_COALESCE_THRESHOLD 8
+#define NVME_IRQ_COALESCE_TIME 1
+
+/*
+ * A single namespace on a NVMe controller
+ *
+ * Every namespace is exposed to the rest of the system as its own volume device
+ */
+typedef struct nvme_ns {
+    struct nvme_ctrl* ctrl;
+
+    u32 nsid;
+    u32 lba_shift;
+    u64 nr_blocks;
+
+    volume_device_t* vdev;
+    struct nvme_ns* next;
+} nvme_ns_t;
+
+/*
+ * A NVMe controller that we found on the PCI bus
+ */
+typedef struct nvme_ctrl {
+    pci_device_t* pdev;
+
+    /* Controller register space */
+    void* regs;
+    size_t regs_size;
+
+    u64 cap;
+    u32 version;
+    u32 db_stride;
+    u32 idx;
+
+    /* The maximum amount of blocks of 4 KiB we can move in a single command */
+    u32 max_xfer_pages;
+
+    char model[41];
+
+    /* Set when our handler is on the INTx line, so teardown knows to release it */
+    bool has_irq;
+
+    nvme_queue_t* admin_q;
+
+    /* One I/O queue pair per CPU, as far as the controller allows */
+    u32 nr_io_queues;
+    nvme_queue_t* io_queues[NVME_MAX_IO_QUEUES];
+
+    nvme_ns_t* namespaces;
+
+    struct nvme_ctrl* next;
+} nvme_ctrl_t;
+
+static inline volatile u32* nvme_get_doorbell(nvme_ctrl_t* ctrl, u16 qid, bool completion)
+{
+    return (volatile u32*)((u8*)ctrl->regs + NVME_REG_DBS + ((2 * qid + (completion ? 1 : 0)) * (4 << ctrl->db_stride)));
+}
+
+nvme_queue_t* nvme_ctrl_get_io_queue(nvme_ctrl_t* ctrl);
+
+#endif // !__ANIVA_NVME_CONTROLLER__
@@ -0,0 +1,341 @@
+#include "nvme_queue.h"
+#include "dev/disk/nvme/nvme_device.h"
+#include "libk/flow/error.h"
+#include "libk/math/math.h"
+#include "mem/heap.h"
+#include "mem/kmem.h"
+#include "sched/scheduler.h"
+#include <libk/string.h>
+
+/*!
+ * @brief: Allocate the memory for a new NVMe queue pair
+ *
+ * This does not tell the controller about the queue. For the admin queue that happens through
+ * the AQA/ASQ/ACQ registers, for I/O queues through the create CQ/SQ admin commands
+ */
+nvme_queue_t* create_nvme_queue(struct nvme_ctrl* ctrl, u16 qid, u16 depth)
+{
+    nvme_queue_t* ret;
+
+    ret = kmalloc(sizeof(*ret));
+
+    if (!ret)
+        return nullptr;
+
+    memset(ret, 0, sizeof(*ret));
+
+    ret->ctrl = ctrl;
+    ret->qid = qid;
+    ret->depth = depth;
+    ret->cq_phase = 1;
+
+    init_spinlock(&ret->lock, NULL);
+
+    /* Queues must be physically contiguous, since we create them with NVME_QUEUE_PHYS_CONTIG */
+    if (kmem_kernel_alloc_range((void**)&ret->sq, ALIGN_UP(depth << NVME_SQE_SHIFT, SMALL_PAGE_SIZE), 0, KMEM_FLAG_DMA))
+        goto free_and_exit;
+
+    if (kmem_kernel_alloc_range((void**)&ret->cq, ALIGN_UP(depth << NVME_CQE_SHIFT, SMALL_PAGE_SIZE), 0, KMEM_FLAG_DMA))
+        goto free_sq_and_exit;
+
+    memset(ret->sq, 0, depth << NVME_SQE_SHIFT);
+    memset((void*)ret->cq, 0, depth << NVME_CQE_SHIFT);
+
+    ret->sq_dma = kmem_to_phys(nullptr, (vaddr_t)ret->sq);
+    ret->cq_dma = kmem_to_phys(nullptr, (vaddr_t)ret->cq);
+
+    ret->sq_doorbell = nvme_get_doorbell(ctrl, qid, false);
+    ret->cq_doorbell = nvme_get_doorbell(ctrl, qid, true);
+
+    return ret;
+
+free_sq_and_exit:
+    kmem_kernel_dealloc((vaddr_t)ret->sq, ALIGN_UP(depth << NVME_SQE_SHIFT, SMALL_PAGE_SIZE));
+free_and_exit:
+    kfree(ret);
+    return nullptr;
+}
+
+void destroy_nvme_queue(nvme_queue_t* queue)
+{
+    for (u32 i = 0; i < NVME_QUEUE_MAX_INFLIGHT; i++) {
+        if (!queue->slots[i].prp_list)
+            continue;
+
+        kmem_kernel_dealloc((vaddr_t)queue->slots[i].prp_list, SMALL_PAGE_SIZE);
+    }
+
+    kmem_kernel_dealloc((vaddr_t)queue->sq, ALIGN_UP(queue->depth << NVME_SQE_SHIFT, SMALL_PAGE_SIZE));
+    kmem_kernel_dealloc((vaddr_t)queue->cq, ALIGN_UP(queue->depth << NVME_CQE_SHIFT, SMALL_PAGE_SIZE));
+
+    kfree(queue);
+}
+
+/*!
+ * @brief: Fill in the data pointer of a command
+ *
+ * NVMe uses physical region pages to describe a buffer. PRP1 points to the first (possibly
+ * unaligned) chunk of the buffer. When the transfer touches exactly two pages, PRP2 points to
+ * the second page. Any bigger transfer needs a PRP list, which we keep per command slot.
+ *
+ * We translate every page of @buffer, so the buffer does not need to be physically contiguous
+ */
+static int nvme_queue_setup_prps(nvme_queue_t* queue, u16 cid, nvme_sqe_t* cmd, void* buffer, size_t size)
+{
+    nvme_cmd_slot_t* slot;
+    vaddr_t vaddr;
+    paddr_t paddr;
+    size_t first_len;
+    size_t nr_pages;
+
+    /* No data buffer. Leave the data pointer as is (Queue creation commands set it themselves) */
+    if (!buffer || !size)
+        return 0;
+
+    cmd->prp1 = NULL;
+    cmd->prp2 = NULL;
+
+    vaddr = (vaddr_t)buffer;
+
+    /* PRP entries need to be dword aligned */
+    if (vaddr & 3)
+        return -KERR_INVAL;
+
+    paddr = kmem_to_phys(nullptr, vaddr);
+
+    if (!paddr)
+        return -KERR_INVAL;
+
+    cmd->prp1 = paddr;
+
+    first_len = NVME_PAGE_SIZE - (vaddr & (NVME_PAGE_SIZE - 1));
+
+    /* Everything fits inside the first page */
+    if (size <= first_len)
+        return 0;
+
+    vaddr += first_len;
+    size -= first_len;
+    nr_pages = ALIGN_UP(size, NVME_PAGE_SIZE) >> NVME_PAGE_SHIFT;
+
+    /* Exactly two pages: PRP2 is a plain data pointer */
+    if (nr_pages == 1) {
+        cmd->prp2 = kmem_to_phys(nullptr, vaddr);
+        return cmd->prp2 ? 0 : -KERR_INVAL;
+    }
+
+    /* We don't chain PRP lists. The caller should split the transfer */
+    if (nr_pages > NVME_PRPS_PER_PAGE)
+        return -KERR_RANGE;
+
+    slot = &queue->slots[cid];
+
+    /* Lazily allocate a PRP list for this slot */
+    if (!slot->prp_list) {
+        if (kmem_kernel_alloc_range((void**)&slot->prp_list, SMALL_PAGE_SIZE, 0, KMEM_FLAG_DMA))
+            return -KERR_NOMEM;
+
+        slot->prp_list_dma = kmem_to_phys(nullptr, (vaddr_t)slot->prp_list);
+    }
+
+    for (size_t i = 0; i < nr_pages; i++) {
+        slot->prp_list[i] = kmem_to_phys(nullptr, vaddr + (i << NVME_PAGE_SHIFT));
+
+        if (!slot->prp_list[i])
+            return -KERR_INVAL;
+    }
+
+    cmd->prp2 = slot->prp_list_dma;
+    return 0;
+}
+
+/*!
+ * @brief: Walk the completion queue and retire any commands the controller has completed
+ *
+ * Caller must hold the queue lock. Returns the amount of completions we've processed
+ */
+static u32 __nvme_queue_reap(nvme_queue_t* queue)
+{
+    u32 nr_reaped;
+    u16 status;
+    volatile nvme_cqe_t* cqe;
+    nvme_cmd_slot_t* slot;
+
+    nr_reaped = 0;
+
+    while (true) {
+        cqe = &queue->cq[queue->cq_head];
+        status = cqe->status;
+
+        /* Phase tag did not flip, this entry is not ours (yet) */
+        if (NVME_CQE_PHASE(status) != queue->cq_phase)
+            break;
+
+        if (cqe->cid < NVME_QUEUE_MAX_INFLIGHT) {
+            slot = &queue->slots[cqe->cid];
+
+            slot->status = NVME_CQE_STATUS(status);
+            slot->result = cqe->result;
+            slot->done = true;
+        }
+
+        if (++queue->cq_head == queue->depth) {
+            queue->cq_head = 0;
+            queue->cq_phase ^= 1;
+        }
+
+        nr_reaped++;
+    }
+
+    /* Let the controller know which entries we've consumed in one doorbell write */
+    if (nr_reaped)
+        *queue->cq_doorbell = queue->cq_head;
+
+    return nr_reaped;
+}
+
+u32 nvme_queue_reap(nvme_queue_t* queue)
+{
+    u32 ret;
+
+    spinlock_lock(&queue->lock);
+    ret = __nvme_queue_reap(queue);
+    spinlock_unlock(&queue->lock);
+
+    return ret;
+}
+
+/*!
+ * @brief: Grab a free command slot
+ *
+ * Caller must hold the queue lock
+ */
+static int __nvme_queue_alloc_slot(nvme_queue_t* queue, u16* p_cid)
+{
+    u32 max_slots;
+
+    /* We can never have more commands in flight than there are free queue entries */
+    max_slots = MIN(queue->depth - 1, NVME_QUEUE_MAX_INFLIGHT);
+
+    for (u32 i = 0; i < max_slots; i++) {
+        if (queue->slot_bitmap & (1ULL << i))
+            continue;
+
+        queue->slot_bitmap |= (1ULL << i);
+        queue->slots[i].done = false;
+        queue->slots[i].status = 0;
+        queue->slots[i].result = 0;
+
+        *p_cid = i;
+        return 0;
+    }
+
+    return -KERR_NOMEM;
+}
+
+/*!
+ * @brief: Put a command on the submission queue of @queue
+ *
+ * Allocates a command slot, fills in the data pointer and rings the submission doorbell. The
+ * command identifier is exported through @p_cid, which the caller can pass to nvme_queue_wait
+ */
+int nvme_queue_submit(nvme_queue_t* queue, nvme_sqe_t* cmd, void* buffer, size_t size, u16* p_cid)
+{
+    int error;
+    u16 cid;
+
+    if (!queue || !cmd || !p_cid)
+        return -KERR_INVAL;
+
+    spinlock_lock(&queue->lock);
+
+    /* Wait for a slot to free up */
+    while (__nvme_queue_alloc_slot(queue, &cid)) {
+        __nvme_queue_reap(queue);
+        spinlock_unlock(&queue->lock);
+
+        scheduler_yield();
+
+        spinlock_lock(&queue->lock);
+    }
+
+    spinlock_unlock(&queue->lock);
+
+    cmd->cid = cid;
+
+    /* The slot is ours now, so we can build the PRPs without holding the queue lock */
+    error = nvme_queue_setup_prps(queue, cid, cmd, buffer, size);
+
+    spinlock_lock(&queue->lock);
+
+    if (error) {
+        queue->slot_bitmap &= ~(1ULL << cid);
+        spinlock_unlock(&queue->lock);
+        return error;
+    }
+
+    memcpy(&queue->sq[queue->sq_tail], cmd, sizeof(*cmd));
+
+    if (++queue->sq_tail == queue->depth)
+        queue->sq_tail = 0;
+
+    /* Ring ring */
+    *queue->sq_doorbell = queue->sq_tail;
+
+    spinlock_unlock(&queue->lock);
+
+    *p_cid = cid;
+    return 0;
+}
+
+/*!
+ * @brief: Wait for a submitted command to complete
+ *
+ * Completions are normally reaped by the IRQ handler, but we also poll the completion queue
+ * ourselves. This keeps us going when the interrupt gets coalesced away or when we are running
+ * without an interrupt line at all
+ */
+int nvme_queue_wait(nvme_queue_t* queue, u16 cid, u32* p_result)
+{
+    u16 status;
+    nvme_cmd_slot_t* slot;
+
+    if (!queue || cid >= NVME_QUEUE_MAX_INFLIGHT)
+        return -KERR_INVAL;
+
+    slot = &queue->slots[cid];
+
+    while (!slot->done) {
+        if (nvme_queue_reap(queue))
+            continue;
+
+        scheduler_yield();
+    }
+
+    spinlock_lock(&queue->lock);
+
+    status = slot->status;
+
+    if (p_result)
+        *p_result = slot->result;
+
+    /* Release the slot */
+    queue->slot_bitmap &= ~(1ULL << cid);
+
+    spinlock_unlock(&queue->lock);
+
+    return status ? -KERR_IO : 0;
+}
+
+int nvme_queue_submit_sync(nvme_queue_t* queue, nvme_sqe_t* cmd, void* buffer, size_t size, u32* p_result)
+{
+    int error;
+    u16 cid;
+
+    error = nvme_queue_submit(queue, cmd, buffer, size, &cid);
+
+    if (error)
+        return error;
+
+    return nvme_queue_wait(queue, cid, p_result);
+}
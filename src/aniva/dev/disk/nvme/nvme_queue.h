@@ -0,0 +1,70 @@
+#ifndef __ANIVA_NVME_QUEUE__
+#define __ANIVA_NVME_QUEUE__
+
+#include "dev/disk/nvme/definitions.h"
+#include "sync/spinlock.h"
+#include <libk/stddef.h>
+
+struct nvme_ctrl;
+
+/* Hard limit on the amount of outstanding commands per queue pair (We track them in a single qword) */
+#define NVME_QUEUE_MAX_INFLIGHT 64
+
+/*
+ * Tracking slot for a single in-flight command
+ *
+ * The slot index doubles as the command identifier, so a completion entry can be
+ * routed back to its waiter without any lookup
+ */
+typedef struct nvme_cmd_slot {
+    volatile bool done;
+    u16 status;
+    u32 result;
+
+    /* Page-sized PRP list for transfers that span more than two pages */
+    u64* prp_list;
+    paddr_t prp_list_dma;
+} nvme_cmd_slot_t;
+
+/*
+ * A single NVMe submission/completion queue pair
+ *
+ * The admin queue is queue pair 0, every I/O queue pair gets its own submission and completion
+ * queue (we never share completion queues between submission queues)
+ */
+typedef struct nvme_queue {
+    struct nvme_ctrl* ctrl;
+
+    u16 qid;
+    u16 depth;
+
+    u16 sq_tail;
+    u16 cq_head;
+    u8 cq_phase;
+
+    /* Submission and completion queue memory */
+    nvme_sqe_t* sq;
+    volatile nvme_cqe_t* cq;
+    paddr_t sq_dma;
+    paddr_t cq_dma;
+
+    /* Doorbell registers for this pair */
+    volatile u32* sq_doorbell;
+    volatile u32* cq_doorbell;
+
+    /* Bitmap of the command slots that are currently in use */
+    u64 slot_bitmap;
+    nvme_cmd_slot_t slots[NVME_QUEUE_MAX_INFLIGHT];
+
+    spinlock_t lock;
+} nvme_queue_t;
+
+nvme_queue_t* create_nvme_queue(struct nvme_ctrl* ctrl, u16 qid, u16 depth);
+void destroy_nvme_queue(nvme_queue_t* queue);
+
+int nvme_queue_submit(nvme_queue_t* queue, nvme_sqe_t* cmd, void* buffer, size_t size, u16* p_cid);
+int nvme_queue_wait(nvme_queue_t* queue, u16 cid, u32* p_result);
+int nvme_queue_submit_sync(nvme_queue_t* queue, nvme_sqe_t* cmd, void* buffer, size_t size, u32* p_result);
+u32 nvme_queue_reap(nvme_queue_t* queue);
+
+#endif // !__ANIVA_NVME_QUEUE__
@@ -0,0 +1,669 @@
+#include "virtio_blk.h"
+#include "dev/core.h"
+#include "dev/device.h"
+#include "dev/disk/volume.h"
+#include "dev/driver.h"
+#include "dev/pci/pci.h"
+#include "irq/interrupts.h"
+#include "libk/flow/error.h"
+#include "libk/math/math.h"
+#include "lightos/dev/pci.h"
+#include "lightos/dev/shared.h"
+#include "logging/log.h"
+#include "mem/heap.h"
+#include "mem/kmem.h"
+#include "sched/scheduler.h"
+#include "system/processor/processor.h"
+#include <libk/string.h>
+
+static u32 _virtio_blk_count;
+static virtio_blk_t* __virtio_blk_devices;
+static driver_t* _virtio_blk_driver;
+
+static pci_dev_id_t virtio_blk_id_table[] = {
+    /* Transitional */
+    PCI_DEVID_IDS_EX(VIRTIO_PCI_VENDOR_ID, VIRTIO_PCI_LEGACY_DEVID_START + 1, 0, 0, PCI_DEVID_USE_VENDOR_ID | PCI_DEVID_USE_DEVICE_ID),
+    /* Modern */
+    PCI_DEVID_IDS_EX(VIRTIO_PCI_VENDOR_ID, VIRTIO_PCI_MODERN_DEVID_BASE + VIRTIO_DEV_TYPE_BLK, 0, 0, PCI_DEVID_USE_VENDOR_ID | PCI_DEVID_USE_DEVICE_ID),
+    PCI_DEVID_END
+};
+
+static void virtio_blk_complete(virtqueue_t* vq, void* cookie, u32 len)
+{
+    virtio_blk_req_t* req = cookie;
+
+    req->done = true;
+}
+
+/*!
+ * @brief: Pick the queue for the current CPU
+ */
+static inline virtio_blk_queue_t* virtio_blk_get_queue(virtio_blk_t* blk)
+{
+    return &blk->queues[get_current_processor()->m_cpu_num % blk->nr_queues];
+}
+
+/*!
+ * @brief: Grab a request slot on @queue
+ *
+ * When all slots are taken, we first make sure the device knows about everything that's
+ * queued, since the slot owners might still be building their batch
+ */
+static virtio_blk_req_t* virtio_blk_alloc_req(virtio_blk_queue_t* queue)
+{
+    virtio_blk_req_t* req;
+
+    while (true) {
+        spinlock_lock(&queue->lock);
+
+        for (u32 i = 0; i < VIRTIO_BLK_REQS_PER_QUEUE; i++) {
+            if (queue->req_bitmap & (1 << i))
+                continue;
+
+            queue->req_bitmap |= (1 << i);
+            spinlock_unlock(&queue->lock);
+
+            req = &queue->reqs[i];
+            req->done = false;
+            *req->status = 0xff;
+            return req;
+        }
+
+        spinlock_unlock(&queue->lock);
+
+        virtqueue_kick(queue->vq);
+
+        if (!virtqueue_reap(queue->vq))
+            scheduler_yield();
+    }
+}
+
+static void virtio_blk_free_req(virtio_blk_queue_t* queue, virtio_blk_req_t* req)
+{
+    spinlock_lock(&queue->lock);
+    queue->req_bitmap &= ~(1 << (req - queue->reqs));
+    spinlock_unlock(&queue->lock);
+}
+
+/*!
+ * @brief: Build the scatter list for a request and put it on the queue
+ *
+ * Physically contiguous pages of @buffer get merged into a single segment
+ */
+static int virtio_blk_submit(virtio_blk_t* blk, virtio_blk_queue_t* queue, virtio_blk_req_t* req, u32 type, u64 sector, void* buffer, size_t size)
+{
+    int error;
+    u32 nr_sgs;
+    u32 max_sgs;
+    u32 len;
+    vaddr_t vaddr;
+    paddr_t paddr;
+    virtq_sg_t sgs[VIRTIO_BLK_MAX_SEGS + 2];
+
+    req->hdr->type = type;
+    req->hdr->reserved = 0;
+    req->hdr->sector = sector;
+
+    sgs[0] = (virtq_sg_t) { req->page_dma + VIRTIO_BLK_REQ_HDR_OFFSET, sizeof(virtio_blk_req_hdr_t), false };
+    nr_sgs = 1;
+
+    max_sgs = VIRTIO_BLK_MAX_SEGS;
+
+    if (blk->seg_max)
+        max_sgs = MIN(max_sgs, blk->seg_max);
+
+    vaddr = (vaddr_t)buffer;
+
+    while (size) {
+        len = MIN(size, SMALL_PAGE_SIZE - (vaddr & (SMALL_PAGE_SIZE - 1)));
+        paddr = kmem_to_phys(nullptr, vaddr);
+
+        if (!paddr)
+            return -KERR_INVAL;
+
+        /* Merge with the previous segment if we can */
+        if (nr_sgs > 1 && sgs[nr_sgs - 1].addr + sgs[nr_sgs - 1].len == paddr && (!blk->size_max || sgs[nr_sgs - 1].len + len <= blk->size_max)) {
+            sgs[nr_sgs - 1].len += len;
+        } else {
+            if (nr_sgs > max_sgs)
+                return -KERR_RANGE;
+
+            sgs[nr_sgs++] = (virtq_sg_t) { paddr, len, type == VIRTIO_BLK_T_IN };
+        }
+
+        vaddr += len;
+        size -= len;
+    }
+
+    sgs[nr_sgs++] = (virtq_sg_t) { req->page_dma + VIRTIO_BLK_REQ_STATUS_OFFSET, 1, true };
+
+    /* Out of descriptors: let the device catch up */
+    while ((error = virtqueue_add(queue->vq, sgs, nr_sgs, req, req->indirect, req->page_dma + VIRTIO_BLK_REQ_INDIRECT_OFFSET)) == -KERR_NOMEM) {
+        virtqueue_kick(queue->vq);
+
+        if (!virtqueue_reap(queue->vq))
+            scheduler_yield();
+    }
+
+    return error;
+}
+
+static int virtio_blk_wait(virtio_blk_queue_t* queue, virtio_blk_req_t* req)
+{
+    u8 status;
+
+    /* Completions are also reaped by the IRQ handler, but we don't rely on having one */
+    while (!req->done)
+        if (!virtqueue_reap(queue->vq))
+            scheduler_yield();
+
+    status = *req->status;
+
+    virtio_blk_free_req(queue, req);
+
+    return (status == VIRTIO_BLK_S_OK) ? 0 : -KERR_IO;
+}
+
+/*!
+ * @brief: Move a range of sectors
+ *
+ * Splits the range into requests and queues up to a full batch of them before
+ * notifying the device once. This keeps the amount of VM exits per byte low
+ */
+static int virtio_blk_rw(virtio_blk_t* blk, u32 type, u64 sector, void* buffer, size_t size)
+{
+    int error;
+    u32 nr_reqs;
+    size_t max_req_size;
+    size_t c_size;
+    virtio_blk_queue_t* queue;
+    virtio_blk_req_t* reqs[VIRTIO_BLK_REQS_PER_QUEUE];
+
+    if (!buffer || !size || (size & ((1 << VIRTIO_BLK_SECTOR_SHIFT) - 1)))
+        return -KERR_INVAL;
+
+    if (sector + (size >> VIRTIO_BLK_SECTOR_SHIFT) > blk->capacity)
+        return -KERR_RANGE;
+
+    queue = virtio_blk_get_queue(blk);
+
+    max_req_size = VIRTIO_BLK_MAX_REQ_PAGES * SMALL_PAGE_SIZE;
+
+    /* An unaligned buffer eats an extra segment */
+    if (blk->seg_max && blk->seg_max <= VIRTIO_BLK_MAX_REQ_PAGES)
+        max_req_size = (blk->seg_max - 1) * SMALL_PAGE_SIZE;
+
+    /* Without indirect descriptors a request needs a ring descriptor per segment */
+    if (!queue->vq->indirect)
+        max_req_size = MIN(max_req_size, (queue->vq->size - 3) * SMALL_PAGE_SIZE);
+
+    if (!max_req_size)
+        max_req_size = SMALL_PAGE_SIZE;
+
+    error = 0;
+
+    while (size && !error) {
+        nr_reqs = 0;
+
+        while (size && nr_reqs < VIRTIO_BLK_REQS_PER_QUEUE) {
+            c_size = MIN(size, max_req_size);
+
+            reqs[nr_reqs] = virtio_blk_alloc_req(queue);
+
+            error = virtio_blk_submit(blk, queue, reqs[nr_reqs], type, sector, buffer, c_size);
+
+            if (error) {
+                virtio_blk_free_req(queue, reqs[nr_reqs]);
+                break;
+            }
+
+            nr_reqs++;
+            sector += c_size >> VIRTIO_BLK_SECTOR_SHIFT;
+            buffer = (u8*)buffer + c_size;
+            size -= c_size;
+        }
+
+        /* One notification for the entire batch */
+        virtqueue_kick(queue->vq);
+
+        for (u32 i = 0; i < nr_reqs; i++)
+            if (virtio_blk_wait(queue, reqs[i]) && !error)
+                error = -KERR_IO;
+    }
+
+    return error;
+}
+
+static inline virtio_blk_t* virtio_blk_get(device_t* device)
+{
+    volume_device_t* volume;
+
+    if (!device)
+        return nullptr;
+
+    volume = device->private;
+
+    if (!volume)
+        return nullptr;
+
+    return volume->private;
+}
+
+static int virtio_blk_bread(device_t* device, driver_t* driver, u64 blk, void* buffer, size_t count)
+{
+    virtio_blk_t* vblk = virtio_blk_get(device);
+
+    if (!vblk)
+        return -KERR_INVAL;
+
+    return virtio_blk_rw(vblk, VIRTIO_BLK_T_IN, (blk * vblk->blk_size) >> VIRTIO_BLK_SECTOR_SHIFT, buffer, count * vblk->blk_size);
+}
+
+static int virtio_blk_bwrite(device_t* device, driver_t* driver, u64 blk, void* buffer, size_t count)
+{
+    virtio_blk_t* vblk = virtio_blk_get(device);
+
+    if (!vblk)
+        return -KERR_INVAL;
+
+    if (virtio_dev_has_feature(&vblk->vdev, VIRTIO_BLK_F_RO))
+        return -KERR_NOPERM;
+
+    return virtio_blk_rw(vblk, VIRTIO_BLK_T_OUT, (blk * vblk->blk_size) >> VIRTIO_BLK_SECTOR_SHIFT, buffer, count * vblk->blk_size);
+}
+
+/*!
+ * @brief: Byte-granular read/write through a bounce buffer
+ */
+static int virtio_blk_rw_bytes(virtio_blk_t* vblk, u64 offset, void* buffer, size_t size, bool write)
+{
+    int error;
+    void* bounce;
+    u64 start;
+    size_t bounce_size;
+
+    if (!buffer || !size)
+        return -KERR_INVAL;
+
+    start = offset & ~((u64)vblk->blk_size - 1);
+    bounce_size = ALIGN_UP(offset + size, vblk->blk_size) - start;
+
+    if (kmem_kernel_alloc_range(&bounce, bounce_size, 0, KMEM_FLAG_WRITABLE))
+        return -KERR_NOMEM;
+
+    error = virtio_blk_rw(vblk, VIRTIO_BLK_T_IN, start >> VIRTIO_BLK_SECTOR_SHIFT, bounce, bounce_size);
+
+    if (error)
+        goto dealloc_and_exit;
+
+    if (!write) {
+        memcpy(buffer, (u8*)bounce + (offset - start), size);
+        goto dealloc_and_exit;
+    }
+
+    memcpy((u8*)bounce + (offset - start), buffer, size);
+
+    error = virtio_blk_rw(vblk, VIRTIO_BLK_T_OUT, start >> VIRTIO_BLK_SECTOR_SHIFT, bounce, bounce_size);
+
+dealloc_and_exit:
+    kmem_kernel_dealloc((vaddr_t)bounce, bounce_size);
+    return error;
+}
+
+static int virtio_blk_read(device_t* device, driver_t* driver, u64 offset, void* buffer, size_t size)
+{
+    virtio_blk_t* vblk = virtio_blk_get(device);
+
+    if (!vblk)
+        return -KERR_INVAL;
+
+    return virtio_blk_rw_bytes(vblk, offset, buffer, size, false);
+}
+
+static int virtio_blk_write(device_t* device, driver_t* driver, u64 offset, void* buffer, size_t size)
+{
+    virtio_blk_t* vblk = virtio_blk_get(device);
+
+    if (!vblk)
+        return -KERR_INVAL;
+
+    if (virtio_dev_has_feature(&vblk->vdev, VIRTIO_BLK_F_RO))
+        return -KERR_NOPERM;
+
+    return virtio_blk_rw_bytes(vblk, offset, buffer, size, true);
+}
+
+static int virtio_blk_flush(device_t* device, driver_t* driver, u64 offset, void* buffer, size_t size)
+{
+    int error;
+    virtio_blk_t* vblk;
+    virtio_blk_queue_t* queue;
+    virtio_blk_req_t* req;
+    virtq_sg_t sgs[2];
+
+    vblk = virtio_blk_get(device);
+
+    if (!vblk)
+        return -KERR_INVAL;
+
+    /* No volatile write cache, nothing to do */
+    if (!virtio_dev_has_feature(&vblk->vdev, VIRTIO_BLK_F_FLUSH))
+        return 0;
+
+    queue = virtio_blk_get_queue(vblk);
+    req = virtio_blk_alloc_req(queue);
+
+    req->hdr->type = VIRTIO_BLK_T_FLUSH;
+    req->hdr->reserved = 0;
+    req->hdr->sector = 0;
+
+    sgs[0] = (virtq_sg_t) { req->page_dma + VIRTIO_BLK_REQ_HDR_OFFSET, sizeof(virtio_blk_req_hdr_t), false };
+    sgs[1] = (virtq_sg_t) { req->page_dma + VIRTIO_BLK_REQ_STATUS_OFFSET, 1, true };
+
+    while ((error = virtqueue_add(queue->vq, sgs, 2, req, req->indirect, req->page_dma + VIRTIO_BLK_REQ_INDIRECT_OFFSET)) == -KERR_NOMEM) {
+        virtqueue_kick(queue->vq);
+
+        if (!virtqueue_reap(queue->vq))
+            scheduler_yield();
+    }
+
+    if (error) {
+        virtio_blk_free_req(queue, req);
+        return error;
+    }
+
+    virtqueue_kick(queue->vq);
+
+    return virtio_blk_wait(queue, req);
+}
+
+static int virtio_blk_getinfo(device_t* device, driver_t* driver, u64 offset, void* buffer, size_t size)
+{
+    DEVINFO* binfo;
+    volume_device_t* volume;
+
+    if (!buffer || size != sizeof(*binfo))
+        return -KERR_INVAL;
+
+    binfo = buffer;
+    volume = device->private;
+
+    if (!volume)
+        return -KERR_INVAL;
+
+    memset(binfo, 0, sizeof(*binfo));
+
+    sfmt((char*)binfo->devicename, "%s", volume->info.label);
+
+    binfo->ctype = DEVICE_CTYPE_PCI;
+    binfo->class = MASS_STORAGE;
+    binfo->subclass = PCI_SUBCLASS_SCSI;
+    binfo->vendorid = VIRTIO_PCI_VENDOR_ID;
+
+    return 0;
+}
+
+static volume_dev_ops_t _virtio_blk_ops = {
+    .f_read = virtio_blk_read,
+    .f_write = virtio_blk_write,
+    .f_bread = virtio_blk_bread,
+    .f_bwrite = virtio_blk_bwrite,
+    .f_flush = virtio_blk_flush,
+    .f_getinfo = virtio_blk_getinfo,
+};
+
+static int virtio_blk_irq_handler(void* ctx)
+{
+    virtio_blk_t* blk = ctx;
+
+    if (!blk)
+        return 0;
+
+    /* Not ours (Shared INTx line) */
+    if (!(virtio_dev_read_isr(&blk->vdev) & VIRTIO_ISR_QUEUE))
+        return 0;
+
+    for (u32 i = 0; i < blk->nr_queues; i++)
+        virtqueue_reap(blk->queues[i].vq);
+
+    return 0;
+}
+
+static int virtio_blk_init_queue(virtio_blk_t* blk, u32 idx)
+{
+    virtio_blk_req_t* req;
+    virtio_blk_queue_t* queue = &blk->queues[idx];
+
+    queue->vq = create_virtqueue(&blk->vdev, idx, virtio_blk_complete);
+
+    if (!queue->vq)
+        return -KERR_NODEV;
+
+    init_spinlock(&queue->lock, NULL);
+
+    for (u32 i = 0; i < VIRTIO_BLK_REQS_PER_QUEUE; i++) {
+        req = &queue->reqs[i];
+
+        if (kmem_kernel_alloc_range(&req->page, SMALL_PAGE_SIZE, 0, KMEM_FLAG_DMA))
+            return -KERR_NOMEM;
+
+        memset(req->page, 0, SMALL_PAGE_SIZE);
+
+        req->page_dma = kmem_to_phys(nullptr, (vaddr_t)req->page);
+        req->hdr = (virtio_blk_req_hdr_t*)((u8*)req->page + VIRTIO_BLK_REQ_HDR_OFFSET);
+        req->status = (volatile u8*)req->page + VIRTIO_BLK_REQ_STATUS_OFFSET;
+        req->indirect = (virtq_desc_t*)((u8*)req->page + VIRTIO_BLK_REQ_INDIRECT_OFFSET);
+    }
+
+    return 0;
+}
+
+static void destroy_virtio_blk(virtio_blk_t* blk)
+{
+    virtio_blk_queue_t* queue;
+    virtio_blk_t** walker;
+
+    for (walker = &__virtio_blk_devices; *walker; walker = &(*walker)->next) {
+        if (*walker != blk)
+            continue;
+
+        *walker = blk->next;
+        break;
+    }
+
+    if (blk->volume) {
+        unregister_volume_device(blk->volume);
+        destroy_volume_device(blk->volume);
+    }
+
+    /* Stop the device before we pull the rings from under it */
+    if (blk->vdev.legacy || blk->vdev.common_cfg)
+        virtio_dev_reset(&blk->vdev);
+
+    /* The handler gets @blk as context, so it has to be gone before we free it */
+    if (blk->has_irq)
+        (void)pci_device_deallocate_irq(blk->vdev.pdev, virtio_blk_irq_handler, blk);
+
+    for (u32 i = 0; i < VIRTIO_BLK_MAX_QUEUES; i++) {
+        queue = &blk->queues[i];
+
+        for (u32 j = 0; j < VIRTIO_BLK_REQS_PER_QUEUE; j++)
+            if (queue->reqs[j].page)
+                kmem_kernel_dealloc((vaddr_t)queue->reqs[j].page, SMALL_PAGE_SIZE);
+
+        if (queue->vq)
+            destroy_virtqueue(queue->vq);
+    }
+
+    destroy_virtio_dev(&blk->vdev);
+    kfree(blk);
+}
+
+static int virtio_blk_init(virtio_blk_t* blk, pci_device_t* pdev)
+{
+    int error;
+    u32 nr_queues;
+    volume_info_t vinfo = { 0 };
+
+    error = init_virtio_dev(&blk->vdev, pdev);
+
+    if (error)
+        return error;
+
+    if (blk->vdev.type != VIRTIO_DEV_TYPE_BLK)
+        return -KERR_NODEV;
+
+    error = virtio_dev_negotiate_features(&blk->vdev,
+        VIRTIO_FEATURE(VIRTIO_BLK_F_SIZE_MAX) | VIRTIO_FEATURE(VIRTIO_BLK_F_SEG_MAX) | VIRTIO_FEATURE(VIRTIO_BLK_F_RO) | VIRTIO_FEATURE(VIRTIO_BLK_F_BLK_SIZE) | VIRTIO_FEATURE(VIRTIO_BLK_F_FLUSH) | VIRTIO_FEATURE(VIRTIO_BLK_F_MQ));
+
+    if (error)
+        return error;
+
+    blk->capacity = virtio_dev_cfg_read64(&blk->vdev, VIRTIO_BLK_CFG_CAPACITY);
+    blk->blk_size = (1 << VIRTIO_BLK_SECTOR_SHIFT);
+
+    if (virtio_dev_has_feature(&blk->vdev, VIRTIO_BLK_F_BLK_SIZE))
+        blk->blk_size = virtio_dev_cfg_read32(&blk->vdev, VIRTIO_BLK_CFG_BLK_SIZE);
+
+    /* Weird block size, don't trust it */
+    if (blk->blk_size < (1 << VIRTIO_BLK_SECTOR_SHIFT) || blk->blk_size > SMALL_PAGE_SIZE || (blk->blk_size & (blk->blk_size - 1)))
+        blk->blk_size = (1 << VIRTIO_BLK_SECTOR_SHIFT);
+
+    if (virtio_dev_has_feature(&blk->vdev, VIRTIO_BLK_F_SIZE_MAX))
+        blk->size_max = virtio_dev_cfg_read32(&blk->vdev, VIRTIO_BLK_CFG_SIZE_MAX);
+
+    if (virtio_dev_has_feature(&blk->vdev, VIRTIO_BLK_F_SEG_MAX))
+        blk->seg_max = virtio_dev_cfg_read32(&blk->vdev, VIRTIO_BLK_CFG_SEG_MAX);
+
+    /* Header and status need a segment too */
+    if (blk->seg_max && blk->seg_max < 3)
+        blk->seg_max = 3;
+
+    /* One queue per CPU, if the device does multiqueue */
+    nr_queues = 1;
+
+    if (virtio_dev_has_feature(&blk->vdev, VIRTIO_BLK_F_MQ))
+        nr_queues = MIN(VIRTIO_BLK_MAX_QUEUES, virtio_dev_cfg_read16(&blk->vdev, VIRTIO_BLK_CFG_NUM_QUEUES));
+
+    for (u32 i = 0; i < nr_queues; i++) {
+        error = virtio_blk_init_queue(blk, i);
+
+        if (error)
+            break;
+
+        blk->nr_queues++;
+    }
+
+    if (!blk->nr_queues)
+        return -KERR_NODEV;
+
+    /* Completions are polled as well, so a missing IRQ is not fatal */
+    if (pci_device_allocate_irq(pdev, NULL, IRQHANDLER_FLAG_DIRECT_CALL, virtio_blk_irq_handler, blk, "virtio-blk"))
+        KLOG_DBG("virtio-blk: Failed to allocate an IRQ, falling back to polling\n");
+    else
+        blk->has_irq = true;
+
+    virtio_dev_driver_ok(&blk->vdev);
+
+    blk->volume = create_volume_device(NULL, &_virtio_blk_ops, NULL, blk);
+
+    if (!blk->volume)
+        return -KERR_NOMEM;
+
+    register_volume_device(blk->volume);
+
+    vinfo.type = VOLUME_TYPE_UNKNOWN;
+    vinfo.logical_sector_size = blk->blk_size;
+    vinfo.physical_sector_size = blk->blk_size;
+    vinfo.max_transfer_sector_nr = (VIRTIO_BLK_MAX_REQ_PAGES * SMALL_PAGE_SIZE) / blk->blk_size;
+    vinfo.max_offset = (blk->capacity << VIRTIO_BLK_SECTOR_SHIFT) - 1;
+
+    sfmt(vinfo.label, "virtio-blk%d", blk->idx);
+
+    /* This also scans the partition table */
+    volume_dev_set_info(blk->volume, &vinfo);
+
+    KLOG_DBG("virtio-blk: %s, 0x%llx sectors, %d queue(s)%s%s\n", vinfo.label, blk->capacity, blk->nr_queues,
+        virtio_dev_has_feature(&blk->vdev, VIRTIO_F_RING_INDIRECT_DESC) ? ", indirect" : "",
+        virtio_dev_has_feature(&blk->vdev, VIRTIO_F_RING_EVENT_IDX) ? ", event-idx" : "");
+    return 0;
+}
+
+static int virtio_blk_probe(pci_device_t* device, pci_driver_t* driver)
+{
+    int error;
+    device_t* dev;
+    virtio_blk_t* blk;
+    char name_buffer[16] = { 0 };
+
+    blk = kmalloc(sizeof(*blk));
+
+    if (!blk)
+        return -KERR_NOMEM;
+
+    memset(blk, 0, sizeof(*blk));
+
+    blk->idx = _virtio_blk_count++;
+    blk->next = __virtio_blk_devices;
+    __virtio_blk_devices = blk;
+
+    sfmt(name_buffer, "vblk%d", blk->idx);
+
+    dev = device->dev;
+
+    mutex_lock(dev->lock);
+
+    /* Take the device from PCI */
+    (void)driver_takeover_device(_virtio_blk_driver, dev, name_buffer, NULL, blk);
+
+    mutex_unlock(dev->lock);
+
+    error = virtio_blk_init(blk, device);
+
+    if (error) {
+        KLOG_DBG("virtio-blk: Failed to initialize device (error=%d)\n", error);
+        destroy_virtio_blk(blk);
+    }
+
+    return error;
+}
+
+pci_driver_t virtio_blk_pci_driver = {
+    .id_table = virtio_blk_id_table,
+    .f_probe = virtio_blk_probe,
+    .device_flags = NULL,
+};
+
+int virtio_blk_driver_init(driver_t* driver)
+{
+    __virtio_blk_devices = nullptr;
+    _virtio_blk_count = 0;
+    _virtio_blk_driver = driver;
+
+    register_pci_driver(driver, &virtio_blk_pci_driver);
+
+    return 0;
+}
+
+int virtio_blk_driver_exit()
+{
+    unregister_pci_driver(&virtio_blk_pci_driver);
+
+    while (__virtio_blk_devices)
+        destroy_virtio_blk(__virtio_blk_devices);
+
+    return 0;
+}
+
+/*
+ * Drv/disk/virtio-blk
+ */
+aniva_driver_t base_virtio_blk_driver = {
+    .m_name = "virtio-blk",
+    .m_descriptor = "Virtio block device driver",
+    .m_type = DT_DISK,
+    .m_version = DRIVER_VERSION(0, 0, 1),
+    .f_init = virtio_blk_driver_init,
+    .f_exit = virtio_blk_driver_exit,
+};
+EXPORT_DRIVER_PTR(base_virtio_blk_driver);
@@ -0,0 +1,105 @@
+#ifndef __ANIVA_VIRTIO_BLK__
+#define __ANIVA_VIRTIO_BLK__
+
+#include "dev/disk/device.h"
+#include "dev/virtio/virtio.h"
+#include "dev/virtio/virtqueue.h"
+#include <libk/stddef.h>
+
+/* Feature bits */
+#define VIRTIO_BLK_F_SIZE_MAX 1
+#define VIRTIO_BLK_F_SEG_MAX 2
+#define VIRTIO_BLK_F_GEOMETRY 4
+#define VIRTIO_BLK_F_RO 5
+#define VIRTIO_BLK_F_BLK_SIZE 6
+#define VIRTIO_BLK_F_FLUSH 9
+#define VIRTIO_BLK_F_TOPOLOGY 10
+#define VIRTIO_BLK_F_MQ 12
+
+/* Device config offsets */
+#define VIRTIO_BLK_CFG_CAPACITY 0
+#define VIRTIO_BLK_CFG_SIZE_MAX 8
+#define VIRTIO_BLK_CFG_SEG_MAX 12
+#define VIRTIO_BLK_CFG_BLK_SIZE 20
+#define VIRTIO_BLK_CFG_PHYS_BLK_EXP 24
+#define VIRTIO_BLK_CFG_NUM_QUEUES 34
+
+/* Request types */
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+
+/* Request status */
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+/* virtio-blk always addresses the disk in 512 byte sectors */
+#define VIRTIO_BLK_SECTOR_SHIFT 9
+
+#define VIRTIO_BLK_MAX_QUEUES 16
+/* Request slots per queue. This is also how many requests we batch before kicking the device */
+#define VIRTIO_BLK_REQS_PER_QUEUE 16
+/* Maximum amount of data pages per request (One extra segment for unaligned buffers) */
+#define VIRTIO_BLK_MAX_REQ_PAGES 128
+#define VIRTIO_BLK_MAX_SEGS (VIRTIO_BLK_MAX_REQ_PAGES + 1)
+
+typedef struct virtio_blk_req_hdr {
+    u32 type;
+    u32 reserved;
+    u64 sector;
+} __attribute__((packed)) virtio_blk_req_hdr_t;
+
+/*
+ * Layout of the DMA page every request slot owns
+ *
+ * Header and status live here so the device never touches caller memory for them, and
+ * the indirect table describes the whole request in a single ring descriptor
+ */
+#define VIRTIO_BLK_REQ_HDR_OFFSET 0
+#define VIRTIO_BLK_REQ_STATUS_OFFSET 16
+#define VIRTIO_BLK_REQ_INDIRECT_OFFSET 64
+
+typedef struct virtio_blk_req {
+    virtio_blk_req_hdr_t* hdr;
+    volatile u8* status;
+    virtq_desc_t* indirect;
+
+    void* page;
+    paddr_t page_dma;
+
+    volatile bool done;
+} virtio_blk_req_t;
+
+typedef struct virtio_blk_queue {
+    virtqueue_t* vq;
+
+    u32 req_bitmap;
+    virtio_blk_req_t reqs[VIRTIO_BLK_REQS_PER_QUEUE];
+
+    spinlock_t lock;
+} virtio_blk_queue_t;
+
+typedef struct virtio_blk {
+    virtio_dev_t vdev;
+
+    u32 idx;
+
+    /* Capacity in 512 byte sectors */
+    u64 capacity;
+    u32 blk_size;
+    u32 size_max;
+    u32 seg_max;
+
+    /* Set when our handler is on the INTx line, so teardown knows to release it */
+    bool has_irq;
+
+    u32 nr_queues;
+    virtio_blk_queue_t queues[VIRTIO_BLK_MAX_QUEUES];
+
+    volume_device_t* volume;
+
+    struct virtio_blk* next;
+} virtio_blk_t;
+
+#endif // !__ANIVA_VIRTIO_BLK__
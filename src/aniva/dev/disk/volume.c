@@ -1,5 +1,6 @@
 #include "volume.h"
 #include "dev/device.h"
+#include "dev/disk/blkqueue.h"
 #include "dev/disk/device.h"
 #include "dev/driver.h"
 #include "dev/group.h"
@@ -394,6 +395,21 @@ size_t volume_write(volume_t* volume, uintptr_t offset, void* buffer, size_t siz
     return size;
 }
 
+blk_request_t* volume_submit(volume_t* volume, u32 op, uintptr_t block, void* buffer, size_t nr_blks)
+{
+    u64 end_offset;
+
+    if (!volume || !volume->parent || !volume->parent->queue || !volume->info.logical_sector_size || !nr_blks)
+        return nullptr;
+
+    end_offset = volume->info.min_offset + (block + nr_blks) * volume->info.logical_sector_size - 1;
+
+    if (end_offset > volume->info.max_offset)
+        return nullptr;
+
+    return blk_submit(volume->parent->queue, op, volume_get_min_blk(&volume->info) + block, buffer, nr_blks);
+}
+
 size_t volume_bread(volume_t* volume, uintptr_t block, void* buffer, size_t nr_blks)
 {
     if (!volume || !buffer || !nr_blks)
@@ -416,6 +432,23 @@ size_t volume_bwrite(volume_t* volume, uintptr_t block, void* buffer, size_t nr_
     return nr_blks * volume->info.logical_sector_size;
 }
 
+/*!
+ * @brief: Queue a block read on a volume without waiting for it
+ *
+ * Unlike volume_bread, this does not clip requests that run past the end of the volume.
+ * Returns nullptr if the request could not be queued, in which case the caller should do
+ * a synchronous read
+ */
+blk_request_t* volume_bread_async(volume_t* volume, uintptr_t block, void* buffer, size_t nr_blks)
+{
+    return volume_submit(volume, BLK_REQ_READ, block, buffer, nr_blks);
+}
+
+blk_request_t* volume_bwrite_async(volume_t* volume, uintptr_t block, void* buffer, size_t nr_blks)
+{
+    return volume_submit(volume, BLK_REQ_WRITE, block, buffer, nr_blks);
+}
+
 int volume_flush(volume_t* volume)
 {
     return __volume_flush(volume->dev, NULL, NULL, NULL, NULL);
@@ -504,14 +537,19 @@ int register_volume_device(struct volume_device* volume_dev)
         DEVICE_CTL_END,
     };
 
+    /* Storage drivers register their devices from concurrent init workers */
+    volume_dev->id = __atomic_fetch_add(&next_voldv_id, 1, __ATOMIC_RELAXED);
+
     /* Format the device name */
-    sfmt(name_buffer, VOLUME_DEVICE_NAME_FMT, next_voldv_id);
+    sfmt(name_buffer, VOLUME_DEVICE_NAME_FMT, volume_dev->id);
 
     KLOG_DBG("Creating volume device: %s\n", name_buffer);
 
     volume_dev->dev = create_device_ex(NULL, name_buffer, volume_dev, DEVICE_CTYPE_OTHER, NULL, __volume_dev_ctl_nodes);
-    volume_dev->id = next_voldv_id;
-    next_voldv_id++;
+
+    /* Memory backed devices gain nothing from queueing */
+    if ((volume_dev->flags & VOLUME_DEV_FLAG_MEMORY) != VOLUME_DEV_FLAG_MEMORY)
+        volume_dev->queue = create_blk_queue(volume_dev, BLK_ELEVATOR_DEFAULT);
 
     return device_register(volume_dev->dev, volume_devices_dgroup);
 }
@@ -521,6 +559,12 @@ int unregister_volume_device(struct volume_device* volume_dev)
     if (!volume_dev)
         return -KERR_INVAL;
 
+    /* Drain any outstanding requests before the device goes away */
+    if (volume_dev->queue)
+        destroy_blk_queue(volume_dev->queue);
+
+    volume_dev->queue = nullptr;
+
     destroy_device(volume_dev->dev);
     volume_dev->dev = nullptr;
     return 0;
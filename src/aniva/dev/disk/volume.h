@@ -7,6 +7,7 @@
 #include "lightos/volume/shared.h"
 
 struct volume_device;
+struct blk_request;
 
 /* Can't write to this volume */
 #define VOLUME_FLAG_READONLY 0x00000001
@@ -68,6 +69,11 @@ size_t volume_write(volume_t* volume, uintptr_t offset, void* buffer, size_t siz
 size_t volume_bread(volume_t* volume, uintptr_t block, void* buffer, size_t nr_blks);
 size_t volume_bwrite(volume_t* volume, uintptr_t block, void* buffer, size_t nr_blks);
 int volume_flush(volume_t* volume);
+
+/* Asynchronous block I/O through the request queue of the parent device */
+struct blk_request* volume_submit(volume_t* volume, u32 op, uintptr_t block, void* buffer, size_t nr_blks);
+struct blk_request* volume_bread_async(volume_t* volume, uintptr_t block, void* buffer, size_t nr_blks);
+struct blk_request* volume_bwrite_async(volume_t* volume, uintptr_t block, void* buffer, size_t nr_blks);
 int volume_resize(volume_t* volume, uintptr_t new_min_offset, uintptr_t new_max_offset);
 /* Completely removes a volume, also unregisters it and destroys it */
 int volume_remove(volume_t* volume);
@@ -11,6 +11,7 @@
 #include "mem/tracker/tracker.h"
 #include "oss/obj.h"
 #include "sync/mutex.h"
+#include "sync/sem.h"
 #include "system/sysvar/var.h"
 #include <libk/string.h>
 #include <mem/heap.h>
@@ -84,6 +85,58 @@ bool driver_is_busy(driver_t* driver)
     return (mutex_is_locked(driver->m_lock));
 }
 
+/*!
+ * @brief: Mark @driver as active and wake up anyone that is waiting for it
+ *
+ * The ready semaphore only ever gets posted on the transition to active, so it never
+ * holds more than a single count
+ */
+void driver_mark_ready(driver_t* driver)
+{
+    if (__atomic_fetch_or(&driver->m_flags, DRV_ACTIVE, __ATOMIC_SEQ_CST) & DRV_ACTIVE)
+        return;
+
+    sem_post(driver->m_ready_sem);
+}
+
+/*!
+ * @brief: Take the active flag of @driver away again
+ *
+ * Takes back the count that driver_mark_ready left in the ready semaphore
+ */
+static void __driver_clear_ready(driver_t* driver)
+{
+    if ((__atomic_fetch_and(&driver->m_flags, ~DRV_ACTIVE, __ATOMIC_SEQ_CST) & DRV_ACTIVE) != DRV_ACTIVE)
+        return;
+
+    sem_wait(driver->m_ready_sem, NULL);
+}
+
+/*!
+ * @brief: Block until @driver is ready for messages
+ *
+ * Every waiter takes the count of the ready semaphore and puts it right back, so the
+ * next waiter (or anyone coming after us) passes through as well. After that, we still
+ * need to wait for whoever is holding the driver right now
+ */
+int driver_wait_ready(driver_t* driver)
+{
+    if (!driver || !driver->m_ready_sem)
+        return -KERR_INVAL;
+
+    if (!driver_is_active(driver)) {
+        if (sem_wait(driver->m_ready_sem, NULL))
+            return -KERR_INVAL;
+
+        sem_post(driver->m_ready_sem);
+    }
+
+    mutex_lock(driver->m_lock);
+    mutex_unlock(driver->m_lock);
+
+    return 0;
+}
+
 /*
  * Quick TODO: create a way to validate pointer origin
  */
@@ -163,7 +216,7 @@ int generic_driver_entry(driver_t* driver)
 
     if (!error) {
         /* Init finished, the driver is ready for messages */
-        driver->m_flags |= DRV_ACTIVE;
+        driver_mark_ready(driver);
     } else {
         driver->m_flags |= DRV_FAILED;
     }
@@ -184,7 +237,8 @@ kerror_t bootstrap_driver(driver_t* driver)
     }
 
     /* Preemptively set the driver to inactive */
-    driver->m_flags &= ~(DRV_ACTIVE | DRV_FAILED);
+    __driver_clear_ready(driver);
+    driver->m_flags &= ~DRV_FAILED;
 
     // NOTE: if the drivers port is not valid, the subsystem will verify
     // it and provide a new port, so we won't have to wory about that here
@@ -235,6 +289,8 @@ driver_t* create_driver(aniva_driver_t* handle)
     memset(ret, 0, sizeof(*ret));
 
     ret->m_lock = create_mutex(NULL);
+    ret->m_load_lock = create_mutex(NULL);
+    ret->m_ready_sem = create_semaphore(1, 0, 1);
     ret->m_handle = handle;
 
     ret->m_flags = NULL;
@@ -315,6 +371,8 @@ void destroy_driver(driver_t* driver)
     }
 
     destroy_mutex(driver->m_lock);
+    destroy_mutex(driver->m_load_lock);
+    destroy_semaphore(driver->m_ready_sem);
 
     /* A driver might exist without any dependencies */
     if (driver->m_dep_list)
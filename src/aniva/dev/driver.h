@@ -11,6 +11,7 @@ struct oss_obj;
 struct device;
 struct dgroup;
 struct driver;
+struct semaphore;
 
 /*
  * Every type of driver has a version
@@ -131,6 +132,9 @@ typedef struct aniva_driver {
 bool driver_is_ready(struct driver* driver);
 bool driver_is_busy(struct driver* driver);
 
+void driver_mark_ready(struct driver* driver);
+int driver_wait_ready(struct driver* driver);
+
 int drv_read(struct driver* driver, void* buffer, size_t* buffer_size, uintptr_t offset);
 int drv_write(struct driver* driver, void* buffer, size_t* buffer_size, uintptr_t offset);
 
@@ -191,6 +195,10 @@ typedef struct driver {
     driver_version_t m_check_version;
 
     mutex_t* m_lock;
+    /* Held while the driver is being loaded, so it only gets loaded once at a time */
+    mutex_t* m_load_lock;
+    /* Posted once the driver goes active. Anyone waiting for that blocks on this */
+    struct semaphore* m_ready_sem;
 
     /* Url of the installed driver */
     dev_url_t m_url;
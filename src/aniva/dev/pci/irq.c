@@ -1,3 +1,5 @@
+#include "irq/interrupts.h"
+#include "libk/flow/error.h"
 #include "pci.h"
 
 /*!
@@ -9,10 +11,49 @@
  *  - I/O Apic
  *  - Regular dual PIC
  *
- * TODO
+ * Right now we only route the legacy INTx pin, through the interrupt line firmware programmed into
+ * the config space. INTx lines are level triggered and often shared between devices, so handlers
+ * need to check if the interrupt was meant for them and always let the next handler have a look.
+ *
+ * TODO: MSI(-X)
  */
 int pci_device_allocate_irq(pci_device_t* device, uint32_t irq_flags, uint32_t handler_flags, void* handler, void* ctx, const char* desc)
 {
+    int error;
+
+    if (!device || !handler)
+        return -KERR_INVAL;
+
+    /* No INTx pin or firmware did not route it anywhere */
+    if (!device->interrupt_pin || device->interrupt_line == 0xff)
+        return -KERR_NODEV;
+
+    error = irq_allocate(device->interrupt_line, irq_flags | IRQ_FLAG_SHARED, handler_flags, handler, ctx, desc);
 
+    if (error)
+        return error;
+
+    /* Clear the INTx disable bit */
+    pci_set_interrupt_line(&device->address, true);
     return 0;
 }
+
+/*!
+ * @brief: Release an IRQ handler that was allocated with pci_device_allocate_irq
+ *
+ * @ctx needs to be the context the handler was allocated with, since the line may be shared
+ * with other instances of the same driver
+ */
+int pci_device_deallocate_irq(pci_device_t* device, void* handler, void* ctx)
+{
+    if (!device || !handler)
+        return -KERR_INVAL;
+
+    if (!device->interrupt_pin || device->interrupt_line == 0xff)
+        return -KERR_NODEV;
+
+    /* Stop the device from raising INTx before the handler goes away */
+    pci_set_interrupt_line(&device->address, false);
+
+    return irq_deallocate(device->interrupt_line, handler, ctx);
+}
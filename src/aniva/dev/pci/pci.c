@@ -32,6 +32,11 @@ struct pci_driver_link {
 };
 
 static struct pci_driver_link* __pci_drivers;
+/*
+ * Protects the driver list and the ->driver field of every device. Drivers register themselves
+ * from their f_init, which may run on any of the driver init workers at the same time
+ */
+static mutex_t* __pci_lock;
 
 #define FOREACH_PCI_DRIVER(i, drivers) for (struct pci_driver_link* i = drivers; i; i = i->next)
 
@@ -71,12 +76,23 @@ static bool __matches_pci_devid(pci_device_t* device, pci_dev_id_t id)
 
 /*
  * Try to see if there is a suitable device present for this driver to manage
- * NOTE: the caller may not have the drivers lock held on call
+ * NOTE: the caller may not have the drivers lock or __pci_lock held on call
  * FIXME: when the device already has a driver, we should try to determine whether to
  *        replace the old driver with this one...
  *
  * @returns: the amount of fitting devices found
  */
+static bool __matches_pci_devids(pci_device_t* device, pci_dev_id_t* ids)
+{
+    FOREACH_PCI_DEVID(i, ids)
+    {
+        if (__matches_pci_devid(device, *i))
+            return true;
+    }
+
+    return false;
+}
+
 static int __find_fitting_pci_devices(pci_driver_t* driver)
 {
     int probe_error;
@@ -99,28 +115,32 @@ static int __find_fitting_pci_devices(pci_driver_t* driver)
     {
         ret = i->data;
 
+        mutex_lock(__pci_lock);
+
         /* For now, skip any device that already has a driver, until we can choose one over the other */
-        if (ret->driver)
+        if (ret->driver || !__matches_pci_devids(ret, ids)) {
+            mutex_unlock(__pci_lock);
             continue;
+        }
 
-        FOREACH_PCI_DEVID(i, ids)
-        {
-            if (__matches_pci_devid(ret, *i)) {
-                /* Try to probe */
-                probe_error = driver->f_probe(ret, driver);
+        /* Claim the device, so nobody else probes it while we do */
+        ret->driver = driver;
 
-                if (!probe_error) {
-                    driver->device_count++;
-                    ret->driver = driver;
+        mutex_unlock(__pci_lock);
 
-                    /* Add the device to the driver */
-                    driver_add_dev(driver->driver, ret->dev);
-                    break;
-                }
-            }
+        probe_error = driver->f_probe(ret, driver);
 
-            probe_error = 0;
+        if (probe_error) {
+            mutex_lock(__pci_lock);
+            ret->driver = nullptr;
+            mutex_unlock(__pci_lock);
+            continue;
         }
+
+        driver->device_count++;
+
+        /* Add the device to the driver */
+        driver_add_dev(driver->driver, ret->dev);
     }
 
     mutex_unlock(driver->lock);
@@ -137,11 +157,15 @@ static int __add_pci_driver(pci_driver_t* driver)
 {
     struct pci_driver_link** slot;
 
+    mutex_lock(__pci_lock);
+
     slot = __find_pci_driver(driver);
 
     /* Does it exists? */
-    if (*slot)
+    if (*slot) {
+        mutex_unlock(__pci_lock);
         return -1;
+    }
 
     /* Link the driver before we find a fitting device */
     *slot = kzalloc(sizeof(struct pci_driver_link));
@@ -149,6 +173,8 @@ static int __add_pci_driver(pci_driver_t* driver)
     (*slot)->this = driver;
     (*slot)->next = nullptr;
 
+    mutex_unlock(__pci_lock);
+
     /* A driver may just know of itself that it should not prompt a rescan here */
     if ((driver->device_flags & PCI_DEV_FLAG_NO_RESCAN) == PCI_DEV_FLAG_NO_RESCAN)
         return 0;
@@ -172,6 +198,8 @@ static int __remove_pci_driver(pci_driver_t* driver)
     struct pci_driver_link** slot;
     struct pci_driver_link* to_remove;
 
+    mutex_lock(__pci_lock);
+
     slot = __find_pci_driver(driver);
 
     if (*slot) {
@@ -181,27 +209,29 @@ static int __remove_pci_driver(pci_driver_t* driver)
 
         *slot = to_remove->next;
 
+        mutex_unlock(__pci_lock);
+
         kzfree(to_remove, sizeof(struct pci_driver_link));
 
         return 0;
     }
 
+    mutex_unlock(__pci_lock);
     return -1;
 }
 
 static bool __has_pci_driver(pci_driver_t* driver)
 {
+    bool ret;
     struct pci_driver_link** link;
 
-    link = __find_pci_driver(driver);
+    mutex_lock(__pci_lock);
 
-    if (!(*link))
-        return false;
-
-    if (!(*link)->this)
-        return false;
+    link = __find_pci_driver(driver);
+    ret = (*link && (*link)->this);
 
-    return true;
+    mutex_unlock(__pci_lock);
+    return ret;
 }
 
 /*
@@ -228,35 +258,37 @@ static void __register_pci_device(pci_device_t* dev)
      * one that is more sophisticated and can thus be used far more
      */
 
+    mutex_lock(__pci_lock);
+
     /* Loop over every registered pci driver */
     FOREACH_PCI_DRIVER(i, __pci_drivers)
     {
         pci_driver_t* d = i->this;
 
-        /* Loop over their supported ids */
-        FOREACH_PCI_DEVID(dev_id, d->id_table)
-        {
-
-            /* Try to match */
-            if (__matches_pci_devid(dev, *dev_id)) {
-                probe_error = d->f_probe(dev, d);
-                fitting_driver = d;
-                break;
-            }
-        }
-
-        /* Have we found our driver? */
-        if (fitting_driver)
+        /* Try to match one of their supported ids */
+        if (__matches_pci_devids(dev, d->id_table)) {
+            fitting_driver = d;
             break;
+        }
     }
 
+    /* Claim it before we drop the lock for the probe */
+    dev->driver = fitting_driver;
+
+    mutex_unlock(__pci_lock);
+
     /* Yay, this pci device can be piloted by a fitting driver! */
-    if (fitting_driver && !probe_error) {
-        dev->driver = fitting_driver;
+    if (fitting_driver) {
+        probe_error = fitting_driver->f_probe(dev, fitting_driver);
+
+        if (probe_error)
+            dev->driver = nullptr;
     }
 
     /* Add the device */
+    mutex_lock(__pci_lock);
     list_append(__pci_devices, dev);
+    mutex_unlock(__pci_lock);
 }
 
 /* Default PCI callbacks */
@@ -1014,6 +1046,7 @@ void init_pci_early()
 
 bool init_pci()
 {
+    __pci_lock = create_mutex(NULL);
     __pci_drivers = nullptr;
     __pci_devices = init_list();
     __pci_bridges = init_list();
@@ -247,6 +247,7 @@ int pci_device_enable(pci_device_t* device);
 int pci_device_disable(pci_device_t* device);
 
 extern int pci_device_allocate_irq(pci_device_t* device, uint32_t irq_flags, uint32_t handler_flags, void* handler, void* ctx, const char* desc);
+extern int pci_device_deallocate_irq(pci_device_t* device, void* handler, void* ctx);
 
 #define PCI_DEVID_USE_VENDOR_ID (1 << 0)
 #define PCI_DEVID_USE_DEVICE_ID (1 << 1)
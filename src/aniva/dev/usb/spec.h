@@ -331,4 +331,7 @@ typedef struct usb_port_status {
 #define USB_FEATURE_C_PORT_OVER_CURRENT 19
 #define USB_FEATURE_C_PORT_RESET 20
 
+/* Endpoint feature selector */
+#define USB_FEATURE_ENDPOINT_HALT 0
+
 #endif // !__ANIVA_USB_SPECIFICATION__
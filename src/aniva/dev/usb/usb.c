@@ -546,6 +546,57 @@ int usb_device_submit_int(usb_device_t* device, usb_xfer_t** pxfer, int (*f_cb)(
     return _usb_submit_int(device->hcd, pxfer, f_cb, device, direct, (epb->desc.endpoint_address & USB_ENDPOINT_NUMBER_MASK), epb->desc.max_packet_size, epb->desc.interval, buffer, bsize);
 }
 
+/*!
+ * @brief: Do a bulk transfer on @epb of @device and wait for it to complete
+ *
+ * @p_transfered gets the amount of bytes that actually went over the wire, which may be less than
+ * @bsize on a short packet
+ */
+int usb_device_submit_bulk(usb_device_t* device, enum USB_XFER_DIRECTION direct, usb_endpoint_buffer_t* epb, void* buffer, size_t bsize, size_t* p_transfered)
+{
+    int error;
+    usb_xfer_t* xfer;
+
+    if (!device || !epb)
+        return -KERR_INVAL;
+
+    if (!buffer || !bsize)
+        return -KERR_INVAL;
+
+    error = init_bulk_xfer(&xfer, NULL, device, direct, (epb->desc.endpoint_address & USB_ENDPOINT_NUMBER_MASK), epb->desc.max_packet_size, buffer, bsize);
+
+    if (error)
+        return error;
+
+    error = usb_xfer_enqueue(xfer, device->hcd);
+
+    if (error)
+        goto dealloc_and_exit;
+
+    (void)usb_xfer_await_complete(xfer, NULL);
+
+    if (xfer->xfer_flags & USB_XFER_FLAG_ERROR)
+        error = -KERR_DEV;
+
+    if (p_transfered)
+        *p_transfered = (direct == USB_DIRECTION_DEVICE_TO_HOST) ? xfer->resp_transfer_size : xfer->req_tranfered_size;
+
+dealloc_and_exit:
+    release_usb_xfer(xfer);
+    return error;
+}
+
+/*!
+ * @brief: Clear the halt condition of an endpoint that stalled
+ */
+int usb_device_clear_halt(usb_device_t* device, usb_endpoint_buffer_t* epb)
+{
+    if (!device || !epb)
+        return -KERR_INVAL;
+
+    return usb_device_submit_ctl(device, USB_TYPE_STANDARD | USB_TYPE_EP_OUT, USB_REQ_CLEAR_FEATURE, USB_FEATURE_ENDPOINT_HALT, epb->desc.endpoint_address, 0, NULL, NULL);
+}
+
 int usb_device_set_address(usb_device_t* device, uint8_t addr)
 {
     int error;
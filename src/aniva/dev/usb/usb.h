@@ -113,6 +113,8 @@ int usb_device_reset_address(usb_device_t* device);
 
 int usb_device_submit_ctl(usb_device_t* device, uint8_t reqtype, uint8_t req, uint16_t value, uint16_t idx, uint16_t len, void* respbuf, uint32_t respbuf_len);
 int usb_device_submit_int(usb_device_t* device, usb_xfer_t** pxfer, int (*f_cb)(struct usb_xfer*), enum USB_XFER_DIRECTION direct, usb_endpoint_buffer_t* epb, void* buffer, size_t bsize);
+int usb_device_submit_bulk(usb_device_t* device, enum USB_XFER_DIRECTION direct, usb_endpoint_buffer_t* epb, void* buffer, size_t bsize, size_t* p_transfered);
+int usb_device_clear_halt(usb_device_t* device, usb_endpoint_buffer_t* epb);
 
 /*
  * TODO: Define the functions for handling transfers to specific endpoints on a device
@@ -119,6 +119,19 @@ int init_int_xfer(usb_xfer_t** pxfer, int (*f_cb)(struct usb_xfer*), struct usb_
     return 0;
 }
 
+int init_bulk_xfer(usb_xfer_t** pxfer, int (*f_cb)(struct usb_xfer*), struct usb_device* target, enum USB_XFER_DIRECTION direction, uint8_t endpoint, uint16_t max_pckt_size, void* buffer, size_t bsize)
+{
+    usb_xfer_t* xfer;
+
+    xfer = create_usb_xfer(target, f_cb, USB_BULK_XFER, direction, target->dev_addr, target->hub_addr, target->hub_port, endpoint, max_pckt_size, 0, buffer, bsize, buffer, bsize);
+
+    if (!xfer)
+        return -KERR_NOMEM;
+
+    *pxfer = xfer;
+    return 0;
+}
+
 /*
  * Manage the existance of the request object with a reference counter
  */
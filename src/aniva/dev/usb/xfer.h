@@ -103,6 +103,7 @@ usb_xfer_t* create_usb_xfer(struct usb_device* device, int (*f_cb)(struct usb_xf
 
 int init_ctl_xfer(usb_xfer_t** pxfer, struct usb_ctlreq* ctl, struct usb_device* target, uint8_t devaddr, uint8_t hubaddr, uint8_t hubport, uint8_t reqtype, uint8_t req, uint16_t value, uint16_t idx, uint16_t len, void* respbuf, uint32_t respbuf_len);
 int init_int_xfer(usb_xfer_t** pxfer, int (*f_cb)(struct usb_xfer*), struct usb_device* target, enum USB_XFER_DIRECTION direction, uint8_t endpoint, uint16_t max_pckt_size, uint8_t interval, void* buffer, size_t bsize);
+int init_bulk_xfer(usb_xfer_t** pxfer, int (*f_cb)(struct usb_xfer*), struct usb_device* target, enum USB_XFER_DIRECTION direction, uint8_t endpoint, uint16_t max_pckt_size, void* buffer, size_t bsize);
 
 /* Manage the existance of the request object with a reference counter */
 void get_usb_xfer(usb_xfer_t* req);
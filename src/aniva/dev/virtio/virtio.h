@@ -0,0 +1,150 @@
+#ifndef __ANIVA_VIRTIO__
+#define __ANIVA_VIRTIO__
+
+#include <dev/pci/pci.h>
+#include <libk/stddef.h>
+
+struct virtqueue;
+
+#define VIRTIO_PCI_VENDOR_ID 0x1af4
+
+/*
+ * Transitional (legacy) devices use device ids 0x1000 - 0x103f, modern devices
+ * use 0x1040 + the virtio device type
+ */
+#define VIRTIO_PCI_LEGACY_DEVID_START 0x1000
+#define VIRTIO_PCI_LEGACY_DEVID_END 0x103f
+#define VIRTIO_PCI_MODERN_DEVID_BASE 0x1040
+
+/* Virtio device types */
+#define VIRTIO_DEV_TYPE_NET 1
+#define VIRTIO_DEV_TYPE_BLK 2
+
+/* Device status bits */
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+#define VIRTIO_STATUS_NEEDS_RESET 0x40
+#define VIRTIO_STATUS_FAILED 0x80
+
+/* Device-independent feature bits */
+#define VIRTIO_F_RING_INDIRECT_DESC 28
+#define VIRTIO_F_RING_EVENT_IDX 29
+#define VIRTIO_F_VERSION_1 32
+
+#define VIRTIO_FEATURE(bit) (1ULL << (bit))
+
+/* ISR status bits */
+#define VIRTIO_ISR_QUEUE 0x01
+#define VIRTIO_ISR_CONFIG 0x02
+
+/*
+ * Modern transport: PCI vendor capability that points to one of the config structures
+ */
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG 3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+#define VIRTIO_PCI_CAP_PCI_CFG 5
+
+#define VIRTIO_PCI_CAP_VNDR 0x09
+
+#define VIRTIO_PCI_CAP_CFG_TYPE 3
+#define VIRTIO_PCI_CAP_BAR 4
+#define VIRTIO_PCI_CAP_OFFSET 8
+#define VIRTIO_PCI_CAP_LENGTH 12
+#define VIRTIO_PCI_CAP_NOTIFY_MULT 16
+
+/* Modern transport: Common configuration structure offsets */
+#define VIRTIO_PCI_COMMON_DFSELECT 0
+#define VIRTIO_PCI_COMMON_DF 4
+#define VIRTIO_PCI_COMMON_GFSELECT 8
+#define VIRTIO_PCI_COMMON_GF 12
+#define VIRTIO_PCI_COMMON_MSIX 16
+#define VIRTIO_PCI_COMMON_NUMQ 18
+#define VIRTIO_PCI_COMMON_STATUS 20
+#define VIRTIO_PCI_COMMON_CFGGENERATION 21
+#define VIRTIO_PCI_COMMON_Q_SELECT 22
+#define VIRTIO_PCI_COMMON_Q_SIZE 24
+#define VIRTIO_PCI_COMMON_Q_MSIX 26
+#define VIRTIO_PCI_COMMON_Q_ENABLE 28
+#define VIRTIO_PCI_COMMON_Q_NOFF 30
+#define VIRTIO_PCI_COMMON_Q_DESCLO 32
+#define VIRTIO_PCI_COMMON_Q_DESCHI 36
+#define VIRTIO_PCI_COMMON_Q_AVAILLO 40
+#define VIRTIO_PCI_COMMON_Q_AVAILHI 44
+#define VIRTIO_PCI_COMMON_Q_USEDLO 48
+#define VIRTIO_PCI_COMMON_Q_USEDHI 52
+
+/* Legacy transport: I/O port register offsets inside BAR0 */
+#define VIRTIO_PCI_LEGACY_HOST_FEATURES 0
+#define VIRTIO_PCI_LEGACY_GUEST_FEATURES 4
+#define VIRTIO_PCI_LEGACY_QUEUE_PFN 8
+#define VIRTIO_PCI_LEGACY_QUEUE_SIZE 12
+#define VIRTIO_PCI_LEGACY_QUEUE_SEL 14
+#define VIRTIO_PCI_LEGACY_QUEUE_NOTIFY 16
+#define VIRTIO_PCI_LEGACY_STATUS 18
+#define VIRTIO_PCI_LEGACY_ISR 19
+/* Device config starts here when MSI-X is disabled (Which it always is for us) */
+#define VIRTIO_PCI_LEGACY_CONFIG 20
+
+/* Legacy devices want the queue address as a page frame number of this size */
+#define VIRTIO_PCI_LEGACY_QUEUE_ADDR_SHIFT 12
+
+/*
+ * A virtio device on the PCI bus
+ *
+ * Abstracts away the difference between the modern (capability based, MMIO) and the
+ * legacy (I/O port) transport. Device drivers only talk to this through the virtio_dev_*
+ * functions below
+ */
+typedef struct virtio_dev {
+    pci_device_t* pdev;
+
+    bool legacy;
+    u32 type;
+
+    /* Legacy: base of the I/O port range */
+    u16 io_base;
+
+    /* Modern: mapped config structures */
+    void* common_cfg;
+    void* notify_base;
+    u32 notify_off_mult;
+    void* isr;
+    void* device_cfg;
+
+    /* Mapped BARs, so we don't map a BAR twice when multiple caps point into it */
+    void* bars[PCI_STD_BAR_COUNT];
+    size_t bar_sizes[PCI_STD_BAR_COUNT];
+
+    /* Features that both we and the device agreed on */
+    u64 features;
+} virtio_dev_t;
+
+int init_virtio_dev(virtio_dev_t* vdev, pci_device_t* pdev);
+void destroy_virtio_dev(virtio_dev_t* vdev);
+
+static inline bool virtio_dev_has_feature(virtio_dev_t* vdev, u32 bit)
+{
+    return (vdev->features & VIRTIO_FEATURE(bit)) == VIRTIO_FEATURE(bit);
+}
+
+void virtio_dev_reset(virtio_dev_t* vdev);
+u8 virtio_dev_get_status(virtio_dev_t* vdev);
+void virtio_dev_add_status(virtio_dev_t* vdev, u8 status);
+int virtio_dev_negotiate_features(virtio_dev_t* vdev, u64 wanted);
+void virtio_dev_driver_ok(virtio_dev_t* vdev);
+u8 virtio_dev_read_isr(virtio_dev_t* vdev);
+
+u8 virtio_dev_cfg_read8(virtio_dev_t* vdev, u32 offset);
+u16 virtio_dev_cfg_read16(virtio_dev_t* vdev, u32 offset);
+u32 virtio_dev_cfg_read32(virtio_dev_t* vdev, u32 offset);
+u64 virtio_dev_cfg_read64(virtio_dev_t* vdev, u32 offset);
+
+u16 virtio_dev_get_queue_size(virtio_dev_t* vdev, u16 idx);
+int virtio_dev_activate_queue(virtio_dev_t* vdev, struct virtqueue* vq);
+void virtio_dev_notify(virtio_dev_t* vdev, struct virtqueue* vq);
+
+#endif // !__ANIVA_VIRTIO__
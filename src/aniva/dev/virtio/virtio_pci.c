@@ -0,0 +1,405 @@
+#include "dev/pci/definitions.h"
+#include "dev/virtio/virtqueue.h"
+#include "libk/flow/error.h"
+#include "libk/io.h"
+#include "logging/log.h"
+#include "mem/kmem.h"
+#include "virtio.h"
+#include <libk/string.h>
+
+/*!
+ * @brief: Map BAR @bar of the device, if we haven't done so already
+ */
+static void* __virtio_map_bar(virtio_dev_t* vdev, u8 bar)
+{
+    u32 bar_value, bar_hi;
+    paddr_t bar_addr;
+    size_t size;
+
+    if (bar >= PCI_STD_BAR_COUNT)
+        return nullptr;
+
+    if (vdev->bars[bar])
+        return vdev->bars[bar];
+
+    vdev->pdev->ops.read_dword(vdev->pdev, BAR0 + bar * sizeof(u32), &bar_value);
+
+    if (!is_bar_mem(bar_value))
+        return nullptr;
+
+    bar_addr = get_bar_address(bar_value);
+
+    if (is_bar_64bit(bar_value) && bar + 1 < PCI_STD_BAR_COUNT) {
+        vdev->pdev->ops.read_dword(vdev->pdev, BAR0 + (bar + 1) * sizeof(u32), &bar_hi);
+        bar_addr |= ((paddr_t)bar_hi << 32);
+    }
+
+    size = ALIGN_UP(pci_get_bar_size(vdev->pdev, bar), SMALL_PAGE_SIZE);
+
+    if (!size)
+        size = SMALL_PAGE_SIZE;
+
+    if (kmem_kernel_alloc(&vdev->bars[bar], bar_addr, size, 0, KMEM_FLAG_DMA | KMEM_FLAG_KERNEL))
+        return nullptr;
+
+    vdev->bar_sizes[bar] = size;
+    return vdev->bars[bar];
+}
+
+/*!
+ * @brief: Walk the vendor capabilities of the device to find the modern config structures
+ *
+ * Returns -KERR_NODEV when the device does not expose the modern interface, in which case
+ * we fall back to the legacy transport
+ */
+static int __virtio_pci_find_modern(virtio_dev_t* vdev)
+{
+    u8 pos, cap_id;
+    u8 cfg_type, bar;
+    u32 offset;
+    void* bar_base;
+    void** target;
+    pci_device_t* pdev = vdev->pdev;
+
+    if (!(pdev->status & PCI_STATUS_CAP_LIST))
+        return -KERR_NODEV;
+
+    pdev->ops.read_byte(pdev, CAPABILITIES_POINTER, &pos);
+
+    /* NOTE: 48 is the pci cap TTL */
+    for (u32 i = 0; i < 48 && pos >= 0x40; i++) {
+        pos &= ~3;
+
+        pdev->ops.read_byte(pdev, pos, &cap_id);
+
+        if (cap_id != VIRTIO_PCI_CAP_VNDR)
+            goto next;
+
+        pdev->ops.read_byte(pdev, pos + VIRTIO_PCI_CAP_CFG_TYPE, &cfg_type);
+        pdev->ops.read_byte(pdev, pos + VIRTIO_PCI_CAP_BAR, &bar);
+        pdev->ops.read_dword(pdev, pos + VIRTIO_PCI_CAP_OFFSET, &offset);
+
+        switch (cfg_type) {
+        case VIRTIO_PCI_CAP_COMMON_CFG:
+            target = &vdev->common_cfg;
+            break;
+        case VIRTIO_PCI_CAP_NOTIFY_CFG:
+            target = &vdev->notify_base;
+            pdev->ops.read_dword(pdev, pos + VIRTIO_PCI_CAP_NOTIFY_MULT, &vdev->notify_off_mult);
+            break;
+        case VIRTIO_PCI_CAP_ISR_CFG:
+            target = &vdev->isr;
+            break;
+        case VIRTIO_PCI_CAP_DEVICE_CFG:
+            target = &vdev->device_cfg;
+            break;
+        default:
+            target = nullptr;
+            break;
+        }
+
+        /* Only use the first cap of every type, as the spec recommends */
+        if (!target || *target)
+            goto next;
+
+        bar_base = __virtio_map_bar(vdev, bar);
+
+        if (bar_base)
+            *target = (u8*)bar_base + offset;
+    next:
+        pdev->ops.read_byte(pdev, pos + 1, &pos);
+    }
+
+    if (!vdev->common_cfg || !vdev->notify_base || !vdev->isr)
+        return -KERR_NODEV;
+
+    return 0;
+}
+
+static int __virtio_pci_init_legacy(virtio_dev_t* vdev)
+{
+    u32 bar0;
+
+    vdev->pdev->ops.read_dword(vdev->pdev, BAR0, &bar0);
+
+    if (!is_bar_io(bar0))
+        return -KERR_NODEV;
+
+    vdev->io_base = get_bar_address(bar0) & 0xffff;
+    vdev->legacy = true;
+    return 0;
+}
+
+/*!
+ * @brief: Initialize the transport for a virtio PCI device
+ *
+ * Prefers the modern interface and falls back to the legacy I/O port interface for
+ * transitional devices that don't have the vendor capabilities (or old hypervisors)
+ */
+int init_virtio_dev(virtio_dev_t* vdev, pci_device_t* pdev)
+{
+    if (!vdev || !pdev || pdev->vendor_id != VIRTIO_PCI_VENDOR_ID)
+        return -KERR_INVAL;
+
+    memset(vdev, 0, sizeof(*vdev));
+
+    vdev->pdev = pdev;
+
+    if (pdev->dev_id >= VIRTIO_PCI_MODERN_DEVID_BASE)
+        vdev->type = pdev->dev_id - VIRTIO_PCI_MODERN_DEVID_BASE;
+    else {
+        /* Transitional devices store the type in the subsystem id */
+        u16 subsys_id;
+
+        pdev->ops.read_word(pdev, SUBSYSTEM_ID, &subsys_id);
+        vdev->type = subsys_id;
+    }
+
+    pci_device_enable(pdev);
+
+    if (!__virtio_pci_find_modern(vdev))
+        goto reset_and_exit;
+
+    /* Modern-only devices must have the capabilities */
+    if (pdev->dev_id > VIRTIO_PCI_LEGACY_DEVID_END || __virtio_pci_init_legacy(vdev)) {
+        destroy_virtio_dev(vdev);
+        return -KERR_NODEV;
+    }
+
+    KLOG_DBG("virtio: Using legacy transport for device %x\n", pdev->dev_id);
+
+reset_and_exit:
+    virtio_dev_reset(vdev);
+    virtio_dev_add_status(vdev, VIRTIO_STATUS_ACKNOWLEDGE);
+    virtio_dev_add_status(vdev, VIRTIO_STATUS_DRIVER);
+    return 0;
+}
+
+void destroy_virtio_dev(virtio_dev_t* vdev)
+{
+    for (u32 i = 0; i < PCI_STD_BAR_COUNT; i++) {
+        if (!vdev->bars[i])
+            continue;
+
+        kmem_kernel_dealloc((vaddr_t)vdev->bars[i], vdev->bar_sizes[i]);
+        vdev->bars[i] = nullptr;
+    }
+}
+
+static inline void* __common(virtio_dev_t* vdev, u32 offset)
+{
+    return (u8*)vdev->common_cfg + offset;
+}
+
+u8 virtio_dev_get_status(virtio_dev_t* vdev)
+{
+    if (vdev->legacy)
+        return in8(vdev->io_base + VIRTIO_PCI_LEGACY_STATUS);
+
+    return mmio_read_byte(__common(vdev, VIRTIO_PCI_COMMON_STATUS));
+}
+
+static void __virtio_dev_set_status(virtio_dev_t* vdev, u8 status)
+{
+    if (vdev->legacy)
+        out8(vdev->io_base + VIRTIO_PCI_LEGACY_STATUS, status);
+    else
+        mmio_write_byte(__common(vdev, VIRTIO_PCI_COMMON_STATUS), status);
+}
+
+void virtio_dev_reset(virtio_dev_t* vdev)
+{
+    __virtio_dev_set_status(vdev, 0);
+
+    /* Modern devices signal reset completion by reading back zero */
+    if (!vdev->legacy)
+        while (virtio_dev_get_status(vdev))
+            udelay(10);
+}
+
+void virtio_dev_add_status(virtio_dev_t* vdev, u8 status)
+{
+    __virtio_dev_set_status(vdev, virtio_dev_get_status(vdev) | status);
+}
+
+void virtio_dev_driver_ok(virtio_dev_t* vdev)
+{
+    virtio_dev_add_status(vdev, VIRTIO_STATUS_DRIVER_OK);
+}
+
+static u64 __virtio_dev_get_features(virtio_dev_t* vdev)
+{
+    u64 ret;
+
+    if (vdev->legacy)
+        return in32(vdev->io_base + VIRTIO_PCI_LEGACY_HOST_FEATURES);
+
+    mmio_write_dword(__common(vdev, VIRTIO_PCI_COMMON_DFSELECT), 0);
+    ret = mmio_read_dword(__common(vdev, VIRTIO_PCI_COMMON_DF));
+    mmio_write_dword(__common(vdev, VIRTIO_PCI_COMMON_DFSELECT), 1);
+    ret |= (u64)mmio_read_dword(__common(vdev, VIRTIO_PCI_COMMON_DF)) << 32;
+
+    return ret;
+}
+
+static void __virtio_dev_set_features(virtio_dev_t* vdev, u64 features)
+{
+    if (vdev->legacy) {
+        out32(vdev->io_base + VIRTIO_PCI_LEGACY_GUEST_FEATURES, features & 0xffffffffUL);
+        return;
+    }
+
+    mmio_write_dword(__common(vdev, VIRTIO_PCI_COMMON_GFSELECT), 0);
+    mmio_write_dword(__common(vdev, VIRTIO_PCI_COMMON_GF), features & 0xffffffffUL);
+    mmio_write_dword(__common(vdev, VIRTIO_PCI_COMMON_GFSELECT), 1);
+    mmio_write_dword(__common(vdev, VIRTIO_PCI_COMMON_GF), features >> 32);
+}
+
+/*!
+ * @brief: Agree on a set of features with the device
+ *
+ * @wanted: The device specific features the driver would like to use. Transport features
+ * (Indirect descriptors, event index, version 1) are added here
+ */
+int virtio_dev_negotiate_features(virtio_dev_t* vdev, u64 wanted)
+{
+    u64 offered;
+
+    wanted |= VIRTIO_FEATURE(VIRTIO_F_RING_INDIRECT_DESC) | VIRTIO_FEATURE(VIRTIO_F_RING_EVENT_IDX);
+
+    /* Legacy devices only have 32 feature bits and don't know about version 1 */
+    if (vdev->legacy)
+        wanted &= 0xffffffffUL;
+    else
+        wanted |= VIRTIO_FEATURE(VIRTIO_F_VERSION_1);
+
+    offered = __virtio_dev_get_features(vdev);
+
+    vdev->features = offered & wanted;
+
+    /* We don't speak the legacy layout over the modern transport */
+    if (!vdev->legacy && !virtio_dev_has_feature(vdev, VIRTIO_F_VERSION_1))
+        return -KERR_NODEV;
+
+    __virtio_dev_set_features(vdev, vdev->features);
+
+    if (vdev->legacy)
+        return 0;
+
+    virtio_dev_add_status(vdev, VIRTIO_STATUS_FEATURES_OK);
+
+    /* Device may reject our subset */
+    if (!(virtio_dev_get_status(vdev) & VIRTIO_STATUS_FEATURES_OK)) {
+        virtio_dev_add_status(vdev, VIRTIO_STATUS_FAILED);
+        return -KERR_NODEV;
+    }
+
+    return 0;
+}
+
+u8 virtio_dev_read_isr(virtio_dev_t* vdev)
+{
+    /* Reading the ISR acknowledges the interrupt */
+    if (vdev->legacy)
+        return in8(vdev->io_base + VIRTIO_PCI_LEGACY_ISR);
+
+    return mmio_read_byte(vdev->isr);
+}
+
+u8 virtio_dev_cfg_read8(virtio_dev_t* vdev, u32 offset)
+{
+    if (vdev->legacy)
+        return in8(vdev->io_base + VIRTIO_PCI_LEGACY_CONFIG + offset);
+
+    return vdev->device_cfg ? mmio_read_byte((u8*)vdev->device_cfg + offset) : 0;
+}
+
+u16 virtio_dev_cfg_read16(virtio_dev_t* vdev, u32 offset)
+{
+    if (vdev->legacy)
+        return in16(vdev->io_base + VIRTIO_PCI_LEGACY_CONFIG + offset);
+
+    return vdev->device_cfg ? mmio_read_word((u8*)vdev->device_cfg + offset) : 0;
+}
+
+u32 virtio_dev_cfg_read32(virtio_dev_t* vdev, u32 offset)
+{
+    if (vdev->legacy)
+        return in32(vdev->io_base + VIRTIO_PCI_LEGACY_CONFIG + offset);
+
+    return vdev->device_cfg ? mmio_read_dword((u8*)vdev->device_cfg + offset) : 0;
+}
+
+/*!
+ * @brief: Read a 64-bit config field
+ *
+ * The device may change the config while we read it in two halves, so retry until
+ * the config generation stays stable
+ */
+u64 virtio_dev_cfg_read64(virtio_dev_t* vdev, u32 offset)
+{
+    u8 gen;
+    u64 ret;
+
+    if (vdev->legacy)
+        return virtio_dev_cfg_read32(vdev, offset) | ((u64)virtio_dev_cfg_read32(vdev, offset + 4) << 32);
+
+    do {
+        gen = mmio_read_byte(__common(vdev, VIRTIO_PCI_COMMON_CFGGENERATION));
+        ret = virtio_dev_cfg_read32(vdev, offset) | ((u64)virtio_dev_cfg_read32(vdev, offset + 4) << 32);
+    } while (gen != mmio_read_byte(__common(vdev, VIRTIO_PCI_COMMON_CFGGENERATION)));
+
+    return ret;
+}
+
+u16 virtio_dev_get_queue_size(virtio_dev_t* vdev, u16 idx)
+{
+    if (vdev->legacy) {
+        out16(vdev->io_base + VIRTIO_PCI_LEGACY_QUEUE_SEL, idx);
+        return in16(vdev->io_base + VIRTIO_PCI_LEGACY_QUEUE_SIZE);
+    }
+
+    if (idx >= mmio_read_word(__common(vdev, VIRTIO_PCI_COMMON_NUMQ)))
+        return 0;
+
+    mmio_write_word(__common(vdev, VIRTIO_PCI_COMMON_Q_SELECT), idx);
+    return mmio_read_word(__common(vdev, VIRTIO_PCI_COMMON_Q_SIZE));
+}
+
+/*!
+ * @brief: Tell the device where the rings of @vq live and enable the queue
+ */
+int virtio_dev_activate_queue(virtio_dev_t* vdev, virtqueue_t* vq)
+{
+    if (vdev->legacy) {
+        /* Legacy devices only take a single page frame number and compute the ring offsets themselves */
+        out16(vdev->io_base + VIRTIO_PCI_LEGACY_QUEUE_SEL, vq->idx);
+        out32(vdev->io_base + VIRTIO_PCI_LEGACY_QUEUE_PFN, vq->desc_dma >> VIRTIO_PCI_LEGACY_QUEUE_ADDR_SHIFT);
+        return 0;
+    }
+
+    mmio_write_word(__common(vdev, VIRTIO_PCI_COMMON_Q_SELECT), vq->idx);
+    mmio_write_word(__common(vdev, VIRTIO_PCI_COMMON_Q_SIZE), vq->size);
+
+    mmio_write_dword(__common(vdev, VIRTIO_PCI_COMMON_Q_DESCLO), vq->desc_dma & 0xffffffffUL);
+    mmio_write_dword(__common(vdev, VIRTIO_PCI_COMMON_Q_DESCHI), vq->desc_dma >> 32);
+    mmio_write_dword(__common(vdev, VIRTIO_PCI_COMMON_Q_AVAILLO), vq->avail_dma & 0xffffffffUL);
+    mmio_write_dword(__common(vdev, VIRTIO_PCI_COMMON_Q_AVAILHI), vq->avail_dma >> 32);
+    mmio_write_dword(__common(vdev, VIRTIO_PCI_COMMON_Q_USEDLO), vq->used_dma & 0xffffffffUL);
+    mmio_write_dword(__common(vdev, VIRTIO_PCI_COMMON_Q_USEDHI), vq->used_dma >> 32);
+
+    vq->notify_off = mmio_read_word(__common(vdev, VIRTIO_PCI_COMMON_Q_NOFF));
+
+    mmio_write_word(__common(vdev, VIRTIO_PCI_COMMON_Q_ENABLE), 1);
+    return 0;
+}
+
+void virtio_dev_notify(virtio_dev_t* vdev, virtqueue_t* vq)
+{
+    if (vdev->legacy) {
+        out16(vdev->io_base + VIRTIO_PCI_LEGACY_QUEUE_NOTIFY, vq->idx);
+        return;
+    }
+
+    mmio_write_word((u8*)vdev->notify_base + vq->notify_off * vdev->notify_off_mult, vq->idx);
+}
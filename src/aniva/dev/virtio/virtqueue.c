@@ -0,0 +1,316 @@
+#include "virtqueue.h"
+#include "libk/atomic.h"
+#include "libk/flow/error.h"
+#include "mem/heap.h"
+#include "mem/kmem.h"
+#include <libk/string.h>
+
+/*
+ * Ring layout (Same for both transports, since legacy devices dictate it):
+ *
+ * [ Descriptor table | Avail ring ] <pad to VIRTQ_ALIGN> [ Used ring ]
+ */
+static inline size_t __virtq_avail_offset(u16 size)
+{
+    return sizeof(virtq_desc_t) * size;
+}
+
+static inline size_t __virtq_used_offset(u16 size)
+{
+    /* flags + idx + ring + used_event */
+    return ALIGN_UP(__virtq_avail_offset(size) + sizeof(u16) * (3 + size), VIRTQ_ALIGN);
+}
+
+static inline size_t __virtq_mem_size(u16 size)
+{
+    /* flags + idx + ring + avail_event */
+    return ALIGN_UP(__virtq_used_offset(size) + sizeof(u16) * 3 + sizeof(virtq_used_elem_t) * size, VIRTQ_ALIGN);
+}
+
+static inline volatile u16* __virtq_used_event(virtqueue_t* vq)
+{
+    return &vq->avail->ring[vq->size];
+}
+
+static inline volatile u16* __virtq_avail_event(virtqueue_t* vq)
+{
+    return (volatile u16*)&vq->used->ring[vq->size];
+}
+
+/*!
+ * @brief: Allocate and activate virtqueue @idx of @vdev
+ *
+ * Modern devices let us shrink the queue, so we cap it to VIRTQ_MAX_SIZE. Legacy devices
+ * don't, so we need to use whatever they give us
+ */
+virtqueue_t* create_virtqueue(virtio_dev_t* vdev, u16 idx, f_virtq_complete_t f_complete)
+{
+    u16 size;
+    virtqueue_t* ret;
+
+    size = virtio_dev_get_queue_size(vdev, idx);
+
+    /* Queue does not exist */
+    if (!size)
+        return nullptr;
+
+    if (!vdev->legacy && size > VIRTQ_MAX_SIZE)
+        size = VIRTQ_MAX_SIZE;
+
+    ret = kmalloc(sizeof(*ret));
+
+    if (!ret)
+        return nullptr;
+
+    memset(ret, 0, sizeof(*ret));
+
+    ret->vdev = vdev;
+    ret->idx = idx;
+    ret->size = size;
+    ret->f_complete = f_complete;
+    ret->event_idx = virtio_dev_has_feature(vdev, VIRTIO_F_RING_EVENT_IDX);
+    ret->indirect = virtio_dev_has_feature(vdev, VIRTIO_F_RING_INDIRECT_DESC);
+    ret->ring_mem_size = __virtq_mem_size(size);
+
+    init_spinlock(&ret->lock, NULL);
+
+    ret->cookies = kmalloc(sizeof(void*) * size);
+
+    if (!ret->cookies)
+        goto free_and_exit;
+
+    memset(ret->cookies, 0, sizeof(void*) * size);
+
+    if (kmem_kernel_alloc_range(&ret->ring_mem, ret->ring_mem_size, 0, KMEM_FLAG_DMA))
+        goto free_cookies_and_exit;
+
+    memset(ret->ring_mem, 0, ret->ring_mem_size);
+
+    ret->desc = ret->ring_mem;
+    ret->avail = (volatile virtq_avail_t*)((u8*)ret->ring_mem + __virtq_avail_offset(size));
+    ret->used = (volatile virtq_used_t*)((u8*)ret->ring_mem + __virtq_used_offset(size));
+
+    ret->desc_dma = kmem_to_phys(nullptr, (vaddr_t)ret->desc);
+    ret->avail_dma = kmem_to_phys(nullptr, (vaddr_t)ret->avail);
+    ret->used_dma = kmem_to_phys(nullptr, (vaddr_t)ret->used);
+
+    /* Chain all descriptors into the free list */
+    for (u16 i = 0; i < size - 1; i++)
+        ret->desc[i].next = i + 1;
+
+    ret->free_head = 0;
+    ret->nr_free = size;
+
+    if (virtio_dev_activate_queue(vdev, ret))
+        goto dealloc_and_exit;
+
+    return ret;
+
+dealloc_and_exit:
+    kmem_kernel_dealloc((vaddr_t)ret->ring_mem, ret->ring_mem_size);
+free_cookies_and_exit:
+    kfree(ret->cookies);
+free_and_exit:
+    kfree(ret);
+    return nullptr;
+}
+
+void destroy_virtqueue(virtqueue_t* vq)
+{
+    kmem_kernel_dealloc((vaddr_t)vq->ring_mem, vq->ring_mem_size);
+    kfree(vq->cookies);
+    kfree(vq);
+}
+
+/*!
+ * @brief: Put a buffer chain on the avail ring
+ *
+ * When the device supports indirect descriptors and the caller supplies an indirect table, the
+ * whole chain only takes up a single descriptor in the ring. This means large requests don't starve
+ * the queue of descriptors. The caller must keep @indirect alive until the chain completes.
+ *
+ * This does not notify the device. Call virtqueue_kick after adding one or more chains
+ */
+int virtqueue_add(virtqueue_t* vq, virtq_sg_t* sgs, u32 nr_sgs, void* cookie, virtq_desc_t* indirect, paddr_t indirect_dma)
+{
+    u16 head;
+    u16 c_idx;
+    u16 prev;
+    virtq_desc_t* desc;
+
+    if (!vq || !sgs || !nr_sgs || !cookie)
+        return -KERR_INVAL;
+
+    /* Indirect tables are useless for a single buffer */
+    if (nr_sgs == 1 || !vq->indirect)
+        indirect = nullptr;
+
+    if (indirect) {
+        for (u32 i = 0; i < nr_sgs; i++) {
+            indirect[i].addr = sgs[i].addr;
+            indirect[i].len = sgs[i].len;
+            indirect[i].flags = (sgs[i].write ? VIRTQ_DESC_F_WRITE : 0) | ((i + 1 < nr_sgs) ? VIRTQ_DESC_F_NEXT : 0);
+            indirect[i].next = i + 1;
+        }
+    }
+
+    spinlock_lock(&vq->lock);
+
+    if (vq->nr_free < (indirect ? 1 : nr_sgs)) {
+        spinlock_unlock(&vq->lock);
+        return -KERR_NOMEM;
+    }
+
+    head = vq->free_head;
+
+    if (indirect) {
+        desc = &vq->desc[head];
+
+        desc->addr = indirect_dma;
+        desc->len = nr_sgs * sizeof(virtq_desc_t);
+        desc->flags = VIRTQ_DESC_F_INDIRECT;
+
+        vq->free_head = desc->next;
+        vq->nr_free--;
+    } else {
+        c_idx = head;
+        prev = head;
+
+        for (u32 i = 0; i < nr_sgs; i++) {
+            desc = &vq->desc[c_idx];
+
+            desc->addr = sgs[i].addr;
+            desc->len = sgs[i].len;
+            desc->flags = (sgs[i].write ? VIRTQ_DESC_F_WRITE : 0) | VIRTQ_DESC_F_NEXT;
+
+            prev = c_idx;
+            c_idx = desc->next;
+        }
+
+        /* Terminate the chain */
+        vq->desc[prev].flags &= ~VIRTQ_DESC_F_NEXT;
+
+        vq->free_head = c_idx;
+        vq->nr_free -= nr_sgs;
+    }
+
+    vq->cookies[head] = cookie;
+
+    vq->avail->ring[vq->avail->idx % vq->size] = head;
+
+    /* Descriptors must be visible before the index update */
+    mem_barier_write();
+
+    vq->avail->idx++;
+
+    spinlock_unlock(&vq->lock);
+    return 0;
+}
+
+/*!
+ * @brief: Check if the device wants to be notified about new buffers
+ *
+ * With event index suppression, the device tells us at which avail index it wants
+ * to be notified. If we moved past it since our last kick, we need to notify. Otherwise
+ * the device is still processing and will pick up our buffers by itself
+ */
+bool virtqueue_kick_prepare(virtqueue_t* vq)
+{
+    u16 old_idx;
+    u16 new_idx;
+    u16 event;
+    bool ret;
+
+    spinlock_lock(&vq->lock);
+
+    /* Make sure the avail index is visible before we look at the device's suppression state */
+    mem_barier_full();
+
+    old_idx = vq->last_kick_idx;
+    new_idx = vq->avail->idx;
+    vq->last_kick_idx = new_idx;
+
+    if (vq->event_idx) {
+        event = *__virtq_avail_event(vq);
+        ret = (u16)(new_idx - event - 1) < (u16)(new_idx - old_idx);
+    } else
+        ret = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+
+    spinlock_unlock(&vq->lock);
+    return ret;
+}
+
+void virtqueue_kick(virtqueue_t* vq)
+{
+    if (virtqueue_kick_prepare(vq))
+        virtio_dev_notify(vq->vdev, vq);
+}
+
+static void __virtqueue_free_chain(virtqueue_t* vq, u16 head)
+{
+    u16 c_idx;
+    u16 count;
+
+    c_idx = head;
+    count = 1;
+
+    /* Indirect chains only take a single descriptor in the ring */
+    while (vq->desc[c_idx].flags & VIRTQ_DESC_F_NEXT) {
+        c_idx = vq->desc[c_idx].next;
+        count++;
+    }
+
+    vq->desc[c_idx].next = vq->free_head;
+    vq->free_head = head;
+    vq->nr_free += count;
+}
+
+/*!
+ * @brief: Process any buffer chains the device has returned
+ *
+ * Calls the completion callback for every chain. Safe to call from both the IRQ handler
+ * and a polling waiter. Returns the number of chains we've processed
+ */
+u32 virtqueue_reap(virtqueue_t* vq)
+{
+    u32 ret;
+    u16 head;
+    u32 len;
+    void* cookie;
+    volatile virtq_used_elem_t* elem;
+
+    ret = 0;
+
+    spinlock_lock(&vq->lock);
+
+    while (vq->last_used_idx != vq->used->idx) {
+        /* Read the element only after we've seen the index */
+        mem_barier_read();
+
+        elem = &vq->used->ring[vq->last_used_idx % vq->size];
+        head = elem->id;
+        len = elem->len;
+
+        vq->last_used_idx++;
+
+        if (head >= vq->size)
+            continue;
+
+        cookie = vq->cookies[head];
+        vq->cookies[head] = nullptr;
+
+        __virtqueue_free_chain(vq, head);
+
+        if (cookie && vq->f_complete)
+            vq->f_complete(vq, cookie, len);
+
+        ret++;
+    }
+
+    /* Ask for an interrupt as soon as the next chain is used */
+    if (vq->event_idx)
+        *__virtq_used_event(vq) = vq->last_used_idx;
+
+    spinlock_unlock(&vq->lock);
+    return ret;
+}
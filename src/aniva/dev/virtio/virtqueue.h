@@ -0,0 +1,119 @@
+#ifndef __ANIVA_VIRTQUEUE__
+#define __ANIVA_VIRTQUEUE__
+
+#include "dev/virtio/virtio.h"
+#include "sync/spinlock.h"
+#include <libk/stddef.h>
+
+#define VIRTQ_DESC_F_NEXT 0x01
+#define VIRTQ_DESC_F_WRITE 0x02
+#define VIRTQ_DESC_F_INDIRECT 0x04
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 0x01
+#define VIRTQ_USED_F_NO_NOTIFY 0x01
+
+/* Never allocate more descriptors per queue than this, even if the device allows it */
+#define VIRTQ_MAX_SIZE 256
+
+/* Used and avail rings start on a new page for legacy devices */
+#define VIRTQ_ALIGN 4096
+
+typedef struct virtq_desc {
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+} __attribute__((packed)) virtq_desc_t;
+
+/*
+ * Driver -> device ring
+ *
+ * When VIRTIO_F_RING_EVENT_IDX is negotiated, ring[size] holds the used_event index
+ */
+typedef struct virtq_avail {
+    u16 flags;
+    u16 idx;
+    u16 ring[];
+} virtq_avail_t;
+
+typedef struct virtq_used_elem {
+    u32 id;
+    u32 len;
+} __attribute__((packed)) virtq_used_elem_t;
+
+/*
+ * Device -> driver ring
+ *
+ * When VIRTIO_F_RING_EVENT_IDX is negotiated, the u16 after ring[size] holds the avail_event index
+ */
+typedef struct virtq_used {
+    u16 flags;
+    u16 idx;
+    virtq_used_elem_t ring[];
+} virtq_used_t;
+
+/*
+ * A single chunk of physical memory that is part of a request
+ */
+typedef struct virtq_sg {
+    paddr_t addr;
+    u32 len;
+    /* Device writes into this buffer */
+    bool write;
+} virtq_sg_t;
+
+struct virtqueue;
+
+/* Called for every buffer chain the device hands back to us */
+typedef void (*f_virtq_complete_t)(struct virtqueue* vq, void* cookie, u32 len);
+
+/*
+ * A split virtqueue
+ */
+typedef struct virtqueue {
+    virtio_dev_t* vdev;
+
+    u16 idx;
+    u16 size;
+    /* Modern: Offset of this queues notify register in units of the notify multiplier */
+    u16 notify_off;
+
+    bool event_idx;
+    bool indirect;
+
+    void* ring_mem;
+    size_t ring_mem_size;
+    paddr_t desc_dma;
+    paddr_t avail_dma;
+    paddr_t used_dma;
+
+    virtq_desc_t* desc;
+    volatile virtq_avail_t* avail;
+    volatile virtq_used_t* used;
+
+    /* Head of the free descriptor chain and how many descriptors are in it */
+    u16 free_head;
+    u16 nr_free;
+
+    /* How far we've processed the used ring */
+    u16 last_used_idx;
+    /* Avail index at the time of the last notification (for event index suppression) */
+    u16 last_kick_idx;
+
+    /* Submitter cookies, indexed by the head descriptor of a chain */
+    void** cookies;
+
+    f_virtq_complete_t f_complete;
+
+    spinlock_t lock;
+} virtqueue_t;
+
+virtqueue_t* create_virtqueue(virtio_dev_t* vdev, u16 idx, f_virtq_complete_t f_complete);
+void destroy_virtqueue(virtqueue_t* vq);
+
+int virtqueue_add(virtqueue_t* vq, virtq_sg_t* sgs, u32 nr_sgs, void* cookie, virtq_desc_t* indirect, paddr_t indirect_dma);
+bool virtqueue_kick_prepare(virtqueue_t* vq);
+void virtqueue_kick(virtqueue_t* vq);
+u32 virtqueue_reap(virtqueue_t* vq);
+
+#endif // !__ANIVA_VIRTQUEUE__
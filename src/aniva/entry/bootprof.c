@@ -0,0 +1,141 @@
+#include "bootprof.h"
+#include "dev/debug/serial.h"
+#include "libk/kopts/parser.h"
+#include "logging/log.h"
+#include "mem/heap.h"
+#include "system/profile/profile.h"
+#include "system/sysvar/map.h"
+#include "time/core.h"
+#include <libk/string.h>
+#include <lightos/sysvar/shared.h>
+
+static bootprof_stage_t __stages[BOOTPROF_MAX_STAGES];
+static u32 __nr_stages;
+/* The very first timestamp we've seen */
+static u64 __boot_start;
+/* Set once the profile is published. We don't care about anything after that */
+static bool __bootprof_done;
+
+/*!
+ * @brief: Record a boot stage that started at @start and ended right now
+ *
+ * Can be called concurrently, every caller claims its own slot
+ */
+void bootprof_record(const char* name, u64 start)
+{
+    u32 idx;
+    u64 end;
+    bootprof_stage_t* stage;
+
+    if (__bootprof_done)
+        return;
+
+    end = read_tsc();
+
+    /* Only the first stage gets to set this */
+    if (!__boot_start)
+        __boot_start = start;
+
+    idx = __atomic_fetch_add(&__nr_stages, 1, __ATOMIC_RELAXED);
+
+    if (idx >= BOOTPROF_MAX_STAGES)
+        return;
+
+    stage = &__stages[idx];
+
+    strncpy(stage->name, name, BOOTPROF_NAME_LEN - 1);
+    stage->name[BOOTPROF_NAME_LEN - 1] = '\0';
+    stage->start = start;
+    stage->cycles = end - start;
+}
+
+/*!
+ * @brief: Sort the recorded stages, longest first
+ *
+ * Insertion sort is fine for the few hundred stages we can have
+ */
+static void __bootprof_sort(u32 nr_stages)
+{
+    bootprof_stage_t tmp;
+    u32 j;
+
+    for (u32 i = 1; i < nr_stages; i++) {
+        memcpy(&tmp, &__stages[i], sizeof(tmp));
+
+        for (j = i; j > 0 && __stages[j - 1].cycles < tmp.cycles; j--)
+            memcpy(&__stages[j], &__stages[j - 1], sizeof(tmp));
+
+        memcpy(&__stages[j], &tmp, sizeof(tmp));
+    }
+}
+
+static size_t __bootprof_fmt_stage(char* buffer, size_t bsize, const char* name, u64 cycles, u64 tsc_hz)
+{
+    if (tsc_hz)
+        sfmt_sz(buffer, bsize, "%s: %lld cycles (%lld us)\n", name, cycles, (cycles * 1000000) / tsc_hz);
+    else
+        sfmt_sz(buffer, bsize, "%s: %lld cycles\n", name, cycles);
+
+    return strlen(buffer);
+}
+
+/*!
+ * @brief: Publish the boot profile
+ *
+ * Called right before we leave the kernel boot sequence. The table is stored in the BOOT_PROFILE
+ * variable of the admin profile (as much of it as fits in a sysvar) and printed on serial
+ * if the 'bootprof' kopt is set
+ */
+void bootprof_finish()
+{
+    u32 nr_stages;
+    u64 tsc_hz;
+    u64 total;
+    size_t len;
+    size_t line_len;
+    char* table;
+    char line[128];
+    const bool do_print = kopts_get_bool("bootprof");
+
+    __bootprof_done = true;
+
+    nr_stages = __atomic_load_n(&__nr_stages, __ATOMIC_RELAXED);
+
+    if (nr_stages > BOOTPROF_MAX_STAGES)
+        nr_stages = BOOTPROF_MAX_STAGES;
+
+    total = read_tsc() - __boot_start;
+    tsc_hz = time_get_tsc_hz();
+
+    __bootprof_sort(nr_stages);
+
+    table = kmalloc(SYSVAR_MAX_LEN);
+
+    if (!table)
+        return;
+
+    len = __bootprof_fmt_stage(table, SYSVAR_MAX_LEN, "total", total, tsc_hz);
+
+    if (do_print) {
+        serial_println("[ BOOTPROF ] Boot stages, longest first:");
+        serial_print(table);
+    }
+
+    for (u32 i = 0; i < nr_stages; i++) {
+        line_len = __bootprof_fmt_stage(line, sizeof(line), __stages[i].name, __stages[i].cycles, tsc_hz);
+
+        if (do_print)
+            serial_print(line);
+
+        /* The sysvar needs room for the terminator on top of our own */
+        if (len + line_len + 2 > SYSVAR_MAX_LEN)
+            continue;
+
+        memcpy(&table[len], line, line_len + 1);
+        len += line_len;
+    }
+
+    sysvar_attach_ex(get_admin_profile()->node, BOOTPROF_VARKEY, PROFILE_TYPE_ADMIN, SYSVAR_TYPE_STRING, SYSVAR_FLAG_VOLATILE, table, len + 1);
+
+    kfree(table);
+}
@@ -0,0 +1,38 @@
+#ifndef __ANIVA_ENTRY_BOOTPROF__
+#define __ANIVA_ENTRY_BOOTPROF__
+
+#include "system/asm_specifics.h"
+#include <libk/stddef.h>
+
+/*
+ * Boot profiler
+ *
+ * Every stage of the boot sequence (and every driver init) gets timestamped with the TSC. When the
+ * kernel is done booting, the stages are sorted by how long they took and published in the
+ * BOOT_PROFILE sysvar of the admin profile. Passing the 'bootprof' kopt also dumps the table on serial.
+ */
+
+/* Max number of stages we keep track of. Anything after that is not recorded */
+#define BOOTPROF_MAX_STAGES 256
+#define BOOTPROF_NAME_LEN 32
+
+#define BOOTPROF_VARKEY "BOOT_PROFILE"
+
+typedef struct bootprof_stage {
+    char name[BOOTPROF_NAME_LEN];
+    u64 start;
+    u64 cycles;
+} bootprof_stage_t;
+
+void bootprof_record(const char* name, u64 start);
+void bootprof_finish();
+
+/* Time a single init call */
+#define BOOTPROF_STAGE(call)                       \
+    do {                                           \
+        u64 ___bootprof_start = read_tsc();        \
+        call;                                      \
+        bootprof_record(#call, ___bootprof_start); \
+    } while (0)
+
+#endif // !__ANIVA_ENTRY_BOOTPROF__
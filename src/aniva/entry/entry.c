@@ -1,4 +1,5 @@
 #include "entry.h"
+#include "entry/bootprof.h"
 #include "dev/core.h"
 #include "dev/debug/early_tty.h"
 #include "dev/device.h"
@@ -118,10 +119,10 @@ static kerror_t _start_early_if(struct multiboot_tag* mb_addr, uint32_t mb_magic
      */
 
     // Logging system asap
-    init_early_logging();
+    BOOTPROF_STAGE(init_early_logging());
 
     // First logger
-    init_serial();
+    BOOTPROF_STAGE(init_serial());
 
     /* Our fist hello to serial */
     KLOG_DBG("Hi from within (%s)\n", "Aniva");
@@ -149,10 +150,10 @@ static kerror_t _start_early_if(struct multiboot_tag* mb_addr, uint32_t mb_magic
 static kerror_t _start_system_management(void)
 {
     // parse multiboot
-    init_multiboot((void*)g_system_info.virt_multiboot_addr);
+    BOOTPROF_STAGE(init_multiboot((void*)g_system_info.virt_multiboot_addr));
 
     // init bootstrap processor
-    init_processor(&g_bsp, 0);
+    BOOTPROF_STAGE(init_processor(&g_bsp, 0));
 
     /*
      * bootstrap the kernel heap
@@ -163,26 +164,26 @@ static kerror_t _start_system_management(void)
      * ask it for bulk memory that we can then create a memory_allocator
      * from
      */
-    init_kheap();
+    BOOTPROF_STAGE(init_kheap());
 
     // we need memory
-    init_kmem((void*)g_system_info.virt_multiboot_addr);
+    BOOTPROF_STAGE(init_kmem((void*)g_system_info.virt_multiboot_addr));
 
     // Fully initialize logging right after the memory setup
-    init_logging();
+    BOOTPROF_STAGE(init_logging());
 
     // Initialize an early console
-    init_early_tty();
+    BOOTPROF_STAGE(init_early_tty());
 
     KLOG_INFO("Initialized tty\n");
 
     // Setup interrupts (Fault handlers and IRQ request framework)
-    init_interrupts();
+    BOOTPROF_STAGE(init_interrupts());
 
     KLOG_INFO("Initialized interrupts\n");
 
     // initialize cpu-related things that need the memorymanager and the heap
-    init_processor_late(&g_bsp);
+    BOOTPROF_STAGE(init_processor_late(&g_bsp));
 
     KLOG_INFO("Initialized processor late\n");
 
@@ -197,72 +198,72 @@ static kerror_t _start_system_management(void)
 static kerror_t _start_subsystems(void)
 {
     // we need more memory
-    init_zalloc();
+    BOOTPROF_STAGE(init_zalloc());
 
     KLOG_INFO("Initialized zalloc\n");
 
     // Initialize libk
-    init_libk();
+    BOOTPROF_STAGE(init_libk());
 
     KLOG_INFO("Initialized libk\n");
 
     /* Just kinda get them ready */
-    init_aniva_tests();
+    BOOTPROF_STAGE(init_aniva_tests());
 
     KLOG_INFO("Initialized aniva tests\n");
 
     // Initialize buffer
-    init_aniva_buffers();
+    BOOTPROF_STAGE(init_aniva_buffers());
 
     KLOG_INFO("Initialized aniva buffers\n");
 
     // Initialize kevent
-    init_kevents();
+    BOOTPROF_STAGE(init_kevents());
 
     KLOG_INFO("Initialized kevents\n");
 
     // Make sure we know how to access the PCI configuration space at this point
-    init_pci_early();
+    BOOTPROF_STAGE(init_pci_early());
 
     KLOG_INFO("Initialized pci space\n");
 
     /* Initialize OSS */
-    init_oss();
+    BOOTPROF_STAGE(init_oss());
 
     KLOG_INFO("Initialized oss\n");
 
     /* Initialize the filesystem core */
-    init_fs_core();
+    BOOTPROF_STAGE(init_fs_core());
 
     KLOG_INFO("Initialized fs core\n");
 
     /* Init the infrastructure needed for drivers */
-    init_driver_subsys();
+    BOOTPROF_STAGE(init_driver_subsys());
 
     KLOG_INFO("Initialized drivers\n");
 
     /* Init the kernel device subsystem */
-    init_devices();
+    BOOTPROF_STAGE(init_devices());
 
     KLOG_INFO("Initialized devices\n");
 
     /* Initialize global disk device subsystem */
-    init_volumes();
+    BOOTPROF_STAGE(init_volumes());
 
     KLOG_INFO("Initialized volumes\n");
 
     /* Initialize the video subsystem */
-    init_video();
+    BOOTPROF_STAGE(init_video());
 
     KLOG_INFO("Initialized video\n");
 
     /* Initialize HID driver subsystem */
-    init_hid();
+    BOOTPROF_STAGE(init_hid());
 
     KLOG_INFO("Initialized HID\n");
 
     /* Initialize the USB subsystem */
-    init_usb();
+    BOOTPROF_STAGE(init_usb());
 
     KLOG_INFO("Initialized subsystems\n");
 
@@ -321,22 +322,22 @@ NOINLINE void __init _start(struct multiboot_tag* mb_addr, uint32_t mb_magic)
     ASSERT_MSG(kinit_err == KERR_NONE, "Stage 2 of the kernel init failed for some reason =(");
 
     /* Initialize the ACPI subsystem */
-    init_acpi();
+    BOOTPROF_STAGE(init_acpi());
 
     /* Initialize the PCI subsystem after ACPI */
-    init_pci();
+    BOOTPROF_STAGE(init_pci());
 
     /* Initialize the timer system */
-    init_timer_system();
+    BOOTPROF_STAGE(init_timer_system());
 
     /* Initialize the subsystem responsible for managing processes */
-    init_proc_core();
+    BOOTPROF_STAGE(init_proc_core());
 
     /* Initialize the kernel idle process */
-    init_kernel_idle();
+    BOOTPROF_STAGE(init_kernel_idle());
 
     /* Initialize scheduler on the bsp */
-    init_scheduler(0);
+    BOOTPROF_STAGE(init_scheduler(0));
 
     root_proc = create_kernel_proc(kthread_entry, NULL);
 
@@ -374,6 +375,9 @@ void kthread_entry(void)
     /* Make sure the scheduler won't ruin our day */
     // pause_scheduler();
 
+    /* We have a process and a scheduler now, so logs can be drained asynchronously */
+    BOOTPROF_STAGE(init_log_drain());
+
     /*
      * Install and load initial drivers
      * NOTE: arch specific devices like APIC, PIT, RTC, etc. are initialized
@@ -387,32 +391,32 @@ void kthread_entry(void)
      * Load in-kernel drivers -> Mount ramdisk -> Load device drivers from Root/System -> Load disk devices and find our rootdevice
      * -> Move the ramdisk to Initrd/ -> Mount the rootdevice to Root/ -> Lock system parts of the rootdevice -> Load userspace
      */
-    init_aniva_driver_registry();
+    BOOTPROF_STAGE(init_aniva_driver_registry());
 
     /* Try to fetch the initrd which we can mount initial root to */
-    try_fetch_initramdisk();
+    BOOTPROF_STAGE(try_fetch_initramdisk());
 
     /* Initialize the ramdisk as our initial root */
-    init_root_ram_volume();
+    BOOTPROF_STAGE(init_root_ram_volume());
 
     /* Initialize hardware (device.c) */
-    init_hw();
+    BOOTPROF_STAGE(init_hw());
 
     /* Scan for pci devices and initialize any matching drivers */
-    init_pci_drivers();
+    BOOTPROF_STAGE(init_pci_drivers());
 
     /* Probe for a root device */
-    init_root_volume();
+    BOOTPROF_STAGE(init_root_volume());
 
     /*
      * Late environment stuff right before we are done bootstrapping kernel systems
      */
 
     /* (libk/bin/elf.c): Load the driver for dynamic executables */
-    init_dynamic_loader();
+    BOOTPROF_STAGE(init_dynamic_loader());
 
     /* Do late initialization of the default profiles */
-    init_profiles_late();
+    BOOTPROF_STAGE(init_profiles_late());
 
     /* Allocate a quick buffer for our init process */
     driver_t* drv;
@@ -428,6 +432,9 @@ void kthread_entry(void)
         SYSVAR_VEC_END,
     };
 
+    /* Everything up to here is kernel boot, so publish how long that took */
+    bootprof_finish();
+
     /* Execute the buffer */
     ASSERT_MSG(proc_exec(init_buffer, vec, get_admin_profile(), PROC_KERNEL | PROC_SYNC) != nullptr, "Failed to launch init process");
 
@@ -1,10 +1,12 @@
 #include "cache.h"
+#include "dev/disk/blkqueue.h"
 #include "dev/disk/volume.h"
 #include "fs/core.h"
 #include "fs/fat/core.h"
 #include "fs/fat/file.h"
 #include "fs/file.h"
 #include "libk/flow/error.h"
+#include "logging/log.h"
 #include "mem/heap.h"
 #include "mem/kmem.h"
 #include "sync/mutex.h"
@@ -63,6 +65,9 @@ void destroy_fat_info(oss_node_t* node)
     if (info->sector_cache)
         destroy_fat_sector_cache(info->sector_cache);
 
+    if (info->ra_cache)
+        destroy_fat_ra_cache(info->ra_cache);
+
     destroy_mutex(info->fat_lock);
     zfree_fixed(&__fat_info_cache, info);
 
@@ -326,6 +331,9 @@ int fatfs_write(oss_node_t* node, void* buffer, size_t size, disk_offset_t offse
     info = GET_FAT_FSINFO(node);
     lba_size = info->sector_cache->blocksize;
 
+    /* Any prefetched copy of this range is stale now */
+    fat_ra_cache_invalidate(node, offset, size);
+
     while (current_offset < size) {
         current_block = (offset + current_offset) / lba_size;
         current_delta = (offset + current_offset) % lba_size;
@@ -382,6 +390,326 @@ int fatfs_flush(oss_node_t* node)
     return error;
 }
 
+/*!
+ * @brief: Create a cluster read-ahead cache
+ *
+ * @lss: The logical sector size of the volume. Clusters need to be made up of whole
+ * logical sectors, since we read them straight into the cache
+ */
+fat_ra_cache_t* create_fat_ra_cache(uint32_t cluster_size, uint32_t lss)
+{
+    uint32_t count;
+    fat_ra_cache_t* cache;
+
+    if (!cluster_size || !lss || (cluster_size % lss))
+        return nullptr;
+
+    count = FAT_RA_CACHE_SIZE / cluster_size;
+
+    if (count < FAT_RA_CACHE_MIN_ENTRIES)
+        count = FAT_RA_CACHE_MIN_ENTRIES;
+    if (count > FAT_RA_CACHE_MAX_ENTRIES)
+        count = FAT_RA_CACHE_MAX_ENTRIES;
+
+    cache = kmalloc(sizeof(*cache) + count * sizeof(fat_ra_entry_t));
+
+    if (!cache)
+        return nullptr;
+
+    memset(cache, 0, sizeof(*cache) + count * sizeof(fat_ra_entry_t));
+
+    cache->cluster_size = cluster_size;
+    cache->entry_count = count;
+
+    if (kmem_kernel_alloc_range((void**)&cache->buffers, (size_t)cluster_size * count, NULL, KMEM_FLAG_KERNEL | KMEM_FLAG_WRITABLE))
+        goto dealloc_and_exit;
+
+    cache->lock = create_mutex(NULL);
+
+    if (!cache->lock)
+        goto dealloc_buffers_and_exit;
+
+    for (uint32_t i = 0; i < count; i++)
+        cache->entries[i].buffer = &cache->buffers[i * cluster_size];
+
+    return cache;
+
+dealloc_buffers_and_exit:
+    kmem_kernel_dealloc((vaddr_t)cache->buffers, (size_t)cluster_size * count);
+dealloc_and_exit:
+    kfree(cache);
+    return nullptr;
+}
+
+/*!
+ * @brief: Drop an entry from the read-ahead cache
+ *
+ * If the entry is still in flight we need to wait for it, since the device is going to
+ * write into the entries buffer
+ */
+static void __fat_ra_drop_entry(fat_ra_cache_t* cache, fat_ra_entry_t* entry)
+{
+    if (entry->req) {
+        (void)blk_request_wait(entry->req);
+        release_blk_request(entry->req);
+    }
+
+    if (entry->cluster && !entry->used)
+        cache->nr_wasted++;
+
+    entry->req = nullptr;
+    entry->cluster = 0;
+    entry->used = false;
+}
+
+void destroy_fat_ra_cache(fat_ra_cache_t* cache)
+{
+    if (!cache)
+        return;
+
+    for (uint32_t i = 0; i < cache->entry_count; i++)
+        __fat_ra_drop_entry(cache, &cache->entries[i]);
+
+    KLOG_DBG("FAT read-ahead: %lld issued, %lld hits, %lld wasted\n", cache->nr_issued, cache->nr_hits, cache->nr_wasted);
+
+    destroy_mutex(cache->lock);
+    kmem_kernel_dealloc((vaddr_t)cache->buffers, (size_t)cache->cluster_size * cache->entry_count);
+    kfree(cache);
+}
+
+static fat_ra_entry_t* __fat_ra_find(fat_ra_cache_t* cache, uint32_t cluster)
+{
+    for (uint32_t i = 0; i < cache->entry_count; i++)
+        if (cache->entries[i].cluster == cluster)
+            return &cache->entries[i];
+
+    return nullptr;
+}
+
+/*!
+ * @brief: Find an entry we can put a new prefetch into
+ *
+ * Prefers unused entries, after that the least recently used entry that isn't in flight.
+ * Returns NULL when everything is still waiting on the device
+ */
+static fat_ra_entry_t* __fat_ra_find_victim(fat_ra_cache_t* cache)
+{
+    fat_ra_entry_t* c_entry;
+    fat_ra_entry_t* victim;
+
+    victim = nullptr;
+
+    for (uint32_t i = 0; i < cache->entry_count; i++) {
+        c_entry = &cache->entries[i];
+
+        if (!c_entry->cluster)
+            return c_entry;
+
+        if (c_entry->req && !blk_request_is_done(c_entry->req))
+            continue;
+
+        if (!victim || c_entry->last_use < victim->last_use)
+            victim = c_entry;
+    }
+
+    if (victim)
+        __fat_ra_drop_entry(cache, victim);
+
+    return victim;
+}
+
+/*!
+ * @brief: Check if the sector cache holds dirty data in a range of the volume
+ */
+static bool __fat_sec_cache_is_dirty(oss_node_t* node, fat_sector_cache_t* cache, disk_offset_t offset, size_t size)
+{
+    uintptr_t start;
+    struct sec_cache_entry* c_entry;
+    uint32_t lss = oss_node_getfs(node)->m_device->info.logical_sector_size;
+
+    for (uint32_t i = 0; i < cache->cache_count; i++) {
+        c_entry = cache->entries[i];
+
+        if (!c_entry->is_dirty)
+            continue;
+
+        start = c_entry->current_block * lss;
+
+        if (start < offset + size && offset < start + cache->blocksize)
+            return true;
+    }
+
+    return false;
+}
+
+/*!
+ * @brief: Start prefetching the clusters of @file that back [offset, offset + size)
+ *
+ * Never blocks on the device. Clusters that are already cached, or that have dirty data
+ * in the sector cache, are skipped. A single call will only ever take up half the cache,
+ * so a prefetch can't evict clusters that a reader is just about to consume
+ */
+int fat_ra_cache_prefetch(oss_node_t* node, fat_file_t* file, uintptr_t offset, size_t size)
+{
+    uint32_t lss;
+    uint32_t cluster;
+    uintptr_t c_offset;
+    uintptr_t first, last;
+    volume_t* volume;
+    fat_fs_info_t* info;
+    fat_ra_cache_t* cache;
+    fat_ra_entry_t* entry;
+    blk_request_t* req;
+
+    info = GET_FAT_FSINFO(node);
+
+    if (!info || !info->ra_cache || !file || !file->clusterchain_buffer || !file->clusters_num || !size)
+        return -KERR_INVAL;
+
+    cache = info->ra_cache;
+    volume = oss_node_getfs(node)->m_device;
+    lss = volume->info.logical_sector_size;
+
+    first = offset / cache->cluster_size;
+    last = (offset + size - 1) / cache->cluster_size;
+
+    if (first >= file->clusters_num)
+        return -KERR_RANGE;
+
+    if (last >= file->clusters_num)
+        last = file->clusters_num - 1;
+
+    if (last - first >= (cache->entry_count >> 1))
+        last = first + (cache->entry_count >> 1) - 1;
+
+    mutex_lock(cache->lock);
+
+    for (uintptr_t i = first; i <= last; i++) {
+        cluster = file->clusterchain_buffer[i];
+
+        if (cluster < 2 || __fat_ra_find(cache, cluster))
+            continue;
+
+        c_offset = fat_cluster_to_offset(info, cluster);
+
+        if (__fat_sec_cache_is_dirty(node, info->sector_cache, c_offset, cache->cluster_size))
+            continue;
+
+        entry = __fat_ra_find_victim(cache);
+
+        if (!entry)
+            break;
+
+        /* Consecutive clusters get merged by the volume queue, so one call per cluster is fine */
+        req = volume_bread_async(volume, c_offset / lss, entry->buffer, cache->cluster_size / lss);
+
+        /* No queue on this volume (or it's shutting down). Don't bother */
+        if (!req)
+            break;
+
+        entry->cluster = cluster;
+        entry->req = req;
+        entry->used = false;
+        entry->last_use = ++cache->clock;
+
+        cache->nr_issued++;
+    }
+
+    mutex_unlock(cache->lock);
+    return 0;
+}
+
+/*!
+ * @brief: Try to read a part of a cluster from the read-ahead cache
+ *
+ * Returns 0 on a hit. On any error the caller should just go to the disk itself
+ */
+int fat_ra_cache_read(oss_node_t* node, uint32_t cluster, void* buffer, uint32_t offset, size_t size)
+{
+    int error;
+    fat_fs_info_t* info;
+    fat_ra_cache_t* cache;
+    fat_ra_entry_t* entry;
+
+    info = GET_FAT_FSINFO(node);
+
+    if (!info || !info->ra_cache)
+        return -KERR_INVAL;
+
+    cache = info->ra_cache;
+
+    if (offset + size > cache->cluster_size)
+        return -KERR_RANGE;
+
+    mutex_lock(cache->lock);
+
+    entry = __fat_ra_find(cache, cluster);
+
+    if (!entry) {
+        error = -KERR_NOT_FOUND;
+        goto unlock_and_exit;
+    }
+
+    if (entry->req) {
+        error = blk_request_wait(entry->req);
+
+        release_blk_request(entry->req);
+        entry->req = nullptr;
+
+        if (error) {
+            /* Nothing usable in here */
+            entry->cluster = 0;
+            goto unlock_and_exit;
+        }
+    }
+
+    memcpy(buffer, &entry->buffer[offset], size);
+
+    entry->used = true;
+    entry->last_use = ++cache->clock;
+
+    cache->nr_hits++;
+    error = 0;
+
+unlock_and_exit:
+    mutex_unlock(cache->lock);
+    return error;
+}
+
+/*!
+ * @brief: Drop any prefetched clusters that overlap a range of the volume
+ */
+void fat_ra_cache_invalidate(oss_node_t* node, disk_offset_t offset, size_t size)
+{
+    uintptr_t start;
+    fat_fs_info_t* info;
+    fat_ra_cache_t* cache;
+    fat_ra_entry_t* c_entry;
+
+    info = GET_FAT_FSINFO(node);
+
+    if (!info || !info->ra_cache)
+        return;
+
+    cache = info->ra_cache;
+
+    mutex_lock(cache->lock);
+
+    for (uint32_t i = 0; i < cache->entry_count; i++) {
+        c_entry = &cache->entries[i];
+
+        if (!c_entry->cluster)
+            continue;
+
+        start = fat_cluster_to_offset(info, c_entry->cluster);
+
+        if (start < offset + size && offset < start + cache->cluster_size)
+            __fat_ra_drop_entry(cache, c_entry);
+    }
+
+    mutex_unlock(cache->lock);
+}
+
 /*!
  * @brief: Allocates memory for a file under the FAT filesystem
  */
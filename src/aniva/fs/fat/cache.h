@@ -9,12 +9,14 @@
 #include "dev/disk/volume.h"
 #include "libk/flow/error.h"
 #include "oss/node.h"
+#include "sync/mutex.h"
 
 #define DEFAULT_SEC_CACHE_COUNT (8)
 #define MAX_SEC_CACHE_COUNT (8)
 
 struct fat_file;
 struct file;
+struct blk_request;
 enum FAT_FILE_TYPE;
 
 struct sec_cache_entry;
@@ -27,6 +29,46 @@ typedef struct {
     struct sec_cache_entry* entries[];
 } fat_sector_cache_t;
 
+/* How much memory we'd like to spend on prefetched clusters */
+#define FAT_RA_CACHE_SIZE (256 * Kib)
+#define FAT_RA_CACHE_MIN_ENTRIES (4)
+#define FAT_RA_CACHE_MAX_ENTRIES (64)
+
+typedef struct fat_ra_entry {
+    /* Absolute cluster number. Zero when this entry is unused */
+    uint32_t cluster;
+    /* Stamp of the last time someone touched this entry */
+    uint32_t last_use;
+    /* Did anyone read this cluster after it got prefetched */
+    bool used;
+    /* In-flight read. NULL once the data is in @buffer */
+    struct blk_request* req;
+    uint8_t* buffer;
+} fat_ra_entry_t;
+
+/*
+ * Cluster read-ahead cache
+ *
+ * Clusters in here got prefetched through the asynchronous volume queue when a file
+ * is read sequentially. Readers that hit an entry which is still in flight simply wait
+ * for the request to complete, which is still way shorter than issuing the read themselves
+ */
+typedef struct fat_ra_cache {
+    mutex_t* lock;
+    uint32_t cluster_size;
+    uint32_t entry_count;
+    uint32_t clock;
+    uint8_t* buffers;
+
+    /* Statistics */
+    uint64_t nr_issued;
+    uint64_t nr_hits;
+    /* Evicted before anyone read them */
+    uint64_t nr_wasted;
+
+    fat_ra_entry_t entries[];
+} fat_ra_cache_t;
+
 void init_fat_cache(void);
 
 kerror_t create_fat_info(oss_node_t* node, volume_t* device);
@@ -35,6 +77,13 @@ void destroy_fat_info(oss_node_t* node);
 fat_sector_cache_t* create_fat_sector_cache(uintptr_t block_size, uint32_t cache_count);
 void destroy_fat_sector_cache(fat_sector_cache_t* cache);
 
+fat_ra_cache_t* create_fat_ra_cache(uint32_t cluster_size, uint32_t lss);
+void destroy_fat_ra_cache(fat_ra_cache_t* cache);
+
+int fat_ra_cache_prefetch(oss_node_t* node, struct fat_file* file, uintptr_t offset, size_t size);
+int fat_ra_cache_read(oss_node_t* node, uint32_t cluster, void* buffer, uint32_t offset, size_t size);
+void fat_ra_cache_invalidate(oss_node_t* node, disk_offset_t offset, size_t size);
+
 int fatfs_read(oss_node_t* node, void* buffer, size_t size, disk_offset_t offset);
 int fatfs_write(oss_node_t* node, void* buffer, size_t size, disk_offset_t offset);
 int fatfs_flush(oss_node_t* node);
@@ -231,13 +231,15 @@ int fat32_read_clusters(oss_node_t* node, uint8_t* buffer, fat_file_t* file, uin
         if (current_delta > info->cluster_size - current_deviation)
             current_delta = info->cluster_size - current_deviation;
 
-        current_cluster_offset = (info->usable_clusters_start + (file->clusterchain_buffer[current_index] - 2) * info->boot_sector_copy.sectors_per_cluster)
-            * info->boot_sector_copy.sector_size;
+        /* Try to get it from any earlier read-ahead first */
+        if (fat_ra_cache_read(node, file->clusterchain_buffer[current_index], buffer + index, current_deviation, current_delta)) {
+            current_cluster_offset = fat_cluster_to_offset(info, file->clusterchain_buffer[current_index]);
 
-        error = fatfs_read(node, buffer + index, current_delta, current_cluster_offset + current_deviation);
+            error = fatfs_read(node, buffer + index, current_delta, current_cluster_offset + current_deviation);
 
-        if (error)
-            return -2;
+            if (error)
+                return -2;
+        }
 
         index += current_delta;
     }
@@ -1026,6 +1028,9 @@ oss_node_t* fat32_mount(fs_type_t* type, const char* mountpoint, volume_t* devic
     ffi->total_usable_sectors = oss_node_getfs(node)->m_total_blocks - ffi->total_reserved_sectors;
     ffi->cluster_count = ffi->total_usable_sectors / boot_sector->sectors_per_cluster;
     ffi->cluster_size = boot_sector->sectors_per_cluster * boot_sector->sector_size;
+
+    /* Not fatal, we'll just do without read-ahead */
+    ffi->ra_cache = create_fat_ra_cache(ffi->cluster_size, device->info.logical_sector_size);
     ffi->usable_sector_offset = boot_sector->reserved_sectors * boot_sector->sector_size;
     ffi->usable_clusters_start = (boot_sector->reserved_sectors + (boot_sector->fats * boot_sector->fat32.sectors_per_fat));
 
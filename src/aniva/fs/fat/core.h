@@ -202,11 +202,21 @@ typedef struct fat_fs_info {
     fat_boot_fsinfo_t boot_fs_info;
 
     fat_sector_cache_t* sector_cache;
+    /* May be NULL if the volume can't do asynchronous I/O */
+    fat_ra_cache_t* ra_cache;
 
 } fat_fs_info_t;
 
 #define GET_FAT_FSINFO(node) ((fat_fs_info_t*)(oss_node_getfs((node))->m_fs_priv))
 
+/*!
+ * @brief: Get the byte offset of a cluster on the volume
+ */
+static inline uintptr_t fat_cluster_to_offset(fat_fs_info_t* info, uint32_t cluster)
+{
+    return (info->usable_clusters_start + (cluster - 2) * info->boot_sector_copy.sectors_per_cluster) * info->boot_sector_copy.sector_size;
+}
+
 static inline bool is_fat32(fat_fs_info_t* finfo)
 {
     return (finfo->fat_type == FTYPE_FAT32);
@@ -38,6 +38,14 @@ static int fat_write(file_t* file, void* buffer, size_t* p_size, uintptr_t offse
     return fat32_write_clusters(file->m_obj->parent, buffer, file->m_private, offset, *p_size);
 }
 
+static int fat_readahead(file_t* file, uintptr_t offset, size_t size)
+{
+    if (!file || !file->m_obj)
+        return -KERR_INVAL;
+
+    return fat_ra_cache_prefetch(file->m_obj->parent, file->m_private, offset, size);
+}
+
 static int fat_sync(file_t* file)
 {
     if (!file || !file->m_obj)
@@ -61,6 +69,7 @@ file_ops_t fat_file_ops = {
     .f_read = fat_read,
     .f_write = fat_write,
     .f_sync = fat_sync,
+    .f_readahead = fat_readahead,
 };
 
 int fat_dir_destroy(dir_t* dir)
@@ -1,4 +1,5 @@
 #include "file.h"
+#include "logging/log.h"
 #include "mem/heap.h"
 #include "mem/page_dir.h"
 #include "oss/core.h"
@@ -8,6 +9,11 @@
 #include <libk/string.h>
 
 static int _file_close(file_t* file);
+
+/* Global read-ahead counters */
+static u64 __ra_nr_hits;
+static u64 __ra_nr_misses;
+static u64 __ra_nr_issued;
 file_t f_kmap(file_t* file, page_dir_t* dir, size_t size, uint32_t custom_flags, uint32_t page_flags);
 
 /*
@@ -163,6 +169,8 @@ file_t* create_file(struct oss_node* parent, uint32_t flags, const char* path)
     ret->m_buffer = nullptr;
     ret->m_buffer_size = 0;
 
+    memset(&ret->m_ra, 0, sizeof(ret->m_ra));
+
     return ret;
 
 exit_and_dealloc:
@@ -190,6 +198,88 @@ void destroy_file(file_t* file)
     kfree(file);
 }
 
+/*!
+ * @brief: Update the read-ahead state of @file after a read and prefetch if needed
+ *
+ * Called with the file lock held. We only issue a new read-ahead once the reader gets
+ * within half a window of the end of the previous one, so a sequential reader keeps the
+ * device busy without us calling into the filesystem on every read
+ */
+static void __file_update_readahead(file_t* file, uintptr_t offset, size_t size)
+{
+    uintptr_t end;
+    uintptr_t ra_start;
+    uintptr_t ra_end;
+    file_ra_state_t* ra = &file->m_ra;
+
+    end = offset + size;
+
+    if (ra->end > ra->start && offset >= ra->start && end <= ra->end) {
+        ra->nr_hits++;
+        __atomic_fetch_add(&__ra_nr_hits, 1, __ATOMIC_RELAXED);
+    } else {
+        ra->nr_misses++;
+        __atomic_fetch_add(&__ra_nr_misses, 1, __ATOMIC_RELAXED);
+    }
+
+    /* Random access. Collapse the window */
+    if (offset != ra->next_offset) {
+        ra->next_offset = end;
+        ra->window = 0;
+        ra->start = ra->end = 0;
+        return;
+    }
+
+    ra->next_offset = end;
+
+    if (!ra->window)
+        ra->window = FILE_RA_MIN_WINDOW;
+    else if (ra->window < FILE_RA_MAX_WINDOW)
+        ra->window <<= 1;
+
+    if (!file->m_ops->f_readahead || end >= file->m_total_size)
+        return;
+
+    /* Still far enough behind the previous read-ahead */
+    if (end + (ra->window >> 1) < ra->end)
+        return;
+
+    ra_start = (ra->end > end) ? ra->end : end;
+    ra_end = end + ra->window;
+
+    if (ra_end > file->m_total_size)
+        ra_end = file->m_total_size;
+
+    if (ra_end <= ra_start)
+        return;
+
+    if (file->m_ops->f_readahead(file, ra_start, ra_end - ra_start))
+        return;
+
+    /* Only the file lock is held here, so other files may bump these at the same time */
+    __atomic_fetch_add(&__ra_nr_issued, 1, __ATOMIC_RELAXED);
+
+    ra->start = end;
+    ra->end = ra_end;
+}
+
+/*!
+ * @brief: Get the global read-ahead counters
+ *
+ * @p_hits: Reads that were fully covered by an earlier read-ahead
+ * @p_misses: Reads that were not
+ * @p_issued: How many times we asked a filesystem to prefetch
+ */
+void file_get_ra_stats(u64* p_hits, u64* p_misses, u64* p_issued)
+{
+    if (p_hits)
+        *p_hits = __atomic_load_n(&__ra_nr_hits, __ATOMIC_RELAXED);
+    if (p_misses)
+        *p_misses = __atomic_load_n(&__ra_nr_misses, __ATOMIC_RELAXED);
+    if (p_issued)
+        *p_issued = __atomic_load_n(&__ra_nr_issued, __ATOMIC_RELAXED);
+}
+
 /*!
  * @brief: Read data from a file
  */
@@ -210,6 +300,9 @@ size_t file_read(file_t* file, void* buffer, size_t size, uintptr_t offset)
 
     error = file->m_ops->f_read(file, buffer, &size, offset);
 
+    if (!error && size)
+        __file_update_readahead(file, offset, size);
+
     mutex_unlock(file_obj->lock);
 
     if (error)
@@ -297,6 +390,9 @@ static int _file_close(file_t* file)
 
     mutex_lock(file_obj->lock);
 
+    if (file->m_ra.nr_hits)
+        KLOG_DBG("Closing %s (read-ahead: %d hits, %d misses)\n", file_obj->name, file->m_ra.nr_hits, file->m_ra.nr_misses);
+
     /* NOTE: the external close function should never kill the file object, just the internal buffers used by the filesystem */
     error = file->m_ops->f_close(file);
 
@@ -38,8 +38,37 @@ typedef struct file_ops {
      */
     int (*f_close)(struct file* file);
     int (*f_resize)(struct file* file, size_t new_size);
+    /*
+     * Hint that [offset, offset + size) is probably going to be read soon. The filesystem
+     * may start fetching it in the background, but must never block on the I/O here
+     */
+    int (*f_readahead)(struct file* file, uintptr_t offset, size_t size);
 } file_ops_t;
 
+/* Bounds of the read-ahead window */
+#define FILE_RA_MIN_WINDOW (16 * Kib)
+#define FILE_RA_MAX_WINDOW (128 * Kib)
+
+/*
+ * Sequential read-ahead state of a single file
+ *
+ * file_read checks if a read starts where the previous one ended. If it does, the window
+ * doubles (up to FILE_RA_MAX_WINDOW) and we ask the filesystem to prefetch past the read.
+ * Any seek collapses the window back to nothing
+ */
+typedef struct file_ra_state {
+    /* Where a sequential reader is expected to continue */
+    uintptr_t next_offset;
+    /* Range that was last handed to ->f_readahead */
+    uintptr_t start;
+    uintptr_t end;
+    size_t window;
+
+    /* Reads that were (or were not) covered by a previous read-ahead */
+    u32 nr_hits;
+    u32 nr_misses;
+} file_ra_state_t;
+
 #define FILE_READONLY (0x00000001)
 #define FILE_ORPHAN (0x00000002)
 
@@ -95,6 +124,8 @@ typedef struct file {
     size_t m_total_size;
     /* Logical size of the file */
     size_t m_logical_size;
+
+    file_ra_state_t m_ra;
 } file_t;
 
 file_t* create_file(struct oss_node* parent, uint32_t flags, const char* path);
@@ -106,6 +137,8 @@ size_t file_read(file_t* file, void* buffer, size_t size, uintptr_t offset);
 size_t file_write(file_t* file, void* buffer, size_t size, uintptr_t offset);
 int file_sync(file_t* file);
 
+void file_get_ra_stats(u64* p_hits, u64* p_misses, u64* p_issued);
+
 file_t* file_open(const char* path);
 file_t* file_open_from(struct oss_node* node, const char* path);
 int file_close(file_t* file);
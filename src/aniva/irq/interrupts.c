@@ -151,7 +151,13 @@ static inline void destroy_irq(irq_t* irq)
     memset(irq, 0, sizeof(*irq));
 }
 
-int irq_deallocate(uint32_t vec, void* handler)
+/*!
+ * @brief: Remove the handler @handler with context @ctx from the IRQ on @vec
+ *
+ * Shared lines can carry multiple instances of the same handler, which is why we match on @ctx
+ * as well. The vector only gets masked once its last handler is gone
+ */
+int irq_deallocate(uint32_t vec, void* handler, void* ctx)
 {
     int error;
     irq_t* irq;
@@ -166,34 +172,36 @@ int irq_deallocate(uint32_t vec, void* handler)
     /* Make sure no one fucks us */
     mutex_lock(_irq_lock);
 
-    /* Mask the irq so we don't catch any accidental interrupts */
-    irq_mask(irq);
+    target_handler = nullptr;
 
-    /* Clear out the entire irq */
-    if (!irq->handlers || !irq->handlers->next)
-        destroy_irq(irq);
-    else {
-        c_handler = &irq->handlers;
-        target_handler = nullptr;
-
-        do {
-            /* We looking for this handler? */
-            if ((*c_handler)->f_handle != handler)
-                goto cycle;
+    for (c_handler = &irq->handlers; *c_handler; c_handler = &(*c_handler)->next) {
+        /* We looking for this handler? */
+        if ((*c_handler)->f_handle != handler || (*c_handler)->ctx != ctx)
+            continue;
 
-            target_handler = *c_handler;
-            *c_handler = (*c_handler)->next;
+        target_handler = *c_handler;
+        *c_handler = target_handler->next;
 
-            kfree(target_handler);
-            break;
-        cycle:
-            c_handler = &(*c_handler)->next;
-        } while (*c_handler);
+        kfree(target_handler);
+        break;
+    }
 
-        if (!target_handler)
-            error = -KERR_INVAL;
+    if (!target_handler) {
+        error = -KERR_INVAL;
+        goto unlock_and_exit;
     }
 
+    /* Other handlers still listen on this line */
+    if (irq->handlers)
+        goto unlock_and_exit;
+
+    /* Mask the irq so we don't catch any accidental interrupts */
+    irq_mask(irq);
+
+    /* Clear out the entire irq */
+    destroy_irq(irq);
+
+unlock_and_exit:
     /* We're done =) */
     mutex_unlock(_irq_lock);
     return error;
@@ -108,7 +108,7 @@ typedef struct irq {
 } irq_t;
 
 int irq_allocate(uint32_t vec, uint32_t irq_flags, uint32_t handler_flags, void* handler, void* ctx, const char* desc);
-int irq_deallocate(uint32_t vec, void* handler);
+int irq_deallocate(uint32_t vec, void* handler, void* ctx);
 
 int irq_mask(irq_t* vec);
 int irq_unmask(irq_t* vec);
@@ -4,6 +4,8 @@
 #include "mem/heap.h"
 #include "mem/kmem.h"
 #include "mem/zalloc/zalloc.h"
+#include "system/asm_specifics.h"
+#include "tests/tests.h"
 #include <crypto/k_crc32.h>
 
 static zone_allocator_t* __hash_entry_allocator;
@@ -75,6 +77,321 @@ static uintptr_t __hashmap_hash_str(hashmap_key_t str)
     return hashmap_compute_key(_str);
 }
 
+/*
+ * Open addressing
+ *
+ * Every slot has a control byte. Free slots are either HASHMAP_CTRL_EMPTY or HASHMAP_CTRL_DELETED
+ * (both have the top bit set), used slots hold the lowest 7 bits of their hash (top bit clear).
+ * The rest of the hash picks the group where probing starts. Groups are probed in a triangular
+ * sequence, which visits every group exactly once when the number of groups is a power of two.
+ * A lookup can stop at the first group that still has an empty slot, since an insert would never
+ * have gone past it.
+ */
+#define HASHMAP_CTRL_EMPTY 0x80
+#define HASHMAP_CTRL_DELETED 0xfe
+
+#define HASHMAP_LSBS 0x0101010101010101ULL
+#define HASHMAP_MSBS 0x8080808080808080ULL
+
+/* Groups we move over from the old table on every mutation, while resizing */
+#define HASHMAP_MIGRATE_GROUPS 4
+
+static inline u8 __hashmap_h2(uintptr_t hash)
+{
+    return hash & 0x7f;
+}
+
+static inline size_t __hashmap_h1(uintptr_t hash)
+{
+    return hash >> 7;
+}
+
+static inline u64 __hashmap_group_load(const u8* ctrl)
+{
+    return *(const u64*)ctrl;
+}
+
+/*!
+ * @brief: Get a mask with the top bit set for every byte that matches @h2
+ *
+ * This may give false positives for bytes above a real match, which is fine since
+ * we compare the full hash anyway
+ */
+static inline u64 __hashmap_group_match(u64 group, u8 h2)
+{
+    u64 x = group ^ (HASHMAP_LSBS * h2);
+
+    return (x - HASHMAP_LSBS) & ~x & HASHMAP_MSBS;
+}
+
+/* EMPTY is the only control byte with the top bit set and bit 1 cleared */
+static inline u64 __hashmap_group_match_empty(u64 group)
+{
+    return group & (~group << 6) & HASHMAP_MSBS;
+}
+
+static inline u64 __hashmap_group_match_free(u64 group)
+{
+    return group & HASHMAP_MSBS;
+}
+
+/* Pop the index of the lowest matching byte from @mask */
+static inline u32 __hashmap_mask_next(u64* mask)
+{
+    u32 idx = __builtin_ctzll(*mask) >> 3;
+
+    *mask &= (*mask - 1);
+    return idx;
+}
+
+static inline size_t __hashmap_table_capacity(hashmap_table_t* table)
+{
+    return table->m_nr_groups * HASHMAP_GROUP_SIZE;
+}
+
+/* Keep a table at most 7/8 full (tombstones count) */
+static inline size_t __hashmap_table_max_load(hashmap_table_t* table)
+{
+    return __hashmap_table_capacity(table) - (__hashmap_table_capacity(table) >> 3);
+}
+
+static inline bool __hashmap_table_is_inline(hashmap_t* map, hashmap_table_t* table)
+{
+    return (table->m_ctrl == (u8*)&map->m_inline_ctrl);
+}
+
+static void __hashmap_init_inline_table(hashmap_t* map)
+{
+    map->m_table.m_ctrl = (u8*)&map->m_inline_ctrl;
+    map->m_table.m_slots = map->m_inline_slots;
+    map->m_table.m_nr_groups = 1;
+    map->m_table.m_nr_used = 0;
+    map->m_table.m_nr_deleted = 0;
+
+    memset(map->m_table.m_ctrl, HASHMAP_CTRL_EMPTY, HASHMAP_GROUP_SIZE);
+}
+
+static kerror_t __hashmap_alloc_table(hashmap_table_t* table, size_t nr_groups)
+{
+    size_t ctrl_size = nr_groups * HASHMAP_GROUP_SIZE;
+    u8* buffer;
+
+    /* Control bytes first, so they stay 8-byte aligned, then the slots */
+    buffer = kmalloc(ctrl_size + ctrl_size * sizeof(hashmap_slot_t));
+
+    if (!buffer)
+        return -KERR_NOMEM;
+
+    memset(buffer, HASHMAP_CTRL_EMPTY, ctrl_size);
+
+    table->m_ctrl = buffer;
+    table->m_slots = (hashmap_slot_t*)(buffer + ctrl_size);
+    table->m_nr_groups = nr_groups;
+    table->m_nr_used = 0;
+    table->m_nr_deleted = 0;
+    return 0;
+}
+
+static void __hashmap_free_table(hashmap_t* map, hashmap_table_t* table)
+{
+    if (table->m_ctrl && !__hashmap_table_is_inline(map, table))
+        kfree(table->m_ctrl);
+
+    memset(table, 0, sizeof(*table));
+}
+
+/*!
+ * @brief: Find the slot index of @hash in @table
+ *
+ * @returns: The slot index, or -1 if @hash is not in @table
+ */
+static ssize_t __hashmap_table_find(hashmap_table_t* table, uintptr_t hash)
+{
+    u64 group;
+    u64 match;
+    u32 slot_idx;
+    size_t group_idx;
+    const size_t group_mask = table->m_nr_groups - 1;
+    const u8 h2 = __hashmap_h2(hash);
+
+    if (!table->m_ctrl)
+        return -1;
+
+    group_idx = __hashmap_h1(hash) & group_mask;
+
+    for (size_t i = 0; i < table->m_nr_groups; i++) {
+        group = __hashmap_group_load(&table->m_ctrl[group_idx * HASHMAP_GROUP_SIZE]);
+        match = __hashmap_group_match(group, h2);
+
+        while (match) {
+            slot_idx = group_idx * HASHMAP_GROUP_SIZE + __hashmap_mask_next(&match);
+
+            if (table->m_slots[slot_idx].m_hash == hash)
+                return slot_idx;
+        }
+
+        if (__hashmap_group_match_empty(group))
+            return -1;
+
+        group_idx = (group_idx + i + 1) & group_mask;
+    }
+
+    return -1;
+}
+
+/*!
+ * @brief: Put @hash in the first free slot of its probe sequence
+ *
+ * Caller must make sure @hash isn't in the table yet and that the table has room
+ */
+static void __hashmap_table_insert(hashmap_table_t* table, uintptr_t hash, hashmap_value_t value)
+{
+    u64 match;
+    u32 slot_idx;
+    size_t group_idx;
+    const size_t group_mask = table->m_nr_groups - 1;
+
+    group_idx = __hashmap_h1(hash) & group_mask;
+
+    for (size_t i = 0; i < table->m_nr_groups; i++) {
+        match = __hashmap_group_match_free(__hashmap_group_load(&table->m_ctrl[group_idx * HASHMAP_GROUP_SIZE]));
+
+        if (match) {
+            slot_idx = group_idx * HASHMAP_GROUP_SIZE + __hashmap_mask_next(&match);
+
+            if (table->m_ctrl[slot_idx] == HASHMAP_CTRL_DELETED)
+                table->m_nr_deleted--;
+
+            table->m_ctrl[slot_idx] = __hashmap_h2(hash);
+            table->m_slots[slot_idx].m_hash = hash;
+            table->m_slots[slot_idx].m_value = value;
+            table->m_nr_used++;
+            return;
+        }
+
+        group_idx = (group_idx + i + 1) & group_mask;
+    }
+
+    kernel_panic("hashmap: Tried to insert into a full table");
+}
+
+/*!
+ * @brief: Free up slot @slot_idx of @table
+ *
+ * When the group of the slot still has an empty slot, no probe sequence ever went past it. In that
+ * case the slot can simply become empty again, instead of leaving a tombstone
+ */
+static void __hashmap_table_erase(hashmap_table_t* table, size_t slot_idx)
+{
+    size_t group_idx = slot_idx / HASHMAP_GROUP_SIZE;
+
+    if (__hashmap_group_match_empty(__hashmap_group_load(&table->m_ctrl[group_idx * HASHMAP_GROUP_SIZE])))
+        table->m_ctrl[slot_idx] = HASHMAP_CTRL_EMPTY;
+    else {
+        table->m_ctrl[slot_idx] = HASHMAP_CTRL_DELETED;
+        table->m_nr_deleted++;
+    }
+
+    table->m_slots[slot_idx].m_hash = 0;
+    table->m_slots[slot_idx].m_value = nullptr;
+    table->m_nr_used--;
+}
+
+/*!
+ * @brief: Move up to @nr_groups groups from the old table into the current one
+ *
+ * Frees the old table once it's empty
+ */
+static void __hashmap_migrate(hashmap_t* map, size_t nr_groups)
+{
+    size_t slot_idx;
+    hashmap_table_t* old = &map->m_old_table;
+
+    if (!old->m_ctrl)
+        return;
+
+    for (; nr_groups && map->m_migrate_group < old->m_nr_groups; nr_groups--, map->m_migrate_group++) {
+        for (u32 i = 0; i < HASHMAP_GROUP_SIZE; i++) {
+            slot_idx = map->m_migrate_group * HASHMAP_GROUP_SIZE + i;
+
+            if (old->m_ctrl[slot_idx] & HASHMAP_CTRL_EMPTY)
+                continue;
+
+            __hashmap_table_insert(&map->m_table, old->m_slots[slot_idx].m_hash, old->m_slots[slot_idx].m_value);
+
+            /* Leave a tombstone, so lookups in the old table still probe past this slot */
+            old->m_ctrl[slot_idx] = HASHMAP_CTRL_DELETED;
+            old->m_nr_used--;
+        }
+    }
+
+    if (map->m_migrate_group < old->m_nr_groups && old->m_nr_used)
+        return;
+
+    __hashmap_free_table(map, old);
+    map->m_migrate_group = 0;
+}
+
+/*!
+ * @brief: Make sure there is room for at least one more entry in the current table
+ *
+ * When the table is full, we start moving to a new table. Twice the size when the table is
+ * at least half full with live entries, the same size otherwise (that just gets rid of tombstones)
+ */
+static kerror_t __hashmap_reserve_open(hashmap_t* map)
+{
+    kerror_t error;
+    size_t nr_groups;
+    hashmap_table_t* table = &map->m_table;
+
+    if (table->m_nr_used + table->m_nr_deleted < __hashmap_table_max_load(table))
+        return 0;
+
+    /* Still busy with the last resize. Finish that one first */
+    if (map->m_old_table.m_ctrl)
+        __hashmap_migrate(map, map->m_old_table.m_nr_groups);
+
+    nr_groups = table->m_nr_groups;
+
+    if (table->m_nr_used >= (__hashmap_table_capacity(table) >> 1))
+        nr_groups <<= 1;
+
+    map->m_old_table = *table;
+    map->m_migrate_group = 0;
+
+    error = __hashmap_alloc_table(&map->m_table, nr_groups);
+
+    if (error) {
+        map->m_table = map->m_old_table;
+        memset(&map->m_old_table, 0, sizeof(map->m_old_table));
+        return error;
+    }
+
+    /* Get a head start, so small tables are done in one go */
+    __hashmap_migrate(map, HASHMAP_MIGRATE_GROUPS);
+    return 0;
+}
+
+/*!
+ * @brief: Find the slot of @hash in either of the tables
+ */
+static hashmap_slot_t* __hashmap_find_slot_open(hashmap_t* map, uintptr_t hash)
+{
+    ssize_t slot_idx;
+
+    slot_idx = __hashmap_table_find(&map->m_table, hash);
+
+    if (slot_idx >= 0)
+        return &map->m_table.m_slots[slot_idx];
+
+    slot_idx = __hashmap_table_find(&map->m_old_table, hash);
+
+    if (slot_idx >= 0)
+        return &map->m_old_table.m_slots[slot_idx];
+
+    return nullptr;
+}
+
 typedef struct hashmap_entry {
 
     /* The actual value stored at this address */
@@ -124,27 +441,17 @@ static void __destroy_hashmap_entry(hashmap_entry_t* entry)
 }
 
 /*
- * Compute the total size of the hashmap object based on its max size
- * and the flags
+ * Compute the total size of a closed addressing hashmap object based on its max size
  */
-static size_t __get_hashmap_size(size_t max_entries, uint32_t hm_flags)
+static size_t __get_hashmap_size(size_t max_entries)
 {
-    size_t hashmap_size = sizeof(hashmap_t);
-
-    if ((hm_flags & HASHMAP_FLAG_CA) == HASHMAP_FLAG_CA) {
-        hashmap_size += max_entries * sizeof(hashmap_entry_t);
-    } else {
-        hashmap_size += max_entries * sizeof(hashmap_value_t);
-    }
-
-    return hashmap_size;
+    return sizeof(hashmap_t) + max_entries * sizeof(hashmap_entry_t);
 }
 
 /*
- * Allocate kernel memory for the hashmap and initialize
- * its internals
+ * Allocate a closed addressing hashmap. These get all of their buckets up front
  */
-hashmap_t* create_hashmap(size_t max_entries, uint32_t flags)
+static hashmap_t* __create_hashmap_closed(size_t max_entries, uint32_t flags)
 {
     int error;
     hashmap_t* ret;
@@ -152,13 +459,7 @@ hashmap_t* create_hashmap(size_t max_entries, uint32_t flags)
     size_t aligned_size;
     uint32_t delta;
 
-    if (!max_entries)
-        return nullptr;
-
-    /* FIXME: implement open addressing */
-    flags |= HASHMAP_FLAG_CA;
-
-    hashmap_size = __get_hashmap_size(max_entries, flags);
+    hashmap_size = __get_hashmap_size(max_entries);
     aligned_size = ALIGN_UP(hashmap_size, SMALL_PAGE_SIZE);
 
     error = (kmem_kernel_alloc_range((void**)&ret, aligned_size, 0, KMEM_FLAG_WRITABLE | KMEM_FLAG_KERNEL));
@@ -172,10 +473,7 @@ hashmap_t* create_hashmap(size_t max_entries, uint32_t flags)
     delta = aligned_size - hashmap_size;
 
     /* We are able to claim this memory just for free entries, so lets take it =D */
-    if ((flags & HASHMAP_FLAG_CA) == HASHMAP_FLAG_CA)
-        max_entries += (delta / sizeof(hashmap_entry_t));
-    else
-        max_entries += (delta / sizeof(hashmap_value_t));
+    max_entries += (delta / sizeof(hashmap_entry_t));
 
     ret->m_flags = flags;
     ret->m_size = 0;
@@ -187,6 +485,42 @@ hashmap_t* create_hashmap(size_t max_entries, uint32_t flags)
     return ret;
 }
 
+/*
+ * Allocate kernel memory for the hashmap and initialize
+ * its internals
+ *
+ * Open addressing maps start out with their inline group and grow when they need to. @max_entries
+ * only limits their size when HASHMAP_FLAG_FS is set
+ */
+hashmap_t* create_hashmap(size_t max_entries, uint32_t flags)
+{
+    hashmap_t* ret;
+
+    if (!max_entries)
+        return nullptr;
+
+    if ((flags & HASHMAP_FLAG_CA) == HASHMAP_FLAG_CA)
+        return __create_hashmap_closed(max_entries, flags);
+
+    ret = kmalloc(sizeof(*ret));
+
+    if (!ret)
+        return nullptr;
+
+    memset(ret, 0, sizeof(*ret));
+
+    ret->m_flags = flags;
+    ret->m_size = 0;
+    ret->m_total_size = sizeof(*ret);
+    ret->m_max_entries = max_entries;
+
+    ret->f_hash_func = __hashmap_hash_str;
+
+    __hashmap_init_inline_table(ret);
+
+    return ret;
+}
+
 /*!
  * @brief: Make sure that the hashmap does not have lingering entries
  */
@@ -226,6 +560,14 @@ void destroy_hashmap(hashmap_t* map)
     if (!map)
         return;
 
+    if ((map->m_flags & HASHMAP_FLAG_CA) != HASHMAP_FLAG_CA) {
+        __hashmap_free_table(map, &map->m_old_table);
+        __hashmap_free_table(map, &map->m_table);
+
+        kfree(map);
+        return;
+    }
+
     __hashmap_cleanup(map);
     kmem_kernel_dealloc((vaddr_t)map, map->m_total_size);
 }
@@ -259,40 +601,33 @@ kerror_t hashmap_itterate(hashmap_t* map, void** p_itt_result, hashmap_itterate_
         return (0);
     }
 
-    for (uint64_t i = 0; i < map->m_max_entries; i++) {
-        hashmap_value_t v = map->m_list[i];
+    for (u32 t = 0; t < 2; t++) {
+        hashmap_table_t* table = t ? &map->m_old_table : &map->m_table;
 
-        if (!v)
+        if (!table->m_ctrl)
             continue;
 
-        error = fn(v, arg0, arg1);
+        for (uint64_t i = 0; i < __hashmap_table_capacity(table); i++) {
+            /* Free slot */
+            if (table->m_ctrl[i] & HASHMAP_CTRL_EMPTY)
+                continue;
 
-        /* On error, return the value that caused it */
-        if (error) {
-            if (p_itt_result)
-                *p_itt_result = v;
-            return error;
+            hashmap_value_t v = table->m_slots[i].m_value;
+
+            error = fn(v, arg0, arg1);
+
+            /* On error, return the value that caused it */
+            if (error) {
+                if (p_itt_result)
+                    *p_itt_result = v;
+                return error;
+            }
         }
     }
 
-    kernel_panic("TODO: implement hashmap_itterate for open shit");
     return (0);
 }
 
-/*
- * TODO
- * Attempt a resize of the hashmap this means:
- * 1) Find a region of memory large enough to fit the new map
- * 2) copy over the entries of the old map to the new map,
- *    in such a way that the hashing indecies don't get fucked
- * 3) Fixup pointers (?)
- */
-static kerror_t __hashmap_try_resize(hashmap_t* map)
-{
-    kernel_panic("TODO: implement __hashmap_try_resize");
-    return -1;
-}
-
 /*
  * Sort the closed entry buffer based on hash from low to high
 static kerror_t __hashmap_sort_closed_entry(hashmap_entry_t* root)
@@ -452,8 +787,25 @@ static kerror_t __hashmap_put_closed(hashmap_t* map, hashmap_key_t key, hashmap_
  */
 static kerror_t __hashmap_put_open(hashmap_t* map, hashmap_key_t key, hashmap_value_t value)
 {
-    kernel_panic("TODO: implement __hashmap_put_open");
-    return -1;
+    kerror_t error;
+    uintptr_t hash = map->f_hash_func(key);
+
+    /* Duplicate entry, fuck off */
+    if (__hashmap_find_slot_open(map, hash))
+        return -1;
+
+    error = __hashmap_reserve_open(map);
+
+    if (error)
+        return error;
+
+    /* Pay off a bit of the resize, if there's one going on */
+    __hashmap_migrate(map, HASHMAP_MIGRATE_GROUPS);
+
+    __hashmap_table_insert(&map->m_table, hash, value);
+
+    map->m_size++;
+    return 0;
 }
 
 /*
@@ -468,25 +820,20 @@ static kerror_t __hashmap_put_open(hashmap_t* map, hashmap_key_t key, hashmap_va
  */
 kerror_t hashmap_put(hashmap_t* map, hashmap_key_t key, hashmap_value_t value)
 {
-    kerror_t error;
-
     /* This implies we don't allow nullable values. KEEP THIS CONSISTENT */
     if (!map || !key || !value)
         return -1;
 
-    if (map->m_size >= map->m_max_entries) {
-
-        if (map->m_flags & HASHMAP_FLAG_FS)
+    if ((map->m_flags & HASHMAP_FLAG_CA) == HASHMAP_FLAG_CA) {
+        /* Closed addressing maps can't grow */
+        if (map->m_size >= map->m_max_entries)
             return -1;
 
-        error = __hashmap_try_resize(map);
-
-        if (error)
-            return error;
+        return __hashmap_put_closed(map, key, value);
     }
 
-    if ((map->m_flags & HASHMAP_FLAG_CA) == HASHMAP_FLAG_CA)
-        return __hashmap_put_closed(map, key, value);
+    if ((map->m_flags & HASHMAP_FLAG_FS) == HASHMAP_FLAG_FS && map->m_size >= map->m_max_entries)
+        return -1;
 
     return __hashmap_put_open(map, key, value);
 }
@@ -530,7 +877,14 @@ static hashmap_value_t __hashmap_get_closed(hashmap_t* map, hashmap_key_t key)
  */
 static hashmap_value_t __hashmap_get_open(hashmap_t* map, hashmap_key_t key)
 {
-    kernel_panic("TODO: implement __hashmap_get_open");
+    hashmap_slot_t* slot;
+
+    slot = __hashmap_find_slot_open(map, map->f_hash_func(key));
+
+    if (!slot)
+        return nullptr;
+
+    return slot->m_value;
 }
 
 /*
@@ -598,9 +952,20 @@ static kerror_t __hashmap_set_closed(hashmap_t* map, hashmap_value_t* b_old_valu
     return 0;
 }
 
-static kerror_t __hashmap_set_open(hashmap_t* map, hashmap_key_t key, hashmap_value_t value)
+static kerror_t __hashmap_set_open(hashmap_t* map, hashmap_value_t* b_old_value, hashmap_key_t key, hashmap_value_t value)
 {
-    kernel_panic("TODO: implement __hashmap_set_open");
+    hashmap_slot_t* slot;
+
+    slot = __hashmap_find_slot_open(map, map->f_hash_func(key));
+
+    if (!slot)
+        return -1;
+
+    if (b_old_value)
+        *b_old_value = slot->m_value;
+
+    slot->m_value = value;
+    return 0;
 }
 
 /*
@@ -615,7 +980,7 @@ kerror_t hashmap_set(hashmap_t* map, void** p_old_value, hashmap_key_t key, hash
     if ((map->m_flags & HASHMAP_FLAG_CA) == HASHMAP_FLAG_CA)
         return __hashmap_set_closed(map, (hashmap_value_t*)p_old_value, key, value);
 
-    return __hashmap_set_open(map, key, value);
+    return __hashmap_set_open(map, (hashmap_value_t*)p_old_value, key, value);
 }
 
 /*
@@ -696,8 +1061,32 @@ void* __hashmap_remove_closed(hashmap_t* map, hashmap_key_t key)
  */
 void* __hashmap_remove_open(hashmap_t* map, hashmap_key_t key)
 {
-    kernel_panic("TODO: implement __hashmap_remove_open");
-    return nullptr;
+    void* ret;
+    ssize_t slot_idx;
+    hashmap_table_t* table;
+    uintptr_t hash = map->f_hash_func(key);
+
+    table = &map->m_table;
+    slot_idx = __hashmap_table_find(table, hash);
+
+    if (slot_idx < 0) {
+        table = &map->m_old_table;
+        slot_idx = __hashmap_table_find(table, hash);
+    }
+
+    if (slot_idx < 0)
+        return nullptr;
+
+    ret = table->m_slots[slot_idx].m_value;
+
+    __hashmap_table_erase(table, slot_idx);
+
+    map->m_size--;
+
+    /* Pay off a bit of the resize, if there's one going on */
+    __hashmap_migrate(map, HASHMAP_MIGRATE_GROUPS);
+
+    return ret;
 }
 
 /*!
@@ -734,13 +1123,27 @@ int hashmap_to_array(hashmap_t* map, void*** array_ptr, size_t* size_ptr)
     if (!map->m_size)
         return -1;
 
-    /* Currently only works for closed addressing */
-    if ((map->m_flags & HASHMAP_FLAG_CA) != HASHMAP_FLAG_CA)
-        return -2;
-
     /* Allocate an array to fit our size */
     *array_ptr = kmalloc(*size_ptr);
 
+    if (!(*array_ptr))
+        return -1;
+
+    if ((map->m_flags & HASHMAP_FLAG_CA) != HASHMAP_FLAG_CA) {
+        for (u32 t = 0; t < 2; t++) {
+            hashmap_table_t* table = t ? &map->m_old_table : &map->m_table;
+
+            if (!table->m_ctrl)
+                continue;
+
+            for (uint64_t i = 0; i < __hashmap_table_capacity(table) && idx < map->m_size; i++)
+                if (!(table->m_ctrl[i] & HASHMAP_CTRL_EMPTY))
+                    (*array_ptr)[idx++] = table->m_slots[i].m_value;
+        }
+
+        return 0;
+    }
+
     for (uint64_t i = 0; i < map->m_max_entries; i++) {
         hashmap_entry_t* entry = (hashmap_entry_t*)map->m_list + i;
 
@@ -767,3 +1170,125 @@ void init_hashmap()
 
     ASSERT_MSG(__hash_entry_allocator, "Failed to create hashentry allocator!");
 }
+
+#define HASHMAP_TEST_NR_KEYS 512
+#define HASHMAP_TEST_ROUNDS 16
+
+static char __test_keys[HASHMAP_TEST_NR_KEYS][8];
+
+/*!
+ * @brief: Time put/get/remove rounds on @map
+ */
+static void __test_hashmap_time(hashmap_t* map, u64* p_put, u64* p_get, u64* p_remove)
+{
+    u64 start;
+
+    *p_put = *p_get = *p_remove = 0;
+
+    for (u32 r = 0; r < HASHMAP_TEST_ROUNDS; r++) {
+        start = read_tsc();
+
+        for (u32 i = 0; i < HASHMAP_TEST_NR_KEYS; i++)
+            hashmap_put(map, __test_keys[i], (void*)(u64)(i + 1));
+
+        *p_put += read_tsc() - start;
+        start = read_tsc();
+
+        for (u32 i = 0; i < HASHMAP_TEST_NR_KEYS; i++)
+            hashmap_get(map, __test_keys[i]);
+
+        *p_get += read_tsc() - start;
+        start = read_tsc();
+
+        for (u32 i = 0; i < HASHMAP_TEST_NR_KEYS; i++)
+            hashmap_remove(map, __test_keys[i]);
+
+        *p_remove += read_tsc() - start;
+    }
+
+    *p_put /= (HASHMAP_TEST_ROUNDS * HASHMAP_TEST_NR_KEYS);
+    *p_get /= (HASHMAP_TEST_ROUNDS * HASHMAP_TEST_NR_KEYS);
+    *p_remove /= (HASHMAP_TEST_ROUNDS * HASHMAP_TEST_NR_KEYS);
+}
+
+/*!
+ * @brief: Check the open addressing map and compare it against closed addressing
+ */
+static error_t __test_hashmap(aniva_test_t* test)
+{
+    void* old;
+    hashmap_t* map;
+    u64 o_put, o_get, o_remove;
+    u64 c_put, c_get, c_remove;
+    const char* hex = "0123456789abcdef";
+
+    for (u32 i = 0; i < HASHMAP_TEST_NR_KEYS; i++) {
+        __test_keys[i][0] = 'h';
+        __test_keys[i][1] = 'm';
+        __test_keys[i][2] = hex[(i >> 8) & 0xf];
+        __test_keys[i][3] = hex[(i >> 4) & 0xf];
+        __test_keys[i][4] = hex[i & 0xf];
+        __test_keys[i][5] = '\0';
+    }
+
+    /* Start out tiny, so we go through a couple of resizes */
+    map = create_hashmap(1, NULL);
+
+    if (!map)
+        return -ENOMEM;
+
+    for (u32 i = 0; i < HASHMAP_TEST_NR_KEYS; i++)
+        if (hashmap_put(map, __test_keys[i], (void*)(u64)(i + 1)))
+            goto fail;
+
+    /* Duplicates are not allowed */
+    if (!hashmap_put(map, __test_keys[0], (void*)1) || map->m_size != HASHMAP_TEST_NR_KEYS)
+        goto fail;
+
+    for (u32 i = 0; i < HASHMAP_TEST_NR_KEYS; i++)
+        if (hashmap_get(map, __test_keys[i]) != (void*)(u64)(i + 1))
+            goto fail;
+
+    if (hashmap_set(map, &old, __test_keys[7], (void*)0x1000) || old != (void*)8 || hashmap_get(map, __test_keys[7]) != (void*)0x1000)
+        goto fail;
+
+    /* Remove the even keys */
+    for (u32 i = 0; i < HASHMAP_TEST_NR_KEYS; i += 2)
+        if (!hashmap_remove(map, __test_keys[i]))
+            goto fail;
+
+    for (u32 i = 0; i < HASHMAP_TEST_NR_KEYS; i++)
+        if (hashmap_has(map, __test_keys[i]) != (i & 1))
+            goto fail;
+
+    if (map->m_size != HASHMAP_TEST_NR_KEYS / 2)
+        goto fail;
+
+    destroy_hashmap(map);
+
+    map = create_hashmap(1, NULL);
+
+    if (!map)
+        return -ENOMEM;
+
+    __test_hashmap_time(map, &o_put, &o_get, &o_remove);
+    destroy_hashmap(map);
+
+    /* The closed addressing map can't grow, so give it all of its room up front */
+    map = create_hashmap(HASHMAP_TEST_NR_KEYS * 2, HASHMAP_FLAG_CA);
+
+    if (!map)
+        return -ENOMEM;
+
+    __test_hashmap_time(map, &c_put, &c_get, &c_remove);
+    destroy_hashmap(map);
+
+    KLOG("(open: %lld/%lld/%lld, closed: %lld/%lld/%lld cycles put/get/remove) ", o_put, o_get, o_remove, c_put, c_get, c_remove);
+    return 0;
+
+fail:
+    destroy_hashmap(map);
+    return -EINVAL;
+}
+
+ANIVA_REGISTER_TEST("hashmap open addressing", create_hashmap, __test_hashmap, ANIVA_TEST_TYPE_ALGO);
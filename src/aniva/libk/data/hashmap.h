@@ -5,8 +5,18 @@
 #include <libk/stddef.h>
 
 /*
- * This implementation of a hashmap uses closed addressing (so no linear probing)
- * which means that keys that result in duplicate entries are stored in a linked list
+ * Hashmaps use open addressing by default. Slots are grouped in groups of HASHMAP_GROUP_SIZE, with
+ * a control byte for every slot. The control byte of a used slot holds 7 bits of the hash of its
+ * key, so a lookup can check an entire group with a couple of 64-bit operations (no SSE in the
+ * kernel), before ever touching a slot. Maps grow incrementally: when a table fills up, a bigger one
+ * is allocated and every mutation of the map moves a couple of groups over.
+ *
+ * Small maps live entirely inside the hashmap_t itself.
+ *
+ * The old implementation, which uses closed addressing (keys that result in duplicate entries are
+ * stored in a linked list), can still be selected with HASHMAP_FLAG_CA. It can't grow.
+ *
+ * NOTE: Entries are identified by the hash of their key. We don't keep the keys around
  */
 
 typedef void* hashmap_key_t;
@@ -15,9 +25,26 @@ typedef void* hashmap_value_t;
 struct hashmap_entry;
 
 #define HASHMAP_FLAG_SK (0x00000001) /* Does this hashmap use strings for keys? */
-#define HASHMAP_FLAG_CA (0x00000002) /* Does this hashmap use closed addressing? (FIXME/TODO: open addressing is still unimplemented) */
+#define HASHMAP_FLAG_CA (0x00000002) /* Does this hashmap use closed addressing? */
 #define HASHMAP_FLAG_FS (0x00000004) /* Is this hashmap fixed in size? */
 
+/* Amount of slots that get probed together */
+#define HASHMAP_GROUP_SIZE 8
+
+typedef struct hashmap_slot {
+    uintptr_t m_hash;
+    hashmap_value_t m_value;
+} hashmap_slot_t;
+
+typedef struct hashmap_table {
+    u8* m_ctrl;
+    hashmap_slot_t* m_slots;
+    /* Always a power of two */
+    size_t m_nr_groups;
+    size_t m_nr_used;
+    size_t m_nr_deleted;
+} hashmap_table_t;
+
 typedef struct __hashmap {
     size_t m_max_entries;
     size_t m_size;
@@ -28,6 +55,18 @@ typedef struct __hashmap {
     /* FIXME: this takes up 8 bytes instead of 4... */
     uint32_t m_flags;
 
+    /* Open addressing: the table we insert into */
+    hashmap_table_t m_table;
+    /* The table we are moving away from, while resizing */
+    hashmap_table_t m_old_table;
+    /* The next group of the old table that needs to be moved */
+    size_t m_migrate_group;
+
+    /* Storage for small maps */
+    u64 m_inline_ctrl;
+    hashmap_slot_t m_inline_slots[HASHMAP_GROUP_SIZE];
+
+    /* Closed addressing only */
     hashmap_value_t m_list[];
 } hashmap_t;
 
@@ -26,6 +26,9 @@ NORETURN void kernel_panic(const char* panic_message)
 
     has_paniced = true;
 
+    /* Don't leave anything in the log rings, nobody is going to drain them after this */
+    log_flush_sync();
+
     // kwarnf("[KERNEL PANIC] %s\n", panic_message);
     printf("[KERNEL PANIC] %s\n", panic_message);
 
@@ -16,6 +16,7 @@ enum KOPT_TYPE {
 #define KOPT_KRNL_DBG "krnl_dbg"
 #define KOPT_NO_ACPICA "no_acpica"
 #define KOPT_NO_USB "no_usb"
+#define KOPT_LOG_BENCH "log_bench"
 
 /*
  * These objects are the tokens that the parser generates from a single cmdline given to us
@@ -1,16 +1,76 @@
 #include "log.h"
+#include "entry/entry.h"
+#include "irq/interrupts.h"
 #include "libk/flow/error.h"
+#include "libk/kopts/parser.h"
+#include "libk/math/math.h"
 #include "libk/stddef.h"
+#include "mem/heap.h"
+#include "proc/core.h"
+#include "sched/scheduler.h"
+#include "sync/sem.h"
 #include "sync/spinlock.h"
+#include "system/asm_specifics.h"
+#include "system/processor/processor.h"
 #include <libk/ctype.h>
 #include <libk/string.h>
 #include <sync/mutex.h>
+#include <tests/tests.h>
+
+/*
+ * Buffered logging
+ *
+ * Formatting doesn't talk to the loggers directly. Output is gathered into chunks on the stack,
+ * which are cut at every newline (or when they fill up). Once the drain thread is running, chunks
+ * are pushed into a lock-free byte ring of the current CPU and the drain thread hands them to
+ * the f_log of the loggers at its own pace. The drain thread sleeps on a semaphore that producers
+ * post when they push into an idle drain. Before that point (and after a panic) chunks go to
+ * the loggers right away.
+ *
+ * Every ring has a single producer (its CPU, with interrupts disabled while pushing) and a single
+ * consumer (whoever owns the drain), so the only synchronisation is on the head and tail.
+ */
+#define LOG_RING_SIZE (16 * Kib)
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+/* Max size of the data in a single record */
+#define LOG_CHUNK_SIZE 128
+/* How many times a producer yields to the drain when its ring is full, before giving up */
+#define LOG_PUSH_MAX_RETRIES 64
+
+typedef struct log_record {
+    u16 len;
+    /* Logger flags of this record */
+    u8 flags;
+    /* LOG_TYPE_DEFAULT or LOG_TYPE_LINE */
+    u8 type;
+    char data[];
+} log_record_t;
+
+typedef struct log_ring {
+    /* Written by the producer */
+    u64 head;
+    /* Written by the consumer */
+    u64 tail;
+    /* Bytes we had to throw away, since we couldn't wait for room */
+    u64 nr_dropped;
+    char data[LOG_RING_SIZE];
+} log_ring_t;
 
 static mutex_t* __default_mutex = NULL;
 static spinlock_t* __log_lock = NULL;
 static logger_t* __loggers[LOGGER_MAX_COUNT];
 static size_t __loggers_count;
 
+static log_ring_t __log_rings[SYS_MAX_CPU];
+/* Set when chunks should go into the rings. Cleared again on a panic */
+static bool __log_async;
+/* Held by whoever is draining the rings */
+static bool __log_draining;
+/* Posted to wake the drain thread. __log_drain_pending makes sure we only post once per wakeup */
+static struct semaphore* __log_drain_sem;
+static bool __log_drain_pending;
+static char __log_drain_buffer[LOG_CHUNK_SIZE + 1];
+
 static bool valid_logger_id(logger_id_t id)
 {
     return (id < LOGGER_MAX_COUNT);
@@ -277,6 +337,234 @@ static int print_ex(uint8_t flags, const char* msg, uint8_t type)
     return 0;
 }
 
+static inline void _log_ring_copy_in(log_ring_t* ring, u64 pos, const void* src, size_t len)
+{
+    const size_t offset = pos & LOG_RING_MASK;
+    const size_t first = MIN(len, LOG_RING_SIZE - offset);
+
+    memcpy(&ring->data[offset], src, first);
+
+    if (first < len)
+        memcpy(&ring->data[0], (const u8*)src + first, len - first);
+}
+
+static inline void _log_ring_copy_out(log_ring_t* ring, u64 pos, void* dst, size_t len)
+{
+    const size_t offset = pos & LOG_RING_MASK;
+    const size_t first = MIN(len, LOG_RING_SIZE - offset);
+
+    memcpy(dst, &ring->data[offset], first);
+
+    if (first < len)
+        memcpy((u8*)dst + first, &ring->data[0], len - first);
+}
+
+static inline size_t _log_record_size(size_t len)
+{
+    return ALIGN_UP(sizeof(log_record_t) + len, sizeof(u32));
+}
+
+/*!
+ * @brief: Put a record into @ring
+ *
+ * Only the owner of the ring may call this
+ * @returns: False if there is no room for the record
+ */
+static bool _log_ring_put(log_ring_t* ring, const log_record_t* record, const char* data)
+{
+    const u64 head = ring->head;
+    const size_t size = _log_record_size(record->len);
+
+    if (LOG_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < size)
+        return false;
+
+    _log_ring_copy_in(ring, head, record, sizeof(*record));
+    _log_ring_copy_in(ring, head + sizeof(*record), data, record->len);
+
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*!
+ * @brief: Take the oldest record out of @ring
+ *
+ * Caller must own the drain. @buffer needs room for LOG_CHUNK_SIZE bytes
+ * @returns: False if the ring is empty
+ */
+static bool _log_ring_get(log_ring_t* ring, log_record_t* record, char* buffer)
+{
+    if (ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        return false;
+
+    _log_ring_copy_out(ring, ring->tail, record, sizeof(*record));
+    _log_ring_copy_out(ring, ring->tail + sizeof(*record), buffer, record->len);
+
+    /* Give the room back right away, the caller might take its time with the record */
+    __atomic_store_n(&ring->tail, ring->tail + _log_record_size(record->len), __ATOMIC_RELEASE);
+    return true;
+}
+
+/*!
+ * @brief: Hand every record in the rings to the loggers
+ *
+ * Caller must own the drain
+ */
+static void _log_drain_rings()
+{
+    log_ring_t* ring;
+    log_record_t record;
+
+    for (u32 i = 0; i < SYS_MAX_CPU; i++) {
+        ring = &__log_rings[i];
+
+        while (_log_ring_get(ring, &record, __log_drain_buffer)) {
+            __log_drain_buffer[record.len] = '\0';
+
+            print_ex(record.flags, __log_drain_buffer, record.type);
+        }
+    }
+}
+
+static inline bool _log_try_drain()
+{
+    if (__atomic_exchange_n(&__log_draining, true, __ATOMIC_ACQUIRE))
+        return false;
+
+    _log_drain_rings();
+
+    __atomic_store_n(&__log_draining, false, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*!
+ * @brief: Put a record in the ring of the current CPU
+ *
+ * When the ring is full, we try to drain it ourselves. If somebody else is already draining,
+ * we wait for them, unless we can't be preempted. The record gets dropped when we can't wait or
+ * when we've waited for too long (the drain might be waiting on us, if a logger logs itself)
+ */
+static void _log_ring_push(u8 flags, u8 type, const char* data, size_t len)
+{
+    u32 retries;
+    bool pushed;
+    log_ring_t* ring;
+    log_record_t record = {
+        .len = len,
+        .flags = flags,
+        .type = type,
+    };
+
+    retries = 0;
+
+    while (true) {
+        CHECK_AND_DO_DISABLE_INTERRUPTS();
+
+        ring = &__log_rings[get_current_processor()->m_cpu_num % SYS_MAX_CPU];
+        pushed = _log_ring_put(ring, &record, data);
+
+        CHECK_AND_TRY_ENABLE_INTERRUPTS();
+
+        if (pushed) {
+            /*
+             * Wake the drain if nobody did so yet. Not from interrupt context though, since we might
+             * be inside the scheduler. The record gets picked up with the next wakeup in that case
+             */
+            if (___were_enabled_x && !__atomic_exchange_n(&__log_drain_pending, true, __ATOMIC_ACQ_REL))
+                sem_post(__log_drain_sem);
+            return;
+        }
+
+        if (_log_try_drain())
+            continue;
+
+        if (!___were_enabled_x || retries++ >= LOG_PUSH_MAX_RETRIES) {
+            __atomic_fetch_add(&ring->nr_dropped, len, __ATOMIC_RELAXED);
+            return;
+        }
+
+        scheduler_yield();
+    }
+}
+
+/*!
+ * @brief: Send a chunk of output to the loggers that match @flags
+ *
+ * @data does not have to be null-terminated
+ */
+static void _log_emit(u8 flags, u8 type, const char* data, size_t len)
+{
+    char buffer[LOG_CHUNK_SIZE + 1];
+
+    if (!len && type != LOG_TYPE_LINE)
+        return;
+
+    /* Only the type flags matter to the loggers */
+    flags &= (LOGGER_FLAG_INFO | LOGGER_FLAG_DEBUG | LOGGER_FLAG_WARNINGS);
+
+    if (__atomic_load_n(&__log_async, __ATOMIC_ACQUIRE))
+        return _log_ring_push(flags, type, data, len);
+
+    memcpy(buffer, data, len);
+    buffer[len] = '\0';
+
+    try_lock_logging();
+    print_ex(flags, buffer, type);
+    try_unlock_logging();
+}
+
+/*!
+ * @brief: Send a string of any length to the loggers
+ *
+ * Gets cut up into chunks. For lines, only the last chunk is sent as a line
+ */
+static int _log_write(u8 flags, const char* msg, u8 type)
+{
+    size_t len;
+    size_t chunk;
+
+    if (!msg)
+        return -1;
+
+    len = strlen(msg);
+
+    do {
+        chunk = MIN(len, LOG_CHUNK_SIZE);
+        len -= chunk;
+
+        _log_emit(flags, len ? LOG_TYPE_DEFAULT : type, msg, chunk);
+
+        msg += chunk;
+    } while (len);
+
+    return 0;
+}
+
+/*!
+ * @brief: Output callback for _vprintf that gathers chunks
+ *
+ * @out points at the current position inside a chunk buffer of LOG_CHUNK_SIZE bytes, of which
+ * @p_cur_size are left. Full chunks and chunks that end in a newline are sent off right away
+ */
+static int _klogbuf(uint8_t typeflags, char c, char** out, size_t* p_cur_size)
+{
+    char* start;
+
+    **out = c;
+    (*out)++;
+    (*p_cur_size)--;
+
+    if (*p_cur_size && c != '\n')
+        return 0;
+
+    start = *out - (LOG_CHUNK_SIZE - *p_cur_size);
+
+    _log_emit(typeflags, LOG_TYPE_DEFAULT, start, *out - start);
+
+    *out = start;
+    *p_cur_size = LOG_CHUNK_SIZE;
+    return 0;
+}
+
 static int USED _kputch(uint8_t typeflags, char c, char** out, size_t* p_cur_size)
 {
     /* We don't use this variable */
@@ -287,17 +575,18 @@ static int USED _kputch(uint8_t typeflags, char c, char** out, size_t* p_cur_siz
 
 int kputch(char c)
 {
-    return _kputch(LOGGER_FLAG_INFO, c, NULL, NULL);
+    _log_emit(LOGGER_FLAG_INFO, LOG_TYPE_DEFAULT, &c, 1);
+    return 0;
 }
 
 int print(const char* msg)
 {
-    return print_ex(LOGGER_FLAG_INFO, msg, LOG_TYPE_DEFAULT);
+    return _log_write(LOGGER_FLAG_INFO, msg, LOG_TYPE_DEFAULT);
 }
 
 int println(const char* msg)
 {
-    return print_ex(LOGGER_FLAG_INFO, msg, LOG_TYPE_LINE);
+    return _log_write(LOGGER_FLAG_INFO, msg, LOG_TYPE_LINE);
 }
 
 static inline void _print_hex(uint8_t typeflags, uint64_t value, int prec, int (*output_cb)(uint8_t typeflags, char c, char** out, size_t* p_cur_size), char** out, size_t* max_size)
@@ -377,8 +666,6 @@ static inline int _vprintf(uint8_t typeflags, const char* fmt, va_list args, int
 
     prefix = nullptr;
 
-    try_lock_logging();
-
     /* Check for the no prefix flag */
     if ((typeflags & LOGGER_FLAG_NO_PREFIX) != LOGGER_FLAG_NO_PREFIX) {
         if ((typeflags & LOGGER_FLAG_WARNINGS) == LOGGER_FLAG_WARNINGS)
@@ -504,10 +791,25 @@ static inline int _vprintf(uint8_t typeflags, const char* fmt, va_list args, int
         output_cb(typeflags, *c, out, &max_size);
     }
 
-    try_unlock_logging();
     return 0;
 }
 
+/*!
+ * @brief: Format into chunks and send those to the loggers
+ */
+static int _vklogf(uint8_t typeflags, const char* fmt, va_list args)
+{
+    int error;
+    char chunk[LOG_CHUNK_SIZE];
+    char* cursor = chunk;
+
+    error = _vprintf(typeflags, fmt, args, _klogbuf, &cursor, LOG_CHUNK_SIZE);
+
+    /* Send off whatever is left */
+    _log_emit(typeflags, LOG_TYPE_DEFAULT, chunk, cursor - chunk);
+    return error;
+}
+
 int vprintf(const char* fmt, va_list args)
 {
     int error;
@@ -515,7 +817,7 @@ int vprintf(const char* fmt, va_list args)
     /*
      * These kinds of prints should go to all loggers
      */
-    error = _vprintf(LOGGER_FLAG_NO_PREFIX | LOGGER_FLAG_DEBUG | LOGGER_FLAG_INFO | LOGGER_FLAG_WARNINGS, fmt, args, _kputch, NULL, NULL);
+    error = _vklogf(LOGGER_FLAG_NO_PREFIX | LOGGER_FLAG_DEBUG | LOGGER_FLAG_INFO | LOGGER_FLAG_WARNINGS, fmt, args);
 
     return error;
 }
@@ -527,7 +829,7 @@ void log(const char* msg)
 
 void vlogf(const char* fmt, va_list args)
 {
-    (void)_vprintf(LOGGER_FLAG_INFO, fmt, args, _kputch, NULL, NULL);
+    (void)_vklogf(LOGGER_FLAG_INFO, fmt, args);
 }
 
 void logf(const char* fmt, ...)
@@ -548,7 +850,6 @@ void logln(const char* msg)
 /*!
  * @brief: Print formated text
  *
- * Slow, since it has to make use of our kputch thingy
  * TODO: implement full fmt scema
  */
 int printf(const char* fmt, ...)
@@ -628,7 +929,7 @@ int vkdbgf(bool prefix, const char* fmt, va_list args)
     if (!prefix)
         flags |= LOGGER_FLAG_NO_PREFIX;
 
-    return _vprintf(flags, fmt, args, _kputch, NULL, NULL);
+    return _vklogf(flags, fmt, args);
 }
 
 int kdbgf(const char* fmt, ...)
@@ -649,7 +950,7 @@ int kdbgln(const char* msg)
 {
     int error;
 
-    error = print_ex(LOGGER_FLAG_DEBUG, msg, LOG_TYPE_LINE);
+    error = _log_write(LOGGER_FLAG_DEBUG, msg, LOG_TYPE_LINE);
 
     return error;
 }
@@ -658,7 +959,7 @@ int kdbg(const char* msg)
 {
     int error;
 
-    error = print_ex(LOGGER_FLAG_DEBUG, msg, LOG_TYPE_DEFAULT);
+    error = _log_write(LOGGER_FLAG_DEBUG, msg, LOG_TYPE_DEFAULT);
 
     return error;
 }
@@ -667,7 +968,8 @@ int kdbgc(char c)
 {
     int error;
 
-    error = _kputch(LOGGER_FLAG_DEBUG, c, NULL, NULL);
+    _log_emit(LOGGER_FLAG_DEBUG, LOG_TYPE_DEFAULT, &c, 1);
+    error = 0;
 
     return error;
 }
@@ -679,7 +981,7 @@ int kwarnf(const char* fmt, ...)
     va_list args;
     va_start(args, fmt);
 
-    error = _vprintf(LOGGER_FLAG_WARNINGS, fmt, args, _kputch, NULL, NULL);
+    error = _vklogf(LOGGER_FLAG_WARNINGS, fmt, args);
 
     va_end(args);
 
@@ -690,7 +992,7 @@ int kwarnln(const char* msg)
 {
     int error;
 
-    error = print_ex(LOGGER_FLAG_WARNINGS, msg, LOG_TYPE_LINE);
+    error = _log_write(LOGGER_FLAG_WARNINGS, msg, LOG_TYPE_LINE);
 
     return error;
 }
@@ -699,7 +1001,7 @@ int kwarn(const char* msg)
 {
     int error;
 
-    error = print_ex(LOGGER_FLAG_WARNINGS, msg, LOG_TYPE_DEFAULT);
+    error = _log_write(LOGGER_FLAG_WARNINGS, msg, LOG_TYPE_DEFAULT);
 
     return error;
 }
@@ -708,7 +1010,8 @@ int kwarnc(char c)
 {
     int error;
 
-    error = _kputch(LOGGER_FLAG_WARNINGS, c, NULL, NULL);
+    _log_emit(LOGGER_FLAG_WARNINGS, LOG_TYPE_DEFAULT, &c, 1);
+    error = 0;
 
     return error;
 }
@@ -736,3 +1039,211 @@ void init_logging()
     __default_mutex = create_mutex(NULL);
     __log_lock = create_spinlock(SPINLOCK_FLAG_SOFT);
 }
+
+#define LOG_BENCH_ROUNDS 64
+#define LOG_BENCH_LINE "[ LOGBENCH ] Measuring the cost of a printf: %d\n"
+
+/* The way printf used to work: every char goes to every logger on its own */
+static void __log_bench_printf_per_char(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+
+    try_lock_logging();
+    (void)_vprintf(LOGGER_FLAG_NO_PREFIX | LOGGER_FLAG_DEBUG | LOGGER_FLAG_INFO | LOGGER_FLAG_WARNINGS, fmt, args, _kputch, NULL, NULL);
+    try_unlock_logging();
+
+    va_end(args);
+}
+
+static u64 __log_bench_time_printf(bool per_char)
+{
+    u64 start;
+
+    start = read_tsc();
+
+    for (u32 i = 0; i < LOG_BENCH_ROUNDS; i++) {
+        if (per_char)
+            __log_bench_printf_per_char(LOG_BENCH_LINE, i);
+        else
+            printf(LOG_BENCH_LINE, i);
+    }
+
+    return (read_tsc() - start) / LOG_BENCH_ROUNDS;
+}
+
+/*!
+ * @brief: Compare the cost of a printf between the per-char, chunked and buffered paths
+ *
+ * Uses whatever loggers are attached (serial, if we have it). Only runs when the 'log_bench'
+ * kopt is set, since it floods the loggers with a few hundred lines
+ */
+static void __log_bench_printf()
+{
+    bool was_async;
+    u64 per_char, chunked, buffered;
+
+    was_async = __atomic_load_n(&__log_async, __ATOMIC_ACQUIRE);
+    buffered = 0;
+
+    /* Make sure nothing is still waiting in the rings before we go synchronous */
+    if (was_async)
+        while (!_log_try_drain())
+            scheduler_yield();
+
+    __atomic_store_n(&__log_async, false, __ATOMIC_RELEASE);
+
+    per_char = __log_bench_time_printf(true);
+    chunked = __log_bench_time_printf(false);
+
+    __atomic_store_n(&__log_async, was_async, __ATOMIC_RELEASE);
+
+    if (was_async)
+        buffered = __log_bench_time_printf(false);
+
+    KLOG("[ LOGBENCH ] printf: %lld per char, %lld chunked, %lld buffered cycles\n", per_char, chunked, buffered);
+}
+
+/*!
+ * @brief: The drain thread
+ *
+ * Runs at a low priority, so logging never gets in the way of real work. Sleeps until a producer
+ * wakes it up
+ */
+static void __log_drain_thread()
+{
+    while (true) {
+        sem_wait(__log_drain_sem, NULL);
+
+        /* Clear this before draining, so anything pushed from here on wakes us up again */
+        __atomic_store_n(&__log_drain_pending, false, __ATOMIC_RELEASE);
+
+        (void)_log_try_drain();
+    }
+}
+
+/*!
+ * @brief: Start draining the log rings asynchronously
+ *
+ * Needs a scheduler and a process to spawn the drain thread in. Until this is called, every
+ * chunk goes to the loggers synchronously. Measures the cost of a printf right after, when the
+ * 'log_bench' kopt asks for it
+ */
+void init_log_drain()
+{
+    __log_drain_sem = create_semaphore(1, 0, 1);
+
+    if (!__log_drain_sem)
+        return;
+
+    if (!spawn_thread("log_drain", SCHED_PRIO_LOW, __log_drain_thread, NULL)) {
+        destroy_semaphore(__log_drain_sem);
+        __log_drain_sem = nullptr;
+        return;
+    }
+
+    __atomic_store_n(&__log_async, true, __ATOMIC_RELEASE);
+
+    if (kopts_get_bool(KOPT_LOG_BENCH))
+        __log_bench_printf();
+}
+
+/*!
+ * @brief: Get every buffered log out and stop buffering
+ *
+ * Called on a panic. Whoever was draining before is never coming back, so we simply
+ * take the drain over
+ */
+void log_flush_sync()
+{
+    __atomic_store_n(&__log_async, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&__log_draining, true, __ATOMIC_SEQ_CST);
+
+    _log_drain_rings();
+
+    __atomic_store_n(&__log_draining, false, __ATOMIC_RELEASE);
+}
+
+#define LOG_TEST_ROUNDS 4
+
+static void __test_log_fill(char* buffer, u32 seq, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        buffer[i] = (char)('a' + ((seq + i) % 26));
+}
+
+static inline void __test_log_make_record(log_record_t* record, u32 seq)
+{
+    record->len = seq % (LOG_CHUNK_SIZE + 1);
+    record->flags = seq & 0xff;
+    record->type = (seq & 1) ? LOG_TYPE_LINE : LOG_TYPE_DEFAULT;
+}
+
+/*!
+ * @brief: Check that records come out of a ring intact and in order, also when they wrap around
+ *
+ * Uses a private ring, so nothing ends up at the loggers
+ */
+static error_t __test_log_ring(aniva_test_t* test)
+{
+    error_t error;
+    u32 put_seq, get_seq;
+    log_ring_t* ring;
+    log_record_t record, expected_record;
+    char buffer[LOG_CHUNK_SIZE];
+    char expected[LOG_CHUNK_SIZE];
+
+    ring = kmalloc(sizeof(*ring));
+
+    if (!ring)
+        return -ENOMEM;
+
+    memset(ring, 0, sizeof(*ring));
+
+    /* Start right before the end, so the very first record already wraps */
+    ring->head = ring->tail = LOG_RING_SIZE - sizeof(record);
+
+    error = -EINVAL;
+    put_seq = get_seq = 0;
+
+    for (u32 round = 0; round < LOG_TEST_ROUNDS; round++) {
+        /* Fill it up */
+        while (true) {
+            __test_log_make_record(&record, put_seq);
+            __test_log_fill(buffer, put_seq, record.len);
+
+            if (!_log_ring_put(ring, &record, buffer))
+                break;
+
+            put_seq++;
+        }
+
+        /* The record that got refused should really not have fit */
+        if (LOG_RING_SIZE - (ring->head - ring->tail) >= _log_record_size(record.len))
+            goto free_and_exit;
+
+        /* And empty it again */
+        while (_log_ring_get(ring, &record, buffer)) {
+            __test_log_make_record(&expected_record, get_seq);
+            __test_log_fill(expected, get_seq, expected_record.len);
+
+            if (record.len != expected_record.len || record.flags != expected_record.flags || record.type != expected_record.type)
+                goto free_and_exit;
+
+            if (!memcmp(buffer, expected, record.len))
+                goto free_and_exit;
+
+            get_seq++;
+        }
+
+        if (get_seq != put_seq || ring->head != ring->tail)
+            goto free_and_exit;
+    }
+
+    error = 0;
+free_and_exit:
+    kfree(ring);
+    return error;
+}
+
+ANIVA_REGISTER_TEST("log ring", init_log_drain, __test_log_ring, ANIVA_TEST_TYPE_IO);
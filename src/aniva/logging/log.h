@@ -38,6 +38,10 @@ typedef struct {
 
 void init_early_logging();
 void init_logging();
+void init_log_drain();
+
+/* Push out everything that is still buffered and log synchronously from now on */
+void log_flush_sync();
 
 /* Function prototypes */
 
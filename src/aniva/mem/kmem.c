@@ -14,6 +14,7 @@
 #include "proc/proc.h"
 #include "sched/scheduler.h"
 #include "sync/mutex.h"
+#include "system/asm_specifics.h"
 #include "system/processor/processor.h"
 #include <dev/core.h>
 #include <dev/driver.h>
@@ -62,7 +63,35 @@ static struct {
 
 /* Variable from boot.asm */
 extern const size_t early_map_size;
-static mutex_t* _kmem_map_lock;
+
+/*
+ * Per address space bookkeeping
+ *
+ * Lives in the page right behind the root table (see kmem_create_page_dir), so we can get to it
+ * with nothing but the root pointer. Every address space has its own lock around pagetable
+ * modifications. The kernel half is shared between all address spaces, so anything up there goes
+ * through the kernel lock.
+ */
+typedef struct kmem_page_dir_info {
+    mutex_t map_lock;
+    /* Copy of the PCID in the page_dir_t, for TLB invalidations when all we have is the root */
+    u16 pcid;
+} kmem_page_dir_info_t;
+
+#define KMEM_PAGE_DIR_ALLOC_SIZE (2 * SMALL_PAGE_SIZE)
+#define KMEM_PAGE_DIR_INFO(root) ((kmem_page_dir_info_t*)((u8*)(root) + SMALL_PAGE_SIZE))
+#define KMEM_PAGE_DIR_MAP_LOCK(root) (&KMEM_PAGE_DIR_INFO(root)->map_lock)
+
+static mutex_t _kmem_kernel_map_lock;
+
+static inline mutex_t* _kmem_get_map_lock(pml_entry_t* table, vaddr_t vaddr)
+{
+    /* Kernel root or the shared kernel half (bit 47 set means sign extended) */
+    if (!table || table == KMEM_DATA.kernel_pdir.m_root || (vaddr & (1ULL << 47)))
+        return &_kmem_kernel_map_lock;
+
+    return KMEM_PAGE_DIR_MAP_LOCK(table);
+}
 
 size_t kmem_get_early_map_size()
 {
@@ -143,41 +172,6 @@ vaddr_t kmem_ensure_high_mapping(uintptr_t addr)
     return kmem_from_phys(addr, HIGH_MAP_BASE);
 }
 
-/*
- * Translate a virtual address to a physical address that is
- * page-aligned
- *
- * TODO: change this function so errors are communicated clearly
- */
-uintptr_t kmem_to_phys_aligned(pml_entry_t* root, vaddr_t addr)
-{
-    pml_entry_t* page;
-
-    if (kmem_get_page(&page, root, ALIGN_DOWN_TO_PAGE(addr), 0, 0))
-        return NULL;
-
-    return kmem_get_page_base(page->raw_bits);
-}
-
-/*!
- * @brief: Get a physical address by mapping
- *
- * Same as the function above, but this one also keeps the alignment in mind
- */
-uintptr_t kmem_to_phys(pml_entry_t* root, vaddr_t addr)
-{
-    size_t delta;
-    pml_entry_t* page;
-
-    /* Address is not mapped */
-    if (kmem_get_page(&page, root, addr, 0, 0))
-        return NULL;
-
-    delta = addr - ALIGN_DOWN_TO_PAGE(addr);
-
-    return kmem_get_page_base(page->raw_bits) + delta;
-}
-
 /*
  * Try to find a free physical page, just as kmem_phys_get_page,
  * but this also marks it as used and makes sure it is filled with zeros
@@ -285,6 +279,412 @@ static inline kerror_t _allocate_pde(pml_entry_t* pde, uint32_t custom_flags, ui
     return 0;
 }
 
+/* Levels of the pagetable, counted from the bottom */
+#define KMEM_PT_LEVEL 1
+#define KMEM_PD_LEVEL 2
+#define KMEM_PDP_LEVEL 3
+#define KMEM_PML4_LEVEL 4
+
+/* Number of 4 KiB pages a single entry maps on each level */
+#define KMEM_LARGE_PAGE_PAGES (LARGE_PAGE_SIZE >> PAGE_SHIFT)
+#define KMEM_HUGE_PAGE_PAGES (HUGE_PAGE_SIZE >> PAGE_SHIFT)
+
+/* Bits of a large page entry that carry over when it's split */
+#define KMEM_LARGE_ATTR_MASK (PDE_PRESENT | PDE_WRITABLE | PDE_USER | PDE_WRITE_THROUGH | PDE_NO_CACHE | PDE_GLOBAL | PDE_NX)
+
+static inline u32 _kmem_level_shift(u32 level)
+{
+    return PAGE_SHIFT + (level - 1) * 9;
+}
+
+/*!
+ * @brief: Get the physical base of a (large) page entry on @level
+ */
+static inline paddr_t _kmem_get_entry_base(pml_entry_t* entry, u32 level)
+{
+    return kmem_get_page_base(entry->raw_bits) & ~((1ULL << _kmem_level_shift(level)) - 1);
+}
+
+static inline bool _kmem_entry_is_large(pml_entry_t* entry, u32 level)
+{
+    return (level == KMEM_PD_LEVEL || level == KMEM_PDP_LEVEL) && pml_entry_is_bit_set(entry, PDE_HUGE_PAGE);
+}
+
+/*
+ * TLB management
+ *
+ * When the CPU supports it, every page directory gets its own PCID. Switching address spaces then
+ * keeps the TLB entries of everyone else around, instead of throwing the entire TLB away on every
+ * CR3 load. The catch is that we now have to invalidate entries of address spaces that aren't
+ * active. We can't reach those with invlpg. With INVPCID we just invalidate them under their own PCID,
+ * otherwise the PCID gets marked stale. Every PCID remembers the generation it was last flushed at,
+ * and gets flushed when it's loaded with an older one. Changes to the shared kernel half bump the
+ * generation itself, which makes every PCID stale at once.
+ *
+ * TODO: Once we're SMP, the stale bits need to become IPI shootdowns to the CPUs that have the address
+ * space loaded
+ */
+#define KMEM_NR_PCIDS 4096
+#define KMEM_PCID_MASK (KMEM_NR_PCIDS - 1)
+#define KMEM_CR3_NOFLUSH (1ULL << 63)
+#define KMEM_CR4_PGE 0x80
+#define KMEM_CR4_PCIDE 0x20000
+
+#define KMEM_INVPCID_ADDR 0
+#define KMEM_INVPCID_SINGLE 1
+#define KMEM_INVPCID_ALL_GLOBAL 2
+
+static spinlock_t _kmem_pcid_lock;
+/* PCID 0 belongs to the kernel and to every directory that could not get one */
+static u64 _kmem_pcid_bitmap[KMEM_NR_PCIDS / 64] = { 1 };
+static u32 _kmem_pcid_gen[KMEM_NR_PCIDS];
+/* Starts at one, so PCIDs that were never loaded are stale */
+static u32 _kmem_tlb_gen = 1;
+
+static inline bool _kmem_has_pcid()
+{
+    return (KMEM_DATA.m_kmem_flags & KMEM_STATUS_FLAG_HAS_PCID) == KMEM_STATUS_FLAG_HAS_PCID;
+}
+
+static inline void _kmem_invpcid(u64 type, u64 pcid, vaddr_t vaddr)
+{
+    struct {
+        u64 pcid;
+        u64 vaddr;
+    } desc = { pcid, vaddr };
+
+    asm volatile("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+
+static inline bool _kmem_has_invpcid()
+{
+    return (KMEM_DATA.m_kmem_flags & KMEM_STATUS_FLAG_HAS_INVPCID) == KMEM_STATUS_FLAG_HAS_INVPCID;
+}
+
+/*!
+ * @brief: Make sure every other address space flushes its TLB entries the next time it's loaded
+ */
+static inline void _kmem_tlb_mark_stale()
+{
+    if (_kmem_has_pcid())
+        __atomic_add_fetch(&_kmem_tlb_gen, 1, __ATOMIC_RELEASE);
+}
+
+/*!
+ * @brief: Get rid of the TLB entries for [@start, @end) of the inactive address space tagged with @pcid
+ */
+static void _kmem_tlb_flush_pcid(u16 pcid, vaddr_t start, vaddr_t end, size_t nr_pages)
+{
+    /* PCID 0 is flushed on every load anyway */
+    if (!pcid)
+        return;
+
+    if (!_kmem_has_invpcid()) {
+        /* Only this PCID needs to be flushed the next time it's loaded */
+        _kmem_pcid_gen[pcid] = __atomic_load_n(&_kmem_tlb_gen, __ATOMIC_ACQUIRE) - 1;
+        return;
+    }
+
+    if (nr_pages > KMEM_TLB_FLUSH_THRESHOLD) {
+        _kmem_invpcid(KMEM_INVPCID_SINGLE, pcid, 0);
+        return;
+    }
+
+    for (vaddr_t vaddr = start; vaddr < end; vaddr += SMALL_PAGE_SIZE)
+        _kmem_invpcid(KMEM_INVPCID_ADDR, pcid, vaddr);
+}
+
+/*!
+ * @brief: Flush the TLB entries of the current address space on this CPU
+ *
+ * @global: Also get rid of global pages
+ */
+static void _kmem_flush_tlb_local(bool global)
+{
+    uintptr_t cr4;
+
+    if (global && _kmem_has_invpcid()) {
+        _kmem_invpcid(KMEM_INVPCID_ALL_GLOBAL, 0, 0);
+        return;
+    }
+
+    cr4 = read_cr4();
+
+    /* Toggling PGE flushes everything, for every PCID */
+    if (global && (cr4 & KMEM_CR4_PGE) == KMEM_CR4_PGE) {
+        write_cr4(cr4 & ~KMEM_CR4_PGE);
+        write_cr4(cr4);
+        return;
+    }
+
+    /* Reloading CR3 without the noflush bit only flushes the current PCID */
+    write_cr3(read_cr3() & ~KMEM_CR3_NOFLUSH);
+}
+
+void kmem_invalidate_tlb_cache_entry(uintptr_t vaddr)
+{
+    asm volatile("invlpg (%0)" : : "r"(vaddr));
+}
+
+/*!
+ * @brief: Invalidate a range in the current address space
+ */
+void kmem_invalidate_tlb_cache_range(uintptr_t vaddr, size_t size)
+{
+    kmem_tlb_batch_t batch;
+    page_dir_t* current = get_current_processor()->m_page_dir;
+
+    kmem_tlb_batch_init(&batch, current ? current->m_root : nullptr);
+    kmem_tlb_batch_add(&batch, vaddr, size);
+    kmem_tlb_batch_flush(&batch);
+}
+
+void kmem_tlb_batch_init(kmem_tlb_batch_t* batch, pml_entry_t* table)
+{
+    batch->table = table;
+    batch->start = 0;
+    batch->end = 0;
+}
+
+/*!
+ * @brief: Add the range at @vaddr to the batch
+ *
+ * We only keep track of the span the batch covers, since unmaps are almost always one contiguous range
+ */
+void kmem_tlb_batch_add(kmem_tlb_batch_t* batch, vaddr_t vaddr, size_t size)
+{
+    vaddr_t end = ALIGN_UP(vaddr + size, SMALL_PAGE_SIZE);
+
+    vaddr = ALIGN_DOWN_TO_PAGE(vaddr);
+
+    if (batch->start == batch->end) {
+        batch->start = vaddr;
+        batch->end = end;
+        return;
+    }
+
+    if (vaddr < batch->start)
+        batch->start = vaddr;
+    if (end > batch->end)
+        batch->end = end;
+}
+
+static inline bool _kmem_tlb_table_is_active(pml_entry_t* table)
+{
+    page_dir_t* current = get_current_processor()->m_page_dir;
+
+    /* Early boot, we're still on the kernel directory */
+    if (!current || !table)
+        return true;
+
+    return (current->m_root == table);
+}
+
+/*!
+ * @brief: Invalidate everything that was collected in @batch
+ *
+ * Small spans get an invlpg for every page, anything over KMEM_TLB_FLUSH_THRESHOLD pages flushes
+ * the entire (local) TLB, since that's cheaper than walking the range
+ */
+void kmem_tlb_batch_flush(kmem_tlb_batch_t* batch)
+{
+    size_t nr_pages;
+    bool kernel_half;
+
+    if (batch->start == batch->end)
+        return;
+
+    nr_pages = (batch->end - batch->start) >> PAGE_SHIFT;
+    kernel_half = (batch->start & (1ULL << 47)) != 0;
+
+    if (kernel_half) {
+        /* This flushes every PCID at once */
+        if (nr_pages > KMEM_TLB_FLUSH_THRESHOLD && _kmem_has_invpcid()) {
+            _kmem_invpcid(KMEM_INVPCID_ALL_GLOBAL, 0, 0);
+            goto reset;
+        }
+
+        /* The kernel half is shared, so other address spaces might have it cached under their PCID */
+        _kmem_tlb_mark_stale();
+    } else if (!_kmem_tlb_table_is_active(batch->table)) {
+        /* Not loaded here, so there is nothing to invlpg. Only its own PCID can have these cached */
+        if (_kmem_has_pcid() && batch->table != KMEM_DATA.kernel_pdir.m_root)
+            _kmem_tlb_flush_pcid(KMEM_PAGE_DIR_INFO(batch->table)->pcid, batch->start, batch->end, nr_pages);
+        goto reset;
+    }
+
+    if (nr_pages > KMEM_TLB_FLUSH_THRESHOLD) {
+        _kmem_flush_tlb_local(kernel_half);
+        goto reset;
+    }
+
+    for (vaddr_t vaddr = batch->start; vaddr < batch->end; vaddr += SMALL_PAGE_SIZE)
+        kmem_invalidate_tlb_cache_entry(vaddr);
+
+reset:
+    batch->start = batch->end = 0;
+}
+
+/*!
+ * @brief: Start tagging address spaces with PCIDs
+ *
+ * Called when the processor finds it supports PCIDs. CR3 needs to have its PCID bits cleared when
+ * we set CR4.PCIDE, which is the case since the kernel directory has PCID 0
+ */
+void kmem_enable_pcid(bool has_invpcid)
+{
+    write_cr4(read_cr4() | KMEM_CR4_PCIDE);
+
+    KMEM_DATA.m_kmem_flags |= KMEM_STATUS_FLAG_HAS_PCID;
+
+    if (has_invpcid)
+        KMEM_DATA.m_kmem_flags |= KMEM_STATUS_FLAG_HAS_INVPCID;
+}
+
+/*!
+ * @brief: Grab a free PCID for @dir
+ *
+ * Falls back to PCID 0 when we run out, which just means @dir is flushed on every switch
+ */
+static void _kmem_alloc_pcid(page_dir_t* dir)
+{
+    u32 idx;
+
+    dir->m_pcid = 0;
+
+    if (!_kmem_has_pcid())
+        return;
+
+    spinlock_lock(&_kmem_pcid_lock);
+
+    for (u32 i = 0; i < (KMEM_NR_PCIDS / 64); i++) {
+        if (!(~_kmem_pcid_bitmap[i]))
+            continue;
+
+        idx = __builtin_ctzll(~_kmem_pcid_bitmap[i]);
+
+        _kmem_pcid_bitmap[i] |= (1ULL << idx);
+        dir->m_pcid = (i * 64) + idx;
+        break;
+    }
+
+    spinlock_unlock(&_kmem_pcid_lock);
+
+    /* Anything left behind by the previous owner needs to go */
+    _kmem_pcid_gen[dir->m_pcid] = __atomic_load_n(&_kmem_tlb_gen, __ATOMIC_ACQUIRE) - 1;
+}
+
+/*!
+ * @brief: Give the PCID of @dir back
+ */
+void kmem_release_pcid(page_dir_t* dir)
+{
+    if (!dir->m_pcid)
+        return;
+
+    spinlock_lock(&_kmem_pcid_lock);
+
+    _kmem_pcid_bitmap[dir->m_pcid / 64] &= ~(1ULL << (dir->m_pcid % 64));
+
+    spinlock_unlock(&_kmem_pcid_lock);
+
+    /* Don't let invalidations on this directory hit the next owner of the PCID */
+    KMEM_PAGE_DIR_INFO(dir->m_root)->pcid = 0;
+    dir->m_pcid = 0;
+}
+
+/*!
+ * @brief: Break the large page at @entry up into a table of smaller pages with the same attributes
+ *
+ * @vaddr: Any address inside the large page, so we can flush it from the TLB
+ */
+static kerror_t _kmem_split_large_page(pml_entry_t* entry, u32 level, vaddr_t vaddr)
+{
+    kerror_t error;
+    paddr_t base;
+    paddr_t table_phys;
+    pml_entry_t* table;
+    u64 bits;
+    const u64 step = (1ULL << _kmem_level_shift(level - 1));
+
+    error = kmem_alloc_phys_page(&table_phys);
+
+    if (error)
+        return error;
+
+    table = (pml_entry_t*)kmem_from_phys(table_phys, KMEM_DATA.m_high_page_base);
+    base = _kmem_get_entry_base(entry, level);
+    bits = entry->raw_bits & KMEM_LARGE_ATTR_MASK;
+
+    /* The PAT bit moves back to bit 7 on the bottom level */
+    if (level - 1 == KMEM_PT_LEVEL)
+        bits |= pml_entry_is_bit_set(entry, PDE_LARGE_PAT) ? PTE_PAT : 0;
+    else
+        bits |= PDE_HUGE_PAGE | (entry->raw_bits & PDE_LARGE_PAT);
+
+    for (u32 i = 0; i < STANDARD_PD_ENTRIES; i++)
+        table[i].raw_bits = (base + i * step) | bits;
+
+    /* Access rights are checked on the leaves, so the table itself can be permissive */
+    entry->raw_bits = table_phys | PDE_PRESENT | PDE_WRITABLE | (entry->raw_bits & PDE_USER);
+
+    kmem_invalidate_tlb_cache_entry(vaddr);
+    return 0;
+}
+
+/*!
+ * @brief: Walk down to the entry for @addr on @level
+ *
+ * Missing levels are created when KMEM_CUSTOMFLAG_GET_MAKE is set. When we run into a large page on
+ * the way down, it gets split up if we're allowed to make tables. Otherwise the walk ends there, and
+ * @p_level tells the caller on which level it found the entry. Range operations only need to do this
+ * once for every pagetable
+ */
+static kerror_t _kmem_walk(pml_entry_t** p_entry, u32* p_level, pml_entry_t* root, vaddr_t addr, u32 level, uint32_t kmem_flags, uint32_t page_flags)
+{
+    kerror_t error;
+    u32 c_level;
+    pml_entry_t* table;
+    pml_entry_t* entry;
+
+    /* Make sure the virtual address is not fucking us in our ass */
+    addr = addr & PDE_SIZE_MASK;
+
+    table = (root == nullptr) ? (pml_entry_t*)kmem_from_phys((uintptr_t)KMEM_DATA.kernel_pdir.m_phys_root, KMEM_DATA.m_high_page_base) : root;
+
+    for (c_level = KMEM_PML4_LEVEL;; c_level--) {
+        entry = &table[(addr >> _kmem_level_shift(c_level)) & ENTRY_MASK];
+
+        if (c_level == level)
+            break;
+
+        error = _allocate_pde(entry, kmem_flags, page_flags);
+
+        if (error)
+            return error;
+
+        if (_kmem_entry_is_large(entry, c_level)) {
+            /* Lookups can just use the large page itself */
+            if ((kmem_flags & KMEM_CUSTOMFLAG_GET_MAKE) != KMEM_CUSTOMFLAG_GET_MAKE)
+                break;
+
+            error = _kmem_split_large_page(entry, c_level, addr);
+
+            if (error)
+                return error;
+        }
+
+        table = (pml_entry_t*)kmem_from_phys((uintptr_t)kmem_get_page_base(entry->raw_bits), KMEM_DATA.m_high_page_base);
+    }
+
+    *p_entry = entry;
+
+    if (p_level)
+        *p_level = c_level;
+
+    return KERR_NONE;
+}
+
 /*
  * This function is to be used after the bootstrap pagemap has been
  * discarded. When we create a new mapping, we pull a page from a
@@ -299,118 +699,203 @@ static inline kerror_t _allocate_pde(pml_entry_t* pde, uint32_t custom_flags, ui
 kerror_t kmem_get_page(pml_entry_t** bentry, pml_entry_t* root, uintptr_t addr, uint32_t kmem_flags, uint32_t page_flags)
 {
     kerror_t error;
-    pml_entry_t* pml4;
-    pml_entry_t* pdp;
-    pml_entry_t* pd;
-    pml_entry_t* pt;
-
-    /* Make sure the virtual address is not fucking us in our ass */
-    addr = addr & PDE_SIZE_MASK;
+    pml_entry_t* entry;
 
-    /* Compute indices */
-    const uint16_t pml4_idx = (addr >> 39) & ENTRY_MASK;
-    const uint16_t pdp_idx = (addr >> 30) & ENTRY_MASK;
-    const uint16_t pd_idx = (addr >> 21) & ENTRY_MASK;
-    const uint16_t pt_idx = (addr >> 12) & ENTRY_MASK;
-
-    pml4 = (root == nullptr) ? (pml_entry_t*)kmem_from_phys((uintptr_t)KMEM_DATA.kernel_pdir.m_phys_root, KMEM_DATA.m_high_page_base) : root;
-    error = _allocate_pde(&pml4[pml4_idx], kmem_flags, page_flags);
+    /* NOTE: Without KMEM_CUSTOMFLAG_GET_MAKE this might give back a large page entry */
+    error = _kmem_walk(&entry, nullptr, root, addr, KMEM_PT_LEVEL, kmem_flags, page_flags);
 
     if (error)
         return error;
 
-    pdp = (pml_entry_t*)kmem_from_phys((uintptr_t)kmem_get_page_base(pml4[pml4_idx].raw_bits), KMEM_DATA.m_high_page_base);
-    error = _allocate_pde(&pdp[pdp_idx], kmem_flags, page_flags);
+    if (bentry)
+        *bentry = entry;
 
-    if (error)
-        return error;
+    return KERR_NONE;
+}
 
-    pd = (pml_entry_t*)kmem_from_phys((uintptr_t)kmem_get_page_base(pdp[pdp_idx].raw_bits), KMEM_DATA.m_high_page_base);
-    error = _allocate_pde(&pd[pd_idx], kmem_flags, page_flags);
+/*
+ * Translate a virtual address to a physical address that is
+ * page-aligned
+ *
+ * TODO: change this function so errors are communicated clearly
+ */
+uintptr_t kmem_to_phys_aligned(pml_entry_t* root, vaddr_t addr)
+{
+    return ALIGN_DOWN_TO_PAGE(kmem_to_phys(root, addr));
+}
 
-    if (error)
-        return error;
+/*!
+ * @brief: Get a physical address by mapping
+ *
+ * Same as the function above, but this one also keeps the alignment in mind. Works for
+ * addresses inside large pages as well
+ */
+uintptr_t kmem_to_phys(pml_entry_t* root, vaddr_t addr)
+{
+    u32 level;
+    pml_entry_t* entry;
 
-    // this just should exist
-    pt = (pml_entry_t*)kmem_from_phys((uintptr_t)kmem_get_page_base(pd[pd_idx].raw_bits), KMEM_DATA.m_high_page_base);
+    /* Address is not mapped */
+    if (_kmem_walk(&entry, &level, root, addr, KMEM_PT_LEVEL, 0, 0))
+        return NULL;
 
-    if (bentry)
-        *bentry = (pml_entry_t*)&pt[pt_idx];
+    if (!pml_entry_is_bit_set(entry, PTE_PRESENT))
+        return NULL;
 
-    return KERR_NONE;
+    return _kmem_get_entry_base(entry, level) + (addr & ((1ULL << _kmem_level_shift(level)) - 1));
 }
 
-void kmem_invalidate_tlb_cache_entry(uintptr_t vaddr)
+void kmem_refresh_tlb(void)
 {
-    asm volatile("invlpg (%0)" : : "r"(vaddr));
+    _kmem_flush_tlb_local(true);
+}
 
-    /* TODO: send message to other cores that they need to
-    perform a tlb shootdown aswell on this address */
+bool kmem_map_page(pml_entry_t* table, vaddr_t virt, paddr_t phys, uint32_t kmem_flags, uint32_t page_flags)
+{
+    return kmem_map_range(table, virt, phys, 1, kmem_flags, page_flags);
 }
 
-void kmem_invalidate_tlb_cache_range(uintptr_t vaddr, size_t size)
+/*!
+ * @brief: Compute the entry bits for a mapping with @kmem_flags and @page_flags on @level
+ */
+static inline u64 _kmem_get_pte_bits(uint32_t kmem_flags, uint32_t page_flags, u32 level)
 {
-    vaddr_t virtual_base = ALIGN_DOWN_TO_PAGE(vaddr);
-    uintptr_t indices = kmem_get_page_idx(size);
+    u64 bits = PTE_PRESENT;
 
-    for (uintptr_t i = 0; i < indices; i++) {
-        kmem_invalidate_tlb_cache_entry(virtual_base + i * SMALL_PAGE_SIZE);
-    }
+    if ((page_flags & KMEM_FLAG_WRITABLE) == KMEM_FLAG_WRITABLE)
+        bits |= PTE_WRITABLE;
+    if ((page_flags & KMEM_FLAG_NOCACHE) == KMEM_FLAG_NOCACHE)
+        bits |= PTE_NO_CACHE;
+    if ((page_flags & KMEM_FLAG_WRITETHROUGH) == KMEM_FLAG_WRITETHROUGH)
+        bits |= PTE_WRITE_THROUGH;
+    if ((page_flags & KMEM_FLAG_SPEC) == KMEM_FLAG_SPEC)
+        bits |= (level == KMEM_PT_LEVEL) ? PTE_PAT : PDE_LARGE_PAT;
+    if ((page_flags & KMEM_FLAG_NOEXECUTE) == KMEM_FLAG_NOEXECUTE)
+        bits |= PTE_NX;
+
+    /* Set special bit */
+    if ((kmem_flags & KMEM_CUSTOMFLAG_CREATE_USER) == KMEM_CUSTOMFLAG_CREATE_USER || (page_flags & KMEM_FLAG_KERNEL) != KMEM_FLAG_KERNEL)
+        bits |= PTE_USER;
+
+    if (level != KMEM_PT_LEVEL)
+        bits |= PDE_HUGE_PAGE;
+
+    return bits;
 }
 
-void kmem_refresh_tlb(void)
+/*!
+ * @brief: Check if we can map a large page on @level at @virt
+ */
+static inline bool _kmem_can_map_large(vaddr_t virt, paddr_t phys, size_t page_count, u32 level, uint32_t kmem_flags)
 {
-    /* FIXME: is this always up to date? */
-    page_dir_t* current = get_current_processor()->m_page_dir;
+    const u64 mask = (1ULL << _kmem_level_shift(level)) - 1;
 
-    /* Reloading CR3 will clear the tlb */
-    kmem_set_addrspace(current);
+    if ((kmem_flags & KMEM_CUSTOMFLAG_NO_LARGE_PAGES) == KMEM_CUSTOMFLAG_NO_LARGE_PAGES)
+        return false;
+
+    if (level == KMEM_PDP_LEVEL && (KMEM_DATA.m_kmem_flags & KMEM_STATUS_FLAG_HAS_HUGE_PAGES) != KMEM_STATUS_FLAG_HAS_HUGE_PAGES)
+        return false;
+
+    return ((virt & mask) == 0 && (phys & mask) == 0 && page_count >= (1ULL << (_kmem_level_shift(level) - PAGE_SHIFT)));
 }
 
-bool kmem_map_page(pml_entry_t* table, vaddr_t virt, paddr_t phys, uint32_t kmem_flags, uint32_t page_flags)
+/*!
+ * @brief: Try to put a large page at @entry
+ *
+ * A table that's already there gets replaced, which is only allowed if it's a pagetable, since
+ * every entry in it is about to be overwritten anyway
+ */
+static bool _kmem_map_large(pml_entry_t* table, pml_entry_t* entry, u32 level, vaddr_t virt, paddr_t phys, u64 bits)
 {
-    return kmem_map_range(table, virt, phys, 1, kmem_flags, page_flags);
+    paddr_t table_phys;
+    kmem_tlb_batch_t batch;
+
+    if (pml_entry_is_bit_set(entry, PDE_PRESENT) && !_kmem_entry_is_large(entry, level)) {
+        if (level != KMEM_PD_LEVEL)
+            return false;
+
+        table_phys = kmem_get_page_base(entry->raw_bits);
+
+        entry->raw_bits = phys | bits;
+
+        kmem_tlb_batch_init(&batch, table);
+        kmem_tlb_batch_add(&batch, virt, LARGE_PAGE_SIZE);
+        kmem_tlb_batch_flush(&batch);
+        kmem_phys_dealloc_page(kmem_get_page_idx(table_phys));
+        return true;
+    }
+
+    entry->raw_bits = phys | bits;
+    return true;
 }
 
+/*!
+ * @brief: Map @page_count pages at @virt_base to the physical range at @phys_base
+ *
+ * We walk the table once for every pagetable we touch and fill in runs of entries after that. Wherever
+ * both addresses line up on a 2 MiB (or 1 GiB) boundary and there is enough left to map, we use a
+ * large page instead, unless the caller asked for KMEM_CUSTOMFLAG_NO_LARGE_PAGES
+ */
 bool kmem_map_range(pml_entry_t* table, uintptr_t virt_base, uintptr_t phys_base, size_t page_count, uint32_t kmem_flags, uint32_t page_flags)
 {
-    pml_entry_t* page;
+    u64 pte_bits;
+    u32 level;
+    size_t nr_entries;
+    uint32_t pt_idx;
+    pml_entry_t* entry;
+    mutex_t* lock;
 
     /* Clear the low page bits from these addresses */
     virt_base &= ~PAGE_LOW_MASK;
     phys_base &= ~PAGE_LOW_MASK;
 
-    /*
-    if (!page_flags)
-      kernel_panic("Mapped page with page_flags=NULL");
-    */
+    pte_bits = _kmem_get_pte_bits(kmem_flags, page_flags, KMEM_PT_LEVEL);
+    lock = _kmem_get_map_lock(table, virt_base);
 
-    mutex_lock(_kmem_map_lock);
+    mutex_lock(lock);
 
-    for (uintptr_t i = 0; i < page_count; i++) {
-        if (kmem_get_page(&page, table, virt_base + (i << PAGE_SHIFT), kmem_flags, page_flags)) {
-            mutex_unlock(_kmem_map_lock);
-            return false;
+    while (page_count) {
+        /* Try the biggest page size first */
+        for (level = KMEM_PDP_LEVEL; level > KMEM_PT_LEVEL; level--) {
+            if (!_kmem_can_map_large(virt_base, phys_base, page_count, level, kmem_flags))
+                continue;
+
+            if (_kmem_walk(&entry, nullptr, table, virt_base, level, kmem_flags, page_flags))
+                goto fail_unlock;
+
+            if (_kmem_map_large(table, entry, level, virt_base, phys_base, _kmem_get_pte_bits(kmem_flags, page_flags, level)))
+                break;
+        }
+
+        if (level > KMEM_PT_LEVEL) {
+            nr_entries = (1ULL << (_kmem_level_shift(level) - PAGE_SHIFT));
+            goto next;
         }
 
-        /* Do the actual mapping */
-        kmem_set_page_base(page, phys_base + (i << PAGE_SHIFT));
+        if (_kmem_walk(&entry, &level, table, virt_base, KMEM_PT_LEVEL, kmem_flags, page_flags) || level != KMEM_PT_LEVEL)
+            goto fail_unlock;
+
+        pt_idx = (virt_base >> PAGE_SHIFT) & ENTRY_MASK;
+        nr_entries = STANDARD_PD_ENTRIES - pt_idx;
 
-        /* Set regular bits */
-        pml_entry_set_bit(page, PTE_PRESENT, true);
-        pml_entry_set_bit(page, PTE_WRITABLE, ((page_flags & KMEM_FLAG_WRITABLE) == KMEM_FLAG_WRITABLE));
-        pml_entry_set_bit(page, PTE_NO_CACHE, ((page_flags & KMEM_FLAG_NOCACHE) == KMEM_FLAG_NOCACHE));
-        pml_entry_set_bit(page, PTE_WRITE_THROUGH, ((page_flags & KMEM_FLAG_WRITETHROUGH) == KMEM_FLAG_WRITETHROUGH));
-        pml_entry_set_bit(page, PTE_PAT, ((page_flags & KMEM_FLAG_SPEC) == KMEM_FLAG_SPEC));
-        pml_entry_set_bit(page, PTE_NX, ((page_flags & KMEM_FLAG_NOEXECUTE) == KMEM_FLAG_NOEXECUTE));
+        if (nr_entries > page_count)
+            nr_entries = page_count;
 
-        /* Set special bit */
-        pml_entry_set_bit(page, PTE_USER,
-            (kmem_flags & KMEM_CUSTOMFLAG_CREATE_USER) == KMEM_CUSTOMFLAG_CREATE_USER ? true : (page_flags & KMEM_FLAG_KERNEL) != KMEM_FLAG_KERNEL);
+        for (uint32_t i = 0; i < nr_entries; i++)
+            entry[i].raw_bits = kmem_get_page_base(phys_base + (i << PAGE_SHIFT)) | pte_bits;
+
+    next:
+        virt_base += (nr_entries << PAGE_SHIFT);
+        phys_base += (nr_entries << PAGE_SHIFT);
+        page_count -= nr_entries;
     }
 
-    mutex_unlock(_kmem_map_lock);
+    mutex_unlock(lock);
     return true;
+
+fail_unlock:
+    mutex_unlock(lock);
+    return false;
 }
 
 /* Assumes we have a physical address buffer */
@@ -449,10 +934,14 @@ static bool __kmem_do_recursive_unmap(pml_entry_t* table, uintptr_t virt)
     if (!entry_exists)
         return false;
 
+    /* Large pages have no tables below them to clean up */
+    if (_kmem_entry_is_large(&pdp[pdp_idx], KMEM_PDP_LEVEL))
+        return false;
+
     pml_entry_t* pd = (pml_entry_t*)kmem_ensure_high_mapping((uintptr_t)kmem_get_page_base(pdp[pdp_idx].raw_bits));
     entry_exists = (pml_entry_is_bit_set(&pd[pd_idx], PDE_PRESENT));
 
-    if (!entry_exists)
+    if (!entry_exists || _kmem_entry_is_large(&pd[pd_idx], KMEM_PD_LEVEL))
         return false;
 
     pml_entry_t* pt = (pml_entry_t*)kmem_ensure_high_mapping((uintptr_t)kmem_get_page_base(pd[pd_idx].raw_bits));
@@ -464,21 +953,105 @@ static bool __kmem_do_recursive_unmap(pml_entry_t* table, uintptr_t virt)
     return true;
 }
 
-bool kmem_unmap_page_ex(pml_entry_t* table, uintptr_t virt, uint32_t custom_flags)
+/*!
+ * @brief: Clear @page_count entries starting at @virt, one pagetable at a time
+ *
+ * When @release is set, the references to the physical pages that were mapped get dropped as well.
+ * Caller must hold the map lock of @table
+ *
+ * @returns: 0 on success, 1 when part of the range has no pagetable, 2 when a physical page could not be released
+ */
+static int _kmem_unmap_range_locked(pml_entry_t* table, vaddr_t virt, size_t page_count, uint32_t custom_flags, bool release, bool clear)
 {
-    pml_entry_t* page;
+    int error;
+    u32 level;
+    size_t nr_entries;
+    uint32_t pt_idx;
+    paddr_t base;
+    pml_entry_t* entry;
+    kmem_tlb_batch_t batch;
+
+    error = 0;
+    virt = ALIGN_DOWN_TO_PAGE(virt);
 
-    if (kmem_get_page(&page, table, virt, custom_flags, 0))
-        return false;
+    kmem_tlb_batch_init(&batch, table);
 
-    page->raw_bits = NULL;
+    while (page_count) {
+        /* Stop at any large page we find on the way down */
+        if (_kmem_walk(&entry, &level, table, virt, KMEM_PT_LEVEL, custom_flags & ~KMEM_CUSTOMFLAG_GET_MAKE, 0)) {
+            error = 1;
+            break;
+        }
 
-    if ((custom_flags & KMEM_CUSTOMFLAG_RECURSIVE_UNMAP) == KMEM_CUSTOMFLAG_RECURSIVE_UNMAP)
-        __kmem_do_recursive_unmap(table, virt);
+        if (level != KMEM_PT_LEVEL) {
+            nr_entries = (1ULL << (_kmem_level_shift(level) - PAGE_SHIFT));
 
-    kmem_invalidate_tlb_cache_entry(virt);
+            /* Only part of this large page goes away, so break it up and try again */
+            if ((virt & ((nr_entries << PAGE_SHIFT) - 1)) || page_count < nr_entries) {
+                if (_kmem_split_large_page(entry, level, virt)) {
+                    error = 1;
+                    break;
+                }
 
-    return true;
+                continue;
+            }
+
+            base = _kmem_get_entry_base(entry, level);
+
+            for (size_t i = 0; release && !error && i < nr_entries; i++)
+                if (kmem_phys_dealloc_page(kmem_get_page_idx(base) + i))
+                    error = 2;
+
+            if (error)
+                break;
+
+            if (clear) {
+                entry->raw_bits = NULL;
+                kmem_tlb_batch_add(&batch, virt, nr_entries << PAGE_SHIFT);
+            }
+
+            goto next;
+        }
+
+        pt_idx = (virt >> PAGE_SHIFT) & ENTRY_MASK;
+        nr_entries = STANDARD_PD_ENTRIES - pt_idx;
+
+        if (nr_entries > page_count)
+            nr_entries = page_count;
+
+        for (uint32_t i = 0; i < nr_entries; i++) {
+            if (release && pml_entry_is_bit_set(&entry[i], PTE_PRESENT) && kmem_phys_dealloc_page(kmem_get_page_idx(kmem_get_page_base(entry[i].raw_bits)))) {
+                error = 2;
+                break;
+            }
+
+            if (clear)
+                entry[i].raw_bits = NULL;
+        }
+
+        if (clear)
+            kmem_tlb_batch_add(&batch, virt, nr_entries << PAGE_SHIFT);
+
+        if (error)
+            break;
+
+        /* Only needs to happen once per pagetable */
+        if (clear && (custom_flags & KMEM_CUSTOMFLAG_RECURSIVE_UNMAP) == KMEM_CUSTOMFLAG_RECURSIVE_UNMAP)
+            __kmem_do_recursive_unmap(table, virt);
+
+    next:
+        virt += (nr_entries << PAGE_SHIFT);
+        page_count -= nr_entries;
+    }
+
+    /* Flush whatever we managed to clear, even when we bailed halfway */
+    kmem_tlb_batch_flush(&batch);
+    return error;
+}
+
+bool kmem_unmap_page_ex(pml_entry_t* table, uintptr_t virt, uint32_t custom_flags)
+{
+    return kmem_unmap_range_ex(table, virt, 1, custom_flags);
 }
 
 // FIXME: free higher level pts as well
@@ -494,17 +1067,18 @@ bool kmem_unmap_range(pml_entry_t* table, uintptr_t virt, size_t page_count)
 
 bool kmem_unmap_range_ex(pml_entry_t* table, uintptr_t virt, size_t page_count, uint32_t custom_flags)
 {
-    virt = ALIGN_DOWN_TO_PAGE(virt);
+    int error;
+    mutex_t* lock;
 
-    for (uintptr_t i = 0; i < page_count; i++) {
+    lock = _kmem_get_map_lock(table, virt);
 
-        if (!kmem_unmap_page_ex(table, virt, custom_flags))
-            return false;
+    mutex_lock(lock);
 
-        virt += SMALL_PAGE_SIZE;
-    }
+    error = _kmem_unmap_range_locked(table, virt, page_count, custom_flags, false, true);
 
-    return true;
+    mutex_unlock(lock);
+
+    return (error == 0);
 }
 
 /*
@@ -623,26 +1197,25 @@ int kmem_dealloc_unmap(pml_entry_t* map, page_tracker_t* tracker, uintptr_t virt
  */
 int kmem_dealloc_ex(pml_entry_t* map, page_tracker_t* tracker, uintptr_t virt_base, size_t size, bool unmap, bool defer_res_release)
 {
+    int error;
+    mutex_t* lock;
     page_range_t range;
     const size_t pages_needed = GET_PAGECOUNT(virt_base, size);
 
     if (!pages_needed)
         return 0;
 
-    for (uintptr_t i = 0; i < pages_needed; i++) {
-        // get the virtual address of the current page
-        const vaddr_t vaddr = virt_base + (i * SMALL_PAGE_SIZE);
-        // get the physical base of that page
-        const paddr_t paddr = kmem_to_phys_aligned(map, vaddr);
-        // get the index of that physical page
-        const uintptr_t page_idx = kmem_get_page_idx(paddr);
+    lock = _kmem_get_map_lock(map, virt_base);
 
-        if (kmem_phys_dealloc_page(page_idx))
-            return 2;
+    mutex_lock(lock);
 
-        if (unmap && !kmem_unmap_page(map, vaddr))
-            return 1;
-    }
+    /* Release the physical pages and clear their entries in one go */
+    error = _kmem_unmap_range_locked(map, virt_base, pages_needed, 0, true, unmap);
+
+    mutex_unlock(lock);
+
+    if (error)
+        return error;
 
     /* Only release the resource if we dont want to defer that opperation */
     // if (resources && !defer_res_release && resource_release(virt_base, size, GET_RESOURCE(resources, KRES_TYPE_MEM)))
@@ -768,6 +1341,39 @@ int kmem_alloc_range(void** result, pml_entry_t* map, page_tracker_t* tracker, v
     return 0;
 }
 
+/*!
+ * @brief: Try to grab a zeroed, physically contiguous 2 MiB chunk for the virtual address @v_addr
+ *
+ * Only works when @v_addr is 2 MiB aligned and there are at least that many pages left to map
+ */
+static bool _kmem_alloc_large_chunk(paddr_t* p_addr, vaddr_t v_addr, size_t pages_left, uint32_t custom_flags)
+{
+    u64 page_idx;
+    paddr_t address;
+
+    if ((custom_flags & KMEM_CUSTOMFLAG_NO_LARGE_PAGES) == KMEM_CUSTOMFLAG_NO_LARGE_PAGES)
+        return false;
+
+    if ((v_addr & (LARGE_PAGE_SIZE - 1)) || pages_left < KMEM_LARGE_PAGE_PAGES)
+        return false;
+
+    if (kmem_phys_alloc_range(KMEM_LARGE_PAGE_PAGES, &page_idx))
+        return false;
+
+    address = kmem_get_page_addr(page_idx);
+
+    /* Needs to be aligned and inside the high map, so we can zero it */
+    if ((address & (LARGE_PAGE_SIZE - 1)) || address + LARGE_PAGE_SIZE > 2ULL * Gib) {
+        kmem_phys_dealloc_range(page_idx, KMEM_LARGE_PAGE_PAGES);
+        return false;
+    }
+
+    memset((void*)kmem_from_phys(address, KMEM_DATA.m_high_page_base), 0x00, LARGE_PAGE_SIZE);
+
+    *p_addr = address;
+    return true;
+}
+
 /*
  * This function will never remap or use identity mapping, so
  * KMEM_CUSTOMFLAG_NO_REMAP and KMEM_CUSTOMFLAG_IDENTITY are ignored here
@@ -793,13 +1399,25 @@ int kmem_alloc_scattered(void** result, pml_entry_t* map, page_tracker_t* tracke
      */
     for (uint64_t i = 0; i < pages_needed; i++) {
 
+        v_addr = v_base + (i * SMALL_PAGE_SIZE);
+
+        /* Try to back entire 2 MiB chunks with a single large page */
+        if (_kmem_alloc_large_chunk(&p_addr, v_addr, pages_needed - i, custom_flags)) {
+            if (!kmem_map_range(map, v_addr, p_addr, KMEM_LARGE_PAGE_PAGES, KMEM_CUSTOMFLAG_GET_MAKE | custom_flags, page_flags)) {
+                /* Nothing points to the chunk yet, give it back to the buddy allocator */
+                kmem_phys_dealloc_range(kmem_get_page_idx(p_addr), KMEM_LARGE_PAGE_PAGES);
+                return -1;
+            }
+
+            i += KMEM_LARGE_PAGE_PAGES - 1;
+            continue;
+        }
+
         error = kmem_alloc_phys_page(&p_addr);
 
         if (error)
             return error;
 
-        v_addr = v_base + (i * SMALL_PAGE_SIZE);
-
         /*
          * NOTE: don't mark, because otherwise the physical pages gets
          * marked free again after it is mapped
@@ -810,6 +1428,7 @@ int kmem_alloc_scattered(void** result, pml_entry_t* map, page_tracker_t* tracke
                 p_addr,
                 KMEM_CUSTOMFLAG_GET_MAKE | custom_flags,
                 page_flags)) {
+            kmem_phys_dealloc_page(kmem_get_page_idx(p_addr));
             return -1;
         }
     }
@@ -869,6 +1488,7 @@ int kmem_user_dealloc(struct proc* p, vaddr_t vaddr, size_t size)
 {
     paddr_t c_phys_base;
     uintptr_t c_phys_idx;
+    vaddr_t base;
     page_range_t range;
     const size_t page_count = GET_PAGECOUNT(vaddr, size);
 
@@ -876,6 +1496,7 @@ int kmem_user_dealloc(struct proc* p, vaddr_t vaddr, size_t size)
         return 0;
 
     vaddr = ALIGN_DOWN_TO_PAGE(vaddr);
+    base = vaddr;
 
     for (uintptr_t i = 0; i < page_count; i++) {
         /* Grab the aligned physical base of this virtual address */
@@ -900,8 +1521,8 @@ int kmem_user_dealloc(struct proc* p, vaddr_t vaddr, size_t size)
         vaddr += SMALL_PAGE_SIZE;
     }
 
-    /* Initialize a page range */
-    init_page_range(&range, kmem_get_page_idx(vaddr), page_count, 0, 1);
+    /* Initialize a page range (@vaddr points past the end by now) */
+    init_page_range(&range, kmem_get_page_idx(base), page_count, 0, 1);
 
     /* Deallocate the user range */
     page_tracker_dealloc(&p->m_virtual_tracker, &range);
@@ -1036,16 +1657,9 @@ dealloc_and_exit:
  */
 static void __kmem_map_kernel_range_to_map(pml_entry_t* map)
 {
-    pml_entry_t* page;
-    const size_t max_end_idx = kmem_get_page_idx(2ULL * Gib);
-
-    for (uintptr_t i = 0; i < max_end_idx; i++) {
-        if (kmem_get_page(&page, map, (i << PAGE_SHIFT) | HIGH_MAP_BASE, KMEM_CUSTOMFLAG_GET_MAKE, KMEM_FLAG_KERNEL | KMEM_FLAG_WRITABLE))
-            break;
-
-        kmem_set_page_base(page, (i << PAGE_SHIFT));
-        kmem_set_page_flags(page, KMEM_FLAG_KERNEL | KMEM_FLAG_WRITABLE);
-    }
+    /* Both ends are 1 GiB aligned, so this ends up as a handful of large pages */
+    if (!kmem_map_range(map, HIGH_MAP_BASE, 0, kmem_get_page_idx(2ULL * Gib), KMEM_CUSTOMFLAG_GET_MAKE, KMEM_FLAG_KERNEL | KMEM_FLAG_WRITABLE))
+        return;
 
     KLOG_INFO("Mapped kernel text\n");
 }
@@ -1138,7 +1752,8 @@ int kmem_create_page_dir(page_dir_t* ret, uint32_t custom_flags, size_t initial_
      */
     pml_entry_t* table_root;
 
-    error = (kmem_kernel_alloc_range((void**)&table_root, SMALL_PAGE_SIZE, KMEM_CUSTOMFLAG_CREATE_USER, KMEM_FLAG_WRITABLE));
+    /* One extra page behind the root for the mapping lock */
+    error = (kmem_kernel_alloc_range((void**)&table_root, KMEM_PAGE_DIR_ALLOC_SIZE, KMEM_CUSTOMFLAG_CREATE_USER, KMEM_FLAG_WRITABLE));
 
     if (error)
         return error;
@@ -1146,11 +1761,14 @@ int kmem_create_page_dir(page_dir_t* ret, uint32_t custom_flags, size_t initial_
     /* Clear root, so we have no random mappings */
     memset(table_root, 0, SMALL_PAGE_SIZE);
 
+    init_mutex(KMEM_PAGE_DIR_MAP_LOCK(table_root), NULL);
+
     /* NOTE: this works, but I really don't want to have to do this =/ */
     error = (kmem_copy_kernel_mapping(table_root));
 
     if (error) {
-        kmem_kernel_dealloc((vaddr_t)table_root, SMALL_PAGE_SIZE);
+        destroy_mutex(KMEM_PAGE_DIR_MAP_LOCK(table_root));
+        kmem_kernel_dealloc((vaddr_t)table_root, KMEM_PAGE_DIR_ALLOC_SIZE);
         return error;
     }
 
@@ -1161,9 +1779,27 @@ int kmem_create_page_dir(page_dir_t* ret, uint32_t custom_flags, size_t initial_
     ret->m_phys_root = kmem_to_phys(nullptr, (vaddr_t)table_root);
     ret->m_kernel_low = kernel_start;
     ret->m_kernel_high = kernel_end;
+
+    _kmem_alloc_pcid(ret);
+
+    KMEM_PAGE_DIR_INFO(table_root)->pcid = ret->m_pcid;
     return 0;
 }
 
+/*!
+ * @brief: Map the large page at @entry into @root at the same address
+ */
+static inline void _kmem_copy_large_entry(pml_entry_t* root, pml_entry_t* entry, u32 level, vaddr_t vaddr)
+{
+    kmem_map_range(
+        root,
+        vaddr,
+        _kmem_get_entry_base(entry, level),
+        (1ULL << (_kmem_level_shift(level) - PAGE_SHIFT)),
+        KMEM_CUSTOMFLAG_GET_MAKE,
+        (pml_entry_is_bit_set(entry, PTE_USER) ? 0 : KMEM_FLAG_KERNEL) | (pml_entry_is_bit_set(entry, PTE_WRITABLE) ? KMEM_FLAG_WRITABLE : 0));
+}
+
 /*!
  * @brief: Copy the contents of a pagemap into a new pagemap
  */
@@ -1197,6 +1833,12 @@ int kmem_copy_page_dir(page_dir_t* result, page_dir_t* src_dir)
             if (!pml_entry_is_bit_set(&pml4_entry[j], PDE_PRESENT))
                 continue;
 
+            /* 1 GiB page */
+            if (_kmem_entry_is_large(&pml4_entry[j], KMEM_PDP_LEVEL)) {
+                _kmem_copy_large_entry(result->m_root, &pml4_entry[j], KMEM_PDP_LEVEL, (j << (PAGE_SHIFT + 18)) | (i << (PAGE_SHIFT + 27)));
+                continue;
+            }
+
             paddr_t pdp_entry_phys = kmem_get_page_base(pml4_entry[j].raw_bits);
             pml_entry_t* pdp_entry = (pml_entry_t*)kmem_ensure_high_mapping(pdp_entry_phys);
 
@@ -1206,6 +1848,12 @@ int kmem_copy_page_dir(page_dir_t* result, page_dir_t* src_dir)
                 if (!pml_entry_is_bit_set(&pdp_entry[k], PDE_PRESENT))
                     continue;
 
+                /* 2 MiB page */
+                if (_kmem_entry_is_large(&pdp_entry[k], KMEM_PD_LEVEL)) {
+                    _kmem_copy_large_entry(result->m_root, &pdp_entry[k], KMEM_PD_LEVEL, (k << (PAGE_SHIFT + 9)) | (j << (PAGE_SHIFT + 18)) | (i << (PAGE_SHIFT + 27)));
+                    continue;
+                }
+
                 paddr_t pd_entry_phys = kmem_get_page_base(pdp_entry[k].raw_bits);
                 pml_entry_t* pd_entry = (pml_entry_t*)kmem_ensure_high_mapping(pd_entry_phys);
 
@@ -1292,6 +1940,17 @@ static int __clear_shared_kernel_mapping(pml_entry_t* dir)
     return (0);
 }
 
+/*!
+ * @brief: Drop the references to all the physical pages behind a large page
+ */
+static inline void _kmem_release_large_entry(pml_entry_t* entry, u32 level)
+{
+    const size_t base_idx = kmem_get_page_idx(_kmem_get_entry_base(entry, level));
+
+    for (size_t i = 0; i < (1ULL << (_kmem_level_shift(level) - PAGE_SHIFT)); i++)
+        kmem_phys_dealloc_page(base_idx + i);
+}
+
 /*
  * TODO: do we want to murder an entire addressspace, or do we just want to get rid
  * of the mappings?
@@ -1304,6 +1963,10 @@ static int __clear_shared_kernel_mapping(pml_entry_t* dir)
  */
 int kmem_destroy_page_dir(pml_entry_t* dir)
 {
+    /* Kernel and driver processes share the kernel root, which has no lock page behind it */
+    if (!dir || dir == KMEM_DATA.kernel_pdir.m_root)
+        return -1;
+
     // if (__is_current_pagemap(dir))
     //   return -1;
 
@@ -1345,6 +2008,12 @@ int kmem_destroy_page_dir(pml_entry_t* dir)
             if (!pml_entry_is_bit_set(&pml4_entry[j], PDE_PRESENT))
                 continue;
 
+            /* 1 GiB page, no table behind it */
+            if (_kmem_entry_is_large(&pml4_entry[j], KMEM_PDP_LEVEL)) {
+                _kmem_release_large_entry(&pml4_entry[j], KMEM_PDP_LEVEL);
+                continue;
+            }
+
             paddr_t pdp_entry_phys = kmem_get_page_base(pml4_entry[j].raw_bits);
             pml_entry_t* pdp_entry = (pml_entry_t*)kmem_ensure_high_mapping(pdp_entry_phys);
 
@@ -1354,6 +2023,12 @@ int kmem_destroy_page_dir(pml_entry_t* dir)
                 if (!pml_entry_is_bit_set(&pdp_entry[k], PDE_PRESENT))
                     continue;
 
+                /* 2 MiB page, no table behind it */
+                if (_kmem_entry_is_large(&pdp_entry[k], KMEM_PD_LEVEL)) {
+                    _kmem_release_large_entry(&pdp_entry[k], KMEM_PD_LEVEL);
+                    continue;
+                }
+
                 paddr_t pd_entry_phys = kmem_get_page_base(pdp_entry[k].raw_bits);
                 pml_entry_t* pd_entry = (pml_entry_t*)kmem_ensure_high_mapping(pd_entry_phys);
 
@@ -1387,16 +2062,24 @@ int kmem_destroy_page_dir(pml_entry_t* dir)
 
     } // pml4 loop
 
-    paddr_t dir_phys = kmem_to_phys_aligned(nullptr, (uintptr_t)dir);
-    uintptr_t idx = kmem_get_page_idx(dir_phys);
+    destroy_mutex(KMEM_PAGE_DIR_MAP_LOCK(dir));
+
+    /* Root table and the page with its lock */
+    for (uintptr_t i = 0; i < KMEM_PAGE_DIR_ALLOC_SIZE; i += SMALL_PAGE_SIZE) {
+        paddr_t dir_phys = kmem_to_phys_aligned(nullptr, (uintptr_t)dir + i);
+        uintptr_t idx = kmem_get_page_idx(dir_phys);
 
-    kmem_phys_dealloc_page(idx);
+        kmem_phys_dealloc_page(idx);
+    }
 
     return (0);
 }
 
 error_t kmem_set_addrspace_ex(page_dir_t* dir, struct proc* proc)
 {
+    u32 gen;
+    u64 cr3;
+
     /* Load the kernel map if there was no map specified */
     if (!dir)
         dir = &KMEM_DATA.kernel_pdir;
@@ -1408,8 +2091,24 @@ error_t kmem_set_addrspace_ex(page_dir_t* dir, struct proc* proc)
     ASSERT(get_current_processor() != nullptr);
     get_current_processor()->m_page_dir = dir;
 
+    cr3 = dir->m_phys_root;
+
+    if (_kmem_has_pcid()) {
+        gen = __atomic_load_n(&_kmem_tlb_gen, __ATOMIC_ACQUIRE);
+        cr3 |= (dir->m_pcid & KMEM_PCID_MASK);
+
+        /*
+         * Keep the TLB entries of this PCID if nothing changed since we last flushed them. PCID 0 is
+         * shared, so it always gets flushed
+         */
+        if (dir->m_pcid && _kmem_pcid_gen[dir->m_pcid] == gen)
+            cr3 |= KMEM_CR3_NOFLUSH;
+        else
+            _kmem_pcid_gen[dir->m_pcid] = gen;
+    }
+
     asm volatile("" : : : "memory");
-    asm volatile("movq %0, %%cr3" ::"r"(dir->m_phys_root));
+    asm volatile("movq %0, %%cr3" ::"r"(cr3));
     asm volatile("" : : : "memory");
 
     return 0;
@@ -1432,7 +2131,6 @@ int kmem_get_kernel_address(vaddr_t* p_kaddr, vaddr_t virtual_address, pml_entry
 
 int kmem_get_kernel_address_ex(vaddr_t* p_kaddr, vaddr_t virtual_address, vaddr_t map_base, pml_entry_t* map)
 {
-    pml_entry_t* page;
     paddr_t p_address;
     vaddr_t v_kernel_address;
     vaddr_t v_align_delta;
@@ -1441,11 +2139,11 @@ int kmem_get_kernel_address_ex(vaddr_t* p_kaddr, vaddr_t virtual_address, vaddr_
     if (!map)
         return -1;
 
-    /* Make sure we don't make a new page here */
-    if (kmem_get_page(&page, map, virtual_address, 0, 0))
-        return -1;
+    /* Make sure we don't make a new page here. This also resolves addresses inside large pages */
+    p_address = kmem_to_phys_aligned(map, virtual_address);
 
-    p_address = kmem_get_page_base(page->raw_bits);
+    if (!p_address)
+        return -1;
 
     /* Calculate the delta of the virtual address to its closest page base downwards */
     v_align_delta = virtual_address - ALIGN_DOWN_TO_PAGE(virtual_address);
@@ -1472,7 +2170,6 @@ int kmem_get_kernel_address_ex(vaddr_t* p_kaddr, vaddr_t virtual_address, vaddr_
  */
 int kmem_map_to_kernel(vaddr_t* p_kaddr, vaddr_t uaddr, size_t size, vaddr_t map_base, pml_entry_t* map, u32 custom_flags, u32 kmem_flags)
 {
-    pml_entry_t* page;
     paddr_t p_address;
     vaddr_t v_kernel_address;
     vaddr_t v_align_delta;
@@ -1484,11 +2181,11 @@ int kmem_map_to_kernel(vaddr_t* p_kaddr, vaddr_t uaddr, size_t size, vaddr_t map
     if (GET_PAGECOUNT(uaddr, size) == 0)
         return 0;
 
-    /* Make sure we don't make a new page here */
-    if (kmem_get_page(&page, map, uaddr, 0, 0))
-        return -1;
+    /* Make sure we don't make a new page here. This also resolves addresses inside large pages */
+    p_address = kmem_to_phys_aligned(map, uaddr);
 
-    p_address = kmem_get_page_base(page->raw_bits);
+    if (!p_address)
+        return -1;
 
     /* Calculate the delta of the virtual address to its closest page base downwards */
     v_align_delta = uaddr - ALIGN_DOWN_TO_PAGE(uaddr);
@@ -1511,6 +2208,27 @@ int kmem_map_to_kernel(vaddr_t* p_kaddr, vaddr_t uaddr, size_t size, vaddr_t map
     return 0;
 }
 
+/*!
+ * @brief: Check if the CPU supports 1 GiB pages
+ *
+ * processor_info isn't filled in yet at this point, so ask CPUID directly
+ */
+static void _init_kmem_detect_huge_pages(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    read_cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+
+    if (eax < 0x80000001)
+        return;
+
+    read_cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+
+    /* PDPE1GB */
+    if (edx & (1 << 26))
+        KMEM_DATA.m_kmem_flags |= KMEM_STATUS_FLAG_HAS_HUGE_PAGES;
+}
+
 /*
  * TODO: Implement a lock around the physical allocator
  * FIXME: this could be heapless
@@ -1519,8 +2237,9 @@ error_t init_kmem(uintptr_t* mb_addr)
 {
     memset(&KMEM_DATA, 0, sizeof(KMEM_DATA));
 
-    /* Create our mutex */
-    _kmem_map_lock = create_mutex(NULL);
+    init_mutex(&_kmem_kernel_map_lock, NULL);
+
+    init_spinlock(&_kmem_pcid_lock, NULL);
 
     /* Initialize the kernel physical memory unit */
     if (init_kmem_phys(mb_addr))
@@ -1529,8 +2248,14 @@ error_t init_kmem(uintptr_t* mb_addr)
     // Perform multiboot finalization
     finalize_multiboot();
 
+    /* Check if we're allowed to use 1 GiB pages before we build the kernel map */
+    _init_kmem_detect_huge_pages();
+
     _init_kmem_page_layout();
 
+    /* The kernel map is set up, let the physical allocator know */
+    init_kmem_phys_late();
+
     KMEM_DATA.m_kmem_flags |= KMEM_STATUS_FLAG_DONE_INIT;
 
     return 0;
@@ -84,8 +84,10 @@ void debug_kmem(void);
 #define PAGE_SIZE 0x200000
 #define PAGE_SHIFT 12
 #define LARGE_PAGE_SHIFT 21
+#define HUGE_PAGE_SHIFT 30
 #define SMALL_PAGE_SIZE (1ULL << PAGE_SHIFT)
 #define LARGE_PAGE_SIZE (1ULL << LARGE_PAGE_SHIFT)
+#define HUGE_PAGE_SIZE (1ULL << HUGE_PAGE_SHIFT)
 #define PAGE_SIZE_BYTES 0x200000UL
 
 #define PDP_MASK 0x3fffffffUL
@@ -113,9 +115,16 @@ void debug_kmem(void);
 #define KMEM_CUSTOMFLAG_NO_PHYS_REALIGN 0x00000020
 #define KMEM_CUSTOMFLAG_RECURSIVE_UNMAP 0x00000040
 #define KMEM_CUSTOMFLAG_GET_PDE 0x00000080
+/* Only use 4 KiB pages, even when the range could be mapped with large pages */
+#define KMEM_CUSTOMFLAG_NO_LARGE_PAGES 0x00000100
 
 #define KMEM_STATUS_FLAG_DONE_INIT 0x00000001
 #define KMEM_STATUS_FLAG_HAS_QUICKMAP 0x00000002
+/* The CPU can map 1 GiB pages */
+#define KMEM_STATUS_FLAG_HAS_HUGE_PAGES 0x00000004
+/* Address spaces are tagged with a PCID, so switching between them does not flush the TLB */
+#define KMEM_STATUS_FLAG_HAS_PCID 0x00000008
+#define KMEM_STATUS_FLAG_HAS_INVPCID 0x00000010
 
 // defines for alignment
 #define ALIGN_UP(addr, size) \
@@ -196,6 +205,28 @@ uintptr_t kmem_to_phys_aligned(pml_entry_t* root, uintptr_t addr);
  */
 void kmem_refresh_tlb();
 
+void kmem_enable_pcid(bool has_invpcid);
+void kmem_release_pcid(page_dir_t* dir);
+
+/* Ranges bigger than this many pages get a full flush instead of an invlpg for every page */
+#define KMEM_TLB_FLUSH_THRESHOLD 32
+
+/*
+ * A batch of TLB invalidations for a single pagemap
+ *
+ * Unmapping code adds every range it touches and flushes once at the end, so we only decide how to
+ * flush when we know how much has changed
+ */
+typedef struct kmem_tlb_batch {
+    pml_entry_t* table;
+    vaddr_t start;
+    vaddr_t end;
+} kmem_tlb_batch_t;
+
+void kmem_tlb_batch_init(kmem_tlb_batch_t* batch, pml_entry_t* table);
+void kmem_tlb_batch_add(kmem_tlb_batch_t* batch, vaddr_t vaddr, size_t size);
+void kmem_tlb_batch_flush(kmem_tlb_batch_t* batch);
+
 kerror_t kmem_get_page(pml_entry_t** bentry, pml_entry_t* root, uintptr_t addr, uint32_t kmem_flags, uint32_t page_flags);
 void kmem_set_page_flags(pml_entry_t* page, uint32_t flags);
 
@@ -9,6 +9,8 @@ typedef struct {
     vaddr_t m_kernel_low;
     pml_entry_t* m_root;
     paddr_t m_phys_root;
+    /* Process context ID that tags the TLB entries of this directory (0 when it has none) */
+    u16 m_pcid;
 } page_dir_t;
 
 #endif // !__ANIVA_MEM_PAGEDIR__
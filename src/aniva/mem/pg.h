@@ -11,6 +11,8 @@
 #define PDE_DIRTY 0x0000000000000040ULL
 #define PDE_HUGE_PAGE 0x0000000000000080ULL
 #define PDE_GLOBAL 0x0000000000000100ULL
+/* PAT bit of a large page. Bit 7 is taken by the page size bit on this level */
+#define PDE_LARGE_PAT 0x0000000000001000ULL
 #define PDE_NX 0x8000000000000000ULL
 
 #define PTE_PRESENT 0x0000000000000001ULL
@@ -9,6 +9,100 @@
 #include "mem/kmem.h"
 #include "mem/tracker/tracker.h"
 #include "sync/spinlock.h"
+#include "system/processor/processor.h"
+#include "tests/tests.h"
+
+/*
+ * Physical pages are handed out by a zoned buddy allocator
+ *
+ * Every page up to the highest usable page gets a phys_page_t in a flat array, indexed by its page
+ * index. Free pages live in blocks of 2^order pages, which sit on the free list of their order inside
+ * the zone they belong to. Allocating splits up a bigger block when there is no block of the right
+ * order, freeing merges a block with its buddy for as long as that one is free too.
+ *
+ * Single pages make up the bulk of what kmem asks for (pagetables, scattered allocations), so every
+ * CPU keeps a short list of hot order-0 pages which it refills from, and drains to, the buddy
+ * allocator in batches. Most page allocations never touch m_allocator_lock this way.
+ *
+ * Pages above the highest usable page (MMIO, framebuffers, ect.) are not managed. Reserving or
+ * releasing them is a no-op.
+ */
+
+#define PHYS_MAX_ORDER 10
+#define PHYS_NR_ORDERS (PHYS_MAX_ORDER + 1)
+
+#define PHYS_PAGE_NONE 0xffffffffU
+#define PHYS_PAGE_MAX_REFC 0xffff
+
+/* This page heads a free block on one of the zone free lists */
+#define PHYS_PAGE_FLAG_FREE 0x01
+/* This page is free, but sits on the hot list of a CPU */
+#define PHYS_PAGE_FLAG_HOT 0x02
+/* This page is in use and its links hold a pointer to its owner. Cleared when the page gets freed */
+#define PHYS_PAGE_FLAG_OWNED 0x04
+
+/* Max number of pages on a hot list before it gives a batch back */
+#define PHYS_HOT_HIGH 64
+/* Number of pages that move between a hot list and the buddy allocator at once */
+#define PHYS_HOT_BATCH 16
+
+enum PHYS_ZONE {
+    /* Old ISA DMA can only reach the first 16 Mib */
+    PHYS_ZONE_DMA,
+    /* Everything covered by the high kernel mapping */
+    PHYS_ZONE_NORMAL,
+    /* Everything above that */
+    PHYS_ZONE_HIGH,
+
+    PHYS_NR_ZONES,
+};
+
+#define PHYS_ZONE_DMA_END_IDX ((16ULL * Mib) >> PAGE_SHIFT)
+#define PHYS_ZONE_NORMAL_END_IDX ((2ULL * Gib) >> PAGE_SHIFT)
+
+/*
+ * Pagetables are accessed through the high kernel mapping, so we try the normal zone first and only
+ * touch the other zones when it runs dry
+ */
+static const enum PHYS_ZONE _phys_zone_fallback[] = {
+    PHYS_ZONE_NORMAL,
+    PHYS_ZONE_DMA,
+    PHYS_ZONE_HIGH,
+};
+
+typedef struct phys_page {
+    /* Links on a free list or a hot list. Used pages may store an owner pointer in here */
+    u32 next;
+    u32 prev;
+    /* Number of references to this page. Zero means free */
+    u16 refc;
+    /* Order of the block this page heads when it's free, or the index of its hot list when it's hot */
+    u8 order;
+    u8 flags;
+} phys_page_t;
+
+typedef struct phys_free_area {
+    u32 head;
+    u32 nr_free;
+} phys_free_area_t;
+
+typedef struct phys_zone {
+    const char* m_name;
+    /* Page indices [m_start, m_end) this zone covers */
+    u64 m_start;
+    u64 m_end;
+    /* Free pages in this zone, not counting the ones on hot lists */
+    size_t m_nr_free_pages;
+
+    phys_free_area_t m_areas[PHYS_NR_ORDERS];
+} phys_zone_t;
+
+typedef struct phys_hot_list {
+    spinlock_t lock;
+    u32 head;
+    u32 tail;
+    u32 count;
+} phys_hot_list_t;
 
 static struct {
     uint32_t m_mmap_entry_num;
@@ -21,13 +115,17 @@ static struct {
     size_t m_total_avail_memory_bytes;
     size_t m_total_unavail_memory_bytes;
 
-    /* TODO: Replace this with the physical tracker */
-    // bitmap_t* m_phys_bitmap;
+    /* One descriptor for every page we manage */
+    phys_page_t* m_pages;
+    size_t m_nr_pages;
+
+    phys_zone_t m_zones[PHYS_NR_ZONES];
 
-    /* Tracker 0: The physical page tracker =D */
-    page_tracker_t m_physical_tracker;
+    /* Order-0 pages cached per CPU */
+    phys_hot_list_t m_hot_lists[SYS_MAX_CPU];
+    bool m_hot_lists_enabled;
 
-    /* Lock around the physical allocation */
+    /* Lock around the buddy allocator */
     spinlock_t m_allocator_lock;
 
     /* List of physical ranges retrieved by parsing the memory map */
@@ -337,45 +435,546 @@ static int _allocate_free_physical_range(kmem_range_t* range, size_t size)
     return 0;
 }
 
-static int __init_physical_tracker()
+static inline phys_page_t* _phys_page(u64 idx)
+{
+    return &g_phys_data.m_pages[idx];
+}
+
+static inline bool _phys_is_managed(u64 idx)
+{
+    return (idx < g_phys_data.m_nr_pages);
+}
+
+static inline phys_zone_t* _phys_idx_to_zone(u64 idx)
+{
+    if (idx < PHYS_ZONE_DMA_END_IDX)
+        return &g_phys_data.m_zones[PHYS_ZONE_DMA];
+
+    if (idx < PHYS_ZONE_NORMAL_END_IDX)
+        return &g_phys_data.m_zones[PHYS_ZONE_NORMAL];
+
+    return &g_phys_data.m_zones[PHYS_ZONE_HIGH];
+}
+
+/*!
+ * @brief: Take a reference to a page that already has at least one
+ *
+ * Fails when the page is free, or when its refcount is saturated
+ */
+static inline bool _phys_page_ref(phys_page_t* page)
+{
+    u16 refc = __atomic_load_n(&page->refc, __ATOMIC_RELAXED);
+
+    do {
+        if (!refc || refc == PHYS_PAGE_MAX_REFC)
+            return false;
+    } while (!__atomic_compare_exchange_n(&page->refc, &refc, refc + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+/*!
+ * @brief: Drop a reference to a page
+ *
+ * @returns: The number of references left, or -1 if the page did not have any
+ */
+static inline int _phys_page_unref(phys_page_t* page)
+{
+    u16 refc = __atomic_load_n(&page->refc, __ATOMIC_RELAXED);
+
+    do {
+        if (!refc)
+            return -1;
+    } while (!__atomic_compare_exchange_n(&page->refc, &refc, refc - 1, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return refc - 1;
+}
+
+static inline void _phys_list_push(u32* head, u32* tail, u64 idx)
+{
+    phys_page_t* page = _phys_page(idx);
+
+    page->prev = PHYS_PAGE_NONE;
+    page->next = *head;
+
+    if (*head != PHYS_PAGE_NONE)
+        _phys_page(*head)->prev = idx;
+    else if (tail)
+        *tail = idx;
+
+    *head = idx;
+}
+
+static inline void _phys_list_remove(u32* head, u32* tail, u64 idx)
+{
+    phys_page_t* page = _phys_page(idx);
+
+    if (page->prev != PHYS_PAGE_NONE)
+        _phys_page(page->prev)->next = page->next;
+    else
+        *head = page->next;
+
+    if (page->next != PHYS_PAGE_NONE)
+        _phys_page(page->next)->prev = page->prev;
+    else if (tail)
+        *tail = page->prev;
+
+    page->next = PHYS_PAGE_NONE;
+    page->prev = PHYS_PAGE_NONE;
+}
+
+static inline void _buddy_add_block(phys_zone_t* zone, u64 idx, u32 order)
+{
+    phys_page_t* page = _phys_page(idx);
+
+    page->flags = PHYS_PAGE_FLAG_FREE;
+    page->order = order;
+
+    _phys_list_push(&zone->m_areas[order].head, nullptr, idx);
+    zone->m_areas[order].nr_free++;
+}
+
+static inline void _buddy_remove_block(phys_zone_t* zone, u64 idx)
+{
+    phys_page_t* page = _phys_page(idx);
+
+    _phys_list_remove(&zone->m_areas[page->order].head, nullptr, idx);
+    zone->m_areas[page->order].nr_free--;
+
+    page->flags &= ~PHYS_PAGE_FLAG_FREE;
+}
+
+/*!
+ * @brief: Give a block of 2^@order pages back to @zone
+ *
+ * Merges the block with its buddy for as long as that one is free as well.
+ * Caller must hold m_allocator_lock
+ */
+static void _buddy_free_block(phys_zone_t* zone, u64 idx, u32 order)
+{
+    u64 buddy_idx;
+    phys_page_t* buddy;
+
+    zone->m_nr_free_pages += (1ULL << order);
+
+    while (order < PHYS_MAX_ORDER) {
+        buddy_idx = idx ^ (1ULL << order);
+
+        if (buddy_idx < zone->m_start || buddy_idx >= zone->m_end)
+            break;
+
+        buddy = _phys_page(buddy_idx);
+
+        /* Buddy is (partially) in use, or split up */
+        if ((buddy->flags & PHYS_PAGE_FLAG_FREE) != PHYS_PAGE_FLAG_FREE || buddy->order != order)
+            break;
+
+        _buddy_remove_block(zone, buddy_idx);
+
+        idx &= ~(1ULL << order);
+        order++;
+    }
+
+    _buddy_add_block(zone, idx, order);
+}
+
+/*!
+ * @brief: Take a block of 2^@order pages from @zone
+ *
+ * Splits up a bigger block if there is no free block of @order.
+ * Caller must hold m_allocator_lock
+ *
+ * @returns: The index of the first page, or PHYS_PAGE_NONE if the zone can't fit the block
+ */
+static u64 _buddy_alloc_block(phys_zone_t* zone, u32 order)
+{
+    u32 c_order;
+    u64 idx;
+
+    for (c_order = order; c_order < PHYS_NR_ORDERS; c_order++)
+        if (zone->m_areas[c_order].head != PHYS_PAGE_NONE)
+            break;
+
+    if (c_order == PHYS_NR_ORDERS)
+        return PHYS_PAGE_NONE;
+
+    idx = zone->m_areas[c_order].head;
+
+    _buddy_remove_block(zone, idx);
+
+    /* Put back the upper halves we don't need */
+    while (c_order > order) {
+        c_order--;
+        _buddy_add_block(zone, idx + (1ULL << c_order), c_order);
+    }
+
+    zone->m_nr_free_pages -= (1ULL << order);
+
+    return idx;
+}
+
+/*!
+ * @brief: Take the single free page @idx out of the free block it's part of
+ *
+ * Caller must hold m_allocator_lock
+ */
+static bool _buddy_carve_page(phys_zone_t* zone, u64 idx)
+{
+    u32 order;
+    u64 head;
+    u64 half;
+    phys_page_t* page;
+
+    /* Blocks are aligned to their size, so the block that contains @idx starts at @idx rounded down to its order */
+    for (order = 0; order < PHYS_NR_ORDERS; order++) {
+        head = idx & ~((1ULL << order) - 1);
+        page = _phys_page(head);
+
+        if ((page->flags & PHYS_PAGE_FLAG_FREE) == PHYS_PAGE_FLAG_FREE && page->order == order)
+            break;
+    }
+
+    if (order == PHYS_NR_ORDERS)
+        return false;
+
+    _buddy_remove_block(zone, head);
+
+    /* Split the block, keeping the half that contains @idx */
+    while (order) {
+        order--;
+        half = head + (1ULL << order);
+
+        if (idx >= half) {
+            _buddy_add_block(zone, head, order);
+            head = half;
+        } else
+            _buddy_add_block(zone, half, order);
+    }
+
+    zone->m_nr_free_pages--;
+
+    return true;
+}
+
+/*!
+ * @brief: Free the pages [@idx, @idx + @nr_pages) in the biggest aligned blocks that fit
+ *
+ * Caller must hold m_allocator_lock
+ */
+static void _buddy_free_range(u64 idx, u64 nr_pages)
+{
+    u32 order;
+    const u64 end = idx + nr_pages;
+
+    while (idx < end) {
+        order = 0;
+
+        /* Zone borders are aligned to the biggest order, so this never crosses one */
+        while (order < PHYS_MAX_ORDER && (idx & ((2ULL << order) - 1)) == 0 && (idx + (2ULL << order)) <= end)
+            order++;
+
+        _buddy_free_block(_phys_idx_to_zone(idx), idx, order);
+
+        idx += (1ULL << order);
+    }
+}
+
+/*!
+ * @brief: Find a contiguous range that's too big for a single buddy block
+ *
+ * Rare enough to just walk the zone. Caller must hold m_allocator_lock
+ */
+static u64 _phys_alloc_pages_large(phys_zone_t* zone, u32 nr_pages)
+{
+    u64 idx;
+    u64 run_start;
+    u64 run_length;
+    phys_page_t* page;
+
+    run_start = zone->m_start;
+    run_length = 0;
+
+    for (idx = zone->m_start; idx < zone->m_end && run_length < nr_pages;) {
+        page = _phys_page(idx);
+
+        /* We only ever land on block heads, since we skip over entire free blocks */
+        if ((page->flags & PHYS_PAGE_FLAG_FREE) != PHYS_PAGE_FLAG_FREE) {
+            run_length = 0;
+            run_start = ++idx;
+            continue;
+        }
+
+        run_length += (1ULL << page->order);
+        idx += (1ULL << page->order);
+    }
+
+    if (run_length < nr_pages)
+        return PHYS_PAGE_NONE;
+
+    for (idx = run_start; idx < run_start + nr_pages; idx++)
+        ASSERT_MSG(_buddy_carve_page(zone, idx), "Failed to carve page out of a free run");
+
+    return run_start;
+}
+
+/*!
+ * @brief: Allocate @nr_pages contiguous pages from the buddy allocator
+ *
+ * Caller must hold m_allocator_lock
+ */
+static u64 _phys_alloc_pages(u32 nr_pages)
+{
+    u32 order;
+    u64 idx;
+    phys_zone_t* zone;
+
+    idx = PHYS_PAGE_NONE;
+    order = (nr_pages == 1) ? 0 : (32 - __builtin_clz(nr_pages - 1));
+
+    for (u32 i = 0; i < arrlen(_phys_zone_fallback) && idx == PHYS_PAGE_NONE; i++) {
+        zone = &g_phys_data.m_zones[_phys_zone_fallback[i]];
+
+        if (zone->m_nr_free_pages < nr_pages)
+            continue;
+
+        if (order > PHYS_MAX_ORDER) {
+            idx = _phys_alloc_pages_large(zone, nr_pages);
+            continue;
+        }
+
+        idx = _buddy_alloc_block(zone, order);
+
+        /* Give back the tail of the block we don't need */
+        if (idx != PHYS_PAGE_NONE && (1ULL << order) > nr_pages)
+            _buddy_free_range(idx + nr_pages, (1ULL << order) - nr_pages);
+    }
+
+    if (idx == PHYS_PAGE_NONE)
+        return PHYS_PAGE_NONE;
+
+    for (u64 i = idx; i < idx + nr_pages; i++) {
+        _phys_page(i)->flags = 0;
+        _phys_page(i)->refc = 1;
+    }
+
+    return idx;
+}
+
+static inline phys_hot_list_t* _phys_get_hot_list()
+{
+    return &g_phys_data.m_hot_lists[get_current_processor()->m_cpu_num % SYS_MAX_CPU];
+}
+
+static inline u8 _phys_get_hot_list_idx(phys_hot_list_t* hot)
 {
-    kmem_range_t cache_range;
-    vaddr_t cache_start_addr;
-    const size_t max_page = kmem_get_page_idx(g_phys_data.m_highest_phys_page_base);
-    /* Check how many physical pages we need to track */
-    const size_t physical_pages = max_page + 1;
-    /* Calculate how big our range cache size is going to be */
-    const size_t needed_range_cache_size = (3 << PAGE_SHIFT) + (g_phys_data.m_phys_ranges->m_length * sizeof(page_allocation_t));
+    return (u8)(hot - g_phys_data.m_hot_lists);
+}
+
+/*!
+ * @brief: Grab a batch of pages from the buddy allocator
+ *
+ * Hot lists only hold direct-mapped pages, so we only refill from the normal zone.
+ * Caller must hold @hot->lock
+ */
+static void _phys_hot_refill(phys_hot_list_t* hot)
+{
+    u64 idx;
+    phys_page_t* page;
+    phys_zone_t* zone = &g_phys_data.m_zones[PHYS_ZONE_NORMAL];
+
+    spinlock_lock(&g_phys_data.m_allocator_lock);
+
+    for (u32 i = 0; i < PHYS_HOT_BATCH; i++) {
+        idx = _buddy_alloc_block(zone, 0);
 
-    /* Find a bitmap. This is crucial */
-    ASSERT_MSG(_allocate_free_physical_range(&cache_range, needed_range_cache_size) == NULL, "Failed to find a physical range for our physmem tracker!");
+        if (idx == PHYS_PAGE_NONE)
+            break;
 
-    /* Compute where our bitmap MUST go */
-    cache_start_addr = kmem_ensure_high_mapping(cache_range.start);
+        page = _phys_page(idx);
+        page->flags = PHYS_PAGE_FLAG_HOT;
+        page->order = _phys_get_hot_list_idx(hot);
 
-    /* Initialize the page tracker object */
-    ASSERT_MSG(init_page_tracker(&g_phys_data.m_physical_tracker, (void*)cache_start_addr, needed_range_cache_size, max_page) == 0, "Failed to initialize the page tracker");
+        _phys_list_push(&hot->head, &hot->tail, idx);
+        hot->count++;
+    }
 
-    /* Pre-allocate all physical memory */
-    page_tracker_alloc(&g_phys_data.m_physical_tracker, 0, physical_pages, PAGE_RANGE_FLAG_KERNEL);
+    spinlock_unlock(&g_phys_data.m_allocator_lock);
+}
+
+/*!
+ * @brief: Give the @nr_pages coldest pages of @hot back to the buddy allocator
+ *
+ * Caller must hold @hot->lock
+ */
+static void _phys_hot_drain(phys_hot_list_t* hot, u32 nr_pages)
+{
+    u64 idx;
+
+    spinlock_lock(&g_phys_data.m_allocator_lock);
+
+    while (nr_pages-- && hot->tail != PHYS_PAGE_NONE) {
+        idx = hot->tail;
+
+        _phys_list_remove(&hot->head, &hot->tail, idx);
+        hot->count--;
+
+        _phys_page(idx)->flags = 0;
+
+        _buddy_free_block(_phys_idx_to_zone(idx), idx, 0);
+    }
+
+    spinlock_unlock(&g_phys_data.m_allocator_lock);
+}
+
+static u64 _phys_hot_alloc_page()
+{
+    u64 idx;
+    phys_page_t* page;
+    phys_hot_list_t* hot = _phys_get_hot_list();
+
+    spinlock_lock(&hot->lock);
+
+    if (!hot->count)
+        _phys_hot_refill(hot);
+
+    idx = hot->head;
+
+    if (idx != PHYS_PAGE_NONE) {
+        _phys_list_remove(&hot->head, &hot->tail, idx);
+        hot->count--;
+
+        page = _phys_page(idx);
+        page->flags = 0;
+        page->refc = 1;
+    }
+
+    spinlock_unlock(&hot->lock);
+
+    return idx;
+}
+
+static void _phys_hot_free_page(u64 idx)
+{
+    phys_page_t* page = _phys_page(idx);
+    phys_hot_list_t* hot = _phys_get_hot_list();
+
+    spinlock_lock(&hot->lock);
+
+    page->flags = PHYS_PAGE_FLAG_HOT;
+    page->order = _phys_get_hot_list_idx(hot);
+
+    /* Freed last, handed out first. This page is most likely still in cache */
+    _phys_list_push(&hot->head, &hot->tail, idx);
+
+    if (++hot->count > PHYS_HOT_HIGH)
+        _phys_hot_drain(hot, PHYS_HOT_BATCH);
+
+    spinlock_unlock(&hot->lock);
+}
+
+/*!
+ * @brief: Put a page that just lost its last reference back where it belongs
+ */
+static void _phys_release_page(u64 idx)
+{
+    phys_zone_t* zone = _phys_idx_to_zone(idx);
+
+    if (g_phys_data.m_hot_lists_enabled && zone == &g_phys_data.m_zones[PHYS_ZONE_NORMAL]) {
+        _phys_hot_free_page(idx);
+        return;
+    }
+
+    spinlock_lock(&g_phys_data.m_allocator_lock);
+
+    _buddy_free_block(zone, idx, 0);
+
+    spinlock_unlock(&g_phys_data.m_allocator_lock);
+}
+
+static void _init_phys_zone(phys_zone_t* zone, const char* name, u64 start, u64 end)
+{
+    const u64 nr_pages = g_phys_data.m_nr_pages;
+
+    zone->m_name = name;
+    zone->m_start = (start < nr_pages) ? start : nr_pages;
+    zone->m_end = (end < nr_pages) ? end : nr_pages;
+    zone->m_nr_free_pages = 0;
+
+    for (u32 i = 0; i < PHYS_NR_ORDERS; i++) {
+        zone->m_areas[i].head = PHYS_PAGE_NONE;
+        zone->m_areas[i].nr_free = 0;
+    }
+}
+
+static int __init_physical_allocator()
+{
+    u64 start_idx;
+    u64 end_idx;
+    paddr_t usable_end;
+    kmem_range_t pages_range;
+    kmem_range_t* range;
+
+    usable_end = 0;
+
+    /* We only need to manage pages up until the last usable page */
+    FOREACH(i, g_phys_data.m_phys_ranges)
+    {
+        range = i->data;
+
+        if (range->type == MEMTYPE_USABLE && (range->start + range->length) > usable_end)
+            usable_end = range->start + range->length;
+    }
+
+    g_phys_data.m_nr_pages = kmem_get_page_idx(ALIGN_DOWN_TO_PAGE(usable_end));
+
+    ASSERT_MSG(g_phys_data.m_nr_pages < PHYS_PAGE_NONE, "Too much physical memory to manage!");
+
+    /* Find a place for the page array. This is crucial */
+    ASSERT_MSG(_allocate_free_physical_range(&pages_range, g_phys_data.m_nr_pages * sizeof(phys_page_t)) == 0, "Failed to find a physical range for our page array!");
+
+    g_phys_data.m_pages = (phys_page_t*)kmem_ensure_high_mapping(pages_range.start);
+
+    /* Everything starts out reserved. Only the usable ranges are given to the buddy allocator */
+    for (u64 i = 0; i < g_phys_data.m_nr_pages; i++) {
+        g_phys_data.m_pages[i].next = PHYS_PAGE_NONE;
+        g_phys_data.m_pages[i].prev = PHYS_PAGE_NONE;
+        g_phys_data.m_pages[i].refc = 1;
+        g_phys_data.m_pages[i].order = 0;
+        g_phys_data.m_pages[i].flags = 0;
+    }
+
+    _init_phys_zone(&g_phys_data.m_zones[PHYS_ZONE_DMA], "DMA", 0, PHYS_ZONE_DMA_END_IDX);
+    _init_phys_zone(&g_phys_data.m_zones[PHYS_ZONE_NORMAL], "Normal", PHYS_ZONE_DMA_END_IDX, PHYS_ZONE_NORMAL_END_IDX);
+    _init_phys_zone(&g_phys_data.m_zones[PHYS_ZONE_HIGH], "High", PHYS_ZONE_NORMAL_END_IDX, g_phys_data.m_nr_pages);
+
+    for (u32 i = 0; i < SYS_MAX_CPU; i++) {
+        init_spinlock(&g_phys_data.m_hot_lists[i].lock, NULL);
+
+        g_phys_data.m_hot_lists[i].head = PHYS_PAGE_NONE;
+        g_phys_data.m_hot_lists[i].tail = PHYS_PAGE_NONE;
+        g_phys_data.m_hot_lists[i].count = 0;
+    }
 
-    // Mark the contiguous 'free' ranges as free in our bitmap
     FOREACH(i, g_phys_data.m_phys_ranges)
     {
-        const kmem_range_t* range = i->data;
+        range = i->data;
 
         if (range->type != MEMTYPE_USABLE)
             continue;
 
-        u64 base = range->start;
-        size_t size = range->length;
+        /* Merging with the reserved ranges might have left these unaligned */
+        start_idx = kmem_get_page_idx(ALIGN_UP_TO_PAGE(range->start));
+        end_idx = kmem_get_page_idx(ALIGN_DOWN_TO_PAGE(range->start + range->length));
 
-        KLOG_DBG("Marking free range: start=0x%llx, size=0x%llx\n", base, size);
+        if (start_idx >= end_idx)
+            continue;
+
+        KLOG_DBG("Marking free range: start=0x%llx, size=0x%llx\n", range->start, range->length);
+
+        for (u64 j = start_idx; j < end_idx; j++)
+            g_phys_data.m_pages[j].refc = 0;
 
-        /* Base and size should already be page-aligned */
-        kmem_phys_dealloc_range(
-            kmem_get_page_idx(base),
-            GET_PAGECOUNT(base, size));
+        _buddy_free_range(start_idx, end_idx - start_idx);
     }
 
     return 0;
@@ -388,12 +987,21 @@ size_t kmem_phys_get_total_bytecount()
 
 size_t kmem_phys_get_used_bytecount()
 {
-    size_t count = 0;
+    size_t nr_free = 0;
+
+    /* Doesn't need to be exact, so we don't bother taking the locks */
+    for (u32 i = 0; i < PHYS_NR_ZONES; i++)
+        nr_free += g_phys_data.m_zones[i].m_nr_free_pages;
+
+    for (u32 i = 0; i < SYS_MAX_CPU; i++)
+        nr_free += g_phys_data.m_hot_lists[i].count;
+
+    nr_free <<= PAGE_SHIFT;
 
-    /* Do the thing */
-    (void)page_tracker_get_used_page_count(&g_phys_data.m_physical_tracker, &count);
+    if (nr_free > g_phys_data.m_total_avail_memory_bytes)
+        return 0;
 
-    return (count << PAGE_SHIFT);
+    return g_phys_data.m_total_avail_memory_bytes - nr_free;
 }
 
 kmem_range_t* kmem_phys_get_range(u32 idx)
@@ -408,34 +1016,129 @@ u32 kmem_phys_get_nr_ranges()
 
 void kmem_phys_dump()
 {
-    page_tracker_dump(&g_phys_data.m_physical_tracker);
+    phys_zone_t* zone;
+
+    spinlock_lock(&g_phys_data.m_allocator_lock);
+
+    for (u32 i = 0; i < PHYS_NR_ZONES; i++) {
+        zone = &g_phys_data.m_zones[i];
+
+        KLOG_DBG("Zone %s: pages [0x%llx, 0x%llx), %lld free\n", zone->m_name, zone->m_start, zone->m_end, zone->m_nr_free_pages);
+
+        for (u32 j = 0; j < PHYS_NR_ORDERS; j++)
+            KLOG_DBG(" - order %d: %d free blocks\n", j, zone->m_areas[j].nr_free);
+    }
+
+    for (u32 i = 0; i < SYS_MAX_CPU; i++)
+        KLOG_DBG("CPU %d: %d hot pages\n", i, g_phys_data.m_hot_lists[i].count);
+
+    spinlock_unlock(&g_phys_data.m_allocator_lock);
 }
 
 bool kmem_phys_is_page_used(uintptr_t idx)
 {
-    bool has;
-
-    /* Check if the tracker has this page tracked */
-    if (page_tracker_has_addr(&g_phys_data.m_physical_tracker, kmem_get_page_addr(idx), &has))
+    /* Pages we don't manage are never up for grabs */
+    if (!_phys_is_managed(idx))
         return true;
 
-    return has;
+    return (__atomic_load_n(&_phys_page(idx)->refc, __ATOMIC_RELAXED) != 0);
+}
+
+/*!
+ * @brief: Attach @owner to a used page
+ *
+ * Lets subsystems get from a page back to whatever manages it, without having to keep
+ * lookup structures of their own. Only used pages can have an owner, freeing the page
+ * drops it. Pass NULL to detach the current owner
+ */
+error_t kmem_phys_set_owner(u64 page_idx, void* owner)
+{
+    phys_page_t* page;
+
+    if (!_phys_is_managed(page_idx))
+        return -EINVAL;
+
+    page = _phys_page(page_idx);
+
+    if (!__atomic_load_n(&page->refc, __ATOMIC_RELAXED))
+        return -EINVAL;
+
+    if (!owner) {
+        page->flags &= ~PHYS_PAGE_FLAG_OWNED;
+        return 0;
+    }
+
+    page->next = (u32)(u64)owner;
+    page->prev = (u32)((u64)owner >> 32);
+    page->flags |= PHYS_PAGE_FLAG_OWNED;
+    return 0;
+}
+
+/*!
+ * @brief: Get the owner of a used page, if it has one
+ */
+void* kmem_phys_get_owner(u64 page_idx)
+{
+    phys_page_t* page;
+
+    if (!_phys_is_managed(page_idx))
+        return nullptr;
+
+    page = _phys_page(page_idx);
+
+    if ((page->flags & PHYS_PAGE_FLAG_OWNED) != PHYS_PAGE_FLAG_OWNED || !__atomic_load_n(&page->refc, __ATOMIC_RELAXED))
+        return nullptr;
+
+    return (void*)((u64)page->next | ((u64)page->prev << 32));
 }
 
 /*!
  * @brief: Allocates a single physical page
+ *
+ * Served from the hot list of the current CPU when we can
  */
 error_t kmem_phys_alloc_page(u64* p_page_idx)
 {
-    return kmem_phys_alloc_range(1, p_page_idx);
+    u64 idx;
+
+    if (!p_page_idx)
+        return -EINVAL;
+
+    if (!g_phys_data.m_hot_lists_enabled)
+        return kmem_phys_alloc_range(1, p_page_idx);
+
+    idx = _phys_hot_alloc_page();
+
+    /* The normal zone is dry. Let the buddy allocator look through the other zones */
+    if (idx == PHYS_PAGE_NONE)
+        return kmem_phys_alloc_range(1, p_page_idx);
+
+    *p_page_idx = idx;
+    return 0;
 }
 
 /*!
- * @brief: Deallocates a single page
+ * @brief: Drops a reference to a single page
+ *
+ * The page is freed once the last reference is gone
  */
 error_t kmem_phys_dealloc_page(u64 page_idx)
 {
-    return kmem_phys_dealloc_range(page_idx, 1);
+    int refc;
+
+    /* Not ours to free */
+    if (!_phys_is_managed(page_idx))
+        return 0;
+
+    refc = _phys_page_unref(_phys_page(page_idx));
+
+    if (refc < 0)
+        return -EINVAL;
+
+    if (!refc)
+        _phys_release_page(page_idx);
+
+    return 0;
 }
 
 error_t kmem_phys_reserve_page(u64 page_idx)
@@ -447,24 +1150,59 @@ error_t kmem_phys_reserve_page(u64 page_idx)
  * @brief: Reserves a specific page range
  *
  * Used by drivers to prevent certain parts of mmio memory to be allocated
- * for generic use
+ * for generic use. Pages that are already in use get an extra reference
  */
 error_t kmem_phys_reserve_range(u64 page_idx, u32 nr_pages)
 {
     error_t error;
+    phys_page_t* page;
+    phys_hot_list_t* hot;
 
     if (!nr_pages)
         return -EINVAL;
 
+    error = 0;
+
+    /* Free pages might be on any hot list */
+    for (u32 i = 0; i < SYS_MAX_CPU; i++)
+        spinlock_lock(&g_phys_data.m_hot_lists[i].lock);
+
     spinlock_lock(&g_phys_data.m_allocator_lock);
 
-    /* Mark the entry used */
-    error = page_tracker_alloc(&g_phys_data.m_physical_tracker, page_idx, nr_pages, PAGE_RANGE_FLAG_KERNEL);
+    for (u64 idx = page_idx; idx < (page_idx + nr_pages) && !error; idx++) {
+        if (!_phys_is_managed(idx))
+            continue;
 
-    // page_tracker_dump(&g_phys_data.m_physical_tracker);
+        page = _phys_page(idx);
+
+        if (_phys_page_ref(page))
+            continue;
+
+        if (page->refc == PHYS_PAGE_MAX_REFC) {
+            error = -ERANGE;
+            break;
+        }
+
+        if ((page->flags & PHYS_PAGE_FLAG_HOT) == PHYS_PAGE_FLAG_HOT) {
+            hot = &g_phys_data.m_hot_lists[page->order];
+
+            _phys_list_remove(&hot->head, &hot->tail, idx);
+            hot->count--;
+        } else if (!_buddy_carve_page(_phys_idx_to_zone(idx), idx)) {
+            /* Someone is still in the middle of freeing this page */
+            error = -EBUSY;
+            break;
+        }
+
+        page->flags = 0;
+        page->refc = 1;
+    }
 
     spinlock_unlock(&g_phys_data.m_allocator_lock);
 
+    for (u32 i = SYS_MAX_CPU; i > 0; i--)
+        spinlock_unlock(&g_phys_data.m_hot_lists[i - 1].lock);
+
     return error;
 }
 
@@ -473,46 +1211,49 @@ error_t kmem_phys_reserve_range(u64 page_idx, u32 nr_pages)
  */
 error_t kmem_phys_alloc_range(u32 nr_pages, u64* p_page_idx)
 {
-    error_t error;
-    page_range_t range;
+    u64 idx;
 
     if (!p_page_idx || !nr_pages)
         return -EINVAL;
 
     spinlock_lock(&g_phys_data.m_allocator_lock);
 
-    /* Try to allocate any range */
-    error = page_tracker_alloc_any(&g_phys_data.m_physical_tracker, PAGE_TRACKER_FIRST_FIT, nr_pages, PAGE_RANGE_FLAG_KERNEL, &range);
-
-    // page_tracker_dump(&g_phys_data.m_physical_tracker);
-
-    // KLOG_DBG("returned range: %lld(%d)\n", range.page_idx, range.nr_pages);
+    idx = _phys_alloc_pages(nr_pages);
 
     spinlock_unlock(&g_phys_data.m_allocator_lock);
 
-    /* Export the page idx */
-    if (!error)
-        *p_page_idx = range.page_idx;
+    if (idx == PHYS_PAGE_NONE)
+        return -ENOMEM;
 
-    return error;
+    *p_page_idx = idx;
+    return 0;
 }
 
 /*!
- * @brief: Deallocates a contiguous range of physical memory
+ * @brief: Drops a reference to every page in a contiguous range of physical memory
  */
 error_t kmem_phys_dealloc_range(u64 page_idx, u32 nr_pages)
 {
+    int refc;
     error_t error;
-    page_range_t range;
 
-    /* Initialize the range */
-    init_page_range(&range, page_idx, nr_pages, 0, 1);
+    if (nr_pages == 1)
+        return kmem_phys_dealloc_page(page_idx);
+
+    error = 0;
 
-    /* Lock this fucker */
     spinlock_lock(&g_phys_data.m_allocator_lock);
 
-    /* Deallocate */
-    error = page_tracker_dealloc(&g_phys_data.m_physical_tracker, &range);
+    for (u64 idx = page_idx; idx < (page_idx + nr_pages) && _phys_is_managed(idx); idx++) {
+        refc = _phys_page_unref(_phys_page(idx));
+
+        if (refc < 0)
+            error = -EINVAL;
+
+        /* Bigger ranges go straight to the buddy allocator, where they can merge again */
+        if (!refc)
+            _buddy_free_block(_phys_idx_to_zone(idx), idx, 0);
+    }
 
     spinlock_unlock(&g_phys_data.m_allocator_lock);
 
@@ -582,9 +1323,7 @@ int init_kmem_phys(u64* mb_addr)
      */
     kmem_parse_mmap();
 
-    // if (__init_physical_tracker_bitmap())
-    // return -ENOMEM;
-    if (__init_physical_tracker())
+    if (__init_physical_allocator())
         return -ENOMEM;
 
     return 0;
@@ -597,5 +1336,77 @@ int init_kmem_phys(u64* mb_addr)
  */
 int init_kmem_phys_late()
 {
+    /* Single pages can be served from the per-CPU hot lists from now on */
+    g_phys_data.m_hot_lists_enabled = true;
     return 0;
 }
+
+#define PHYS_TEST_NR_PAGES 256
+#define PHYS_TEST_ROUNDS 64
+
+/*!
+ * @brief: Checks the buddy allocator and measures how fast we can hand out pages
+ */
+static error_t __test_kmem_phys_alloc(aniva_test_t* test)
+{
+    u64 idx;
+    u64 start;
+    u64 page_cycles;
+    u64 range_cycles;
+    u64 pages[PHYS_TEST_NR_PAGES];
+
+    start = read_tsc();
+
+    /* Single pages. These should mostly hit the hot lists */
+    for (u32 i = 0; i < PHYS_TEST_ROUNDS; i++) {
+        for (u32 j = 0; j < PHYS_TEST_NR_PAGES; j++)
+            if (kmem_phys_alloc_page(&pages[j]))
+                return -ENOMEM;
+
+        for (u32 j = 0; j < PHYS_TEST_NR_PAGES; j++)
+            if (kmem_phys_dealloc_page(pages[j]))
+                return -EINVAL;
+    }
+
+    page_cycles = (read_tsc() - start) / (PHYS_TEST_ROUNDS * PHYS_TEST_NR_PAGES);
+
+    start = read_tsc();
+
+    /* Contiguous ranges of every order */
+    for (u32 i = 0; i < PHYS_TEST_ROUNDS; i++) {
+        for (u32 order = 1; order < PHYS_NR_ORDERS; order++) {
+            if (kmem_phys_alloc_range(1 << order, &idx))
+                return -ENOMEM;
+
+            /* Blocks are always aligned to their size */
+            if (idx & ((1ULL << order) - 1))
+                return -EINVAL;
+
+            if (!kmem_phys_is_page_used(idx) || !kmem_phys_is_page_used(idx + (1ULL << order) - 1))
+                return -EINVAL;
+
+            if (kmem_phys_dealloc_range(idx, 1 << order))
+                return -EINVAL;
+
+            if (kmem_phys_is_page_used(idx))
+                return -EINVAL;
+        }
+    }
+
+    range_cycles = (read_tsc() - start) / (PHYS_TEST_ROUNDS * PHYS_MAX_ORDER);
+
+    /* An extra reference must keep a page alive */
+    if (kmem_phys_alloc_page(&idx) || kmem_phys_reserve_page(idx))
+        return -ENOMEM;
+
+    if (kmem_phys_dealloc_page(idx) || !kmem_phys_is_page_used(idx))
+        return -EINVAL;
+
+    if (kmem_phys_dealloc_page(idx) || kmem_phys_is_page_used(idx))
+        return -EINVAL;
+
+    KLOG("(%lld cycles/page, %lld cycles/range) ", page_cycles, range_cycles);
+    return 0;
+}
+
+ANIVA_REGISTER_TEST("physical page allocation", kmem_phys_alloc_range, __test_kmem_phys_alloc, ANIVA_TEST_TYPE_MEM);
@@ -36,6 +36,9 @@ error_t kmem_phys_reserve_range(u64 page_idx, u32 nr_pages);
 error_t kmem_phys_alloc_range(u32 nr_pages, u64* p_page_idx);
 error_t kmem_phys_dealloc_range(u64 page_idx, u32 nr_pages);
 
+error_t kmem_phys_set_owner(u64 page_idx, void* owner);
+void* kmem_phys_get_owner(u64 page_idx);
+
 size_t kmem_phys_get_total_bytecount();
 size_t kmem_phys_get_used_bytecount();
 
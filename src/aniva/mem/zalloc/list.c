@@ -13,183 +13,144 @@ static const enum ZONE_ENTRY_SIZE __default_entry_sizes[DEFAULT_ZONE_ENTRY_SIZE_
     [7] = ZALLOC_1024BYTES,
 };
 
-/*
- * This could probably also be done with a binary search
+/*!
+ * @brief: Get the size class for an allocation of @size bytes
+ *
+ * @size must be in the range [1, ZALLOC_LIST_MAX_SIZE]
  */
-static kerror_t __allocator_list_add_allocator(zalloc_list_t* list, zone_allocator_t* allocator)
+static inline uint32_t __size_to_class(size_t size)
 {
-    size_t size_to_add;
-    zone_allocator_t* next;
-    zone_allocator_t** itt;
+    uint32_t shift;
 
-    if (!list || !allocator || !allocator->m_entry_size)
-        return -1;
+    if (size <= ZALLOC_LIST_LINEAR_MAX)
+        return (size - 1) >> 3;
 
-    size_to_add = allocator->m_entry_size;
+    /* The power of two right below @size */
+    shift = 63 - __builtin_clzl(size - 1);
 
-    for (itt = &list->list; *itt; itt = &(*itt)->m_next) {
-        next = (*itt)->m_next;
-
-        /* No duplicate sizes */
-        if (size_to_add == (*itt)->m_entry_size)
-            return -1;
-
-        if (size_to_add > (*itt)->m_entry_size && (!next || size_to_add < next->m_entry_size))
-            break;
-    }
+    return ZALLOC_LIST_NR_LINEAR_CLASSES + (shift - 6) * 4 + (((size - 1) >> (shift - 2)) & 3);
+}
 
-    if (*itt) {
+static inline size_t __class_to_size(uint32_t class)
+{
+    uint32_t shift;
 
-        /*
-         * Since the size of the allocator to add is inbetween the itterator and the nexts size,
-         * we need to put it inbetween the two
-         */
-        allocator->m_next = next;
-        (*itt)->m_next = allocator;
+    if (class < ZALLOC_LIST_NR_LINEAR_CLASSES)
+        return (class + 1) << 3;
 
-    } else
-        *itt = allocator;
+    class -= ZALLOC_LIST_NR_LINEAR_CLASSES;
+    shift = 6 + (class >> 2);
 
-    list->allocator_count++;
-    return (0);
+    return (1ULL << shift) + (((class & 3) + 1) << (shift - 2));
 }
 
-/*
- * Find the middle of a range using a fast and a slow pointer
+/*!
+ * @brief: Put @allocator in the slot of its size class
+ *
+ * Also links it into the list, so we can find everything again when the list is destroyed
  */
-static zone_allocator_t** __try_find_middle_zone_allocator(zone_allocator_t** start, zone_allocator_t** end)
+static kerror_t __allocator_list_add_allocator(zalloc_list_t* list, zone_allocator_t* allocator)
 {
+    uint32_t class;
+
+    if (!list || !allocator || !allocator->m_entry_size || allocator->m_entry_size > ZALLOC_LIST_MAX_SIZE)
+        return -1;
 
-    zone_allocator_t** slow = start;
-    zone_allocator_t** fast = start;
+    class = __size_to_class(allocator->m_entry_size);
 
-    while (*fast && ((*fast)->m_next) && (fast != end && (&(*fast)->m_next != end))) {
-        slow = &(*slow)->m_next;
-        fast = &(*fast)->m_next->m_next;
-    }
+    /* No duplicate classes, and the allocator must be exactly the class size */
+    if (list->classes[class] || __class_to_size(class) != allocator->m_entry_size)
+        return -1;
+
+    list->classes[class] = allocator;
+
+    allocator->m_next = list->list;
+    list->list = allocator;
 
-    return slow;
+    list->allocator_count++;
+    return (0);
 }
 
 /*!
- * @brief Find the optimal zone allocator to store a allocatin of the size specified
+ * @brief Find the zone allocator for an allocation of @size bytes
  *
- * Try to find a zone allocator that fits our size specification. The
+ * Creates the allocator for the size class when it does not exist yet
  */
 static zone_allocator_t* __get_allocator_for_size(zalloc_list_t* list, size_t size)
 {
-    zone_allocator_t** current;
-    zone_allocator_t** priv = nullptr;
-    zone_allocator_t** end = nullptr;
-    zone_allocator_t** start = &list->list;
-
-    while ((current = __try_find_middle_zone_allocator(start, end)) != nullptr) {
-        if (!current || !(*current) || current == priv)
-            break;
-
-        /* If we accept this allocation size, break */
-        if ((*current)->m_entry_size == size || ((*current)->m_entry_size - size) <= ZALLOC_ACCEPTABLE_MEMSIZE_DEVIATON)
-            return (*current);
-
-        /*
-         * Otherwise devide the list and search the half that must contain the correct size
-         */
-        if ((*current)->m_entry_size > size) {
-            end = current;
-        } else {
-            start = current;
-        }
-
-        priv = current;
-    }
-
-    return nullptr;
-}
-
-void* zalloc_listed(zalloc_list_t* list, size_t size)
-{
-    size_t allocator_size;
+    size_t class_size;
+    uint32_t class;
     zone_allocator_t* allocator;
 
-    if (!size)
+    if (!size || size > ZALLOC_LIST_MAX_SIZE)
         return nullptr;
 
-    allocator = __get_allocator_for_size(list, size);
+    class = __size_to_class(size);
+    allocator = list->classes[class];
 
-    if (!allocator) {
+    if (allocator)
+        return allocator;
 
-        allocator_size = ZALLOC_DEFAULT_ALLOC_COUNT * size;
+    class_size = __class_to_size(class);
 
-        /* Let's try to create a new allocator for this size */
-        allocator = create_zone_allocator(allocator_size, size, ZALLOC_FLAG_KERNEL);
+    /* Let's try to create a new allocator for this class */
+    allocator = create_zone_allocator(ZALLOC_DEFAULT_ALLOC_COUNT * class_size, class_size, ZALLOC_FLAG_KERNEL);
 
-        ASSERT(!__allocator_list_add_allocator(list, allocator));
-    }
-
-    /*
     if (!allocator)
-      return nullptr;
-      */
+        return nullptr;
 
-    ASSERT_MSG(allocator, "Failed to find zone allocator for kernel allocation!");
+    ASSERT(!__allocator_list_add_allocator(list, allocator));
 
-    return zalloc(allocator, size);
+    return allocator;
 }
 
-void zfree_listed(zalloc_list_t* list, void* address, size_t size)
+void* zalloc_listed(zalloc_list_t* list, size_t size)
 {
     zone_allocator_t* allocator;
 
-    if (!size)
-        return;
-
     allocator = __get_allocator_for_size(list, size);
 
-    /*
     if (!allocator)
-      return;
-      */
+        return nullptr;
 
-    ASSERT_MSG(allocator, "Failed to find zone allocator to free kernel allocation!");
+    return zalloc(allocator, size);
+}
 
-    zfree(allocator, address, size);
+/*!
+ * @brief: Free an allocation made with zalloc_listed
+ *
+ * The zone (and with it, the allocator) is found through @address. @size is only kept for
+ * API compatibility
+ */
+void zfree_listed(zalloc_list_t* list, void* address, size_t size)
+{
+    (void)size;
+
+    zfree_listed_scan(list, address);
 }
 
 /*!
  * @brief: Free an address if we don't know the entry size
  *
- * Can be quite slowe, so
- * TODO: Optimize by caching recent allocations made in an allocator list so we
- * don't have to do expensive lookups every time there is a free call
+ * The zone that backs @address is found through the metadata of its physical page
  */
 kerror_t zfree_listed_scan(zalloc_list_t* list, void* address)
 {
-    zone_t* c_zone;
-    zone_store_t* c_store;
-    zone_allocator_t* alloc;
+    zone_t* zone;
 
-    /* Scan over all the allocators to find which one containse @address */
-    for (alloc = list->list; alloc; alloc = alloc->m_next) {
-        c_store = alloc->m_store;
-
-        while (c_store) {
-
-            for (uint32_t i = 0; i < c_store->m_zones_count; i++) {
-                c_zone = c_store->m_zones[i];
+    if (!list || !address)
+        return -1;
 
-                if (c_zone->m_entries_start < (vaddr_t)address && (c_zone->m_entries_start + c_zone->m_total_available_size) >= (vaddr_t)address)
-                    break;
-            }
+    zone = zone_from_address(address);
 
-            c_zone = nullptr;
-            c_store = c_store->m_next;
-        }
-    }
+    if (!zone || !zone->m_allocator)
+        return -1;
 
-    if (!c_zone || !c_store || !alloc)
+    /* Make sure the zone is actually part of this list */
+    if (zone->m_zone_entry_size > ZALLOC_LIST_MAX_SIZE || list->classes[__size_to_class(zone->m_zone_entry_size)] != zone->m_allocator)
         return -1;
 
-    zfree_fixed(alloc, address);
+    zfree(zone->m_allocator, address, zone->m_zone_entry_size);
     return 0;
 }
 
@@ -234,6 +195,8 @@ void destroy_zalloc_list(zalloc_list_t* list)
 
     walker = list->list;
 
+    memset(list->classes, 0, sizeof(list->classes));
+
     do {
         next = walker->m_next;
 
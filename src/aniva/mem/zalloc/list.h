@@ -6,8 +6,16 @@
 
 struct zone_allocator;
 
+/* Eight classes of 8 byte steps, after that four classes for every power of two up to 32 Kib */
+#define ZALLOC_LIST_NR_LINEAR_CLASSES 8
+#define ZALLOC_LIST_LINEAR_MAX (ZALLOC_LIST_NR_LINEAR_CLASSES * 8)
+#define ZALLOC_LIST_NR_CLASSES (ZALLOC_LIST_NR_LINEAR_CLASSES + 9 * 4)
+#define ZALLOC_LIST_MAX_SIZE (32 * Kib)
+
 typedef struct zalloc_list {
     struct zone_allocator* list;
+    /* Allocator for every size class. Created on the first allocation of a class */
+    struct zone_allocator* classes[ZALLOC_LIST_NR_CLASSES];
     /* How many allocators does this list hold */
     uint32_t allocator_count;
     /* How many pages does this struct take up */
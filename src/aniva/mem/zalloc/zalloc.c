@@ -2,6 +2,7 @@
 #include "libk/data/bitmap.h"
 #include "libk/flow/error.h"
 #include "logging/log.h"
+#include "mem/phys.h"
 #include "mem/zalloc/list.h"
 #include "sys/types.h"
 #include <mem/heap.h>
@@ -18,6 +19,54 @@ zone_allocator_t __initial_allocator[DEFAULT_ZONE_ENTRY_SIZE_COUNT];
 static inline void* zone_allocate(zone_t* zone, size_t size);
 static inline int zone_deallocate(zone_t* zone, void* address, size_t size);
 
+static inline void __zone_list_push(zone_t** list, zone_t* zone)
+{
+    zone->m_prev = nullptr;
+    zone->m_next = *list;
+
+    if (*list)
+        (*list)->m_prev = zone;
+
+    *list = zone;
+}
+
+static inline void __zone_list_remove(zone_t** list, zone_t* zone)
+{
+    if (zone->m_prev)
+        zone->m_prev->m_next = zone->m_next;
+    else
+        *list = zone->m_next;
+
+    if (zone->m_next)
+        zone->m_next->m_prev = zone->m_prev;
+
+    zone->m_next = nullptr;
+    zone->m_prev = nullptr;
+}
+
+/*!
+ * @brief: Put @zone on the list of its allocator that matches its state
+ */
+static inline void __zone_link(zone_t* zone)
+{
+    zone_allocator_t* allocator = zone->m_allocator;
+
+    if (!allocator)
+        return;
+
+    __zone_list_push(zone->m_nr_free ? &allocator->m_partial : &allocator->m_full, zone);
+}
+
+static inline void __zone_unlink(zone_t* zone)
+{
+    zone_allocator_t* allocator = zone->m_allocator;
+
+    if (!allocator)
+        return;
+
+    __zone_list_remove(zone->m_nr_free ? &allocator->m_partial : &allocator->m_full, zone);
+}
+
 void init_zalloc()
 {
     __kernel_alloc_list = create_zalloc_list(1);
@@ -48,6 +97,8 @@ int init_zone_allocator(zone_allocator_t* ret, size_t initial_size, size_t hard_
     // Initialize the initial zones
     ret->m_total_size = 0;
     ret->m_grow_size = initial_size;
+    ret->m_partial = nullptr;
+    ret->m_full = nullptr;
 
     new_zone_store = create_zone_store(DEFAULT_ZONE_STORE_CAPACITY);
 
@@ -141,6 +192,8 @@ int init_zone_allocator_ex(zone_allocator_t* ret, void* start_buffer, size_t ini
 
     // Initialize the initial zones
     ret->m_total_size = 0;
+    ret->m_partial = nullptr;
+    ret->m_full = nullptr;
     /* We know we didn't allocate this fucker */
     ret->m_flags = flags & ~ZALLOC_FLAG_DID_ALLOCATE;
     ret->m_grow_size = initial_size;
@@ -244,6 +297,7 @@ void destroy_zone_allocator(zone_allocator_t* allocator, bool clear_zones)
  */
 void zone_allocator_clear(zone_allocator_t* allocator)
 {
+    zone_t* zone;
     zone_store_t* c_store;
 
     c_store = allocator->m_store;
@@ -252,8 +306,18 @@ void zone_allocator_clear(zone_allocator_t* allocator)
     while (c_store) {
 
         /* Clear all the zones inside this store */
-        for (uint32_t i = 0; i < c_store->m_zones_count; i++)
-            bitmap_unmark_range(&c_store->m_zones[i]->m_entries, 0, c_store->m_zones[i]->m_entries.m_entries);
+        for (uint32_t i = 0; i < c_store->m_zones_count; i++) {
+            zone = c_store->m_zones[i];
+
+            __zone_unlink(zone);
+
+            bitmap_unmark_range(&zone->m_entries, 0, zone->m_entries.m_entries);
+
+            zone->m_nr_free = zone->m_entries.m_entries;
+            zone->m_hint = 0;
+
+            __zone_link(zone);
+        }
 
         c_store = c_store->m_next;
     }
@@ -464,6 +528,9 @@ int zone_store_add(zone_store_t* store, zone_t* zone)
 
     store->m_zones_count++;
 
+    /* Being in a store means the allocator can hand out entries from this zone */
+    __zone_link(zone);
+
     return 0;
 }
 
@@ -502,6 +569,8 @@ int zone_store_remove(zone_store_t* store, zone_t* zone)
 
     store->m_zones_count--;
 
+    __zone_unlink(zone);
+
     return 0;
 }
 
@@ -519,6 +588,7 @@ void destroy_zone(zone_allocator_t* allocator, zone_t* zone)
     zone_size += zone->m_entries.m_size;
     zone_size += zone->m_total_available_size;
 
+    /* NOTE: Freeing the pages also drops our ownership of them */
     /* TODO: resolve pml root */
     kmem_dealloc(nullptr, nullptr, (vaddr_t)zone, zone_size);
 }
@@ -599,7 +669,14 @@ zone_t* init_zone(zone_allocator_t* allocator, void* buffer, size_t bsize, const
     zone->m_total_available_size = zone->m_entries.m_entries * zone->m_zone_entry_size;
     /* Initialize the zone data fields */
     zone->m_entries_start = ALIGN_UP((uintptr_t)zone + sizeof(zone_t) + BITS_TO_BYTES(nr_bitmap_entries), 8);
+    zone->m_allocator = allocator;
+    zone->m_nr_free = zone->m_entries.m_entries;
+    zone->m_hint = 0;
 
+    /*
+     * NOTE: We don't know who else lives in the pages of @buffer, so we can't claim them. Addresses in
+     * this zone are resolved by scanning the zones of the allocator
+     */
     return zone;
 }
 
@@ -673,6 +750,13 @@ zone_t* create_zone(zone_allocator_t* allocator, const size_t entry_size, size_t
 
     zone->m_total_available_size = entries_bytes;
     zone->m_entries_start = ALIGN_UP(((uintptr_t)zone + aligned_size) - entries_bytes, 8);
+    zone->m_allocator = allocator;
+    zone->m_nr_free = zone->m_entries.m_entries;
+    zone->m_hint = 0;
+
+    /* Claim our pages, so frees can find us through the page metadata */
+    for (size_t offset = 0; offset < aligned_size; offset += SMALL_PAGE_SIZE)
+        kmem_phys_set_owner(kmem_to_phys(nullptr, (vaddr_t)zone + offset) >> PAGE_SHIFT, zone);
 
     return zone;
 }
@@ -696,81 +780,118 @@ void* zalloc(zone_allocator_t* allocator, size_t size)
 {
     int error;
     void* result;
-    zone_t* new_zone;
-    zone_store_t* current_store;
+    zone_t* zone;
 
     if (!allocator || !size)
         return nullptr;
 
-    current_store = allocator->m_store;
-
-    while (current_store) {
+    /* Every zone in an allocator has the same entry size */
+    if (size > allocator->m_entry_size)
+        return nullptr;
 
-        for (uintptr_t i = 0; i < current_store->m_zones_count; i++) {
-            zone_t* zone = current_store->m_zones[i];
+    zone = allocator->m_partial;
 
-            if (!zone)
-                continue;
+    if (!zone) {
+        error = grow_zone_allocator(allocator, &zone);
 
-            if (size <= zone->m_zone_entry_size) {
-                result = zone_allocate(zone, size);
+        if (error)
+            return nullptr;
+    }
 
-                if (!result)
-                    continue;
+    result = zone_allocate(zone, size);
 
-                return result;
-            }
-        }
+    if (!result)
+        kernel_panic("zalloc: Zone on the partial list had no free entries!");
 
-        current_store = current_store->m_next;
+    /* Full zones don't need to be found anymore */
+    if (!zone->m_nr_free) {
+        __zone_list_remove(&allocator->m_partial, zone);
+        __zone_list_push(&allocator->m_full, zone);
     }
 
-    error = grow_zone_allocator(allocator, &new_zone);
+    return result;
+}
 
-    if (error)
+/*!
+ * @brief: Find the zone that @address was allocated from
+ *
+ * Only works for zones that own their pages (i.e. that were created by the allocator)
+ */
+zone_t* zone_from_address(void* address)
+{
+    zone_t* zone;
+    paddr_t phys;
+
+    phys = kmem_to_phys(nullptr, (vaddr_t)address);
+
+    if (!phys)
         return nullptr;
 
-    result = zone_allocate(new_zone, size);
+    zone = kmem_phys_get_owner(phys >> PAGE_SHIFT);
 
-    if (result)
-        return result;
+    if (!zone)
+        return nullptr;
 
-    /* TODO: try to create a new zone somewhere and allocate there */
-    kernel_panic("zalloc call failed! TODO: fix this dumb panic!");
+    /* The zone header shares its pages with the entries, make sure we're not pointing at that */
+    if ((vaddr_t)address < zone->m_entries_start || (vaddr_t)address >= zone->m_entries_start + zone->m_total_available_size)
+        return nullptr;
 
-    return nullptr;
+    return zone;
 }
 
-void zfree(zone_allocator_t* allocator, void* address, size_t size)
+/*!
+ * @brief: Find the zone inside @allocator that contains @address
+ */
+static zone_t* __allocator_find_zone(zone_allocator_t* allocator, void* address)
 {
-    int error;
-    zone_store_t* current_store;
+    zone_t* zone;
 
-    if (!allocator || !address || !size)
-        return;
+    zone = zone_from_address(address);
+
+    if (zone && zone->m_allocator == allocator)
+        return zone;
+
+    /* Zones that live in a buffer we were given don't own their pages. Go look for those */
+    FOREACH_ZONESTORE(allocator, store)
+    {
+        for (u32 i = 0; i < store->m_zones_count; i++) {
+            zone = store->m_zones[i];
 
-    current_store = allocator->m_store;
+            if ((vaddr_t)address >= zone->m_entries_start && (vaddr_t)address < zone->m_entries_start + zone->m_total_available_size)
+                return zone;
+        }
+    }
 
-    while (current_store) {
+    return nullptr;
+}
 
-        for (uintptr_t i = 0; i < current_store->m_zones_count; i++) {
-            zone_t* zone = current_store->m_zones[i];
+/*!
+ * @brief: Give an entry back to its zone
+ *
+ * @size is not needed to find the zone, it's only kept for API compatibility
+ */
+void zfree(zone_allocator_t* allocator, void* address, size_t size)
+{
+    zone_t* zone;
+    bool was_full;
 
-            if (!zone)
-                continue;
+    if (!allocator || !address)
+        return;
 
-            if (size <= zone->m_zone_entry_size) {
-                error = zone_deallocate(zone, address, size);
+    zone = __allocator_find_zone(allocator, address);
 
-                if (error)
-                    continue;
+    if (!zone)
+        return;
 
-                // If the deallocation succeeded, just exit
-                break;
-            }
-        }
+    was_full = (zone->m_nr_free == 0);
 
-        current_store = current_store->m_next;
+    if (zone_deallocate(zone, address, size))
+        return;
+
+    /* Has room again */
+    if (was_full) {
+        __zone_list_remove(&allocator->m_full, zone);
+        __zone_list_push(&allocator->m_partial, zone);
     }
 }
 
@@ -784,46 +905,84 @@ void zfree_fixed(zone_allocator_t* allocator, void* address)
     zfree(allocator, address, allocator->m_entry_size);
 }
 
+/*!
+ * @brief: Find the index of a free entry in @zone
+ *
+ * Scans the bitmap a qword at a time, starting at the hint. The entries that don't fill
+ * up an entire qword at the end of the bitmap are checked one by one
+ */
+static inline bool __zone_find_free(zone_t* zone, uintptr_t* p_index)
+{
+    u64 qword;
+    const u32 nr_qwords = zone->m_entries.m_entries >> 6;
+
+    for (u32 i = zone->m_hint; i < nr_qwords; i++) {
+        memcpy(&qword, &zone->m_entries.m_map[i << 3], sizeof(qword));
+
+        if (qword == ~0ULL)
+            continue;
+
+        zone->m_hint = i;
+        *p_index = (i << 6) + __builtin_ctzll(~qword);
+        return true;
+    }
+
+    zone->m_hint = nr_qwords;
+
+    for (uintptr_t i = (uintptr_t)nr_qwords << 6; i < zone->m_entries.m_entries; i++) {
+        if (bitmap_isset(&zone->m_entries, i))
+            continue;
+
+        *p_index = i;
+        return true;
+    }
+
+    return false;
+}
+
 static inline void* zone_allocate(zone_t* zone, size_t size)
 {
     uintptr_t index;
 
-    // ASSERT_MSG(size <= zone->m_zone_entry_size, "Allocating over the span of multiple subzones is not yet implemented!");
-
-    // const size_t entries_needed = (size + zone->m_zone_entry_size - 1) / zone->m_zone_entry_size;
-    if (!KERR_OK(bitmap_find_free(&zone->m_entries, &index)))
+    if (!zone->m_nr_free || !__zone_find_free(zone, &index))
         return nullptr;
 
     bitmap_mark(&zone->m_entries, index);
+    zone->m_nr_free--;
 
     return (void*)(zone->m_entries_start + (index * zone->m_zone_entry_size));
 }
 
 static inline int zone_deallocate(zone_t* zone, void* address, size_t size)
 {
-    ASSERT_MSG(size <= zone->m_zone_entry_size, "Deallocating over the span of multiple subzones is not yet implemented!");
+    uintptr_t offset;
+    uintptr_t index;
 
     // Address is not contained inside this zone
     if ((uintptr_t)address < zone->m_entries_start)
         return -1;
 
-    /*
-     * FIXME: this integer division is dangerous. We really should only accept sizes that are
-     * a power of two and if they are not, we should round them up to be that size. This way we can
-     * store the log2 of the entry_size which will make sure that we can ALWAYS find back the address
-     * of any allocation
-     */
-    uintptr_t address_offset = (uintptr_t)(address - zone->m_entries_start) / zone->m_zone_entry_size;
+    offset = (uintptr_t)address - zone->m_entries_start;
+    index = offset / zone->m_zone_entry_size;
 
     // If an offset is equal to or greater than the amount of entries, something has
     // gone wrong, since offsets start at 0
-    if (address_offset >= zone->m_entries.m_entries)
+    if (index >= zone->m_entries.m_entries)
         return -1;
 
-    if (!bitmap_isset(&zone->m_entries, address_offset))
+    /* Not the start of an entry */
+    if (offset != index * zone->m_zone_entry_size)
         return -1;
 
-    bitmap_unmark(&zone->m_entries, address_offset);
+    if (!bitmap_isset(&zone->m_entries, index))
+        return -1;
+
+    bitmap_unmark(&zone->m_entries, index);
+    zone->m_nr_free++;
+
+    /* Keep the hint at the lowest qword with a free entry */
+    if ((index >> 6) < zone->m_hint)
+        zone->m_hint = index >> 6;
 
     return 0;
 }
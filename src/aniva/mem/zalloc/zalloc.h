@@ -33,7 +33,6 @@ typedef enum ZONE_ENTRY_SIZE {
 
 #define ZALLOC_DEFAULT_MEM_SIZE 16 * Kib
 #define ZALLOC_DEFAULT_ALLOC_COUNT 128 /* What is the default amount of an object that we should be able to allocate before we should expand the allocator */
-#define ZALLOC_ACCEPTABLE_MEMSIZE_DEVIATON 16 /* How much a allocation may deviate from the size of a allocator in order to still be stored there */
 
 /*
  * Ideas for a different zalloc design:
@@ -55,6 +54,14 @@ typedef enum ZONE_ENTRY_SIZE {
  *  - a block knows nothing about itself and is simply a pointer into a physical address.
  *    it is managed by its coresponding chunk
  *
+ * Finding a zone to allocate from is O(1): every allocator keeps the zones that still have free
+ * entries on a partial list, and the ones that are full on a full list. Inside a zone, the bitmap is
+ * scanned a qword at a time, starting at the first qword that may have a free bit.
+ *
+ * Zones that we allocated ourselves register themselves as the owner of their physical pages. This
+ * lets zfree get from any address back to its zone through the page metadata, so it doesn't need
+ * a size or a scan.
+ *
  * Current NOTEs
  *  - the current implementation is very agressive when it comes to page allocation. If, due to alignement, it
  *    is able to snatch a few more pages, it won't hesitate to fill that empty space with more subzones/blocks/entries.
@@ -66,6 +73,15 @@ typedef struct zone {
 
     vaddr_t m_entries_start;
 
+    struct zone_allocator* m_allocator;
+    /* Links on the partial or full list of the allocator */
+    struct zone* m_next;
+    struct zone* m_prev;
+
+    u32 m_nr_free;
+    /* No free entries in the qwords of the bitmap before this one */
+    u32 m_hint;
+
     bitmap_t m_entries;
 } zone_t;
 
@@ -97,6 +113,11 @@ typedef struct zone_allocator {
     zone_store_t* m_store;
     mutex_t* m_lock;
 
+    /* Zones that have free entries */
+    zone_t* m_partial;
+    /* Zones that don't */
+    zone_t* m_full;
+
     size_t m_store_count;
 
     size_t m_grow_size; /* Size we add to the allocator every time we grow */
@@ -118,11 +139,13 @@ typedef struct zone_allocator {
 void init_zalloc();
 
 void* kzalloc(size_t size);
+/* @size is not needed anymore, the zone gets resolved through the address */
 void kzfree(void* address, size_t size);
 void kzfree_scan(void* address);
 
 void* zalloc(zone_allocator_t* allocator, size_t size);
 void zfree(zone_allocator_t* allocator, void* address, size_t size);
+zone_t* zone_from_address(void* address);
 void* zalloc_fixed(zone_allocator_t* allocator);
 void zfree_fixed(zone_allocator_t* allocator, void* address);
 
@@ -34,6 +34,9 @@ void init_khandle_ex(khandle_t* bHandle, HANDLE_TYPE type, u32 flags, void* ref)
 
 static inline void __destroy_khandle(khandle_t* handle)
 {
+    /* Unpublish first, so lockless readers stop seeing this handle before we tear it down */
+    __atomic_store_n(&handle->reference.kobj, nullptr, __ATOMIC_RELEASE);
+
     memset(handle, 0, sizeof(khandle_t));
     handle->index = KHNDL_INVALID_INDEX;
 }
@@ -93,16 +96,54 @@ struct oss_node* khandle_get_relative_node(khandle_t* handle)
 
 /*
  * Check if the handle seems bound by looking for its index and reference
+ *
+ * The reference is what gets published last, so that's what readers need to look at first
  */
 static bool __is_khandle_bound(khandle_t* handle)
 {
-    return (handle != nullptr && ((handle->index != KHNDL_INVALID_INDEX) && handle->reference.kobj != nullptr));
+    return (handle != nullptr && __atomic_load_n(&handle->reference.kobj, __ATOMIC_ACQUIRE) != nullptr && handle->index != KHNDL_INVALID_INDEX);
 }
 
-int init_khandle_map(khandle_map_t* ret, uint32_t max_count)
+static inline khandle_t* __get_khandle_slot(khandle_map_t* map, uint32_t index)
+{
+    khandle_t* chunk;
+
+    if (index >= map->max_count)
+        return nullptr;
+
+    chunk = __atomic_load_n(&map->chunks[index >> KHNDL_CHUNK_SHIFT], __ATOMIC_ACQUIRE);
+
+    if (!chunk)
+        return nullptr;
+
+    return &chunk[index & (KHNDL_CHUNK_ENTRIES - 1)];
+}
+
+static khandle_t* __alloc_khandle_chunk()
 {
     int error;
+    khandle_t* chunk;
+
+    error = kmem_kernel_alloc_range((void**)&chunk, KHNDL_CHUNK_ENTRIES * sizeof(khandle_t), NULL, KMEM_FLAG_WRITABLE | KMEM_FLAG_KERNEL);
+
+    if (error)
+        return nullptr;
+
+    memset(chunk, 0, KHNDL_CHUNK_ENTRIES * sizeof(khandle_t));
+
+    for (uint32_t i = 0; i < KHNDL_CHUNK_ENTRIES; i++)
+        chunk[i].index = KHNDL_INVALID_INDEX;
+
+    return chunk;
+}
 
+static inline void __free_khandle_chunk(khandle_t* chunk)
+{
+    kmem_kernel_dealloc((vaddr_t)chunk, KHNDL_CHUNK_ENTRIES * sizeof(khandle_t));
+}
+
+int init_khandle_map(khandle_map_t* ret, uint32_t max_count)
+{
     if (!ret)
         return -1;
 
@@ -114,21 +155,17 @@ int init_khandle_map(khandle_map_t* ret, uint32_t max_count)
     ret->max_count = max_count;
     ret->lock = create_mutex(0);
 
-    /* Ensure we can create this list that provides a maximum of 1024 handles */
-    error = kmem_kernel_alloc_range((void**)&ret->handles, max_count * sizeof(khandle_t), NULL, KMEM_FLAG_WRITABLE | KMEM_FLAG_KERNEL);
+    if (!ret->lock)
+        return -KERR_NOMEM;
 
-    if (error) {
+    /* Most processes never get past the first chunk, so only that one is there from the start */
+    ret->chunks[0] = __alloc_khandle_chunk();
+
+    if (!ret->chunks[0]) {
         destroy_mutex(ret->lock);
-        return error;
+        return -KERR_NOMEM;
     }
 
-    /* Zero */
-    memset(ret->handles, 0, max_count * sizeof(khandle_t));
-
-    /* Should we? */
-    for (uint32_t i = 0; i < ret->max_count; i++)
-        ret->handles[i].index = KHNDL_INVALID_INDEX;
-
     return 0;
 }
 
@@ -149,11 +186,24 @@ int copy_khandle_map(khandle_map_t* dst_map, khandle_map_t* src_map)
     if (error)
         goto unlock_and_error;
 
-    dst_map->count = src_map->count;
-    dst_map->next_free_index = src_map->next_free_index;
+    for (uint32_t i = 0; i < KHNDL_NR_CHUNKS; i++) {
+        if (!src_map->chunks[i])
+            continue;
+
+        if (!dst_map->chunks[i])
+            dst_map->chunks[i] = __alloc_khandle_chunk();
+
+        if (!dst_map->chunks[i]) {
+            error = -KERR_NOMEM;
+            break;
+        }
+
+        /* Copy the handles */
+        memcpy(dst_map->chunks[i], src_map->chunks[i], KHNDL_CHUNK_ENTRIES * sizeof(khandle_t));
+    }
 
-    /* Copy the handles */
-    memcpy(dst_map->handles, src_map->handles, sizeof(khandle_t) * dst_map->max_count);
+    dst_map->count = src_map->count;
+    memcpy(dst_map->used_bitmap, src_map->used_bitmap, sizeof(dst_map->used_bitmap));
 
 unlock_and_error:
     mutex_unlock(src_map->lock);
@@ -175,192 +225,227 @@ void destroy_khandle_map(khandle_map_t* map)
     if (!map)
         return;
 
-    KLOG_INFO("Destroying khandle map! (0x%p)\n", map->handles);
+    KLOG_INFO("Destroying khandle map! (0x%p)\n", map);
 
     destroy_mutex(map->lock);
 
     ASSERT_MSG(map->max_count, "Tried to destroy a khandle map without a max_count!");
 
-    ASSERT_MSG(kmem_kernel_dealloc((vaddr_t)map->handles, map->max_count * sizeof(khandle_t)) == 0, "Failed to dealloc khandle map");
+    for (uint32_t i = 0; i < KHNDL_NR_CHUNKS; i++) {
+        if (map->chunks[i])
+            __free_khandle_chunk(map->chunks[i]);
+
+        map->chunks[i] = nullptr;
+    }
 }
 
+/*!
+ * @brief: Find the handle at @user_handle
+ *
+ * This is on the path of pretty much every syscall, so it does not take the map lock. Chunks stay
+ * where they are for as long as the map lives, so the only thing we need to be careful about is a
+ * handle that is being bound or unbound at the same time, which __is_khandle_bound takes care of
+ */
 khandle_t* find_khandle(khandle_map_t* map, uint32_t user_handle)
 {
-    khandle_t* handle = nullptr;
-
-    mutex_lock(map->lock);
+    khandle_t* handle;
 
     if (!map)
-        goto unlock_and_exit;
+        return nullptr;
 
-    if (user_handle >= map->max_count)
-        goto unlock_and_exit;
+    handle = __get_khandle_slot(map, user_handle);
 
-    if (!__is_khandle_bound(&map->handles[user_handle]))
-        goto unlock_and_exit;
+    if (!__is_khandle_bound(handle))
+        return nullptr;
 
-    handle = &map->handles[user_handle];
-
-unlock_and_exit:
-    mutex_unlock(map->lock);
     return handle;
 }
 
-static kerror_t __try_reallocate_handles(khandle_map_t* map, size_t new_max_count)
+/*!
+ * @brief: Find the lowest free index in @map
+ *
+ * Caller must hold the map lock
+ */
+static uint32_t __find_free_index(khandle_map_t* map)
 {
-    kerror_t error;
-    khandle_t* new_list;
+    u64 free_bits;
+    uint32_t index;
 
-    /* Debug */
-    kernel_panic("TODO: had to reallocate khandles! verify this works (__try_reallocate_handles)");
+    for (uint32_t i = 0; i < (KHNDL_MAX_ENTRIES / 64); i++) {
+        free_bits = ~map->used_bitmap[i];
 
-    if (!map || !new_max_count || new_max_count > KHNDL_MAX_ENTRIES)
-        return -1;
-
-    /* Allocate new space */
-    error = kmem_kernel_alloc_range((void**)&new_list, new_max_count * sizeof(khandle_t), NULL, KMEM_FLAG_WRITABLE | KMEM_FLAG_KERNEL);
-
-    if (error)
-        return error;
+        if (!free_bits)
+            continue;
 
-    /* Since they are stored as one massive vector, we can simply copy all of it over */
-    memcpy(map->handles, new_list, map->max_count * sizeof(khandle_t));
+        index = (i * 64) + __builtin_ctzll(free_bits);
 
-    /* We can now deallocate the old list */
-    error = kmem_kernel_dealloc((uint64_t)map->handles, map->max_count * sizeof(khandle_t));
+        if (index >= map->max_count)
+            break;
 
-    /* Update max_count */
-    map->max_count = new_max_count;
+        return index;
+    }
 
-    return (error);
+    return KHNDL_INVALID_INDEX;
 }
 
-static void __bind_khandle(khandle_map_t* map, khandle_t* handle, uint32_t index)
+/*!
+ * @brief: Put @handle into the slot at @index
+ *
+ * Allocates the chunk for @index if it's not there yet. Caller must hold the map lock
+ */
+static kerror_t __bind_khandle(khandle_map_t* map, khandle_t* handle, uint32_t index)
 {
+    void* kobj;
+    khandle_t tmp;
+    khandle_t* slot;
+    khandle_t** p_chunk;
+
     if (!map || !handle)
-        return;
+        return -KERR_INVAL;
+
+    p_chunk = &map->chunks[index >> KHNDL_CHUNK_SHIFT];
+
+    if (!(*p_chunk)) {
+        khandle_t* chunk = __alloc_khandle_chunk();
+
+        if (!chunk)
+            return -KERR_NOMEM;
+
+        /* Readers may see this right away */
+        __atomic_store_n(p_chunk, chunk, __ATOMIC_RELEASE);
+    }
+
+    slot = &(*p_chunk)[index & (KHNDL_CHUNK_ENTRIES - 1)];
+    kobj = handle->reference.kobj;
 
     /* First mutate the index */
     handle->index = index;
 
-    /* Then copy it over */
-    // map->handles[index] = *handle;
-    memcpy(&map->handles[index], handle, sizeof(khandle_t));
+    /*
+     * Then copy it over without the reference, so the slot never holds an object before
+     * the rest of the handle is in place. The release store publishes it
+     */
+    memcpy(&tmp, handle, sizeof(khandle_t));
+    tmp.reference.kobj = nullptr;
+
+    memcpy(slot, &tmp, sizeof(khandle_t));
+
+    __atomic_store_n(&slot->reference.kobj, kobj, __ATOMIC_RELEASE);
+
+    map->used_bitmap[index / 64] |= (1ULL << (index % 64));
     map->count++;
+    return 0;
+}
+
+/*!
+ * @brief: Drop @index from the bookkeeping of @map
+ *
+ * Caller must hold the map lock
+ */
+static inline void __release_khandle_index(khandle_map_t* map, uint32_t index)
+{
+    map->used_bitmap[index / 64] &= ~(1ULL << (index % 64));
+    map->count--;
 }
 
 /*!
  * @brief: Copies a handle into the handle map
  *
+ * Takes the lowest free index, just like file descriptors would
+ *
  * NOTE: mutates the handle to fill in the index they are put at
  */
 kerror_t bind_khandle(khandle_map_t* map, khandle_t* handle, uint32_t* bidx)
 {
-    kerror_t res;
-    uint32_t current_index;
-    khandle_t* slot;
+    kerror_t error;
+    uint32_t index;
 
     if (!map || !handle)
         return -1;
 
     mutex_lock(map->lock);
 
-    if (map->count >= map->max_count) {
-
-        /* Have we reached the hardlimit? */
-        if (map->max_count >= KHNDL_MAX_ENTRIES)
-            return -1;
-
-        /* __try_reallocate_handles will mutate the values in map */
-        res = __try_reallocate_handles(map, KHNDL_MAX_ENTRIES);
+    index = __find_free_index(map);
 
-        /* If we fail to reallocate, thats kinda cringe lol */
-        if ((res)) {
-            mutex_unlock(map->lock);
-            return res;
-        }
+    /* Could not find a place to bind this handle, abort */
+    if (index == KHNDL_INVALID_INDEX) {
+        mutex_unlock(map->lock);
+        return -1;
     }
 
-    /* Check if the next free index is valid */
-    current_index = map->next_free_index;
-
-    /* Try to get the next free index */
-    if (current_index != KHNDL_INVALID_INDEX) {
-
-        slot = &map->handles[current_index];
+    error = __bind_khandle(map, handle, index);
 
-        if (!__is_khandle_bound(slot)) {
-
-            /* insert into array */
-            __bind_khandle(map, handle, current_index);
-
-            map->next_free_index += 1;
-            goto unlock_and_success;
-        }
-    }
-
-    /* Check if we can put it somewhere in a hole */
-    current_index = 0;
+    mutex_unlock(map->lock);
 
-    /* Loop over the entire array */
-    while (current_index < map->max_count) {
+    if (error)
+        return error;
 
-        slot = &map->handles[current_index];
+    if (bidx)
+        *bidx = index;
+    return (0);
+}
 
-        if (!__is_khandle_bound(slot)) {
+/*!
+ * @brief: Bind @handle at a specific @index
+ *
+ * Fails when there already is a handle at @index
+ */
+kerror_t bind_khandle_at(khandle_map_t* map, khandle_t* handle, uint32_t index)
+{
+    kerror_t error;
 
-            __bind_khandle(map, handle, current_index);
+    if (!map || !handle || index >= map->max_count)
+        return -KERR_INVAL;
 
-            /* Make sure that the next free index is still valid */
-            map->next_free_index = current_index + 1;
-            goto unlock_and_success;
-        }
+    mutex_lock(map->lock);
 
-        current_index++;
-    }
+    if ((map->used_bitmap[index / 64] & (1ULL << (index % 64))) != 0)
+        error = -KERR_DUPLICATE;
+    else
+        error = __bind_khandle(map, handle, index);
 
-    /* Could not find a place to bind this handle, abort */
     mutex_unlock(map->lock);
-    return -1;
 
-unlock_and_success:
-    mutex_unlock(map->lock);
+    return error;
+}
 
-    if (bidx)
-        *bidx = current_index;
-    return (0);
+/*!
+ * @brief: Bind @handle at @index, or at the lowest free index if @index is taken
+ */
+kerror_t try_bind_khandle_at(khandle_map_t* map, khandle_t* handle, uint32_t index)
+{
+    if (!bind_khandle_at(map, handle, index))
+        return 0;
+
+    return bind_khandle(map, handle, nullptr);
 }
 
 /* NOTE: mutates the handle to clear the index */
 kerror_t unbind_khandle(khandle_map_t* map, khandle_t* handle)
 {
+    uint32_t index;
     khandle_t* _handle;
 
-    mutex_lock(map->lock);
-
     if (!map || !handle)
-        goto error_and_unlock;
+        return -1;
+
+    mutex_lock(map->lock);
 
-    _handle = &map->handles[handle->index];
+    index = handle->index;
+    _handle = __get_khandle_slot(map, index);
 
     /* WTF */
-    if (_handle != handle)
+    if (!_handle || _handle != handle)
         goto error_and_unlock;
 
-    /*
-    map->next_free_index ^= _handle->index;
-    _handle->index ^= map->next_free_index;
-    map->next_free_index ^= _handle->index;
-    */
-
-    map->next_free_index = _handle->index;
-
     /*
      * Zero out this entry
      * NOTE: this sets the index of the handle to KHNDL_INVALID_INDEX
      */
     destroy_khandle(_handle);
 
+    __release_khandle_index(map, index);
+
     mutex_unlock(map->lock);
     return 0;
 
@@ -376,16 +461,24 @@ error_and_unlock:
  */
 kerror_t khandle_map_remove(khandle_map_t* map, HANDLE_TYPE type, void* addr)
 {
+    khandle_t* handle;
+
     if (!map || !map->lock)
         return -KERR_INVAL;
 
     mutex_lock(map->lock);
 
     for (u32 i = 0; i < map->max_count; i++) {
-        if (map->handles[i].type != type || map->handles[i].reference.kobj != addr)
+        handle = __get_khandle_slot(map, i);
+
+        if (!handle || !__is_khandle_bound(handle))
+            continue;
+
+        if (handle->type != type || handle->reference.kobj != addr)
             continue;
 
-        __destroy_khandle(&map->handles[i]);
+        __destroy_khandle(handle);
+        __release_khandle_index(map, i);
     }
 
     mutex_unlock(map->lock);
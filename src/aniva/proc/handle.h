@@ -72,13 +72,22 @@ struct oss_node* khandle_get_relative_node(khandle_t* handle);
 
 #define KHNDL_INVALID_INDEX (uint32_t) - 1
 
+/* Handles live in chunks of this many entries, which get allocated when they are first needed */
+#define KHNDL_CHUNK_SHIFT (7)
+#define KHNDL_CHUNK_ENTRIES (1 << KHNDL_CHUNK_SHIFT)
+#define KHNDL_NR_CHUNKS (KHNDL_MAX_ENTRIES / KHNDL_CHUNK_ENTRIES)
+
 /*
  * Map that stores the handles for a specific entity
  * NOTE: should never be heap-allocated on its own
+ *
+ * Chunks never move and are only freed together with the map, so find_khandle can index
+ * them without taking the lock. The lock is only there to serialize binding and unbinding.
  */
 typedef struct khandle_map {
-    khandle_t* handles;
-    uint32_t next_free_index;
+    khandle_t* chunks[KHNDL_NR_CHUNKS];
+    /* One bit for every index that is taken */
+    u64 used_bitmap[KHNDL_MAX_ENTRIES / 64];
     uint32_t count;
     uint32_t max_count; /* Hard limit for this value is KHANDL_MAX_ENTRIES, but we can also limit a process even further if that is needed */
     mutex_t* lock;
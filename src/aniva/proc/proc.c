@@ -13,6 +13,7 @@
 #include "lightos/error.h"
 #include "lightos/syscall.h"
 #include "lightos/sysvar/shared.h"
+#include "lightos/time/kdata.h"
 #include "logging/log.h"
 #include "mem/kmem.h"
 #include "mem/phys.h"
@@ -28,6 +29,7 @@
 #include "sys/types.h"
 #include "system/processor/processor.h"
 #include "system/profile/profile.h"
+#include "system/syscall/core.h"
 #include "thread.h"
 #include "time/core.h"
 #include <libk/string.h>
@@ -102,6 +104,44 @@ static inline int __proc_destroy_page_tracker(proc_t* proc)
     return kmem_kernel_dealloc((u64)buffer, bsize);
 }
 
+/*!
+ * @brief: Map the kernel data page into @proc
+ *
+ * The page is shared between every process, so it's kept out of the processes backed ranges. The
+ * reference we take here gets dropped again when the page directory is destroyed
+ */
+static int __proc_map_kdata(proc_t* proc)
+{
+    int error;
+    paddr_t kdata_phys;
+
+    if (is_kernel_proc(proc) || is_driver_proc(proc))
+        return 0;
+
+    error = time_get_kdata_page(&kdata_phys);
+
+    if (error)
+        return error;
+
+    error = page_tracker_alloc(&proc->m_virtual_tracker, kmem_get_page_idx(LIGHTOS_KDATA_ADDR), 1, PAGE_RANGE_FLAG_UNBACKED);
+
+    if (error)
+        return error;
+
+    error = kmem_phys_reserve_page(kmem_get_page_idx(kdata_phys));
+
+    if (error)
+        return error;
+
+    /* Read-only and not executable for userspace */
+    if (!kmem_map_page(proc->m_root_pd.m_root, LIGHTOS_KDATA_ADDR, kdata_phys, KMEM_CUSTOMFLAG_GET_MAKE | KMEM_CUSTOMFLAG_CREATE_USER, KMEM_FLAG_NOEXECUTE)) {
+        kmem_phys_dealloc_page(kmem_get_page_idx(kdata_phys));
+        return -KERR_NOMEM;
+    }
+
+    return 0;
+}
+
 /*!
  * @brief Allocate memory for a process and prepare it for execution
  *
@@ -158,6 +198,13 @@ proc_t* create_proc(proc_t* parent, struct user_profile* profile, char* name, Fu
     /* Initialize this fucker */
     __proc_init_page_tracker(proc, PROC_DEFAULT_PAGE_TRACKER_BSIZE);
 
+    /* Userspace expects the page to be there, so a process without it can't run */
+    if (__proc_map_kdata(proc)) {
+        /* Calls __destroy_proc */
+        destroy_oss_obj(proc->obj);
+        return nullptr;
+    }
+
     /* Okay to pass a reference, since resource bundles should NEVER own this memory */
     // proc->m_resource_bundle = create_resource_bundle(&proc->m_root_pd);
     proc->m_env = create_penv(proc->m_name, proc, NULL, NULL);
@@ -391,9 +438,9 @@ static void __proc_clear_handles(proc_t* proc)
     map = &proc->m_handle_map;
 
     for (uint32_t i = 0; i < map->max_count; i++) {
-        current_handle = &map->handles[i];
+        current_handle = find_khandle(map, i);
 
-        if (!current_handle->reference.kobj || current_handle->index == KHNDL_INVALID_INDEX)
+        if (!current_handle)
             continue;
 
         destroy_khandle(current_handle);
@@ -442,6 +489,9 @@ void __destroy_proc(proc_t* proc)
     /* Yeet handles */
     __proc_clear_handles(proc);
 
+    /* Yeet the syscall ring */
+    sys_ring_destroy(proc);
+
     /* Free everything else */
     destroy_mutex(proc->m_lock);
 
@@ -459,13 +509,16 @@ void __destroy_proc(proc_t* proc)
      * you never know... For that we simply allow every page directory to be
      * killed as long as we are not currently using it :clown:
      */
-    if (get_current_processor()->m_page_dir != &proc->m_root_pd)
+    if (get_current_processor()->m_page_dir != &proc->m_root_pd) {
+        kmem_release_pcid(&proc->m_root_pd);
         kmem_destroy_page_dir(proc->m_root_pd.m_root);
+    }
 
     KLOG_DBG("Doing penv\n");
 
-    /* Kill the environment */
-    destroy_penv(proc->m_env);
+    /* Kill the environment (if we got that far) */
+    if (proc->m_env)
+        destroy_penv(proc->m_env);
 
     /* Clear it out */
     proc->m_env = nullptr;
@@ -74,6 +74,8 @@ typedef struct proc {
     page_dir_t m_root_pd;
     khandle_map_t m_handle_map;
     page_tracker_t m_virtual_tracker;
+    /* Kernel state of the syscall ring, if the process asked for one */
+    struct proc_sysring* m_sysring;
 
     /* A couple of static pointers to certain threads */
     struct thread* m_init_thread;
@@ -55,6 +55,13 @@ ALWAYS_INLINE uintptr_t read_fs(uint32_t offset)
     return ret;
 }
 
+ALWAYS_INLINE uint64_t read_tsc()
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 ALWAYS_INLINE uintptr_t read_cs()
 {
     uintptr_t ret;
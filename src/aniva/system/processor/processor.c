@@ -2,6 +2,7 @@
 #include "entry/entry.h"
 #include "irq/idt.h"
 #include "libk/flow/error.h"
+#include "mem/kmem.h"
 #include "sched/scheduler.h"
 #include "system/asm_specifics.h"
 #include "system/msr.h"
@@ -140,6 +141,10 @@ void init_processor_late(processor_t* processor)
         }
     }
 
+    /* Tag address spaces, so switching between them doesn't wipe the TLB */
+    if (processor_has(&processor->m_info, X86_FEATURE_PCID))
+        kmem_enable_pcid(processor_has(&processor->m_info, X86_FEATURE_INVPCID));
+
     /* We are guaranteed to support interrupt syscalls */
     processor->m_flags |= PROCESSOR_FLAG_INT_SYSCALLS;
 
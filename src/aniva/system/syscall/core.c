@@ -40,6 +40,9 @@ static const sys_fn_t __syscall_map[] = {
     [SYSID_GET_PROCESSTIME] = (sys_fn_t)sys_get_process_time,
     [SYSID_SLEEP] = (sys_fn_t)sys_sleep,
     [SYSID_GET_FUNCTION] = (sys_fn_t)sys_get_function,
+
+    [SYSID_RING_SETUP] = (sys_fn_t)sys_ring_setup,
+    [SYSID_RING_ENTER] = (sys_fn_t)sys_ring_enter,
 };
 static const size_t __syscall_map_sz = (sizeof(__syscall_map) / (sizeof(*__syscall_map)));
 
@@ -31,6 +31,11 @@ void sys_entry();
 kerror_t install_syscall(uint32_t id, sys_fn_t handler);
 kerror_t uninstall_syscall(uint32_t id);
 
+struct proc;
+
+/* Release the syscall ring of a process */
+void sys_ring_destroy(struct proc* proc);
+
 uintptr_t call_syscall(uint32_t id, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t arg4);
 
 #endif //__ANIVA_SYSCALL_CORE__
@@ -80,9 +80,31 @@ error_t sys_alloc_vmem(size_t size, u32 flags, vaddr_t* buffer)
     return 0;
 }
 
+/*
+ * Release a range of user pages
+ *
+ * Partial ranges are allowed, so userspace allocators can hand back the tail of a span
+ */
 error_t sys_dealloc_vmem(vaddr_t buffer, size_t size)
 {
-    kernel_panic("TODO: Implement syscall (sys_dealloc_vmem)");
+    proc_t* current_process;
+
+    if (!buffer || !size || (buffer & PAGE_LOW_MASK))
+        return EINVAL;
+
+    current_process = get_current_proc();
+
+    if (!current_process)
+        return EINVAL;
+
+    size = ALIGN_UP(size, SMALL_PAGE_SIZE);
+
+    if (kmem_validate_ptr(current_process, buffer, size))
+        return EINVAL;
+
+    if (kmem_user_dealloc(current_process, buffer, size))
+        return EINVAL;
+
     return 0;
 }
 
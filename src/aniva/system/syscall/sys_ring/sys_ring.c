@@ -0,0 +1,300 @@
+#include "libk/flow/error.h"
+#include "lightos/handle_def.h"
+#include "lightos/ring/shared.h"
+#include "lightos/syscall.h"
+#include "mem/heap.h"
+#include "mem/kmem.h"
+#include "proc/proc.h"
+#include "sched/scheduler.h"
+#include "sync/mutex.h"
+#include "system/syscall/core.h"
+#include <libk/string.h>
+
+/*
+ * Kernel side of the syscall ring
+ *
+ * Everything userspace can write to is treated as a suggestion. The sizes of the queues and our
+ * own indices are kept here, out of reach of the process, and every submission is copied out of
+ * the shared memory before we look at it. The operations themselves are carried out by the same
+ * code that backs the regular syscalls, so they go through the khandle drivers just like a single
+ * sys_read or sys_write would.
+ *
+ * Submissions are completed synchronously, inside sys_ring_enter. The process still saves a trap
+ * for every operation after the first one of a batch.
+ */
+typedef struct proc_sysring {
+    lightos_ring_t __user* ring;
+    lightos_ring_sqe_t __user* sqes;
+    lightos_ring_cqe_t __user* cqes;
+
+    size_t size;
+
+    u32 sq_entries;
+    u32 cq_entries;
+
+    /* Our own copies of the indices we own */
+    u32 sq_head;
+    u32 cq_tail;
+
+    mutex_t* lock;
+} proc_sysring_t;
+
+static inline u32 _sysring_round_entries(u32 entries)
+{
+    u32 ret = 1;
+
+    if (!entries)
+        return LIGHTOS_RING_DEFAULT_ENTRIES;
+
+    if (entries > LIGHTOS_RING_MAX_ENTRIES)
+        return LIGHTOS_RING_MAX_ENTRIES;
+
+    /* Round up to the next power of two */
+    while (ret < entries)
+        ret <<= 1;
+
+    return ret;
+}
+
+/*!
+ * @brief: Give a process its ring
+ *
+ * A process only gets one ring. When it already has one, we simply hand that one back
+ */
+error_t sys_ring_setup(u32 entries, u32 flags, lightos_ring_t __user** p_ring)
+{
+    error_t error;
+    void* buffer;
+    size_t size;
+    proc_t* c_proc;
+    proc_sysring_t* sysring;
+
+    c_proc = get_current_proc();
+
+    if (!c_proc || !p_ring || flags)
+        return EINVAL;
+
+    if (kmem_validate_ptr(c_proc, (vaddr_t)p_ring, sizeof(*p_ring)))
+        return EINVAL;
+
+    mutex_lock(c_proc->m_lock);
+
+    if (c_proc->m_sysring) {
+        *p_ring = c_proc->m_sysring->ring;
+
+        mutex_unlock(c_proc->m_lock);
+        return 0;
+    }
+
+    error = ENOMEM;
+    sysring = kmalloc(sizeof(*sysring));
+
+    if (!sysring)
+        goto unlock_and_exit;
+
+    memset(sysring, 0, sizeof(*sysring));
+
+    sysring->sq_entries = _sysring_round_entries(entries);
+    /* Twice the CQ entries, so a full SQ can't stall on completions that were not reaped yet */
+    sysring->cq_entries = sysring->sq_entries << 1;
+
+    size = sizeof(lightos_ring_t) + sysring->sq_entries * sizeof(lightos_ring_sqe_t) + sysring->cq_entries * sizeof(lightos_ring_cqe_t);
+    size = ALIGN_UP(size, SMALL_PAGE_SIZE);
+
+    if (kmem_user_alloc_range(&buffer, c_proc, size, NULL, KMEM_FLAG_WRITABLE))
+        goto free_and_exit;
+
+    sysring->lock = create_mutex(NULL);
+
+    if (!sysring->lock)
+        goto dealloc_and_exit;
+
+    sysring->size = size;
+    sysring->ring = buffer;
+
+    memset(sysring->ring, 0, size);
+
+    sysring->ring->sq_entries = sysring->sq_entries;
+    sysring->ring->cq_entries = sysring->cq_entries;
+    sysring->ring->sq_off = sizeof(lightos_ring_t);
+    sysring->ring->cq_off = sizeof(lightos_ring_t) + sysring->sq_entries * sizeof(lightos_ring_sqe_t);
+
+    sysring->sqes = (lightos_ring_sqe_t __user*)((u8*)sysring->ring + sysring->ring->sq_off);
+    sysring->cqes = (lightos_ring_cqe_t __user*)((u8*)sysring->ring + sysring->ring->cq_off);
+
+    c_proc->m_sysring = sysring;
+    *p_ring = sysring->ring;
+
+    mutex_unlock(c_proc->m_lock);
+    return 0;
+
+dealloc_and_exit:
+    kmem_user_dealloc(c_proc, (vaddr_t)buffer, size);
+free_and_exit:
+    kfree(sysring);
+unlock_and_exit:
+    mutex_unlock(c_proc->m_lock);
+    return error;
+}
+
+/*!
+ * @brief: Carry out a single submission
+ *
+ * @sqe is our private copy, so we don't have to worry about it changing under us
+ */
+static u64 _sysring_do_sqe(lightos_ring_sqe_t* sqe, u64* p_size)
+{
+    u64 result;
+    size_t read_size;
+
+    *p_size = 0;
+
+    switch (sqe->op) {
+    case LIGHTOS_RING_OP_NOP:
+        return 0;
+    case LIGHTOS_RING_OP_READ:
+        read_size = 0;
+        result = sys_read(sqe->handle, (void*)sqe->buffer, sqe->size, &read_size);
+
+        *p_size = read_size;
+        return result;
+    case LIGHTOS_RING_OP_WRITE:
+        result = sys_write(sqe->handle, (void*)sqe->buffer, sqe->size);
+
+        if (!result)
+            *p_size = sqe->size;
+        return result;
+    case LIGHTOS_RING_OP_SEEK:
+        return sys_seek(sqe->handle, sqe->offset, sqe->arg);
+    case LIGHTOS_RING_OP_DIR_READ:
+        return sys_dir_read(sqe->handle, sqe->offset, (lightos_direntry_t*)sqe->buffer, sqe->size);
+    case LIGHTOS_RING_OP_SEND_MSG:
+        return sys_send_msg(sqe->handle, sqe->arg, sqe->offset, (void*)sqe->buffer, sqe->size);
+    case LIGHTOS_RING_OP_CLOSE:
+        return sys_close(sqe->handle);
+    }
+
+    return EINVAL;
+}
+
+static inline bool _sysring_op_failed(lightos_ring_sqe_t* sqe, u64 result)
+{
+    /*
+     * Seeks return the new offset. An absolute seek that didn't land where it was asked to
+     * failed. Relative seeks can't be checked like that, so those always pass
+     */
+    if (sqe->op == LIGHTOS_RING_OP_SEEK)
+        return (sqe->arg == 0 && result != sqe->offset);
+
+    return (result != 0);
+}
+
+/*!
+ * @brief: Process up to @to_submit submissions from the ring of the current process
+ *
+ * Stops early when the SQ runs dry or when there is no room left in the CQ. The amount of
+ * consumed submissions is put in @p_consumed
+ */
+error_t sys_ring_enter(u32 to_submit, u32 flags, u32 __user* p_consumed)
+{
+    u32 sq_tail;
+    u32 cq_head;
+    u32 consumed;
+    u64 result;
+    u64 size;
+    bool canceled;
+    proc_t* c_proc;
+    proc_sysring_t* sysring;
+    lightos_ring_sqe_t sqe;
+    lightos_ring_cqe_t __user* cqe;
+
+    c_proc = get_current_proc();
+
+    if (!c_proc || !c_proc->m_sysring || flags)
+        return EINVAL;
+
+    if (p_consumed && kmem_validate_ptr(c_proc, (vaddr_t)p_consumed, sizeof(*p_consumed)))
+        return EINVAL;
+
+    sysring = c_proc->m_sysring;
+    consumed = 0;
+    canceled = false;
+
+    mutex_lock(sysring->lock);
+
+    /* The process may have unmapped the ring. Don't fault on that */
+    if (kmem_validate_ptr(c_proc, (vaddr_t)sysring->ring, sysring->size)) {
+        mutex_unlock(sysring->lock);
+        return EINVAL;
+    }
+
+    sq_tail = __atomic_load_n(&sysring->ring->sq_tail, __ATOMIC_ACQUIRE);
+
+    /* Don't trust a tail that is further away than the ring is big */
+    if (sq_tail - sysring->sq_head > sysring->sq_entries)
+        sq_tail = sysring->sq_head + sysring->sq_entries;
+
+    while (consumed < to_submit && sysring->sq_head != sq_tail) {
+        cq_head = __atomic_load_n(&sysring->ring->cq_head, __ATOMIC_ACQUIRE);
+
+        /* CQ is full */
+        if (sysring->cq_tail - cq_head >= sysring->cq_entries)
+            break;
+
+        memcpy(&sqe, &sysring->sqes[sysring->sq_head & (sysring->sq_entries - 1)], sizeof(sqe));
+
+        /* The SQE slot is free for userspace again */
+        sysring->sq_head++;
+        __atomic_store_n(&sysring->ring->sq_head, sysring->sq_head, __ATOMIC_RELEASE);
+
+        cqe = &sysring->cqes[sysring->cq_tail & (sysring->cq_entries - 1)];
+
+        if (canceled) {
+            result = ECANCELED;
+            size = 0;
+            cqe->flags = LIGHTOS_RING_CQE_FLAG_CANCELED;
+        } else {
+            result = (sqe.op < LIGHTOS_RING_OP_COUNT) ? _sysring_do_sqe(&sqe, &size) : EINVAL;
+            cqe->flags = 0;
+
+            canceled = ((sqe.flags & LIGHTOS_RING_SQE_FLAG_LINK) == LIGHTOS_RING_SQE_FLAG_LINK && _sysring_op_failed(&sqe, result));
+        }
+
+        cqe->user_data = sqe.user_data;
+        cqe->result = result;
+        cqe->size = size;
+        cqe->res0 = 0;
+
+        /* Publish the completion */
+        sysring->cq_tail++;
+        __atomic_store_n(&sysring->ring->cq_tail, sysring->cq_tail, __ATOMIC_RELEASE);
+
+        consumed++;
+    }
+
+    mutex_unlock(sysring->lock);
+
+    if (p_consumed)
+        *p_consumed = consumed;
+
+    return 0;
+}
+
+/*!
+ * @brief: Release the kernel state of a processes ring
+ *
+ * The shared memory itself is tracked by the processes page tracker, so it goes together
+ * with the rest of the address space
+ */
+void sys_ring_destroy(proc_t* proc)
+{
+    proc_sysring_t* sysring = proc->m_sysring;
+
+    if (!sysring)
+        return;
+
+    proc->m_sysring = nullptr;
+
+    destroy_mutex(sysring->lock);
+    kfree(sysring);
+}
@@ -1,6 +1,10 @@
 #include "core.h"
 #include "libk/flow/error.h"
+#include "lightos/time/kdata.h"
+#include "mem/kmem.h"
+#include "system/asm_specifics.h"
 #include "time/apic.h"
+#include <libk/string.h>
 #include <sched/scheduler.h>
 #include <time/pit.h>
 
@@ -24,6 +28,17 @@ static time_chip_t* _system_chip_drivers[TICK_TYPE_COUNT] = {
 
 static size_t _system_ticks;
 
+/*
+ * The page we share with userspace. See lightos/time/kdata.h
+ *
+ * We calibrate the TSC against our own tick source, by remembering where
+ * both were at the first tick we've seen
+ */
+static lightos_kdata_t* _kdata;
+static paddr_t _kdata_phys;
+static u64 _tsc_calib_start;
+static size_t _tsc_calib_start_ticks;
+
 /*!
  * @brief: Get the current system tick count
  */
@@ -59,6 +74,67 @@ int time_get_system_tick_type(TICK_TYPE* type)
     return 0;
 }
 
+/*!
+ * @brief: Get the physical address of the kernel data page, so it can be mapped into processes
+ */
+int time_get_kdata_page(paddr_t* p_phys)
+{
+    if (!p_phys || !_kdata)
+        return -KERR_INVAL;
+
+    *p_phys = _kdata_phys;
+    return 0;
+}
+
+/*!
+ * @brief: Get the calibrated frequency of the TSC
+ *
+ * Returns zero while calibration hasn't finished yet
+ */
+u64 time_get_tsc_hz()
+{
+    if (!_kdata)
+        return 0;
+
+    return _kdata->tsc_hz;
+}
+
+/*!
+ * @brief: Publish the current time on the kernel data page
+ *
+ * Writers bump the sequence to an odd value before touching anything and back to even after,
+ * which tells readers in userspace whether their copy is consistent
+ */
+static void _time_update_kdata(u64 tsc)
+{
+    system_time_t time = { 0 };
+
+    if (!_kdata)
+        return;
+
+    (void)time_get_system_time(&time);
+
+    if (!_tsc_calib_start) {
+        _tsc_calib_start = tsc;
+        _tsc_calib_start_ticks = _system_ticks;
+    }
+
+    __atomic_store_n(&_kdata->seq, _kdata->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    _kdata->ticks = _system_ticks;
+    _kdata->s_since_boot = time.s_since_boot;
+    _kdata->ms_since_last_s = time.ms_since_last_s;
+    _kdata->us_since_last_ms = time.us_since_last_ms;
+    _kdata->tsc_at_tick = tsc;
+
+    /* Need at least a second worth of ticks for a usable frequency. It only gets better after that */
+    if (_system_ticks - _tsc_calib_start_ticks >= TARGET_TPS)
+        _kdata->tsc_hz = ((tsc - _tsc_calib_start) * TARGET_TPS) / (_system_ticks - _tsc_calib_start_ticks);
+
+    __atomic_store_n(&_kdata->seq, _kdata->seq + 1, __ATOMIC_RELEASE);
+}
+
 int time_register_chip(struct time_chip* chip)
 {
     if (!chip)
@@ -82,6 +158,8 @@ int __do_tick(struct time_chip* chip, registers_t* regs, size_t delta)
     if (!delta)
         return 0;
 
+    _time_update_kdata(read_tsc());
+
     /* NOTE: we store the current processor structure in the GS register */
     this = get_current_scheduler();
 
@@ -223,9 +301,22 @@ static void _timer_init_pic_timers()
  */
 void init_timer_system()
 {
+    int error;
+
     _system_ticks = 0;
     _active_ticker_chip = nullptr;
 
+    /* Every userprocess gets this page mapped, so we can't start any without it */
+    error = kmem_kernel_alloc_range((void**)&_kdata, SMALL_PAGE_SIZE, NULL, KMEM_FLAG_WRITABLE);
+
+    ASSERT_MSG(error == 0, "Failed to allocate the kernel data page");
+
+    memset(_kdata, 0, SMALL_PAGE_SIZE);
+
+    _kdata->version = LIGHTOS_KDATA_VERSION;
+    _kdata->ticks_per_s = TARGET_TPS;
+    _kdata_phys = kmem_to_phys(nullptr, (vaddr_t)_kdata);
+
     /* Initialize all the chip drivers */
     init_pit_chip_driver();
     init_apic_chip_driver();
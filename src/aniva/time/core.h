@@ -83,6 +83,8 @@ int time_get_system_time(system_time_t* btime);
 int time_get_system_tick_type(TICK_TYPE* type);
 
 int time_register_chip(struct time_chip* chip);
+int time_get_kdata_page(paddr_t* p_phys);
+u64 time_get_tsc_hz();
 
 /* Called by chip drivers, implemented by the time core */
 int __do_tick(struct time_chip* chip, registers_t* regs, size_t delta);
@@ -112,7 +112,7 @@ static int disable_pit(time_chip_t* chip)
 {
     CHECK_AND_DO_DISABLE_INTERRUPTS();
 
-    irq_deallocate(PIT_TIMER_INT_NUM, pit_irq_handler);
+    irq_deallocate(PIT_TIMER_INT_NUM, pit_irq_handler, NULL);
 
     CHECK_AND_TRY_ENABLE_INTERRUPTS();
     return 0;
@@ -0,0 +1,197 @@
+#include "dev/usb/spec.h"
+#include "dev/usb/usb.h"
+#include "libk/flow/error.h"
+#include "libk/math/math.h"
+#include "mem/heap.h"
+#include "priv.h"
+#include "scsi.h"
+#include <libk/string.h>
+
+/*
+ * Bulk-Only Transport
+ *
+ * Every command is a Command Block Wrapper on the bulk-out pipe, an optional data stage on
+ * either bulk pipe and a Command Status Wrapper on the bulk-in pipe
+ */
+
+#define BOT_CBW_SIGNATURE 0x43425355
+#define BOT_CSW_SIGNATURE 0x53425355
+
+#define BOT_CBW_FLAG_IN 0x80
+
+#define BOT_CSW_STATUS_GOOD 0x00
+#define BOT_CSW_STATUS_FAILED 0x01
+#define BOT_CSW_STATUS_PHASE_ERROR 0x02
+
+/* Class specific requests */
+#define BOT_REQ_RESET 0xff
+#define BOT_REQ_GET_MAX_LUN 0xfe
+
+typedef struct bot_cbw {
+    u32 signature;
+    u32 tag;
+    u32 data_len;
+    u8 flags;
+    u8 lun;
+    u8 cb_len;
+    u8 cb[SCSI_MAX_CDB_LEN];
+} __attribute__((packed)) bot_cbw_t;
+
+typedef struct bot_csw {
+    u32 signature;
+    u32 tag;
+    u32 residue;
+    u8 status;
+} __attribute__((packed)) bot_csw_t;
+
+struct usbdisk_bot {
+    bot_cbw_t cbw;
+    bot_csw_t csw;
+};
+
+/*!
+ * @brief: Get the device back in a state where it accepts CBWs
+ *
+ * Needed after a phase error or when a CSW does not make sense
+ */
+static int __bot_reset_recovery(usbdisk_dev_t* uddev)
+{
+    int error;
+
+    error = usb_device_submit_ctl(uddev->udev, USB_TYPE_CLASS | USB_TYPE_IF_OUT, BOT_REQ_RESET, 0, uddev->intf->desc.interface_number, 0, NULL, NULL);
+
+    if (error)
+        return error;
+
+    (void)usb_device_clear_halt(uddev->udev, uddev->ep_in);
+    (void)usb_device_clear_halt(uddev->udev, uddev->ep_out);
+    return 0;
+}
+
+/*!
+ * @brief: Read the CSW of the current command
+ *
+ * A stall on the bulk-in pipe here means the device wants us to clear it and try again
+ */
+static int __bot_read_csw(usbdisk_dev_t* uddev, struct usbdisk_bot* bot)
+{
+    int error;
+    size_t transfered = 0;
+
+    for (u32 i = 0; i < 2; i++) {
+        error = usb_device_submit_bulk(uddev->udev, USB_DIRECTION_DEVICE_TO_HOST, uddev->ep_in, &bot->csw, sizeof(bot->csw), &transfered);
+
+        if (!error)
+            break;
+
+        (void)usb_device_clear_halt(uddev->udev, uddev->ep_in);
+    }
+
+    if (error)
+        return error;
+
+    if (transfered != sizeof(bot->csw) || bot->csw.signature != BOT_CSW_SIGNATURE || bot->csw.tag != bot->cbw.tag)
+        return -KERR_IO;
+
+    return 0;
+}
+
+static int usbdisk_bot_exec(usbdisk_dev_t* uddev, u8* cdb, u32 cdb_len, enum USB_XFER_DIRECTION dir, void* buffer, u32 bsize, u32* p_transfered)
+{
+    int error;
+    size_t transfered = 0;
+    usb_endpoint_buffer_t* data_ep;
+    struct usbdisk_bot* bot = uddev->transport_priv;
+
+    if (cdb_len > SCSI_MAX_CDB_LEN)
+        return -KERR_INVAL;
+
+    memset(&bot->cbw, 0, sizeof(bot->cbw));
+
+    bot->cbw.signature = BOT_CBW_SIGNATURE;
+    bot->cbw.tag = ++uddev->tag;
+    bot->cbw.data_len = buffer ? bsize : 0;
+    bot->cbw.flags = (dir == USB_DIRECTION_DEVICE_TO_HOST) ? BOT_CBW_FLAG_IN : 0;
+    bot->cbw.lun = uddev->lun;
+    bot->cbw.cb_len = cdb_len;
+
+    memcpy(bot->cbw.cb, cdb, cdb_len);
+
+    error = usb_device_submit_bulk(uddev->udev, USB_DIRECTION_HOST_TO_DEVICE, uddev->ep_out, &bot->cbw, sizeof(bot->cbw), NULL);
+
+    if (error) {
+        __bot_reset_recovery(uddev);
+        return error;
+    }
+
+    if (bot->cbw.data_len) {
+        data_ep = (dir == USB_DIRECTION_DEVICE_TO_HOST) ? uddev->ep_in : uddev->ep_out;
+
+        /* The whole data stage goes out as one transfer. A stall here still gets us a CSW */
+        if (usb_device_submit_bulk(uddev->udev, dir, data_ep, buffer, bsize, &transfered))
+            (void)usb_device_clear_halt(uddev->udev, data_ep);
+    }
+
+    error = __bot_read_csw(uddev, bot);
+
+    if (error) {
+        __bot_reset_recovery(uddev);
+        return error;
+    }
+
+    if (p_transfered)
+        *p_transfered = bot->cbw.data_len - MIN(bot->csw.residue, bot->cbw.data_len);
+
+    switch (bot->csw.status) {
+    case BOT_CSW_STATUS_GOOD:
+        return 0;
+    case BOT_CSW_STATUS_FAILED:
+        return -KERR_IO;
+    default:
+        __bot_reset_recovery(uddev);
+        return -KERR_DEV;
+    }
+}
+
+static int usbdisk_bot_init(usbdisk_dev_t* uddev)
+{
+    usb_endpoint_buffer_t* ep;
+
+    for (ep = uddev->intf->ep_list; ep; ep = ep->next) {
+        if (!usb_endpoint_type_is_bulk(ep))
+            continue;
+
+        if (usb_endpoint_dir_is_inc(ep) && !uddev->ep_in)
+            uddev->ep_in = ep;
+        else if (usb_endpoint_dir_is_out(ep) && !uddev->ep_out)
+            uddev->ep_out = ep;
+    }
+
+    if (!uddev->ep_in || !uddev->ep_out)
+        return -KERR_NODEV;
+
+    uddev->transport_priv = kmalloc(sizeof(struct usbdisk_bot));
+
+    if (!uddev->transport_priv)
+        return -KERR_NOMEM;
+
+    /* Devices with a single LUN are allowed to stall this */
+    if (usb_device_submit_ctl(uddev->udev, USB_TYPE_CLASS | USB_TYPE_IF_IN, BOT_REQ_GET_MAX_LUN, 0, uddev->intf->desc.interface_number, 1, uddev->scratch, 1))
+        uddev->scratch[0] = 0;
+
+    uddev->max_lun = uddev->scratch[0];
+    return 0;
+}
+
+static void usbdisk_bot_destroy(usbdisk_dev_t* uddev)
+{
+    kfree(uddev->transport_priv);
+    uddev->transport_priv = nullptr;
+}
+
+usbdisk_transport_t usbdisk_bot_transport = {
+    .name = "BOT",
+    .f_init = usbdisk_bot_init,
+    .f_destroy = usbdisk_bot_destroy,
+    .f_exec = usbdisk_bot_exec,
+};
@@ -1,46 +1,335 @@
 #include "dev/device.h"
 #include "dev/disk/device.h"
 #include "dev/disk/volume.h"
+#include "dev/usb/spec.h"
 #include "dev/usb/usb.h"
 #include "libk/flow/error.h"
+#include "libk/io.h"
+#include "libk/math/math.h"
+#include "logging/log.h"
 #include "mem/heap.h"
+#include "priv.h"
+#include "scsi.h"
+#include <libk/string.h>
 
-struct usbdisk_dev {
-    usb_device_t* udev;
-    volume_device_t* diskdev;
-};
+/* How many times we ask a device that just got plugged in if it's ready yet */
+#define USBDISK_READY_RETRIES 20
+
+static u32 _usbdisk_count;
+
+static inline usbdisk_dev_t* usbdisk_get(device_t* device)
+{
+    volume_device_t* volume;
+
+    if (!device)
+        return nullptr;
+
+    volume = device->private;
+
+    if (!volume)
+        return nullptr;
+
+    return volume->private;
+}
+
+/*!
+ * @brief: Send a single SCSI command through the transport of @uddev
+ *
+ * Caller should hold the device lock
+ */
+static inline int usbdisk_scsi_cmd(usbdisk_dev_t* uddev, u8* cdb, u32 cdb_len, enum USB_XFER_DIRECTION dir, void* buffer, u32 bsize, u32* p_transfered)
+{
+    return uddev->transport->f_exec(uddev, cdb, cdb_len, dir, buffer, bsize, p_transfered);
+}
+
+/*!
+ * @brief: Read and write @count blocks starting at @blk
+ *
+ * Every command moves as many blocks as we can fit in USBDISK_MAX_XFER_SIZE, so a large request
+ * only costs a handful of round trips instead of one per sector
+ */
+static int usbdisk_rw(usbdisk_dev_t* uddev, bool write, u64 blk, void* buffer, size_t count)
+{
+    int error;
+    u32 c_count;
+    u32 c_size;
+    u32 cdb_len;
+    u32 transfered;
+    u32 max_count;
+    u8 cdb[SCSI_MAX_CDB_LEN];
+
+    if (!buffer || !count)
+        return -KERR_INVAL;
+
+    if (blk >= uddev->nr_blocks || count > uddev->nr_blocks - blk)
+        return -KERR_RANGE;
+
+    max_count = USBDISK_MAX_XFER_SIZE / uddev->block_size;
+    error = 0;
+
+    mutex_lock(uddev->lock);
+
+    while (count && !error) {
+        c_count = MIN(count, max_count);
+        c_size = c_count * uddev->block_size;
+        transfered = 0;
+
+        memset(cdb, 0, sizeof(cdb));
+
+        if (uddev->use_16) {
+            cdb[0] = write ? SCSI_WRITE_16 : SCSI_READ_16;
+            *(u64*)&cdb[2] = scsi_be64(blk);
+            *(u32*)&cdb[10] = scsi_be32(c_count);
+            cdb_len = 16;
+        } else {
+            cdb[0] = write ? SCSI_WRITE_10 : SCSI_READ_10;
+            *(u32*)&cdb[2] = scsi_be32((u32)blk);
+            *(u16*)&cdb[7] = scsi_be16((u16)c_count);
+            cdb_len = 10;
+        }
+
+        error = usbdisk_scsi_cmd(uddev, cdb, cdb_len, write ? USB_DIRECTION_HOST_TO_DEVICE : USB_DIRECTION_DEVICE_TO_HOST, buffer, c_size, &transfered);
+
+        if (!error && transfered != c_size)
+            error = -KERR_IO;
+
+        blk += c_count;
+        count -= c_count;
+        buffer = (u8*)buffer + c_size;
+    }
+
+    mutex_unlock(uddev->lock);
+
+    return error;
+}
 
 /*!
- * @brief: Read a block from the usbstick
+ * @brief: Read a range of blocks from the usbstick
  */
 static int usbdisk_bread(struct device* device, struct driver* driver, u64 offset, void* buffer, size_t bsize)
 {
-    return 0;
+    usbdisk_dev_t* uddev = usbdisk_get(device);
+
+    if (!uddev)
+        return -KERR_INVAL;
+
+    return usbdisk_rw(uddev, false, offset, buffer, bsize);
 }
 
 /*!
- * @brief: Write a block to the usbstick
+ * @brief: Write a range of blocks to the usbstick
  */
 static int usbdisk_bwrite(struct device* device, struct driver* driver, u64 offset, void* buffer, size_t bsize)
 {
-    return 0;
+    usbdisk_dev_t* uddev = usbdisk_get(device);
+
+    if (!uddev)
+        return -KERR_INVAL;
+
+    return usbdisk_rw(uddev, true, offset, buffer, bsize);
+}
+
+static int usbdisk_flush(struct device* device, struct driver* driver, u64 offset, void* buffer, size_t bsize)
+{
+    int error;
+    u8 cdb[10] = { SCSI_SYNCHRONIZE_CACHE_10 };
+    usbdisk_dev_t* uddev = usbdisk_get(device);
+
+    if (!uddev)
+        return -KERR_INVAL;
+
+    mutex_lock(uddev->lock);
+
+    error = usbdisk_scsi_cmd(uddev, cdb, sizeof(cdb), USB_DIRECTION_HOST_TO_DEVICE, NULL, 0, NULL);
+
+    mutex_unlock(uddev->lock);
+
+    /* Plenty of sticks have no write cache and fail this command. That's fine */
+    if (error == -KERR_IO)
+        return 0;
+
+    return error;
 }
 
 static volume_dev_ops_t __usbdisk_ops = {
     .f_bread = usbdisk_bread,
     .f_bwrite = usbdisk_bwrite,
+    .f_flush = usbdisk_flush,
 };
 
+static int usbdisk_request_sense(usbdisk_dev_t* uddev, u8* p_key)
+{
+    int error;
+    u8 cdb[6] = { SCSI_REQUEST_SENSE, 0, 0, 0, sizeof(scsi_sense_data_t), 0 };
+    scsi_sense_data_t* sense = (scsi_sense_data_t*)uddev->scratch;
+
+    memset(sense, 0, sizeof(*sense));
+
+    error = usbdisk_scsi_cmd(uddev, cdb, sizeof(cdb), USB_DIRECTION_DEVICE_TO_HOST, sense, sizeof(*sense), NULL);
+
+    if (error)
+        return error;
+
+    *p_key = sense->sense_key & 0x0f;
+    return 0;
+}
+
+/*!
+ * @brief: Wait for the medium to become ready
+ *
+ * A fresh device likes to report a unit attention or a not ready condition for a bit
+ */
+static int usbdisk_wait_ready(usbdisk_dev_t* uddev)
+{
+    u8 key;
+    u8 cdb[6] = { SCSI_TEST_UNIT_READY };
+
+    for (u32 i = 0; i < USBDISK_READY_RETRIES; i++) {
+        if (!usbdisk_scsi_cmd(uddev, cdb, sizeof(cdb), USB_DIRECTION_HOST_TO_DEVICE, NULL, 0, NULL))
+            return 0;
+
+        if (usbdisk_request_sense(uddev, &key))
+            return -KERR_DEV;
+
+        switch (key) {
+        case SCSI_SENSE_NO_SENSE:
+        case SCSI_SENSE_UNIT_ATTENTION:
+            break;
+        case SCSI_SENSE_NOT_READY:
+            mdelay(100);
+            break;
+        default:
+            return -KERR_DEV;
+        }
+    }
+
+    return -KERR_TIMEOUT;
+}
+
+static int usbdisk_read_capacity(usbdisk_dev_t* uddev)
+{
+    int error;
+    u8 cdb10[10] = { SCSI_READ_CAPACITY_10 };
+    u8 cdb16[16] = { SCSI_SERVICE_ACTION_IN_16, SCSI_SAI_READ_CAPACITY_16 };
+    scsi_read_capacity_10_t* cap10 = (scsi_read_capacity_10_t*)uddev->scratch;
+    scsi_read_capacity_16_t* cap16 = (scsi_read_capacity_16_t*)uddev->scratch;
+
+    error = usbdisk_scsi_cmd(uddev, cdb10, sizeof(cdb10), USB_DIRECTION_DEVICE_TO_HOST, cap10, sizeof(*cap10), NULL);
+
+    if (error)
+        return error;
+
+    uddev->nr_blocks = (u64)scsi_be32(cap10->last_lba) + 1;
+    uddev->block_size = scsi_be32(cap10->block_size);
+
+    /* Too big for READ CAPACITY(10), ask again with the 16 byte version */
+    if (cap10->last_lba == 0xffffffff) {
+        *(u32*)&cdb16[10] = scsi_be32(sizeof(*cap16));
+
+        error = usbdisk_scsi_cmd(uddev, cdb16, sizeof(cdb16), USB_DIRECTION_DEVICE_TO_HOST, cap16, sizeof(*cap16), NULL);
+
+        if (error)
+            return error;
+
+        uddev->nr_blocks = scsi_be64(cap16->last_lba) + 1;
+        uddev->block_size = scsi_be32(cap16->block_size);
+    }
+
+    if (!uddev->block_size || uddev->block_size > USBDISK_MAX_XFER_SIZE)
+        return -KERR_DEV;
+
+    /* READ(10) can't address past 2^32 blocks */
+    uddev->use_16 = (uddev->nr_blocks > 0xffffffffULL);
+    return 0;
+}
+
 /*!
  * @brief: Gathers generic volume information
  *
- * TODO: Do the needed USB transactions for this
+ * Makes sure we're talking to a disk, waits for it to become ready and asks it how big it is
  */
 static inline int usbdisk_init_volume_dev_info(struct usbdisk_dev* uddev, volume_info_t* pinfo)
 {
+    int error;
+    char vendor[9] = { 0 };
+    char product[17] = { 0 };
+    u8 cdb[6] = { SCSI_INQUIRY, 0, 0, 0, sizeof(scsi_inquiry_data_t), 0 };
+    scsi_inquiry_data_t* inq = (scsi_inquiry_data_t*)uddev->scratch;
+
+    memset(inq, 0, sizeof(*inq));
+
+    mutex_lock(uddev->lock);
+
+    error = usbdisk_scsi_cmd(uddev, cdb, sizeof(cdb), USB_DIRECTION_DEVICE_TO_HOST, inq, sizeof(*inq), NULL);
+
+    if (error)
+        goto unlock_and_exit;
+
+    if ((inq->peripheral & SCSI_TYPE_MASK) != SCSI_TYPE_DISK) {
+        error = -KERR_NODEV;
+        goto unlock_and_exit;
+    }
+
+    memcpy(vendor, inq->vendor, sizeof(inq->vendor));
+    memcpy(product, inq->product, sizeof(inq->product));
+
+    KLOG_DBG("usbdisk: %s %s over %s\n", vendor, product, uddev->transport->name);
+
+    error = usbdisk_wait_ready(uddev);
+
+    if (error)
+        goto unlock_and_exit;
+
+    error = usbdisk_read_capacity(uddev);
+
+unlock_and_exit:
+    mutex_unlock(uddev->lock);
+
+    if (error)
+        return error;
+
+    pinfo->type = VOLUME_TYPE_UNKNOWN;
+    pinfo->logical_sector_size = uddev->block_size;
+    pinfo->physical_sector_size = uddev->block_size;
+    pinfo->max_transfer_sector_nr = USBDISK_MAX_XFER_SIZE / uddev->block_size;
+    pinfo->max_offset = (uddev->nr_blocks * uddev->block_size) - 1;
+
+    sfmt(pinfo->label, "usbdisk%d", _usbdisk_count++);
     return 0;
 }
 
+/*!
+ * @brief: Pick the alternate setting we want to drive
+ *
+ * UAS devices usually have a BOT fallback as another alternate setting of the same interface. We
+ * prefer UAS, unless the device would need streams for it
+ */
+static usb_interface_entry_t* usbdisk_select_intf(usb_device_t* dev, usb_interface_buffer_t* intrf, usbdisk_transport_t** ptransport)
+{
+    usb_interface_entry_t* c_entry;
+    usb_interface_entry_t* bot = nullptr;
+    usb_interface_entry_t* uas = nullptr;
+
+    for (c_entry = intrf->alt_list; c_entry; c_entry = c_entry->next) {
+        if (c_entry->desc.interface_class != 0x08)
+            continue;
+
+        if (c_entry->desc.interface_protocol == USBDISK_PROTO_BOT && !bot)
+            bot = c_entry;
+        else if (c_entry->desc.interface_protocol == USBDISK_PROTO_UAS && !uas)
+            uas = c_entry;
+    }
+
+    /* TODO: Superspeed UAS needs bulk streams, which none of our HCDs can do yet */
+    if (uas && (dev->speed != USB_SUPERSPEED || !bot)) {
+        *ptransport = &usbdisk_uas_transport;
+        return uas;
+    }
+
+    *ptransport = &usbdisk_bot_transport;
+    return bot;
+}
+
 /*!
  * @brief: Creates a new usbdisk device object
  *
@@ -49,38 +338,97 @@ static inline int usbdisk_init_volume_dev_info(struct usbdisk_dev* uddev, volume
  */
 int usbdisk_create(driver_t* driver, usb_device_t* dev, usb_interface_buffer_t* intrf)
 {
+    int error;
     struct usbdisk_dev* uddev;
     volume_info_t info = { 0 };
 
+    if (!intrf)
+        return -KERR_NULL;
+
     uddev = kmalloc(sizeof(*uddev));
 
     if (!uddev)
         return -KERR_NOMEM;
 
+    memset(uddev, 0, sizeof(*uddev));
+
     /* Set the usb disk device fields */
     uddev->udev = dev;
+    uddev->intf = usbdisk_select_intf(dev, intrf, &uddev->transport);
+
+    error = -KERR_NODEV;
+
+    if (!uddev->intf)
+        goto free_and_exit;
+
+    /* Switch over to the alternate setting we picked */
+    if (uddev->intf->desc.alternate_setting) {
+        error = usb_device_submit_ctl(dev, USB_TYPE_STANDARD | USB_TYPE_IF_OUT, USB_REQ_SET_INTERFACE,
+            uddev->intf->desc.alternate_setting, uddev->intf->desc.interface_number, 0, NULL, NULL);
+
+        if (error)
+            goto free_and_exit;
+    }
+
+    uddev->lock = create_mutex(NULL);
+
+    error = uddev->transport->f_init(uddev);
+
+    if (error)
+        goto destroy_and_exit;
 
     /* Initialize generic volume info */
-    usbdisk_init_volume_dev_info(uddev, &info);
+    error = usbdisk_init_volume_dev_info(uddev, &info);
+
+    if (error)
+        goto destroy_and_exit;
 
     /* Finally, create the volume device */
-    uddev->diskdev = create_volume_device(&info, &__usbdisk_ops, NULL, uddev);
+    uddev->diskdev = create_volume_device(NULL, &__usbdisk_ops, NULL, uddev);
+
+    if (!uddev->diskdev) {
+        error = -KERR_NOMEM;
+        goto destroy_and_exit;
+    }
 
-    /* Register the generic disk device (Because idk) */
+    dev->private = uddev;
+
+    /* Register first, so the partition scan goes through the request queue */
     register_volume_device(uddev->diskdev);
 
-    /* TODO: Register the disk device to oss (Should gdisk do this?) */
+    /* This also scans the partition table */
+    volume_dev_set_info(uddev->diskdev, &info);
     return 0;
+
+destroy_and_exit:
+    if (uddev->transport_priv)
+        uddev->transport->f_destroy(uddev);
+
+    destroy_mutex(uddev->lock);
+free_and_exit:
+    kfree(uddev);
+    return error;
 }
 
 int usbdisk_destroy(struct usbdisk_dev* dev)
 {
+    if (!dev)
+        return -KERR_INVAL;
+
+    /* Make sure nobody is still queueing I/O on us */
+    unregister_volume_device(dev->diskdev);
+
     /* Murder the volume device */
     destroy_volume_device(dev->diskdev);
 
+    dev->transport->f_destroy(dev);
+    dev->udev->private = nullptr;
+
     /* Also murder the usb device */
     destroy_usb_device(dev->udev);
 
+    destroy_mutex(dev->lock);
+
     /* Finally, murder our own memory (Gosh we're cruel) */
     kfree(dev);
     return 0;
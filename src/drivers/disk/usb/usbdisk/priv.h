@@ -1,11 +1,68 @@
 #ifndef __ANIVA_USBDISK_PRIV__
 #define __ANIVA_USBDISK_PRIV__
 
+#include "dev/disk/device.h"
 #include "dev/driver.h"
 #include "dev/usb/usb.h"
+#include "sync/mutex.h"
 
 struct usbdisk_dev;
 
+/* Interface protocols of the mass storage class we can talk */
+#define USBDISK_PROTO_BOT 0x50
+#define USBDISK_PROTO_UAS 0x62
+
+/* Biggest transfer we put in a single SCSI command */
+#define USBDISK_MAX_XFER_SIZE (64 * Kib)
+
+/*
+ * A transport carries SCSI commands to the device
+ *
+ * f_exec sends @cdb and moves @bsize bytes of @buffer in the direction @dir. @p_transfered
+ * gets the amount of data that actually made it
+ */
+typedef struct usbdisk_transport {
+    const char* name;
+
+    int (*f_init)(struct usbdisk_dev* uddev);
+    void (*f_destroy)(struct usbdisk_dev* uddev);
+    int (*f_exec)(struct usbdisk_dev* uddev, u8* cdb, u32 cdb_len, enum USB_XFER_DIRECTION dir, void* buffer, u32 bsize, u32* p_transfered);
+} usbdisk_transport_t;
+
+extern usbdisk_transport_t usbdisk_bot_transport;
+extern usbdisk_transport_t usbdisk_uas_transport;
+
+typedef struct usbdisk_dev {
+    usb_device_t* udev;
+    volume_device_t* diskdev;
+
+    /* Only one command on the wire at a time */
+    mutex_t* lock;
+
+    /* The interface (alternate setting) we're driving */
+    usb_interface_entry_t* intf;
+    usbdisk_transport_t* transport;
+    void* transport_priv;
+
+    usb_endpoint_buffer_t* ep_in;
+    usb_endpoint_buffer_t* ep_out;
+    /* UAS has separate pipes for commands and status */
+    usb_endpoint_buffer_t* ep_cmd;
+    usb_endpoint_buffer_t* ep_status;
+
+    u32 tag;
+    u8 lun;
+    u8 max_lun;
+    /* Do we need the 16 byte cdbs to reach every block */
+    bool use_16;
+
+    u32 block_size;
+    u64 nr_blocks;
+
+    /* Small buffer for command responses during setup */
+    u8 scratch[64];
+} usbdisk_dev_t;
+
 extern int usbdisk_create(driver_t* driver, usb_device_t* dev, usb_interface_buffer_t* intrf);
 extern int usbdisk_destroy(struct usbdisk_dev* dev);
 
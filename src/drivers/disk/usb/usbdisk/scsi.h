@@ -0,0 +1,88 @@
+#ifndef __ANIVA_USBDISK_SCSI__
+#define __ANIVA_USBDISK_SCSI__
+
+#include <libk/stddef.h>
+
+/*
+ * The subset of SCSI block commands (SBC) we need to drive a usb disk
+ */
+
+#define SCSI_TEST_UNIT_READY 0x00
+#define SCSI_REQUEST_SENSE 0x03
+#define SCSI_INQUIRY 0x12
+#define SCSI_READ_CAPACITY_10 0x25
+#define SCSI_READ_10 0x28
+#define SCSI_WRITE_10 0x2a
+#define SCSI_SYNCHRONIZE_CACHE_10 0x35
+#define SCSI_READ_16 0x88
+#define SCSI_WRITE_16 0x8a
+#define SCSI_SERVICE_ACTION_IN_16 0x9e
+
+/* Service action of SERVICE ACTION IN(16) that gets us READ CAPACITY(16) */
+#define SCSI_SAI_READ_CAPACITY_16 0x10
+
+/* Peripheral device type of a direct access block device (A disk) */
+#define SCSI_TYPE_DISK 0x00
+#define SCSI_TYPE_MASK 0x1f
+
+/* Sense keys we care about */
+#define SCSI_SENSE_NO_SENSE 0x00
+#define SCSI_SENSE_NOT_READY 0x02
+#define SCSI_SENSE_UNIT_ATTENTION 0x06
+
+/* The largest cdb we ever send */
+#define SCSI_MAX_CDB_LEN 16
+
+typedef struct scsi_inquiry_data {
+    u8 peripheral;
+    u8 removable;
+    u8 version;
+    u8 resp_fmt;
+    u8 additional_len;
+    u8 flags[3];
+    char vendor[8];
+    char product[16];
+    char revision[4];
+} __attribute__((packed)) scsi_inquiry_data_t;
+
+typedef struct scsi_sense_data {
+    u8 resp_code;
+    u8 obsolete;
+    u8 sense_key;
+    u8 info[4];
+    u8 additional_len;
+    u8 cmd_info[4];
+    u8 asc;
+    u8 ascq;
+    u8 fru;
+    u8 key_specific[3];
+} __attribute__((packed)) scsi_sense_data_t;
+
+typedef struct scsi_read_capacity_10 {
+    u32 last_lba;
+    u32 block_size;
+} __attribute__((packed)) scsi_read_capacity_10_t;
+
+typedef struct scsi_read_capacity_16 {
+    u64 last_lba;
+    u32 block_size;
+    u8 reserved[20];
+} __attribute__((packed)) scsi_read_capacity_16_t;
+
+/* Everything on the SCSI side of things is big endian */
+static inline u16 scsi_be16(u16 val)
+{
+    return __builtin_bswap16(val);
+}
+
+static inline u32 scsi_be32(u32 val)
+{
+    return __builtin_bswap32(val);
+}
+
+static inline u64 scsi_be64(u64 val)
+{
+    return __builtin_bswap64(val);
+}
+
+#endif // !__ANIVA_USBDISK_SCSI__
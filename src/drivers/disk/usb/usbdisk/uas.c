@@ -0,0 +1,205 @@
+#include "dev/usb/usb.h"
+#include "libk/flow/error.h"
+#include "mem/heap.h"
+#include "priv.h"
+#include "scsi.h"
+#include <libk/string.h>
+
+/*
+ * USB Attached SCSI
+ *
+ * UAS uses four pipes: commands go out on the command pipe, the device answers on the status pipe
+ * and data moves over a dedicated pipe per direction. On superspeed, every command gets its own stream
+ * on the status and data pipes, so the device can have a bunch of tagged commands in flight. Without
+ * streams (High speed), the device tells us which tag it wants to move data for with a READ READY or
+ * WRITE READY IU on the status pipe before every data stage.
+ *
+ * Our host controllers don't do streams, so we only ever drive UAS without them and keep a single
+ * command in flight. Superspeed UAS devices go through BOT instead (see usbdisk_create)
+ */
+
+#define UAS_IU_COMMAND 0x01
+#define UAS_IU_SENSE 0x03
+#define UAS_IU_RESPONSE 0x04
+#define UAS_IU_READ_READY 0x06
+#define UAS_IU_WRITE_READY 0x07
+
+#define UAS_STATUS_GOOD 0x00
+
+typedef struct uas_cmd_iu {
+    u8 iu_id;
+    u8 reserved0;
+    u16 tag;
+    u8 prio_attr;
+    u8 reserved1;
+    u8 add_cdb_len;
+    u8 reserved2;
+    u8 lun[8];
+    u8 cdb[SCSI_MAX_CDB_LEN];
+} __attribute__((packed)) uas_cmd_iu_t;
+
+/* Common header of every IU on the status pipe */
+typedef struct uas_iu_hdr {
+    u8 iu_id;
+    u8 reserved;
+    u16 tag;
+} __attribute__((packed)) uas_iu_hdr_t;
+
+typedef struct uas_sense_iu {
+    uas_iu_hdr_t hdr;
+    u16 status_qual;
+    u8 status;
+    u8 reserved[7];
+    u16 sense_len;
+    u8 sense[96];
+} __attribute__((packed)) uas_sense_iu_t;
+
+struct usbdisk_uas {
+    uas_cmd_iu_t cmd;
+    uas_sense_iu_t status;
+};
+
+/*!
+ * @brief: Read the next IU for our current tag off the status pipe
+ */
+static int __uas_read_status(usbdisk_dev_t* uddev, struct usbdisk_uas* uas, u16 tag)
+{
+    int error;
+    size_t transfered = 0;
+
+    error = usb_device_submit_bulk(uddev->udev, USB_DIRECTION_DEVICE_TO_HOST, uddev->ep_status, &uas->status, sizeof(uas->status), &transfered);
+
+    if (error) {
+        (void)usb_device_clear_halt(uddev->udev, uddev->ep_status);
+        return error;
+    }
+
+    if (transfered < sizeof(uas_iu_hdr_t) || uas->status.hdr.tag != tag)
+        return -KERR_IO;
+
+    return 0;
+}
+
+static int usbdisk_uas_exec(usbdisk_dev_t* uddev, u8* cdb, u32 cdb_len, enum USB_XFER_DIRECTION dir, void* buffer, u32 bsize, u32* p_transfered)
+{
+    int error;
+    u16 tag;
+    u8 ready_iu;
+    size_t transfered = 0;
+    usb_endpoint_buffer_t* data_ep;
+    struct usbdisk_uas* uas = uddev->transport_priv;
+
+    if (cdb_len > SCSI_MAX_CDB_LEN)
+        return -KERR_INVAL;
+
+    /* Tag zero is not a valid command tag */
+    uddev->tag = (uddev->tag + 1) & 0xffff;
+
+    if (!uddev->tag)
+        uddev->tag = 1;
+
+    tag = scsi_be16((u16)uddev->tag);
+
+    memset(&uas->cmd, 0, sizeof(uas->cmd));
+
+    uas->cmd.iu_id = UAS_IU_COMMAND;
+    uas->cmd.tag = tag;
+    uas->cmd.lun[1] = uddev->lun;
+
+    memcpy(uas->cmd.cdb, cdb, cdb_len);
+
+    error = usb_device_submit_bulk(uddev->udev, USB_DIRECTION_HOST_TO_DEVICE, uddev->ep_cmd, &uas->cmd, sizeof(uas->cmd), NULL);
+
+    if (error) {
+        (void)usb_device_clear_halt(uddev->udev, uddev->ep_cmd);
+        return error;
+    }
+
+    if (buffer && bsize) {
+        error = __uas_read_status(uddev, uas, tag);
+
+        if (error)
+            return error;
+
+        ready_iu = (dir == USB_DIRECTION_DEVICE_TO_HOST) ? UAS_IU_READ_READY : UAS_IU_WRITE_READY;
+
+        /* Anything other than a ready IU means the command ended before it got to the data */
+        if (uas->status.hdr.iu_id != ready_iu)
+            goto check_status;
+
+        data_ep = (dir == USB_DIRECTION_DEVICE_TO_HOST) ? uddev->ep_in : uddev->ep_out;
+
+        if (usb_device_submit_bulk(uddev->udev, dir, data_ep, buffer, bsize, &transfered))
+            (void)usb_device_clear_halt(uddev->udev, data_ep);
+    }
+
+    error = __uas_read_status(uddev, uas, tag);
+
+    if (error)
+        return error;
+
+check_status:
+    if (p_transfered)
+        *p_transfered = transfered;
+
+    if (uas->status.hdr.iu_id != UAS_IU_SENSE)
+        return -KERR_DEV;
+
+    if (uas->status.status != UAS_STATUS_GOOD)
+        return -KERR_IO;
+
+    return 0;
+}
+
+/*!
+ * @brief: Find the four UAS pipes
+ *
+ * The pipe usage descriptors that say which endpoint is which don't make it into our endpoint
+ * lists, so we rely on the order every UAS device we know of uses: command, status, data in, data out
+ */
+static int usbdisk_uas_init(usbdisk_dev_t* uddev)
+{
+    usb_endpoint_buffer_t* ep;
+
+    for (ep = uddev->intf->ep_list; ep; ep = ep->next) {
+        if (!usb_endpoint_type_is_bulk(ep))
+            continue;
+
+        if (usb_endpoint_dir_is_out(ep)) {
+            if (!uddev->ep_cmd)
+                uddev->ep_cmd = ep;
+            else if (!uddev->ep_out)
+                uddev->ep_out = ep;
+        } else {
+            if (!uddev->ep_status)
+                uddev->ep_status = ep;
+            else if (!uddev->ep_in)
+                uddev->ep_in = ep;
+        }
+    }
+
+    if (!uddev->ep_cmd || !uddev->ep_status || !uddev->ep_in || !uddev->ep_out)
+        return -KERR_NODEV;
+
+    uddev->transport_priv = kmalloc(sizeof(struct usbdisk_uas));
+
+    if (!uddev->transport_priv)
+        return -KERR_NOMEM;
+
+    /* UAS has no GET MAX LUN, we just talk to LUN 0 */
+    uddev->max_lun = 0;
+    return 0;
+}
+
+static void usbdisk_uas_destroy(usbdisk_dev_t* uddev)
+{
+    kfree(uddev->transport_priv);
+    uddev->transport_priv = nullptr;
+}
+
+usbdisk_transport_t usbdisk_uas_transport = {
+    .name = "UAS",
+    .f_init = usbdisk_uas_init,
+    .f_destroy = usbdisk_uas_destroy,
+    .f_exec = usbdisk_uas_exec,
+};
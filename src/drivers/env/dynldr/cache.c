@@ -0,0 +1,495 @@
+#include "fs/file.h"
+#include "libk/bin/elf.h"
+#include "libk/data/hashmap.h"
+#include "libk/data/linkedlist.h"
+#include "libk/flow/error.h"
+#include "libk/math/math.h"
+#include "logging/log.h"
+#include "mem/heap.h"
+#include "mem/kmem.h"
+#include "mem/phys.h"
+#include "mem/tracker/tracker.h"
+#include "mem/zalloc/zalloc.h"
+#include "priv.h"
+#include "proc/proc.h"
+#include "sync/mutex.h"
+#include <libk/string.h>
+
+/*
+ * The library cache
+ *
+ * Every library gets loaded through here. The first time we see a library, we read its file, give
+ * it a spot in the library window and parse its symbols. Every process that links against it after
+ * that gets:
+ *  - The read-only segments (text, rodata, dynsym, ect.) mapped straight from pages we keep here
+ *  - Private copies of the writable segments (data, GOT, bss), which get relocated per process
+ *  - The symbols we parsed the first time
+ *
+ * Since a library ends up at the same address in every process, the addresses of its symbols are the
+ * same everywhere too. Segments that need relocations (text relocations) or that share a page with
+ * another segment can't be shared, so those get a private copy like the writable segments do.
+ *
+ * When the file of a library changes, its image is taken out of the cache and lives on only for as
+ * long as the libraries that were made from it
+ */
+
+static list_t* _dynlib_cache;
+static mutex_t* _dynlib_cache_lock;
+/* Where the next library goes in the library window */
+static vaddr_t _dynlib_window_next;
+static u32 _dynlib_cache_hits;
+
+static dynlib_image_t* __dynlib_cache_find(const char* path)
+{
+    dynlib_image_t* dimage;
+
+    FOREACH(i, _dynlib_cache)
+    {
+        dimage = i->data;
+
+        if (strcmp(dimage->path, path) == 0)
+            return dimage;
+    }
+
+    return nullptr;
+}
+
+static inline bool __phdr_pages_overlap(struct elf64_phdr* a, struct elf64_phdr* b)
+{
+    return ALIGN_DOWN_TO_PAGE(a->p_vaddr) < ALIGN_UP_TO_PAGE(b->p_vaddr + b->p_memsz)
+        && ALIGN_DOWN_TO_PAGE(b->p_vaddr) < ALIGN_UP_TO_PAGE(a->p_vaddr + a->p_memsz);
+}
+
+/*!
+ * @brief: Check if there are any relocations that land inside @phdr
+ */
+static bool __dynlib_segment_has_relocs(elf_image_t* image, struct elf64_phdr* phdr)
+{
+    size_t rela_count;
+    struct elf64_shdr* shdr;
+    struct elf64_rela* table;
+
+    for (uint32_t i = 0; i < image->elf_hdr->e_shnum; i++) {
+        shdr = elf_get_shdr(image->elf_hdr, i);
+
+        if (shdr->sh_type != SHT_RELA)
+            continue;
+
+        table = (struct elf64_rela*)(image->kernel_image + shdr->sh_offset);
+        rela_count = shdr->sh_size / sizeof(struct elf64_rela);
+
+        for (uint32_t j = 0; j < rela_count; j++)
+            if (table[j].r_offset >= phdr->p_vaddr && table[j].r_offset < phdr->p_vaddr + phdr->p_memsz)
+                return true;
+    }
+
+    return false;
+}
+
+/*!
+ * @brief: Check if every process can map the same pages for @phdr
+ */
+static bool __dynlib_segment_can_share(elf_image_t* image, struct elf64_phdr* phdr)
+{
+    struct elf64_phdr* c_phdr;
+
+    if (phdr->p_type != PT_LOAD || !phdr->p_memsz)
+        return false;
+
+    if ((phdr->p_flags & PF_W) == PF_W)
+        return false;
+
+    for (uint32_t i = 0; i < image->elf_hdr->e_phnum; i++) {
+        c_phdr = &image->elf_phdrs[i];
+
+        if (c_phdr == phdr || c_phdr->p_type != PT_LOAD)
+            continue;
+
+        if (__phdr_pages_overlap(phdr, c_phdr))
+            return false;
+    }
+
+    return !__dynlib_segment_has_relocs(image, phdr);
+}
+
+/*!
+ * @brief: Build the pages of the segments of @dimage that we can share
+ */
+static kerror_t __dynlib_image_prepare_segments(dynlib_image_t* dimage)
+{
+    kerror_t error;
+    dynlib_segment_t* seg;
+    struct elf64_phdr* phdr;
+    elf_image_t* image = &dimage->image;
+
+    dimage->segments = kmalloc(sizeof(dynlib_segment_t) * image->elf_hdr->e_phnum);
+
+    if (!dimage->segments)
+        return -KERR_NOMEM;
+
+    memset(dimage->segments, 0, sizeof(dynlib_segment_t) * image->elf_hdr->e_phnum);
+
+    for (uint32_t i = 0; i < image->elf_hdr->e_phnum; i++) {
+        seg = &dimage->segments[i];
+        phdr = &image->elf_phdrs[i];
+
+        if (!__dynlib_segment_can_share(image, phdr))
+            continue;
+
+        seg->ubase = ALIGN_DOWN_TO_PAGE((vaddr_t)image->user_base + phdr->p_vaddr);
+        seg->nr_pages = GET_PAGECOUNT((vaddr_t)image->user_base + phdr->p_vaddr, phdr->p_memsz);
+
+        error = kmem_kernel_alloc_range(&seg->kbase, seg->nr_pages << PAGE_SHIFT, NULL, KMEM_FLAG_KERNEL | KMEM_FLAG_WRITABLE);
+
+        if (error)
+            return error;
+
+        /* Every process is going to see these, so don't leave anything in there */
+        memset(seg->kbase, 0, seg->nr_pages << PAGE_SHIFT);
+        memcpy(seg->kbase + (phdr->p_vaddr & PAGE_LOW_MASK), image->kernel_image + phdr->p_offset, MIN(phdr->p_filesz, phdr->p_memsz));
+
+        seg->phys = kmem_to_phys(NULL, (vaddr_t)seg->kbase);
+
+        dimage->nr_shared_pages += seg->nr_pages;
+    }
+
+    return 0;
+}
+
+static void __destroy_dynlib_image(dynlib_image_t* dimage)
+{
+    dynlib_segment_t* seg;
+
+    /* Processes that still have these mapped keep their own references to the pages */
+    for (uint32_t i = 0; dimage->segments && i < dimage->image.elf_hdr->e_phnum; i++) {
+        seg = &dimage->segments[i];
+
+        if (seg->kbase)
+            kmem_kernel_dealloc((vaddr_t)seg->kbase, seg->nr_pages << PAGE_SHIFT);
+    }
+
+    if (dimage->symbol_list) {
+        FOREACH(n, dimage->symbol_list)
+        {
+            loaded_sym_t* sym = n->data;
+
+            kzfree(sym, sizeof(*sym));
+        }
+
+        destroy_list(dimage->symbol_list);
+    }
+
+    if (dimage->symbol_map)
+        destroy_hashmap(dimage->symbol_map);
+
+    if (dimage->image.kernel_image)
+        destroy_elf_image(&dimage->image);
+
+    kfree(dimage->segments);
+    kfree((void*)dimage->path);
+    kfree(dimage);
+}
+
+/*!
+ * @brief: Read the library in @file at @path and get everything ready to map it into processes
+ *
+ * Caller should hold the cache lock
+ */
+static kerror_t __create_dynlib_image(const char* path, file_t* file, dynlib_image_t** p_image)
+{
+    kerror_t error;
+    elf_image_t* image;
+    dynlib_image_t* dimage;
+
+    dimage = kmalloc(sizeof(*dimage));
+
+    if (!dimage)
+        return -KERR_NOMEM;
+
+    memset(dimage, 0, sizeof(*dimage));
+
+    image = &dimage->image;
+
+    dimage->path = strdup(path);
+    dimage->file_obj = file->m_obj;
+    dimage->file_size = file->m_total_size;
+    dimage->symbol_map = create_hashmap(0x1000, HASHMAP_FLAG_SK);
+    dimage->symbol_list = init_list();
+
+    KLOG_DBG("Caching dynamic library %s\n", path);
+
+    /* Not loaded for any process in particular */
+    error = load_elf_image(image, nullptr, file);
+
+    if (error) {
+        /* load_elf_image cleans up after itself */
+        image->kernel_image = nullptr;
+        goto destroy_and_exit;
+    }
+
+    error = _elf_scan_phdrs(image);
+
+    if (error)
+        goto destroy_and_exit;
+
+    /* Claim our spot in the library window */
+    if (_dynlib_window_next + image->user_image_size > DYNLIB_WINDOW_END) {
+        error = -KERR_NOMEM;
+        goto destroy_and_exit;
+    }
+
+    image->user_base = (void*)_dynlib_window_next;
+
+    error = _elf_do_headers(image);
+
+    if (error)
+        goto destroy_and_exit;
+
+    error = _elf_load_dyn_info(image);
+
+    if (error)
+        goto destroy_and_exit;
+
+    error = __dynlib_image_prepare_segments(dimage);
+
+    if (error)
+        goto destroy_and_exit;
+
+    error = _elf_do_symbols(dimage->symbol_list, dimage->symbol_map, nullptr, image);
+
+    if (error)
+        goto destroy_and_exit;
+
+    /* Leave a guard page between libraries */
+    _dynlib_window_next += image->user_image_size + SMALL_PAGE_SIZE;
+
+    list_append(_dynlib_cache, dimage);
+
+    KLOG_DBG("Cached %s at 0x%p (%lld of %lld pages shared)\n", dimage->path, image->user_base, dimage->nr_shared_pages, (image->user_image_size >> PAGE_SHIFT));
+
+    *p_image = dimage;
+    return 0;
+
+destroy_and_exit:
+    __destroy_dynlib_image(dimage);
+    return error;
+}
+
+/*!
+ * @brief: Take @dimage out of the cache, since the file it came from changed
+ *
+ * Libraries that still use the image keep it alive until they drop it with dynlib_cache_put.
+ * Caller should hold the cache lock
+ */
+static void __dynlib_cache_drop(dynlib_image_t* dimage)
+{
+    KLOG_DBG("Dropping stale cached library %s\n", dimage->path);
+
+    list_remove_ex(_dynlib_cache, dimage);
+
+    dimage->stale = true;
+
+    if (!dimage->nr_users)
+        __destroy_dynlib_image(dimage);
+}
+
+/*!
+ * @brief: Grab the cached image of the library at @path
+ *
+ * Reads the library into the cache if it's not there yet, or if the file changed since we cached
+ * it. Files don't have an mtime, so a different object or size is what tells us it got replaced.
+ * Every successful call needs a matching dynlib_cache_put
+ */
+kerror_t dynlib_cache_get(const char* path, dynlib_image_t** p_image)
+{
+    kerror_t error;
+    file_t* file;
+    dynlib_image_t* dimage;
+
+    if (!path || !p_image)
+        return -KERR_INVAL;
+
+    file = file_open(path);
+
+    if (!file)
+        return -KERR_NOT_FOUND;
+
+    mutex_lock(_dynlib_cache_lock);
+
+    dimage = __dynlib_cache_find(path);
+
+    if (dimage && (dimage->file_obj != file->m_obj || dimage->file_size != file->m_total_size)) {
+        __dynlib_cache_drop(dimage);
+        dimage = nullptr;
+    }
+
+    error = 0;
+
+    if (dimage)
+        _dynlib_cache_hits++;
+    else
+        error = __create_dynlib_image(path, file, &dimage);
+
+    if (!error) {
+        dimage->nr_users++;
+        *p_image = dimage;
+    }
+
+    mutex_unlock(_dynlib_cache_lock);
+
+    file_close(file);
+    return error;
+}
+
+/*!
+ * @brief: Drop a reference we got from dynlib_cache_get
+ */
+void dynlib_cache_put(dynlib_image_t* dimage)
+{
+    if (!dimage)
+        return;
+
+    mutex_lock(_dynlib_cache_lock);
+
+    dimage->nr_users--;
+
+    /* Nobody is going to find this one anymore */
+    if (dimage->stale && !dimage->nr_users)
+        __destroy_dynlib_image(dimage);
+
+    mutex_unlock(_dynlib_cache_lock);
+}
+
+/*!
+ * @brief: Map the shared pages of @seg into @proc
+ */
+static kerror_t __dynlib_map_shared_segment(dynlib_segment_t* seg, struct elf64_phdr* phdr, proc_t* proc)
+{
+    kerror_t error;
+    page_range_t range;
+    u32 page_flags = NULL;
+
+    /* Keep these out of the backed ranges, so the process does not try to free them on exit */
+    error = page_tracker_alloc(&proc->m_virtual_tracker, kmem_get_page_idx(seg->ubase), seg->nr_pages, PAGE_RANGE_FLAG_UNBACKED);
+
+    if (error)
+        return error;
+
+    /* This reference gets dropped again when the page directory of @proc is destroyed */
+    error = kmem_phys_reserve_range(kmem_get_page_idx(seg->phys), seg->nr_pages);
+
+    if (error)
+        goto dealloc_and_exit;
+
+    if ((phdr->p_flags & PF_X) != PF_X)
+        page_flags |= KMEM_FLAG_NOEXECUTE;
+
+    if (!kmem_map_range(proc->m_root_pd.m_root, seg->ubase, seg->phys, seg->nr_pages, KMEM_CUSTOMFLAG_GET_MAKE | KMEM_CUSTOMFLAG_CREATE_USER, page_flags)) {
+        kmem_phys_dealloc_range(kmem_get_page_idx(seg->phys), seg->nr_pages);
+        error = -KERR_NOMEM;
+        goto dealloc_and_exit;
+    }
+
+    return 0;
+
+dealloc_and_exit:
+    init_page_range(&range, kmem_get_page_idx(seg->ubase), seg->nr_pages, NULL, 1);
+
+    page_tracker_dealloc(&proc->m_virtual_tracker, &range);
+    return error;
+}
+
+/*!
+ * @brief: Map the cached library @dimage into @proc
+ *
+ * Fills @image with everything the loader needs to relocate the library for @proc. The private
+ * segments get copied into the current addressspace, so this must be called from inside the
+ * addressspace of @proc
+ */
+kerror_t dynlib_image_map(dynlib_image_t* dimage, proc_t* proc, elf_image_t* image)
+{
+    kerror_t error;
+    dynlib_segment_t* seg;
+    struct elf64_phdr* phdr;
+    const vaddr_t base = (vaddr_t)dimage->image.user_base;
+
+    /* Something else got here first. Nothing in userspace should ever allocate in the library window */
+    for (vaddr_t addr = base; addr < base + dimage->image.user_image_size; addr += SMALL_PAGE_SIZE)
+        if (!page_tracker_get_range(&proc->m_virtual_tracker, kmem_get_page_idx(addr), NULL))
+            return -KERR_DUPLICATE;
+
+    /* The buffers in here stay with the cache */
+    memcpy(image, &dimage->image, sizeof(*image));
+
+    image->proc = proc;
+
+    for (uint32_t i = 0; i < image->elf_hdr->e_phnum; i++) {
+        seg = &dimage->segments[i];
+        phdr = &image->elf_phdrs[i];
+
+        if (phdr->p_type != PT_LOAD)
+            continue;
+
+        if (seg->kbase)
+            error = __dynlib_map_shared_segment(seg, phdr, proc);
+        else
+            error = _elf_load_segment(image, phdr);
+
+        if (error)
+            return error;
+    }
+
+    return 0;
+}
+
+void dynlib_cache_get_info(dynldr_cache_info_t* info)
+{
+    dynlib_image_t* dimage;
+
+    memset(info, 0, sizeof(*info));
+
+    mutex_lock(_dynlib_cache_lock);
+
+    FOREACH(i, _dynlib_cache)
+    {
+        dimage = i->data;
+
+        info->nr_images++;
+        info->nr_shared_pages += dimage->nr_shared_pages;
+    }
+
+    info->nr_hits = _dynlib_cache_hits;
+
+    mutex_unlock(_dynlib_cache_lock);
+
+    info->nr_used_pages = kmem_phys_get_used_bytecount() >> PAGE_SHIFT;
+}
+
+kerror_t init_dynlib_cache()
+{
+    _dynlib_cache = init_list();
+    _dynlib_cache_lock = create_mutex(NULL);
+    _dynlib_window_next = DYNLIB_WINDOW_BASE;
+    _dynlib_cache_hits = 0;
+
+    if (!_dynlib_cache || !_dynlib_cache_lock)
+        return -KERR_NOMEM;
+
+    return 0;
+}
+
+/*!
+ * @brief: Drop every image in the cache
+ *
+ * Only call this once there are no more loaded apps
+ */
+void destroy_dynlib_cache()
+{
+    FOREACH(i, _dynlib_cache)
+    {
+        __destroy_dynlib_image(i->data);
+    }
+
+    destroy_list(_dynlib_cache);
+    destroy_mutex(_dynlib_cache_lock);
+}
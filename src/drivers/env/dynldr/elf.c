@@ -71,31 +71,50 @@ static inline void* _elf_get_shdr_kaddr(elf_image_t* image, struct elf64_shdr* h
 }
 
 /*!
- * @brief: Itterate the program headers and load shit we need
+ * @brief: Translate a virtual address inside @image to its spot in the kernel buffer of the file
  *
- * This MUST be the first opperation done on an ELF image after we've got the pheaders
- * NOTE: We assume PT_INTERP is correct
+ * Lets us read the parts of the image that come straight from the file, without it needing
+ * to be mapped anywhere
  */
-kerror_t _elf_load_phdrs(elf_image_t* image)
+static inline void* _elf_get_vaddr_kaddr(elf_image_t* image, vaddr_t vaddr)
+{
+    struct elf64_phdr* phdr;
+
+    for (uint32_t i = 0; i < image->elf_hdr->e_phnum; i++) {
+        phdr = &image->elf_phdrs[i];
+
+        if (phdr->p_type != PT_LOAD)
+            continue;
+
+        if (vaddr < phdr->p_vaddr || vaddr >= phdr->p_vaddr + phdr->p_filesz)
+            continue;
+
+        return image->kernel_image + phdr->p_offset + (vaddr - phdr->p_vaddr);
+    }
+
+    return nullptr;
+}
+
+/*!
+ * @brief: Find the size of the image and its dynamic table
+ *
+ * Does not touch the address space of the image, so this may be called on images that don't
+ * have a process (yet)
+ */
+kerror_t _elf_scan_phdrs(elf_image_t* image)
 {
-    proc_t* proc;
     size_t user_high;
     size_t user_low;
-    page_range_t range;
     struct elf64_hdr* hdr;
-    struct elf64_phdr* phdr_list;
     struct elf64_phdr* c_phdr;
 
-    proc = image->proc;
     hdr = image->elf_hdr;
-    phdr_list = image->elf_phdrs;
 
     user_high = NULL;
     user_low = (u64)-1;
 
-    /* First, we calculate the size of this image */
     for (uint32_t i = 0; i < hdr->e_phnum; i++) {
-        c_phdr = &phdr_list[i];
+        c_phdr = &image->elf_phdrs[i];
 
         switch (c_phdr->p_type) {
         case PT_LOAD:
@@ -105,15 +124,76 @@ kerror_t _elf_load_phdrs(elf_image_t* image)
             if (c_phdr->p_memsz + c_phdr->p_vaddr > user_high)
                 user_high = c_phdr->p_memsz + c_phdr->p_vaddr;
             break;
+        case PT_DYNAMIC:
+            /* We only ever read this table, so take it from the file */
+            image->elf_dyntbl_mapsize = ALIGN_UP(c_phdr->p_memsz, SMALL_PAGE_SIZE);
+            image->elf_dyntbl = image->kernel_image + c_phdr->p_offset;
+            break;
         }
     }
 
     /* Would be weird if we have a reverse image or sm like that? */
-    ASSERT(user_high > user_low);
+    if (user_high <= user_low)
+        return -KERR_INVAL;
 
     /* Simple delta */
     image->user_image_size = ALIGN_UP(user_high - user_low, SMALL_PAGE_SIZE);
 
+    return 0;
+}
+
+/*!
+ * @brief: Give a loadable segment of @image private memory inside its process and copy it in
+ */
+kerror_t _elf_load_segment(elf_image_t* image, struct elf64_phdr* phdr)
+{
+    kerror_t error;
+    vaddr_t v_user_phdr_start;
+    vaddr_t virtual_phdr_base = (vaddr_t)image->user_base + phdr->p_vaddr;
+    size_t phdr_size = phdr->p_memsz;
+
+    error = kmem_user_alloc_scattered(
+        (void**)&v_user_phdr_start,
+        image->proc,
+        virtual_phdr_base,
+        phdr_size,
+        KMEM_CUSTOMFLAG_GET_MAKE | KMEM_CUSTOMFLAG_CREATE_USER | KMEM_CUSTOMFLAG_NO_REMAP,
+        KMEM_FLAG_WRITABLE);
+
+    if (error)
+        return error;
+
+    //KLOG_DBG("Allocated %lld bytes at 0x%llx (base=0x%llx)\n", phdr_size, v_user_phdr_start, phdr->p_vaddr);
+
+    /* Then, zero the rest of the buffer. This also takes care of any NOBITS sections */
+    memset((void*)(v_user_phdr_start), 0, phdr_size);
+
+    /*
+     * Copy elf into the mapped area
+     */
+    memcpy((void*)v_user_phdr_start, image->kernel_image + phdr->p_offset,
+        MIN(phdr_size, phdr->p_filesz));
+
+    return 0;
+}
+
+/*!
+ * @brief: Itterate the program headers and load shit we need
+ *
+ * This MUST be the first opperation done on an ELF image after we've got the pheaders
+ * NOTE: We assume PT_INTERP is correct
+ */
+kerror_t _elf_load_phdrs(elf_image_t* image)
+{
+    kerror_t error;
+    page_range_t range;
+    struct elf64_phdr* c_phdr;
+
+    error = _elf_scan_phdrs(image);
+
+    if (error)
+        return error;
+
     /* With this we can find the user base */
     ASSERT(page_tracker_find_fitting_range(&image->proc->m_virtual_tracker, NULL, kmem_get_page_idx(image->user_image_size), &range) == 0);
 
@@ -125,45 +205,16 @@ kerror_t _elf_load_phdrs(elf_image_t* image)
     KLOG_DBG("Found elf image user base: 0x%p (size=%lld bytes)\n", image->user_base, image->user_image_size);
 
     /* Now we can actually start to load the headers */
-    for (uint32_t i = 0; i < hdr->e_phnum; i++) {
-        c_phdr = &phdr_list[i];
+    for (uint32_t i = 0; i < image->elf_hdr->e_phnum; i++) {
+        c_phdr = &image->elf_phdrs[i];
 
-        switch (c_phdr->p_type) {
-        case PT_LOAD: {
-            vaddr_t v_user_phdr_start;
-            vaddr_t virtual_phdr_base = (vaddr_t)image->user_base + c_phdr->p_vaddr;
-            size_t phdr_size = c_phdr->p_memsz;
-
-            ASSERT(kmem_user_alloc_scattered(
-                       (void**)&v_user_phdr_start,
-                       proc,
-                       virtual_phdr_base,
-                       phdr_size,
-                       KMEM_CUSTOMFLAG_GET_MAKE | KMEM_CUSTOMFLAG_CREATE_USER | KMEM_CUSTOMFLAG_NO_REMAP,
-                       KMEM_FLAG_WRITABLE)
-                == 0);
-
-            //KLOG_DBG("Allocated %lld bytes at 0x%llx (base=0x%llx)\n", phdr_size, v_user_phdr_start, c_phdr->p_vaddr);
-
-            /* Then, zero the rest of the buffer */
-            /* TODO: ??? */
-            memset((void*)(v_user_phdr_start), 0, phdr_size);
+        if (c_phdr->p_type != PT_LOAD)
+            continue;
 
-            /*
-             * Copy elf into the mapped area
-             */
-            memcpy((void*)v_user_phdr_start, image->kernel_image + c_phdr->p_offset,
-                MIN(phdr_size, c_phdr->p_filesz));
-        } break;
-        case PT_DYNAMIC:
-            /* Remap to the kernel */
-            image->elf_dyntbl_mapsize = ALIGN_UP(c_phdr->p_memsz, SMALL_PAGE_SIZE);
-            image->elf_dyntbl = image->user_base + c_phdr->p_vaddr;
-            //ASSERT(kmem_get_kernel_address((vaddr_t*)&image->elf_dyntbl, (vaddr_t)image->user_base + c_phdr->p_vaddr, proc->m_root_pd.m_root) == 0);
+        error = _elf_load_segment(image, c_phdr);
 
-            // printf("Setting PT_DYNAMIC addr=0x%p size=0x%llx\n", image->elf_dyntbl, image->elf_dyntbl_mapsize);
-            break;
-        }
+        if (error)
+            return error;
     }
 
     /* Suck my dick */
@@ -173,14 +224,17 @@ kerror_t _elf_load_phdrs(elf_image_t* image)
 /*!
  * @brief: Do preperations on the ELF section headers
  *
- * 1) Fix header offset and ensure backing ram
+ * 1) Fix header offsets
  * 2) Cache certain interesting tables
  */
 kerror_t _elf_do_headers(elf_image_t* image)
 {
     struct elf64_shdr* shdr;
 
-    /* First pass: Fix all the addresses of the section headers */
+    /*
+     * First pass: Fix all the addresses of the section headers
+     * NOTE: NOBITS sections are part of the loadable segments, which get zeroed when they're loaded
+     */
     for (uint32_t i = 0; i < image->elf_hdr->e_shnum; i++) {
         shdr = elf_get_shdr(image->elf_hdr, i);
 
@@ -189,16 +243,6 @@ kerror_t _elf_do_headers(elf_image_t* image)
 
         /* Add this thing */
         shdr->sh_addr += (uint64_t)image->user_base;
-
-        switch (shdr->sh_type) {
-        case SHT_NOBITS:
-            if (!shdr->sh_size)
-                break;
-
-            /* NOBITS sections should be included in the pheaders. Just clear them */
-            memset((void*)shdr->sh_addr, 0, shdr->sh_size);
-            break;
-        }
     }
 
     image->elf_symtbl_hdr = nullptr;
@@ -239,9 +283,16 @@ kerror_t _elf_do_headers(elf_image_t* image)
     return 0;
 }
 
+/*!
+ * @brief: Walk a symbol table and collect the symbols it defines
+ *
+ * The table itself is left alone, since it might be shared with other processes. When @app is given,
+ * we also count the uses of the symbols this table needs from the rest of the app
+ */
 static inline kerror_t __elf_parse_symbol_table(loaded_app_t* app, list_t* symlist, hashmap_t* symmap, elf_image_t* image, struct elf64_sym* symtable, size_t sym_count, const char* strtab)
 {
     loaded_sym_t* sym;
+    vaddr_t sym_value;
 
     /* Grab the start of the symbol table */
     struct elf64_sym* sym_table_start = symtable;
@@ -255,12 +306,16 @@ static inline kerror_t __elf_parse_symbol_table(loaded_app_t* app, list_t* symli
         /* Debug print lmao */
         //KLOG_DBG("Found a symbol (\'%s\'). addr=0x%llx (user_base=0x%p)\n", sym_name, current_symbol->st_value, image->user_base);
 
-        current_symbol->st_value += (vaddr_t)image->user_base;
+        sym_value = current_symbol->st_value + (vaddr_t)image->user_base;
 
         switch (current_symbol->st_shndx) {
         case SHN_UNDEF:
             // printf("Resolving: %s\n", sym_name);
 
+            /* Cached library images get parsed without an app */
+            if (!app)
+                break;
+
             /*
              * Need to look for this symbol in an earlier loaded binary =/
              */
@@ -269,7 +324,6 @@ static inline kerror_t __elf_parse_symbol_table(loaded_app_t* app, list_t* symli
             if (!sym)
                 break;
 
-            current_symbol->st_value = sym->uaddr;
             sym->usecount++;
             break;
         default:
@@ -290,7 +344,7 @@ static inline kerror_t __elf_parse_symbol_table(loaded_app_t* app, list_t* symli
             memset(sym, 0, sizeof(*sym));
 
             sym->name = sym_name;
-            sym->uaddr = current_symbol->st_value;
+            sym->uaddr = sym_value;
 
             if (type == STT_FUNC)
                 sym->flags |= LDSYM_FLAG_EXPORT;
@@ -348,7 +402,7 @@ kerror_t _elf_do_symbols(list_t* symbol_list, hashmap_t* exported_symbol_map, lo
 
         switch (shdr->sh_type) {
         case SHT_REL:
-            rel = (struct elf64_rel*)shdr->sh_addr;
+            rel = (struct elf64_rel*)_elf_get_shdr_kaddr(image, shdr);
 
             /* Calculate the table size */
             entry_count = shdr->sh_size / sizeof(*rel);
@@ -371,7 +425,7 @@ kerror_t _elf_do_symbols(list_t* symbol_list, hashmap_t* exported_symbol_map, lo
             }
             break;
         case SHT_RELA:
-            rela = (struct elf64_rela*)shdr->sh_addr;
+            rela = (struct elf64_rela*)_elf_get_shdr_kaddr(image, shdr);
 
             /* Calculate the table size */
             entry_count = shdr->sh_size / sizeof(*rela);
@@ -401,7 +455,10 @@ kerror_t _elf_do_symbols(list_t* symbol_list, hashmap_t* exported_symbol_map, lo
     return 0;
 }
 
-static kerror_t __elf_get_dynsect_info(elf_image_t* image)
+/*!
+ * @brief: Collect information about what is inside the dynamic section of @image
+ */
+kerror_t _elf_load_dyn_info(elf_image_t* image)
 {
     Elf64_Word* _elf_dynsym_count_p;
     char* strtab;
@@ -418,19 +475,18 @@ static kerror_t __elf_get_dynsect_info(elf_image_t* image)
         /* First look for anything that isn't the DT_NEEDED type */
         switch (dyns_entry->d_tag) {
         case DT_STRTAB:
-            /* We can do this, since we have assured a kernel mapping through loading this pheader beforehand */
-            //ASSERT(kmem_get_kernel_address((vaddr_t*)&strtab, (vaddr_t)image->user_base + dyns_entry->d_un.d_ptr, image->proc->m_root_pd.m_root) == 0);
-            strtab = image->user_base + dyns_entry->d_un.d_ptr;
+            /* These tables come straight from the file, so we can read them from the kernel buffer */
+            strtab = _elf_get_vaddr_kaddr(image, dyns_entry->d_un.d_ptr);
             break;
         case DT_SYMTAB:
-            //ASSERT(kmem_get_kernel_address((vaddr_t*)&dyn_syms, (vaddr_t)image->user_base + dyns_entry->d_un.d_ptr, image->proc->m_root_pd.m_root) == 0);
-            dyn_syms = image->user_base + dyns_entry->d_un.d_ptr;
+            dyn_syms = _elf_get_vaddr_kaddr(image, dyns_entry->d_un.d_ptr);
             break;
         case DT_HASH:
-            // image->elf_dynsym_count = ((Elf64_Word*)(Must(kmem_get_kernel_address((vaddr_t)image->user_base + dyns_entry->d_un.d_ptr, image->proc->m_root_pd.m_root))))[1];
             /* Get the address */
-            //ASSERT(kmem_get_kernel_address((uint64_t*)&_elf_dynsym_count_p, (vaddr_t)image->user_base + dyns_entry->d_un.d_ptr, image->proc->m_root_pd.m_root) == 0);
-            _elf_dynsym_count_p = image->user_base + dyns_entry->d_un.d_ptr;
+            _elf_dynsym_count_p = _elf_get_vaddr_kaddr(image, dyns_entry->d_un.d_ptr);
+
+            if (!_elf_dynsym_count_p)
+                break;
 
             /* Yoink the value */
             image->elf_dynsym_tblsz = _elf_dynsym_count_p[1];
@@ -457,7 +513,12 @@ static kerror_t __elf_get_dynsect_info(elf_image_t* image)
     return KERR_NONE;
 }
 
-static kerror_t __elf_process_dynsect_info(elf_image_t* image, loaded_app_t* app)
+/*!
+ * @brief: Load the libraries @image needs into @app
+ *
+ * Needs the info from _elf_load_dyn_info
+ */
+kerror_t _elf_load_dyn_needed(elf_image_t* image, loaded_app_t* app)
 {
     kerror_t error;
     struct elf64_dyn* dyns_entry;
@@ -499,13 +560,13 @@ kerror_t _elf_load_dyn_sections(elf_image_t* image, loaded_app_t* app)
         return -KERR_INVAL;
 
     /* Gather info on the dynamic part of this image */
-    error = __elf_get_dynsect_info(image);
+    error = _elf_load_dyn_info(image);
 
     if (error)
         return error;
 
     /* Do meaningful shit */
-    return __elf_process_dynsect_info(image, app);
+    return _elf_load_dyn_needed(image, app);
 }
 
 /*!
@@ -25,7 +25,7 @@
  * should be independent of wether the ELF stuff is part of the loaded app or simply a supporting library.
  */
 
-static dynamic_library_t* _create_dynamic_lib(loaded_app_t* parent, const char* name, const char* path)
+static dynamic_library_t* _create_dynamic_lib(loaded_app_t* parent, const char* name, const char* path, dynlib_image_t* cached)
 {
     dynamic_library_t* ret;
 
@@ -39,25 +39,22 @@ static dynamic_library_t* _create_dynamic_lib(loaded_app_t* parent, const char*
     ret->app = parent;
     ret->name = strdup(name);
     ret->path = strdup(path);
-    ret->symbol_map = create_hashmap(0x1000, HASHMAP_FLAG_SK);
-    ret->symbol_list = init_list();
+    ret->cached = cached;
+    ret->symbol_map = cached->symbol_map;
+    ret->symbol_list = cached->symbol_list;
 
     return ret;
 }
 
+/*!
+ * @brief: Free @lib
+ *
+ * The image buffers and the symbols belong to the library cache, so we only drop our reference
+ * to them. The mappings inside the process get cleaned up with the process itself
+ */
 static void _destroy_dynamic_lib(dynamic_library_t* lib)
 {
-    destroy_elf_image(&lib->image);
-
-    FOREACH(n, lib->symbol_list)
-    {
-        loaded_sym_t* sym = n->data;
-
-        kzfree(sym, sizeof(*sym));
-    }
-
-    destroy_hashmap(lib->symbol_map);
-    destroy_list(lib->symbol_list);
+    dynlib_cache_put(lib->cached);
 
     kfree((void*)lib->name);
     kfree((void*)lib->path);
@@ -65,12 +62,16 @@ static void _destroy_dynamic_lib(dynamic_library_t* lib)
 }
 
 /*!
- * @brief: Load the complete image of a dynamic library
+ * @brief: Map the cached image of a dynamic library and get it ready to run
+ *
+ * Everything that is the same for every process (symbols, read-only segments) comes from the
+ * library cache. What's left for us is to load the dependencies and to relocate the private
+ * segments of the library
  *
  * NOTE: This may be called from some process A as an affector on some other process B. This
  * means we need to temporarily switch to the addresspace of process B in order to load this library
  */
-static kerror_t _dynlib_load_image(file_t* file, dynamic_library_t* lib)
+static kerror_t _dynlib_load_image(dynamic_library_t* lib)
 {
     proc_t *c_proc, *app_proc;
     page_dir_t prev_pdir;
@@ -91,28 +92,13 @@ static kerror_t _dynlib_load_image(file_t* file, dynamic_library_t* lib)
     kmem_set_addrspace_ex(&app_proc->m_root_pd, c_proc);
 
     /* Bring the image into memory */
-    error = load_elf_image(&lib->image, app_proc, file);
-
-    if (!KERR_OK(error))
-        goto switch_back_and_exit;
-
-    error = _elf_load_phdrs(&lib->image);
-
-    if (!KERR_OK(error))
-        goto switch_back_and_exit;
-
-    error = _elf_do_headers(&lib->image);
+    error = dynlib_image_map(lib->cached, app_proc, &lib->image);
 
     if (!KERR_OK(error))
         goto switch_back_and_exit;
 
     /* Might load more libraries */
-    error = _elf_load_dyn_sections(&lib->image, lib->app);
-
-    if (!KERR_OK(error))
-        goto switch_back_and_exit;
-
-    error = _elf_do_symbols(lib->symbol_list, lib->symbol_map, lib->app, &lib->image);
+    error = _elf_load_dyn_needed(&lib->image, lib->app);
 
     if (!KERR_OK(error))
         goto switch_back_and_exit;
@@ -177,15 +163,15 @@ static inline bool app_check_lib(loaded_app_t* app, const char* path)
 /*!
  * @brief: Load a dynamic library from a file into a target app
  *
- * Copies the image into the apps address space and resolves the symbols, after
- * we've loaded the dependencies for this library
+ * Maps the cached image of the library into the apps address space and relocates it,
+ * after we've loaded the dependencies for this library
  */
 kerror_t load_dynamic_lib(const char* path, struct loaded_app* target_app, dynamic_library_t** blib)
 {
     kerror_t error;
     const char* search_path;
     const char* search_dir;
-    file_t* lib_file;
+    dynlib_image_t* cached;
     dynamic_library_t* lib;
     sysvar_t* libs_var;
 
@@ -213,33 +199,33 @@ kerror_t load_dynamic_lib(const char* path, struct loaded_app* target_app, dynam
     if (!search_path)
         return -KERR_NOMEM;
 
+    /* Grab the image from the cache. This reads the file if nobody has loaded this library yet */
+    error = dynlib_cache_get(search_path, &cached);
+
+    if (error) {
+        kfree((void*)search_path);
+        return error;
+    }
+
     KLOG_DBG("Creating lib structure...\n");
 
     /* First, try to create a library object */
-    lib = _create_dynamic_lib(target_app, path, search_path);
+    lib = _create_dynamic_lib(target_app, path, search_path, cached);
 
     kfree((void*)search_path);
 
-    if (!lib)
+    if (!lib) {
+        dynlib_cache_put(cached);
         return -KERR_INVAL;
+    }
 
-    KLOG_DBG("Adding and opening %s...\n", lib->path);
+    KLOG_DBG("Trying to load dynamic library %s\n", lib->path);
 
     /* Register ourselves preemptively to the app */
     list_append(target_app->unordered_liblist, lib);
 
-    /* Then try to open the target file */
-    lib_file = file_open(lib->path);
-
-    if (!lib_file)
-        goto dealloc_and_exit;
-
-    KLOG_DBG("Trying to load dynamic library %s\n", lib_file->m_obj->name);
-
     /* Get the image loaded */
-    error = _dynlib_load_image(lib_file, lib);
-
-    file_close(lib_file);
+    error = _dynlib_load_image(lib);
 
     if (error)
         goto dealloc_and_exit;
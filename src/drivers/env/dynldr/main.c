@@ -129,6 +129,8 @@ static int _loader_init()
     _loaded_apps = init_list();
     _dynld_lock = create_mutex(NULL);
 
+    ASSERT(KERR_OK(init_dynlib_cache()));
+
     ASSERT(KERR_OK(kevent_add_hook("proc", DYN_LDR_NAME, _dyn_loader_proc_hook, NULL)));
     return 0;
 }
@@ -153,6 +155,9 @@ static int _loader_exit()
 
     destroy_list(_loaded_apps);
     destroy_mutex(_dynld_lock);
+
+    /* Only safe now that every app is gone */
+    destroy_dynlib_cache();
     return 0;
 }
 
@@ -376,6 +381,12 @@ static uint64_t _loader_msg(aniva_driver_t* driver, dcc_t code, void* in_buf, si
 
         break;
     }
+    case DYN_LDR_GET_CACHE_INFO:
+        if (!in_buf || in_bsize != sizeof(dynldr_cache_info_t))
+            return DRV_STAT_INVAL;
+
+        dynlib_cache_get_info(in_buf);
+        break;
     default:
         return DRV_STAT_INVAL;
     }
@@ -47,6 +47,63 @@ typedef struct elf_image {
 extern kerror_t load_elf_image(elf_image_t* image, struct proc* proc, file_t* file);
 extern void destroy_elf_image(elf_image_t* image);
 
+/*
+ * Libraries get mapped at a fixed spot in this window, which is the same in every process. Apps
+ * and the rest of userspace get placed from the bottom of the addressspace up, so they never get here
+ */
+#define DYNLIB_WINDOW_BASE 0x00007f0000000000ULL
+#define DYNLIB_WINDOW_END 0x00007ff000000000ULL
+
+/*
+ * A segment of a cached library that is shared between processes
+ */
+typedef struct dynlib_segment {
+    /* Kernel mapping of the pages. NULL if this segment gets a private copy */
+    void* kbase;
+    paddr_t phys;
+    /* Page aligned user address of the segment */
+    vaddr_t ubase;
+    size_t nr_pages;
+} dynlib_segment_t;
+
+/*
+ * A library image inside the library cache
+ *
+ * Everything about a library that is the same in every process that uses it: the file, the address
+ * it gets mapped at, the pages of its read-only segments and its symbols. These stay in the cache
+ * after their last user goes away, so launching the same app again doesn't need to touch the file
+ */
+typedef struct dynlib_image {
+    const char* path;
+
+    /* Template for the images of the libraries. Only the cache owns the buffers in here */
+    elf_image_t image;
+
+    /* One entry for every program header */
+    dynlib_segment_t* segments;
+
+    hashmap_t* symbol_map;
+    list_t* symbol_list;
+
+    size_t nr_shared_pages;
+
+    /* The file we got read from. Only compared against, to see if the library got replaced */
+    struct oss_obj* file_obj;
+    size_t file_size;
+
+    /* Libraries that use this image. A stale image is out of the cache and goes with its last user */
+    u32 nr_users;
+    bool stale;
+} dynlib_image_t;
+
+extern kerror_t init_dynlib_cache();
+extern void destroy_dynlib_cache();
+
+extern kerror_t dynlib_cache_get(const char* path, dynlib_image_t** p_image);
+extern void dynlib_cache_put(dynlib_image_t* dimage);
+extern kerror_t dynlib_image_map(dynlib_image_t* dimage, struct proc* proc, elf_image_t* image);
+extern void dynlib_cache_get_info(dynldr_cache_info_t* info);
+
 /*
  * A dynamic library that has been loaded as support for a dynamic app
  */
@@ -55,9 +112,12 @@ typedef struct dynamic_library {
     const char* path;
 
     elf_image_t image;
+    /* The cached image we got mapped from */
+    dynlib_image_t* cached;
 
     /* Reference the loaded app to get access to environment info */
     struct loaded_app* app;
+    /* NOTE: These are owned by the cached image */
     hashmap_t* symbol_map;
     list_t* symbol_list;
     thread_t* lib_wait_thread;
@@ -123,6 +183,8 @@ extern struct loaded_sym* loaded_app_find_symbol_by_addr(loaded_app_t* app, void
 
 extern kerror_t loaded_app_set_entry_tramp(loaded_app_t* app);
 
+extern kerror_t _elf_scan_phdrs(elf_image_t* image);
+extern kerror_t _elf_load_segment(elf_image_t* image, struct elf64_phdr* phdr);
 extern kerror_t _elf_load_phdrs(elf_image_t* image);
 extern kerror_t _elf_do_headers(elf_image_t* image);
 extern kerror_t _elf_do_relocations(elf_image_t* image, loaded_app_t* app);
@@ -134,6 +196,8 @@ extern kerror_t _elf_do_relocations(elf_image_t* image, loaded_app_t* app);
  * FIXME: Make this independant of this crap?
  */
 extern kerror_t _elf_load_dyn_sections(elf_image_t* image, loaded_app_t* app);
+extern kerror_t _elf_load_dyn_info(elf_image_t* image);
+extern kerror_t _elf_load_dyn_needed(elf_image_t* image, loaded_app_t* app);
 extern kerror_t _elf_do_symbols(list_t* symbol_list, hashmap_t* exported_symbol_map, loaded_app_t* app, elf_image_t* image);
 
 #define LDSYM_FLAG_IS_CPY 0x00000001
@@ -36,6 +36,8 @@
 #include "exec.h"
 #include "system/profile/profile.h"
 #include "system/sysvar/var.h"
+#include "system/asm_specifics.h"
+#include "time/core.h"
 
 #define KTERM_MAX_BUFFER_SIZE 512
 #define KTERM_KEYBUFFER_CAPACITY 512
@@ -49,6 +51,12 @@
 
 #define KTERM_MAX_BOX_COUNT 32
 
+/* Our chars only have 7 bits */
+#define KTERM_GLYPH_COUNT 128
+/* How many foreground/background pairs we keep rasterized glyphs for */
+#define KTERM_GLYPH_CACHE_SLOTS 4
+#define KTERM_GLYPH_PIXELS (KTERM_FONT_WIDTH * KTERM_FONT_HEIGHT)
+
 enum KTERM_BASE_CLR {
     BASE_CLR_RED = 0,
     BASE_CLR_YELLOW,
@@ -77,6 +85,24 @@ struct kterm_terminal_char {
     uint8_t ch : 7;
 };
 
+/*
+ * Glyphs of the font, rasterized for a single foreground/background pair
+ *
+ * Glyphs get rasterized the first time they are drawn in these colors, after which
+ * drawing them is just a copy of KTERM_FONT_HEIGHT rows into the framebuffer
+ */
+struct kterm_glyph_cache_slot {
+    uint32_t fg;
+    uint32_t bg;
+    /* Last time this slot was used, for eviction */
+    uint32_t stamp;
+    bool valid;
+    /* Bitmap of the glyphs that have been rasterized */
+    uint64_t rasterized[KTERM_GLYPH_COUNT / 64];
+    /* KTERM_GLYPH_COUNT glyphs of KTERM_GLYPH_PIXELS pixels each */
+    uint32_t* pixels;
+};
+
 /*
  * This is only accessed when mode is KTERM_MODE_GRAPHICS
  */
@@ -126,6 +152,10 @@ static uint32_t _chars_cursor_y;
 static uint32_t _current_color_idx;
 static uint32_t _current_background_idx;
 static aniva_font_t* _kterm_font;
+static struct kterm_glyph_cache_slot _glyph_cache[KTERM_GLYPH_CACHE_SLOTS];
+static uint32_t _glyph_cache_stamp;
+/* Number of characters on the screen that don't scroll */
+static uint32_t _nr_no_scroll_chars;
 
 static const char* _old_dflt_lwnd_path_value;
 
@@ -193,6 +223,8 @@ static void kterm_enable_newline_tag();
 static void kterm_disable_newline_tag();
 static const char* kterm_get_buffer_contents();
 static void kterm_scroll(uintptr_t lines);
+static void kterm_scroll_chars(uintptr_t lines);
+static void kterm_scroll_blit(uintptr_t lines);
 
 logger_t kterm_logger = {
     .title = "kterm",
@@ -253,35 +285,118 @@ static inline void kterm_clear_raw()
 }
 
 /*!
- * @brief: Update a single char on the screen
+ * @brief: Check if we can put pixels on the screen with plain copies
  *
- * TODO: Check if char_start is aligned and @count times inside the char buffer
+ * The glyph cache stores 32-bit pixels, so anything else goes pixel by pixel
  */
-static inline void kterm_update_term_char(struct kterm_terminal_char* char_start, uint32_t count)
+static inline bool kterm_can_blit()
+{
+    return (_kterm_vdev && _kterm_fb_bpp == 32 && _glyph_cache[0].pixels);
+}
+
+static void kterm_init_glyph_cache()
+{
+    uint32_t* pixels;
+    const size_t slot_size = KTERM_GLYPH_COUNT * KTERM_GLYPH_PIXELS * sizeof(uint32_t);
+
+    /* Not fatal, we'll just have to draw pixel by pixel */
+    if (kmem_kernel_alloc_range((void**)&pixels, KTERM_GLYPH_CACHE_SLOTS * slot_size, NULL, KMEM_FLAG_KERNEL | KMEM_FLAG_WRITABLE))
+        return;
+
+    for (uint32_t i = 0; i < KTERM_GLYPH_CACHE_SLOTS; i++) {
+        memset(&_glyph_cache[i], 0, sizeof(_glyph_cache[i]));
+
+        _glyph_cache[i].pixels = (uint32_t*)((uintptr_t)pixels + i * slot_size);
+    }
+}
+
+/*!
+ * @brief: Find the cache slot for @fg and @bg
+ *
+ * Recycles the least recently used slot if these colors don't have one yet
+ */
+static struct kterm_glyph_cache_slot* kterm_get_glyph_cache_slot(uint32_t fg, uint32_t bg)
+{
+    struct kterm_glyph_cache_slot* slot;
+    struct kterm_glyph_cache_slot* victim;
+
+    victim = &_glyph_cache[0];
+
+    for (uint32_t i = 0; i < KTERM_GLYPH_CACHE_SLOTS; i++) {
+        slot = &_glyph_cache[i];
+
+        if (slot->valid && slot->fg == fg && slot->bg == bg)
+            goto found;
+
+        if (!slot->valid || (victim->valid && slot->stamp < victim->stamp))
+            victim = slot;
+    }
+
+    slot = victim;
+
+    slot->fg = fg;
+    slot->bg = bg;
+    slot->valid = true;
+    memset(slot->rasterized, 0, sizeof(slot->rasterized));
+
+found:
+    slot->stamp = ++_glyph_cache_stamp;
+    return slot;
+}
+
+/*!
+ * @brief: Get the pixels of @c in the colors of @slot
+ */
+static inline uint32_t* kterm_get_cached_glyph(struct kterm_glyph_cache_slot* slot, uint8_t c)
+{
+    uint8_t* glyph;
+    uint32_t* pixels;
+
+    c &= (KTERM_GLYPH_COUNT - 1);
+    pixels = &slot->pixels[c * KTERM_GLYPH_PIXELS];
+
+    if ((slot->rasterized[c >> 6] & (1ULL << (c & 63))) != 0)
+        return pixels;
+
+    (void)get_glyph_for_char(_kterm_font, c, &glyph);
+
+    for (uint32_t y = 0; y < KTERM_FONT_HEIGHT; y++)
+        for (uint32_t x = 0; x < KTERM_FONT_WIDTH; x++)
+            pixels[y * KTERM_FONT_WIDTH + x] = (glyph[y] & (1 << x)) ? slot->fg : slot->bg;
+
+    slot->rasterized[c >> 6] |= (1ULL << (c & 63));
+    return pixels;
+}
+
+static inline void kterm_get_term_char_pos(struct kterm_terminal_char* term_chr, uint32_t* x, uint32_t* y)
+{
+    uintptr_t offset = ((uintptr_t)term_chr - (uintptr_t)_characters) / sizeof(*term_chr);
+
+    *x = (offset % _chars_xres) * KTERM_FONT_WIDTH;
+    *y = (offset / _chars_xres) * KTERM_FONT_HEIGHT;
+}
+
+/*!
+ * @brief: Draw @count chars, starting at @char_start, one pixel at a time
+ *
+ * Used when the framebuffer format doesn't allow copying cached glyphs
+ */
+static void kterm_update_term_char_pixels(struct kterm_terminal_char* char_start, uint32_t count)
 {
     uint8_t* glyph;
-    /* x and y components inside the screen */
-    uintptr_t offset;
     uint32_t color;
     uint32_t background_clr;
     uint32_t x;
     uint32_t y;
 
-    if (!count)
-        return;
-
     /* Find the background color */
     background_clr = kterm_color_for_pallet_idx(_current_background_idx);
 
-    /* Calculate the offset of the starting character */
-    offset = ((uintptr_t)char_start - (uintptr_t)_characters) / sizeof(*char_start);
-
-    do {
+    for (; count; count--, char_start++) {
         /* Grab our font */
         (void)get_glyph_for_char(_kterm_font, char_start->ch, &glyph);
 
-        x = (offset % _chars_xres) * KTERM_FONT_WIDTH;
-        y = (ALIGN_DOWN(offset, _chars_xres) / _chars_xres) * KTERM_FONT_HEIGHT;
+        kterm_get_term_char_pos(char_start, &x, &y);
 
         color = kterm_color_for_pallet_idx(char_start->pallet_idx);
 
@@ -290,16 +405,63 @@ static inline void kterm_update_term_char(struct kterm_terminal_char* char_start
 
                 if (glyph[_y] & (1 << _x))
                     kterm_draw_pixel_raw(x + _x, y + _y, color);
-                /* TODO: draw a background color */
                 else
                     kterm_draw_pixel_raw(x + _x, y + _y, background_clr);
             }
         }
+    }
+}
 
-        count--;
-        char_start++;
-        offset++;
-    } while (count);
+/*!
+ * @brief: Update a range of chars on the screen
+ *
+ * Copies the rasterized glyphs into the framebuffer a row at a time
+ * TODO: Check if char_start is aligned and @count times inside the char buffer
+ */
+static inline void kterm_update_term_char(struct kterm_terminal_char* char_start, uint32_t count)
+{
+    uint32_t* glyph;
+    uint32_t color;
+    uint32_t background_clr;
+    uint32_t x;
+    uint32_t y;
+    uint8_t last_pallet_idx;
+    void* dst;
+    struct kterm_glyph_cache_slot* slot;
+
+    if (!count)
+        return;
+
+    if (!kterm_can_blit())
+        return kterm_update_term_char_pixels(char_start, count);
+
+    /* Find the background color */
+    background_clr = kterm_color_for_pallet_idx(_current_background_idx);
+
+    slot = nullptr;
+    last_pallet_idx = 0;
+
+    for (; count; count--, char_start++) {
+        kterm_get_term_char_pos(char_start, &x, &y);
+
+        if (x + KTERM_FONT_WIDTH > _kterm_fb_width || y + KTERM_FONT_HEIGHT > _kterm_fb_height)
+            continue;
+
+        /* Runs of chars in the same color are common, only look for a new slot when it changes */
+        if (!slot || char_start->pallet_idx != last_pallet_idx) {
+            color = kterm_color_for_pallet_idx(char_start->pallet_idx);
+            slot = kterm_get_glyph_cache_slot(color, background_clr);
+            last_pallet_idx = char_start->pallet_idx;
+        }
+
+        glyph = kterm_get_cached_glyph(slot, char_start->ch);
+        dst = (void*)(KTERM_FB_ADDR + _kterm_fb_pitch * y + x * sizeof(uint32_t));
+
+        for (uint32_t _y = 0; _y < KTERM_FONT_HEIGHT; _y++) {
+            memcpy(dst, &glyph[_y * KTERM_FONT_WIDTH], KTERM_FONT_WIDTH * sizeof(uint32_t));
+            dst += _kterm_fb_pitch;
+        }
+    }
 }
 
 /*!
@@ -460,6 +622,108 @@ static uint32_t kterm_cmd_palletinfo(const char** argv, size_t argc)
     return 0;
 }
 
+/*!
+ * @brief: Fill the screen with text for the benchmarks
+ */
+static void _gfxbench_fill_screen()
+{
+    struct kterm_terminal_char* ch;
+
+    for (uint32_t y = 0; y < _chars_yres; y++) {
+        for (uint32_t x = 0; x < _chars_xres; x++) {
+            ch = kterm_get_term_char(x, y);
+
+            /* Every char differs from the one above it, so nothing can be skipped when scrolling */
+            ch->ch = '!' + ((x + y) % ('~' - '!'));
+            ch->pallet_idx = _current_color_idx;
+        }
+    }
+
+    kterm_update_term_char(_characters, _chars_xres * _chars_yres);
+}
+
+static void _gfxbench_print_result(const char* label, u64 cycles, u64 tsc_hz, u64 nr_chars)
+{
+    kterm_print(label);
+    kterm_print(to_string(cycles));
+    kterm_print(" cycles");
+
+    /* Can't convert cycles to time before the TSC is calibrated */
+    if (!tsc_hz || !cycles) {
+        kterm_println(NULL);
+        return;
+    }
+
+    kterm_print(", ");
+
+    if (nr_chars) {
+        kterm_print(to_string((nr_chars * tsc_hz) / cycles));
+        kterm_println(" chars/s");
+        return;
+    }
+
+    kterm_print(to_string((cycles * 1000000) / tsc_hz));
+    kterm_println(" us");
+}
+
+/*!
+ * @brief: Compare the old and the new ways of drawing and scrolling
+ *
+ * Redraws a full screen of text pixel by pixel and with the glyph cache, after which a full
+ * screen is scrolled line by line with both scroll methods. The screen is cleared afterwards
+ */
+static uint32_t kterm_cmd_gfxbench(const char** argv, size_t argc)
+{
+    u64 start;
+    u64 tsc_hz;
+    u64 cycles[4];
+    const uint32_t nr_chars = _chars_xres * _chars_yres;
+
+    if (!kterm_can_blit()) {
+        kterm_println("Can't run gfxbench: The framebuffer is not 32 bpp");
+        return 1;
+    }
+
+    if (_nr_no_scroll_chars) {
+        kterm_println("Can't run gfxbench: There are chars on the screen that don't scroll");
+        return 1;
+    }
+
+    _gfxbench_fill_screen();
+
+    start = read_tsc();
+    kterm_update_term_char_pixels(_characters, nr_chars);
+    cycles[0] = read_tsc() - start;
+
+    start = read_tsc();
+    kterm_update_term_char(_characters, nr_chars);
+    cycles[1] = read_tsc() - start;
+
+    _gfxbench_fill_screen();
+
+    start = read_tsc();
+    for (uint32_t i = 0; i < _chars_yres; i++)
+        kterm_scroll_chars(1);
+    cycles[2] = read_tsc() - start;
+
+    _gfxbench_fill_screen();
+
+    start = read_tsc();
+    for (uint32_t i = 0; i < _chars_yres; i++)
+        kterm_scroll_blit(1);
+    cycles[3] = read_tsc() - start;
+
+    kterm_clear();
+
+    tsc_hz = time_get_tsc_hz();
+
+    _gfxbench_print_result("Redraw (per pixel): ", cycles[0], tsc_hz, nr_chars);
+    _gfxbench_print_result("Redraw (glyph cache): ", cycles[1], tsc_hz, nr_chars);
+    _gfxbench_print_result("Full screen scroll (per char): ", cycles[2], tsc_hz, 0);
+    _gfxbench_print_result("Full screen scroll (blit): ", cycles[3], tsc_hz, 0);
+    return 0;
+}
+
 struct kterm_cmd kterm_commands[] = {
     {
         "help",
@@ -506,6 +770,11 @@ struct kterm_cmd kterm_commands[] = {
         "Print info about a disk device",
         (f_kterm_command_handler_t)kterm_cmd_diskinfo,
     },
+    {
+        "rainfo",
+        "Print file read-ahead statistics",
+        (f_kterm_command_handler_t)kterm_cmd_rainfo,
+    },
     {
         "vidinfo",
         "Print info about the current video device",
@@ -558,6 +827,11 @@ struct kterm_cmd kterm_commands[] = {
         "Info about kterms color pallet",
         (f_kterm_command_handler_t)kterm_cmd_palletinfo,
     },
+    {
+        "gfxbench",
+        "Time drawing and scrolling of the terminal",
+        (f_kterm_command_handler_t)kterm_cmd_gfxbench,
+    },
     /*
      * NOTE: this is exec and this should always
      * be placed at the end of this list, otherwise
@@ -1248,6 +1522,9 @@ int kterm_init(driver_t* driver)
 
     /* Clear the entire character buffer */
     memset(_characters, 0, _chars_xres * _chars_yres * sizeof(struct kterm_terminal_char));
+    _nr_no_scroll_chars = 0;
+
+    kterm_init_glyph_cache();
 
     /* Allocate the color pallet */
     ASSERT(!kmem_kernel_alloc_range((void**)&_clr_pallet, KTERM_MAX_PALLET_ENTRY_COUNT * sizeof(struct kterm_terminal_pallet_entry), NULL, KMEM_FLAG_KERNEL | KMEM_FLAG_WRITABLE));
@@ -1825,9 +2102,15 @@ static inline void kterm_draw_char_ex(struct kterm_terminal_char* term_chr, char
     term_chr->ch = c;
     term_chr->pallet_idx = color_idx;
 
-    if (tgl_no_scroll)
+    if (tgl_no_scroll) {
         term_chr->no_scroll = !term_chr->no_scroll;
 
+        if (term_chr->no_scroll)
+            _nr_no_scroll_chars++;
+        else
+            _nr_no_scroll_chars--;
+    }
+
     if (force_update)
         return kterm_update_term_char(term_chr, 1);
 
@@ -2027,15 +2310,16 @@ int kterm_print(const char* msg)
     return 0;
 }
 
-// TODO: add a scroll direction (up, down, left, ect)
-static void kterm_scroll(uintptr_t lines)
+/*!
+ * @brief: Scroll by redrawing every char that changed
+ *
+ * Chars that don't scroll stay on the screen this way
+ */
+static void kterm_scroll_chars(uintptr_t lines)
 {
     uint32_t new_y;
     struct kterm_terminal_char *c_char, *prev_char;
 
-    if (!lines)
-        return;
-
     /* We'll always begin drawing at zero */
     new_y = 0;
 
@@ -2059,6 +2343,51 @@ static void kterm_scroll(uintptr_t lines)
             kterm_draw_char(x, new_y, NULL, 1, false);
         new_y++;
     }
+}
+
+/*!
+ * @brief: Scroll by moving the framebuffer contents up in one go
+ *
+ * Only the newly exposed lines get drawn. Every text line is moved with its own copy, which
+ * can't overlap with its destination, since we move at least a line
+ */
+static void kterm_scroll_blit(uintptr_t lines)
+{
+    const size_t line_size = _kterm_fb_pitch * KTERM_FONT_HEIGHT;
+    const uint32_t kept_lines = _chars_yres - lines;
+    struct kterm_terminal_char* ch;
+
+    for (uint32_t y = 0; y < kept_lines; y++) {
+        memcpy(kterm_get_term_char(0, y), kterm_get_term_char(0, y + lines), _chars_xres * sizeof(*_characters));
+        memcpy((void*)(KTERM_FB_ADDR + y * line_size), (void*)(KTERM_FB_ADDR + (y + lines) * line_size), line_size);
+    }
+
+    for (uint32_t y = kept_lines; y < _chars_yres; y++) {
+        for (uint32_t x = 0; x < _chars_xres; x++) {
+            ch = kterm_get_term_char(x, y);
+
+            ch->ch = NULL;
+            ch->pallet_idx = 1;
+        }
+    }
+
+    kterm_draw_rect(0, kept_lines * KTERM_FONT_HEIGHT, _chars_xres * KTERM_FONT_WIDTH, lines * KTERM_FONT_HEIGHT, kterm_color_for_pallet_idx(_current_background_idx));
+}
+
+// TODO: add a scroll direction (up, down, left, ect)
+static void kterm_scroll(uintptr_t lines)
+{
+    if (!lines)
+        return;
+
+    if (lines > _chars_yres)
+        lines = _chars_yres;
+
+    /* Chars that stay put would get dragged along by the blit */
+    if (_nr_no_scroll_chars || !kterm_can_blit())
+        kterm_scroll_chars(lines);
+    else
+        kterm_scroll_blit(lines);
 
     _chars_cursor_y -= lines;
 }
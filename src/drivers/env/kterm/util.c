@@ -8,6 +8,7 @@
 #include "lightos/dev/shared.h"
 #include "drivers/env/kterm/kterm.h"
 #include "entry/entry.h"
+#include "fs/file.h"
 #include "libk/data/linkedlist.h"
 #include "libk/flow/error.h"
 #include "libk/stddef.h"
@@ -367,6 +368,25 @@ uint32_t kterm_cmd_diskinfo(const char** argv, size_t argc)
     return 0;
 }
 
+/*!
+ * @brief: Print how well file read-ahead has been doing since boot
+ */
+uint32_t kterm_cmd_rainfo(const char** argv, size_t argc)
+{
+    u64 hits, misses, issued;
+
+    file_get_ra_stats(&hits, &misses, &issued);
+
+    kterm_print_keyvalue("Read-ahead hits", to_string(hits));
+    kterm_print_keyvalue("Read-ahead misses", to_string(misses));
+    kterm_print_keyvalue("Read-aheads issued", to_string(issued));
+
+    if (hits + misses)
+        kterm_print_keyvalue("Hit rate (%)", to_string((hits * 100) / (hits + misses)));
+
+    return 0;
+}
+
 static bool procinfo_callback(proc_t* proc)
 {
     // kterm_print_keyvalue(proc->m_name, to_string(proc->m_id));
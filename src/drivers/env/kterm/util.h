@@ -24,6 +24,7 @@ uint32_t kterm_cmd_drvld(const char** argv, size_t argc);
 uint32_t kterm_cmd_devinfo(const char** argv, size_t argc);
 uint32_t kterm_cmd_diskinfo(const char** argv, size_t argc);
 uint32_t kterm_cmd_procinfo(const char** argv, size_t argc);
+uint32_t kterm_cmd_rainfo(const char** argv, size_t argc);
 
 extern uint32_t kterm_cmd_envinfo(const char** argv, size_t argc);
 
@@ -212,20 +212,23 @@ static void USED lwnd_main()
              * Per window, check if it's visible, by breaking the window in smaller parts
              * and rendering those seperately
              */
-            if (!lwnd_window_should_update(w))
-                continue;
+            if (lwnd_window_should_update(w)) {
+                /* Split the fucker */
+                lwnd_window_split(_lwnd_stack, w, false);
 
-            /* Split the fucker */
-            lwnd_window_split(_lwnd_stack, w, false);
+                /* Draw the fucker */
+                lwnd_window_draw(w, _lwnd_0_screen);
 
-            /* Draw the fucker */
-            lwnd_window_draw(w, _lwnd_0_screen);
+                /* We've done the update =) */
+                lwnd_window_clear_update(w);
 
-            /* We've done the update =) */
-            lwnd_window_clear_update(w);
+                /* Make sure the background knows about this */
+                lwnd_window_update(_lwnd_stack->background_window);
+            }
 
-            /* Make sure the background knows about this */
-            lwnd_window_update(_lwnd_stack->background_window);
+            /* Push whatever the client submitted this frame. Window layout didn't change for this */
+            if (lwnd_window_is_damaged(w))
+                lwnd_window_draw_damage(w, _lwnd_0_screen);
         }
 
         lwnd_wndstack_update_background(_lwnd_stack);
@@ -391,6 +394,10 @@ uintptr_t msg_window_driver(aniva_driver_t* this, dcc_t code, void* buffer, size
         uwnd->fb.blue_mask = wnd->this_fb->colors.blue.length_bits << uwnd->fb.blue_lshift;
         uwnd->fb.alpha_mask = wnd->this_fb->colors.alpha.length_bits << uwnd->fb.alpha_lshift;
 
+        /* Not fatal, the client will just have to do the old one-update-per-draw dance */
+        if (lwnd_window_request_cmdring(wnd, &uwnd->cmdring))
+            uwnd->cmdring = NULL;
+
         break;
     case LWND_DCC_UPDATE_WND:
         wnd = wndstack_find_window(c_workspace->stack, uwnd->title);
@@ -401,6 +408,16 @@ uintptr_t msg_window_driver(aniva_driver_t* this, dcc_t code, void* buffer, size
         /* Mark as needing updating */
         lwnd_window_full_update_screen(wnd, _lwnd_0_screen);
         break;
+    case LWND_DCC_SUBMIT:
+        wnd = wndstack_find_window(c_workspace->stack, uwnd->title);
+
+        if (!wnd)
+            return DRV_STAT_NOT_FOUND;
+
+        /* Execute the entire batch. lwnd_main picks up the damage */
+        if (lwnd_window_consume_cmds(wnd))
+            return DRV_STAT_INVAL;
+        break;
     case LWND_DCC_GETKEY:
         // KLOG_DBG("Trying to get key event!\n");
         wnd = wndstack_find_window(c_workspace->stack, uwnd->title);
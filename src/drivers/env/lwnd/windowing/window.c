@@ -3,6 +3,7 @@
 #include "dev/video/framebuffer.h"
 #include "drivers/env/lwnd/display/screen.h"
 #include "libk/flow/error.h"
+#include "libk/math/math.h"
 #include "libk/stddef.h"
 #include "mem/heap.h"
 #include "mem/kmem.h"
@@ -30,6 +31,8 @@ lwnd_window_t* create_window(proc_t* p, const char* title, u32 x, u32 y, u32 wid
     ret->flags = LWND_WINDOW_FLAG_NEED_UPDATE;
     ret->this_fb = NULL;
 
+    init_spinlock(&ret->damage_lock, NULL);
+
     ret->hid_key_ring = kmalloc(sizeof(hid_event_t) * 64);
     init_hid_event_buffer(&ret->hid_key_buffer, ret->hid_key_ring, 64);
 
@@ -51,6 +54,9 @@ void destroy_window(lwnd_window_t* window)
         kfree(window->this_fb);
     }
 
+    if (window->cmdring)
+        kmem_kernel_dealloc((vaddr_t)window->cmdring, ALIGN_UP(sizeof(lwnd_cmdring_t), SMALL_PAGE_SIZE));
+
     kfree(window->hid_key_ring);
 
     kfree((void*)window->title);
@@ -135,13 +141,13 @@ int lwnd_window_move(struct lwnd_screen* screen, lwnd_window_t* wnd, u32 newx, u
 }
 
 /*!
- * @brief: Update a single rect from a window
+ * @brief: Copy an area of a windows framebuffer to the screen
  *
- * Copies a part of the windows internal framebuffer to the screen
+ * @x, @y, @w, @h: The area relative to the window
  *
  * TODO: Use 2D acceleration on the video device to bitblt
  */
-static inline void __lwnd_redraw_rect(lwnd_window_t* wnd, lwnd_screen_t* screen, lwnd_wndrect_t* rect)
+static void __lwnd_blit_area(lwnd_window_t* wnd, lwnd_screen_t* screen, u32 x, u32 y, u32 w, u32 h)
 {
     u32 abs_rect_x;
     u32 abs_rect_y;
@@ -152,9 +158,6 @@ static inline void __lwnd_redraw_rect(lwnd_window_t* wnd, lwnd_screen_t* screen,
     void* screen_offset;
     void* rect_offset;
 
-    if (!wnd || !screen || !rect)
-        return;
-
     screen_info = screen->fbinfo;
     wnd_info = wnd->this_fb;
 
@@ -167,19 +170,19 @@ static inline void __lwnd_redraw_rect(lwnd_window_t* wnd, lwnd_screen_t* screen,
     const uint32_t screen_bytes_per_pixel = screen_info->bpp >> 3;
     const uint32_t wnd_bytes_per_pixel = wnd_info->bpp >> 3;
 
-    abs_rect_x = wnd->x + rect->x;
-    abs_rect_y = wnd->y + rect->y;
+    abs_rect_x = wnd->x + x;
+    abs_rect_y = wnd->y + y;
 
     /* Get the starting offset on the screen where we need to draw */
     screen_offset = screen_info->kernel_addr + (void*)(u64)(abs_rect_y * screen_info->pitch + abs_rect_x * screen_bytes_per_pixel);
     /* Get the starting offset inside the windows framebuffer where we need to draw */
-    rect_offset = wnd->this_fb->kernel_addr + (void*)(u64)(rect->y * wnd_info->pitch + rect->x * wnd_bytes_per_pixel);
+    rect_offset = wnd->this_fb->kernel_addr + (void*)(u64)(y * wnd_info->pitch + x * wnd_bytes_per_pixel);
 
     /* Calculate actual draw width and height */
-    draw_height = rect->h - ((abs_rect_y + rect->h) > screen_info->height ? ((abs_rect_y + rect->h) - screen_info->height) : 0);
-    draw_width = rect->w - ((abs_rect_x + rect->w) > screen_info->width ? ((abs_rect_x + rect->w) - screen_info->width) : 0);
+    draw_height = h - ((abs_rect_y + h) > screen_info->height ? ((abs_rect_y + h) - screen_info->height) : 0);
+    draw_width = w - ((abs_rect_x + w) > screen_info->width ? ((abs_rect_x + w) - screen_info->width) : 0);
 
-    // KLOG_DBG("Trying to draw: x:%d y:%d (%dx%d)\n", rect->x, rect->y, rect->w, rect->h);
+    // KLOG_DBG("Trying to draw: x:%d y:%d (%dx%d)\n", x, y, w, h);
 
     /*
      * Our manual slow bitblt xD
@@ -196,6 +199,19 @@ static inline void __lwnd_redraw_rect(lwnd_window_t* wnd, lwnd_screen_t* screen,
         screen_offset += screen_info->pitch - (draw_width * screen_bytes_per_pixel);
         rect_offset += wnd_info->pitch - (draw_width * wnd_bytes_per_pixel);
     }
+}
+
+/*!
+ * @brief: Update a single rect from a window
+ *
+ * Copies a part of the windows internal framebuffer to the screen
+ */
+static inline void __lwnd_redraw_rect(lwnd_window_t* wnd, lwnd_screen_t* screen, lwnd_wndrect_t* rect)
+{
+    if (!wnd || !screen || !rect)
+        return;
+
+    __lwnd_blit_area(wnd, screen, rect->x, rect->y, rect->w, rect->h);
 
     rect->rect_changed = false;
 }
@@ -282,3 +298,240 @@ error_and_exit:
     kfree(info);
     return error;
 }
+
+/*!
+ * @brief: Map a command ring for @wnd into both the kernel and the owning process
+ *
+ * @p_uring: Gets the address of the ring the client should use
+ */
+int lwnd_window_request_cmdring(lwnd_window_t* wnd, lwnd_cmdring_t** p_uring)
+{
+    int error;
+    size_t size;
+    paddr_t phys;
+    lwnd_cmdring_t* ring;
+    lwnd_cmdring_t* u_ring;
+
+    if (!wnd || !p_uring)
+        return -KERR_INVAL;
+
+    /* Already have one */
+    if (wnd->cmdring) {
+        *p_uring = wnd->u_cmdring;
+        return 0;
+    }
+
+    /* NOTE: This fits in a single page, so we don't need to care about physical contiguity */
+    size = ALIGN_UP(sizeof(lwnd_cmdring_t), SMALL_PAGE_SIZE);
+
+    error = kmem_kernel_alloc_range((void**)&ring, size, NULL, KMEM_FLAG_WRITABLE | KMEM_FLAG_KERNEL);
+
+    if (error)
+        return error;
+
+    memset(ring, 0, size);
+
+    ring->capacity = LWND_CMDRING_CAPACITY;
+    u_ring = ring;
+
+    if (wnd->proc) {
+        phys = kmem_to_phys(NULL, (vaddr_t)ring);
+
+        if (!phys) {
+            error = -KERR_INVAL;
+            goto dealloc_and_exit;
+        }
+
+        error = kmem_user_alloc((void**)&u_ring, wnd->proc, phys, size, NULL, KMEM_FLAG_WRITABLE);
+
+        if (error)
+            goto dealloc_and_exit;
+    }
+
+    wnd->cmdring = ring;
+    wnd->u_cmdring = u_ring;
+
+    *p_uring = u_ring;
+    return 0;
+
+dealloc_and_exit:
+    kmem_kernel_dealloc((vaddr_t)ring, size);
+    return error;
+}
+
+static void __lwnd_window_add_damage(lwnd_window_t* wnd, u32 x, u32 y, u32 w, u32 h)
+{
+    u32 end_x, end_y;
+    lwnd_wndrect_t* bbox;
+
+    spinlock_lock(&wnd->damage_lock);
+
+    if (wnd->n_damage < LWND_WINDOW_MAX_DAMAGE) {
+        wnd->damage[wnd->n_damage++] = (lwnd_wndrect_t) { .x = x, .y = y, .w = w, .h = h };
+        goto set_flag_and_exit;
+    }
+
+    /* Out of slots. Collapse everything into a single bounding box */
+    bbox = &wnd->damage[0];
+
+    for (u32 i = 1; i < wnd->n_damage; i++) {
+        end_x = MAX(bbox->x + bbox->w, wnd->damage[i].x + wnd->damage[i].w);
+        end_y = MAX(bbox->y + bbox->h, wnd->damage[i].y + wnd->damage[i].h);
+
+        bbox->x = MIN(bbox->x, wnd->damage[i].x);
+        bbox->y = MIN(bbox->y, wnd->damage[i].y);
+        bbox->w = end_x - bbox->x;
+        bbox->h = end_y - bbox->y;
+    }
+
+    end_x = MAX(bbox->x + bbox->w, x + w);
+    end_y = MAX(bbox->y + bbox->h, y + h);
+
+    bbox->x = MIN(bbox->x, x);
+    bbox->y = MIN(bbox->y, y);
+    bbox->w = end_x - bbox->x;
+    bbox->h = end_y - bbox->y;
+
+    wnd->n_damage = 1;
+
+set_flag_and_exit:
+    wnd->flags |= LWND_WINDOW_FLAG_DAMAGED;
+
+    spinlock_unlock(&wnd->damage_lock);
+}
+
+/*!
+ * @brief: Clip a command to the window. Returns false if nothing is left of it
+ */
+static inline bool __lwnd_clip_cmd(lwnd_window_t* wnd, lwnd_cmd_t* cmd)
+{
+    if (cmd->x >= wnd->width || cmd->y >= wnd->height)
+        return false;
+
+    if (cmd->w > wnd->width - cmd->x)
+        cmd->w = wnd->width - cmd->x;
+
+    if (cmd->h > wnd->height - cmd->y)
+        cmd->h = wnd->height - cmd->y;
+
+    return (cmd->w && cmd->h);
+}
+
+static void __lwnd_fill_rect(fb_info_t* info, u32 x, u32 y, u32 w, u32 h, u32 clr)
+{
+    u32* line;
+    const u32 bytes_pp = info->bpp >> 3;
+
+    line = (u32*)(info->kernel_addr + (u64)y * info->pitch + (u64)x * bytes_pp);
+
+    for (u32 i = 0; i < h; i++) {
+        for (u32 j = 0; j < w; j++)
+            line[j] = clr;
+
+        line = (u32*)((u8*)line + info->pitch);
+    }
+}
+
+/*!
+ * @brief: Execute everything the client put in its command ring
+ *
+ * Called from the submit message, so this runs in the context of the client. All the
+ * drawing happens in the windows own framebuffer. The areas that were touched are
+ * recorded as damage, which lwnd_main pushes to the screen in its next pass
+ */
+int lwnd_window_consume_cmds(lwnd_window_t* wnd)
+{
+    u32 head;
+    u32 tail;
+    lwnd_cmd_t cmd;
+    lwnd_cmdring_t* ring;
+
+    if (!wnd || !wnd->cmdring || !wnd->this_fb || !wnd->this_fb->kernel_addr)
+        return -KERR_INVAL;
+
+    ring = wnd->cmdring;
+
+    head = *(volatile u32*)&ring->head;
+    tail = ring->tail;
+
+    /* The client messed up the ring. Drop all of it and just redraw the entire window */
+    if ((head - tail) > LWND_CMDRING_CAPACITY) {
+        ring->tail = head;
+        __lwnd_window_add_damage(wnd, 0, 0, wnd->width, wnd->height);
+        return -KERR_INVAL;
+    }
+
+    for (; tail != head; tail++) {
+        /* Copy it out, so the client can't change it while we're working with it */
+        cmd = ring->cmds[tail & (LWND_CMDRING_CAPACITY - 1)];
+
+        if (!__lwnd_clip_cmd(wnd, &cmd))
+            continue;
+
+        switch (cmd.type) {
+        case LWND_CMD_FILL_RECT:
+            __lwnd_fill_rect(wnd->this_fb, cmd.x, cmd.y, cmd.w, cmd.h, cmd.clr);
+            break;
+        case LWND_CMD_OUTLINE_RECT:
+            __lwnd_fill_rect(wnd->this_fb, cmd.x, cmd.y, cmd.w, 1, cmd.clr);
+            __lwnd_fill_rect(wnd->this_fb, cmd.x, cmd.y + cmd.h - 1, cmd.w, 1, cmd.clr);
+            __lwnd_fill_rect(wnd->this_fb, cmd.x, cmd.y, 1, cmd.h, cmd.clr);
+            __lwnd_fill_rect(wnd->this_fb, cmd.x + cmd.w - 1, cmd.y, 1, cmd.h, cmd.clr);
+            break;
+        case LWND_CMD_DAMAGE:
+            break;
+        default:
+            continue;
+        }
+
+        __lwnd_window_add_damage(wnd, cmd.x, cmd.y, cmd.w, cmd.h);
+    }
+
+    ring->tail = tail;
+    return 0;
+}
+
+/*!
+ * @brief: Push the damaged parts of a window to the screen
+ *
+ * Only the parts of the damage that overlap with the visible rects of the window get drawn,
+ * so we don't need to resplit anything here
+ */
+int lwnd_window_draw_damage(lwnd_window_t* wnd, struct lwnd_screen* screen)
+{
+    u32 n_damage;
+    u32 x, y, end_x, end_y;
+    lwnd_wndrect_t* d;
+    lwnd_wndrect_t damage[LWND_WINDOW_MAX_DAMAGE];
+
+    if (!wnd || !screen)
+        return -KERR_INVAL;
+
+    spinlock_lock(&wnd->damage_lock);
+
+    n_damage = wnd->n_damage;
+    memcpy(damage, wnd->damage, n_damage * sizeof(*damage));
+
+    wnd->n_damage = 0;
+    wnd->flags &= ~LWND_WINDOW_FLAG_DAMAGED;
+
+    spinlock_unlock(&wnd->damage_lock);
+
+    for (lwnd_wndrect_t* r = wnd->rects; r; r = r->next_part) {
+        for (u32 i = 0; i < n_damage; i++) {
+            d = &damage[i];
+
+            x = MAX(r->x, d->x);
+            y = MAX(r->y, d->y);
+            end_x = MIN(r->x + r->w, d->x + d->w);
+            end_y = MIN(r->y + r->h, d->y + d->h);
+
+            if (end_x <= x || end_y <= y)
+                continue;
+
+            __lwnd_blit_area(wnd, screen, x, y, end_x - x, end_y - y);
+        }
+    }
+
+    return 0;
+}
@@ -6,8 +6,15 @@
 #include "libk/stddef.h"
 #include "mem/zalloc/zalloc.h"
 #include "proc/proc.h"
+#include "sync/spinlock.h"
+#include <libgfx/shared.h>
 
 #define LWND_WINDOW_FLAG_NEED_UPDATE 0x00000001
+/* The client submitted damage that still needs to go to the screen */
+#define LWND_WINDOW_FLAG_DAMAGED 0x00000002
+
+/* Past this many damage rects, we just merge everything into one big rect */
+#define LWND_WINDOW_MAX_DAMAGE 8
 
 struct lwnd_wndstack;
 struct lwnd_screen;
@@ -70,6 +77,15 @@ typedef struct lwnd_window {
      */
     lwnd_wndrect_t* rects;
     lwnd_wndrect_t* prev_rects;
+
+    /* Command ring shared with the client, mapped in both the kernel and the process */
+    lwnd_cmdring_t* cmdring;
+    lwnd_cmdring_t* u_cmdring;
+
+    /* Damage collected from the command ring, relative to the window */
+    spinlock_t damage_lock;
+    u32 n_damage;
+    lwnd_wndrect_t damage[LWND_WINDOW_MAX_DAMAGE];
 } lwnd_window_t;
 
 static inline bool lwnd_window_should_update(lwnd_window_t* wnd)
@@ -77,6 +93,11 @@ static inline bool lwnd_window_should_update(lwnd_window_t* wnd)
     return ((wnd->flags & LWND_WINDOW_FLAG_NEED_UPDATE) == LWND_WINDOW_FLAG_NEED_UPDATE);
 }
 
+static inline bool lwnd_window_is_damaged(lwnd_window_t* wnd)
+{
+    return ((wnd->flags & LWND_WINDOW_FLAG_DAMAGED) == LWND_WINDOW_FLAG_DAMAGED);
+}
+
 static inline bool lwnd_window_is_inside_window(lwnd_window_t* top, lwnd_window_t* bottom)
 {
     return (top->x >= bottom->x && top->y >= bottom->y && (top->x + top->width) <= (bottom->x + bottom->width) && (top->y + top->height) <= (bottom->y + bottom->height));
@@ -95,6 +116,10 @@ int lwnd_window_move(struct lwnd_screen* screen, lwnd_window_t* wnd, u32 newx, u
 int lwnd_window_request_fb(lwnd_window_t* wnd, struct lwnd_screen* screen);
 int lwnd_window_draw(lwnd_window_t* wnd, struct lwnd_screen* screen);
 
+int lwnd_window_request_cmdring(lwnd_window_t* wnd, lwnd_cmdring_t** p_uring);
+int lwnd_window_consume_cmds(lwnd_window_t* wnd);
+int lwnd_window_draw_damage(lwnd_window_t* wnd, struct lwnd_screen* screen);
+
 extern lwnd_wndrect_t* create_and_link_lwndrect(lwnd_wndrect_t** rect_list, zone_allocator_t* cache, u32 x, u32 y, u32 w, u32 h);
 // Uses fb_info or debug
 extern int lwnd_window_split(struct lwnd_wndstack* stack, lwnd_window_t* wnd, bool front_to_back);
@@ -66,6 +66,7 @@ u64 upi_destroy_pipe(proc_t* proc, HANDLE pipe_handle)
 u64 upi_connect_pipe(proc_t* proc, lightos_pipe_t* upipe)
 {
     upi_pipe_t* pipe;
+    upi_listener_t* listener;
 
     pipe = get_upi_pipe(proc, upipe->pipe, NULL);
 
@@ -73,13 +74,23 @@ u64 upi_connect_pipe(proc_t* proc, lightos_pipe_t* upipe)
     if (!pipe)
         return DRV_STAT_INVAL;
 
+    mutex_lock(pipe->lock);
+
     /* Proc can not connect to this pipe, yikes */
     if (!upi_pipe_can_proc_connect(pipe, proc))
-        return DRV_STAT_INVAL;
+        goto unlock_and_exit_error;
 
     /* We may connect, do da thing */
-    if (!create_upi_listener(proc, pipe, upipe->pipe))
-        return DRV_STAT_INVAL;
+    listener = create_upi_listener(proc, pipe, upipe->pipe);
+
+    if (!listener)
+        goto unlock_and_exit_error;
+
+    /* Hook the listener up to the ring */
+    if (upi_pipe_has_ring(pipe) && upi_ring_attach_listener(pipe, listener, upipe)) {
+        destroy_upi_listener(pipe, listener);
+        goto unlock_and_exit_error;
+    }
 
     /* Reference the pipe object */
     oss_obj_ref(pipe->obj);
@@ -91,7 +102,12 @@ u64 upi_connect_pipe(proc_t* proc, lightos_pipe_t* upipe)
     /* Copy over the name */
     strncpy((char*)upipe->name, pipe->obj->name, sizeof(upipe->name));
 
+    mutex_unlock(pipe->lock);
     return 0;
+
+unlock_and_exit_error:
+    mutex_unlock(pipe->lock);
+    return DRV_STAT_INVAL;
 }
 
 u64 upi_disconnect_pipe(proc_t* proc, HANDLE pipe_handle)
@@ -104,14 +120,17 @@ u64 upi_disconnect_pipe(proc_t* proc, HANDLE pipe_handle)
     if (!pipe)
         return DRV_STAT_INVAL;
 
-    listener = get_upi_listener(pipe, proc);
+    mutex_lock(pipe->lock);
 
-    if (!listener)
-        return DRV_STAT_INVAL;
+    listener = get_upi_listener(pipe, proc);
 
     /* Murder the listener */
-    destroy_upi_listener(pipe, listener);
-    return 0;
+    if (listener)
+        destroy_upi_listener(pipe, listener);
+
+    mutex_unlock(pipe->lock);
+
+    return listener ? 0 : DRV_STAT_INVAL;
 }
 
 /*!
@@ -121,6 +140,7 @@ u64 upi_disconnect_pipe(proc_t* proc, HANDLE pipe_handle)
  */
 u64 upi_send_transact(proc_t* proc, lightos_pipe_ft_t* ft)
 {
+    u64 error;
     upi_pipe_t* pipe;
 
     if (!ft)
@@ -129,7 +149,8 @@ u64 upi_send_transact(proc_t* proc, lightos_pipe_ft_t* ft)
     /* Grab the pipe handle */
     pipe = get_upi_pipe(proc, ft->pipe_handle, NULL);
 
-    if (!pipe)
+    /* Transactions over a ring never come by us */
+    if (!pipe || upi_pipe_has_ring(pipe))
         return DRV_STAT_INVAL;
 
     /* If this pipe is not fullduplex, only the creator of the pipe can send over the pipe */
@@ -140,8 +161,14 @@ u64 upi_send_transact(proc_t* proc, lightos_pipe_ft_t* ft)
     if (ft->transaction.transaction_type == LIGHTOS_PIPE_TRANSACT_TYPE_SIGNAL && upi_maybe_handle_signal_transact(proc, ft))
         return 0;
 
+    mutex_lock(pipe->lock);
+
     /* Add the transaction to the pipes buffer */
-    return upi_pipe_add_transaction(pipe, ft);
+    error = upi_pipe_add_transaction(pipe, ft);
+
+    mutex_unlock(pipe->lock);
+
+    return error;
 }
 
 static inline lightos_pipe_ft_t* __upi_pipe_get_next_ft_for_listener(upi_pipe_t* pipe, upi_listener_t* listener, u32* p_prev_idx)
@@ -173,13 +200,17 @@ u64 upi_transact_preview(proc_t* proc, lightos_pipe_ft_t* tranact)
 
     pipe = get_upi_pipe(proc, tranact->pipe_handle, NULL);
 
-    if (!pipe)
+    if (!pipe || upi_pipe_has_ring(pipe))
         return DRV_STAT_INVAL;
 
+    mutex_lock(pipe->lock);
+
     listener = get_upi_listener(pipe, proc);
 
-    if (!listener)
+    if (!listener) {
+        mutex_unlock(pipe->lock);
         return DRV_STAT_INVAL;
+    }
 
     c_ft = __upi_pipe_get_next_ft_for_listener(pipe, listener, NULL);
 
@@ -189,22 +220,22 @@ u64 upi_transact_preview(proc_t* proc, lightos_pipe_ft_t* tranact)
         /* Copy the transaction into the ft struct */
         memcpy(&tranact->transaction, &c_ft->transaction, sizeof(lightos_pipe_transaction_t));
 
+    mutex_unlock(pipe->lock);
     return 0;
 }
 
-u64 upi_transact_accept(proc_t* proc, lightos_pipe_accept_t* accept)
+/*!
+ * @brief: Accept the current transaction of @proc on @pipe
+ *
+ * Caller should hold the pipe lock
+ */
+static u64 __upi_transact_accept(proc_t* proc, upi_pipe_t* pipe, lightos_pipe_accept_t* accept)
 {
     size_t bsize;
-    upi_pipe_t* pipe;
     upi_listener_t* listener;
     u32 c_ft_idx;
     lightos_pipe_ft_t* c_ft;
 
-    pipe = get_upi_pipe(proc, accept->pipe_handle, NULL);
-
-    if (!pipe)
-        return DRV_STAT_INVAL;
-
     listener = get_upi_listener(pipe, proc);
 
     if (!listener)
@@ -265,18 +296,36 @@ u64 upi_transact_accept(proc_t* proc, lightos_pipe_accept_t* accept)
     return upi_pipe_check_transaction(pipe, c_ft_idx);
 }
 
-u64 upi_transact_deny(proc_t* proc, HANDLE handle)
+u64 upi_transact_accept(proc_t* proc, lightos_pipe_accept_t* accept)
 {
+    u64 error;
     upi_pipe_t* pipe;
-    upi_listener_t* listener;
-    lightos_pipe_ft_t* c_ft;
-    u32 c_ft_idx;
 
-    pipe = get_upi_pipe(proc, handle, NULL);
+    pipe = get_upi_pipe(proc, accept->pipe_handle, NULL);
 
-    if (!pipe)
+    if (!pipe || upi_pipe_has_ring(pipe))
         return DRV_STAT_INVAL;
 
+    mutex_lock(pipe->lock);
+
+    error = __upi_transact_accept(proc, pipe, accept);
+
+    mutex_unlock(pipe->lock);
+
+    return error;
+}
+
+/*!
+ * @brief: Deny the current transaction of @proc on @pipe
+ *
+ * Caller should hold the pipe lock
+ */
+static u64 __upi_transact_deny(proc_t* proc, upi_pipe_t* pipe)
+{
+    upi_listener_t* listener;
+    lightos_pipe_ft_t* c_ft;
+    u32 c_ft_idx;
+
     listener = get_upi_listener(pipe, proc);
 
     if (!listener)
@@ -305,6 +354,25 @@ u64 upi_transact_deny(proc_t* proc, HANDLE handle)
     return upi_pipe_check_transaction(pipe, c_ft_idx);
 }
 
+u64 upi_transact_deny(proc_t* proc, HANDLE handle)
+{
+    u64 error;
+    upi_pipe_t* pipe;
+
+    pipe = get_upi_pipe(proc, handle, NULL);
+
+    if (!pipe || upi_pipe_has_ring(pipe))
+        return DRV_STAT_INVAL;
+
+    mutex_lock(pipe->lock);
+
+    error = __upi_transact_deny(proc, pipe);
+
+    mutex_unlock(pipe->lock);
+
+    return error;
+}
+
 u64 upi_dump_pipe(proc_t* proc, lightos_pipe_dump_t* dump)
 {
     upi_pipe_t* pipe;
@@ -314,17 +382,26 @@ u64 upi_dump_pipe(proc_t* proc, lightos_pipe_dump_t* dump)
     if (!pipe)
         return DRV_STAT_INVAL;
 
+    mutex_lock(pipe->lock);
+
     dump->n_connection = pipe->n_listeners;
+
+    /* The transactions of a ring are counted inside the ring */
+    if (upi_pipe_has_ring(pipe)) {
+        upi_ring_dump(pipe, dump);
+        goto unlock_and_exit;
+    }
+
     dump->n_cur_transact = pipe->n_ft;
     dump->n_deny = pipe->n_total_deny;
     dump->n_accept = pipe->n_total_accept;
     dump->acceptance_rate = 0;
 
     /* No transactions, don't do weird things */
-    if (!pipe->n_total_transacts)
-        return 0;
-
-    dump->acceptance_rate = (pipe->n_total_accept * 100) / (pipe->n_total_transacts);
+    if (pipe->n_total_transacts)
+        dump->acceptance_rate = (pipe->n_total_accept * 100) / (pipe->n_total_transacts);
 
+unlock_and_exit:
+    mutex_unlock(pipe->lock);
     return 0;
 }
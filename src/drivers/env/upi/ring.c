@@ -0,0 +1,391 @@
+#include "dev/driver.h"
+#include "libk/flow/error.h"
+#include "lightos/memory/memory.h"
+#include "lightos/proc/ipc/pipe/shared.h"
+#include "mem/kmem.h"
+#include "mem/phys.h"
+#include "mem/tracker/tracker.h"
+#include "sched/scheduler.h"
+#include "upi.h"
+
+/*
+ * Shared pipe rings
+ *
+ * The driver only allocates the ring, maps it and hands out consumer slots. Everything that moves
+ * through the ring is written and read by the processes themselves (see shared.h for the layout).
+ * What is left for us is putting processes to sleep when they have nothing to do and waking them
+ * again when the other side made progress
+ */
+
+static inline u32 __upi_ring_get_size(u32 requested)
+{
+    u32 size;
+
+    if (!requested)
+        return LIGHTOS_PIPE_RING_DEFAULT_SIZE;
+
+    if (requested > LIGHTOS_PIPE_RING_MAX_SIZE)
+        return LIGHTOS_PIPE_RING_MAX_SIZE;
+
+    /* Round up to a power of two, so the processes can wrap with a mask */
+    for (size = LIGHTOS_PIPE_RING_MIN_SIZE; size < requested; size <<= 1)
+        ;
+
+    return size;
+}
+
+/*!
+ * @brief: Map the ring of @pipe into @proc
+ *
+ * Every mapping takes its own reference on the ring pages. A process that still has the ring mapped
+ * when the pipe goes away can keep reading it without faulting. The reference is dropped when the
+ * process unmaps the ring itself or when its page directory is destroyed
+ */
+static int __upi_ring_map(upi_pipe_t* pipe, proc_t* proc, lightos_pipe_ring_t** p_uring)
+{
+    int error;
+    paddr_t phys;
+    page_range_t range;
+    const size_t nr_pages = GET_PAGECOUNT(0, pipe->ring_bsize);
+
+    phys = kmem_to_phys(NULL, (vaddr_t)pipe->ring);
+
+    if (!phys)
+        return -KERR_INVAL;
+
+    error = page_tracker_alloc_any(&proc->m_virtual_tracker, PAGE_TRACKER_FIRST_FIT, nr_pages, PAGE_RANGE_FLAG_UNBACKED | PAGE_RANGE_FLAG_WRITABLE, &range);
+
+    if (error)
+        return error;
+
+    error = kmem_phys_reserve_range(kmem_get_page_idx(phys), nr_pages);
+
+    if (error)
+        goto dealloc_and_exit;
+
+    if (!kmem_map_range(proc->m_root_pd.m_root, kmem_get_page_addr(range.page_idx), phys, nr_pages, KMEM_CUSTOMFLAG_GET_MAKE | KMEM_CUSTOMFLAG_CREATE_USER,
+            KMEM_FLAG_WRITABLE | KMEM_FLAG_NOEXECUTE)) {
+        kmem_phys_dealloc_range(kmem_get_page_idx(phys), nr_pages);
+        error = -KERR_NOMEM;
+        goto dealloc_and_exit;
+    }
+
+    *p_uring = (lightos_pipe_ring_t*)kmem_get_page_addr(range.page_idx);
+    return 0;
+
+dealloc_and_exit:
+    page_tracker_dealloc(&proc->m_virtual_tracker, &range);
+    return error;
+}
+
+/*!
+ * @brief: Give @pipe a ring and map it into its creator
+ *
+ * Puts the address and the size of the ring in @upipe
+ */
+int upi_pipe_create_ring(upi_pipe_t* pipe, lightos_pipe_t* upipe)
+{
+    int error;
+    u32 size;
+
+    size = __upi_ring_get_size(upipe->ring_size);
+
+    pipe->ring_bsize = LIGHTOS_PIPE_RING_DATA_OFFSET + size;
+    pipe->ring_space_sem = create_semaphore(1, 0, 1);
+
+    if (!pipe->ring_space_sem)
+        return -KERR_NOMEM;
+
+    error = kmem_kernel_alloc_range((void**)&pipe->ring, pipe->ring_bsize, NULL, KMEM_FLAG_WRITABLE | KMEM_FLAG_KERNEL);
+
+    if (error)
+        goto destroy_and_exit;
+
+    /* This is going to be visible to userspace, don't leak anything */
+    memset(pipe->ring, 0, pipe->ring_bsize);
+
+    pipe->ring->size = size;
+
+    error = __upi_ring_map(pipe, pipe->creator_proc, &upipe->ring);
+
+    if (error)
+        goto destroy_and_exit;
+
+    upipe->ring_size = size;
+    upipe->ring_slot = LIGHTOS_PIPE_RING_SLOT_PRODUCER;
+    return 0;
+
+destroy_and_exit:
+    upi_pipe_destroy_ring(pipe);
+    return error;
+}
+
+/*!
+ * @brief: Mark the ring of @pipe closed and get everyone out of the driver
+ *
+ * Called before the pipe is torn down. Sleepers wake up to a closed ring
+ */
+void upi_pipe_close_ring(upi_pipe_t* pipe)
+{
+    if (!pipe->ring)
+        return;
+
+    mutex_lock(pipe->lock);
+
+    __atomic_or_fetch(&pipe->ring->flags, LIGHTOS_PIPE_RING_FLAG_CLOSED, __ATOMIC_RELEASE);
+
+    for (upi_listener_t* i = pipe->listeners; i != nullptr; i = i->next) {
+        if (!i->ring_waiting)
+            continue;
+
+        i->ring_waiting = false;
+        sem_post(i->ring_sem);
+    }
+
+    if (pipe->ring_space_waiting) {
+        pipe->ring_space_waiting = false;
+        sem_post(pipe->ring_space_sem);
+    }
+
+    mutex_unlock(pipe->lock);
+
+    /* Sleepers don't touch the pipe after they drop this, so we're safe to kill it after */
+    while (__atomic_load_n(&pipe->n_ring_sleepers, __ATOMIC_ACQUIRE))
+        scheduler_yield();
+}
+
+/*!
+ * @brief: Drop the drivers reference to the ring of @pipe
+ *
+ * The pages stick around until every process that mapped them lets go
+ */
+void upi_pipe_destroy_ring(upi_pipe_t* pipe)
+{
+    if (pipe->ring)
+        kmem_kernel_dealloc((vaddr_t)pipe->ring, pipe->ring_bsize);
+
+    if (pipe->ring_space_sem)
+        destroy_semaphore(pipe->ring_space_sem);
+
+    pipe->ring = nullptr;
+    pipe->ring_space_sem = nullptr;
+}
+
+/*!
+ * @brief: Give @listener a consumer slot in the ring of @pipe and map the ring for it
+ *
+ * The listener starts reading at the current head, so it only sees transactions sent after it
+ * connected. Caller should hold the pipe lock
+ */
+int upi_ring_attach_listener(upi_pipe_t* pipe, upi_listener_t* listener, lightos_pipe_t* upipe)
+{
+    int error;
+    u32 mask;
+    u32 slot;
+    lightos_pipe_ring_t* ring = pipe->ring;
+
+    mask = __atomic_load_n(&ring->consumer_mask, __ATOMIC_ACQUIRE);
+
+    for (slot = 0; slot < LIGHTOS_PIPE_RING_MAX_CONSUMERS; slot++)
+        if ((mask & (1U << slot)) == 0)
+            break;
+
+    if (slot == LIGHTOS_PIPE_RING_MAX_CONSUMERS)
+        return -KERR_NOMEM;
+
+    listener->ring_sem = create_semaphore(1, 0, 1);
+
+    if (!listener->ring_sem)
+        return -KERR_NOMEM;
+
+    error = __upi_ring_map(pipe, listener->proc, &upipe->ring);
+
+    if (error) {
+        destroy_semaphore(listener->ring_sem);
+        listener->ring_sem = nullptr;
+        return error;
+    }
+
+    listener->ring_slot = slot;
+
+    /*
+     * The tail needs to be in place before the producer can see the slot. A producer that still
+     * works with the old mask can't get past this tail anyway, since it never writes beyond the
+     * slowest consumer it knows of
+     */
+    ring->consumers[slot].tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    ring->consumers[slot].n_handled = __atomic_load_n(&ring->n_transacts, __ATOMIC_ACQUIRE);
+
+    __atomic_or_fetch(&ring->consumer_mask, (1U << slot), __ATOMIC_RELEASE);
+
+    upipe->ring_slot = slot;
+    upipe->ring_size = ring->size;
+    return 0;
+}
+
+/*!
+ * @brief: Release the consumer slot of @listener
+ *
+ * Mapping the ring out is left to the listener itself. Caller should hold the pipe lock
+ */
+void upi_ring_detach_listener(upi_pipe_t* pipe, upi_listener_t* listener)
+{
+    if (!pipe->ring || !listener->ring_sem)
+        return;
+
+    __atomic_and_fetch(&pipe->ring->consumer_mask, ~(1U << listener->ring_slot), __ATOMIC_RELEASE);
+
+    /* Another thread of the listener might be asleep on the semaphore we're about to kill */
+    if (listener->ring_waiting) {
+        listener->ring_waiting = false;
+        sem_post(listener->ring_sem);
+    }
+
+    while (__atomic_load_n(&listener->ring_sleeping, __ATOMIC_ACQUIRE))
+        scheduler_yield();
+
+    /* This listener might have been the one holding the producer back */
+    if (pipe->ring_space_waiting) {
+        pipe->ring_space_waiting = false;
+        sem_post(pipe->ring_space_sem);
+    }
+
+    destroy_semaphore(listener->ring_sem);
+    listener->ring_sem = nullptr;
+}
+
+void upi_ring_dump(upi_pipe_t* pipe, lightos_pipe_dump_t* dump)
+{
+    u32 mask;
+    u64 n_transacts;
+    u64 n_slowest;
+    lightos_pipe_ring_t* ring = pipe->ring;
+
+    mask = __atomic_load_n(&ring->consumer_mask, __ATOMIC_ACQUIRE);
+    n_transacts = __atomic_load_n(&ring->n_transacts, __ATOMIC_ACQUIRE);
+    n_slowest = n_transacts;
+
+    for (u32 i = 0; i < LIGHTOS_PIPE_RING_MAX_CONSUMERS; i++) {
+        if ((mask & (1U << i)) == 0)
+            continue;
+
+        if (ring->consumers[i].n_handled < n_slowest)
+            n_slowest = ring->consumers[i].n_handled;
+    }
+
+    dump->n_cur_transact = n_transacts - n_slowest;
+    dump->n_accept = ring->n_accept;
+    dump->n_deny = ring->n_deny;
+    dump->acceptance_rate = 0;
+
+    if (dump->n_accept + dump->n_deny)
+        dump->acceptance_rate = (dump->n_accept * 100) / (dump->n_accept + dump->n_deny);
+}
+
+/*!
+ * @brief: Sleep until the ring of a pipe lets the caller make progress
+ *
+ * Listeners sleep until there is something behind their tail, the creator sleeps until there
+ * are @wait->size bytes free. The condition is checked again under the pipe lock, so a wakeup
+ * that raced with us going to sleep can't get lost: the other side bumps its index before it
+ * looks at the waiter counts and takes the same lock to wake us
+ */
+u64 upi_ring_wait(proc_t* proc, lightos_pipe_ring_wait_t* wait)
+{
+    upi_pipe_t* pipe;
+    upi_listener_t* listener;
+    lightos_pipe_ring_t* ring;
+    struct semaphore* sem;
+    bool* p_sleeping;
+
+    pipe = get_upi_pipe(proc, wait->pipe_handle, NULL);
+
+    if (!pipe || !upi_pipe_has_ring(pipe))
+        return DRV_STAT_INVAL;
+
+    ring = pipe->ring;
+
+    mutex_lock(pipe->lock);
+
+    if ((__atomic_load_n(&ring->flags, __ATOMIC_ACQUIRE) & LIGHTOS_PIPE_RING_FLAG_CLOSED) == LIGHTOS_PIPE_RING_FLAG_CLOSED)
+        goto unlock_and_exit_error;
+
+    if (proc == pipe->creator_proc) {
+        if (wait->size > ring->size)
+            goto unlock_and_exit_error;
+
+        if (ring->size - lightos_pipe_ring_used(ring) >= wait->size)
+            goto unlock_and_exit;
+
+        pipe->ring_space_waiting = true;
+        sem = pipe->ring_space_sem;
+        p_sleeping = nullptr;
+    } else {
+        listener = get_upi_listener(pipe, proc);
+
+        if (!listener || !listener->ring_sem)
+            goto unlock_and_exit_error;
+
+        if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != __atomic_load_n(&ring->consumers[listener->ring_slot].tail, __ATOMIC_ACQUIRE))
+            goto unlock_and_exit;
+
+        listener->ring_waiting = true;
+        listener->ring_sleeping = true;
+        sem = listener->ring_sem;
+        p_sleeping = &listener->ring_sleeping;
+    }
+
+    __atomic_add_fetch(&pipe->n_ring_sleepers, 1, __ATOMIC_ACQUIRE);
+
+    mutex_unlock(pipe->lock);
+
+    sem_wait(sem, NULL);
+
+    /* NOTE: The listener and the pipe may be gone as soon as these drop */
+    if (p_sleeping)
+        __atomic_store_n(p_sleeping, false, __ATOMIC_RELEASE);
+
+    __atomic_sub_fetch(&pipe->n_ring_sleepers, 1, __ATOMIC_RELEASE);
+    return 0;
+
+unlock_and_exit:
+    mutex_unlock(pipe->lock);
+    return 0;
+
+unlock_and_exit_error:
+    mutex_unlock(pipe->lock);
+    return DRV_STAT_INVAL;
+}
+
+/*!
+ * @brief: Wake up whoever is waiting on the other side of the ring
+ *
+ * The creator wakes its sleeping listeners, a listener wakes the creator
+ */
+u64 upi_ring_wake(proc_t* proc, HANDLE pipe_handle)
+{
+    upi_pipe_t* pipe;
+
+    pipe = get_upi_pipe(proc, pipe_handle, NULL);
+
+    if (!pipe || !upi_pipe_has_ring(pipe))
+        return DRV_STAT_INVAL;
+
+    mutex_lock(pipe->lock);
+
+    if (proc == pipe->creator_proc) {
+        for (upi_listener_t* i = pipe->listeners; i != nullptr; i = i->next) {
+            if (!i->ring_waiting)
+                continue;
+
+            i->ring_waiting = false;
+            sem_post(i->ring_sem);
+        }
+    } else if (get_upi_listener(pipe, proc) && pipe->ring_space_waiting) {
+        pipe->ring_space_waiting = false;
+        sem_post(pipe->ring_space_sem);
+    }
+
+    mutex_unlock(pipe->lock);
+    return 0;
+}
@@ -25,26 +25,35 @@ static zone_allocator_t* _upi_listener_allocator = NULL;
  * TODO: Graceful driver shutdown
  */
 static upi_pipe_t* _upi_pipe_list;
+/* Only guards the list above. Everything else is locked per pipe */
+static mutex_t* _upi_list_lock;
 
 static inline void __upi_register_pipe(upi_pipe_t* pipe)
 {
+    mutex_lock(_upi_list_lock);
+
     pipe->_upi_next = _upi_pipe_list;
     _upi_pipe_list = pipe;
+
+    mutex_unlock(_upi_list_lock);
 }
 
 static inline void __upi_unregister_pipe(upi_pipe_t* pipe)
 {
-    upi_pipe_t** walker = &_upi_pipe_list;
+    upi_pipe_t** walker;
+
+    mutex_lock(_upi_list_lock);
+
+    walker = &_upi_pipe_list;
 
     while (*walker && *walker != pipe)
         walker = &(*walker)->_upi_next;
 
-    /* Not found */
-    if (!(*walker))
-        return;
-
     /* Do the unlink */
-    *walker = pipe->_upi_next;
+    if (*walker)
+        *walker = pipe->_upi_next;
+
+    mutex_unlock(_upi_list_lock);
 }
 
 static inline void upi_pipe_link_listener(upi_pipe_t* pipe, upi_listener_t* listener)
@@ -97,13 +106,16 @@ upi_listener_t* create_upi_listener(proc_t* proc, upi_pipe_t* pipe, HANDLE pipe_
 
     upi_pipe_link_listener(pipe, ret);
 
+    pipe->n_listeners++;
+
     return ret;
 }
 
 /*!
  * @brief: Kills upi listener memory
  *
- * This also unlinks the listener from its pipe after the handle has been yoinked
+ * This also unlinks the listener from its pipe after the handle has been yoinked. Caller should hold
+ * the pipe lock
  */
 void destroy_upi_listener(upi_pipe_t* pipe, upi_listener_t* listener)
 {
@@ -112,9 +124,14 @@ void destroy_upi_listener(upi_pipe_t* pipe, upi_listener_t* listener)
     if (!listener || !listener->proc)
         return;
 
+    /* Give up our consumer slot, if we had one */
+    upi_ring_detach_listener(pipe, listener);
+
     /* Unlink the listener from it's pipe */
     upi_pipe_unlink_listener(pipe, listener);
 
+    pipe->n_listeners--;
+
     mutex_lock(listener->proc->m_handle_map.lock);
 
     handle = find_khandle(&listener->proc->m_handle_map, listener->pipe_handle);
@@ -155,6 +172,10 @@ bool upi_pipe_can_proc_connect(upi_pipe_t* pipe, proc_t* proc)
     if (get_upi_listener(pipe, proc))
         return false;
 
+    /* The creator is the producer of a ring, it can't consume from it as well */
+    if (upi_pipe_has_ring(pipe) && proc == pipe->creator_proc)
+        return false;
+
     return true;
 }
 
@@ -170,6 +191,11 @@ static void __destroy_upi_pipe(upi_pipe_t* pipe)
     /* Unregister the pipe from UPI */
     __upi_unregister_pipe(pipe);
 
+    /* Get any sleepers out of the driver before we start killing things */
+    upi_pipe_close_ring(pipe);
+
+    mutex_lock(pipe->lock);
+
     /* Remove all instances of this pipe from the creator_procs handle map */
     khandle_map_remove(&pipe->creator_proc->m_handle_map, HNDL_TYPE_UPI_PIPE, pipe);
 
@@ -202,6 +228,12 @@ static void __destroy_upi_pipe(upi_pipe_t* pipe)
         c_listener = next_listener;
     }
 
+    /* Drop our reference to the ring. Processes that still have it mapped keep theirs */
+    upi_pipe_destroy_ring(pipe);
+
+    mutex_unlock(pipe->lock);
+
+    destroy_mutex(pipe->lock);
     zfree_fixed(_upi_pipe_allocator, pipe);
 }
 
@@ -233,11 +265,32 @@ upi_pipe_t* create_upi_pipe(proc_t* proc, lightos_pipe_t __user* upipe)
     ret->n_listeners = 0;
     ret->max_listeners = upipe->max_listeners;
     ret->flags = upipe->flags;
+    ret->uniform_size = upi_pipe_is_uniform(ret) ? upipe->data_size : 0;
+    ret->lock = create_mutex(NULL);
+
+    if (!ret->lock)
+        goto destroy_and_exit;
+
     ret->obj = create_oss_obj(upipe->name);
 
     if (!ret->obj)
         goto destroy_and_exit;
 
+    /*
+     * Single duplex pipes get a ring, unless asked otherwise. Full duplex pipes have more than one
+     * producer, so they keep going through the driver
+     */
+    if ((ret->flags & (LIGHTOS_UPIPE_FLAGS_FULLDUPLEX | LIGHTOS_UPIPE_FLAGS_NORING)) == 0) {
+        if (!ret->max_listeners || ret->max_listeners > LIGHTOS_PIPE_RING_MAX_CONSUMERS)
+            ret->max_listeners = LIGHTOS_PIPE_RING_MAX_CONSUMERS;
+
+        if (upi_pipe_create_ring(ret, upipe))
+            goto destroy_and_exit;
+
+        upipe->max_listeners = ret->max_listeners;
+        goto add_to_node;
+    }
+
     /* Uniform pipes have their own data cache */
     if (upi_pipe_is_uniform(ret)) {
         ret->uniform_allocator = create_zone_allocator(64 * Kib, upipe->data_size, NULL);
@@ -254,6 +307,7 @@ upi_pipe_t* create_upi_pipe(proc_t* proc, lightos_pipe_t __user* upipe)
 
     memset(ret->ft_buffer, 0, sizeof(lightos_pipe_ft_t) * ret->ft_capacity);
 
+add_to_node:
     pipe_node = proc->m_env->node;
 
     /* If we wanted to create a global pipe, try to add it here */
@@ -283,6 +337,11 @@ destroy_and_exit:
     if (ret->ft_buffer)
         kmem_kernel_dealloc((vaddr_t)ret->ft_buffer, sizeof(lightos_pipe_t) * ret->ft_capacity);
 
+    upi_pipe_destroy_ring(ret);
+
+    if (ret->lock)
+        destroy_mutex(ret->lock);
+
     zfree_fixed(_upi_pipe_allocator, ret);
     return nullptr;
 }
@@ -388,6 +447,16 @@ u64 upi_msg(struct aniva_driver* this, driver_control_code_t dcc, void* in_buf,
             return DRV_STAT_INVAL;
 
         return upi_dump_pipe(c_proc, (lightos_pipe_dump_t*)in_buf);
+    case LIGHTOS_UPI_MSG_RING_WAIT:
+        if (in_bsize != sizeof(lightos_pipe_ring_wait_t))
+            return DRV_STAT_INVAL;
+
+        return upi_ring_wait(c_proc, (lightos_pipe_ring_wait_t*)in_buf);
+    case LIGHTOS_UPI_MSG_RING_WAKE:
+        if (in_bsize != sizeof(HANDLE))
+            return DRV_STAT_INVAL;
+
+        return upi_ring_wake(c_proc, *(HANDLE*)in_buf);
     }
 
     return DRV_STAT_INVAL;
@@ -403,6 +472,10 @@ int upi_init(driver_t* this)
     _upi_listener_allocator = NULL;
 
     _upi_pipe_list = NULL;
+    _upi_list_lock = create_mutex(NULL);
+
+    if (!_upi_list_lock)
+        return -KERR_NOMEM;
 
     _upi_pipe_allocator = create_zone_allocator(1 * Mib, sizeof(upi_pipe_t), NULL);
 
@@ -428,8 +501,9 @@ int upi_init(driver_t* this)
 
 int upi_exit()
 {
-    for (upi_pipe_t* pipe = _upi_pipe_list; pipe != nullptr; pipe = pipe->_upi_next)
-        destroy_upi_pipe(pipe);
+    /* Destroying a pipe unlinks it, so keep going until the list is empty */
+    while (_upi_pipe_list)
+        destroy_upi_pipe(_upi_pipe_list);
 
     if (_upi_pipe_allocator)
         destroy_zone_allocator(_upi_pipe_allocator, false);
@@ -438,6 +512,8 @@ int upi_exit()
 
     /* Destroy the oss node for global pipes */
     destroy_oss_node(_upi_pipe_node);
+
+    destroy_mutex(_upi_list_lock);
     return 0;
 }
 
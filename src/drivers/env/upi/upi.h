@@ -5,6 +5,8 @@
 #include "lightos/proc/ipc/pipe/shared.h"
 #include "mem/zalloc/zalloc.h"
 #include "proc/handle.h"
+#include "sync/mutex.h"
+#include "sync/sem.h"
 #include <oss/obj.h>
 #include <proc/proc.h>
 
@@ -24,6 +26,14 @@ typedef struct upi_listener {
     /* The handle of @proc to the pipe this listener is connected to */
     HANDLE pipe_handle;
 
+    /* Our consumer slot inside the pipes ring */
+    u32 ring_slot;
+    /* Set while this listener sleeps in the driver until the ring has something for it */
+    bool ring_waiting;
+    /* Set from going to sleep until we're completely done with @ring_sem */
+    bool ring_sleeping;
+    struct semaphore* ring_sem;
+
     /* Link listeners in a linear fashion */
     struct upi_listener* next;
 
@@ -34,12 +44,14 @@ typedef struct upi_listener {
  * @brief: Kernel-side pipe structure
  *
  * The kernel driver is responsible for acting as a sort of middleman in charge of every user pipe
- * that is created (NOTE: This does make this the most likely performance bottleneck in the future).
- * It keeps track of the transactions present in the pipe and the listeners on the pipe
+ * that is created. It keeps track of the listeners on the pipe and, for pipes without a ring, of the
+ * transactions present in the pipe. Pipes with a ring only come by the driver to connect and to sleep
  */
 typedef struct upi_pipe {
     /* The process 'in charge' of this pipe */
     proc_t* creator_proc;
+    /* Protects the ft buffer, the listeners and the ring bookkeeping of this pipe */
+    mutex_t* lock;
     /* The oss object inside the environment of the creator_proc representing the pipe */
     oss_obj_t* obj;
     /* Flags for this pipe */
@@ -68,6 +80,22 @@ typedef struct upi_pipe {
 
     /* Zone allocator for uniform pipes */
     zone_allocator_t* uniform_allocator;
+    /* Size of every transaction on a uniform pipe */
+    u32 uniform_size;
+
+    /*
+     * Shared ring, if this pipe has one. When it does, transactions never go through the driver and
+     * the ft buffer stays empty. The ring is mapped into the creator and into every listener, where
+     * every mapping holds its own reference to the pages
+     */
+    lightos_pipe_ring_t* ring;
+    /* Size of the ring allocation, header page included */
+    size_t ring_bsize;
+    /* The creator sleeps on this when the ring is full */
+    struct semaphore* ring_space_sem;
+    bool ring_space_waiting;
+    /* Number of processes sleeping inside the driver on this ring */
+    u32 n_ring_sleepers;
 
     u32 max_listeners;
     u32 n_listeners;
@@ -77,6 +105,11 @@ typedef struct upi_pipe {
     struct upi_pipe* _upi_next;
 } upi_pipe_t;
 
+static inline bool upi_pipe_has_ring(upi_pipe_t* pipe)
+{
+    return (pipe->ring != nullptr);
+}
+
 static inline bool upi_pipe_is_uniform(upi_pipe_t* pipe)
 {
     return ((pipe->flags & LIGHTOS_UPIPE_FLAGS_UNIFORM) == LIGHTOS_UPIPE_FLAGS_UNIFORM);
@@ -84,15 +117,13 @@ static inline bool upi_pipe_is_uniform(upi_pipe_t* pipe)
 
 /*!
  * @brief: Grab the internal data size of an uniform pipe
- *
- * NOTE: The zone allocator is also used to store fts, together with the data in blocks
  */
 static inline u32 upi_pipe_get_uniform_datasize(upi_pipe_t* pipe)
 {
-    if (upi_pipe_is_uniform(pipe))
+    if (!upi_pipe_is_uniform(pipe))
         return 0;
 
-    return pipe->uniform_allocator->m_entry_size - sizeof(lightos_pipe_ft_t);
+    return pipe->uniform_size;
 }
 
 extern u64 upi_create_pipe(proc_t* proc, lightos_pipe_t* upipe);
@@ -111,6 +142,15 @@ extern u64 upi_pipe_next_transaction(upi_pipe_t* pipe, u32* p_idx);
 
 extern void upi_destroy_transaction(upi_pipe_t* pipe, lightos_pipe_ft_t* ft);
 
+extern int upi_pipe_create_ring(upi_pipe_t* pipe, lightos_pipe_t* upipe);
+extern void upi_pipe_close_ring(upi_pipe_t* pipe);
+extern void upi_pipe_destroy_ring(upi_pipe_t* pipe);
+extern int upi_ring_attach_listener(upi_pipe_t* pipe, upi_listener_t* listener, lightos_pipe_t* upipe);
+extern void upi_ring_detach_listener(upi_pipe_t* pipe, upi_listener_t* listener);
+extern void upi_ring_dump(upi_pipe_t* pipe, lightos_pipe_dump_t* dump);
+extern u64 upi_ring_wait(proc_t* proc, lightos_pipe_ring_wait_t* wait);
+extern u64 upi_ring_wake(proc_t* proc, HANDLE pipe_handle);
+
 kerror_t upi_maybe_handle_signal_transact(proc_t* calling_proc, lightos_pipe_ft_t* ft);
 
 upi_pipe_t* create_upi_pipe(proc_t* proc, lightos_pipe_t* upipe);
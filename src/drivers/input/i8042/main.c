@@ -229,12 +229,12 @@ static int _exit_i8042()
         destroy_hid_device(s_i8042_device);
     }
 
-    error = irq_deallocate(PS2_KB_IRQ_VEC, i8042_kbd_irq_handler);
+    error = irq_deallocate(PS2_KB_IRQ_VEC, i8042_kbd_irq_handler, NULL);
 
     if (error)
         return error;
 
-    return irq_deallocate(PS2_MOUSE_IRQ_VEC, i8042_mouse_irq_handler);
+    return irq_deallocate(PS2_MOUSE_IRQ_VEC, i8042_mouse_irq_handler, NULL);
 }
 
 /*!
@@ -6,6 +6,7 @@
 #include "dev/usb/xfer.h"
 #include "drivers/usb/ehci/buffer.h"
 #include "drivers/usb/ehci/ehci_spec.h"
+#include "irq/interrupts.h"
 #include "libk/data/linkedlist.h"
 #include "libk/data/queue.h"
 #include "libk/flow/error.h"
@@ -18,6 +19,7 @@
 #include "proc/core.h"
 #include "sched/scheduler.h"
 #include "sync/mutex.h"
+#include "sync/sem.h"
 #include <dev/core.h>
 #include <dev/driver.h>
 #include <stdint.h>
@@ -37,6 +39,7 @@ static pci_dev_id_t ehci_pci_ids[] = {
 };
 
 static int _ehci_remove_async_qh(ehci_hcd_t* ehci, ehci_qh_t* qh);
+static int _ehci_remove_periodic_qh(ehci_hcd_t* ehci, ehci_qh_t* qh);
 
 static inline uint32_t _ehci_get_portsts(void* portreg)
 {
@@ -188,49 +191,37 @@ int ehci_clear_port_feature(ehci_hcd_t* ehci, uint32_t port, uint16_t feature)
     return 0;
 }
 
-static int ehci_interrupt_poll(ehci_hcd_t* ehci)
+/*!
+ * @brief: IRQ handler of the EHCI controller
+ *
+ * We only acknowledge the interrupt and wake up the threads that do the actual work here, since
+ * retiring transfers means taking mutexes and completion callbacks like to queue new transfers.
+ * The line may be shared, so we always let the other handlers have a look too
+ */
+static int ehci_irq_handler(void* ctx)
 {
     uint32_t usbsts;
-    // KLOG_DBG("EHCI: entered the ehci polling routine\n");
-
-    while ((ehci->ehci_flags & EHCI_HCD_FLAG_STOPPING) != EHCI_HCD_FLAG_STOPPING) {
+    ehci_hcd_t* ehci = ctx;
 
-        while (ehci->transfer_list->m_length == 0)
-            scheduler_yield();
+    usbsts = mmio_read_dword(ehci->opregs + EHCI_OPREG_USBSTS) & ehci->cur_interrupt_state;
 
-        usbsts = mmio_read_dword(ehci->opregs + EHCI_OPREG_USBSTS) & 0x3f;
-
-        /*
-        if (usbsts & EHCI_OPREG_USBSTS_USBINT) {
-          KLOG_DBG("EHCI: Finished a transfer!\n");
-        }
-        */
-
-        if (usbsts & EHCI_OPREG_USBSTS_USBERRINT)
-            kernel_panic("EHCI: Got a transfer error!");
-
-        if (usbsts & EHCI_OPREG_USBSTS_PORTCHANGE)
-            KLOG_DBG("EHCI: Port change occured!\n");
+    /* Not for us */
+    if (!usbsts)
+        return 0;
 
-        /*
-        if (usbsts & EHCI_OPREG_USBSTS_FLROLLOVER) {
-            KLOG_DBG("EHCI: Frame List rollover!\n");
-        }
-        */
+    /* Acknowledge */
+    mmio_write_dword(ehci->opregs + EHCI_OPREG_USBSTS, usbsts);
 
-        if (usbsts & EHCI_OPREG_USBSTS_HOSTSYSERR)
-            kernel_panic("EHCI: Host system error (yikes)!\n");
+    if (usbsts & EHCI_OPREG_USBSTS_HOSTSYSERR)
+        kernel_panic("EHCI: Host system error (yikes)!\n");
 
-        if (usbsts & EHCI_OPREG_USBSTS_INTONAA) {
-            KLOG_DBG("EHCI: Advanced the async qh!\n");
-            ehci->n_destroyable_qh++;
-        }
+    /* Transfer errors are picked up per transfer by the finish thread */
+    if (usbsts & (EHCI_OPREG_USBSTS_USBINT | EHCI_OPREG_USBSTS_USBERRINT))
+        sem_post(ehci->xfer_sem);
 
-        mmio_write_dword(ehci->opregs + EHCI_OPREG_USBSTS, usbsts);
+    if (usbsts & EHCI_OPREG_USBSTS_INTONAA)
+        sem_post(ehci->iaa_sem);
 
-        /* Yield a bit */
-        scheduler_yield();
-    }
     return 0;
 }
 
@@ -278,6 +269,8 @@ static inline int ehci_get_finished_transfer(ehci_hcd_t* ehci, ehci_xfer_t** p_x
 {
     ehci_xfer_t* c_e_xfer = nullptr;
 
+    mutex_lock(ehci->transfer_lock);
+
     FOREACH(i, ehci->transfer_list)
     {
         c_e_xfer = i->data;
@@ -292,81 +285,126 @@ static inline int ehci_get_finished_transfer(ehci_hcd_t* ehci, ehci_xfer_t** p_x
         c_e_xfer = nullptr;
     }
 
+    /* Remove from the local transfer list */
+    if (c_e_xfer)
+        list_remove_ex(ehci->transfer_list, c_e_xfer);
+
+    mutex_unlock(ehci->transfer_lock);
+
     /* Nothing to do */
     if (!c_e_xfer)
         return -1;
 
-    /* Remove from the local transfer list */
-    ehci_deq_xfer(ehci, c_e_xfer);
-
     /* Export */
     *p_xfer = c_e_xfer;
 
     return 0;
 }
 
+/*!
+ * @brief: Unlink the qh of a finished transfer from the schedule it's on
+ */
+static void _ehci_retire_xfer(ehci_hcd_t* ehci, ehci_xfer_t* e_xfer)
+{
+    if (e_xfer->xfer->req_type == USB_INT_XFER)
+        _ehci_remove_periodic_qh(ehci, e_xfer->qh);
+    else
+        _ehci_remove_async_qh(ehci, e_xfer->qh);
+}
+
+/*!
+ * @brief: Threaded routine that hands finished transfers back to the usb core
+ *
+ * Sleeps until our IRQ handler tells us the controller completed something
+ */
 static int ehci_transfer_finish_thread(ehci_hcd_t* ehci)
 {
     ehci_xfer_t* c_e_xfer;
     usb_xfer_t* c_usb_xfer;
 
     while ((ehci->ehci_flags & EHCI_HCD_FLAG_STOPPING) != EHCI_HCD_FLAG_STOPPING) {
-        c_e_xfer = nullptr;
-
-        /* Find a finished transfer */
-        while (ehci_get_finished_transfer(ehci, &c_e_xfer))
-            scheduler_yield();
+        sem_wait(ehci->xfer_sem, NULL);
 
-        // KLOG_DBG("EHCI: Finished a transfer\n");
-        c_usb_xfer = c_e_xfer->xfer;
+        /* A single interrupt may cover multiple transfers */
+        while (ehci_get_finished_transfer(ehci, &c_e_xfer) == 0) {
+            c_usb_xfer = c_e_xfer->xfer;
 
-        ehci_xfer_finalise(ehci, c_e_xfer);
+            ehci_xfer_finalise(ehci, c_e_xfer);
 
-        /* Remove from the async link */
-        _ehci_remove_async_qh(ehci, c_e_xfer->qh);
+            /* Remove from the schedule */
+            _ehci_retire_xfer(ehci, c_e_xfer);
 
-        /* Destroy our local transfer struct */
-        destroy_ehci_xfer(ehci, c_e_xfer);
+            /* Destroy our local transfer struct */
+            destroy_ehci_xfer(ehci, c_e_xfer);
 
-        // KLOG_DBG("Completing: %p\n", c_e_xfer);
-        /* Transmit the transfer complete */
-        (void)usb_xfer_complete(c_usb_xfer);
+            /* Transmit the transfer complete */
+            (void)usb_xfer_complete(c_usb_xfer);
+        }
     }
 
     return 0;
 }
 
+/*!
+ * @brief: Wait until the controller can't be holding on to any qh we've unlinked
+ *
+ * Rings the async advance doorbell and waits for the IRQ that follows. The async schedule is walked
+ * after the periodic schedule in every microframe, so this covers the periodic schedule too. When the
+ * async schedule isn't running there is no doorbell to ring, so we just wait out a frame
+ */
+static void _ehci_wait_async_advance(ehci_hcd_t* ehci)
+{
+    uint32_t cmd;
+
+    if ((mmio_read_dword(ehci->opregs + EHCI_OPREG_USBSTS) & EHCI_OPREG_USBSTS_ASSTATUS) != EHCI_OPREG_USBSTS_ASSTATUS) {
+        mdelay(2);
+        return;
+    }
+
+    cmd = mmio_read_dword(ehci->opregs + EHCI_OPREG_USBCMD);
+    mmio_write_dword(ehci->opregs + EHCI_OPREG_USBCMD, cmd | EHCI_OPREG_USBCMD_INT_ON_ASYNC_ADVANCE_DB);
+
+    sem_wait(ehci->iaa_sem, NULL);
+}
+
 /*!
  * @brief: Threaded routine to make sure qheads are safely destroyed
+ *
+ * Every time something gets retired, we grab everything that's queued up for destruction, wait
+ * for the controller to let go of it and then kill the whole batch
  */
 static int ehci_qhead_cleanup_thread(ehci_hcd_t* ehci)
 {
+    ehci_qh_t* batch;
     ehci_qh_t* to_destroy;
 
     while ((ehci->ehci_flags & EHCI_HCD_FLAG_STOPPING) != EHCI_HCD_FLAG_STOPPING) {
+        sem_wait(ehci->cleanup_sem, NULL);
 
-        /* If there was no recent async advance, we can't destroy anything */
-        while (!ehci->n_destroyable_qh)
-            scheduler_yield();
+        batch = nullptr;
 
-        /* Kill all the queue heads until we've depleded them */
-        do {
-            /* Yoink a qh */
-            to_destroy = queue_dequeue(ehci->destroyable_qh_q);
+        mutex_lock(ehci->cleanup_lock);
 
-            /* Fuck */
-            if (!to_destroy)
-                break;
+        /* Yoink all the qhs. They're unlinked, so we can chain them through their next field */
+        while ((to_destroy = queue_dequeue(ehci->destroyable_qh_q))) {
+            to_destroy->next = batch;
+            batch = to_destroy;
+        }
 
-            /* Destroy the qh and clear the async adv flag */
-            (void)destroy_ehci_qh(ehci, to_destroy);
+        mutex_unlock(ehci->cleanup_lock);
 
-        } while (to_destroy);
+        /* Some earlier round already took care of ours */
+        if (!batch)
+            continue;
 
-        /* Ded */
-        ehci->n_destroyable_qh--;
+        _ehci_wait_async_advance(ehci);
 
-        scheduler_yield();
+        while (batch) {
+            to_destroy = batch;
+            batch = batch->next;
+
+            (void)destroy_ehci_qh(ehci, to_destroy);
+        }
     }
     return 0;
 }
@@ -694,13 +732,22 @@ static int ehci_setup(usb_hcd_t* hcd)
     ehci->destroyable_qh_q = create_limitless_queue();
     ehci->transfer_lock = create_mutex(NULL);
     ehci->async_lock = create_mutex(NULL);
-    // ehci->cleanup_lock = create_mutex(NULL);
+    ehci->cleanup_lock = create_mutex(NULL);
+    ehci->xfer_sem = create_semaphore(1, 0, 1);
+    ehci->cleanup_sem = create_semaphore(1, 0, 1);
+    ehci->iaa_sem = create_semaphore(1, 0, 1);
+
+    /* Interrupts get enabled on the HC side in ehci_start */
+    error = pci_device_allocate_irq(hcd->pci_device, 0, IRQHANDLER_FLAG_DIRECT_CALL, ehci_irq_handler, ehci, "EHCI controller");
+
+    if (error)
+        return error;
+
+    /* These sleep until our IRQ handler has work for them */
     ehci->transfer_finish_thread = spawn_thread("EHCI Transfer Finisher", SCHED_PRIO_HIGHEST, (FuncPtr)ehci_transfer_finish_thread, (uintptr_t)ehci);
-    ehci->qhead_cleanup_thread = spawn_thread("EHCI Qhead cleanup", SCHED_PRIO_HIGHEST, (FuncPtr)ehci_qhead_cleanup_thread, (uintptr_t)ehci);
-    /* TODO: Setup actual interrupts */
-    ehci->interrupt_polling_thread = spawn_thread("EHCI Polling", SCHED_PRIO_HIGHEST, (FuncPtr)ehci_interrupt_poll, (uint64_t)ehci);
+    ehci->qhead_cleanup_thread = spawn_thread("EHCI Qhead cleanup", SCHED_PRIO_HIGH, (FuncPtr)ehci_qhead_cleanup_thread, (uintptr_t)ehci);
 
-    ASSERT_MSG(ehci->interrupt_polling_thread, "Failed to spawn the EHCI Polling thread!");
+    ASSERT_MSG(ehci->transfer_finish_thread, "Failed to spawn the EHCI Transfer Finisher thread!");
 
     KLOG_DBG("Done with EHCI initialization\n");
     return 0;
@@ -831,6 +878,31 @@ static int _ehci_remove_async_qh(ehci_hcd_t* ehci, ehci_qh_t* qh)
     return 0;
 }
 
+/*!
+ * @brief: Unlink a qh from the periodic schedule
+ *
+ * Unlike async qhs, we leave the hw link of @qh alone. The HC might be sitting on it right now
+ * and needs to be able to continue down the interrupt tree
+ */
+static int _ehci_remove_periodic_qh(ehci_hcd_t* ehci, ehci_qh_t* qh)
+{
+    mutex_lock(ehci->async_lock);
+
+    if (qh->prev) {
+        qh->prev->next = qh->next;
+        qh->prev->hw_next = qh->hw_next;
+    }
+
+    if (qh->next)
+        qh->next->prev = qh->prev;
+
+    qh->next = nullptr;
+    qh->prev = nullptr;
+
+    mutex_unlock(ehci->async_lock);
+    return 0;
+}
+
 static inline void _ehci_try_enable_async(ehci_hcd_t* ehci)
 {
     uint32_t cmd;
@@ -843,8 +915,8 @@ static inline void _ehci_try_enable_async(ehci_hcd_t* ehci)
     if ((sts & EHCI_OPREG_USBSTS_ASSTATUS) == EHCI_OPREG_USBSTS_ASSTATUS)
         return;
 
-    cmd |= EHCI_OPREG_USBCMD_ASYNC_SCHEDULE_ENABLE | EHCI_OPREG_USBCMD_INT_ON_ASYNC_ADVANCE_DB;
-    mmio_write_dword(ehci->opregs, cmd);
+    cmd |= EHCI_OPREG_USBCMD_ASYNC_SCHEDULE_ENABLE;
+    mmio_write_dword(ehci->opregs + EHCI_OPREG_USBCMD, cmd);
 }
 
 /*!
@@ -907,7 +979,7 @@ static int _ehci_add_async_int_xfer(ehci_hcd_t* ehci, ehci_xfer_t* e_xfer)
     /* Fuck man */
     ASSERT_MSG(interval, "_ehci_add_async_int_xfer: Got a null-interval");
 
-    // mutex_lock(ehci->async_lock);
+    mutex_lock(ehci->async_lock);
 
     link_qh = ehci->interrupt_list[interval - 1];
 
@@ -924,7 +996,7 @@ static int _ehci_add_async_int_xfer(ehci_hcd_t* ehci, ehci_xfer_t* e_xfer)
     link_qh->next = qh;
     link_qh->hw_next = qh->qh_dma;
 
-    // mutex_unlock(ehci->async_lock);
+    mutex_unlock(ehci->async_lock);
     return 0;
 }
 
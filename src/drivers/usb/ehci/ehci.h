@@ -12,6 +12,7 @@
 struct usb_hcd;
 struct usb_device;
 struct usb_xfer;
+struct semaphore;
 
 #define EHCI_SPINUP_LIMIT 16
 
@@ -57,10 +58,16 @@ typedef struct ehci_hcd {
     ehci_qh_t* async;
 
     list_t* transfer_list;
+    /* Queue heads that were unlinked from the schedules, but may still be cached by the HC */
     queue_t* destroyable_qh_q;
-    u32 n_destroyable_qh;
 
-    thread_t* interrupt_polling_thread;
+    /* Posted from our IRQ handler on USBINT/USBERRINT */
+    struct semaphore* xfer_sem;
+    /* Posted when a queue head gets retired */
+    struct semaphore* cleanup_sem;
+    /* Posted from our IRQ handler on an async advance */
+    struct semaphore* iaa_sem;
+
     thread_t* transfer_finish_thread;
     thread_t* qhead_cleanup_thread;
     mutex_t* cleanup_lock;
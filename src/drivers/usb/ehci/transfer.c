@@ -10,6 +10,7 @@
 #include "mem/kmem.h"
 #include "mem/zalloc/zalloc.h"
 #include "sync/mutex.h"
+#include "sync/sem.h"
 #include <libk/math/math.h>
 
 static zone_allocator_t* _ehci_xfer_cache;
@@ -35,10 +36,12 @@ ehci_xfer_t* create_ehci_xfer(struct usb_xfer* xfer, ehci_qh_t* qh, ehci_qtd_t*
 void destroy_ehci_xfer(ehci_hcd_t* ehci, ehci_xfer_t* xfer)
 {
     /* Enqueue the queue head so we can kill it peacefully */
+    mutex_lock(ehci->cleanup_lock);
     queue_enqueue(ehci->destroyable_qh_q, xfer->qh);
+    mutex_unlock(ehci->cleanup_lock);
 
-    if (xfer->xfer->req_type != USB_CTL_XFER)
-        ehci->n_destroyable_qh++;
+    /* Let the cleanup thread know */
+    sem_post(ehci->cleanup_sem);
 
     zfree_fixed(_ehci_xfer_cache, xfer);
 }
@@ -276,11 +279,11 @@ static size_t _ehci_write_qtd_chain(ehci_hcd_t* ehci, ehci_qtd_t* qtd, ehci_qtd_
     written_size = NULL;
 
     do {
-        c_written_size = MIN(bsize, qtd->len);
+        c_written_size = MIN(bsize - written_size, c_qtd->len);
 
         /* Copy the bytes */
         // memcpy(qtd->buffer, buffer + written_size, c_written_size);
-        ehci_scratch_buffer_write_qtd(&ehci->xfer_buf, qtd, buffer + written_size, c_written_size);
+        ehci_scratch_buffer_write_qtd(&ehci->xfer_buf, c_qtd, buffer + written_size, c_written_size);
 
         /* Mark the written bytes */
         written_size += c_written_size;
@@ -324,7 +327,8 @@ static void _ehci_xfer_attach_data_qtds(ehci_hcd_t* ehci, bool data_toggle, ehci
     packet_count = ALIGN_UP(bsize, EHCI_MAX_PACKETSIZE) / EHCI_MAX_PACKETSIZE;
 
     for (size_t i = 0; i < packet_count; i++) {
-        c_packet_size = (bsize - i * EHCI_MAX_PACKETSIZE) % EHCI_MAX_PACKETSIZE;
+        /* Every packet is full, except for maybe the last one */
+        c_packet_size = MIN(bsize - i * EHCI_MAX_PACKETSIZE, EHCI_MAX_PACKETSIZE);
 
         b = _create_ehci_qtd_raw(ehci, c_packet_size, direction == USB_DIRECTION_DEVICE_TO_HOST ? EHCI_QTD_PID_IN : EHCI_QTD_PID_OUT);
 
@@ -409,7 +413,7 @@ int ehci_init_data_queue(ehci_hcd_t* ehci, struct usb_xfer* xfer, struct ehci_xf
     end->hw_token |= EHCI_QTD_IOC;
 
     if (xfer->req_direction == USB_DIRECTION_HOST_TO_DEVICE) {
-        write_size = _ehci_write_qtd_chain(ehci, start, NULL, xfer->req_buffer, xfer->req_direction);
+        write_size = _ehci_write_qtd_chain(ehci, start, NULL, xfer->req_buffer, xfer->req_size);
 
         if (write_size != xfer->req_size)
             return -KERR_INVAL;
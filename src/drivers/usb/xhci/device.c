@@ -0,0 +1,517 @@
+#include "device.h"
+#include "dev/usb/hcd.h"
+#include "dev/usb/spec.h"
+#include "dev/usb/xfer.h"
+#include "libk/flow/error.h"
+#include "libk/io.h"
+#include "libk/math/math.h"
+#include "mem/heap.h"
+#include "mem/kmem.h"
+#include "xhci.h"
+
+/*
+ * Contexts are either 32 or 64 bytes wide, depending on the controller (see HCC_64BYTE_CONTEXT). This
+ * means we can't just index the context structs, so we always go through these
+ */
+static inline void* __xhci_ctx_at(xhci_hcd_t* xhci, void* base, uint32_t idx)
+{
+    return (uint8_t*)base + (idx * xhci->ctx_size);
+}
+
+static inline xhci_ip_ctl_ctx_t* __xhci_input_ctl_ctx(xhci_hcd_t* xhci, xhci_device_t* xdev)
+{
+    return __xhci_ctx_at(xhci, xdev->input_ctx, 0);
+}
+
+static inline xhci_slot_ctx_t* __xhci_input_slot_ctx(xhci_hcd_t* xhci, xhci_device_t* xdev)
+{
+    return __xhci_ctx_at(xhci, xdev->input_ctx, 1);
+}
+
+static inline xhci_endpoint_ctx_t* __xhci_input_ep_ctx(xhci_hcd_t* xhci, xhci_device_t* xdev, uint8_t dci)
+{
+    return __xhci_ctx_at(xhci, xdev->input_ctx, dci + 1);
+}
+
+static inline xhci_slot_ctx_t* __xhci_dev_slot_ctx(xhci_hcd_t* xhci, xhci_device_t* xdev)
+{
+    return __xhci_ctx_at(xhci, xdev->device_ctx, 0);
+}
+
+static inline xhci_endpoint_ctx_t* __xhci_dev_ep_ctx(xhci_hcd_t* xhci, xhci_device_t* xdev, uint8_t dci)
+{
+    return __xhci_ctx_at(xhci, xdev->device_ctx, dci);
+}
+
+static xhci_endpoint_t* create_xhci_endpoint(xhci_hcd_t* xhci, uint8_t dci, uint8_t type, uint16_t max_packet_size)
+{
+    uint32_t ring_type;
+    xhci_endpoint_t* ep;
+
+    switch (type) {
+    case XHCI_EP_TYPE_CTL:
+        ring_type = XHCI_RING_TYPE_CTL;
+        break;
+    case XHCI_EP_TYPE_BULK_IN:
+    case XHCI_EP_TYPE_BULK_OUT:
+        ring_type = XHCI_RING_TYPE_BULC;
+        break;
+    case XHCI_EP_TYPE_INT_IN:
+    case XHCI_EP_TYPE_INT_OUT:
+        ring_type = XHCI_RING_TYPE_INTR;
+        break;
+    default:
+        return nullptr;
+    }
+
+    ep = kmalloc(sizeof(*ep));
+
+    if (!ep)
+        return nullptr;
+
+    memset(ep, 0, sizeof(*ep));
+
+    ep->ring = create_xhci_ring(xhci, XHCI_TRBS_PER_SEGMENT, ring_type);
+
+    if (!ep->ring) {
+        kfree(ep);
+        return nullptr;
+    }
+
+    ep->dci = dci;
+    ep->type = type;
+    ep->max_packet_size = max_packet_size;
+
+    return ep;
+}
+
+static void destroy_xhci_endpoint(xhci_endpoint_t* ep)
+{
+    destroy_xhci_ring(ep->ring);
+    kfree(ep);
+}
+
+/*!
+ * @brief: Allocate the bookkeeping and contexts for a new device on @xhci
+ *
+ * The device does not have a slot yet. That's done by xhci_device_address
+ */
+xhci_device_t* create_xhci_device(xhci_hcd_t* xhci, usb_device_t* udev)
+{
+    xhci_device_t* xdev;
+
+    xdev = kmalloc(sizeof(*xdev));
+
+    if (!xdev)
+        return nullptr;
+
+    memset(xdev, 0, sizeof(*xdev));
+
+    xdev->udev = udev;
+
+    if (kmem_kernel_alloc_range((void**)&xdev->device_ctx, SMALL_PAGE_SIZE, NULL, KMEM_FLAG_KERNEL | KMEM_FLAG_DMA))
+        goto dealloc_and_exit;
+
+    if (kmem_kernel_alloc_range((void**)&xdev->input_ctx, SMALL_PAGE_SIZE, NULL, KMEM_FLAG_KERNEL | KMEM_FLAG_DMA))
+        goto dealloc_dev_ctx;
+
+    memset(xdev->device_ctx, 0, SMALL_PAGE_SIZE);
+    memset(xdev->input_ctx, 0, SMALL_PAGE_SIZE);
+
+    xdev->device_ctx_dma = kmem_to_phys(nullptr, (vaddr_t)xdev->device_ctx);
+    xdev->input_device_ctx_dma = kmem_to_phys(nullptr, (vaddr_t)xdev->input_ctx);
+
+    return xdev;
+
+dealloc_dev_ctx:
+    kmem_kernel_dealloc((vaddr_t)xdev->device_ctx, SMALL_PAGE_SIZE);
+dealloc_and_exit:
+    kfree(xdev);
+    return nullptr;
+}
+
+/*!
+ * @brief: Release the slot of @xdev (if it has one) and free everything
+ */
+void destroy_xhci_device(xhci_hcd_t* xhci, xhci_device_t* xdev)
+{
+    if (xdev->slot) {
+        xhci_exec_cmd(xhci, 0, 0, XHCI_TRB_TYPE(TRB_DISABLE_SLOT) | XHCI_TRB_SLOT_ID(xdev->slot), NULL);
+
+        xhci->devices[xdev->slot] = nullptr;
+        xhci->dctx_array_ptr->dev_ctx_ptrs[xdev->slot] = 0;
+
+        if (xdev->udev)
+            xdev->udev->slot = 0;
+    }
+
+    for (uint32_t i = 0; i < XHCI_MAX_EPS; i++)
+        if (xdev->eps[i])
+            destroy_xhci_endpoint(xdev->eps[i]);
+
+    kmem_kernel_dealloc((vaddr_t)xdev->input_ctx, SMALL_PAGE_SIZE);
+    kmem_kernel_dealloc((vaddr_t)xdev->device_ctx, SMALL_PAGE_SIZE);
+    kfree(xdev);
+}
+
+/*!
+ * @brief: Clear the input context and copy the current slot context into it
+ */
+static void __xhci_prepare_input(xhci_hcd_t* xhci, xhci_device_t* xdev, uint32_t add_flags)
+{
+    memset(xdev->input_ctx, 0, (XHCI_MAX_EPS + 1) * xhci->ctx_size);
+    memcpy(__xhci_input_slot_ctx(xhci, xdev), __xhci_dev_slot_ctx(xhci, xdev), sizeof(xhci_slot_ctx_t));
+
+    __xhci_input_ctl_ctx(xhci, xdev)->add_flags = add_flags;
+}
+
+static uint8_t __xhci_usb_speed_id(enum USB_SPEED speed)
+{
+    switch (speed) {
+    case USB_LOWSPEED:
+        return XHCI_SPEED_LOW;
+    case USB_FULLSPEED:
+        return XHCI_SPEED_FULL;
+    case USB_HIGHSPEED:
+        return XHCI_SPEED_HIGH;
+    case USB_SUPERSPEED:
+        return XHCI_SPEED_SUPER;
+    }
+
+    return XHCI_SPEED_FULL;
+}
+
+/*!
+ * @brief: Find out where on the bus @xdev lives
+ *
+ * Walks up the hub chain to find the root port and builds the route string on the way. Tier 1
+ * (the port on the hub right below the roothub) lives in the lowest nibble
+ */
+static int __xhci_device_route(xhci_hcd_t* xhci, xhci_device_t* xdev)
+{
+    uint32_t depth = 0;
+    uint32_t portsc;
+    uint8_t ports[5];
+    usb_device_t* c_dev = xdev->udev;
+    usb_hub_t* rhub = xhci->rhub->phub;
+
+    while (c_dev->hub && c_dev->hub != rhub) {
+        /* The route string only has room for 5 tiers */
+        if (depth >= sizeof(ports))
+            return -KERR_RANGE;
+
+        ports[depth++] = MIN(c_dev->dev_port, 15);
+        c_dev = c_dev->hub->udev;
+
+        if (!c_dev)
+            return -KERR_INVAL;
+    }
+
+    if (!c_dev->dev_port || c_dev->dev_port > xhci->max_ports)
+        return -KERR_RANGE;
+
+    xdev->root_port = c_dev->dev_port;
+    xdev->route = 0;
+
+    while (depth)
+        xdev->route = (xdev->route << 4) | ports[--depth];
+
+    xdev->speed_id = __xhci_usb_speed_id(xdev->udev->speed);
+
+    /* Devices on the root ports can tell us their speed directly */
+    if (xdev->udev->hub == rhub) {
+        portsc = mmio_read_dword(&xhci->op_regs->ports[xdev->root_port - 1].port_status_base);
+
+        if ((portsc >> XHCI_PORT_SPEED_OFFSET) & XHCI_PORT_SPEED_MASK)
+            xdev->speed_id = (portsc >> XHCI_PORT_SPEED_OFFSET) & XHCI_PORT_SPEED_MASK;
+    }
+
+    return 0;
+}
+
+/*!
+ * @brief: Max packet size we use for ep0 until the device descriptor tells us better
+ */
+static uint16_t __xhci_default_ep0_mps(uint8_t speed_id)
+{
+    switch (speed_id) {
+    case XHCI_SPEED_LOW:
+        return 8;
+    case XHCI_SPEED_FULL:
+    case XHCI_SPEED_HIGH:
+        return 64;
+    }
+
+    return 512;
+}
+
+/*!
+ * @brief: Give @xdev a slot and an address
+ *
+ * Does the Enable Slot and Address Device commands. The controller picks the address itself, so the
+ * address the usb core gives a device is only meaningful to the core
+ */
+int xhci_device_address(xhci_hcd_t* xhci, xhci_device_t* xdev)
+{
+    int error;
+    uint32_t slot;
+    xhci_slot_ctx_t* slot_ctx;
+    xhci_endpoint_ctx_t* ep_ctx;
+    xhci_endpoint_t* ep0;
+    xhci_device_t* hub_xdev;
+
+    error = __xhci_device_route(xhci, xdev);
+
+    if (error)
+        return error;
+
+    error = xhci_exec_cmd(xhci, 0, 0, XHCI_TRB_TYPE(TRB_ENABLE_SLOT), &slot);
+
+    if (error)
+        return error;
+
+    if (!slot || slot >= XHCI_MAX_HC_SLOTS || slot > xhci->max_slots)
+        return -KERR_RANGE;
+
+    xdev->slot = slot;
+
+    ep0 = create_xhci_endpoint(xhci, 1, XHCI_EP_TYPE_CTL, __xhci_default_ep0_mps(xdev->speed_id));
+
+    if (!ep0) {
+        error = -KERR_NOMEM;
+        goto disable_slot;
+    }
+
+    xdev->eps[1] = ep0;
+
+    __xhci_prepare_input(xhci, xdev, XHCI_INPUT_CTX_FLAG(0) | XHCI_INPUT_CTX_FLAG(1));
+
+    slot_ctx = __xhci_input_slot_ctx(xhci, xdev);
+    slot_ctx->dev_info = SLOT_0_ROUTE(xdev->route) | SLOT_0_SPEED(xdev->speed_id) | SLOT_0_NUM_ENTRIES(1);
+    slot_ctx->dev_info2 = SLOT_1_RH_PORT(xdev->root_port);
+    slot_ctx->tt_info = SLOT_2_IRQ_TARGET(0);
+
+    /* Low- and fullspeed devices behind a highspeed hub talk through the transaction translator of that hub */
+    if (xdev->speed_id == XHCI_SPEED_LOW || xdev->speed_id == XHCI_SPEED_FULL) {
+        hub_xdev = xdev->udev->hub ? xhci_get_device(xhci, xdev->udev->hub->udev) : nullptr;
+
+        if (hub_xdev && hub_xdev->speed_id == XHCI_SPEED_HIGH)
+            slot_ctx->tt_info |= SLOT_2_TT_HUB_SLOT(hub_xdev->slot) | SLOT_2_PORT_NUM(xdev->udev->dev_port);
+    }
+
+    ep_ctx = __xhci_input_ep_ctx(xhci, xdev, 1);
+    ep_ctx->ep_info2 = ENDPOINT_1_CERR(3) | ENDPOINT_1_EPTYPE(XHCI_EP_TYPE_CTL) | ENDPOINT_1_MAXPACKETSIZE(ep0->max_packet_size);
+    ep_ctx->deq_ptr = xhci_ring_trb_dma(ep0->ring, ep0->ring->enqueue) | ENDPOINT_2_DCS_BIT;
+    ep_ctx->tx_info = ENDPOINT_4_AVGTRBLENGTH(8);
+
+    xhci->dctx_array_ptr->dev_ctx_ptrs[slot] = xdev->device_ctx_dma;
+    xhci->devices[slot] = xdev;
+
+    error = xhci_exec_cmd(xhci, xdev->input_device_ctx_dma, 0, XHCI_TRB_TYPE(TRB_ADDR_DEV) | XHCI_TRB_SLOT_ID(slot), NULL);
+
+    if (error)
+        goto disable_slot;
+
+    xdev->addr = SLOT_3_DEVICE_ADDRESS_GET(__xhci_dev_slot_ctx(xhci, xdev)->dev_state);
+    xdev->udev->slot = slot;
+
+    return 0;
+
+disable_slot:
+    xhci_exec_cmd(xhci, 0, 0, XHCI_TRB_TYPE(TRB_DISABLE_SLOT) | XHCI_TRB_SLOT_ID(slot), NULL);
+
+    xhci->devices[slot] = nullptr;
+    xhci->dctx_array_ptr->dev_ctx_ptrs[slot] = 0;
+    xdev->slot = 0;
+
+    if (xdev->eps[1])
+        destroy_xhci_endpoint(xdev->eps[1]);
+
+    xdev->eps[1] = nullptr;
+    return error;
+}
+
+/*!
+ * @brief: Tell the controller about the real max packet size of ep0
+ *
+ * We only know this after the first GET_DESCRIPTOR, so this does an Evaluate Context when it changed
+ */
+int xhci_device_update_ep0(xhci_hcd_t* xhci, xhci_device_t* xdev, uint16_t max_packet_size)
+{
+    int error;
+    xhci_endpoint_ctx_t* ep_ctx;
+    xhci_endpoint_t* ep0 = xdev->eps[1];
+
+    if (!ep0 || !max_packet_size)
+        return -KERR_INVAL;
+
+    if (ep0->max_packet_size == max_packet_size)
+        return 0;
+
+    __xhci_prepare_input(xhci, xdev, XHCI_INPUT_CTX_FLAG(1));
+
+    ep_ctx = __xhci_input_ep_ctx(xhci, xdev, 1);
+
+    memcpy(ep_ctx, __xhci_dev_ep_ctx(xhci, xdev, 1), sizeof(*ep_ctx));
+
+    ep_ctx->ep_info2 &= ~ENDPOINT_1_MAXPACKETSIZE(0xffff);
+    ep_ctx->ep_info2 |= ENDPOINT_1_MAXPACKETSIZE(max_packet_size);
+
+    error = xhci_exec_cmd(xhci, xdev->input_device_ctx_dma, 0, XHCI_TRB_TYPE(TRB_EVAL_CONTEX) | XHCI_TRB_SLOT_ID(xdev->slot), NULL);
+
+    if (error)
+        return error;
+
+    ep0->max_packet_size = max_packet_size;
+    return 0;
+}
+
+/*!
+ * @brief: Convert the bInterval of @xfer to the exponent the endpoint context wants
+ *
+ * The endpoint context takes 2^interval * 125us. High- and superspeed endpoints already give
+ * us an exponent (+1), low- and fullspeed endpoints give us a number of 1ms frames
+ */
+static uint8_t __xhci_ep_interval(xhci_device_t* xdev, usb_xfer_t* xfer)
+{
+    uint32_t exp;
+    uint32_t microframes;
+
+    if (xfer->req_type != USB_INT_XFER)
+        return 0;
+
+    if (xdev->speed_id == XHCI_SPEED_HIGH || xdev->speed_id >= XHCI_SPEED_SUPER)
+        return MIN(MAX(xfer->xfer_interval, 1), 16) - 1;
+
+    microframes = MAX(xfer->xfer_interval, 1) * 8;
+
+    for (exp = 0; (1U << (exp + 1)) <= microframes; exp++)
+        ;
+
+    return MIN(MAX(exp, 3), 10);
+}
+
+/*!
+ * @brief: Add the endpoint that @xfer talks to to @xdev
+ *
+ * Endpoints are configured the first time something gets queued on them
+ */
+int xhci_device_configure_ep(xhci_hcd_t* xhci, xhci_device_t* xdev, usb_xfer_t* xfer, uint8_t dci)
+{
+    int error;
+    bool in = (dci & 1) == 1;
+    uint8_t type;
+    uint16_t mps;
+    xhci_endpoint_t* ep;
+    xhci_slot_ctx_t* slot_ctx;
+    xhci_endpoint_ctx_t* ep_ctx;
+
+    if (dci < 2 || dci >= XHCI_MAX_EPS || xdev->eps[dci])
+        return -KERR_INVAL;
+
+    switch (xfer->req_type) {
+    case USB_BULK_XFER:
+        type = in ? XHCI_EP_TYPE_BULK_IN : XHCI_EP_TYPE_BULK_OUT;
+        break;
+    case USB_INT_XFER:
+        type = in ? XHCI_EP_TYPE_INT_IN : XHCI_EP_TYPE_INT_OUT;
+        break;
+    default:
+        return -KERR_INVAL;
+    }
+
+    mps = xfer->req_max_packet_size ? xfer->req_max_packet_size : 8;
+    ep = create_xhci_endpoint(xhci, dci, type, mps);
+
+    if (!ep)
+        return -KERR_NOMEM;
+
+    __xhci_prepare_input(xhci, xdev, XHCI_INPUT_CTX_FLAG(0) | XHCI_INPUT_CTX_FLAG(dci));
+
+    slot_ctx = __xhci_input_slot_ctx(xhci, xdev);
+
+    if (SLOT_0_NUM_ENTRIES_GET(slot_ctx->dev_info) < dci) {
+        slot_ctx->dev_info &= ~SLOT_0_NUM_ENTRIES(0x1f);
+        slot_ctx->dev_info |= SLOT_0_NUM_ENTRIES(dci);
+    }
+
+    ep_ctx = __xhci_input_ep_ctx(xhci, xdev, dci);
+    ep_ctx->ep_info = ENDPOINT_0_INTERVAL(__xhci_ep_interval(xdev, xfer));
+    ep_ctx->ep_info2 = ENDPOINT_1_CERR(3) | ENDPOINT_1_EPTYPE(type) | ENDPOINT_1_MAXPACKETSIZE(mps);
+    ep_ctx->deq_ptr = xhci_ring_trb_dma(ep->ring, ep->ring->enqueue) | ENDPOINT_2_DCS_BIT;
+
+    if (xfer->req_type == USB_INT_XFER)
+        ep_ctx->tx_info = ENDPOINT_4_AVGTRBLENGTH(mps) | ENDPOINT_4_MAXESITPAYLOAD(mps);
+    else
+        ep_ctx->tx_info = ENDPOINT_4_AVGTRBLENGTH(3 * Kib);
+
+    error = xhci_exec_cmd(xhci, xdev->input_device_ctx_dma, 0, XHCI_TRB_TYPE(TRB_CONFIG_EP) | XHCI_TRB_SLOT_ID(xdev->slot), NULL);
+
+    if (error) {
+        destroy_xhci_endpoint(ep);
+        return error;
+    }
+
+    xdev->eps[dci] = ep;
+    return 0;
+}
+
+/*!
+ * @brief: Point the controller at the current dequeue pointer of @ep
+ *
+ * The endpoint needs to be stopped or halted for this
+ */
+int xhci_device_set_ep_deq(xhci_hcd_t* xhci, xhci_device_t* xdev, xhci_endpoint_t* ep)
+{
+    paddr_t deq;
+    uint32_t cycle;
+    xhci_ring_t* ring = ep->ring;
+
+    spinlock_lock(xhci->event_lock);
+
+    /* A dequeue pointer past our enqueue pointer is still on the previous lap of the ring */
+    cycle = ring->ring_cycle;
+
+    if (ring->dequeue > ring->enqueue)
+        cycle ^= 1;
+
+    deq = xhci_ring_trb_dma(ring, ring->dequeue) | cycle;
+
+    spinlock_unlock(xhci->event_lock);
+
+    return xhci_exec_cmd(xhci, deq, 0, XHCI_TRB_TYPE(TRB_SET_DEQ) | XHCI_TRB_EP_ID(ep->dci) | XHCI_TRB_SLOT_ID(xdev->slot), NULL);
+}
+
+/*!
+ * @brief: Get @ep going again after it halted
+ *
+ * The event handler already moved the ring dequeue pointer past the td that halted the endpoint,
+ * so we continue with whatever was queued after it
+ */
+int xhci_device_reset_ep(xhci_hcd_t* xhci, xhci_device_t* xdev, xhci_endpoint_t* ep)
+{
+    int error;
+    bool pending;
+
+    /* This fails when the endpoint wasn't halted in the first place, which is fine */
+    xhci_exec_cmd(xhci, 0, 0, XHCI_TRB_TYPE(TRB_RESET_EP) | XHCI_TRB_EP_ID(ep->dci) | XHCI_TRB_SLOT_ID(xdev->slot), NULL);
+
+    error = xhci_device_set_ep_deq(xhci, xdev, ep);
+
+    if (error)
+        return error;
+
+    spinlock_lock(xhci->event_lock);
+    pending = (ep->td_busy != ep->td_tail);
+    spinlock_unlock(xhci->event_lock);
+
+    if (pending)
+        xhci_ring_doorbell(xhci, xdev->slot, ep->dci, 0);
+
+    return 0;
+}
+
+int xhci_device_stop_ep(xhci_hcd_t* xhci, xhci_device_t* xdev, xhci_endpoint_t* ep)
+{
+    return xhci_exec_cmd(xhci, 0, 0, XHCI_TRB_TYPE(TRB_STOP_RING) | XHCI_TRB_EP_ID(ep->dci) | XHCI_TRB_SLOT_ID(xdev->slot), NULL);
+}
@@ -5,14 +5,51 @@
 #include "drivers/usb/xhci/xhci.h"
 #include <libk/stddef.h>
 
+/* Protocol speed ids, as found in the PORTSC speed field and in the slot context */
+#define XHCI_SPEED_FULL 1
+#define XHCI_SPEED_LOW 2
+#define XHCI_SPEED_HIGH 3
+#define XHCI_SPEED_SUPER 4
+
+/* Max amount of transfers that can be in flight on a single endpoint */
+#define XHCI_EP_MAX_TDS 16
+
+/*
+ * Endpoint on a xHC device
+ *
+ * tds are used in ring order. td_head is the oldest td that wasn't handed back to its usb_xfer yet,
+ * td_busy is the oldest td the controller is still working on and td_tail is where the next td goes
+ */
+typedef struct xhci_endpoint {
+    xhci_ring_t* ring;
+
+    xhci_td_t tds[XHCI_EP_MAX_TDS];
+    uint32_t td_head;
+    uint32_t td_busy;
+    uint32_t td_tail;
+
+    uint16_t max_packet_size;
+    uint8_t type;
+    uint8_t dci;
+} xhci_endpoint_t;
+
+static inline xhci_td_t* xhci_ep_get_td(xhci_endpoint_t* ep, uint32_t idx)
+{
+    return &ep->tds[idx % XHCI_EP_MAX_TDS];
+}
+
 /*
  * Device on a xHC HCD
  */
 typedef struct xhci_device {
     uint8_t slot, addr;
+    /* Root hub port this device hangs off of (1-based) and its xhci speed id */
+    uint8_t root_port;
+    uint8_t speed_id;
+    uint32_t route;
 
-    /* The rings for the endpoints on this device */
-    xhci_ring_t* ep_rings;
+    /* The endpoints of this device, indexed by device context index */
+    xhci_endpoint_t* eps[XHCI_MAX_EPS];
 
     /* This devices context */
     paddr_t device_ctx_dma;
@@ -25,6 +62,36 @@ typedef struct xhci_device {
     usb_device_t* udev;
 } xhci_device_t;
 
-xhci_device_t* create_xhci_device();
+xhci_device_t* create_xhci_device(xhci_hcd_t* xhci, usb_device_t* udev);
+void destroy_xhci_device(xhci_hcd_t* xhci, xhci_device_t* xdev);
+
+int xhci_device_address(xhci_hcd_t* xhci, xhci_device_t* xdev);
+int xhci_device_update_ep0(xhci_hcd_t* xhci, xhci_device_t* xdev, uint16_t max_packet_size);
+int xhci_device_configure_ep(xhci_hcd_t* xhci, xhci_device_t* xdev, usb_xfer_t* xfer, uint8_t dci);
+int xhci_device_reset_ep(xhci_hcd_t* xhci, xhci_device_t* xdev, xhci_endpoint_t* ep);
+int xhci_device_stop_ep(xhci_hcd_t* xhci, xhci_device_t* xdev, xhci_endpoint_t* ep);
+int xhci_device_set_ep_deq(xhci_hcd_t* xhci, xhci_device_t* xdev, xhci_endpoint_t* ep);
+
+static inline xhci_device_t* xhci_get_device(xhci_hcd_t* xhci, usb_device_t* udev)
+{
+    if (!udev || !udev->slot || udev->slot >= XHCI_MAX_HC_SLOTS)
+        return nullptr;
+
+    return xhci->devices[udev->slot];
+}
+
+/* Device context index of an endpoint */
+static inline uint8_t xhci_ep_dci(uint8_t ep_num, bool in)
+{
+    if (!ep_num)
+        return 1;
+
+    return (ep_num * 2) + (in ? 1 : 0);
+}
+
+/* transfer.c */
+int xhci_queue_ctl_xfer(xhci_hcd_t* xhci, xhci_device_t* xdev, usb_xfer_t* xfer);
+int xhci_queue_data_xfer(xhci_hcd_t* xhci, xhci_device_t* xdev, usb_xfer_t* xfer);
+int xhci_cancel_xfer(xhci_hcd_t* xhci, xhci_device_t* xdev, usb_xfer_t* xfer);
 
 #endif // !__ANIVA_DEV_USB_XHCI_DEVICE__
@@ -1,30 +1,294 @@
-
+#include "dev/usb/xfer.h"
+#include "device.h"
 #include "libk/flow/error.h"
-#include "sched/scheduler.h"
+#include "libk/io.h"
+#include "sync/sem.h"
 #include "xhci.h"
 
 /*!
- * @brief: Main entrypoint for our event probe thread
+ * @brief: Translate the dma address of an event back to the trb on @ring
+ */
+static xhci_trb_t* __xhci_event_trb(xhci_ring_t* ring, paddr_t dma)
+{
+    if (dma < ring->ring_dma || dma >= ring->ring_dma + ring->ring_size)
+        return nullptr;
+
+    return (xhci_trb_t*)((uintptr_t)ring->ring_buffer + (dma - ring->ring_dma));
+}
+
+/*!
+ * @brief: Count how many bytes made it through a td that ended on a short packet at @target
  */
-void _xhci_event_poll(xhci_hcd_t* xhci)
+static uint32_t __xhci_td_count_bytes(xhci_ring_t* ring, xhci_td_t* td, xhci_trb_t* target, uint32_t residual)
 {
-    uint32_t type;
-    xhci_ring_t* event_ring;
+    uint32_t total = 0;
+    uint32_t len;
+    xhci_trb_t* c_trb = td->data_trb;
+
+    if (!c_trb || !target)
+        return 0;
+
+    while (c_trb != target) {
+        /* Target is not in this td's data stage */
+        if (c_trb == td->next_trb)
+            return 0;
+
+        total += XHCI_TRB_LEN(c_trb->status);
+        c_trb = xhci_ring_next(ring, c_trb);
+    }
+
+    len = XHCI_TRB_LEN(target->status);
+
+    return total + (residual < len ? len - residual : 0);
+}
+
+/*!
+ * @brief: Move the oldest busy td of @ep to the finished list
+ *
+ * Called with the event lock held
+ */
+static void __xhci_finish_td(xhci_hcd_t* xhci, xhci_endpoint_t* ep, xhci_td_t* td, uint32_t comp_code)
+{
+    td->comp_code = comp_code;
+
+    if ((td->flags & XHCI_TD_FLAG_SHORT) != XHCI_TD_FLAG_SHORT)
+        td->actual_len = (comp_code == XHCI_COMP_SUCCESS) ? td->len : 0;
+
+    ep->ring->dequeue = td->next_trb;
+    ep->td_busy++;
+
+    td->done_next = nullptr;
+
+    if (xhci->done_tds_tail)
+        xhci->done_tds_tail->done_next = td;
+    else
+        xhci->done_tds = td;
+
+    xhci->done_tds_tail = td;
+}
+
+/*!
+ * @brief: Handle a transfer event
+ *
+ * tds on an endpoint complete in order, so the event is always about the oldest busy td of the endpoint
+ *
+ * @returns: True if a td finished
+ */
+static bool __xhci_handle_xfer_event(xhci_hcd_t* xhci, xhci_trb_t* event)
+{
+    uint32_t slot = XHCI_EVT_SLOT_ID(event->control);
+    uint32_t dci = XHCI_EVT_EP_ID(event->control);
+    uint32_t code = XHCI_EVT_COMP_CODE(event->status);
+    xhci_device_t* xdev;
+    xhci_endpoint_t* ep;
+    xhci_td_t* td;
+
+    if (!slot || slot >= XHCI_MAX_HC_SLOTS || dci >= XHCI_MAX_EPS)
+        return false;
+
+    xdev = xhci->devices[slot];
+
+    if (!xdev || !xdev->eps[dci])
+        return false;
+
+    ep = xdev->eps[dci];
+
+    if (ep->td_busy == ep->td_tail)
+        return false;
+
+    /* We stopped the endpoint ourselves. Whoever did that cleans up the ring */
+    if (code == XHCI_COMP_STOPPED || code == XHCI_COMP_STOPPED_LEN_INVALID)
+        return false;
+
+    td = xhci_ep_get_td(ep, ep->td_busy);
+
+    switch (code) {
+    case XHCI_COMP_SHORT_PACKET:
+        td->flags |= XHCI_TD_FLAG_SHORT;
+        td->actual_len = __xhci_td_count_bytes(ep->ring, td, __xhci_event_trb(ep->ring, event->addr), XHCI_EVT_RESIDUAL(event->status));
+
+        /* The status stage of a control transfer still gets its own event */
+        if ((td->flags & XHCI_TD_FLAG_CTL) == XHCI_TD_FLAG_CTL && event->addr != td->last_trb_dma)
+            return false;
+
+        code = XHCI_COMP_SUCCESS;
+        break;
+    case XHCI_COMP_SUCCESS:
+        if (event->addr != td->last_trb_dma)
+            return false;
+        break;
+    case XHCI_COMP_STALL:
+    case XHCI_COMP_BABBLE:
+    case XHCI_COMP_TRANSACTION:
+        /* These halt the endpoint */
+        td->flags |= XHCI_TD_FLAG_HALTED;
+        break;
+    default:
+        break;
+    }
+
+    __xhci_finish_td(xhci, ep, td, code);
+    return true;
+}
+
+/*!
+ * @brief: Handle a command completion event
+ *
+ * @returns: True if this completed the command we're waiting on
+ */
+static bool __xhci_handle_cmd_event(xhci_hcd_t* xhci, xhci_trb_t* event)
+{
+    xhci_cmd_t* cmd = xhci->pending_cmd;
+
+    if (!cmd || cmd->trb_dma != event->addr)
+        return false;
+
+    cmd->comp_code = XHCI_EVT_COMP_CODE(event->status);
+    cmd->slot_id = XHCI_EVT_SLOT_ID(event->control);
 
-    event_ring = xhci->interrupter->event_ring;
+    xhci->pending_cmd = nullptr;
+    return true;
+}
+
+/*!
+ * @brief: Walk the event ring until we've caught up with the controller
+ */
+static void __xhci_process_events(xhci_hcd_t* xhci)
+{
+    bool cmd_done = false;
+    bool xfer_done = false;
+    xhci_trb_t event;
+    xhci_interrupter_t* itr = xhci->interrupter;
+    xhci_ring_t* ring = itr->event_ring;
 
-    event_ring->ring_cycle = 1;
+    spinlock_lock(xhci->event_lock);
 
-    /* Loop forever and check the event status bits on the hcd */
-    do {
-        if ((event_ring->dequeue->control & 1) != event_ring->ring_cycle) {
-            scheduler_yield();
-            continue;
+    while (xhci_ring_dequeue(xhci, ring, &event) == 0) {
+        switch (XHCI_TRB_FIELD_TO_TYPE(event.control)) {
+        case TRB_COMPLETION:
+            cmd_done |= __xhci_handle_cmd_event(xhci, &event);
+            break;
+        case TRB_TRANSFER:
+            xfer_done |= __xhci_handle_xfer_event(xhci, &event);
+            break;
+        default:
+            /* Port changes are picked up by the hub enumeration, which polls the ports */
+            break;
         }
+    }
+
+    /* Tell the controller how far we got and clear the event handler busy bit */
+    mmio_write_qword(&itr->ir_regs->erst_dequeue, xhci_ring_trb_dma(ring, ring->dequeue) | XHCI_ERDP_EHB);
+
+    spinlock_unlock(xhci->event_lock);
+
+    if (cmd_done)
+        sem_post(xhci->cmd_sem);
+
+    if (xfer_done)
+        sem_post(xhci->done_sem);
+}
+
+/*!
+ * @brief: IRQ handler of the xhci interrupter
+ *
+ * The line might be shared with other devices, so we always return 0 to let the other handlers
+ * have a look too
+ */
+int xhci_irq_handler(void* ctx)
+{
+    uint32_t status;
+    uint32_t iman;
+    xhci_hcd_t* xhci = ctx;
+
+    if (!xhci || !xhci->interrupter)
+        return 0;
+
+    status = mmio_read_dword(&xhci->op_regs->status);
+
+    /* Not ours (or the controller is gone) */
+    if (status == ~(uint32_t)0 || (status & XHCI_STS_EINT) != XHCI_STS_EINT)
+        return 0;
+
+    /* Acknowledge before we walk the ring, so events that come in while we're at it raise a new interrupt */
+    mmio_write_dword(&xhci->op_regs->status, XHCI_STS_EINT);
+
+    iman = mmio_read_dword(&xhci->interrupter->ir_regs->irq_pending);
+    mmio_write_dword(&xhci->interrupter->ir_regs->irq_pending, XHCI_ER_IRQ_ACK(iman));
+
+    __xhci_process_events(xhci);
+    return 0;
+}
+
+static xhci_td_t* __xhci_take_done_td(xhci_hcd_t* xhci)
+{
+    xhci_td_t* td;
+
+    spinlock_lock(xhci->event_lock);
+
+    td = xhci->done_tds;
+
+    if (td) {
+        xhci->done_tds = td->done_next;
+
+        if (!xhci->done_tds)
+            xhci->done_tds_tail = nullptr;
+    }
+
+    spinlock_unlock(xhci->event_lock);
+
+    return td;
+}
+
+/*!
+ * @brief: Hand a finished td back to its usb_xfer
+ */
+static void __xhci_complete_td(xhci_hcd_t* xhci, xhci_td_t* td)
+{
+    usb_xfer_t* xfer = td->xfer;
+    xhci_device_t* xdev = td->xdev;
+    xhci_endpoint_t* ep = td->ep;
+    uint32_t flags = td->flags;
+    uint32_t code = td->comp_code;
+    uint32_t actual_len = td->actual_len;
+
+    /* Release the td before completing, since completion callbacks like to requeue right away */
+    spinlock_lock(xhci->event_lock);
+    ep->td_head++;
+    spinlock_unlock(xhci->event_lock);
+
+    if ((flags & XHCI_TD_FLAG_HALTED) == XHCI_TD_FLAG_HALTED)
+        xhci_device_reset_ep(xhci, xdev, ep);
+
+    if (xfer->req_direction == USB_DIRECTION_DEVICE_TO_HOST)
+        xfer->resp_transfer_size = actual_len;
+    else
+        xfer->req_tranfered_size = actual_len;
+
+    xfer->xfer_flags |= USB_XFER_FLAG_DONE;
+
+    if ((flags & XHCI_TD_FLAG_CANCELED) == XHCI_TD_FLAG_CANCELED)
+        xfer->xfer_flags |= USB_XFER_FLAG_CANCELED | USB_XFER_FLAG_ERROR;
+    else if (code != XHCI_COMP_SUCCESS)
+        xfer->xfer_flags |= USB_XFER_FLAG_ERROR;
+
+    usb_xfer_complete(xfer);
+}
+
+/*!
+ * @brief: Main entrypoint for our transfer finish thread
+ *
+ * The IRQ handler queues up finished tds and posts the done semaphore. We complete them
+ * here, outside of IRQ context
+ */
+void _xhci_trf_finish(xhci_hcd_t* xhci)
+{
+    xhci_td_t* td;
 
-        type = XHCI_TRB_FIELD_TO_TYPE(event_ring->dequeue->control);
+    while (true) {
+        sem_wait(xhci->done_sem, NULL);
 
-        printf("TYpe=%d\n", type);
-        kernel_panic("Got an event!");
-    } while (true);
+        while ((td = __xhci_take_done_td(xhci)))
+            __xhci_complete_td(xhci, td);
+    }
 }
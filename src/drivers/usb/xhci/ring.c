@@ -39,12 +39,14 @@ xhci_ring_t* create_xhci_ring(xhci_hcd_t* hcd, uint32_t trb_count, uint32_t type
 
     ret->enqueue = ret->ring_buffer;
     ret->dequeue = ret->enqueue;
+    ret->ring_cycle = 1;
 
-    last = (ret->ring_buffer + ret->ring_size) - sizeof(xhci_trb_t);
+    last = (xhci_trb_t*)ret->ring_buffer + (xhci_ring_nr_trbs(ret) - 1);
 
     if (type != XHCI_RING_TYPE_EVENT) {
-        /* Link the last address back */
+        /* Link the last address back and flip the cycle state every time the controller passes it */
         last->addr = ret->ring_dma;
+        last->control = XHCI_TRB_TYPE(TRB_LIN) | XHCI_TRB_TOGGLE_CYCLE;
     }
 
     ret->last_trb = last;
@@ -58,40 +60,136 @@ void destroy_xhci_ring(xhci_ring_t* ring)
     kzfree(ring, sizeof(xhci_ring_t));
 }
 
+/*!
+ * @brief: Get the trb that comes after @trb on a producer ring
+ *
+ * Follows the link trb back to the start of the segment
+ */
+xhci_trb_t* xhci_ring_next(xhci_ring_t* ring, xhci_trb_t* trb)
+{
+    trb++;
+
+    if (trb == ring->last_trb)
+        trb = ring->ring_buffer;
+
+    return trb;
+}
+
+/*!
+ * @brief: Amount of trbs we can still put on a producer ring
+ *
+ * One slot is always kept open, so a full ring never looks empty to us
+ */
+uint32_t xhci_ring_nr_free(xhci_ring_t* ring)
+{
+    uint32_t usable;
+    uint32_t used;
+
+    /* The link trb does not count */
+    usable = xhci_ring_nr_trbs(ring) - 1;
+    used = (uint32_t)((ring->enqueue - ring->dequeue) + usable) % usable;
+
+    return usable - used - 1;
+}
+
 /*!
  * @brief: Add a trb to the xhci ring
+ *
+ * The trb is handed to the controller by writing the cycle bit of the ring. When @defer is set
+ * the trb gets the inverse cycle bit, so the controller won't touch it until it's passed to
+ * xhci_ring_commit. This is used to publish TDs that span multiple trbs in one go.
+ */
+int xhci_ring_enqueue(struct xhci_hcd* hcd, xhci_ring_t* ring, xhci_trb_t* trb, bool defer, xhci_trb_t** p_trb)
+{
+    uint32_t cycle;
+    xhci_trb_t* slot;
+
+    if (!xhci_ring_nr_free(ring))
+        return -KERR_NOMEM;
+
+    slot = ring->enqueue;
+    cycle = defer ? (ring->ring_cycle ^ 1) : ring->ring_cycle;
+
+    slot->addr = trb->addr;
+    slot->status = trb->status;
+
+    /* Make sure the controller sees the rest of the trb before the cycle bit flips */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->control = (trb->control & ~XHCI_TRB_CYCLE) | cycle;
+
+    if (p_trb)
+        *p_trb = slot;
+
+    ring->enqueue++;
+
+    if (ring->enqueue != ring->last_trb)
+        return 0;
+
+    /* Hand the link trb over. It needs to carry the chain bit if we're in the middle of a TD */
+    ring->last_trb->control = (ring->last_trb->control & ~(XHCI_TRB_CYCLE | XHCI_TRB_CHAIN)) | (trb->control & XHCI_TRB_CHAIN);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ring->last_trb->control |= ring->ring_cycle;
+
+    ring->ring_cycle ^= 1;
+    ring->enqueue = ring->ring_buffer;
+    return 0;
+}
+
+/*!
+ * @brief: Give a trb that was enqueued with @defer to the controller
  */
-int xhci_ring_enqueue(struct xhci_hcd* hcd, xhci_ring_t* ring, xhci_trb_t* trb)
+void xhci_ring_commit(xhci_ring_t* ring, xhci_trb_t* trb)
 {
-    kernel_panic("TODO: xhci_ring_enqueue");
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    trb->control ^= XHCI_TRB_CYCLE;
 }
 
-extern int xhci_ring_dequeue(struct xhci_hcd* hcd, xhci_ring_t* ring, xhci_trb_t* b_trb)
+/*!
+ * @brief: Take the next trb off a consumer (event) ring
+ *
+ * Returns -KERR_NOT_FOUND when the controller didn't produce anything new
+ */
+int xhci_ring_dequeue(struct xhci_hcd* hcd, xhci_ring_t* ring, xhci_trb_t* b_trb)
 {
-    kernel_panic("TODO: xhci_ring_dequeue");
+    xhci_trb_t* trb;
+
+    trb = ring->dequeue;
+
+    if ((__atomic_load_n(&trb->control, __ATOMIC_ACQUIRE) & XHCI_TRB_CYCLE) != ring->ring_cycle)
+        return -KERR_NOT_FOUND;
+
+    memcpy(b_trb, trb, sizeof(*trb));
+
+    /* Event rings don't have a link trb, we simply wrap around at the end of the segment */
+    if (trb == ring->last_trb) {
+        ring->dequeue = ring->ring_buffer;
+        ring->ring_cycle ^= 1;
+    } else
+        ring->dequeue++;
+
+    return 0;
 }
 
-int xhci_cmd_ring_enqueue(xhci_hcd_t* xhci, xhci_trb_t* trb)
+int xhci_cmd_ring_enqueue(xhci_hcd_t* xhci, xhci_trb_t* trb, paddr_t* p_dma)
 {
+    int error;
+    xhci_trb_t* slot;
     xhci_ring_t* cmd_ring;
 
     cmd_ring = xhci->cmd_ring_ptr;
 
-    trb->control &= ~1;
-    trb->control |= xhci->cmd_queue_cycle;
-
-    memcpy(cmd_ring->enqueue, trb, sizeof(*trb));
-
-    cmd_ring->enqueue++;
+    /* We never have more than one command in flight, so the controller is always done with the old ones */
+    cmd_ring->dequeue = cmd_ring->enqueue;
 
-    if (cmd_ring->enqueue == cmd_ring->last_trb) {
-        cmd_ring->enqueue->control ^= 1;
+    error = xhci_ring_enqueue(xhci, cmd_ring, trb, false, &slot);
 
-        if (cmd_ring->enqueue->control & (1 < 1))
-            xhci->cmd_queue_cycle ^= 1;
+    if (error)
+        return error;
 
-        cmd_ring->enqueue = cmd_ring->ring_buffer;
-    }
+    if (p_dma)
+        *p_dma = xhci_ring_trb_dma(cmd_ring, slot);
 
     return 0;
 }
@@ -113,7 +211,11 @@ int xhci_set_cmd_ring(xhci_hcd_t* hcd)
     cmd_ring_reg = mmio_read_qword(&hcd->op_regs->cmd_ring);
 
     /* Set the DMA address of the command ring */
-    cmd_ring_reg &= XHCI_CMD_RING_RSVD_BITS | (cmd_ring->ring_dma & (uint64_t) ~(XHCI_CMD_RING_RSVD_BITS));
+    cmd_ring_reg &= XHCI_CMD_RING_RSVD_BITS;
+    cmd_ring_reg |= (cmd_ring->ring_dma & (uint64_t) ~(XHCI_CMD_RING_RSVD_BITS));
+
+    /* Ring cycle state */
+    cmd_ring_reg |= cmd_ring->ring_cycle;
 
     mmio_write_qword(&hcd->op_regs->cmd_ring, cmd_ring_reg);
 
@@ -151,11 +253,13 @@ xhci_interrupter_t* create_xhci_interrupter(struct xhci_hcd* xhci)
     ret->erst.erst_size = ALIGN_UP(ret->erst.entry_count * sizeof(xhci_erst_entry_t), PAGE_SIZE);
     ASSERT(!kmem_kernel_alloc_range((void**)&ret->erst.entries, ret->erst.erst_size, NULL, KMEM_FLAG_KERNEL | KMEM_FLAG_DMA));
 
+    ret->erst.dma = kmem_to_phys(nullptr, (vaddr_t)ret->erst.entries);
+
     for (uint32_t i = 0; i < ret->erst.entry_count; i++) {
         current_entry = &ret->erst.entries[i];
 
         current_entry->addr = ret->event_ring->ring_dma;
-        current_entry->size = XHCI_TRBS_PER_SEGMENT;
+        current_entry->size = xhci_ring_nr_trbs(ret->event_ring);
         current_entry->res = 0;
     }
 
@@ -179,6 +283,7 @@ int xhci_add_interrupter(struct xhci_hcd* xhci, xhci_interrupter_t* intr, uint32
         return -1;
 
     intr->ir_regs = &xhci->runtime_regs->ir_set[num];
+    intr->inter_num = num;
 
     /* Set the erst size */
     uint32_t size = mmio_read_dword(&intr->ir_regs->erst_size);
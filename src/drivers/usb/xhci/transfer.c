@@ -0,0 +1,323 @@
+#include "dev/usb/spec.h"
+#include "dev/usb/xfer.h"
+#include "device.h"
+#include "libk/flow/error.h"
+#include "libk/math/math.h"
+#include "mem/kmem.h"
+#include "sync/sem.h"
+#include "xhci.h"
+
+/*!
+ * @brief: Count the amount of trbs we need to describe @len bytes at @buffer
+ *
+ * A data trb never crosses a page boundary, since every page gets translated separately
+ */
+static uint32_t __xhci_nr_data_trbs(void* buffer, uint32_t len)
+{
+    if (!len)
+        return 1;
+
+    return (ALIGN_UP((vaddr_t)buffer + len, SMALL_PAGE_SIZE) - ALIGN_DOWN((vaddr_t)buffer, SMALL_PAGE_SIZE)) / SMALL_PAGE_SIZE;
+}
+
+/*!
+ * @brief: Grab a free td on @ep, if there is one and the ring can fit @nr_trbs more trbs
+ */
+static xhci_td_t* __xhci_get_td(xhci_hcd_t* xhci, xhci_device_t* xdev, xhci_endpoint_t* ep, usb_xfer_t* xfer, uint32_t nr_trbs)
+{
+    xhci_td_t* td = nullptr;
+
+    spinlock_lock(xhci->event_lock);
+
+    if (ep->td_tail - ep->td_head < XHCI_EP_MAX_TDS && xhci_ring_nr_free(ep->ring) >= nr_trbs) {
+        td = xhci_ep_get_td(ep, ep->td_tail);
+
+        memset(td, 0, sizeof(*td));
+
+        td->xfer = xfer;
+        td->xdev = xdev;
+        td->ep = ep;
+    }
+
+    spinlock_unlock(xhci->event_lock);
+
+    return td;
+}
+
+/*!
+ * @brief: Make a filled in td visible to the event handler and hand its trbs to the controller
+ *
+ * @first is the first trb of the td, which was enqueued with its cycle bit deferred
+ */
+static void __xhci_submit_td(xhci_hcd_t* xhci, xhci_device_t* xdev, xhci_endpoint_t* ep, xhci_trb_t* first)
+{
+    spinlock_lock(xhci->event_lock);
+    ep->td_tail++;
+    spinlock_unlock(xhci->event_lock);
+
+    xhci_ring_commit(ep->ring, first);
+
+    xhci_ring_doorbell(xhci, xdev->slot, ep->dci, 0);
+}
+
+/*!
+ * @brief: Put @len bytes of @buffer on @ring as a chain of data trbs
+ *
+ * The first trb is of type @type (a data stage trb for control transfers, a normal trb otherwise), the rest
+ * are normal trbs. @flags go on every trb, @last_flags only on the last one
+ */
+static int __xhci_enqueue_data(xhci_hcd_t* xhci, xhci_ring_t* ring, void* buffer, uint32_t len, uint16_t mps, uint32_t type, uint32_t flags,
+    uint32_t last_flags, bool defer, xhci_trb_t** p_first, xhci_trb_t** p_last)
+{
+    int error;
+    uint32_t left = len;
+    uint32_t c_len;
+    vaddr_t c_addr = (vaddr_t)buffer;
+    xhci_trb_t trb;
+    xhci_trb_t* c_trb;
+
+    *p_first = nullptr;
+
+    if (!mps)
+        mps = 8;
+
+    do {
+        c_len = MIN(left, SMALL_PAGE_SIZE - (c_addr & (SMALL_PAGE_SIZE - 1)));
+        left -= c_len;
+
+        trb.addr = c_len ? kmem_to_phys(nullptr, c_addr) : 0;
+        /* TD size is the amount of packets that still need to go after this trb */
+        trb.status = XHCI_TRB_LEN(c_len) | XHCI_TRB_TD_SIZE(MIN(ALIGN_UP(left, mps) / mps, 31)) | XHCI_TRB_INTR_TARGET(0);
+        trb.control = XHCI_TRB_TYPE(type) | flags;
+
+        if (left)
+            trb.control |= XHCI_TRB_CHAIN;
+        else
+            trb.control |= last_flags;
+
+        error = xhci_ring_enqueue(xhci, ring, &trb, defer && !*p_first, &c_trb);
+
+        if (error)
+            return error;
+
+        if (!*p_first)
+            *p_first = c_trb;
+
+        c_addr += c_len;
+        *p_last = c_trb;
+
+        /* Only the first trb of a data stage carries the type and direction */
+        type = TRB_NORMAL;
+        flags &= ~XHCI_TRB_DIR_IN;
+    } while (left);
+
+    return 0;
+}
+
+/*!
+ * @brief: Queue a control transfer on the default control endpoint of @xdev
+ *
+ * Setup, (optional) data and status stages all go into a single td, which completes on the
+ * status stage
+ */
+int xhci_queue_ctl_xfer(xhci_hcd_t* xhci, xhci_device_t* xdev, usb_xfer_t* xfer)
+{
+    int error;
+    bool in;
+    uint16_t mps;
+    uint32_t len;
+    usb_ctlreq_t* ctl;
+    xhci_trb_t trb;
+    xhci_trb_t* setup_trb;
+    xhci_trb_t* last_trb;
+    xhci_trb_t* status_trb;
+    xhci_td_t* td;
+    xhci_endpoint_t* ep = xdev->eps[1];
+
+    ctl = xfer->req_buffer;
+
+    if (!ctl || !ep || xfer->req_size < sizeof(*ctl))
+        return -KERR_INVAL;
+
+    /* Once we've seen the device descriptor, we know what ep0 can really do */
+    if (xdev->udev->desc.max_pckt_size) {
+        mps = xdev->udev->desc.max_pckt_size;
+
+        /* Superspeed devices give us an exponent */
+        if (xdev->speed_id >= XHCI_SPEED_SUPER)
+            mps = 1 << mps;
+
+        error = xhci_device_update_ep0(xhci, xdev, mps);
+
+        if (error)
+            return error;
+    }
+
+    in = (xfer->req_direction == USB_DIRECTION_DEVICE_TO_HOST);
+    len = xfer->resp_buffer ? MIN(ctl->length, xfer->resp_size) : 0;
+
+    td = __xhci_get_td(xhci, xdev, ep, xfer, 2 + (len ? __xhci_nr_data_trbs(xfer->resp_buffer, len) : 0));
+
+    if (!td)
+        return -KERR_NOMEM;
+
+    /* The setup packet itself goes in the trb */
+    memcpy(&trb.addr, ctl, sizeof(trb.addr));
+    trb.status = XHCI_TRB_LEN(sizeof(*ctl)) | XHCI_TRB_INTR_TARGET(0);
+    trb.control = XHCI_TRB_TYPE(TRB_SETUP) | XHCI_TRB_IDT | XHCI_TRB_TRT(len ? (in ? XHCI_TRT_IN : XHCI_TRT_OUT) : XHCI_TRT_NO_DATA);
+
+    /* Keep the controller off this td until we've put all of it on the ring */
+    error = xhci_ring_enqueue(xhci, ep->ring, &trb, true, &setup_trb);
+
+    if (error)
+        return error;
+
+    if (len) {
+        error = __xhci_enqueue_data(xhci, ep->ring, xfer->resp_buffer, len, ep->max_packet_size, TRB_DATA,
+            in ? (XHCI_TRB_DIR_IN | XHCI_TRB_ISP) : 0, 0, false, &td->data_trb, &last_trb);
+
+        if (error)
+            return error;
+    }
+
+    /* Status stage goes the other way from the data stage, or in when there is no data */
+    trb.addr = 0;
+    trb.status = XHCI_TRB_INTR_TARGET(0);
+    trb.control = XHCI_TRB_TYPE(TRB_STATUS) | XHCI_TRB_IOC | ((len && in) ? 0 : XHCI_TRB_DIR_IN);
+
+    error = xhci_ring_enqueue(xhci, ep->ring, &trb, false, &status_trb);
+
+    if (error)
+        return error;
+
+    td->len = len;
+    td->flags = XHCI_TD_FLAG_CTL;
+    td->last_trb_dma = xhci_ring_trb_dma(ep->ring, status_trb);
+    td->next_trb = ep->ring->enqueue;
+
+    __xhci_submit_td(xhci, xdev, ep, setup_trb);
+    return 0;
+}
+
+/*!
+ * @brief: Queue a bulk or interrupt transfer
+ *
+ * The endpoint gets configured the first time we see a transfer for it
+ */
+int xhci_queue_data_xfer(xhci_hcd_t* xhci, xhci_device_t* xdev, usb_xfer_t* xfer)
+{
+    int error;
+    bool in;
+    uint8_t dci;
+    uint32_t len;
+    void* buffer;
+    xhci_trb_t* first_trb;
+    xhci_trb_t* last_trb;
+    xhci_td_t* td;
+    xhci_endpoint_t* ep;
+
+    in = (xfer->req_direction == USB_DIRECTION_DEVICE_TO_HOST);
+    dci = xhci_ep_dci(xfer->req_endpoint, in);
+
+    if (dci < 2 || dci >= XHCI_MAX_EPS)
+        return -KERR_INVAL;
+
+    if (!xdev->eps[dci]) {
+        error = xhci_device_configure_ep(xhci, xdev, xfer, dci);
+
+        if (error)
+            return error;
+    }
+
+    ep = xdev->eps[dci];
+
+    buffer = in ? xfer->resp_buffer : xfer->req_buffer;
+    len = in ? xfer->resp_size : xfer->req_size;
+
+    if (!buffer)
+        len = 0;
+
+    td = __xhci_get_td(xhci, xdev, ep, xfer, __xhci_nr_data_trbs(buffer, len));
+
+    if (!td)
+        return -KERR_NOMEM;
+
+    error = __xhci_enqueue_data(xhci, ep->ring, buffer, len, ep->max_packet_size, TRB_NORMAL,
+        in ? XHCI_TRB_ISP : 0, XHCI_TRB_IOC, true, &first_trb, &last_trb);
+
+    if (error)
+        return error;
+
+    td->data_trb = first_trb;
+    td->len = len;
+    td->last_trb_dma = xhci_ring_trb_dma(ep->ring, last_trb);
+    td->next_trb = ep->ring->enqueue;
+
+    __xhci_submit_td(xhci, xdev, ep, first_trb);
+    return 0;
+}
+
+/*!
+ * @brief: Pull @xfer off the ring it's on
+ *
+ * Stops the endpoint and completes every td that is still on it, since the ring can't skip a single td
+ * in the middle. Everything that was queued behind @xfer on the same endpoint gets canceled with it
+ */
+int xhci_cancel_xfer(xhci_hcd_t* xhci, xhci_device_t* xdev, usb_xfer_t* xfer)
+{
+    int error;
+    bool found = false;
+    uint8_t dci;
+    xhci_td_t* td;
+    xhci_endpoint_t* ep;
+
+    if (xfer->req_type == USB_CTL_XFER)
+        dci = 1;
+    else
+        dci = xhci_ep_dci(xfer->req_endpoint, xfer->req_direction == USB_DIRECTION_DEVICE_TO_HOST);
+
+    if (dci >= XHCI_MAX_EPS || !xdev->eps[dci])
+        return -KERR_NOT_FOUND;
+
+    ep = xdev->eps[dci];
+
+    spinlock_lock(xhci->event_lock);
+
+    for (uint32_t i = ep->td_busy; i != ep->td_tail && !found; i++)
+        found = (xhci_ep_get_td(ep, i)->xfer == xfer);
+
+    spinlock_unlock(xhci->event_lock);
+
+    if (!found)
+        return -KERR_NOT_FOUND;
+
+    /* Fails if the endpoint already halted or stopped, which is exactly where we want it */
+    xhci_device_stop_ep(xhci, xdev, ep);
+
+    spinlock_lock(xhci->event_lock);
+
+    for (; ep->td_busy != ep->td_tail; ep->td_busy++) {
+        td = xhci_ep_get_td(ep, ep->td_busy);
+
+        td->flags |= XHCI_TD_FLAG_CANCELED;
+        td->done_next = nullptr;
+
+        if (xhci->done_tds_tail)
+            xhci->done_tds_tail->done_next = td;
+        else
+            xhci->done_tds = td;
+
+        xhci->done_tds_tail = td;
+    }
+
+    ep->ring->dequeue = ep->ring->enqueue;
+
+    spinlock_unlock(xhci->event_lock);
+
+    error = xhci_device_set_ep_deq(xhci, xdev, ep);
+
+    /* Let the finish thread hand the canceled tds back */
+    sem_post(xhci->done_sem);
+
+    return error;
+}
@@ -8,6 +8,7 @@
 #include "dev/usb/spec.h"
 #include "dev/usb/usb.h"
 #include "dev/usb/xfer.h"
+#include "irq/interrupts.h"
 #include "libk/flow/error.h"
 #include "libk/io.h"
 #include "logging/log.h"
@@ -18,8 +19,10 @@
 #include <dev/pci/pci.h>
 #include <dev/usb/port.h>
 
+#include "device.h"
 #include "extended.h"
 #include "sched/scheduler.h"
+#include "sync/sem.h"
 #include "xhci.h"
 
 int xhci_init(driver_t* driver);
@@ -35,22 +38,23 @@ pci_dev_id_t xhci_pci_ids[] = {
 /*!
  * @brief: Ring the doorbell of a particular slot, endpoint and stream
  *
- * In our case, streamid is most likely going to be 0
+ * @dci is the device context index of the endpoint (0 when ringing for the command ring). In our
+ * case, streamid is most likely going to be 0
  */
-static void xhci_ring(xhci_hcd_t* hcd, uint32_t slot, uint32_t endpoint, uint32_t streamid)
+void xhci_ring_doorbell(xhci_hcd_t* hcd, uint32_t slot, uint32_t dci, uint32_t streamid)
 {
     uint32_t* db_addr;
 
     if (slot > hcd->max_slots)
         return;
 
-    if (endpoint >= XHCI_MAX_EPS)
+    if (dci >= XHCI_MAX_EPS)
         return;
 
     db_addr = &hcd->db_arr->db[slot];
 
     /* Ding, dong */
-    mmio_write_dword(db_addr, DB_VALUE(endpoint, streamid));
+    mmio_write_dword(db_addr, DB_VALUE(dci, streamid));
 
     /* Flush that shit */
     mmio_read_dword(db_addr);
@@ -118,13 +122,21 @@ static int xhci_wait_read(struct usb_hcd* hub, uintptr_t max_timeout, void* addr
     return -1;
 }
 
-static kerror_t xhci_submit_cmd(xhci_hcd_t* xhci, uint64_t trb_addr, uint32_t trb_status, uint32_t trb_control)
+/*!
+ * @brief: Put a command on the command ring and wait for it to complete
+ *
+ * Only one command is in flight at a time. The IRQ handler matches the completion event with
+ * our trb and wakes us up
+ *
+ * @p_slot: Gets the slot id from the completion event (Only meaningful for Enable Slot)
+ * @returns: 0 if the command completed successfully
+ */
+int xhci_exec_cmd(xhci_hcd_t* xhci, uint64_t trb_addr, uint32_t trb_status, uint32_t trb_control, uint32_t* p_slot)
 {
-    xhci_ring_t* ring;
-
-    ring = xhci->cmd_ring_ptr;
+    int error;
+    xhci_cmd_t cmd = { 0 };
 
-    if (!ring)
+    if (!xhci->cmd_ring_ptr)
         return -KERR_INVAL;
 
     xhci_trb_t trb = {
@@ -133,12 +145,43 @@ static kerror_t xhci_submit_cmd(xhci_hcd_t* xhci, uint64_t trb_addr, uint32_t tr
         .control = trb_control
     };
 
+    mutex_lock(xhci->cmd_lock);
+
     /* Put the shit in the ring */
-    xhci_cmd_ring_enqueue(xhci, &trb);
+    spinlock_lock(xhci->event_lock);
+
+    error = xhci_cmd_ring_enqueue(xhci, &trb, &cmd.trb_dma);
+
+    if (!error)
+        xhci->pending_cmd = &cmd;
+
+    spinlock_unlock(xhci->event_lock);
+
+    if (error)
+        goto unlock_and_exit;
 
     /* boob */
-    xhci_ring(xhci, 0, 0, 0);
-    return 0;
+    xhci_ring_doorbell(xhci, 0, 0, 0);
+
+    error = sem_wait(xhci->cmd_sem, NULL);
+
+    if (error) {
+        /* Make sure the IRQ handler does not write to our stack after we're gone */
+        spinlock_lock(xhci->event_lock);
+        xhci->pending_cmd = nullptr;
+        spinlock_unlock(xhci->event_lock);
+        goto unlock_and_exit;
+    }
+
+    if (p_slot)
+        *p_slot = cmd.slot_id;
+
+    if (cmd.comp_code != XHCI_COMP_SUCCESS)
+        error = -KERR_DEV;
+
+unlock_and_exit:
+    mutex_unlock(xhci->cmd_lock);
+    return error;
 }
 
 /*!
@@ -436,16 +479,54 @@ void destroy_xhci_hub(xhci_hub_t* hub)
     kfree(hub->ports);
 }
 
+/*!
+ * @brief: Handle a SET_ADDRESS request for a device that's not on a slot yet
+ *
+ * Completes the transfer right away, since there is nothing to put on a transfer ring
+ */
+static int xhci_set_address(xhci_hcd_t* xhci, usb_xfer_t* req)
+{
+    int error;
+    xhci_device_t* xdev;
+
+    if (!req->device)
+        return -KERR_INVAL;
+
+    /* Already got a slot, nothing to do */
+    if (xhci_get_device(xhci, req->device))
+        goto complete;
+
+    xdev = create_xhci_device(xhci, req->device);
+
+    if (!xdev)
+        return -KERR_NOMEM;
+
+    error = xhci_device_address(xhci, xdev);
+
+    if (error) {
+        destroy_xhci_device(xhci, xdev);
+        return error;
+    }
+
+complete:
+    req->xfer_flags |= USB_XFER_FLAG_DONE;
+
+    usb_xfer_complete(req);
+    return 0;
+}
+
 /*!
  * @brief: Queue the correct TRBs for this request
  *
  * Since USB uses a few different types of packets, we need to construct different TRB structures
- * based on the type of transfer. Next to that the event thread and transfer finish thread of this
- * hcd need to know how to correctly handle events and transfer finishes
+ * based on the type of transfer. Completion is picked up by the IRQ handler and handed back to
+ * the xfer by the transfer finish thread (see event.c)
  */
 int xhci_enq_request(usb_hcd_t* hcd, usb_xfer_t* req)
 {
     xhci_hcd_t* xhci;
+    xhci_device_t* xdev;
+    usb_ctlreq_t* ctl;
 
     if (!hcd)
         return -1;
@@ -464,16 +545,54 @@ int xhci_enq_request(usb_hcd_t* hcd, usb_xfer_t* req)
     if (req->req_devaddr == xhci->rhub->phub->udev->dev_addr)
         return xhci_process_rhub_xfer(xhci->rhub->phub, req);
 
-    kernel_panic("TODO: implement xhci_enq_request");
+    xdev = xhci_get_device(xhci, req->device);
 
-    xhci_ring(xhci, 0, 0, 0);
-    return 0;
+    switch (req->req_type) {
+    case USB_CTL_XFER:
+        ctl = req->req_buffer;
+
+        /* The controller hands out addresses itself, so SET_ADDRESS becomes an Address Device command */
+        if (ctl && (ctl->request_type & USB_TYPE_MASK) == USB_TYPE_STANDARD && ctl->request == USB_REQ_SET_ADDRESS)
+            return xhci_set_address(xhci, req);
+
+        if (!xdev)
+            return -KERR_NODEV;
+
+        return xhci_queue_ctl_xfer(xhci, xdev, req);
+    case USB_INT_XFER:
+    case USB_BULK_XFER:
+        if (!xdev)
+            return -KERR_NODEV;
+
+        return xhci_queue_data_xfer(xhci, xdev, req);
+    default:
+        break;
+    }
+
+    /* TODO: isochronous transfers */
+    return -KERR_INVAL;
 }
 
 int xhci_deq_request(usb_hcd_t* hcd, usb_xfer_t* req)
 {
-    kernel_panic("TODO: implement xhci_deq_request");
-    return 0;
+    xhci_hcd_t* xhci;
+    xhci_device_t* xdev;
+
+    if (!hcd || !req)
+        return -KERR_INVAL;
+
+    xhci = hcd->private;
+
+    if (!xhci)
+        return -KERR_INVAL;
+
+    xdev = xhci_get_device(xhci, req->device);
+
+    /* Roothub transfers are never queued anywhere */
+    if (!xdev)
+        return -KERR_NOT_FOUND;
+
+    return xhci_cancel_xfer(xhci, xdev, req);
 }
 
 usb_hcd_io_ops_t xhci_io_ops = {
@@ -800,7 +919,6 @@ int xhci_setup(usb_hcd_t* hcd)
     /* Enable the HC */
     pci_device_enable(device);
 
-    pci_set_interrupt_line(&hcd->pci_device->address, false);
     pci_set_io(&hcd->pci_device->address, false);
 
     device->ops.read_dword(device, BAR0, (uint32_t*)&bar0);
@@ -842,7 +960,12 @@ int xhci_setup(usb_hcd_t* hcd)
     xhci->hci_version = HC_VERSION(mmio_read_dword(&xhci->cap_regs->hc_capbase));
     xhci->max_interrupters = HC_MAX_INTER(mmio_read_dword(&xhci->cap_regs->hcs_params_1));
 
-    xhci->cmd_queue_cycle = 1;
+    xhci->ctx_size = HCC_64BYTE_CONTEXT(mmio_read_dword(&xhci->cap_regs->hcc_params_1)) ? XHCI_CTX_BYTES_64 : XHCI_CTX_BYTES;
+
+    xhci->event_lock = create_spinlock(0);
+    xhci->cmd_lock = create_mutex(0);
+    xhci->cmd_sem = create_semaphore(1, 0, 1);
+    xhci->done_sem = create_semaphore(1, 0, 1);
 
     uint32_t cap_len = HC_LENGTH(mmio_read_dword(&xhci->cap_regs->hc_capbase));
 
@@ -864,9 +987,14 @@ int xhci_setup(usb_hcd_t* hcd)
     if (error)
         goto fail_and_dealloc;
 
-    /* Create the async polling threads (TODO: only when it's configured to use this) */
-    xhci->event_thread = spawn_thread("xhci_event", SCHED_PRIO_6, _xhci_event_poll, (uint64_t)xhci);
-    // xhci->trf_finish_thread = spawn_thread("xhci_trf_thread", nullptr, (uint64_t)xhci);
+    /* Events come in through the interrupter. TODO: MSI(-X) */
+    error = pci_device_allocate_irq(device, 0, IRQHANDLER_FLAG_DIRECT_CALL, xhci_irq_handler, xhci, "xHCI interrupter");
+
+    if (error)
+        goto fail_and_dealloc;
+
+    /* Finished transfers get handed back to their xfers from here */
+    xhci->trf_finish_thread = spawn_thread("xhci_trf_finish", SCHED_PRIO_6, (FuncPtr)_xhci_trf_finish, (uint64_t)xhci);
 
     /*
      * TODO: support device quirks
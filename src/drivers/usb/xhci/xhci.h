@@ -12,6 +12,7 @@
 #include "mem/zalloc/zalloc.h"
 #include "proc/thread.h"
 #include "sync/mutex.h"
+#include "sync/spinlock.h"
 #include <libk/stddef.h>
 
 struct usb_hcd;
@@ -19,6 +20,9 @@ struct usb_device;
 struct usb_port;
 struct xhci_hcd;
 struct xhci_hub;
+struct xhci_device;
+struct xhci_endpoint;
+struct semaphore;
 
 #define XHCI_PORT_REG_NUM 4
 
@@ -201,6 +205,11 @@ typedef struct xhci_intr_regs {
 #define XHCI_ER_IRQ_CLEAR(p) ((p) & 0xfffffffe)
 #define XHCI_ER_IRQ_ENABLE(p) ((XHCI_ER_IRQ_CLEAR(p)) | 0x2)
 #define XHCI_ER_IRQ_DISABLE(p) ((XHCI_ER_IRQ_CLEAR(p)) & ~(0x2))
+/* IP is write-1-to-clear, so this acknowledges the pending IRQ and keeps it enabled */
+#define XHCI_ER_IRQ_ACK(p) ((p) | 0x3)
+
+/* Event handler busy. Write-1-to-clear, done every time we update the dequeue pointer */
+#define XHCI_ERDP_EHB (1 << 3)
 
 typedef struct xhci_runtime_regs {
     uint32_t microframe_idx;
@@ -234,24 +243,31 @@ typedef struct xhci_cap_regs {
 /* Weird define because there is a bitchin reserved bit right in the middle of our field =/ */
 #define HC_MAX_SCRTCHPD(p) ((((p) >> 16) & 0x3e0) | (((p) >> 27) & 0x1f))
 
+/* Context size bit in hcc_params_1. When set, every context is 64 bytes instead of 32 */
+#define HCC_64BYTE_CONTEXT(p) (((p) >> 2) & 0x1)
+
 /*
  * Bits  0 -  7: Endpoint target
  * Bits  8 - 15: RsvdZ
  * Bits 16 - 31: Stream ID
  * Layout: Section 5.6 of the xhci spec
+ *
+ * The endpoint target is the device context index of the endpoint (1 for the
+ * default control endpoint) and 0 for the host controller command doorbell
  */
 typedef struct xhci_db_array {
     uint32_t db[256];
 } xhci_db_array_t;
 
-#define DB_VALUE(ep, stream) ((((ep) + 1) & 0xff) | ((stream) << 16))
+#define DB_VALUE(dci, stream) (((dci) & 0xff) | ((stream) << 16))
 
 /*
  * xhci contexts
  */
 
-/* NOTE: host controller might use 64-byte contex structures */
+/* NOTE: host controller might use 64-byte contex structures (see HCC_64BYTE_CONTEXT) */
 #define XHCI_CTX_BYTES 32
+#define XHCI_CTX_BYTES_64 64
 
 typedef struct xhci_slot_ctx {
     uint32_t dev_info;
@@ -328,6 +344,18 @@ typedef struct xhci_endpoint_ctx {
 #define ENDPOINT_4_MAXESITPAYLOAD(x) (((x) & 0xFFFF) << 16)
 #define ENDPOINT_4_MAXESITPAYLOAD_GET(x) (((x) >> 16) & 0xFFFF)
 
+/* Endpoint types for ENDPOINT_1_EPTYPE */
+#define XHCI_EP_TYPE_ISOC_OUT 1
+#define XHCI_EP_TYPE_BULK_OUT 2
+#define XHCI_EP_TYPE_INT_OUT 3
+#define XHCI_EP_TYPE_CTL 4
+#define XHCI_EP_TYPE_ISOC_IN 5
+#define XHCI_EP_TYPE_BULK_IN 6
+#define XHCI_EP_TYPE_INT_IN 7
+
+/* Input control context add/drop flags. A0 is the slot context, A1 the default control endpoint */
+#define XHCI_INPUT_CTX_FLAG(dci) (1U << (dci))
+
 #define ENDPOINT_STATE_DISABLED 0
 #define ENDPOINT_STATE_RUNNING 1
 #define ENDPOINT_STATE_HALTED 2
@@ -393,6 +421,62 @@ typedef struct xhci_trb {
 #define XHCI_TRB_TYPE(p) ((p) << 10)
 #define XHCI_TRB_FIELD_TO_TYPE(p) (((p) & XHCI_TRB_TYPE_BM) >> 10)
 
+/*
+ * TRB control field bits
+ */
+#define XHCI_TRB_CYCLE (1 << 0)
+/* Link TRBs: toggle the ring cycle state when the controller follows this link */
+#define XHCI_TRB_TOGGLE_CYCLE (1 << 1)
+/* Interrupt on short packet */
+#define XHCI_TRB_ISP (1 << 2)
+#define XHCI_TRB_CHAIN (1 << 4)
+/* Interrupt on completion */
+#define XHCI_TRB_IOC (1 << 5)
+/* Immediate data: the data lives in the addr field of the TRB itself */
+#define XHCI_TRB_IDT (1 << 6)
+/* Data stage and status stage direction */
+#define XHCI_TRB_DIR_IN (1 << 16)
+/* Setup stage transfer type */
+#define XHCI_TRB_TRT(x) (((x) & 0x3) << 16)
+#define XHCI_TRT_NO_DATA 0
+#define XHCI_TRT_OUT 2
+#define XHCI_TRT_IN 3
+/* Endpoint (dci) and slot targets of command TRBs */
+#define XHCI_TRB_EP_ID(x) (((x) & 0x1f) << 16)
+#define XHCI_TRB_SLOT_ID(x) (((x) & 0xff) << 24)
+
+/*
+ * TRB status field of transfer TRBs
+ */
+#define XHCI_TRB_LEN(x) ((x) & 0x1ffff)
+#define XHCI_TRB_TD_SIZE(x) (((x) & 0x1f) << 17)
+#define XHCI_TRB_INTR_TARGET(x) (((x) & 0x3ff) << 22)
+
+/* Max amount of bytes a single transfer TRB may describe */
+#define XHCI_TRB_MAX_LEN 0x10000
+
+/*
+ * Event TRB fields
+ */
+#define XHCI_EVT_COMP_CODE(status) (((status) >> 24) & 0xff)
+#define XHCI_EVT_RESIDUAL(status) ((status) & 0xffffff)
+#define XHCI_EVT_EP_ID(control) (((control) >> 16) & 0x1f)
+#define XHCI_EVT_SLOT_ID(control) (((control) >> 24) & 0xff)
+
+/*
+ * Completion codes. Section 6.4.5 of the xhci spec
+ */
+#define XHCI_COMP_INVALID 0
+#define XHCI_COMP_SUCCESS 1
+#define XHCI_COMP_DATA_BUFFER 2
+#define XHCI_COMP_BABBLE 3
+#define XHCI_COMP_TRANSACTION 4
+#define XHCI_COMP_TRB 5
+#define XHCI_COMP_STALL 6
+#define XHCI_COMP_SHORT_PACKET 13
+#define XHCI_COMP_STOPPED 26
+#define XHCI_COMP_STOPPED_LEN_INVALID 27
+
 /* bulk, interrupt, isoc scatter/gather, and control data stage */
 #define TRB_NORMAL 1
 /* setup stage for control transfers */
@@ -484,15 +568,39 @@ typedef struct xhci_segment {
 
 /*
  * xhci transfer descriptor
+ *
+ * Keeps track of a usb_xfer while its TRBs are on one of the endpoint rings. Every td
+ * ends with a TRB that has IOC set, which is the one we expect the completion event for
  */
 typedef struct xhci_td {
-    /* All the trbs in a td will be contiguous (for now), so we only need one pointer */
-    xhci_trb_t* trbs;
-
-    uint32_t trb_count;
-    uint32_t status;
+    struct usb_xfer* xfer;
+    struct xhci_device* xdev;
+    struct xhci_endpoint* ep;
+
+    /* First data TRB (if there is any data) and the TRB that raises the completion event */
+    xhci_trb_t* data_trb;
+    paddr_t last_trb_dma;
+    /* Where the ring dequeue pointer moves to once this td is done */
+    xhci_trb_t* next_trb;
+
+    uint32_t len;
+    uint32_t actual_len;
+    uint32_t comp_code;
+    uint32_t flags;
+
+    /* Link in the hcds list of finished tds */
+    struct xhci_td* done_next;
 } xhci_td_t;
 
+/* This td carries a control transfer, so a short data stage does not finish it */
+#define XHCI_TD_FLAG_CTL 0x00000001
+/* Data stage ended in a short packet, actual_len is set */
+#define XHCI_TD_FLAG_SHORT 0x00000002
+/* Transfer got canceled through the deq_request io op */
+#define XHCI_TD_FLAG_CANCELED 0x00000004
+/* The endpoint halted on this td and needs to be reset */
+#define XHCI_TD_FLAG_HALTED 0x00000008
+
 #define XHCI_RING_TYPE_CTL 0
 #define XHCI_RING_TYPE_ISOC 1
 #define XHCI_RING_TYPE_BULC 2
@@ -521,6 +629,7 @@ typedef struct xhci_ring {
     xhci_trb_t* enqueue;
     xhci_trb_t* dequeue;
 
+    /* Link TRB back to the start for producer rings, the last event slot for event rings */
     xhci_trb_t* last_trb;
 
     /* Kernel address to the ring buffer */
@@ -528,18 +637,32 @@ typedef struct xhci_ring {
     paddr_t ring_dma;
     uint32_t ring_size;
     uint32_t ring_type;
+    /* Cycle bit we currently produce (or consume for event rings) */
     uint32_t ring_cycle;
 } xhci_ring_t;
 
+static inline uint32_t xhci_ring_nr_trbs(xhci_ring_t* ring)
+{
+    return ring->ring_size / sizeof(xhci_trb_t);
+}
+
+static inline paddr_t xhci_ring_trb_dma(xhci_ring_t* ring, xhci_trb_t* trb)
+{
+    return ring->ring_dma + ((uintptr_t)trb - (uintptr_t)ring->ring_buffer);
+}
+
 /* ring.c */
 extern xhci_ring_t* create_xhci_ring(struct xhci_hcd* hcd, uint32_t trb_count, uint32_t type);
 extern void destroy_xhci_ring(xhci_ring_t* ring);
 
 extern int xhci_set_cmd_ring(struct xhci_hcd* hcd);
 
-extern int xhci_cmd_ring_enqueue(struct xhci_hcd* hcd, xhci_trb_t* trb);
-extern int xhci_ring_enqueue(struct xhci_hcd* hcd, xhci_ring_t* ring, xhci_trb_t* trb);
+extern int xhci_cmd_ring_enqueue(struct xhci_hcd* hcd, xhci_trb_t* trb, paddr_t* p_dma);
+extern int xhci_ring_enqueue(struct xhci_hcd* hcd, xhci_ring_t* ring, xhci_trb_t* trb, bool defer, xhci_trb_t** p_trb);
+extern void xhci_ring_commit(xhci_ring_t* ring, xhci_trb_t* trb);
 extern int xhci_ring_dequeue(struct xhci_hcd* hcd, xhci_ring_t* ring, xhci_trb_t* b_trb);
+extern uint32_t xhci_ring_nr_free(xhci_ring_t* ring);
+extern xhci_trb_t* xhci_ring_next(xhci_ring_t* ring, xhci_trb_t* trb);
 
 /*
  * Scratchpad store for a xhci hcd
@@ -569,19 +692,17 @@ typedef struct xhci_erst {
 
 /*
  * xhci command
+ *
+ * Lives on the stack of the thread that submits the command. There is only ever
+ * one command in flight, which is guarded by the cmd_lock of the hcd
  */
-
 typedef struct xhci_cmd {
-    xhci_input_dma_t* input_ctx;
+    /* DMA address of the command TRB, used to match the completion event */
+    paddr_t trb_dma;
 
-    uint32_t status;
+    /* Copied from the completion event */
+    uint32_t comp_code;
     uint32_t slot_id;
-
-    /* Store waiters for this command */
-    kdoorbell_t* doorbell;
-
-    /* Underlying TRB of the command */
-    xhci_trb_t* cmd_trb;
 } xhci_cmd_t;
 
 typedef struct xhci_interrupter {
@@ -661,14 +782,31 @@ typedef struct xhci_hcd {
 
     uint32_t xhc_flags;
 
-    mutex_t* event_lock;
-
-    /* These threads are used to do events and trfs by probing */
-    thread_t* event_thread;
+    /*
+     * Protects the event ring, the td bookkeeping of the endpoints and the finished td list. Taken
+     * from our IRQ handler, so this needs to be a spinlock
+     */
+    spinlock_t* event_lock;
+
+    /* Command we're waiting on and the semaphore that gets posted when it completes */
+    mutex_t* cmd_lock;
+    xhci_cmd_t* pending_cmd;
+    struct semaphore* cmd_sem;
+
+    /*
+     * Finished tds get queued here by the IRQ handler and are completed by the transfer finish thread,
+     * since completion callbacks like to resubmit their transfer (which takes the hcd lock)
+     */
+    xhci_td_t* done_tds;
+    xhci_td_t* done_tds_tail;
+    struct semaphore* done_sem;
     thread_t* trf_finish_thread;
 
+    /* Devices indexed by their slot id */
+    struct xhci_device* devices[XHCI_MAX_HC_SLOTS];
+
     uint8_t sbrn;
-    uint8_t cmd_queue_cycle;
+    uint8_t ctx_size;
     uint16_t hci_version;
     uint8_t max_slots;
     uint16_t max_interrupters;
@@ -706,7 +844,12 @@ int xhci_get_port_sts(struct xhci_hcd* xhci, u8 idx, usb_port_status_t* status);
 int xhci_clear_port_ftr(struct xhci_hcd* xhci, u8 idx, u32 feature);
 int xhci_set_port_ftr(struct xhci_hcd* xhci, u8 idx, u32 feature);
 
-extern void _xhci_event_poll(xhci_hcd_t* xhci);
+extern void xhci_ring_doorbell(xhci_hcd_t* xhci, uint32_t slot, uint32_t dci, uint32_t streamid);
+extern int xhci_exec_cmd(xhci_hcd_t* xhci, uint64_t trb_addr, uint32_t trb_status, uint32_t trb_control, uint32_t* p_slot);
+
+/* event.c */
+extern int xhci_irq_handler(void* ctx);
+extern void _xhci_trf_finish(xhci_hcd_t* xhci);
 
 static inline xhci_hcd_t* hcd_to_xhci(usb_hcd_t* hcd)
 {
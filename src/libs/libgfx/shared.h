@@ -14,6 +14,7 @@
 #define LWND_DCC_REQ_FB 14
 #define LWND_DCC_UPDATE_WND 15
 #define LWND_DCC_GETKEY 16
+#define LWND_DCC_SUBMIT 17
 
 #define LKEY_MOD_LALT 0x0001
 #define LKEY_MOD_RALT 0x0002
@@ -66,12 +67,57 @@ typedef struct lclr_buffer {
     void* buffer;
 } lclr_buffer_t;
 
+/*
+ * Draw commands for the window command ring
+ */
+#define LWND_CMD_NOP 0
+/* Fill a rectangle with a solid color */
+#define LWND_CMD_FILL_RECT 1
+/* Draw a one pixel outline of a rectangle */
+#define LWND_CMD_OUTLINE_RECT 2
+/* The client drew into this rectangle itself, lwnd only needs to push it to the screen */
+#define LWND_CMD_DAMAGE 3
+
+typedef struct lwnd_cmd {
+    uint16_t type;
+    uint16_t res0;
+    /* Color, already in the framebuffer format */
+    uint32_t clr;
+    uint32_t x;
+    uint32_t y;
+    uint32_t w;
+    uint32_t h;
+} lwnd_cmd_t;
+
+/* Amount of commands that fit in a ring. Needs to be a power of two */
+#define LWND_CMDRING_CAPACITY 128
+
+/*
+ * Command/damage ring shared between a client and lwnd
+ *
+ * The client appends commands at @head and sends a single LWND_DCC_SUBMIT once per frame,
+ * after which lwnd consumes everything between @tail and @head in one go. lwnd only ever
+ * consumes inside the submit, so once that returns the entire ring is free again
+ */
+typedef struct lwnd_cmdring {
+    /* Only written by the client */
+    uint32_t head;
+    /* Only written by lwnd */
+    uint32_t tail;
+    uint32_t capacity;
+    uint32_t res0;
+
+    lwnd_cmd_t cmds[LWND_CMDRING_CAPACITY];
+} lwnd_cmdring_t;
+
 /*
  * Userspace window flags
  */
 #define LWND_FLAG_HAS_FB 0x000000001
 #define LWND_FLAG_FOCUSSED 0x000000002
 #define LWND_FLAG_DEFER_UPDATES 0x000000004
+/* There are draw commands in the ring lwnd has not seen yet */
+#define LWND_FLAG_PENDING_CMDS 0x40000000
 #define LWND_FLAG_NEED_UPDATE 0x80000000
 
 #define LWND_DEFAULT_EVENTBUFFER_CAPACITY 512
@@ -97,6 +143,9 @@ typedef struct lwindow {
     lkey_event_t* keyevent_buffer;
 
     lframebuffer_t fb;
+
+    /* Filled by lwnd together with the framebuffer. NULL if lwnd could not give us one */
+    lwnd_cmdring_t* cmdring;
 } lwindow_t;
 
 #endif // !__LIGHTENV_LIBGFX_DRIVER__
@@ -2,9 +2,106 @@
 #include "libgfx/shared.h"
 #include "lightos/driver/drv.h"
 
+/*!
+ * @brief: Hand everything in the command ring over to lwnd
+ *
+ * This is the only syscall a frame needs when the window has a command ring
+ */
+BOOL lwindow_submit(lwindow_t* wnd)
+{
+    BOOL res;
+    lwnd_cmdring_t* ring;
+
+    if (!wnd)
+        return FALSE;
+
+    ring = wnd->cmdring;
+
+    if (!ring)
+        return driver_send_msg(wnd->lwnd_handle, LWND_DCC_UPDATE_WND, 0, wnd, sizeof(*wnd));
+
+    /* Nothing to do */
+    if (ring->head == ring->tail)
+        return TRUE;
+
+    res = driver_send_msg(wnd->lwnd_handle, LWND_DCC_SUBMIT, 0, wnd, sizeof(*wnd));
+
+    if (res)
+        wnd->wnd_flags &= ~(LWND_FLAG_NEED_UPDATE | LWND_FLAG_PENDING_CMDS);
+
+    return res;
+}
+
+/*!
+ * @brief: Make sure lwnd has executed all queued draw commands
+ *
+ * Needs to be called before touching the framebuffer directly, otherwise queued commands
+ * would end up on top of pixels that were drawn after them
+ */
+BOOL lwindow_flush_cmds(lwindow_t* wnd)
+{
+    if (!wnd || !wnd->cmdring)
+        return TRUE;
+
+    if ((wnd->wnd_flags & LWND_FLAG_PENDING_CMDS) != LWND_FLAG_PENDING_CMDS)
+        return TRUE;
+
+    return lwindow_submit(wnd);
+}
+
+static BOOL __lwindow_push_cmd(lwindow_t* wnd, uint16_t type, uint32_t clr, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    lwnd_cmd_t* cmd;
+    lwnd_cmdring_t* ring = wnd->cmdring;
+
+    /* Ring is full, let lwnd eat what we have so far */
+    if ((ring->head - ring->tail) >= ring->capacity && !lwindow_submit(wnd))
+        return FALSE;
+
+    cmd = &ring->cmds[ring->head & (ring->capacity - 1)];
+
+    cmd->type = type;
+    cmd->clr = clr;
+    cmd->x = x;
+    cmd->y = y;
+    cmd->w = width;
+    cmd->h = height;
+
+    ring->head++;
+
+    if (type != LWND_CMD_DAMAGE)
+        wnd->wnd_flags |= LWND_FLAG_PENDING_CMDS;
+
+    wnd->wnd_flags |= LWND_FLAG_NEED_UPDATE;
+    return TRUE;
+}
+
+/*!
+ * @brief: Tell lwnd we drew into a part of the framebuffer ourselves
+ */
+BOOL lwindow_damage(lwindow_t* wnd, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    if (!wnd || !width || !height)
+        return FALSE;
+
+    if (!wnd->cmdring) {
+        wnd->wnd_flags |= LWND_FLAG_NEED_UPDATE;
+        return TRUE;
+    }
+
+    return __lwindow_push_cmd(wnd, LWND_CMD_DAMAGE, 0, x, y, width, height);
+}
+
 BOOL lwindow_force_update(lwindow_t* wnd)
 {
-    return driver_send_msg(wnd->lwnd_handle, LWND_DCC_UPDATE_WND, 0, wnd, sizeof(*wnd));
+    if (!wnd->cmdring)
+        return driver_send_msg(wnd->lwnd_handle, LWND_DCC_UPDATE_WND, 0, wnd, sizeof(*wnd));
+
+    /* Nothing queued, so the caller wants the entire window redrawn */
+    if (wnd->cmdring->head == wnd->cmdring->tail && !lwindow_damage(wnd, 0, 0, wnd->current_width, wnd->current_height))
+        return FALSE;
+
+    return lwindow_submit(wnd);
 }
 
 BOOL lwindow_update(lwindow_t* wnd)
@@ -16,9 +113,23 @@ BOOL lwindow_update(lwindow_t* wnd)
     if ((wnd->wnd_flags & LWND_FLAG_DEFER_UPDATES) == LWND_FLAG_DEFER_UPDATES)
         return FALSE;
 
+    if (wnd->cmdring)
+        return lwindow_submit(wnd);
+
     return lwindow_force_update(wnd);
 }
 
+static inline uint32_t __lwindow_get_clr(lwindow_t* wnd, lcolor_t clr)
+{
+    uint32_t _clr = 0;
+
+    _clr |= (((uint32_t)clr.r << wnd->fb.red_lshift));
+    _clr |= (((uint32_t)clr.g << wnd->fb.green_lshift));
+    _clr |= (((uint32_t)clr.b << wnd->fb.blue_lshift));
+
+    return _clr;
+}
+
 BOOL lwindow_request_framebuffer(lwindow_t* wnd, lframebuffer_t* fb)
 {
     BOOL res;
@@ -51,14 +162,16 @@ BOOL lwindow_draw_rect(lwindow_t* wnd, uint32_t x, uint32_t y, uint32_t width, u
     if (!width || !height)
         return FALSE;
 
+    /* Let lwnd do it when the frame gets submitted */
+    if (lwindow_has_cmdring(wnd))
+        return __lwindow_push_cmd(wnd, LWND_CMD_FILL_RECT, __lwindow_get_clr(wnd, clr), x, y, width, height);
+
     /* Compute the initial video address */
     bytes_pp = (wnd->fb.bpp >> 3);
     vaddr = wnd->fb.fb + y * wnd->fb.pitch + (x * bytes_pp);
 
     /* Compute the internal color variable */
-    _clr |= (((uint32_t)clr.r << wnd->fb.red_lshift));
-    _clr |= (((uint32_t)clr.g << wnd->fb.green_lshift));
-    _clr |= (((uint32_t)clr.b << wnd->fb.blue_lshift));
+    _clr = __lwindow_get_clr(wnd, clr);
 
     if ((x + width) >= wnd->current_width)
         width -= ((x + width) - wnd->current_width);
@@ -92,14 +205,15 @@ BOOL lwindow_draw_outline_rect(lwindow_t* wnd, uint32_t x, uint32_t y, uint32_t
     if (!width || !height)
         return FALSE;
 
+    if (lwindow_has_cmdring(wnd))
+        return __lwindow_push_cmd(wnd, LWND_CMD_OUTLINE_RECT, __lwindow_get_clr(wnd, clr), x, y, width, height);
+
     /* Compute the initial video address */
     bytes_pp = (wnd->fb.bpp >> 3);
     vaddr = wnd->fb.fb + y * wnd->fb.pitch + (x * bytes_pp);
 
     /* Compute the internal color variable */
-    _clr |= (((uint32_t)clr.r << wnd->fb.red_lshift));
-    _clr |= (((uint32_t)clr.g << wnd->fb.green_lshift));
-    _clr |= (((uint32_t)clr.b << wnd->fb.blue_lshift));
+    _clr = __lwindow_get_clr(wnd, clr);
 
     if ((x + width) > wnd->current_width)
         width -= ((x + width) - wnd->current_width);
@@ -141,6 +255,10 @@ BOOL lwindow_draw_buffer(lwindow_t* wnd, uint32_t startx, uint32_t starty, lclr_
     if (!buffer || !buffer->width || !buffer->height)
         return FALSE;
 
+    /* Queued commands need to land before our pixels do */
+    if (!lwindow_flush_cmds(wnd))
+        return FALSE;
+
     /* Compute the initial video address */
     bytes_pp = (wnd->fb.bpp >> 3);
     vaddr = wnd->fb.fb + (uint64_t)starty * wnd->fb.pitch + (startx * bytes_pp);
@@ -156,6 +274,10 @@ BOOL lwindow_draw_buffer(lwindow_t* wnd, uint32_t startx, uint32_t starty, lclr_
         vaddr += wnd->fb.pitch;
     }
 
+    /* Only push the damage, the update happens once per frame */
+    if (lwindow_has_cmdring(wnd))
+        return lwindow_damage(wnd, startx, starty, buffer->width, buffer->height);
+
     /* We did shit, need an update */
     wnd->wnd_flags |= LWND_FLAG_NEED_UPDATE;
 
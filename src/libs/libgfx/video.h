@@ -21,11 +21,26 @@ BOOL lwindow_request_framebuffer(lwindow_t* wnd, lframebuffer_t* fb);
 BOOL lwindow_update(lwindow_t* wnd);
 BOOL lwindow_force_update(lwindow_t* wnd);
 
+/*
+ * Command ring interface
+ *
+ * When a window has a command ring, the draw functions below only queue up work. Nothing
+ * reaches the screen until the next lwindow_update, which submits the whole frame at once
+ */
+BOOL lwindow_submit(lwindow_t* wnd);
+BOOL lwindow_flush_cmds(lwindow_t* wnd);
+BOOL lwindow_damage(lwindow_t* wnd, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
 static inline BOOL lwindow_has_fb(lwindow_t* wnd)
 {
     return ((wnd->wnd_flags & LWND_FLAG_HAS_FB) == LWND_FLAG_HAS_FB);
 }
 
+static inline BOOL lwindow_has_cmdring(lwindow_t* wnd)
+{
+    return (wnd->cmdring != NULL);
+}
+
 BOOL lwindow_resize(lwindow_t* wnd, uint32_t new_width, uint32_t new_height);
 BOOL lwindow_draw_rect(lwindow_t* wnd, uint32_t x, uint32_t y, uint32_t width, uint32_t height, lcolor_t clr);
 BOOL lwindow_draw_outline_rect(lwindow_t* wnd, uint32_t x, uint32_t y, uint32_t width, uint32_t height, lcolor_t clr);
@@ -41,6 +41,11 @@ enum DYNLDR_MSG_CODE {
      * Returns a pointer to the exitvector of the current process
      */
     DYN_LDR_GET_EXIT_VEC,
+    /*
+     * Get info about the library cache
+     * IN: (dynldr_cache_info_t) buffer to put the info in
+     */
+    DYN_LDR_GET_CACHE_INFO,
 };
 
 typedef struct dynldr_exit_vector {
@@ -48,6 +53,17 @@ typedef struct dynldr_exit_vector {
     void* vec_exits[];
 } dynldr_exit_vector_t;
 
+typedef struct dynldr_cache_info {
+    /* Number of libraries in the cache */
+    unsigned int nr_images;
+    /* Number of library loads that didn't have to read a file */
+    unsigned int nr_hits;
+    /* Number of library pages that get shared between processes */
+    unsigned long long nr_shared_pages;
+    /* Number of physical pages in use on the entire system */
+    unsigned long long nr_used_pages;
+} dynldr_cache_info_t;
+
 typedef struct dynldr_getfuncname_msg {
     const char* proc_path;
     void* func_addr;
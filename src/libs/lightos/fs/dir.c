@@ -2,12 +2,16 @@
 #include "lightos/fs/shared.h"
 #include "lightos/handle.h"
 #include "lightos/handle_def.h"
+#include "lightos/ring/ring.h"
 #include "lightos/syscall.h"
 #include "lightos/system.h"
 #include "sys/types.h"
 #include <stdlib.h>
 #include <string.h>
 
+/* Amount of entries we try to read in one go */
+#define DIR_PREFETCH_COUNT 16
+
 Directory* open_dir(const char* path, u32 flags, u32 mode)
 {
     HANDLE handle;
@@ -82,28 +86,79 @@ static void _dir_link_direntry(Directory* dir, DirEntry* entry)
 {
     DirEntry** walker;
 
-    if (!dir->entries) {
-        dir->entries = entry;
-        return;
-    }
-
     walker = &dir->entries;
 
-    do {
+    /* Find the first entry with a higher index than ours */
+    while (*walker && (*walker)->idx < entry->idx)
+        walker = &(*walker)->next;
+
+    entry->next = *walker;
+    *walker = entry;
+}
+
+/*!
+ * @brief: Read a batch of entries starting at @idx through the syscall ring
+ *
+ * Listing a directory goes through it index by index, so we fetch the entries after @idx
+ * along with it. This turns a trap per entry into a trap per batch. Entries that don't exist
+ * simply fail their read and are thrown away again.
+ *
+ * @returns: 0 when the batch was submitted, even if @idx itself could not be read
+ */
+static error_t _dir_prefetch_entries(Directory* dir, uint32_t idx)
+{
+    DirEntry* ent;
+    lightos_ring_t* ring;
+    lightos_ring_sqe_t* sqe;
+    lightos_ring_cqe_t* cqe;
+
+    ring = lightos_get_ring();
+
+    if (!ring)
+        return -ENOTSUP;
+
+    for (uint32_t i = idx; i < idx + DIR_PREFETCH_COUNT; i++) {
+        /* Already have this one */
+        if (i != idx && _dir_read_entry(dir, i))
+            continue;
 
-        /* If this entry is a higher index than the one we're currently at, we just
-           smash it into the list =0 */
-        if (entry->idx > (*walker)->idx) {
-            entry->next = (*walker)->next;
-            (*walker)->next = entry;
-            return;
+        ent = malloc(sizeof(*ent));
+
+        if (!ent)
+            break;
+
+        sqe = lightos_ring_get_sqe(ring);
+
+        if (!sqe) {
+            free(ent);
+            break;
         }
 
-        walker = &(*walker)->next;
-    } while (*walker);
+        memset(ent, 0, sizeof(*ent));
+
+        ent->idx = i;
+
+        lightos_ring_prep_dir_read(sqe, dir->handle, i, &ent->entry, (u64)ent);
+    }
+
+    if (lightos_ring_submit(ring, NULL))
+        return -EINVAL;
+
+    while ((cqe = lightos_ring_peek_cqe(ring))) {
+        ent = (DirEntry*)cqe->user_data;
+
+        if (cqe->result == 0) {
+            /* Make sure the last byte is null */
+            ent->entry.name[sizeof(ent->entry.name) - 1] = '\0';
 
-    if (!(*walker))
-        *walker = entry;
+            _dir_link_direntry(dir, ent);
+        } else
+            free(ent);
+
+        lightos_ring_cqe_seen(ring);
+    }
+
+    return 0;
 }
 
 DirEntry* dir_read_entry(Directory* dir, uint32_t idx)
@@ -117,6 +172,10 @@ DirEntry* dir_read_entry(Directory* dir, uint32_t idx)
     if (ent)
         return ent;
 
+    /* Try to grab it together with the next couple of entries */
+    if (!_dir_prefetch_entries(dir, idx))
+        return _dir_read_entry(dir, idx);
+
     /* Nope, make a new one */
     ent = malloc(sizeof(*ent));
 
@@ -1,5 +1,6 @@
 #include "handle.h"
 #include "lightos/handle_def.h"
+#include "lightos/ring/ring.h"
 #include "lightos/syscall.h"
 #include "stdlib.h"
 #include <stdio.h>
@@ -69,6 +70,102 @@ error_t handle_read_ex(HANDLE handle, VOID* buffer, u64 buffer_size, u64* preads
     return sys_read(handle, buffer, buffer_size, preadsize);
 }
 
+/*!
+ * @brief: Seek and read/write in one go
+ *
+ * When we have a syscall ring, the seek and the transfer are submitted together, so the
+ * kernel only gets entered once. Otherwise we fall back to two plain syscalls
+ */
+static error_t _handle_rw_at(HANDLE handle, enum LIGHTOS_RING_OP op, u64 offset, VOID* buffer, u64 buffer_size, u64* psize)
+{
+    error_t error, seek_error;
+    lightos_ring_t* ring;
+    lightos_ring_sqe_t* sqe[2];
+    lightos_ring_cqe_t* cqe;
+
+    ring = lightos_get_ring();
+
+    if (!ring || lightos_ring_get_pending(ring))
+        goto fallback;
+
+    sqe[0] = lightos_ring_get_sqe(ring);
+
+    if (!sqe[0])
+        goto fallback;
+
+    sqe[1] = lightos_ring_get_sqe(ring);
+
+    /* Don't leave an unfilled entry behind for the next submit */
+    if (!sqe[1]) {
+        lightos_ring_put_sqe(ring);
+        goto fallback;
+    }
+
+    /* Linked, so the kernel cancels the transfer when the seek fails */
+    lightos_ring_prep_seek(sqe[0], handle, offset, SEEK_SET, 0);
+    sqe[0]->flags |= LIGHTOS_RING_SQE_FLAG_LINK;
+
+    if (op == LIGHTOS_RING_OP_READ)
+        lightos_ring_prep_read(sqe[1], handle, buffer, buffer_size, 1);
+    else
+        lightos_ring_prep_write(sqe[1], handle, buffer, buffer_size, 1);
+
+    error = lightos_ring_submit(ring, NULL);
+    seek_error = 0;
+
+    while ((cqe = lightos_ring_peek_cqe(ring))) {
+        /* A seek completes with the new offset */
+        if (cqe->user_data == 0 && cqe->result != offset)
+            seek_error = EINVAL;
+
+        if (cqe->user_data == 1) {
+            error = cqe->result;
+
+            if (psize)
+                *psize = cqe->size;
+        }
+
+        lightos_ring_cqe_seen(ring);
+    }
+
+    /* The transfer got canceled if the seek failed */
+    if (seek_error)
+        return seek_error;
+
+    return error;
+
+fallback:
+    /* sys_seek gives back the new offset, anything else means it failed */
+    if (sys_seek(handle, offset, SEEK_SET) != offset)
+        return EINVAL;
+
+    if (op == LIGHTOS_RING_OP_READ)
+        return sys_read(handle, buffer, buffer_size, psize);
+
+    error = sys_write(handle, buffer, buffer_size);
+
+    if (!error && psize)
+        *psize = buffer_size;
+
+    return error;
+}
+
+error_t handle_read_at(HANDLE handle, u64 offset, VOID* buffer, u64 buffer_size, u64* preadsize)
+{
+    if (!buffer || !buffer_size)
+        return EINVAL;
+
+    return _handle_rw_at(handle, LIGHTOS_RING_OP_READ, offset, buffer, buffer_size, preadsize);
+}
+
+error_t handle_write_at(HANDLE handle, u64 offset, VOID* buffer, size_t buffer_size)
+{
+    if (!buffer || !buffer_size)
+        return EINVAL;
+
+    return _handle_rw_at(handle, LIGHTOS_RING_OP_WRITE, offset, buffer, buffer_size, NULL);
+}
+
 error_t handle_write(HANDLE handle, VOID* buffer, size_t buffer_size)
 {
     if (!buffer || !buffer_size)
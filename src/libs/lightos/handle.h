@@ -80,4 +80,11 @@ error_t handle_read_ex(HANDLE handle, VOID* buffer, u64 buffer_size, u64* preads
  */
 error_t handle_write(HANDLE handle, VOID* buffer, size_t buffer_size);
 
+/*
+ * Read or write at a specific offset. Costs a single trap when the process
+ * has a syscall ring
+ */
+error_t handle_read_at(HANDLE handle, u64 offset, VOID* buffer, u64 buffer_size, u64* preadsize);
+error_t handle_write_at(HANDLE handle, u64 offset, VOID* buffer, size_t buffer_size);
+
 #endif // !__LIGHTENV_HANDLE__
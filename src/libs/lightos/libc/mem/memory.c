@@ -1,384 +1,398 @@
 #include "memory.h"
 #include "lightos/memory/alloc.h"
 #include "lightos/memory/memory.h"
-#include <assert.h>
 #include <lightos/system.h>
 #include <stdio.h>
 #include <string.h>
 
 /*
- * TODO: I hate this impl: fix it
+ * Userspace heap
+ *
+ * Small allocations (up to MALLOC_MAX_SMALL bytes) are served from size-class runs. A run is
+ * a chunk of virtual memory we get from the kernel, cut up into equally sized blocks. Every
+ * block starts with a small header that points back to its run, so freeing is O(1): no need to
+ * look up who owns a pointer.
+ *
+ * Size classes go in steps of 16 bytes up to 256 bytes, and in four steps per power of two
+ * after that. This keeps the internal waste under 25% while keeping the number of classes low.
+ *
+ * Every class keeps a list of runs that still have free blocks. Freed blocks go to the front
+ * of their runs free list, so recently freed (cache-hot) memory is handed out first. Runs that
+ * become entirely free are given back to the kernel, except for the last one of a class, so a
+ * malloc/free loop does not hammer the kernel.
+ *
+ * Anything bigger gets its own span straight from the kernel, which is released again on free.
  */
 
-#define ALIGN_UP(addr, size) \
-    (((addr) % (size) == 0) ? (addr) : (addr) + (size) - ((addr) % (size)))
+#define MALLOC_ALIGN 16
+#define MALLOC_MAGIC 0x4d4c4f43
+#define MALLOC_MAGIC_FREE 0x46524545
+
+/* Header flags */
+#define MALLOC_HDR_LARGE 0x00000001
+
+/* Classes of 16 byte steps */
+#define MALLOC_NR_LINEAR_CLASSES 16
+#define MALLOC_LINEAR_MAX (MALLOC_NR_LINEAR_CLASSES * MALLOC_ALIGN)
+/* Four classes for every power of two from 256 up to 32 Kib */
+#define MALLOC_NR_CLASSES (MALLOC_NR_LINEAR_CLASSES + 7 * 4)
+#define MALLOC_MAX_SMALL (32 * Kib)
 
-#define ALIGN_DOWN(addr, size) ((addr) - ((addr) % (size)))
+/* Default size of a run. Runs of the bigger classes are made to fit at least MALLOC_RUN_MIN_BLOCKS */
+#define MALLOC_RUN_SIZE (64 * Kib)
+#define MALLOC_RUN_MIN_BLOCKS 8
+
+struct malloc_run;
 
-#define POOLENTRY_USED_BIT 0x8000000000000000ULL
 /*
- * A single entry inside the pool
+ * Header in front of every block we hand out
+ *
+ * Keeping this at 16 bytes keeps the data behind it 16-byte aligned
  */
-struct malloc_pool_entry {
-    uintptr_t attr;
+struct malloc_hdr {
+    union {
+        /* The run a small block belongs to */
+        struct malloc_run* run;
+        /* Size of the entire span for large blocks (header included) */
+        size_t span_size;
+    };
+    uint32_t flags;
+    uint32_t magic;
+};
 
-    uint8_t data[];
+/* A free block links to the next free block of the run through its data */
+struct malloc_free_block {
+    struct malloc_hdr hdr;
+    struct malloc_free_block* next;
 };
 
-static inline void* _poolentry_get_data(struct malloc_pool_entry* entry)
-{
-    return entry->data;
-}
+/*
+ * A run of same-sized blocks
+ */
+struct malloc_run {
+    struct malloc_run* next;
+    struct malloc_run* prev;
+    struct malloc_class* class;
+
+    /* Size of the entire run, as we got it from the kernel */
+    size_t size;
+    /* Size of a single block, header included */
+    size_t stride;
+
+    uint32_t nr_blocks;
+    uint32_t nr_used;
+
+    /* Blocks that were freed before */
+    struct malloc_free_block* free_list;
+    /* Blocks that were never handed out */
+    uint8_t* fresh;
+    uint8_t* end;
+} __attribute__((aligned(MALLOC_ALIGN)));
+
+struct malloc_class {
+    /* Usable size of the blocks in this class */
+    size_t size;
+    /* Runs that still have free blocks */
+    struct malloc_run* partial;
+};
 
-static inline struct malloc_pool_entry* _data_get_malloc_pool_entry(void* data)
-{
-    return (struct malloc_pool_entry*)((uintptr_t)data - sizeof(struct malloc_pool_entry));
-}
+static struct malloc_class __classes[MALLOC_NR_CLASSES];
 
-static inline uintptr_t _poolentry_get_next_free(struct malloc_pool_entry* entry)
+static inline struct malloc_hdr* _data_get_hdr(void* data)
 {
-    return (uintptr_t)(entry->attr & ~(POOLENTRY_USED_BIT));
+    return (struct malloc_hdr*)((uintptr_t)data - sizeof(struct malloc_hdr));
 }
 
-static inline void _poolentry_set_next_free(struct malloc_pool_entry* entry, uintptr_t next)
+static inline void* _hdr_get_data(struct malloc_hdr* hdr)
 {
-    /* This should really never happen xD */
-    assert((next & POOLENTRY_USED_BIT) != POOLENTRY_USED_BIT);
-
-    entry->attr &= POOLENTRY_USED_BIT;
-    entry->attr |= next;
+    return (void*)((uintptr_t)hdr + sizeof(struct malloc_hdr));
 }
 
-/*
- * A pool of dynamic memory
+/*!
+ * @brief: Get the size class for an allocation of @size bytes
  *
- * Pools are organised as followed: We order pools based on their entry_size field. We group pools together with
- * the same entry_sizes in a linked list.
+ * @size must be in the range [1, MALLOC_MAX_SMALL]
  */
-struct malloc_pool {
-    struct malloc_pool* m_next_size;
-    struct malloc_pool* m_next_sibling;
-    size_t m_data_size;
-    size_t m_entry_size;
-    uint8_t m_poolentries[];
-};
-
-static inline size_t _get_real_entrysize(size_t entrysize)
+static inline uint32_t _size_to_class(size_t size)
 {
-    return entrysize + sizeof(struct malloc_pool_entry);
-}
+    uint32_t shift;
 
-static inline struct malloc_pool_entry* _pool_get_entry(struct malloc_pool* pool, uintptr_t idx)
-{
-    idx *= _get_real_entrysize(pool->m_entry_size);
+    if (size <= MALLOC_LINEAR_MAX)
+        return (size - 1) >> 4;
 
-    if (idx >= pool->m_data_size)
-        return nullptr;
+    /* The power of two right below @size */
+    shift = 63 - __builtin_clzl(size - 1);
 
-    return (struct malloc_pool_entry*)&pool->m_poolentries[idx];
+    return MALLOC_NR_LINEAR_CLASSES + (shift - 8) * 4 + (((size - 1) >> (shift - 2)) & 3);
 }
 
-static inline bool _pool_is_valid_pointer(struct malloc_pool* pool, void* data, struct malloc_pool_entry** bentry)
+static inline size_t _class_to_size(uint32_t class)
 {
-    struct malloc_pool_entry* entry;
+    uint32_t shift;
 
-    if (!data)
-        return false;
+    if (class < MALLOC_NR_LINEAR_CLASSES)
+        return (class + 1) << 4;
 
-    /* Data lays outside of the pools valid range */
-    if (data < (void*)pool->m_poolentries || data >= (void*)(pool->m_poolentries + pool->m_data_size))
-        return false;
+    class -= MALLOC_NR_LINEAR_CLASSES;
+    shift = 8 + (class >> 2);
 
-    entry = _data_get_malloc_pool_entry(data);
-
-    /* TODO: Verify the entries hash */
-    if (bentry)
-        *bentry = entry;
-    return true;
+    return (1ULL << shift) + (((class & 3) + 1) << (shift - 2));
 }
 
-static struct malloc_pool* __start_range;
-
-/*!
- * @brief: Find a pool which supports our allocationsize
- *
- * This only finds the top size pool. This should be the head of the sibling chain
- */
-static struct malloc_pool* _find_malloc_pool(size_t entrysize)
+static inline void _class_push_run(struct malloc_class* class, struct malloc_run* run)
 {
-    struct malloc_pool* walker;
-
-    walker = __start_range;
+    run->prev = nullptr;
+    run->next = class->partial;
 
-    while (walker) {
-        if (walker->m_entry_size == ALIGN_UP(entrysize, MEMPOOL_ALIGN))
-            return walker;
+    if (class->partial)
+        class->partial->prev = run;
 
-        walker = walker->m_next_size;
-    }
-
-    return nullptr;
+    class->partial = run;
 }
 
-/*!
- * @brief: Calculate what the max entrycount is going to be for a given entrysize
- *
- * 'calculate'
- */
-static inline size_t _calculate_poolsize(size_t entrysize)
+static inline void _class_remove_run(struct malloc_class* class, struct malloc_run* run)
 {
-    size_t coefficient;
-
-    /*
-     * AHHHHH MY EYESOCKETS
-     */
-    if (entrysize <= (16 * Kib))
-        coefficient = 64;
-    else if (entrysize <= (64 * Kib))
-        coefficient = 16;
+    if (run->prev)
+        run->prev->next = run->next;
     else
-        coefficient = 1;
+        class->partial = run->next;
+
+    if (run->next)
+        run->next->prev = run->prev;
 
-    return _get_real_entrysize(entrysize) * coefficient;
+    run->next = nullptr;
+    run->prev = nullptr;
 }
 
-static struct malloc_pool* _create_malloc_pool(size_t entrysize)
+static struct malloc_run* _create_malloc_run(struct malloc_class* class)
 {
-    size_t poolsize;
-    struct malloc_pool* ret;
+    size_t size;
+    size_t stride;
+    struct malloc_run* ret;
 
-    entrysize = ALIGN_UP(entrysize, MEMPOOL_ENTSZ_ALIGN);
+    stride = sizeof(struct malloc_hdr) + class->size;
+    size = sizeof(*ret) + stride * MALLOC_RUN_MIN_BLOCKS;
 
-    poolsize = _calculate_poolsize(entrysize) + sizeof(*ret);
+    if (size < MALLOC_RUN_SIZE)
+        size = MALLOC_RUN_SIZE;
 
-    /* Allocate a memorypool where we can put our malloc pool */
-    ret = allocate_vmem(poolsize, VMEM_FLAG_READ | VMEM_FLAG_WRITE);
+    size = ALIGN_UP(size, MEMPOOL_ALIGN);
+
+    ret = allocate_vmem(size, VMEM_FLAG_READ | VMEM_FLAG_WRITE);
 
-    /* Syscall memory for us */
     if (!ret)
         return nullptr;
 
     memset(ret, 0, sizeof(*ret));
 
-    ret->m_entry_size = entrysize;
-    ret->m_data_size = ALIGN_DOWN(poolsize - sizeof(*ret), _get_real_entrysize(ret->m_entry_size));
-    ret->m_next_sibling = NULL;
-    ret->m_next_size = NULL;
-
-    memset(ret->m_poolentries, 0, ret->m_data_size);
+    ret->class = class;
+    ret->size = size;
+    ret->stride = stride;
+    ret->nr_blocks = (size - sizeof(*ret)) / stride;
+    ret->fresh = (uint8_t*)&ret[1];
+    ret->end = ret->fresh + ret->nr_blocks * stride;
 
+    _class_push_run(class, ret);
     return ret;
 }
 
-static inline int _pool_append_size(struct malloc_pool* pool, struct malloc_pool* to_append)
+static inline void _destroy_malloc_run(struct malloc_run* run)
 {
-    /* Inherit the next size */
-    to_append->m_next_size = pool->m_next_size;
-    to_append->m_next_sibling = NULL;
-
-    /* Walk the entire sibling chain to update the links */
-    while (pool) {
-        pool->m_next_size = to_append;
-
-        /* Cycle through the siblings */
-        pool = pool->m_next_sibling;
-    }
-
-    return 0;
+    deallocate_vmem(run, run->size);
 }
 
-static inline int _pool_append_sibling(struct malloc_pool* pool, struct malloc_pool* to_append)
+static void* _alloc_small(size_t size)
 {
-    struct malloc_pool** slot;
+    struct malloc_hdr* hdr;
+    struct malloc_run* run;
+    struct malloc_class* class;
 
-    /* Inherit the next size */
-    to_append->m_next_size = pool->m_next_size;
-    to_append->m_next_sibling = NULL;
+    class = &__classes[_size_to_class(size)];
+    run = class->partial;
 
-    slot = &pool;
+    if (!run)
+        run = _create_malloc_run(class);
 
-    while (*slot)
-        slot = &(*slot)->m_next_sibling;
+    if (!run)
+        return nullptr;
+
+    if (run->free_list) {
+        hdr = &run->free_list->hdr;
+        run->free_list = run->free_list->next;
+    } else {
+        hdr = (struct malloc_hdr*)run->fresh;
+        run->fresh += run->stride;
+    }
 
-    /* Finally place the pool into it's slot */
-    *slot = to_append;
+    hdr->run = run;
+    hdr->flags = 0;
+    hdr->magic = MALLOC_MAGIC;
 
-    return 0;
+    /* Full runs don't need to be found by the allocator anymore */
+    if (++run->nr_used == run->nr_blocks)
+        _class_remove_run(class, run);
+
+    return _hdr_get_data(hdr);
 }
 
-static int _register_malloc_pool(struct malloc_pool* pool)
+static void _free_small(struct malloc_hdr* hdr)
 {
-    struct malloc_pool* walker;
+    struct malloc_run* run = hdr->run;
+    struct malloc_class* class = run->class;
+    struct malloc_free_block* block = (struct malloc_free_block*)hdr;
+
+    /* The run was full, so it wasn't on the partial list */
+    if (run->nr_used-- == run->nr_blocks)
+        _class_push_run(class, run);
 
-    walker = __start_range;
+    hdr->magic = MALLOC_MAGIC_FREE;
 
-    do {
-        if (walker->m_entry_size == pool->m_entry_size)
-            return _pool_append_sibling(walker, pool);
+    block->next = run->free_list;
+    run->free_list = block;
 
-        if (pool->m_entry_size > walker->m_entry_size)
-            /*
-             * If we either reached the end of the chain, meaning the pool we're adding is the largest pool yet,
-             * or if this pools entrysize is in between that of the walkers entrysize and it's next entrysize, we
-             * can append it
-             */
-            if (!walker->m_next_size || walker->m_next_size->m_entry_size > pool->m_entry_size)
-                return _pool_append_size(walker, pool);
+    if (run->nr_used)
+        return;
 
-        walker = walker->m_next_size;
-    } while (walker);
+    /* Keep the last run of a class around, it'll be needed again soon enough */
+    if (class->partial == run && !run->next)
+        return;
 
-    /* Could not append for some reason */
-    return -1;
+    _class_remove_run(class, run);
+    _destroy_malloc_run(run);
 }
 
-static void* _try_pool_allocate(struct malloc_pool* pool)
+static void* _alloc_large(size_t size)
 {
-    size_t entrysize;
-    size_t entrycount;
-    struct malloc_pool_entry* entry;
+    size_t span_size;
+    struct malloc_hdr* hdr;
 
-    entrysize = _get_real_entrysize(pool->m_entry_size);
-    entrycount = pool->m_data_size / entrysize;
+    span_size = ALIGN_UP(size + sizeof(*hdr), MEMPOOL_ALIGN);
 
-    /*
-     * Simple linear scan to get this fucking shit done right now lmao
-     */
-    for (uint64_t i = 0; i < entrycount; i++) {
-        entry = (struct malloc_pool_entry*)&pool->m_poolentries[i * entrysize];
+    /* Overflow */
+    if (span_size < size)
+        return nullptr;
 
-        if ((entry->attr & POOLENTRY_USED_BIT) == POOLENTRY_USED_BIT)
-            continue;
+    hdr = allocate_vmem(span_size, VMEM_FLAG_READ | VMEM_FLAG_WRITE);
 
-        entry->attr |= POOLENTRY_USED_BIT;
+    if (!hdr)
+        return nullptr;
 
-        memset(entry->data, 0, pool->m_entry_size);
+    hdr->span_size = span_size;
+    hdr->flags = MALLOC_HDR_LARGE;
+    hdr->magic = MALLOC_MAGIC;
 
-        return _poolentry_get_data(entry);
-    }
+    return _hdr_get_data(hdr);
+}
+
+static inline size_t _hdr_get_usable_size(struct malloc_hdr* hdr)
+{
+    if ((hdr->flags & MALLOC_HDR_LARGE) == MALLOC_HDR_LARGE)
+        return hdr->span_size - sizeof(*hdr);
 
-    return nullptr;
+    return hdr->run->class->size;
 }
 
 /*!
- * @brief: Try to yoink a pool entry
+ * @brief Internal memory allocation routine
  *
- * TODO: optimize
+ * Small sizes get a block from their size class, big sizes get a span of their own
  */
-static void* _pool_allocate(struct malloc_pool* pool)
+void* mem_alloc(size_t size)
 {
-    void* ret;
-    struct malloc_pool* extra_pool;
-
-    /* Try to allocate in every pool that we have */
-    do {
-        ret = _try_pool_allocate(pool);
-
-        if (ret)
-            return ret;
-
-        pool = pool->m_next_sibling;
-    } while (pool);
-
-    /* Create and extra pool */
-    extra_pool = _create_malloc_pool(pool->m_entry_size);
+    if (!size)
+        return nullptr;
 
-    /* Try to see if we can allocate inside of a new pool =/ */
-    _pool_append_sibling(
-        pool,
-        extra_pool);
+    if (size <= MALLOC_MAX_SMALL)
+        return _alloc_small(size);
 
-    /* Try to allocate here */
-    return _try_pool_allocate(extra_pool);
+    return _alloc_large(size);
 }
 
 /*!
- * @brief Internal memory allocation routine
+ * @brief: Resize the allocation at @addr
  *
- * Based on the size, we'll see if we can find a pool to allocate in. If we can't find
- * anything, we'll simply create a new one
+ * Stays in place when the block is already big enough. Large spans that shrink give their
+ * tail pages back to the kernel
  */
-void* mem_alloc(size_t size)
+void* mem_move_alloc(void* addr, size_t new_size)
 {
-    struct malloc_pool* pool;
+    void* ret;
+    size_t usable;
+    size_t span_size;
+    struct malloc_hdr* hdr;
+
+    if (!addr)
+        return mem_alloc(new_size);
+
+    hdr = _data_get_hdr(addr);
+
+    if (hdr->magic != MALLOC_MAGIC)
+        return nullptr;
 
-    /* Make sure the size is aligned right */
-    size = ALIGN_UP(size, MEMPOOL_ENTSZ_ALIGN);
+    usable = _hdr_get_usable_size(hdr);
 
-    pool = _find_malloc_pool(size);
+    if (new_size <= usable) {
+        if ((hdr->flags & MALLOC_HDR_LARGE) != MALLOC_HDR_LARGE || new_size <= MALLOC_MAX_SMALL)
+            return addr;
 
-    if (!pool) {
-        pool = _create_malloc_pool(size);
+        span_size = ALIGN_UP(new_size + sizeof(*hdr), MEMPOOL_ALIGN);
 
-        /* No memory left I guess? */
-        if (!pool)
-            return nullptr;
+        if (span_size < hdr->span_size && !deallocate_vmem((void*)((uintptr_t)hdr + span_size), hdr->span_size - span_size))
+            hdr->span_size = span_size;
 
-        /* This is very stoopid */
-        if (_register_malloc_pool(pool) != 0)
-            return nullptr;
+        return addr;
     }
 
-    return _pool_allocate(pool);
-}
+    ret = mem_alloc(new_size);
 
-void* mem_move_alloc(void* addr, size_t new_size)
-{
-    return nullptr;
+    if (!ret)
+        return nullptr;
+
+    memcpy(ret, addr, usable);
+
+    mem_dealloc(addr);
+    return ret;
 }
 
 /*!
- * @brief: Find the pool and entry that correspond to a given address @addr
+ * @brief: Get the number of bytes that can be used in the allocation at @addr
  */
-static int _resolve_pool_entry(void* addr, struct malloc_pool** bpool, struct malloc_pool_entry** bentry)
+size_t mem_get_size(void* addr)
 {
-    struct malloc_pool* walker;
-    struct malloc_pool* sibling_walker;
+    struct malloc_hdr* hdr;
 
-    /* Null is always invalid */
     if (!addr)
-        return -1;
+        return 0;
 
-    sibling_walker = nullptr;
-    walker = __start_range;
+    hdr = _data_get_hdr(addr);
 
-    /* Walk the top-level pool chain */
-    while (walker) {
-        sibling_walker = walker;
+    if (hdr->magic != MALLOC_MAGIC)
+        return 0;
 
-        /* Walk the sibling chain */
-        do {
-
-            if (_pool_is_valid_pointer(sibling_walker, addr, bentry))
-                break;
-
-            sibling_walker = sibling_walker->m_next_sibling;
-        } while (sibling_walker);
+    return _hdr_get_usable_size(hdr);
+}
 
-        walker = walker->m_next_size;
-    }
+int mem_dealloc(void* addr)
+{
+    struct malloc_hdr* hdr;
 
-    /* Could not find a valid pool */
-    if (!sibling_walker)
+    if (!addr)
         return -1;
 
-    /* Set the pool buffer. _pool_is_valid_pointer already populates @bentry */
-    if (bpool)
-        *bpool = sibling_walker;
+    hdr = _data_get_hdr(addr);
 
-    return 0;
-}
+    /* Not ours, or freed twice */
+    if (hdr->magic != MALLOC_MAGIC)
+        return -1;
 
-int mem_dealloc(void* addr)
-{
-    struct malloc_pool* pool;
-    struct malloc_pool_entry* entry;
+    if ((hdr->flags & MALLOC_HDR_LARGE) != MALLOC_HDR_LARGE) {
+        _free_small(hdr);
+        return 0;
+    }
 
-    if (_resolve_pool_entry(addr, &pool, &entry))
-        return -1;
+    hdr->magic = MALLOC_MAGIC_FREE;
 
-    entry->attr &= ~POOLENTRY_USED_BIT;
-    return 0;
+    return deallocate_vmem(hdr, hdr->span_size) ? -1 : 0;
 }
 
 /*
@@ -394,12 +408,9 @@ int mem_dealloc(void* addr)
  */
 void __init_memalloc(void)
 {
-    /* Initialize structures */
-    /* Ask for a memory region from the kernel */
-    /* Use the initial memory we get to initialize the allocator further */
-    /* Mark readiness */
-    __start_range = _create_malloc_pool(1);
-
-    /* Asser this crap */
-    assert(__start_range != nullptr);
+    /* Runs are created lazily, we only need to know the class sizes */
+    for (uint32_t i = 0; i < MALLOC_NR_CLASSES; i++) {
+        __classes[i].size = _class_to_size(i);
+        __classes[i].partial = nullptr;
+    }
 }
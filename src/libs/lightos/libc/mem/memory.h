@@ -15,12 +15,18 @@ void* mem_alloc(
 
 /*
  * Move the allocation at a certain address to a bigger buffer
- * returns the old pointer if the size didn't change
+ * returns the old pointer if the allocation already fits the new size
  */
 void* mem_move_alloc(
     void* ptr,
     size_t new_size);
 
+/*
+ * Get the number of usable bytes in an allocation
+ */
+size_t mem_get_size(
+    void* addr);
+
 /*
  * Memory deallocation
  */
@@ -23,10 +23,22 @@ void* malloc(size_t __size)
  */
 void* calloc(size_t count, size_t __size)
 {
-    if (!count)
+    void* ret;
+    size_t total;
+
+    if (!count || !__size)
+        return nullptr;
+
+    if (__builtin_mul_overflow(count, __size, &total))
         return nullptr;
 
-    return mem_alloc(count * __size);
+    ret = mem_alloc(total);
+
+    /* Recycled blocks are not cleared by the allocator */
+    if (ret)
+        memset(ret, 0, total);
+
+    return ret;
 }
 
 /*
@@ -35,7 +47,7 @@ void* calloc(size_t count, size_t __size)
 void* realloc(void* ptr, size_t __size)
 {
     if (!ptr)
-        return nullptr;
+        return malloc(__size);
 
     if (!__size) {
         mem_dealloc(ptr);
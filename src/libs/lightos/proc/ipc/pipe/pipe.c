@@ -6,6 +6,7 @@
 #include "unistd.h"
 #include <errno.h>
 #include <lightos/driver/drv.h>
+#include <lightos/memory/alloc.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -121,7 +122,302 @@ static inline int _lightos_pipe_dump(lightos_pipe_dump_t* dump)
     return -1;
 }
 
-int init_lightos_pipe(lightos_pipe_t* pipe, const char* name, u32 flags, u32 max_listeners, u32 datasize)
+static inline int _lightos_pipe_ring_wait(HANDLE pipe, u32 size)
+{
+    lightos_pipe_ring_wait_t wait = {
+        .pipe_handle = pipe,
+        .size = size,
+    };
+
+    if (driver_send_msg(upi_handle, LIGHTOS_UPI_MSG_RING_WAIT, 0, &wait, sizeof(wait)))
+        return 0;
+
+    return -EPIPE;
+}
+
+static inline void _lightos_pipe_ring_wake(HANDLE pipe)
+{
+    (void)driver_send_msg(upi_handle, LIGHTOS_UPI_MSG_RING_WAKE, 0, &pipe, sizeof(pipe));
+}
+
+/*
+ * Ring backed pipes
+ *
+ * Transactions are put in and taken out of the ring that the driver mapped for us, without any
+ * syscalls. We only go to the driver to sleep when we can't make progress and to wake the other
+ * side, when it told us through the ring that it's sleeping
+ */
+
+static inline u32 __ring_msg_size(u32 payload_size)
+{
+    return (sizeof(lightos_pipe_ring_msg_t) + payload_size + LIGHTOS_PIPE_RING_MSG_ALIGN - 1) & ~(LIGHTOS_PIPE_RING_MSG_ALIGN - 1);
+}
+
+static inline bool __ring_is_producer(lightos_pipe_t* pipe)
+{
+    return (pipe->ring && pipe->ring_slot == LIGHTOS_PIPE_RING_SLOT_PRODUCER);
+}
+
+static inline bool __ring_is_consumer(lightos_pipe_t* pipe)
+{
+    return (pipe->ring && pipe->ring_slot < LIGHTOS_PIPE_RING_MAX_CONSUMERS);
+}
+
+static inline bool __ring_is_closed(lightos_pipe_ring_t* ring)
+{
+    return (__atomic_load_n(&ring->flags, __ATOMIC_ACQUIRE) & LIGHTOS_PIPE_RING_FLAG_CLOSED) == LIGHTOS_PIPE_RING_FLAG_CLOSED;
+}
+
+/*!
+ * @brief: Wait until there are @size bytes free in the ring
+ */
+static int __ring_reserve(lightos_pipe_t* pipe, u32 size)
+{
+    int error;
+    lightos_pipe_ring_t* ring = pipe->ring;
+
+    while (ring->size - lightos_pipe_ring_used(ring) < size) {
+        if (__ring_is_closed(ring))
+            return -EPIPE;
+
+        /* Tell the consumers we need a wakeup. The driver checks the ring again before we sleep */
+        __atomic_add_fetch(&ring->n_space_waiters, 1, __ATOMIC_SEQ_CST);
+
+        error = _lightos_pipe_ring_wait(pipe->pipe, size);
+
+        __atomic_sub_fetch(&ring->n_space_waiters, 1, __ATOMIC_SEQ_CST);
+
+        if (error)
+            return error;
+    }
+
+    return 0;
+}
+
+/*!
+ * @brief: Make everything up to @head visible to the consumers
+ */
+static inline void __ring_publish(lightos_pipe_t* pipe, u64 head)
+{
+    lightos_pipe_ring_t* ring = pipe->ring;
+
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+    /* Pairs with the increment of n_waiters on the consumer side */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->n_waiters, __ATOMIC_RELAXED))
+        _lightos_pipe_ring_wake(pipe->pipe);
+}
+
+/*!
+ * @brief: Put a transaction in the ring
+ *
+ * Transactions that are bigger than half the ring go in as multiple fragments, so the consumers can
+ * start copying the first part while we're still putting in the rest
+ */
+static int __ring_send(lightos_pipe_t* pipe, int type, const void* data, u32 size)
+{
+    int error;
+    u32 offset, chunk, msg_size, pad, pos;
+    u64 head;
+    lightos_pipe_ring_msg_t* msg;
+    lightos_pipe_ring_t* ring = pipe->ring;
+    const u32 max_chunk = (ring->size >> 1) - sizeof(lightos_pipe_ring_msg_t);
+
+    if (__ring_is_closed(ring))
+        return -EPIPE;
+
+    /* We're the only one that writes this */
+    head = ring->head;
+    offset = 0;
+
+    do {
+        chunk = size - offset;
+
+        if (chunk > max_chunk)
+            chunk = max_chunk;
+
+        msg_size = __ring_msg_size(chunk);
+        pos = head & (ring->size - 1);
+        pad = 0;
+
+        /* Messages don't wrap. Fill up the end of the ring and start over at the front */
+        if (pos + msg_size > ring->size)
+            pad = ring->size - pos;
+
+        error = __ring_reserve(pipe, pad + msg_size);
+
+        if (error)
+            return error;
+
+        if (pad) {
+            msg = (lightos_pipe_ring_msg_t*)&lightos_pipe_ring_data(ring)[pos];
+            msg->type = LIGHTOS_PIPE_TRANSACT_TYPE_NONE;
+            msg->flags = 0;
+            msg->size = pad - sizeof(*msg);
+            msg->total_size = 0;
+
+            head += pad;
+            pos = 0;
+        }
+
+        msg = (lightos_pipe_ring_msg_t*)&lightos_pipe_ring_data(ring)[pos];
+        msg->type = type;
+        msg->flags = (offset + chunk < size) ? LIGHTOS_PIPE_RING_MSG_MORE : 0;
+
+        if (offset)
+            msg->flags |= LIGHTOS_PIPE_RING_MSG_CONT;
+        msg->size = chunk;
+        msg->total_size = size;
+
+        memcpy(&msg[1], (const u8*)data + offset, chunk);
+
+        head += msg_size;
+        offset += chunk;
+
+        if (offset >= size)
+            __atomic_add_fetch(&ring->n_transacts, 1, __ATOMIC_RELAXED);
+
+        __ring_publish(pipe, head);
+    } while (offset < size);
+
+    return 0;
+}
+
+/*!
+ * @brief: Move our tail to @tail, giving the space before it back to the producer
+ */
+static inline void __ring_release(lightos_pipe_t* pipe, u64 tail)
+{
+    lightos_pipe_ring_t* ring = pipe->ring;
+
+    __atomic_store_n(&ring->consumers[pipe->ring_slot].tail, tail, __ATOMIC_RELEASE);
+
+    /* Pairs with the increment of n_space_waiters on the producer side */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->n_space_waiters, __ATOMIC_RELAXED))
+        _lightos_pipe_ring_wake(pipe->pipe);
+}
+
+/*!
+ * @brief: Grab the message at our tail
+ *
+ * Skips over padding. When looking for the @start of a transaction, we also skip the rest of a
+ * transaction we only got the tail end of (we may have connected in the middle of it). When @block
+ * is set, we sleep until the producer puts something in
+ */
+static int __ring_peek(lightos_pipe_t* pipe, lightos_pipe_ring_msg_t** p_msg, bool start, bool block)
+{
+    int error;
+    u64 tail, head;
+    lightos_pipe_ring_msg_t* msg;
+    lightos_pipe_ring_t* ring = pipe->ring;
+    lightos_pipe_ring_consumer_t* consumer = &ring->consumers[pipe->ring_slot];
+
+    for (;;) {
+        tail = consumer->tail;
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        if (tail != head) {
+            msg = (lightos_pipe_ring_msg_t*)&lightos_pipe_ring_data(ring)[tail & (ring->size - 1)];
+
+            /* Don't trust the producer to stay inside the ring */
+            if (msg->size > ring->size - sizeof(*msg))
+                return -EIO;
+
+            if (msg->type != LIGHTOS_PIPE_TRANSACT_TYPE_NONE && (!start || (msg->flags & LIGHTOS_PIPE_RING_MSG_CONT) != LIGHTOS_PIPE_RING_MSG_CONT)) {
+                *p_msg = msg;
+                return 0;
+            }
+
+            /* Padding fills the ring exactly, everything else is aligned */
+            if (msg->type == LIGHTOS_PIPE_TRANSACT_TYPE_NONE)
+                __ring_release(pipe, tail + sizeof(*msg) + msg->size);
+            else
+                __ring_release(pipe, tail + __ring_msg_size(msg->size));
+
+            continue;
+        }
+
+        if (__ring_is_closed(ring))
+            return -EPIPE;
+
+        if (!block)
+            return -EAGAIN;
+
+        /* Tell the producer we need a wakeup. The driver checks our tail again before we sleep */
+        __atomic_add_fetch(&ring->n_waiters, 1, __ATOMIC_SEQ_CST);
+
+        error = _lightos_pipe_ring_wait(pipe->pipe, 0);
+
+        __atomic_sub_fetch(&ring->n_waiters, 1, __ATOMIC_SEQ_CST);
+
+        if (error)
+            return error;
+    }
+}
+
+/*!
+ * @brief: Take the transaction at our tail out of the ring
+ *
+ * Copies it into @pdata when we @accept it. Fragments that are still on their way are waited for
+ */
+static int __ring_consume(lightos_pipe_t* pipe, void* pdata, size_t psize, bool accept)
+{
+    int error;
+    u16 flags;
+    size_t offset, n;
+    u64 tail;
+    lightos_pipe_ring_msg_t* msg;
+    lightos_pipe_ring_t* ring = pipe->ring;
+    lightos_pipe_ring_consumer_t* consumer = &ring->consumers[pipe->ring_slot];
+
+    error = __ring_peek(pipe, &msg, true, false);
+
+    if (error)
+        return error;
+
+    offset = 0;
+
+    for (;;) {
+        if (accept && pdata && offset < psize) {
+            n = psize - offset;
+
+            if (n > msg->size)
+                n = msg->size;
+
+            memcpy((u8*)pdata + offset, &msg[1], n);
+            offset += n;
+        }
+
+        /* Grab everything we need before the producer may have the space back */
+        flags = msg->flags;
+        tail = consumer->tail + __ring_msg_size(msg->size);
+
+        __ring_release(pipe, tail);
+
+        if ((flags & LIGHTOS_PIPE_RING_MSG_MORE) != LIGHTOS_PIPE_RING_MSG_MORE)
+            break;
+
+        error = __ring_peek(pipe, &msg, false, true);
+
+        if (error)
+            return error;
+    }
+
+    __atomic_store_n(&consumer->n_handled, consumer->n_handled + 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(accept ? &ring->n_accept : &ring->n_deny, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static inline size_t __ring_bsize(lightos_pipe_t* pipe)
+{
+    return LIGHTOS_PIPE_RING_DATA_OFFSET + pipe->ring_size;
+}
+
+int init_lightos_pipe_ex(lightos_pipe_t* pipe, const char* name, u32 flags, u32 max_listeners, u32 datasize, u32 ring_size)
 {
     memset(pipe, 0, sizeof(*pipe));
 
@@ -130,11 +426,17 @@ int init_lightos_pipe(lightos_pipe_t* pipe, const char* name, u32 flags, u32 max
     pipe->flags = flags;
     pipe->max_listeners = max_listeners;
     pipe->data_size = datasize;
+    pipe->ring_size = ring_size;
 
-    /* The driver will finalise pipe creation and give us a handle */
+    /* The driver will finalise pipe creation and give us a handle (and a ring) */
     return _lightos_pipe_create(pipe);
 }
 
+int init_lightos_pipe(lightos_pipe_t* pipe, const char* name, u32 flags, u32 max_listeners, u32 datasize)
+{
+    return init_lightos_pipe_ex(pipe, name, flags, max_listeners, datasize, 0);
+}
+
 int init_lightos_pipe_uniform(lightos_pipe_t* pipe, const char* name, u32 flags, u32 max_listeners, u32 datasize)
 {
     if (!datasize)
@@ -153,7 +455,17 @@ int init_lightos_pipe_global(lightos_pipe_t* pipe, const char* name, u32 flags,
 
 int destroy_lightos_pipe(lightos_pipe_t* pipe)
 {
-    return _lightos_pipe_destroy(pipe->pipe);
+    int error;
+
+    error = _lightos_pipe_destroy(pipe->pipe);
+
+    /* Our mapping of the ring is ours to get rid of */
+    if (!error && pipe->ring) {
+        deallocate_vmem(pipe->ring, __ring_bsize(pipe));
+        pipe->ring = NULL;
+    }
+
+    return error;
 }
 
 int lightos_pipe_dump(lightos_pipe_t* pipe, lightos_pipe_dump_t* pdump)
@@ -176,6 +488,12 @@ int lightos_pipe_is_empty(lightos_pipe_t* pipe, BOOL* empty)
     if (!pipe || !empty)
         return -EINVAL;
 
+    /* Empty when the slowest consumer has caught up */
+    if (pipe->ring) {
+        *empty = (lightos_pipe_ring_used(pipe->ring) == 0) ? TRUE : FALSE;
+        return 0;
+    }
+
     *empty = FALSE;
 
     error = lightos_pipe_dump(pipe, &dump);
@@ -202,7 +520,11 @@ int lightos_pipe_await_empty(lightos_pipe_t* pipe)
         if (error || empty)
             break;
 
-        usleep(1000);
+        /* The creator of a ring can just sleep until the entire ring is free */
+        if (__ring_is_producer(pipe))
+            error = __ring_reserve(pipe, pipe->ring->size);
+        else
+            usleep(1000);
     } while (error == 0);
 
     return error;
@@ -262,7 +584,62 @@ int lightos_pipe_connect_rel(lightos_pipe_t* pipe, HANDLE rel_handle, const char
 
 int lightos_pipe_disconnect(lightos_pipe_t* pipe)
 {
-    return _lightos_pipe_disconnect(pipe->pipe);
+    int error;
+
+    error = _lightos_pipe_disconnect(pipe->pipe);
+
+    /*
+     * Drop our mapping of the ring, even if the driver did not know about us anymore. In that case
+     * the pipe is gone already and we're the only ones holding on to it
+     */
+    if (pipe->ring) {
+        deallocate_vmem(pipe->ring, __ring_bsize(pipe));
+        pipe->ring = NULL;
+    }
+
+    return error;
+}
+
+static int __lightos_pipe_ring_send(lightos_pipe_t* pipe, lightos_pipe_transaction_t* p_transaction, int type, void* pdata, size_t size)
+{
+    int error;
+    int signal;
+    HANDLE handle;
+
+    /* Only the creator produces */
+    if (!__ring_is_producer(pipe))
+        return -EINVAL;
+
+    switch (type) {
+    case LIGHTOS_PIPE_TRANSACT_TYPE_DATA:
+        /* Uniform pipes cut their transactions down, just like the driver does */
+        if ((pipe->flags & LIGHTOS_UPIPE_FLAGS_UNIFORM) == LIGHTOS_UPIPE_FLAGS_UNIFORM && size > pipe->data_size)
+            size = pipe->data_size;
+        break;
+    case LIGHTOS_PIPE_TRANSACT_TYPE_SIGNAL:
+        signal = (int)(uintptr_t)pdata;
+        pdata = &signal;
+        size = sizeof(signal);
+        break;
+    case LIGHTOS_PIPE_TRANSACT_TYPE_HANDLE:
+        handle = (HANDLE)(uintptr_t)pdata;
+        pdata = &handle;
+        size = sizeof(handle);
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    error = __ring_send(pipe, type, pdata, size);
+
+    *p_transaction = (lightos_pipe_transaction_t) {
+        .transaction_type = type,
+        .data_size = size,
+        .deny_count = 0,
+        .accept_count = 0,
+    };
+
+    return error;
 }
 
 int lightos_pipe_send(lightos_pipe_t* pipe, lightos_pipe_transaction_t* p_transaction, int type, void* pdata, size_t size)
@@ -270,6 +647,9 @@ int lightos_pipe_send(lightos_pipe_t* pipe, lightos_pipe_transaction_t* p_transa
     int error;
     lightos_pipe_ft_t ft;
 
+    if (pipe->ring)
+        return __lightos_pipe_ring_send(pipe, p_transaction, type, pdata, size);
+
     ft.transaction = (lightos_pipe_transaction_t) {
         .transaction_type = type,
         .data_size = size,
@@ -315,6 +695,34 @@ int lightos_pipe_send_handle(lightos_pipe_t* pipe, lightos_pipe_transaction_t* p
     return lightos_pipe_send(pipe, p_transaction, LIGHTOS_PIPE_TRANSACT_TYPE_HANDLE, (void*)(uintptr_t)handle, sizeof(handle));
 }
 
+/*!
+ * @brief: Describe the transaction at our tail, without taking it out of the ring
+ *
+ * An empty ring gives an empty transaction, unless we @block until something shows up
+ */
+static int __lightos_pipe_ring_preview(lightos_pipe_t* pipe, lightos_pipe_transaction_t* p_transaction, bool block)
+{
+    int error;
+    lightos_pipe_ring_msg_t* msg;
+
+    memset(p_transaction, 0, sizeof(*p_transaction));
+
+    if (!__ring_is_consumer(pipe))
+        return -EINVAL;
+
+    error = __ring_peek(pipe, &msg, true, block);
+
+    if (error == -EAGAIN)
+        return 0;
+
+    if (error)
+        return error;
+
+    p_transaction->transaction_type = msg->type;
+    p_transaction->data_size = msg->total_size;
+    return 0;
+}
+
 int lightos_pipe_preview(lightos_pipe_t* pipe, lightos_pipe_transaction_t* p_transaction)
 {
     int error;
@@ -323,6 +731,9 @@ int lightos_pipe_preview(lightos_pipe_t* pipe, lightos_pipe_transaction_t* p_tra
     if (!pipe || !p_transaction)
         return -EINVAL;
 
+    if (pipe->ring)
+        return __lightos_pipe_ring_preview(pipe, p_transaction, false);
+
     /* Preview expects the ft to have the handle variable set */
     ft.pipe_handle = pipe->pipe;
 
@@ -338,6 +749,16 @@ int lightos_pipe_await_transaction(lightos_pipe_t* pipe, lightos_pipe_transactio
     int error;
     lightos_pipe_transaction_t transact;
 
+    /* Rings let us sleep until the producer wakes us */
+    if (pipe->ring) {
+        error = __lightos_pipe_ring_preview(pipe, &transact, true);
+
+        if (ptransaction)
+            *ptransaction = transact;
+
+        return error;
+    }
+
     do {
         error = lightos_pipe_preview(pipe, &transact);
 
@@ -358,6 +779,9 @@ int lightos_pipe_accept(lightos_pipe_t* pipe, void* pdata, size_t psize)
 {
     lightos_pipe_accept_t accept = { 0 };
 
+    if (pipe->ring)
+        return __ring_is_consumer(pipe) ? __ring_consume(pipe, pdata, psize, true) : -EINVAL;
+
     accept.pipe_handle = pipe->pipe;
     accept.buffer = pdata;
     accept.buffer_size = psize;
@@ -367,5 +791,8 @@ int lightos_pipe_accept(lightos_pipe_t* pipe, void* pdata, size_t psize)
 
 int lightos_pipe_deny(lightos_pipe_t* pipe)
 {
+    if (pipe->ring)
+        return __ring_is_consumer(pipe) ? __ring_consume(pipe, NULL, 0, false) : -EINVAL;
+
     return _lightos_pipe_deny(pipe->pipe);
 }
@@ -15,6 +15,14 @@
  */
 int init_lightos_pipe(lightos_pipe_t* pipe, const char* name, u32 flags, u32 max_listeners, u32 datasize);
 
+/*!
+ * @brief: Initialize a new pipe struct with a ring of a certain size
+ *
+ * @ring_size: Size of the data area of the ring backing the pipe. Zero for the default. Ignored
+ * for pipes that don't get a ring
+ */
+int init_lightos_pipe_ex(lightos_pipe_t* pipe, const char* name, u32 flags, u32 max_listeners, u32 datasize, u32 ring_size);
+
 /*!
  * @brief: Initialize a pipe for uniform data
  *
@@ -8,6 +8,8 @@
 #define LIGHTOS_UPIPE_FLAGS_FULLDUPLEX 0x00000001
 #define LIGHTOS_UPIPE_FLAGS_UNIFORM 0x00000002
 #define LIGHTOS_UPIPE_FLAGS_GLOBAL 0x00000004
+/* Don't back this pipe with a shared ring, but let the driver copy every transaction */
+#define LIGHTOS_UPIPE_FLAGS_NORING 0x00000008
 
 /*
  * full/signle duplex IPC struct
@@ -35,6 +37,15 @@ typedef struct lightos_pipe {
     unsigned int data_size;
     /* The maximum number of listeners this pipe may have. Zero for infinite */
     unsigned int max_listeners;
+    /*
+     * Size of the data area of the pipes ring. Set by the creator to ask for a certain size (Zero
+     * for the default), after which the driver puts the actual size here
+     */
+    unsigned int ring_size;
+    /* Consumer slot of this process inside the ring. LIGHTOS_PIPE_RING_SLOT_PRODUCER for the creator */
+    unsigned int ring_slot;
+    /* Address of the ring inside this process. NULL when the pipe has no ring */
+    struct lightos_pipe_ring* ring;
 } lightos_pipe_t;
 
 /*
@@ -103,6 +114,8 @@ static inline unsigned char lightos_transaction_is_valid(lightos_pipe_transactio
 #define LIGHTOS_UPI_MSG_DENY_TRANSACT 6
 #define LIGHTOS_UPI_MSG_PREVIEW_TRANSACT 7
 #define LIGHTOS_UPI_MSG_DUMP_PIPE 8
+#define LIGHTOS_UPI_MSG_RING_WAIT 9
+#define LIGHTOS_UPI_MSG_RING_WAKE 10
 
 /*
  * Sent to the driver when a transaction is sent
@@ -127,4 +140,130 @@ typedef struct lightos_pipe_accept {
     void* buffer;
 } lightos_pipe_accept_t;
 
+/*
+ * Pipe rings
+ *
+ * Unless a pipe is full duplex or created with LIGHTOS_UPIPE_FLAGS_NORING, the driver backs it with a
+ * ring that is mapped into the creator and into every listener. The creator is the only producer: it
+ * writes messages at head and bumps it. Every listener owns a consumer slot with its own tail, so each
+ * listener sees every transaction, just like with the driver-managed pipes. The producer may only
+ * overwrite data that every active consumer has moved past.
+ *
+ * The driver never touches the messages themselves. It only hands out consumer slots and puts
+ * processes to sleep when they have nothing to do (LIGHTOS_UPI_MSG_RING_WAIT). A side that made
+ * progress only calls LIGHTOS_UPI_MSG_RING_WAKE when the other side has said it is (about to be)
+ * sleeping through n_waiters or n_space_waiters.
+ *
+ * Messages are a lightos_pipe_ring_msg_t header followed by the payload, padded to
+ * LIGHTOS_PIPE_RING_MSG_ALIGN. A message that would run past the end of the data area is preceded by
+ * a padding message (type NONE) that fills up the rest of the ring. Transactions that don't fit into
+ * half of the ring are split into fragments that carry LIGHTOS_PIPE_RING_MSG_MORE, except for the
+ * last one.
+ *
+ * NOTE: The ring is single producer. Threads of the creator that send over the same pipe need to
+ * serialize their sends themselves
+ *
+ * This header is also used inside the kernel
+ */
+
+#define LIGHTOS_PIPE_RING_MAX_CONSUMERS 16
+#define LIGHTOS_PIPE_RING_DEFAULT_SIZE (64 * 1024)
+#define LIGHTOS_PIPE_RING_MIN_SIZE (4 * 1024)
+#define LIGHTOS_PIPE_RING_MAX_SIZE (4 * 1024 * 1024)
+/* The data area starts on the page after the ring header */
+#define LIGHTOS_PIPE_RING_DATA_OFFSET 4096
+#define LIGHTOS_PIPE_RING_MSG_ALIGN 16
+/* Consumer slot of the creator, which doesn't consume */
+#define LIGHTOS_PIPE_RING_SLOT_PRODUCER 0xffffffff
+
+/* Set by the driver when the pipe is gone. Nothing new will ever show up */
+#define LIGHTOS_PIPE_RING_FLAG_CLOSED 0x00000001
+
+/* More fragments of this transaction follow */
+#define LIGHTOS_PIPE_RING_MSG_MORE 0x0001
+/* Not the first fragment of a transaction */
+#define LIGHTOS_PIPE_RING_MSG_CONT 0x0002
+
+typedef struct lightos_pipe_ring_msg {
+    /* One of LIGHTOS_PIPE_TRANSACT_TYPE_*. NONE marks padding */
+    unsigned short type;
+    unsigned short flags;
+    /* Size of the payload of this message */
+    unsigned int size;
+    /* Size of the entire transaction, over every fragment */
+    unsigned int total_size;
+    unsigned int res0;
+} lightos_pipe_ring_msg_t;
+
+typedef struct lightos_pipe_ring_consumer {
+    /* Offset of the next message this consumer is going to read */
+    unsigned long long tail;
+    /* Number of transactions this consumer handled */
+    unsigned long long n_handled;
+} __attribute__((aligned(64))) lightos_pipe_ring_consumer_t;
+
+typedef struct lightos_pipe_ring {
+    /* Size of the data area, always a power of two */
+    unsigned int size;
+    unsigned int flags;
+    /* Bitmap of the consumer slots in use. Only written by the driver */
+    unsigned int consumer_mask;
+    /* Number of consumers that are going to sleep until head moves */
+    unsigned int n_waiters;
+    /* Non-zero when the producer is going to sleep until a tail moves */
+    unsigned int n_space_waiters;
+    unsigned int res0;
+    /* Totals for pipe dumps */
+    unsigned long long n_accept;
+    unsigned long long n_deny;
+
+    /* Offset where the producer puts its next message. Free running, wraps through the mask */
+    unsigned long long head __attribute__((aligned(64)));
+    /* Number of transactions the producer has put in the ring */
+    unsigned long long n_transacts;
+
+    lightos_pipe_ring_consumer_t consumers[LIGHTOS_PIPE_RING_MAX_CONSUMERS];
+} lightos_pipe_ring_t;
+
+static inline unsigned char* lightos_pipe_ring_data(lightos_pipe_ring_t* ring)
+{
+    return (unsigned char*)ring + LIGHTOS_PIPE_RING_DATA_OFFSET;
+}
+
+/*!
+ * @brief: Number of bytes between head and the tail of the slowest consumer
+ *
+ * The producer can't write more than ring->size minus this
+ */
+static inline unsigned long long lightos_pipe_ring_used(lightos_pipe_ring_t* ring)
+{
+    unsigned long long head, tail, used;
+    unsigned int mask;
+
+    used = 0;
+    mask = __atomic_load_n(&ring->consumer_mask, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    for (unsigned int i = 0; i < LIGHTOS_PIPE_RING_MAX_CONSUMERS; i++) {
+        if ((mask & (1U << i)) == 0)
+            continue;
+
+        tail = __atomic_load_n(&ring->consumers[i].tail, __ATOMIC_ACQUIRE);
+
+        if (head - tail > used)
+            used = head - tail;
+    }
+
+    return used;
+}
+
+/*
+ * Sent to the driver when a process wants to sleep on a pipe ring. Listeners sleep until there is
+ * something in the ring for them, the creator sleeps until there are @size bytes free
+ */
+typedef struct lightos_pipe_ring_wait {
+    HANDLE pipe_handle;
+    unsigned int size;
+} lightos_pipe_ring_wait_t;
+
 #endif // !__LIGHTOS_LIBC_PIPE_SHARED__
@@ -3,6 +3,7 @@
 #include "lightos/handle.h"
 #include "lightos/handle_def.h"
 #include "lightos/syscall.h"
+#include "lightos/time/time.h"
 
 HANDLE open_proc(const char* name, u32 flags, u32 mode)
 {
@@ -49,5 +50,15 @@ BOOL kill_process(HANDLE handle, u32 flags)
 
 size_t get_process_time()
 {
-    return sys_get_process_time();
+    size_t now;
+    /* Uptime at which this process was launched */
+    static size_t start_ms = (size_t)-1;
+
+    now = lightos_get_uptime_ms();
+
+    /* Only ask the kernel once, the kernel data page has everything we need after that */
+    if (start_ms == (size_t)-1)
+        start_ms = now - sys_get_process_time();
+
+    return now - start_ms;
 }
@@ -0,0 +1,99 @@
+#include "ring.h"
+#include "lightos/ring/shared.h"
+#include "lightos/syscall.h"
+
+static lightos_ring_t* __ring;
+/* Tail of the entries we handed out. Only becomes visible to the kernel on submit */
+static u32 __sq_tail;
+static bool __ring_unavailable;
+
+lightos_ring_t* lightos_get_ring()
+{
+    lightos_ring_t* ring;
+
+    if (__ring)
+        return __ring;
+
+    /* Don't keep asking the kernel if it told us no once */
+    if (__ring_unavailable)
+        return nullptr;
+
+    ring = nullptr;
+
+    if (sys_ring_setup(LIGHTOS_RING_DEFAULT_ENTRIES, 0, &ring) || !ring) {
+        __ring_unavailable = true;
+        return nullptr;
+    }
+
+    __sq_tail = ring->sq_tail;
+    __ring = ring;
+
+    return ring;
+}
+
+lightos_ring_sqe_t* lightos_ring_get_sqe(lightos_ring_t* ring)
+{
+    u32 sq_head;
+    lightos_ring_sqe_t* sqe;
+
+    sq_head = __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (__sq_tail - sq_head >= ring->sq_entries)
+        return nullptr;
+
+    sqe = &lightos_ring_get_sqes(ring)[__sq_tail & (ring->sq_entries - 1)];
+
+    __sq_tail++;
+
+    return sqe;
+}
+
+void lightos_ring_put_sqe(lightos_ring_t* ring)
+{
+    if (!lightos_ring_get_pending(ring))
+        return;
+
+    __sq_tail--;
+}
+
+u32 lightos_ring_get_pending(lightos_ring_t* ring)
+{
+    return __sq_tail - ring->sq_tail;
+}
+
+error_t lightos_ring_submit(lightos_ring_t* ring, u32* p_consumed)
+{
+    u32 pending;
+
+    pending = lightos_ring_get_pending(ring);
+
+    /* Make the filled entries visible, before the kernel gets to see the new tail */
+    __atomic_store_n(&ring->sq_tail, __sq_tail, __ATOMIC_RELEASE);
+
+    if (!pending) {
+        if (p_consumed)
+            *p_consumed = 0;
+        return 0;
+    }
+
+    return sys_ring_enter(pending, 0, p_consumed);
+}
+
+lightos_ring_cqe_t* lightos_ring_peek_cqe(lightos_ring_t* ring)
+{
+    u32 cq_head;
+    u32 cq_tail;
+
+    cq_head = ring->cq_head;
+    cq_tail = __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (cq_head == cq_tail)
+        return nullptr;
+
+    return &lightos_ring_get_cqes(ring)[cq_head & (ring->cq_entries - 1)];
+}
+
+void lightos_ring_cqe_seen(lightos_ring_t* ring)
+{
+    __atomic_store_n(&ring->cq_head, ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,83 @@
+#ifndef __LIGHTOS_RING_H__
+#define __LIGHTOS_RING_H__
+
+#include <lightos/fs/shared.h>
+#include <lightos/handle_def.h>
+#include <lightos/ring/shared.h>
+#include <lightos/types.h>
+
+/*
+ * Userspace end of the syscall ring
+ *
+ * Grab submission entries with lightos_ring_get_sqe, fill them (the prep helpers below do that for
+ * the common operations) and hand all of them to the kernel at once with lightos_ring_submit.
+ * Completions are reaped with lightos_ring_peek_cqe and lightos_ring_cqe_seen.
+ *
+ * There is a single ring per process, which is not safe to use from multiple threads at once.
+ */
+
+/* Get the ring of this process. Sets it up the first time around */
+extern lightos_ring_t* lightos_get_ring();
+
+/* Get a free submission entry. Returns NULL when the SQ is full */
+extern lightos_ring_sqe_t* lightos_ring_get_sqe(lightos_ring_t* ring);
+/* Give back the last entry we got from lightos_ring_get_sqe, as long as it was not submitted */
+extern void lightos_ring_put_sqe(lightos_ring_t* ring);
+/* Amount of submission entries that were handed out, but not submitted yet */
+extern u32 lightos_ring_get_pending(lightos_ring_t* ring);
+/* Hand every pending submission to the kernel in a single syscall */
+extern error_t lightos_ring_submit(lightos_ring_t* ring, u32* p_consumed);
+
+/* Get the oldest completion that was not reaped yet, or NULL if there is none */
+extern lightos_ring_cqe_t* lightos_ring_peek_cqe(lightos_ring_t* ring);
+/* Give the completion we got from lightos_ring_peek_cqe back to the kernel */
+extern void lightos_ring_cqe_seen(lightos_ring_t* ring);
+
+static inline void lightos_ring_prep(lightos_ring_sqe_t* sqe, enum LIGHTOS_RING_OP op, HANDLE handle, u64 user_data)
+{
+    sqe->op = op;
+    sqe->flags = 0;
+    sqe->res0 = 0;
+    sqe->handle = handle;
+    sqe->arg = 0;
+    sqe->res1 = 0;
+    sqe->offset = 0;
+    sqe->buffer = 0;
+    sqe->size = 0;
+    sqe->user_data = user_data;
+}
+
+static inline void lightos_ring_prep_read(lightos_ring_sqe_t* sqe, HANDLE handle, void* buffer, u64 size, u64 user_data)
+{
+    lightos_ring_prep(sqe, LIGHTOS_RING_OP_READ, handle, user_data);
+
+    sqe->buffer = (u64)buffer;
+    sqe->size = size;
+}
+
+static inline void lightos_ring_prep_write(lightos_ring_sqe_t* sqe, HANDLE handle, void* buffer, u64 size, u64 user_data)
+{
+    lightos_ring_prep(sqe, LIGHTOS_RING_OP_WRITE, handle, user_data);
+
+    sqe->buffer = (u64)buffer;
+    sqe->size = size;
+}
+
+static inline void lightos_ring_prep_seek(lightos_ring_sqe_t* sqe, HANDLE handle, u64 offset, u32 type, u64 user_data)
+{
+    lightos_ring_prep(sqe, LIGHTOS_RING_OP_SEEK, handle, user_data);
+
+    sqe->offset = offset;
+    sqe->arg = type;
+}
+
+static inline void lightos_ring_prep_dir_read(lightos_ring_sqe_t* sqe, HANDLE handle, u32 idx, lightos_direntry_t* dirent, u64 user_data)
+{
+    lightos_ring_prep(sqe, LIGHTOS_RING_OP_DIR_READ, handle, user_data);
+
+    sqe->offset = idx;
+    sqe->buffer = (u64)dirent;
+    sqe->size = sizeof(*dirent);
+}
+
+#endif // !__LIGHTOS_RING_H__
@@ -0,0 +1,108 @@
+#ifndef __LIGHTOS_RING_SHARED_H__
+#define __LIGHTOS_RING_SHARED_H__
+
+/*
+ * Syscall ring
+ *
+ * A process can ask the kernel for a submission queue (SQ) and a completion queue (CQ) in memory
+ * that is shared between the process and the kernel. Userspace fills submission entries and bumps
+ * sq_tail, after which a single SYSID_RING_ENTER makes the kernel go through all of them. For every
+ * submission the kernel posts a completion entry, carrying the same user_data, which userspace
+ * reaps at its own pace by bumping cq_head.
+ *
+ * Ownership of the indices:
+ *  - sq_tail and cq_head are written by userspace
+ *  - sq_head and cq_tail are written by the kernel
+ *
+ * Submissions are processed in order, so a SEEK followed by a READ on the same handle works like
+ * one would expect. The kernel stops consuming submissions when the CQ is full, so completions
+ * never get lost.
+ *
+ * This header is also used inside the kernel
+ */
+
+#include <lightos/handle_def.h>
+#include <lightos/types.h>
+
+/* Upper bound of entries in either queue */
+#define LIGHTOS_RING_MAX_ENTRIES 256
+#define LIGHTOS_RING_DEFAULT_ENTRIES 32
+
+enum LIGHTOS_RING_OP {
+    LIGHTOS_RING_OP_NOP,
+    /* Read @size bytes into @buffer */
+    LIGHTOS_RING_OP_READ,
+    /* Write @size bytes from @buffer */
+    LIGHTOS_RING_OP_WRITE,
+    /* Set the handle offset to @offset, with @arg as the seek type. Completes with the new offset */
+    LIGHTOS_RING_OP_SEEK,
+    /* Read directory entry @offset into @buffer */
+    LIGHTOS_RING_OP_DIR_READ,
+    /* Send message @arg to the handle */
+    LIGHTOS_RING_OP_SEND_MSG,
+    /* Close the handle */
+    LIGHTOS_RING_OP_CLOSE,
+
+    LIGHTOS_RING_OP_COUNT,
+};
+
+/*
+ * Don't process any further submissions of this batch when this one fails. An absolute seek
+ * fails when it does not end up at @offset
+ */
+#define LIGHTOS_RING_SQE_FLAG_LINK 0x01
+
+typedef struct lightos_ring_sqe {
+    u8 op;
+    u8 flags;
+    u16 res0;
+    HANDLE handle;
+    u32 arg;
+    u32 res1;
+    u64 offset;
+    u64 buffer;
+    u64 size;
+    u64 user_data;
+} lightos_ring_sqe_t;
+
+/* The submission was not processed, since a linked submission in front of it failed */
+#define LIGHTOS_RING_CQE_FLAG_CANCELED 0x01
+
+typedef struct lightos_ring_cqe {
+    u64 user_data;
+    /* Return value of the operation, just like the matching syscall would have returned */
+    u64 result;
+    /* Amount of bytes that were transfered, for reads and writes */
+    u64 size;
+    u32 flags;
+    u32 res0;
+} lightos_ring_cqe_t;
+
+typedef struct lightos_ring {
+    volatile u32 sq_head;
+    volatile u32 sq_tail;
+    volatile u32 cq_head;
+    volatile u32 cq_tail;
+
+    /* Always powers of two */
+    u32 sq_entries;
+    u32 cq_entries;
+
+    /* Offsets of the entry arrays, from the start of this structure */
+    u32 sq_off;
+    u32 cq_off;
+
+    u32 res0[8];
+} lightos_ring_t;
+
+static inline lightos_ring_sqe_t* lightos_ring_get_sqes(lightos_ring_t* ring)
+{
+    return (lightos_ring_sqe_t*)((u8*)ring + ring->sq_off);
+}
+
+static inline lightos_ring_cqe_t* lightos_ring_get_cqes(lightos_ring_t* ring)
+{
+    return (lightos_ring_cqe_t*)((u8*)ring + ring->cq_off);
+}
+
+#endif // !__LIGHTOS_RING_SHARED_H__
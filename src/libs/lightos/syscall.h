@@ -18,6 +18,7 @@
 #include "lightos/driver/loader.h"
 #include "lightos/fs/shared.h"
 #include "lightos/handle_def.h"
+#include "lightos/ring/shared.h"
 #include "lightos/sysvar/shared.h"
 #include <lightos/types.h>
 
@@ -68,6 +69,9 @@ enum SYSID {
 
     /* Dynamic loader-specific syscalls */
     SYSID_GET_FUNCTION,
+
+    SYSID_RING_SETUP,
+    SYSID_RING_ENTER,
 };
 
 /* Mask that marks a sysid invalid */
@@ -114,4 +118,7 @@ extern void sys_sleep(u64 ns);
 
 extern void* sys_get_function(HANDLE lib, const char* function);
 
+extern error_t sys_ring_setup(u32 entries, u32 flags, lightos_ring_t** p_ring);
+extern error_t sys_ring_enter(u32 to_submit, u32 flags, u32* p_consumed);
+
 #endif // !__LIGHTENV_SYSCALL__
@@ -115,6 +115,16 @@ size_t sys_seek(HANDLE handle, u64 offset, u32 type)
     return syscall_3(SYSID_SEEK, handle, offset, type);
 }
 
+error_t sys_ring_setup(u32 entries, u32 flags, lightos_ring_t** p_ring)
+{
+    return syscall_3(SYSID_RING_SETUP, entries, flags, (u64)p_ring);
+}
+
+error_t sys_ring_enter(u32 to_submit, u32 flags, u32* p_consumed)
+{
+    return syscall_3(SYSID_RING_ENTER, to_submit, flags, (u64)p_consumed);
+}
+
 size_t sys_get_process_time(void)
 {
     return syscall_0(SYSID_GET_PROCESSTIME);
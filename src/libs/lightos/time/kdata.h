@@ -0,0 +1,41 @@
+#ifndef __LIGHTOS_TIME_KDATA_H__
+#define __LIGHTOS_TIME_KDATA_H__
+
+/*
+ * Kernel data page
+ *
+ * The kernel maps a single read-only page at LIGHTOS_KDATA_ADDR into every userprocess, which
+ * it updates on every tick. This lets userspace get the time without having to go through a
+ * syscall every time.
+ *
+ * This header is also used inside the kernel
+ */
+
+#include <lightos/types.h>
+
+#define LIGHTOS_KDATA_ADDR 0x00007ffffffff000ULL
+#define LIGHTOS_KDATA_VERSION 1
+
+typedef struct lightos_kdata {
+    /* Odd while the kernel is updating the page. Readers retry when this changes under them */
+    volatile u32 seq;
+    u32 version;
+    /* Tick rate of the active tick source */
+    volatile u32 ticks_per_s;
+    u32 res0;
+
+    /* Ticks since boot */
+    volatile u64 ticks;
+
+    /* System time at the last tick */
+    volatile u64 s_since_boot;
+    volatile u64 ms_since_last_s;
+    volatile u64 us_since_last_ms;
+
+    /* TSC at the last tick. Together with tsc_hz this lets readers measure time in between ticks */
+    volatile u64 tsc_at_tick;
+    /* Measured TSC frequency. Stays zero until the kernel has had the time to calibrate it */
+    volatile u64 tsc_hz;
+} lightos_kdata_t;
+
+#endif // !__LIGHTOS_TIME_KDATA_H__
@@ -0,0 +1,84 @@
+#include "time.h"
+
+static inline u64 __rdtsc()
+{
+    u32 lo, hi;
+
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+
+    return ((u64)hi << 32) | lo;
+}
+
+const lightos_kdata_t* lightos_get_kdata()
+{
+    const lightos_kdata_t* kdata = (const lightos_kdata_t*)LIGHTOS_KDATA_ADDR;
+
+    /* A kernel that doesn't know about us */
+    if (kdata->version != LIGHTOS_KDATA_VERSION)
+        return nullptr;
+
+    return kdata;
+}
+
+/*!
+ * @brief: Take a consistent snapshot of the kernel data page
+ *
+ * The kernel bumps the sequence counter before and after it updates the page, so we just
+ * retry until we get a copy that wasn't written to halfway through
+ */
+error_t lightos_read_kdata(lightos_kdata_t* p_kdata)
+{
+    u32 seq;
+    const lightos_kdata_t* kdata = lightos_get_kdata();
+
+    if (!kdata || !p_kdata)
+        return -EINVAL;
+
+    do {
+        seq = __atomic_load_n(&kdata->seq, __ATOMIC_ACQUIRE);
+
+        if (seq & 1)
+            continue;
+
+        *p_kdata = *kdata;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != kdata->seq);
+
+    return 0;
+}
+
+u64 lightos_get_ticks()
+{
+    lightos_kdata_t kdata;
+
+    if (lightos_read_kdata(&kdata))
+        return 0;
+
+    return kdata.ticks;
+}
+
+u64 lightos_get_uptime_ms()
+{
+    u64 ms;
+    u64 tick_ms;
+    u64 delta;
+    lightos_kdata_t kdata;
+
+    if (lightos_read_kdata(&kdata))
+        return 0;
+
+    ms = (kdata.s_since_boot * 1000) + kdata.ms_since_last_s;
+
+    if (!kdata.tsc_hz || !kdata.ticks_per_s)
+        return ms;
+
+    /* Fill in the time since the last tick, but never run past the next one */
+    delta = ((__rdtsc() - kdata.tsc_at_tick) * 1000) / kdata.tsc_hz;
+    tick_ms = 1000 / kdata.ticks_per_s;
+
+    if (delta >= tick_ms)
+        delta = tick_ms - 1;
+
+    return ms + delta;
+}
@@ -0,0 +1,20 @@
+#ifndef __LIGHTOS_TIME_H__
+#define __LIGHTOS_TIME_H__
+
+#include <lightos/time/kdata.h>
+#include <lightos/types.h>
+
+/*
+ * Time helpers that read the kernel data page directly, instead of
+ * asking the kernel through a syscall
+ */
+
+extern const lightos_kdata_t* lightos_get_kdata();
+extern error_t lightos_read_kdata(lightos_kdata_t* p_kdata);
+
+/* Ticks since boot */
+extern u64 lightos_get_ticks();
+/* Time since boot in milliseconds, precise up to the TSC when it has been calibrated */
+extern u64 lightos_get_uptime_ms();
+
+#endif // !__LIGHTOS_TIME_H__
@@ -30,6 +30,10 @@ int lightui_draw_rect(lightui_window_t* wnd, uint32_t x, uint32_t y, uint32_t wi
     if ((y + height) >= wnd->lui_height)
         height -= ((y + height) - wnd->lui_height);
 
+    /* Queue it up in the command ring if we can */
+    if (lwindow_has_cmdring(&wnd->gfxwnd))
+        return !lwindow_draw_rect(&wnd->gfxwnd, x + wnd->lui_border_width, y + wnd->lui_top_border_height, width, height, clr);
+
     for (uint32_t i = 0; i < height; i++) {
         for (uint32_t j = 0; j < width; j++)
             *(uint32_t volatile*)(vaddr + j * bytes_pp) = _clr;
@@ -55,6 +59,10 @@ int lightui_draw_buffer(lightui_window_t* wnd, uint32_t x, uint32_t y, lclr_buff
     if (!buffer || !buffer->width || !buffer->height)
         return -1;
 
+    /* Queued commands need to land before our pixels do */
+    if (!lwindow_flush_cmds(&wnd->gfxwnd))
+        return -1;
+
     /* Compute the initial video address */
     bytes_pp = (wnd->gfxwnd.fb.bpp >> 3);
     vaddr = (uintptr_t)wnd->user_fb_start + (uint64_t)y * wnd->gfxwnd.fb.pitch + (x * bytes_pp);
@@ -76,6 +84,9 @@ int lightui_draw_buffer(lightui_window_t* wnd, uint32_t x, uint32_t y, lclr_buff
         vaddr += wnd->gfxwnd.fb.pitch;
     }
 
+    if (lwindow_has_cmdring(&wnd->gfxwnd))
+        return !lwindow_damage(&wnd->gfxwnd, x + wnd->lui_border_width, y + wnd->lui_top_border_height, buffer->width, buffer->height);
+
     /* We did shit, need an update */
     wnd->gfxwnd.wnd_flags |= LWND_FLAG_NEED_UPDATE;
 
@@ -0,0 +1,56 @@
+#ifndef __LIGHTOS_OPENGL_LGL__
+#define __LIGHTOS_OPENGL_LGL__
+
+/*
+ * LightOS GL context binding
+ *
+ * This is our equivalent of glX/wgl. A context renders into a rectangle of an lwnd window
+ * framebuffer (obtained through lwindow_request_framebuffer). lglSwapBuffers pushes the
+ * finished frame to the window and submits it to lwnd in a single message
+ */
+
+#include "gl.h"
+#include <libgfx/shared.h>
+#include <stdint.h>
+
+typedef struct lgl_context lgl_context_t;
+
+/*
+ * Hook to run rasterizer workers on extra threads
+ *
+ * @fn should be called with @arg on @nr_workers threads. The rasterizer splits its tiles
+ * between the caller and any workers, and waits for all tiles to finish before returning.
+ * Without a hook, the calling thread does all the tiles itself
+ */
+typedef void (*lgl_thread_hook_t)(void (*fn)(void* arg), void* arg, uint32_t nr_workers);
+
+/*
+ * Rasterizer statistics, since context creation
+ */
+typedef struct lgl_stats {
+    uint64_t nr_triangles;
+    uint64_t nr_culled;
+    uint64_t nr_pixels;
+    uint64_t nr_flushes;
+} lgl_stats_t;
+
+/*!
+ * @brief: Create a context that renders to (@x, @y, @width, @height) inside @wnd
+ *
+ * The window needs to have a framebuffer already
+ */
+extern lgl_context_t* lglCreateContext(lwindow_t* wnd, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+extern void lglDestroyContext(lgl_context_t* ctx);
+
+extern GLboolean lglMakeCurrent(lgl_context_t* ctx);
+extern lgl_context_t* lglGetCurrentContext(void);
+
+/*!
+ * @brief: Finish the current frame and put it in the window
+ */
+extern GLboolean lglSwapBuffers(lgl_context_t* ctx);
+
+extern void lglSetThreadHook(lgl_context_t* ctx, lgl_thread_hook_t hook, uint32_t nr_workers);
+extern void lglGetStats(lgl_context_t* ctx, lgl_stats_t* stats);
+
+#endif // !__LIGHTOS_OPENGL_LGL__
@@ -0,0 +1,748 @@
+#include "OpenGL/gl.h"
+#include "OpenGL/lgl.h"
+#include "libgfx/video.h"
+#include "priv.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* The context all gl* calls go to */
+lgl_context_t* __lgl_ctx;
+
+#define GET_CTX_OR_RETURN(ctx, ...) \
+    lgl_context_t* ctx = __lgl_ctx; \
+    if (!ctx)                       \
+        return __VA_ARGS__;
+
+lgl_context_t* lglCreateContext(lwindow_t* wnd, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    lgl_context_t* ctx;
+
+    if (!wnd || !lwindow_has_fb(wnd) || !width || !height)
+        return nullptr;
+
+    /* We only do 32-bit framebuffers */
+    if (wnd->fb.bpp != 32)
+        return nullptr;
+
+    if (x + width > wnd->current_width || y + height > wnd->current_height)
+        return nullptr;
+
+    ctx = malloc(sizeof(*ctx));
+
+    if (!ctx)
+        return nullptr;
+
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->wnd = wnd;
+    ctx->wnd_x = x;
+    ctx->wnd_y = y;
+    ctx->width = width;
+    ctx->height = height;
+    ctx->stride = (width + 3) & ~3;
+    ctx->red_lshift = wnd->fb.red_lshift;
+    ctx->green_lshift = wnd->fb.green_lshift;
+    ctx->blue_lshift = wnd->fb.blue_lshift;
+
+    ctx->color = malloc(ctx->stride * height * sizeof(*ctx->color));
+    ctx->depth = malloc(ctx->stride * height * sizeof(*ctx->depth));
+    ctx->tris = malloc(LGL_MAX_BATCH_TRIS * sizeof(*ctx->tris));
+
+    if (!ctx->color || !ctx->depth || !ctx->tris)
+        goto free_and_exit;
+
+    if (lgl_init_bins(ctx))
+        goto free_and_exit;
+
+    /* GL defaults */
+    ctx->vp_w = width;
+    ctx->vp_h = height;
+    ctx->clear_depth = 1.0f;
+    ctx->cur_clr[0] = ctx->cur_clr[1] = ctx->cur_clr[2] = ctx->cur_clr[3] = 1.0f;
+    ctx->cull_mode = GL_BACK;
+    ctx->front_face = GL_CCW;
+    ctx->state.flags = LGL_RS_DEPTH_WRITE;
+    ctx->state.depth_func = GL_LESS;
+    ctx->state.blend_src = GL_ONE;
+    ctx->state.blend_dst = GL_ZERO;
+    ctx->matrix_mode = GL_MODELVIEW;
+
+    lgl_mat4_identity(&ctx->mv_stack[0]);
+    lgl_mat4_identity(&ctx->proj_stack[0]);
+
+    memset(ctx->color, 0, ctx->stride * height * sizeof(*ctx->color));
+
+    for (uint32_t i = 0; i < ctx->stride * height; i++)
+        ctx->depth[i] = 1.0f;
+
+    return ctx;
+
+free_and_exit:
+    free(ctx->tris);
+    free(ctx->depth);
+    free(ctx->color);
+    free(ctx);
+    return nullptr;
+}
+
+void lglDestroyContext(lgl_context_t* ctx)
+{
+    if (!ctx)
+        return;
+
+    if (__lgl_ctx == ctx)
+        __lgl_ctx = nullptr;
+
+    for (uint32_t i = 0; i < LGL_MAX_TEXTURES; i++)
+        free(ctx->textures[i].texels);
+
+    lgl_destroy_bins(ctx);
+
+    free(ctx->tris);
+    free(ctx->depth);
+    free(ctx->color);
+    free(ctx);
+}
+
+GLboolean lglMakeCurrent(lgl_context_t* ctx)
+{
+    /* Don't leave work hanging in the old context */
+    if (__lgl_ctx && __lgl_ctx != ctx)
+        lgl_flush(__lgl_ctx);
+
+    __lgl_ctx = ctx;
+    return GL_TRUE;
+}
+
+lgl_context_t* lglGetCurrentContext(void)
+{
+    return __lgl_ctx;
+}
+
+/*!
+ * @brief: Flush the frame and copy it into the window framebuffer
+ *
+ * The copy is reported to lwnd as damage and submitted right away, so a frame costs
+ * exactly one message to lwnd
+ */
+GLboolean lglSwapBuffers(lgl_context_t* ctx)
+{
+    uint8_t* dst;
+    uint32_t* src;
+    lwindow_t* wnd;
+
+    if (!ctx)
+        return GL_FALSE;
+
+    wnd = ctx->wnd;
+
+    lgl_flush(ctx);
+
+    /* Anything lwnd still has queued for this window needs to land underneath us */
+    if (!lwindow_flush_cmds(wnd))
+        return GL_FALSE;
+
+    dst = (uint8_t*)wnd->fb.fb + (uint64_t)ctx->wnd_y * wnd->fb.pitch + ctx->wnd_x * sizeof(uint32_t);
+    src = ctx->color;
+
+    for (uint32_t y = 0; y < ctx->height; y++) {
+        memcpy(dst, src, ctx->width * sizeof(uint32_t));
+
+        dst += wnd->fb.pitch;
+        src += ctx->stride;
+    }
+
+    if (!lwindow_damage(wnd, ctx->wnd_x, ctx->wnd_y, ctx->width, ctx->height))
+        return GL_FALSE;
+
+    return lwindow_submit(wnd);
+}
+
+void lglSetThreadHook(lgl_context_t* ctx, lgl_thread_hook_t hook, uint32_t nr_workers)
+{
+    if (!ctx)
+        return;
+
+    ctx->thread_hook = hook;
+    ctx->nr_workers = hook ? nr_workers : 0;
+}
+
+void lglGetStats(lgl_context_t* ctx, lgl_stats_t* stats)
+{
+    if (!ctx || !stats)
+        return;
+
+    *stats = ctx->stats;
+}
+
+GLenum glGetError(void)
+{
+    GLenum ret;
+
+    GET_CTX_OR_RETURN(ctx, GL_INVALID_OPERATION);
+
+    ret = ctx->error;
+    ctx->error = GL_NO_ERROR;
+    return ret;
+}
+
+const GLubyte* glGetString(GLenum name)
+{
+    switch (name) {
+    case GL_VENDOR:
+        return (const GLubyte*)"LightOS";
+    case GL_RENDERER:
+        return (const GLubyte*)"lgl tile rasterizer";
+    case GL_VERSION:
+        return (const GLubyte*)"1.1 lgl";
+    case GL_EXTENSIONS:
+        return (const GLubyte*)"";
+    }
+
+    if (__lgl_ctx)
+        lgl_set_error(__lgl_ctx, GL_INVALID_ENUM);
+
+    return nullptr;
+}
+
+static void __lgl_set_cap(lgl_context_t* ctx, GLenum cap, bool enable)
+{
+    uint32_t flag;
+
+    switch (cap) {
+    case GL_DEPTH_TEST:
+        flag = LGL_RS_DEPTH_TEST;
+        break;
+    case GL_BLEND:
+        flag = LGL_RS_BLEND;
+        break;
+    case GL_TEXTURE_2D:
+        flag = LGL_RS_TEXTURE;
+        break;
+    case GL_CULL_FACE:
+        ctx->cull_enabled = enable;
+        return;
+    default:
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    if (enable)
+        ctx->state.flags |= flag;
+    else
+        ctx->state.flags &= ~flag;
+}
+
+void glEnable(GLenum cap)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    __lgl_set_cap(ctx, cap, true);
+}
+
+void glDisable(GLenum cap)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    __lgl_set_cap(ctx, cap, false);
+}
+
+GLboolean glIsEnabled(GLenum cap)
+{
+    GET_CTX_OR_RETURN(ctx, GL_FALSE);
+
+    switch (cap) {
+    case GL_DEPTH_TEST:
+        return (ctx->state.flags & LGL_RS_DEPTH_TEST) ? GL_TRUE : GL_FALSE;
+    case GL_BLEND:
+        return (ctx->state.flags & LGL_RS_BLEND) ? GL_TRUE : GL_FALSE;
+    case GL_TEXTURE_2D:
+        return (ctx->state.flags & LGL_RS_TEXTURE) ? GL_TRUE : GL_FALSE;
+    case GL_CULL_FACE:
+        return ctx->cull_enabled ? GL_TRUE : GL_FALSE;
+    }
+
+    lgl_set_error(ctx, GL_INVALID_ENUM);
+    return GL_FALSE;
+}
+
+void glViewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    if (width < 0 || height < 0) {
+        lgl_set_error(ctx, GL_INVALID_VALUE);
+        return;
+    }
+
+    ctx->vp_x = x;
+    ctx->vp_y = y;
+    ctx->vp_w = width;
+    ctx->vp_h = height;
+}
+
+static inline float __lgl_clampf(float f)
+{
+    return (f < 0.0f) ? 0.0f : ((f > 1.0f) ? 1.0f : f);
+}
+
+void glClearColor(GLclampf red, GLclampf green, GLclampf blue, GLclampf alpha)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    ctx->clear_clr[0] = __lgl_clampf(red);
+    ctx->clear_clr[1] = __lgl_clampf(green);
+    ctx->clear_clr[2] = __lgl_clampf(blue);
+    ctx->clear_clr[3] = __lgl_clampf(alpha);
+}
+
+void glClearDepth(GLclampd depth)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    ctx->clear_depth = __lgl_clampf((float)depth);
+}
+
+void glClear(GLbitfield mask)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    if (mask & ~(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT)) {
+        lgl_set_error(ctx, GL_INVALID_VALUE);
+        return;
+    }
+
+    /* Triangles that were drawn before the clear need to go first */
+    lgl_flush(ctx);
+
+    lgl_clear_buffers(ctx, mask);
+}
+
+void glDepthFunc(GLenum func)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    if (func < GL_NEVER || func > GL_ALWAYS) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    ctx->state.depth_func = func;
+}
+
+void glDepthMask(GLboolean flag)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    if (flag)
+        ctx->state.flags |= LGL_RS_DEPTH_WRITE;
+    else
+        ctx->state.flags &= ~LGL_RS_DEPTH_WRITE;
+}
+
+static inline bool __lgl_is_blend_factor(GLenum f)
+{
+    return (f == GL_ZERO || f == GL_ONE || (f >= GL_SRC_COLOR && f <= GL_ONE_MINUS_DST_COLOR));
+}
+
+void glBlendFunc(GLenum sfactor, GLenum dfactor)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    if (!__lgl_is_blend_factor(sfactor) || !__lgl_is_blend_factor(dfactor)) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    ctx->state.blend_src = sfactor;
+    ctx->state.blend_dst = dfactor;
+}
+
+void glCullFace(GLenum mode)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    if (mode != GL_FRONT && mode != GL_BACK && mode != GL_FRONT_AND_BACK) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    ctx->cull_mode = mode;
+}
+
+void glFrontFace(GLenum mode)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    if (mode != GL_CW && mode != GL_CCW) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    ctx->front_face = mode;
+}
+
+void glColor4f(GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    ctx->cur_clr[0] = red;
+    ctx->cur_clr[1] = green;
+    ctx->cur_clr[2] = blue;
+    ctx->cur_clr[3] = alpha;
+}
+
+void glColor3f(GLfloat red, GLfloat green, GLfloat blue)
+{
+    glColor4f(red, green, blue, 1.0f);
+}
+
+void glColor4ub(GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha)
+{
+    glColor4f(red / 255.0f, green / 255.0f, blue / 255.0f, alpha / 255.0f);
+}
+
+static lgl_array_t* __lgl_get_array(lgl_context_t* ctx, GLenum cap)
+{
+    switch (cap) {
+    case GL_VERTEX_ARRAY:
+        return &ctx->vertex_array;
+    case GL_COLOR_ARRAY:
+        return &ctx->color_array;
+    case GL_TEXTURE_COORD_ARRAY:
+        return &ctx->texcoord_array;
+    }
+
+    return nullptr;
+}
+
+void glEnableClientState(GLenum cap)
+{
+    lgl_array_t* array;
+
+    GET_CTX_OR_RETURN(ctx);
+
+    array = __lgl_get_array(ctx, cap);
+
+    if (!array) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    array->enabled = true;
+}
+
+void glDisableClientState(GLenum cap)
+{
+    lgl_array_t* array;
+
+    GET_CTX_OR_RETURN(ctx);
+
+    array = __lgl_get_array(ctx, cap);
+
+    if (!array) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    array->enabled = false;
+}
+
+static void __lgl_set_array(lgl_context_t* ctx, lgl_array_t* array, GLint size, GLint min_size, GLenum type, GLsizei stride, const GLvoid* ptr)
+{
+    if (size < min_size || size > 4 || stride < 0) {
+        lgl_set_error(ctx, GL_INVALID_VALUE);
+        return;
+    }
+
+    if (type != GL_FLOAT && type != GL_UNSIGNED_BYTE) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    array->size = size;
+    array->type = type;
+    array->stride = stride;
+    array->ptr = ptr;
+}
+
+void glVertexPointer(GLint size, GLenum type, GLsizei stride, const GLvoid* ptr)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    /* Positions need to be floats */
+    if (type != GL_FLOAT) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    __lgl_set_array(ctx, &ctx->vertex_array, size, 2, type, stride, ptr);
+}
+
+void glColorPointer(GLint size, GLenum type, GLsizei stride, const GLvoid* ptr)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    __lgl_set_array(ctx, &ctx->color_array, size, 3, type, stride, ptr);
+}
+
+void glTexCoordPointer(GLint size, GLenum type, GLsizei stride, const GLvoid* ptr)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    if (type != GL_FLOAT) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    __lgl_set_array(ctx, &ctx->texcoord_array, size, 1, type, stride, ptr);
+}
+
+static inline bool __lgl_is_tri_mode(GLenum mode)
+{
+    return (mode == GL_TRIANGLES || mode == GL_TRIANGLE_STRIP || mode == GL_TRIANGLE_FAN);
+}
+
+void glDrawArrays(GLenum mode, GLint first, GLsizei count)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    if (first < 0 || count < 0) {
+        lgl_set_error(ctx, GL_INVALID_VALUE);
+        return;
+    }
+
+    /* Points and lines are not something we rasterize (yet) */
+    if (!__lgl_is_tri_mode(mode)) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    if (!ctx->vertex_array.enabled || !ctx->vertex_array.ptr)
+        return;
+
+    lgl_draw(ctx, mode, count, 0, nullptr, first);
+}
+
+void glDrawElements(GLenum mode, GLsizei count, GLenum type, const GLvoid* indices)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    if (count < 0) {
+        lgl_set_error(ctx, GL_INVALID_VALUE);
+        return;
+    }
+
+    if (!__lgl_is_tri_mode(mode) || (type != GL_UNSIGNED_BYTE && type != GL_UNSIGNED_SHORT && type != GL_UNSIGNED_INT)) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    if (!ctx->vertex_array.enabled || !ctx->vertex_array.ptr || !indices)
+        return;
+
+    lgl_draw(ctx, mode, count, type, indices, 0);
+}
+
+void glGenTextures(GLsizei n, GLuint* textures)
+{
+    GLsizei found;
+
+    GET_CTX_OR_RETURN(ctx);
+
+    if (n < 0 || !textures) {
+        lgl_set_error(ctx, GL_INVALID_VALUE);
+        return;
+    }
+
+    found = 0;
+
+    /* Name 0 is the default texture, never hand that out */
+    for (GLuint i = 1; i < LGL_MAX_TEXTURES && found < n; i++) {
+        if (ctx->textures[i].used)
+            continue;
+
+        ctx->textures[i].used = true;
+        ctx->textures[i].wrap_s = GL_REPEAT;
+        ctx->textures[i].wrap_t = GL_REPEAT;
+        ctx->textures[i].min_filter = GL_NEAREST;
+        ctx->textures[i].mag_filter = GL_NEAREST;
+
+        textures[found++] = i;
+    }
+
+    if (found == n)
+        return;
+
+    /* Give back what we took */
+    while (found--)
+        ctx->textures[textures[found]].used = false;
+
+    lgl_set_error(ctx, GL_OUT_OF_MEMORY);
+}
+
+void glDeleteTextures(GLsizei n, const GLuint* textures)
+{
+    lgl_texture_t* tex;
+
+    GET_CTX_OR_RETURN(ctx);
+
+    if (n < 0 || !textures) {
+        lgl_set_error(ctx, GL_INVALID_VALUE);
+        return;
+    }
+
+    /* Pending triangles might still sample these */
+    lgl_flush(ctx);
+
+    for (GLsizei i = 0; i < n; i++) {
+        if (!textures[i] || textures[i] >= LGL_MAX_TEXTURES)
+            continue;
+
+        tex = &ctx->textures[textures[i]];
+
+        free(tex->texels);
+        memset(tex, 0, sizeof(*tex));
+
+        if (ctx->bound_texture == textures[i])
+            ctx->bound_texture = 0;
+    }
+}
+
+void glBindTexture(GLenum target, GLuint texture)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    if (target != GL_TEXTURE_2D) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    if (texture >= LGL_MAX_TEXTURES || (texture && !ctx->textures[texture].used)) {
+        lgl_set_error(ctx, GL_INVALID_VALUE);
+        return;
+    }
+
+    ctx->bound_texture = texture;
+}
+
+void glTexParameteri(GLenum target, GLenum pname, GLint param)
+{
+    lgl_texture_t* tex;
+
+    GET_CTX_OR_RETURN(ctx);
+
+    if (target != GL_TEXTURE_2D) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    tex = &ctx->textures[ctx->bound_texture];
+
+    /* Sampler state is read at raster time */
+    lgl_flush(ctx);
+
+    switch (pname) {
+    case GL_TEXTURE_WRAP_S:
+    case GL_TEXTURE_WRAP_T:
+        if (param != GL_REPEAT && param != GL_CLAMP_TO_EDGE)
+            goto inval_enum;
+
+        if (pname == GL_TEXTURE_WRAP_S)
+            tex->wrap_s = param;
+        else
+            tex->wrap_t = param;
+        break;
+    case GL_TEXTURE_MIN_FILTER:
+    case GL_TEXTURE_MAG_FILTER:
+        /* NOTE: We accept GL_LINEAR, but we always sample nearest */
+        if (param != GL_NEAREST && param != GL_LINEAR)
+            goto inval_enum;
+
+        if (pname == GL_TEXTURE_MIN_FILTER)
+            tex->min_filter = param;
+        else
+            tex->mag_filter = param;
+        break;
+    default:
+        goto inval_enum;
+    }
+
+    return;
+
+inval_enum:
+    lgl_set_error(ctx, GL_INVALID_ENUM);
+}
+
+void glTexImage2D(GLenum target, GLint level, GLint internal_format, GLsizei width, GLsizei height, GLint border, GLenum format, GLenum type, const GLvoid* pixels)
+{
+    uint32_t bytes_pp;
+    uint32_t* texels;
+    const uint8_t* src;
+    lgl_texture_t* tex;
+
+    GET_CTX_OR_RETURN(ctx);
+
+    if (target != GL_TEXTURE_2D || (format != GL_RGB && format != GL_RGBA) || type != GL_UNSIGNED_BYTE) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    /* No mipmaps, no borders */
+    if (level || border || width <= 0 || height <= 0 || (internal_format != GL_RGB && internal_format != GL_RGBA && (internal_format < 3 || internal_format > 4))) {
+        lgl_set_error(ctx, GL_INVALID_VALUE);
+        return;
+    }
+
+    texels = malloc((size_t)width * height * sizeof(*texels));
+
+    if (!texels) {
+        lgl_set_error(ctx, GL_OUT_OF_MEMORY);
+        return;
+    }
+
+    bytes_pp = (format == GL_RGBA) ? 4 : 3;
+    src = pixels;
+
+    for (GLsizei i = 0; i < width * height; i++) {
+        if (!src) {
+            texels[i] = 0xffffffff;
+            continue;
+        }
+
+        texels[i] = src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)(bytes_pp == 4 ? src[3] : 0xff) << 24);
+
+        src += bytes_pp;
+    }
+
+    tex = &ctx->textures[ctx->bound_texture];
+
+    /* Don't pull the texture from under any pending triangles */
+    lgl_flush(ctx);
+
+    free(tex->texels);
+
+    if (!ctx->bound_texture) {
+        tex->used = true;
+        tex->wrap_s = tex->wrap_t = GL_REPEAT;
+        tex->min_filter = tex->mag_filter = GL_NEAREST;
+    }
+
+    tex->texels = texels;
+    tex->width = width;
+    tex->height = height;
+}
+
+void glFlush(void)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    lgl_flush(ctx);
+}
+
+void glFinish(void)
+{
+    GET_CTX_OR_RETURN(ctx);
+
+    lgl_flush(ctx);
+}
@@ -0,0 +1,401 @@
+#include "OpenGL/gl.h"
+#include "priv.h"
+#include <string.h>
+
+/*
+ * Geometry stage: vertex fetch, transform, clipping and triangle setup
+ */
+
+/* Small direct-mapped post-transform cache, so strips, fans and indexed meshes don't transform shared vertices again */
+#define LGL_VCACHE_SIZE 32
+
+typedef struct lgl_vcache {
+    uint32_t tag[LGL_VCACHE_SIZE];
+    lgl_vertex_t vtx[LGL_VCACHE_SIZE];
+} lgl_vcache_t;
+
+/* A screen-space vertex, with its attributes already divided by w */
+typedef struct lgl_svertex {
+    float x, y, z;
+    float inv_w;
+    float attr[LGL_NR_PLANES];
+} lgl_svertex_t;
+
+static inline const void* __lgl_array_elem(lgl_array_t* array, uint32_t idx, uint32_t elem_size)
+{
+    uint32_t stride = array->stride ? array->stride : array->size * elem_size;
+
+    return (const uint8_t*)array->ptr + (uint64_t)idx * stride;
+}
+
+static void __lgl_fetch_vertex(lgl_context_t* ctx, const lgl_mat4_t* mvp, uint32_t idx, lgl_vertex_t* out)
+{
+    float in[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+    const float* fsrc;
+    const uint8_t* bsrc;
+    lgl_array_t* array;
+
+    fsrc = __lgl_array_elem(&ctx->vertex_array, idx, sizeof(float));
+
+    for (GLint i = 0; i < ctx->vertex_array.size; i++)
+        in[i] = fsrc[i];
+
+    for (uint32_t i = 0; i < 4; i++)
+        out->pos[i] = mvp->m[0 * 4 + i] * in[0] + mvp->m[1 * 4 + i] * in[1] + mvp->m[2 * 4 + i] * in[2] + mvp->m[3 * 4 + i] * in[3];
+
+    array = &ctx->color_array;
+
+    if (!array->enabled || !array->ptr) {
+        memcpy(out->clr, ctx->cur_clr, sizeof(out->clr));
+    } else if (array->type == GL_UNSIGNED_BYTE) {
+        bsrc = __lgl_array_elem(array, idx, sizeof(uint8_t));
+
+        out->clr[3] = 1.0f;
+
+        for (GLint i = 0; i < array->size; i++)
+            out->clr[i] = bsrc[i] / 255.0f;
+    } else {
+        fsrc = __lgl_array_elem(array, idx, sizeof(float));
+
+        out->clr[3] = 1.0f;
+
+        for (GLint i = 0; i < array->size; i++)
+            out->clr[i] = fsrc[i];
+    }
+
+    array = &ctx->texcoord_array;
+    out->tex[0] = out->tex[1] = 0.0f;
+
+    if (!array->enabled || !array->ptr)
+        return;
+
+    fsrc = __lgl_array_elem(array, idx, sizeof(float));
+
+    out->tex[0] = fsrc[0];
+
+    if (array->size > 1)
+        out->tex[1] = fsrc[1];
+}
+
+/*!
+ * @brief: Get a transformed vertex through the cache
+ *
+ * The vertex gets copied into @out, since the next lookup may evict its slot
+ */
+static inline void __lgl_get_vertex(lgl_context_t* ctx, lgl_vcache_t* cache, const lgl_mat4_t* mvp, uint32_t idx, lgl_vertex_t* out)
+{
+    uint32_t slot = idx & (LGL_VCACHE_SIZE - 1);
+
+    if (cache->tag[slot] != idx) {
+        __lgl_fetch_vertex(ctx, mvp, idx, &cache->vtx[slot]);
+        cache->tag[slot] = idx;
+    }
+
+    *out = cache->vtx[slot];
+}
+
+static void __lgl_lerp_vertex(lgl_vertex_t* out, const lgl_vertex_t* a, const lgl_vertex_t* b, float t)
+{
+    for (uint32_t i = 0; i < 4; i++) {
+        out->pos[i] = a->pos[i] + (b->pos[i] - a->pos[i]) * t;
+        out->clr[i] = a->clr[i] + (b->clr[i] - a->clr[i]) * t;
+    }
+
+    out->tex[0] = a->tex[0] + (b->tex[0] - a->tex[0]) * t;
+    out->tex[1] = a->tex[1] + (b->tex[1] - a->tex[1]) * t;
+}
+
+/*!
+ * @brief: Clip a polygon against the near plane (z >= -w)
+ *
+ * Only the near plane needs real clipping, since everything behind it would blow up in the
+ * perspective divide. The other planes are taken care of by the screen-space bounding box
+ *
+ * Returns the number of vertices in @out (at most 4 for a triangle)
+ */
+static uint32_t __lgl_clip_near(const lgl_vertex_t* in[3], lgl_vertex_t out[4])
+{
+    float da, db;
+    uint32_t count = 0;
+    const lgl_vertex_t* a;
+    const lgl_vertex_t* b;
+
+    for (uint32_t i = 0; i < 3; i++) {
+        a = in[i];
+        b = in[(i + 1) % 3];
+
+        da = a->pos[2] + a->pos[3];
+        db = b->pos[2] + b->pos[3];
+
+        if (da >= 0.0f)
+            out[count++] = *a;
+
+        /* Edge crosses the plane */
+        if ((da >= 0.0f) != (db >= 0.0f))
+            __lgl_lerp_vertex(&out[count++], a, b, da / (da - db));
+    }
+
+    return count;
+}
+
+static inline uint32_t __lgl_outcode(const lgl_vertex_t* v)
+{
+    const float x = v->pos[0], y = v->pos[1], z = v->pos[2], w = v->pos[3];
+
+    return (x < -w) | ((x > w) << 1) | ((y < -w) << 2) | ((y > w) << 3) | ((z < -w) << 4) | ((z > w) << 5);
+}
+
+static void __lgl_project(lgl_context_t* ctx, const lgl_vertex_t* v, lgl_svertex_t* out)
+{
+    float inv_w = 1.0f / v->pos[3];
+
+    out->x = ctx->vp_x + (v->pos[0] * inv_w + 1.0f) * 0.5f * ctx->vp_w;
+    /* GL has its origin at the bottom left, we store rows top to bottom */
+    out->y = (float)ctx->height - (ctx->vp_y + (v->pos[1] * inv_w + 1.0f) * 0.5f * ctx->vp_h);
+    out->z = v->pos[2] * inv_w * 0.5f + 0.5f;
+    out->inv_w = inv_w;
+
+    out->attr[LGL_PLANE_Z] = out->z;
+    out->attr[LGL_PLANE_INV_W] = inv_w;
+    out->attr[LGL_PLANE_R] = v->clr[0] * inv_w;
+    out->attr[LGL_PLANE_G] = v->clr[1] * inv_w;
+    out->attr[LGL_PLANE_B] = v->clr[2] * inv_w;
+    out->attr[LGL_PLANE_A] = v->clr[3] * inv_w;
+    out->attr[LGL_PLANE_S] = v->tex[0] * inv_w;
+    out->attr[LGL_PLANE_T] = v->tex[1] * inv_w;
+}
+
+static inline float __lgl_minf(float a, float b)
+{
+    return a < b ? a : b;
+}
+
+static inline float __lgl_maxf(float a, float b)
+{
+    return a > b ? a : b;
+}
+
+/*!
+ * @brief: Find the batch index of the current raster state
+ *
+ * Consecutive triangles mostly share their state, so we only compare against the last one.
+ * The caller makes sure there is room for a new state
+ */
+static uint32_t __lgl_get_state(lgl_context_t* ctx)
+{
+    lgl_raster_state_t state = ctx->state;
+    lgl_texture_t* tex = &ctx->textures[ctx->bound_texture];
+
+    if ((state.flags & LGL_RS_TEXTURE) && tex->texels)
+        state.texture = tex;
+    else
+        state.flags &= ~LGL_RS_TEXTURE;
+
+    if (ctx->nr_states && memcmp(&ctx->states[ctx->nr_states - 1], &state, sizeof(state)) == 0)
+        return ctx->nr_states - 1;
+
+    ctx->states[ctx->nr_states] = state;
+    return ctx->nr_states++;
+}
+
+/*!
+ * @brief: Set up a screen-space triangle and put it in the tile bins
+ */
+static void __lgl_setup_triangle(lgl_context_t* ctx, const lgl_vertex_t* a, const lgl_vertex_t* b, const lgl_vertex_t* c)
+{
+    float area, inv_area;
+    float min_x, min_y, max_x, max_y;
+    bool front;
+    uint32_t idx;
+    lgl_tri_t* tri;
+    lgl_svertex_t v[3];
+    lgl_svertex_t tmp;
+
+    __lgl_project(ctx, a, &v[0]);
+    __lgl_project(ctx, b, &v[1]);
+    __lgl_project(ctx, c, &v[2]);
+
+    area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[2].x - v[0].x) * (v[1].y - v[0].y);
+
+    if (area == 0.0f)
+        goto culled;
+
+    /* Rows go down, so a counter-clockwise triangle in GL has a negative area here */
+    front = (ctx->front_face == GL_CCW) ? (area < 0.0f) : (area > 0.0f);
+
+    if (ctx->cull_enabled && (ctx->cull_mode == GL_FRONT_AND_BACK || (ctx->cull_mode == GL_BACK) != front))
+        goto culled;
+
+    /* Bounding box, clamped to both the viewport and the context */
+    min_x = __lgl_maxf(__lgl_minf(v[0].x, __lgl_minf(v[1].x, v[2].x)), __lgl_maxf(ctx->vp_x, 0.0f));
+    max_x = __lgl_minf(__lgl_maxf(v[0].x, __lgl_maxf(v[1].x, v[2].x)), __lgl_minf(ctx->vp_x + (float)ctx->vp_w, ctx->width));
+    min_y = __lgl_maxf(__lgl_minf(v[0].y, __lgl_minf(v[1].y, v[2].y)), __lgl_maxf((float)ctx->height - (ctx->vp_y + (float)ctx->vp_h), 0.0f));
+    max_y = __lgl_minf(__lgl_maxf(v[0].y, __lgl_maxf(v[1].y, v[2].y)), __lgl_minf((float)ctx->height - ctx->vp_y, ctx->height));
+
+    if (min_x >= max_x || min_y >= max_y)
+        goto culled;
+
+    /* Make the winding consistent, so 'inside' is always positive */
+    if (area < 0.0f) {
+        tmp = v[1];
+        v[1] = v[2];
+        v[2] = tmp;
+        area = -area;
+    }
+
+    if (ctx->nr_tris >= LGL_MAX_BATCH_TRIS || ctx->nr_states >= LGL_MAX_BATCH_STATES)
+        lgl_flush(ctx);
+
+    idx = ctx->nr_tris;
+    tri = &ctx->tris[idx];
+    tri->state = __lgl_get_state(ctx);
+
+    tri->top_left = 0;
+
+    /* Edge i is the one opposite of vertex i */
+    for (uint32_t i = 0; i < 3; i++) {
+        const lgl_svertex_t* va = &v[(i + 1) % 3];
+        const lgl_svertex_t* vb = &v[(i + 2) % 3];
+
+        tri->edge[i][0] = va->y - vb->y;
+        tri->edge[i][1] = vb->x - va->x;
+        tri->edge[i][2] = va->x * vb->y - vb->x * va->y;
+
+        /*
+         * Pixels exactly on an edge belong to only one of the two triangles sharing it. The
+         * edge equations of a shared edge are negated between the two, so this picks one
+         */
+        if (tri->edge[i][0] > 0.0f || (tri->edge[i][0] == 0.0f && tri->edge[i][1] > 0.0f))
+            tri->top_left |= (1 << i);
+    }
+
+    /* Interpolation planes: attr(x, y) = sum(attr_i * edge_i(x, y)) / area */
+    inv_area = 1.0f / area;
+
+    for (uint32_t p = 0; p < LGL_NR_PLANES; p++) {
+        for (uint32_t k = 0; k < 3; k++)
+            tri->plane[p][k] = (v[0].attr[p] * tri->edge[0][k] + v[1].attr[p] * tri->edge[1][k] + v[2].attr[p] * tri->edge[2][k]) * inv_area;
+    }
+
+    /* Pixel centers are at +0.5, so these are the pixels that could be covered */
+    tri->min_x = (int32_t)(min_x);
+    tri->min_y = (int32_t)(min_y);
+    tri->max_x = (int32_t)(max_x + 0.5f) - 1;
+    tri->max_y = (int32_t)(max_y + 0.5f) - 1;
+
+    if (tri->max_x < tri->min_x || tri->max_y < tri->min_y)
+        goto culled;
+
+    ctx->nr_tris++;
+
+    if (lgl_bin_triangle(ctx, idx))
+        lgl_set_error(ctx, GL_OUT_OF_MEMORY);
+
+    ctx->stats.nr_triangles++;
+    return;
+
+culled:
+    ctx->stats.nr_culled++;
+}
+
+static void __lgl_process_triangle(lgl_context_t* ctx, const lgl_vertex_t* a, const lgl_vertex_t* b, const lgl_vertex_t* c)
+{
+    uint32_t nr_clipped;
+    const lgl_vertex_t* in[3] = { a, b, c };
+    lgl_vertex_t clipped[4];
+
+    /* Entirely outside one of the planes */
+    if (__lgl_outcode(a) & __lgl_outcode(b) & __lgl_outcode(c)) {
+        ctx->stats.nr_culled++;
+        return;
+    }
+
+    if (a->pos[2] >= -a->pos[3] && b->pos[2] >= -b->pos[3] && c->pos[2] >= -c->pos[3]) {
+        __lgl_setup_triangle(ctx, a, b, c);
+        return;
+    }
+
+    nr_clipped = __lgl_clip_near(in, clipped);
+
+    for (uint32_t i = 2; i < nr_clipped; i++)
+        __lgl_setup_triangle(ctx, &clipped[0], &clipped[i - 1], &clipped[i]);
+}
+
+static inline uint32_t __lgl_get_index(GLenum index_type, const GLvoid* indices, GLint first, uint32_t i)
+{
+    switch (index_type) {
+    case GL_UNSIGNED_BYTE:
+        return ((const uint8_t*)indices)[i];
+    case GL_UNSIGNED_SHORT:
+        return ((const uint16_t*)indices)[i];
+    case GL_UNSIGNED_INT:
+        return ((const uint32_t*)indices)[i];
+    }
+
+    return first + i;
+}
+
+/*!
+ * @brief: Run @count vertices through the geometry stage
+ *
+ * When @index_type is zero, vertices start at @first, otherwise they are looked up in
+ * @indices
+ */
+void lgl_draw(lgl_context_t* ctx, GLenum mode, GLsizei count, GLenum index_type, const GLvoid* indices, GLint first)
+{
+    uint32_t i0, i1, i2;
+    lgl_vertex_t v[3];
+    lgl_mat4_t mvp;
+    lgl_vcache_t cache;
+
+    if (count < 3)
+        return;
+
+    lgl_mat4_mul(&mvp, &ctx->proj_stack[ctx->proj_depth], &ctx->mv_stack[ctx->mv_depth]);
+
+    /* No index maps to slot 0 with this tag */
+    memset(cache.tag, 0xff, sizeof(cache.tag));
+
+    switch (mode) {
+    case GL_TRIANGLES:
+        for (GLsizei i = 0; i + 2 < count; i += 3) {
+            __lgl_get_vertex(ctx, &cache, &mvp, __lgl_get_index(index_type, indices, first, i), &v[0]);
+            __lgl_get_vertex(ctx, &cache, &mvp, __lgl_get_index(index_type, indices, first, i + 1), &v[1]);
+            __lgl_get_vertex(ctx, &cache, &mvp, __lgl_get_index(index_type, indices, first, i + 2), &v[2]);
+
+            __lgl_process_triangle(ctx, &v[0], &v[1], &v[2]);
+        }
+        break;
+    case GL_TRIANGLE_STRIP:
+        for (GLsizei i = 0; i + 2 < count; i++) {
+            i0 = __lgl_get_index(index_type, indices, first, i);
+            i1 = __lgl_get_index(index_type, indices, first, i + 1);
+            i2 = __lgl_get_index(index_type, indices, first, i + 2);
+
+            /* Every other triangle in a strip is flipped, keep the winding the same */
+            if (i & 1) {
+                uint32_t tmp = i0;
+                i0 = i1;
+                i1 = tmp;
+            }
+
+            __lgl_get_vertex(ctx, &cache, &mvp, i0, &v[0]);
+            __lgl_get_vertex(ctx, &cache, &mvp, i1, &v[1]);
+            __lgl_get_vertex(ctx, &cache, &mvp, i2, &v[2]);
+
+            __lgl_process_triangle(ctx, &v[0], &v[1], &v[2]);
+        }
+        break;
+    case GL_TRIANGLE_FAN:
+        /* The root stays in v[0] for the entire fan */
+        __lgl_get_vertex(ctx, &cache, &mvp, __lgl_get_index(index_type, indices, first, 0), &v[0]);
+
+        for (GLsizei i = 1; i + 1 < count; i++) {
+            __lgl_get_vertex(ctx, &cache, &mvp, __lgl_get_index(index_type, indices, first, i), &v[1]);
+            __lgl_get_vertex(ctx, &cache, &mvp, __lgl_get_index(index_type, indices, first, i + 1), &v[2]);
+
+            __lgl_process_triangle(ctx, &v[0], &v[1], &v[2]);
+        }
+        break;
+    }
+}
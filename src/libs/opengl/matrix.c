@@ -0,0 +1,260 @@
+#include "OpenGL/gl.h"
+#include "priv.h"
+#include <math.h>
+#include <string.h>
+
+void lgl_mat4_identity(lgl_mat4_t* m)
+{
+    memset(m, 0, sizeof(*m));
+
+    m->m[0] = 1.0f;
+    m->m[5] = 1.0f;
+    m->m[10] = 1.0f;
+    m->m[15] = 1.0f;
+}
+
+/*!
+ * @brief: out = a * b
+ *
+ * @out may alias @a or @b
+ */
+void lgl_mat4_mul(lgl_mat4_t* out, const lgl_mat4_t* a, const lgl_mat4_t* b)
+{
+    lgl_mat4_t r;
+
+    for (uint32_t col = 0; col < 4; col++) {
+        for (uint32_t row = 0; row < 4; row++) {
+            r.m[col * 4 + row] = a->m[0 * 4 + row] * b->m[col * 4 + 0]
+                + a->m[1 * 4 + row] * b->m[col * 4 + 1]
+                + a->m[2 * 4 + row] * b->m[col * 4 + 2]
+                + a->m[3 * 4 + row] * b->m[col * 4 + 3];
+        }
+    }
+
+    *out = r;
+}
+
+lgl_mat4_t* lgl_current_matrix(lgl_context_t* ctx)
+{
+    if (ctx->matrix_mode == GL_PROJECTION)
+        return &ctx->proj_stack[ctx->proj_depth];
+
+    return &ctx->mv_stack[ctx->mv_depth];
+}
+
+static void __lgl_mult_current(lgl_context_t* ctx, const lgl_mat4_t* m)
+{
+    lgl_mat4_t* cur = lgl_current_matrix(ctx);
+
+    lgl_mat4_mul(cur, cur, m);
+}
+
+void glMatrixMode(GLenum mode)
+{
+    lgl_context_t* ctx = __lgl_ctx;
+
+    if (!ctx)
+        return;
+
+    if (mode != GL_MODELVIEW && mode != GL_PROJECTION) {
+        lgl_set_error(ctx, GL_INVALID_ENUM);
+        return;
+    }
+
+    ctx->matrix_mode = mode;
+}
+
+void glLoadIdentity(void)
+{
+    lgl_context_t* ctx = __lgl_ctx;
+
+    if (!ctx)
+        return;
+
+    lgl_mat4_identity(lgl_current_matrix(ctx));
+}
+
+void glLoadMatrixf(const GLfloat* m)
+{
+    lgl_context_t* ctx = __lgl_ctx;
+
+    if (!ctx || !m)
+        return;
+
+    memcpy(lgl_current_matrix(ctx)->m, m, sizeof(lgl_mat4_t));
+}
+
+void glMultMatrixf(const GLfloat* m)
+{
+    lgl_mat4_t mat;
+    lgl_context_t* ctx = __lgl_ctx;
+
+    if (!ctx || !m)
+        return;
+
+    memcpy(mat.m, m, sizeof(mat));
+
+    __lgl_mult_current(ctx, &mat);
+}
+
+void glPushMatrix(void)
+{
+    uint32_t* depth;
+    lgl_mat4_t* stack;
+    lgl_context_t* ctx = __lgl_ctx;
+
+    if (!ctx)
+        return;
+
+    depth = (ctx->matrix_mode == GL_PROJECTION) ? &ctx->proj_depth : &ctx->mv_depth;
+    stack = (ctx->matrix_mode == GL_PROJECTION) ? ctx->proj_stack : ctx->mv_stack;
+
+    if (*depth + 1 >= LGL_MATRIX_STACK_DEPTH) {
+        lgl_set_error(ctx, GL_STACK_OVERFLOW);
+        return;
+    }
+
+    stack[*depth + 1] = stack[*depth];
+    (*depth)++;
+}
+
+void glPopMatrix(void)
+{
+    uint32_t* depth;
+    lgl_context_t* ctx = __lgl_ctx;
+
+    if (!ctx)
+        return;
+
+    depth = (ctx->matrix_mode == GL_PROJECTION) ? &ctx->proj_depth : &ctx->mv_depth;
+
+    if (!(*depth)) {
+        lgl_set_error(ctx, GL_STACK_UNDERFLOW);
+        return;
+    }
+
+    (*depth)--;
+}
+
+void glTranslatef(GLfloat x, GLfloat y, GLfloat z)
+{
+    lgl_mat4_t m;
+    lgl_context_t* ctx = __lgl_ctx;
+
+    if (!ctx)
+        return;
+
+    lgl_mat4_identity(&m);
+
+    m.m[12] = x;
+    m.m[13] = y;
+    m.m[14] = z;
+
+    __lgl_mult_current(ctx, &m);
+}
+
+void glScalef(GLfloat x, GLfloat y, GLfloat z)
+{
+    lgl_mat4_t m;
+    lgl_context_t* ctx = __lgl_ctx;
+
+    if (!ctx)
+        return;
+
+    lgl_mat4_identity(&m);
+
+    m.m[0] = x;
+    m.m[5] = y;
+    m.m[10] = z;
+
+    __lgl_mult_current(ctx, &m);
+}
+
+void glRotatef(GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
+{
+    float len, rad, s, c, ic;
+    lgl_mat4_t m;
+    lgl_context_t* ctx = __lgl_ctx;
+
+    if (!ctx)
+        return;
+
+    len = sqrtf(x * x + y * y + z * z);
+
+    if (len == 0.0f)
+        return;
+
+    x /= len;
+    y /= len;
+    z /= len;
+
+    rad = angle * (3.14159265f / 180.0f);
+    s = sinf(rad);
+    c = cosf(rad);
+    ic = 1.0f - c;
+
+    lgl_mat4_identity(&m);
+
+    m.m[0] = x * x * ic + c;
+    m.m[1] = y * x * ic + z * s;
+    m.m[2] = x * z * ic - y * s;
+    m.m[4] = x * y * ic - z * s;
+    m.m[5] = y * y * ic + c;
+    m.m[6] = y * z * ic + x * s;
+    m.m[8] = x * z * ic + y * s;
+    m.m[9] = y * z * ic - x * s;
+    m.m[10] = z * z * ic + c;
+
+    __lgl_mult_current(ctx, &m);
+}
+
+void glOrtho(GLdouble left, GLdouble right, GLdouble bottom, GLdouble top, GLdouble near_val, GLdouble far_val)
+{
+    lgl_mat4_t m;
+    lgl_context_t* ctx = __lgl_ctx;
+
+    if (!ctx)
+        return;
+
+    if (left == right || bottom == top || near_val == far_val) {
+        lgl_set_error(ctx, GL_INVALID_VALUE);
+        return;
+    }
+
+    lgl_mat4_identity(&m);
+
+    m.m[0] = (float)(2.0 / (right - left));
+    m.m[5] = (float)(2.0 / (top - bottom));
+    m.m[10] = (float)(-2.0 / (far_val - near_val));
+    m.m[12] = (float)(-(right + left) / (right - left));
+    m.m[13] = (float)(-(top + bottom) / (top - bottom));
+    m.m[14] = (float)(-(far_val + near_val) / (far_val - near_val));
+
+    __lgl_mult_current(ctx, &m);
+}
+
+void glFrustum(GLdouble left, GLdouble right, GLdouble bottom, GLdouble top, GLdouble near_val, GLdouble far_val)
+{
+    lgl_mat4_t m;
+    lgl_context_t* ctx = __lgl_ctx;
+
+    if (!ctx)
+        return;
+
+    if (near_val <= 0.0 || far_val <= 0.0 || left == right || bottom == top || near_val == far_val) {
+        lgl_set_error(ctx, GL_INVALID_VALUE);
+        return;
+    }
+
+    memset(&m, 0, sizeof(m));
+
+    m.m[0] = (float)(2.0 * near_val / (right - left));
+    m.m[5] = (float)(2.0 * near_val / (top - bottom));
+    m.m[8] = (float)((right + left) / (right - left));
+    m.m[9] = (float)((top + bottom) / (top - bottom));
+    m.m[10] = (float)(-(far_val + near_val) / (far_val - near_val));
+    m.m[11] = -1.0f;
+    m.m[14] = (float)(-2.0 * far_val * near_val / (far_val - near_val));
+
+    __lgl_mult_current(ctx, &m);
+}
@@ -0,0 +1,215 @@
+#ifndef __LIGHTOS_OPENGL_PRIV__
+#define __LIGHTOS_OPENGL_PRIV__
+
+#include "OpenGL/gl.h"
+#include "OpenGL/lgl.h"
+#include <libgfx/shared.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Internals of the software rasterizer
+ *
+ * Draw calls transform and clip their triangles right away, after which the screen-space
+ * triangles get binned into LGL_TILE_SIZE x LGL_TILE_SIZE tiles. Nothing is rasterized
+ * until the batch gets flushed (on glFlush, glClear, texture changes, swap or when the
+ * batch is full). Tiles are independent of each other, so they can be handed out to any
+ * number of threads, while the triangle order inside a tile stays the submission order.
+ */
+
+#define LGL_TILE_SHIFT 6
+#define LGL_TILE_SIZE (1 << LGL_TILE_SHIFT)
+
+/* Triangles we collect before we're forced to flush */
+#define LGL_MAX_BATCH_TRIS 8192
+/* Distinct raster states in a single batch */
+#define LGL_MAX_BATCH_STATES 256
+
+#define LGL_MATRIX_STACK_DEPTH 32
+#define LGL_MAX_TEXTURES 256
+
+/* Vectors of four pixels */
+typedef float lgl_v4f __attribute__((vector_size(16)));
+typedef int32_t lgl_v4i __attribute__((vector_size(16)));
+typedef uint32_t lgl_v4u __attribute__((vector_size(16)));
+
+typedef struct lgl_mat4 {
+    /* Column-major, like GL */
+    float m[16];
+} lgl_mat4_t;
+
+typedef struct lgl_texture {
+    bool used;
+    uint32_t width;
+    uint32_t height;
+    GLenum wrap_s;
+    GLenum wrap_t;
+    GLenum min_filter;
+    GLenum mag_filter;
+    /* RGBA8, with red in the lowest byte */
+    uint32_t* texels;
+} lgl_texture_t;
+
+#define LGL_RS_DEPTH_TEST 0x0001
+#define LGL_RS_DEPTH_WRITE 0x0002
+#define LGL_RS_BLEND 0x0004
+#define LGL_RS_TEXTURE 0x0008
+
+/*
+ * Pipeline state a triangle is rasterized with
+ *
+ * Every triangle points to a snapshot of this, so state changes between draw calls
+ * don't require a flush
+ */
+typedef struct lgl_raster_state {
+    uint32_t flags;
+    GLenum depth_func;
+    GLenum blend_src;
+    GLenum blend_dst;
+    lgl_texture_t* texture;
+} lgl_raster_state_t;
+
+/* Attributes we interpolate, all except z are divided by w */
+enum LGL_PLANE {
+    LGL_PLANE_Z = 0,
+    LGL_PLANE_INV_W,
+    LGL_PLANE_R,
+    LGL_PLANE_G,
+    LGL_PLANE_B,
+    LGL_PLANE_A,
+    LGL_PLANE_S,
+    LGL_PLANE_T,
+    LGL_NR_PLANES,
+};
+
+/*
+ * A triangle after setup
+ *
+ * Edges and attributes are stored as planes: v(x, y) = dx * x + dy * y + c
+ */
+typedef struct lgl_tri {
+    float edge[3][3];
+    /* Mask of edges that are top or left edges (for the fill rule) */
+    uint32_t top_left;
+    float plane[LGL_NR_PLANES][3];
+
+    int32_t min_x, min_y;
+    int32_t max_x, max_y;
+
+    uint32_t state;
+} lgl_tri_t;
+
+typedef struct lgl_bin {
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* tris;
+} lgl_bin_t;
+
+typedef struct lgl_array {
+    bool enabled;
+    GLint size;
+    GLenum type;
+    GLsizei stride;
+    const GLvoid* ptr;
+} lgl_array_t;
+
+/* A transformed vertex in clip space */
+typedef struct lgl_vertex {
+    float pos[4];
+    float clr[4];
+    float tex[2];
+} lgl_vertex_t;
+
+struct lgl_context {
+    lwindow_t* wnd;
+    uint32_t wnd_x;
+    uint32_t wnd_y;
+
+    uint32_t width;
+    uint32_t height;
+    /* In pixels. Rounded up to a multiple of four, so rows can always be done in vectors */
+    uint32_t stride;
+
+    /* Color buffer in the framebuffer format of the window */
+    uint32_t* color;
+    float* depth;
+
+    uint8_t red_lshift;
+    uint8_t green_lshift;
+    uint8_t blue_lshift;
+
+    GLenum error;
+
+    /* Fixed function state */
+    int32_t vp_x, vp_y;
+    uint32_t vp_w, vp_h;
+    float clear_clr[4];
+    float clear_depth;
+    float cur_clr[4];
+    bool cull_enabled;
+    GLenum cull_mode;
+    GLenum front_face;
+    lgl_raster_state_t state;
+
+    lgl_array_t vertex_array;
+    lgl_array_t color_array;
+    lgl_array_t texcoord_array;
+
+    GLenum matrix_mode;
+    uint32_t mv_depth;
+    uint32_t proj_depth;
+    lgl_mat4_t mv_stack[LGL_MATRIX_STACK_DEPTH];
+    lgl_mat4_t proj_stack[LGL_MATRIX_STACK_DEPTH];
+
+    GLuint bound_texture;
+    lgl_texture_t textures[LGL_MAX_TEXTURES];
+
+    /* The current batch */
+    uint32_t nr_tris;
+    uint32_t nr_states;
+    lgl_tri_t* tris;
+    lgl_raster_state_t states[LGL_MAX_BATCH_STATES];
+
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    lgl_bin_t* bins;
+
+    /* Tile dispatch */
+    uint32_t next_tile;
+    uint32_t tiles_done;
+    lgl_thread_hook_t thread_hook;
+    uint32_t nr_workers;
+
+    lgl_stats_t stats;
+};
+
+extern lgl_context_t* __lgl_ctx;
+
+static inline void lgl_set_error(lgl_context_t* ctx, GLenum error)
+{
+    /* Only the first error sticks until glGetError */
+    if (ctx->error == GL_NO_ERROR)
+        ctx->error = error;
+}
+
+static inline uint32_t lgl_pack_color(lgl_context_t* ctx, float r, float g, float b)
+{
+    return ((uint32_t)(r * 255.0f) << ctx->red_lshift) | ((uint32_t)(g * 255.0f) << ctx->green_lshift) | ((uint32_t)(b * 255.0f) << ctx->blue_lshift);
+}
+
+/* matrix.c */
+void lgl_mat4_identity(lgl_mat4_t* m);
+void lgl_mat4_mul(lgl_mat4_t* out, const lgl_mat4_t* a, const lgl_mat4_t* b);
+lgl_mat4_t* lgl_current_matrix(lgl_context_t* ctx);
+
+/* geometry.c */
+void lgl_draw(lgl_context_t* ctx, GLenum mode, GLsizei count, GLenum index_type, const GLvoid* indices, GLint first);
+
+/* raster.c */
+int lgl_init_bins(lgl_context_t* ctx);
+void lgl_destroy_bins(lgl_context_t* ctx);
+int lgl_bin_triangle(lgl_context_t* ctx, uint32_t idx);
+void lgl_flush(lgl_context_t* ctx);
+void lgl_clear_buffers(lgl_context_t* ctx, GLbitfield mask);
+
+#endif // !__LIGHTOS_OPENGL_PRIV__
@@ -0,0 +1,391 @@
+#include "OpenGL/gl.h"
+#include "priv.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Raster stage: binning, tile dispatch and the actual pixel work
+ *
+ * Pixels are processed in groups of four horizontal neighbours, using GCC vector extensions.
+ * Everything per-pixel (edge tests, depth, interpolation, blending) happens on all four
+ * lanes at once, with a lane mask deciding what gets written back
+ */
+
+#define LGL_BIN_INITIAL_CAPACITY 64
+
+int lgl_init_bins(lgl_context_t* ctx)
+{
+    ctx->tiles_x = (ctx->width + LGL_TILE_SIZE - 1) >> LGL_TILE_SHIFT;
+    ctx->tiles_y = (ctx->height + LGL_TILE_SIZE - 1) >> LGL_TILE_SHIFT;
+
+    ctx->bins = calloc(ctx->tiles_x * ctx->tiles_y, sizeof(*ctx->bins));
+
+    if (!ctx->bins)
+        return -1;
+
+    return 0;
+}
+
+void lgl_destroy_bins(lgl_context_t* ctx)
+{
+    if (!ctx->bins)
+        return;
+
+    for (uint32_t i = 0; i < ctx->tiles_x * ctx->tiles_y; i++)
+        free(ctx->bins[i].tris);
+
+    free(ctx->bins);
+    ctx->bins = nullptr;
+}
+
+static int __lgl_bin_add(lgl_bin_t* bin, uint32_t idx)
+{
+    uint32_t new_cap;
+    uint32_t* new_tris;
+
+    if (bin->count >= bin->capacity) {
+        new_cap = bin->capacity ? (bin->capacity << 1) : LGL_BIN_INITIAL_CAPACITY;
+        new_tris = realloc(bin->tris, new_cap * sizeof(*new_tris));
+
+        if (!new_tris)
+            return -1;
+
+        bin->tris = new_tris;
+        bin->capacity = new_cap;
+    }
+
+    bin->tris[bin->count++] = idx;
+    return 0;
+}
+
+/*!
+ * @brief: Put triangle @idx in every tile it could touch
+ *
+ * Tiles inside the bounding box are tested against the edges of the triangle first: when
+ * the tile corner that is furthest inside an edge is still outside it, the triangle can't
+ * touch the tile. This saves a lot of wasted work on long, thin triangles
+ */
+int lgl_bin_triangle(lgl_context_t* ctx, uint32_t idx)
+{
+    int error = 0;
+    float cx, cy;
+    lgl_tri_t* tri = &ctx->tris[idx];
+    uint32_t tx0 = tri->min_x >> LGL_TILE_SHIFT;
+    uint32_t ty0 = tri->min_y >> LGL_TILE_SHIFT;
+    uint32_t tx1 = tri->max_x >> LGL_TILE_SHIFT;
+    uint32_t ty1 = tri->max_y >> LGL_TILE_SHIFT;
+
+    for (uint32_t ty = ty0; ty <= ty1; ty++) {
+        for (uint32_t tx = tx0; tx <= tx1; tx++) {
+            bool outside = false;
+
+            /* Only tiles that aren't fully inside the bounding box can be rejected */
+            if (tx0 != tx1 || ty0 != ty1) {
+                for (uint32_t i = 0; i < 3 && !outside; i++) {
+                    cx = (float)(tx << LGL_TILE_SHIFT) + ((tri->edge[i][0] > 0.0f) ? (LGL_TILE_SIZE - 0.5f) : 0.5f);
+                    cy = (float)(ty << LGL_TILE_SHIFT) + ((tri->edge[i][1] > 0.0f) ? (LGL_TILE_SIZE - 0.5f) : 0.5f);
+
+                    outside = (tri->edge[i][0] * cx + tri->edge[i][1] * cy + tri->edge[i][2]) < 0.0f;
+                }
+            }
+
+            if (outside)
+                continue;
+
+            if (__lgl_bin_add(&ctx->bins[ty * ctx->tiles_x + tx], idx))
+                error = -1;
+        }
+    }
+
+    return error;
+}
+
+static inline lgl_v4f __lgl_splat(float f)
+{
+    return (lgl_v4f) { f, f, f, f };
+}
+
+static inline lgl_v4f __lgl_select(lgl_v4i mask, lgl_v4f a, lgl_v4f b)
+{
+    return (lgl_v4f)(((lgl_v4i)a & mask) | ((lgl_v4i)b & ~mask));
+}
+
+static inline lgl_v4f __lgl_saturate(lgl_v4f v)
+{
+    v = __lgl_select(v < __lgl_splat(0.0f), __lgl_splat(0.0f), v);
+    return __lgl_select(v > __lgl_splat(1.0f), __lgl_splat(1.0f), v);
+}
+
+static inline lgl_v4f __lgl_eval(const float plane[3], lgl_v4f px, float py)
+{
+    return px * plane[0] + (plane[1] * py + plane[2]);
+}
+
+static inline bool __lgl_mask_empty(lgl_v4i mask)
+{
+    return !(mask[0] | mask[1] | mask[2] | mask[3]);
+}
+
+static inline lgl_v4i __lgl_depth_test(GLenum func, lgl_v4f z, lgl_v4f d)
+{
+    switch (func) {
+    case GL_NEVER:
+        return (lgl_v4i) { 0 };
+    case GL_LESS:
+        return z < d;
+    case GL_EQUAL:
+        return z == d;
+    case GL_LEQUAL:
+        return z <= d;
+    case GL_GREATER:
+        return z > d;
+    case GL_NOTEQUAL:
+        return z != d;
+    case GL_GEQUAL:
+        return z >= d;
+    }
+
+    return (lgl_v4i) { -1, -1, -1, -1 };
+}
+
+static inline int32_t __lgl_wrap(GLenum mode, float f, uint32_t size)
+{
+    int32_t i = (int32_t)f;
+
+    /* Truncation rounds up for negatives */
+    if (f < (float)i)
+        i--;
+
+    if (mode == GL_CLAMP_TO_EDGE)
+        return (i < 0) ? 0 : ((i >= (int32_t)size) ? (int32_t)size - 1 : i);
+
+    i %= (int32_t)size;
+
+    return (i < 0) ? i + size : i;
+}
+
+/*!
+ * @brief: Sample four texels with nearest filtering and modulate the color with them
+ *
+ * There is no gather instruction we can count on, so the fetch itself is scalar
+ */
+static inline void __lgl_texture(lgl_texture_t* tex, lgl_v4f s, lgl_v4f t, lgl_v4f clr[4])
+{
+    lgl_v4u texel;
+
+    s *= (float)tex->width;
+    t *= (float)tex->height;
+
+    for (uint32_t i = 0; i < 4; i++)
+        texel[i] = tex->texels[__lgl_wrap(tex->wrap_t, t[i], tex->height) * tex->width + __lgl_wrap(tex->wrap_s, s[i], tex->width)];
+
+    for (uint32_t c = 0; c < 4; c++)
+        clr[c] *= __builtin_convertvector((texel >> (c * 8)) & 0xff, lgl_v4f) * (1.0f / 255.0f);
+}
+
+static inline lgl_v4f __lgl_blend_factor(GLenum factor, lgl_v4f src, lgl_v4f src_a, lgl_v4f dst, lgl_v4f dst_a)
+{
+    switch (factor) {
+    case GL_ZERO:
+        return __lgl_splat(0.0f);
+    case GL_SRC_COLOR:
+        return src;
+    case GL_ONE_MINUS_SRC_COLOR:
+        return 1.0f - src;
+    case GL_SRC_ALPHA:
+        return src_a;
+    case GL_ONE_MINUS_SRC_ALPHA:
+        return 1.0f - src_a;
+    case GL_DST_ALPHA:
+        return dst_a;
+    case GL_ONE_MINUS_DST_ALPHA:
+        return 1.0f - dst_a;
+    case GL_DST_COLOR:
+        return dst;
+    case GL_ONE_MINUS_DST_COLOR:
+        return 1.0f - dst;
+    }
+
+    return __lgl_splat(1.0f);
+}
+
+/*!
+ * @brief: Rasterize all triangles binned in a single tile
+ *
+ * Returns the number of pixels that got written
+ */
+static uint64_t __lgl_raster_tile(lgl_context_t* ctx, uint32_t tile)
+{
+    uint64_t nr_pixels = 0;
+    uint32_t tx = tile % ctx->tiles_x;
+    uint32_t ty = tile / ctx->tiles_x;
+    int32_t x0 = tx << LGL_TILE_SHIFT;
+    int32_t y0 = ty << LGL_TILE_SHIFT;
+    int32_t x1 = x0 + LGL_TILE_SIZE - 1;
+    int32_t y1 = y0 + LGL_TILE_SIZE - 1;
+    const uint8_t shift[3] = { ctx->red_lshift, ctx->green_lshift, ctx->blue_lshift };
+    lgl_bin_t* bin = &ctx->bins[tile];
+
+    for (uint32_t b = 0; b < bin->count; b++) {
+        lgl_tri_t* tri = &ctx->tris[bin->tris[b]];
+        lgl_raster_state_t* state = &ctx->states[tri->state];
+        const bool depth_test = (state->flags & LGL_RS_DEPTH_TEST) == LGL_RS_DEPTH_TEST;
+        const bool depth_write = depth_test && (state->flags & LGL_RS_DEPTH_WRITE) == LGL_RS_DEPTH_WRITE;
+        const lgl_v4i tl[3] = {
+            (lgl_v4i) { 0 } - (int32_t)(tri->top_left & 1),
+            (lgl_v4i) { 0 } - (int32_t)((tri->top_left >> 1) & 1),
+            (lgl_v4i) { 0 } - (int32_t)((tri->top_left >> 2) & 1),
+        };
+        /* Vectors start at multiples of four, so rows stay aligned with the buffers */
+        int32_t rx0 = (tri->min_x > x0 ? tri->min_x : x0) & ~3;
+        int32_t rx1 = tri->max_x < x1 ? tri->max_x : x1;
+        int32_t ry0 = tri->min_y > y0 ? tri->min_y : y0;
+        int32_t ry1 = tri->max_y < y1 ? tri->max_y : y1;
+
+        for (int32_t y = ry0; y <= ry1; y++) {
+            const float py = y + 0.5f;
+            uint32_t* color_row = &ctx->color[y * ctx->stride];
+            float* depth_row = &ctx->depth[y * ctx->stride];
+
+            for (int32_t x = rx0; x <= rx1; x += 4) {
+                lgl_v4i xi = (lgl_v4i) { x, x + 1, x + 2, x + 3 };
+                lgl_v4f px = __builtin_convertvector(xi, lgl_v4f) + 0.5f;
+                lgl_v4i mask = (xi >= tri->min_x) & (xi <= tri->max_x);
+                lgl_v4f z, d, w, clr[4];
+                lgl_v4u dst, out;
+
+                for (uint32_t i = 0; i < 3; i++) {
+                    lgl_v4f e = __lgl_eval(tri->edge[i], px, py);
+
+                    mask &= (e > 0.0f) | ((e == 0.0f) & tl[i]);
+                }
+
+                if (__lgl_mask_empty(mask))
+                    continue;
+
+                z = __lgl_eval(tri->plane[LGL_PLANE_Z], px, py);
+
+                if (depth_test) {
+                    memcpy(&d, &depth_row[x], sizeof(d));
+
+                    mask &= __lgl_depth_test(state->depth_func, z, d);
+
+                    if (__lgl_mask_empty(mask))
+                        continue;
+
+                    if (depth_write) {
+                        d = __lgl_select(mask, z, d);
+                        memcpy(&depth_row[x], &d, sizeof(d));
+                    }
+                }
+
+                /* Perspective correct attributes */
+                w = 1.0f / __lgl_eval(tri->plane[LGL_PLANE_INV_W], px, py);
+
+                for (uint32_t c = 0; c < 4; c++)
+                    clr[c] = __lgl_eval(tri->plane[LGL_PLANE_R + c], px, py) * w;
+
+                if (state->flags & LGL_RS_TEXTURE)
+                    __lgl_texture(state->texture, __lgl_eval(tri->plane[LGL_PLANE_S], px, py) * w, __lgl_eval(tri->plane[LGL_PLANE_T], px, py) * w, clr);
+
+                for (uint32_t c = 0; c < 4; c++)
+                    clr[c] = __lgl_saturate(clr[c]);
+
+                memcpy(&dst, &color_row[x], sizeof(dst));
+
+                if (state->flags & LGL_RS_BLEND) {
+                    /* The framebuffer has no alpha channel, so destination alpha is always one */
+                    const lgl_v4f dst_a = __lgl_splat(1.0f);
+
+                    for (uint32_t c = 0; c < 3; c++) {
+                        lgl_v4f dc = __builtin_convertvector((dst >> shift[c]) & 0xff, lgl_v4f) * (1.0f / 255.0f);
+                        lgl_v4f sf = __lgl_blend_factor(state->blend_src, clr[c], clr[3], dc, dst_a);
+                        lgl_v4f df = __lgl_blend_factor(state->blend_dst, clr[c], clr[3], dc, dst_a);
+
+                        clr[c] = __lgl_saturate(clr[c] * sf + dc * df);
+                    }
+                }
+
+                out = (lgl_v4u) { 0 };
+
+                for (uint32_t c = 0; c < 3; c++)
+                    out |= __builtin_convertvector(clr[c] * 255.0f + 0.5f, lgl_v4u) << shift[c];
+
+                out = (out & (lgl_v4u)mask) | (dst & ~(lgl_v4u)mask);
+                memcpy(&color_row[x], &out, sizeof(out));
+
+                nr_pixels -= mask[0] + mask[1] + mask[2] + mask[3];
+            }
+        }
+    }
+
+    bin->count = 0;
+    return nr_pixels;
+}
+
+/*!
+ * @brief: Tile worker
+ *
+ * Grabs tiles until there are none left. Any number of these can run at the same time
+ */
+static void __lgl_raster_worker(void* arg)
+{
+    uint32_t tile;
+    uint64_t nr_pixels = 0;
+    lgl_context_t* ctx = arg;
+    const uint32_t nr_tiles = ctx->tiles_x * ctx->tiles_y;
+
+    while ((tile = __atomic_fetch_add(&ctx->next_tile, 1, __ATOMIC_ACQ_REL)) < nr_tiles) {
+        if (ctx->bins[tile].count)
+            nr_pixels += __lgl_raster_tile(ctx, tile);
+
+        __atomic_fetch_add(&ctx->tiles_done, 1, __ATOMIC_RELEASE);
+    }
+
+    __atomic_fetch_add(&ctx->stats.nr_pixels, nr_pixels, __ATOMIC_RELAXED);
+}
+
+/*!
+ * @brief: Rasterize the current batch
+ */
+void lgl_flush(lgl_context_t* ctx)
+{
+    const uint32_t nr_tiles = ctx->tiles_x * ctx->tiles_y;
+
+    if (!ctx->nr_tris)
+        return;
+
+    ctx->next_tile = 0;
+    ctx->tiles_done = 0;
+
+    if (ctx->thread_hook && ctx->nr_workers)
+        ctx->thread_hook(__lgl_raster_worker, ctx, ctx->nr_workers);
+
+    /* The caller always helps out */
+    __lgl_raster_worker(ctx);
+
+    /* Wait for the workers to finish up their last tiles */
+    while (__atomic_load_n(&ctx->tiles_done, __ATOMIC_ACQUIRE) < nr_tiles)
+        __builtin_ia32_pause();
+
+    ctx->nr_tris = 0;
+    ctx->nr_states = 0;
+    ctx->stats.nr_flushes++;
+}
+
+void lgl_clear_buffers(lgl_context_t* ctx, GLbitfield mask)
+{
+    const uint32_t nr_pixels = ctx->stride * ctx->height;
+
+    if (mask & GL_COLOR_BUFFER_BIT) {
+        const uint32_t clr = lgl_pack_color(ctx, ctx->clear_clr[0], ctx->clear_clr[1], ctx->clear_clr[2]);
+
+        for (uint32_t i = 0; i < nr_pixels; i++)
+            ctx->color[i] = clr;
+    }
+
+    if (mask & GL_DEPTH_BUFFER_BIT) {
+        for (uint32_t i = 0; i < nr_pixels; i++)
+            ctx->depth[i] = ctx->clear_depth;
+    }
+}
@@ -64,6 +64,13 @@ struct light_option l_options[] = {
         false,
         { 0 },
     },
+    {
+        "Dump boot profile",
+        "bootprof",
+        LOPTION_TYPE_BOOL,
+        false,
+        { 0 },
+    },
     {
         "Test",
         "placeholder",
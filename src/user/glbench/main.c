@@ -0,0 +1,202 @@
+#include <lightos/proc/process.h>
+#include <lightui/window.h>
+#include <opengl/OpenGL/gl.h>
+#include <opengl/OpenGL/lgl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Small benchmark for the software rasterizer
+ *
+ * Measures two things:
+ *  - Triangle throughput: lots of small, untextured triangles. This is mostly setup and binning
+ *  - Fill rate: fullscreen, textured and blended quads. This is mostly the per-pixel work
+ */
+
+#define GLBENCH_WIDTH 512
+#define GLBENCH_HEIGHT 512
+
+/* Small triangles: a grid of GRID x GRID quads per frame */
+#define GLBENCH_GRID 64
+#define GLBENCH_TRI_FRAMES 30
+
+/* Fill rate: this many fullscreen layers per frame */
+#define GLBENCH_FILL_LAYERS 8
+#define GLBENCH_FILL_FRAMES 30
+
+#define GLBENCH_TEX_SIZE 64
+
+#define EXIT_ERROR(str) (printf("[ERROR]: %s\n", str) - 1)
+
+static float grid_vertices[GLBENCH_GRID * GLBENCH_GRID * 6 * 2];
+static uint8_t grid_colors[GLBENCH_GRID * GLBENCH_GRID * 6 * 4];
+static uint32_t texels[GLBENCH_TEX_SIZE * GLBENCH_TEX_SIZE];
+
+static void build_grid(void)
+{
+    float* v = grid_vertices;
+    uint8_t* c = grid_colors;
+    const float step = 2.0f / GLBENCH_GRID;
+
+    for (uint32_t y = 0; y < GLBENCH_GRID; y++) {
+        for (uint32_t x = 0; x < GLBENCH_GRID; x++) {
+            float x0 = -1.0f + x * step;
+            float y0 = -1.0f + y * step;
+            float x1 = x0 + step;
+            float y1 = y0 + step;
+            const float quad[12] = { x0, y0, x1, y0, x0, y1, x0, y1, x1, y0, x1, y1 };
+
+            for (uint32_t i = 0; i < 12; i++)
+                *(v++) = quad[i];
+
+            for (uint32_t i = 0; i < 6; i++) {
+                *(c++) = (x * 4) & 0xff;
+                *(c++) = (y * 4) & 0xff;
+                *(c++) = ((x ^ y) * 8) & 0xff;
+                *(c++) = 0xff;
+            }
+        }
+    }
+}
+
+static void build_texture(void)
+{
+    for (uint32_t y = 0; y < GLBENCH_TEX_SIZE; y++)
+        for (uint32_t x = 0; x < GLBENCH_TEX_SIZE; x++)
+            texels[y * GLBENCH_TEX_SIZE + x] = (((x >> 3) ^ (y >> 3)) & 1) ? 0x80ffffff : 0x80404040;
+}
+
+/*!
+ * @brief: Time @nr_frames frames of the small triangle grid
+ */
+static void bench_triangles(lgl_context_t* ctx)
+{
+    size_t start, elapsed;
+    uint64_t nr_tris;
+
+    glDisable(GL_BLEND);
+    glDisable(GL_TEXTURE_2D);
+    glEnable(GL_DEPTH_TEST);
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+
+    glVertexPointer(2, GL_FLOAT, 0, grid_vertices);
+    glColorPointer(4, GL_UNSIGNED_BYTE, 0, grid_colors);
+
+    start = get_process_time();
+
+    for (uint32_t i = 0; i < GLBENCH_TRI_FRAMES; i++) {
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        glLoadIdentity();
+        glRotatef(i * 3.0f, 0.0f, 0.0f, 1.0f);
+
+        glDrawArrays(GL_TRIANGLES, 0, GLBENCH_GRID * GLBENCH_GRID * 6);
+
+        lglSwapBuffers(ctx);
+    }
+
+    elapsed = get_process_time() - start;
+    nr_tris = (uint64_t)GLBENCH_TRI_FRAMES * GLBENCH_GRID * GLBENCH_GRID * 2;
+
+    if (!elapsed)
+        elapsed = 1;
+
+    printf("glbench: %lld triangles in %lld ms (%lld triangles/s)\n", nr_tris, elapsed, (nr_tris * 1000) / elapsed);
+}
+
+/*!
+ * @brief: Time @nr_frames frames of fullscreen blended, textured layers
+ */
+static void bench_fill(lgl_context_t* ctx)
+{
+    GLuint tex;
+    size_t start, elapsed;
+    uint64_t nr_pixels;
+    lgl_stats_t before, after;
+    const float quad[] = { -1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f };
+    const float uv[] = { 0.0f, 0.0f, 4.0f, 0.0f, 0.0f, 4.0f, 4.0f, 4.0f };
+
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, GLBENCH_TEX_SIZE, GLBENCH_TEX_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_TEXTURE_2D);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    glDisableClientState(GL_COLOR_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+
+    glVertexPointer(2, GL_FLOAT, 0, quad);
+    glTexCoordPointer(2, GL_FLOAT, 0, uv);
+
+    lglGetStats(ctx, &before);
+    start = get_process_time();
+
+    for (uint32_t i = 0; i < GLBENCH_FILL_FRAMES; i++) {
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        for (uint32_t j = 0; j < GLBENCH_FILL_LAYERS; j++) {
+            glLoadIdentity();
+            glRotatef((i + j) * 5.0f, 0.0f, 0.0f, 1.0f);
+            glScalef(1.5f, 1.5f, 1.0f);
+
+            glColor4f(1.0f, (j & 1) ? 1.0f : 0.5f, (j & 2) ? 1.0f : 0.5f, 1.0f);
+
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        }
+
+        lglSwapBuffers(ctx);
+    }
+
+    elapsed = get_process_time() - start;
+    lglGetStats(ctx, &after);
+
+    nr_pixels = after.nr_pixels - before.nr_pixels;
+
+    if (!elapsed)
+        elapsed = 1;
+
+    printf("glbench: %lld pixels in %lld ms (%lld Mpixels/s)\n", nr_pixels, elapsed, (nr_pixels / 1000) / elapsed);
+
+    glDeleteTextures(1, &tex);
+}
+
+int main()
+{
+    lightui_window_t* wnd;
+    lgl_context_t* ctx;
+
+    wnd = lightui_request_window("glbench", GLBENCH_WIDTH, GLBENCH_HEIGHT, 0);
+
+    if (!wnd)
+        return EXIT_ERROR("Failed to create window");
+
+    /* Render inside the lightui borders */
+    ctx = lglCreateContext(&wnd->gfxwnd, wnd->lui_border_width, wnd->lui_top_border_height, wnd->lui_width, wnd->lui_height);
+
+    if (!ctx) {
+        lightui_close_window(wnd);
+        return EXIT_ERROR("Failed to create GL context");
+    }
+
+    lglMakeCurrent(ctx);
+
+    printf("glbench: %s (%s)\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+    build_grid();
+    build_texture();
+
+    glClearColor(0.1f, 0.1f, 0.15f, 1.0f);
+
+    bench_triangles(ctx);
+    bench_fill(ctx);
+
+    lglDestroyContext(ctx);
+    lightui_close_window(wnd);
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <lightos/driver/drv.h>
+#include <lightos/driver/loader.h>
+#include <lightos/handle.h>
+#include <lightos/proc/cmdline.h>
+#include <lightos/proc/ipc/pipe/pipe.h>
+#include <lightos/proc/process.h>
+#include <lightos/time/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Launch benchmark for dynamically linked apps
+ *
+ * We link against lightui and libgfx like any gui app would and launch a bunch of copies of
+ * ourselves. We measure how long it takes for all of them to make it into main and how many
+ * physical pages they take up while they're alive. Every copy creates a pipe to tell us it's up
+ * and sticks around until our 'done' pipe shows up.
+ */
+
+#define LB_APP_PATH "Root/Apps/ldbench"
+#define LB_PIPE_PATH "Runtime/Upi/"
+#define LB_DONE_PIPE "lb_done"
+
+#define LB_NR_INSTANCES 20
+#define LB_POLL_US 1000
+/* Give up on an instance after ~10 seconds */
+#define LB_POLL_TRIES 10000
+
+static bool lb_pipe_exists(const char* name)
+{
+    char path[64];
+    lightos_pipe_t pipe;
+
+    snprintf(path, sizeof(path), LB_PIPE_PATH "%s", name);
+
+    if (lightos_pipe_connect(&pipe, path))
+        return false;
+
+    lightos_pipe_disconnect(&pipe);
+    return true;
+}
+
+/*!
+ * @brief: Wait for the pipe of instance @idx to be there (@up) or to be gone (!@up)
+ */
+static int lb_await_instance(uint32_t idx, bool up)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "lb_up_%d", idx);
+
+    for (uint32_t i = 0; i < LB_POLL_TRIES; i++) {
+        if (lb_pipe_exists(name) == up)
+            return 0;
+
+        usleep(LB_POLL_US);
+    }
+
+    return -1;
+}
+
+static int lb_get_cache_info(HANDLE loader, dynldr_cache_info_t* info)
+{
+    return driver_send_msg(loader, DYN_LDR_GET_CACHE_INFO, 0, info, sizeof(*info)) ? 0 : -1;
+}
+
+/*!
+ * @brief: Instance side. Tell the parent we're up and wait for it to finish measuring
+ */
+static int lb_instance(const char* idx)
+{
+    char name[32];
+    lightos_pipe_t up;
+
+    snprintf(name, sizeof(name), "lb_up_%s", idx);
+
+    if (init_lightos_pipe(&up, name, LIGHTOS_UPIPE_FLAGS_GLOBAL | LIGHTOS_UPIPE_FLAGS_NORING, 1, 0))
+        return -1;
+
+    while (!lb_pipe_exists(LB_DONE_PIPE))
+        usleep(LB_POLL_US * 10);
+
+    destroy_lightos_pipe(&up);
+    return 0;
+}
+
+static int lb_run(HANDLE loader)
+{
+    int error;
+    char cmd[64];
+    uint32_t nr_launched;
+    uint64_t start, launch_ms;
+    lightos_pipe_t done;
+    dynldr_cache_info_t before, after;
+
+    if (lb_get_cache_info(loader, &before))
+        return -1;
+
+    error = 0;
+    start = lightos_get_uptime_ms();
+
+    for (nr_launched = 0; nr_launched < LB_NR_INSTANCES; nr_launched++) {
+        snprintf(cmd, sizeof(cmd), LB_APP_PATH " instance %d", nr_launched);
+
+        if (!create_process(cmd, NULL, NULL, 0, NULL))
+            break;
+    }
+
+    for (uint32_t i = 0; i < nr_launched && !error; i++)
+        error = lb_await_instance(i, true);
+
+    launch_ms = lightos_get_uptime_ms() - start;
+
+    if (!error && nr_launched == LB_NR_INSTANCES && !lb_get_cache_info(loader, &after)) {
+        printf("ldbench: %d instances up in %lld ms (%lld us each)\n", nr_launched, launch_ms, (launch_ms * 1000) / nr_launched);
+        printf("ldbench: %lld KiB resident per instance\n", ((after.nr_used_pages - before.nr_used_pages) * 4) / nr_launched);
+        printf("ldbench: library cache: %d images, %lld shared pages, %d hits\n", after.nr_images, after.nr_shared_pages, after.nr_hits - before.nr_hits);
+    } else
+        error = -1;
+
+    /* Let everyone go, even if something went wrong */
+    if (init_lightos_pipe(&done, LB_DONE_PIPE, LIGHTOS_UPIPE_FLAGS_GLOBAL | LIGHTOS_UPIPE_FLAGS_NORING, LB_NR_INSTANCES, 0))
+        return -1;
+
+    for (uint32_t i = 0; i < nr_launched; i++)
+        (void)lb_await_instance(i, false);
+
+    destroy_lightos_pipe(&done);
+    return error;
+}
+
+int main()
+{
+    int error;
+    HANDLE loader;
+    CMDLINE cmdline = { 0 };
+
+    if (cmdline_get(&cmdline))
+        return -1;
+
+    if (cmdline.argc >= 3 && strcmp(cmdline.argv[1], "instance") == 0)
+        return lb_instance(cmdline.argv[2]);
+
+    if (!open_driver(DYN_LDR_URL, HNDL_FLAG_RW, NULL, &loader))
+        return -1;
+
+    error = lb_run(loader);
+
+    close_handle(loader);
+
+    if (error)
+        printf("ldbench: failed\n");
+
+    return error;
+}
@@ -0,0 +1,195 @@
+#include <lightos/proc/process.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Stress test and benchmark for the userspace heap
+ *
+ * Every phase touches the memory it gets, so a broken allocator shows up as a mismatch
+ * instead of just a fast number
+ */
+
+#define MB_NR_SLOTS 4096
+#define MB_NR_OPS 500000
+#define MB_LARGE_SIZE (256 * 1024)
+#define MB_NR_LARGE_OPS 2000
+
+static void* slots[MB_NR_SLOTS];
+static size_t slot_sizes[MB_NR_SLOTS];
+static uint32_t rng_state = 0x12345678;
+
+static inline uint32_t mb_rand(void)
+{
+    /* xorshift32 */
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static inline void mb_fill(void* ptr, size_t size, uint32_t seed)
+{
+    uint8_t* c = ptr;
+
+    /* Touch the first and last byte of every 64 byte stride */
+    for (size_t i = 0; i < size; i += 64)
+        c[i] = (uint8_t)(seed + i);
+
+    c[size - 1] = (uint8_t)seed;
+}
+
+static inline bool mb_check(void* ptr, size_t size, uint32_t seed)
+{
+    uint8_t* c = ptr;
+
+    for (size_t i = 0; i < size - 1; i += 64)
+        if (c[i] != (uint8_t)(seed + i))
+            return false;
+
+    return c[size - 1] == (uint8_t)seed;
+}
+
+static void mb_report(const char* name, uint64_t nr_ops, size_t start)
+{
+    size_t elapsed = get_process_time() - start;
+
+    if (!elapsed)
+        elapsed = 1;
+
+    printf("mallocbench: %s: %lld ops in %lld ms (%lld ops/s)\n", name, nr_ops, elapsed, (nr_ops * 1000) / elapsed);
+}
+
+/*!
+ * @brief: Allocate and immediately free the same small size
+ *
+ * This is the best case for the allocator: the block should come straight back
+ */
+static int mb_pingpong(void)
+{
+    void* p;
+    size_t start = get_process_time();
+
+    for (uint32_t i = 0; i < MB_NR_OPS; i++) {
+        p = malloc(64);
+
+        if (!p)
+            return -1;
+
+        *(volatile uint8_t*)p = (uint8_t)i;
+
+        free(p);
+    }
+
+    mb_report("pingpong (64 bytes)", MB_NR_OPS * 2, start);
+    return 0;
+}
+
+/*!
+ * @brief: Random mix of allocations, frees and reallocs over a working set of slots
+ */
+static int mb_random(void)
+{
+    uint32_t idx;
+    size_t size;
+    void* p;
+    size_t start = get_process_time();
+
+    for (uint32_t i = 0; i < MB_NR_OPS; i++) {
+        idx = mb_rand() % MB_NR_SLOTS;
+
+        if (!slots[idx]) {
+            /* Mostly small, every now and then something bigger */
+            size = (mb_rand() & 15) ? (mb_rand() % 512) + 1 : (mb_rand() % 16384) + 1;
+            slots[idx] = malloc(size);
+
+            if (!slots[idx])
+                return -1;
+
+            slot_sizes[idx] = size;
+            mb_fill(slots[idx], size, idx);
+            continue;
+        }
+
+        if (!mb_check(slots[idx], slot_sizes[idx], idx)) {
+            printf("mallocbench: corruption in slot %d\n", idx);
+            return -1;
+        }
+
+        /* A quarter of the live slots get resized instead of freed */
+        if ((mb_rand() & 3) == 0) {
+            size = (mb_rand() % 1024) + 1;
+            p = realloc(slots[idx], size);
+
+            if (!p)
+                return -1;
+
+            if (size < slot_sizes[idx])
+                slot_sizes[idx] = size;
+
+            if (!mb_check(p, slot_sizes[idx], idx)) {
+                printf("mallocbench: realloc lost the data of slot %d\n", idx);
+                return -1;
+            }
+
+            slots[idx] = p;
+            slot_sizes[idx] = size;
+            mb_fill(p, size, idx);
+            continue;
+        }
+
+        free(slots[idx]);
+        slots[idx] = nullptr;
+    }
+
+    mb_report("random (1-16K, 25% realloc)", MB_NR_OPS, start);
+
+    for (uint32_t i = 0; i < MB_NR_SLOTS; i++) {
+        free(slots[i]);
+        slots[i] = nullptr;
+    }
+
+    return 0;
+}
+
+/*!
+ * @brief: Allocations that get their own span from the kernel
+ */
+static int mb_large(void)
+{
+    void* p;
+    size_t start = get_process_time();
+
+    for (uint32_t i = 0; i < MB_NR_LARGE_OPS; i++) {
+        p = malloc(MB_LARGE_SIZE);
+
+        if (!p)
+            return -1;
+
+        mb_fill(p, MB_LARGE_SIZE, i);
+
+        free(p);
+    }
+
+    mb_report("large (256K spans)", MB_NR_LARGE_OPS * 2, start);
+    return 0;
+}
+
+int main()
+{
+    if (mb_pingpong())
+        goto fail;
+
+    if (mb_random())
+        goto fail;
+
+    if (mb_large())
+        goto fail;
+
+    printf("mallocbench: all passed\n");
+    return 0;
+
+fail:
+    printf("mallocbench: failed\n");
+    return -1;
+}
@@ -0,0 +1,314 @@
+#include <lightos/proc/cmdline.h>
+#include <lightos/proc/ipc/pipe/pipe.h>
+#include <lightos/proc/process.h>
+#include <lightos/time/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Throughput and latency benchmark for userpipes
+ *
+ * We spawn a copy of ourselves as the consumer and run every message size over two kinds of pipes:
+ * one where the upi driver copies every transaction ('driver', the old way) and one that's backed
+ * by a shared ring ('ring'). The consumer answers over a second pipe whenever a message asks it to.
+ *
+ * throughput: Send a batch of messages and only ask for an answer on the last one
+ * latency: Send a single message and wait for the answer before sending the next one
+ */
+
+#define PB_APP_PATH "Root/Apps/pipebench"
+#define PB_PIPE_PATH "Runtime/Upi/"
+
+#define PB_MAX_MSG_SIZE (1024 * 1024)
+/* Small enough that the biggest messages have to go in fragments */
+#define PB_RING_SIZE (256 * 1024)
+#define PB_CONNECT_TRIES 5000
+
+/* The consumer answers this message */
+#define PB_FLAG_ACK 0x00000001
+/* The consumer is done after this message */
+#define PB_FLAG_QUIT 0x00000002
+
+typedef struct pb_hdr {
+    uint32_t flags;
+    uint32_t seq;
+} pb_hdr_t;
+
+typedef struct pb_mode {
+    const char* name;
+    uint32_t pipe_flags;
+} pb_mode_t;
+
+typedef struct pb_run {
+    size_t size;
+    uint32_t nr_throughput;
+    uint32_t nr_latency;
+} pb_run_t;
+
+static const pb_mode_t pb_modes[] = {
+    { "driver", LIGHTOS_UPIPE_FLAGS_NORING },
+    { "ring", 0 },
+};
+
+/* NOTE: Consumers of driver pipes poll every millisecond, so don't go too crazy on the counts */
+static const pb_run_t pb_runs[] = {
+    { 64, 20000, 2000 },
+    { 4 * 1024, 10000, 1000 },
+    { 1024 * 1024, 100, 50 },
+};
+
+static uint8_t* pb_buffer;
+
+static void pb_pipe_name(char* buffer, size_t bsize, const pb_mode_t* mode, bool ack)
+{
+    snprintf(buffer, bsize, "pb_%s%s", mode->name, ack ? "_ack" : "");
+}
+
+static const pb_mode_t* pb_find_mode(const char* name)
+{
+    for (uint32_t i = 0; i < sizeof(pb_modes) / sizeof(pb_modes[0]); i++)
+        if (strcmp(pb_modes[i].name, name) == 0)
+            return &pb_modes[i];
+
+    return NULL;
+}
+
+/*!
+ * @brief: Connect to the pipe @name, which might not exist yet
+ */
+static int pb_connect(lightos_pipe_t* pipe, const pb_mode_t* mode, bool ack)
+{
+    char name[32];
+    char path[64];
+
+    pb_pipe_name(name, sizeof(name), mode, ack);
+    snprintf(path, sizeof(path), PB_PIPE_PATH "%s", name);
+
+    for (uint32_t i = 0; i < PB_CONNECT_TRIES; i++) {
+        if (!lightos_pipe_connect(pipe, path))
+            return 0;
+
+        usleep(1000);
+    }
+
+    return -1;
+}
+
+static int pb_create(lightos_pipe_t* pipe, const pb_mode_t* mode, bool ack)
+{
+    char name[32];
+
+    pb_pipe_name(name, sizeof(name), mode, ack);
+
+    return init_lightos_pipe_ex(pipe, name, LIGHTOS_UPIPE_FLAGS_GLOBAL | mode->pipe_flags, 1, 0, PB_RING_SIZE);
+}
+
+/*!
+ * @brief: Send @size bytes of pb_buffer
+ *
+ * The driver refuses transactions when its buffer is full, where a ring makes us sleep instead.
+ * Keep trying for the driver, so both modes send the same thing
+ */
+static int pb_send(lightos_pipe_t* pipe, uint32_t flags, uint32_t seq, size_t size)
+{
+    pb_hdr_t* hdr = (pb_hdr_t*)pb_buffer;
+    lightos_pipe_transaction_t transact;
+
+    hdr->flags = flags;
+    hdr->seq = seq;
+
+    while (lightos_pipe_send_data(pipe, &transact, pb_buffer, size)) {
+        if (pipe->ring)
+            return -1;
+
+        usleep(100);
+    }
+
+    return 0;
+}
+
+/*!
+ * @brief: Wait for the answer to message @seq
+ */
+static int pb_await_ack(lightos_pipe_t* ack, uint32_t seq)
+{
+    pb_hdr_t hdr;
+    lightos_pipe_transaction_t transact;
+
+    if (lightos_pipe_await_transaction(ack, &transact))
+        return -1;
+
+    if (lightos_pipe_accept(ack, &hdr, sizeof(hdr)))
+        return -1;
+
+    return (hdr.seq == seq) ? 0 : -1;
+}
+
+static void pb_report(const pb_mode_t* mode, const pb_run_t* run, uint64_t tp_ms, uint64_t lat_ms)
+{
+    uint64_t kib_per_s;
+    uint64_t rtt_us;
+
+    if (!tp_ms)
+        tp_ms = 1;
+
+    kib_per_s = ((uint64_t)run->nr_throughput * run->size * 1000) / (tp_ms * 1024);
+    rtt_us = (lat_ms * 1000) / run->nr_latency;
+
+    printf("pipebench: %s: %lld B: %lld msgs/s, %lld KiB/s, %lld us round trip\n", mode->name, (uint64_t)run->size,
+        ((uint64_t)run->nr_throughput * 1000) / tp_ms, kib_per_s, rtt_us);
+}
+
+static int pb_do_run(lightos_pipe_t* tx, lightos_pipe_t* ack, const pb_mode_t* mode, const pb_run_t* run)
+{
+    uint32_t seq = 0;
+    uint64_t start, tp_ms, lat_ms;
+
+    start = lightos_get_uptime_ms();
+
+    for (uint32_t i = 0; i < run->nr_throughput; i++, seq++)
+        if (pb_send(tx, (i == run->nr_throughput - 1) ? PB_FLAG_ACK : 0, seq, run->size))
+            return -1;
+
+    if (pb_await_ack(ack, seq - 1))
+        return -1;
+
+    tp_ms = lightos_get_uptime_ms() - start;
+    start = lightos_get_uptime_ms();
+
+    for (uint32_t i = 0; i < run->nr_latency; i++, seq++) {
+        if (pb_send(tx, PB_FLAG_ACK, seq, run->size))
+            return -1;
+
+        if (pb_await_ack(ack, seq))
+            return -1;
+    }
+
+    lat_ms = lightos_get_uptime_ms() - start;
+
+    pb_report(mode, run, tp_ms, lat_ms);
+    return 0;
+}
+
+static int pb_do_mode(const pb_mode_t* mode)
+{
+    int error;
+    char cmd[64];
+    lightos_pipe_t tx;
+    lightos_pipe_t ack;
+
+    if (pb_create(&tx, mode, false))
+        return -1;
+
+    snprintf(cmd, sizeof(cmd), PB_APP_PATH " child %s", mode->name);
+
+    error = -1;
+
+    if (!create_process(cmd, NULL, NULL, 0, NULL))
+        goto destroy_and_exit;
+
+    /* The consumer connects to us before it creates the ack pipe, so it won't miss anything */
+    if (pb_connect(&ack, mode, true))
+        goto destroy_and_exit;
+
+    for (uint32_t i = 0; i < sizeof(pb_runs) / sizeof(pb_runs[0]); i++) {
+        error = pb_do_run(&tx, &ack, mode, &pb_runs[i]);
+
+        if (error)
+            break;
+    }
+
+    /* Tell the consumer to stop and wait for it to do so */
+    if (!pb_send(&tx, PB_FLAG_ACK | PB_FLAG_QUIT, 0xffffffff, sizeof(pb_hdr_t)))
+        (void)pb_await_ack(&ack, 0xffffffff);
+
+    lightos_pipe_disconnect(&ack);
+
+destroy_and_exit:
+    destroy_lightos_pipe(&tx);
+    return error;
+}
+
+/*!
+ * @brief: Consumer side. Accepts everything and answers when asked to
+ */
+static int pb_child(const char* mode_name)
+{
+    int error;
+    pb_hdr_t* hdr = (pb_hdr_t*)pb_buffer;
+    const pb_mode_t* mode;
+    lightos_pipe_t rx;
+    lightos_pipe_t ack;
+    lightos_pipe_transaction_t transact;
+
+    mode = pb_find_mode(mode_name);
+
+    if (!mode)
+        return -1;
+
+    if (pb_connect(&rx, mode, false))
+        return -1;
+
+    error = pb_create(&ack, mode, true);
+
+    if (error)
+        goto disconnect_and_exit;
+
+    do {
+        error = lightos_pipe_await_transaction(&rx, &transact);
+
+        if (error)
+            break;
+
+        error = lightos_pipe_accept(&rx, pb_buffer, PB_MAX_MSG_SIZE);
+
+        if (error)
+            break;
+
+        if ((hdr->flags & PB_FLAG_ACK) == PB_FLAG_ACK)
+            error = lightos_pipe_send_data(&ack, &transact, hdr, sizeof(*hdr));
+
+    } while (!error && (hdr->flags & PB_FLAG_QUIT) != PB_FLAG_QUIT);
+
+    /* Let the other side pick up the final answer before the pipe goes */
+    lightos_pipe_await_empty(&ack);
+
+    destroy_lightos_pipe(&ack);
+
+disconnect_and_exit:
+    lightos_pipe_disconnect(&rx);
+    return error;
+}
+
+int main()
+{
+    int error;
+    CMDLINE cmdline = { 0 };
+
+    pb_buffer = malloc(PB_MAX_MSG_SIZE);
+
+    if (!pb_buffer)
+        return -1;
+
+    memset(pb_buffer, 0xab, PB_MAX_MSG_SIZE);
+
+    if (cmdline_get(&cmdline))
+        return -1;
+
+    if (cmdline.argc >= 3 && strcmp(cmdline.argv[1], "child") == 0)
+        return pb_child(cmdline.argv[2]);
+
+    for (uint32_t i = 0; i < sizeof(pb_modes) / sizeof(pb_modes[0]); i++) {
+        error = pb_do_mode(&pb_modes[i]);
+
+        if (error) {
+            printf("pipebench: %s: failed\n", pb_modes[i].name);
+            return error;
+        }
+    }
+
+    printf("pipebench: done\n");
+    return 0;
+}